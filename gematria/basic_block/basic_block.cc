@@ -15,6 +15,8 @@
 #include "gematria/basic_block/basic_block.h"
 
 #include <cassert>
+#include <cstdint>
+#include <cstring>
 #include <ios>
 #include <ostream>
 #include <sstream>
@@ -413,6 +415,20 @@ std::string Instruction::ToString() const {
   return msg;
 }
 
+void Instruction::Clear() {
+  mnemonic.clear();
+  llvm_mnemonic.clear();
+  mnemonic_symbol = kInvalidSymbol;
+  prefixes.clear();
+  input_operands.clear();
+  implicit_input_operands.clear();
+  output_operands.clear();
+  implicit_output_operands.clear();
+  address = 0;
+  size = 0;
+  is_valid = true;
+}
+
 void Instruction::AddTokensToList(std::vector<std::string>& tokens) const {
   for (const std::string& prefix : prefixes) tokens.push_back(prefix);
   tokens.push_back(mnemonic);
@@ -471,4 +487,163 @@ std::ostream& operator<<(std::ostream& os, const BasicBlock& block) {
   return os;
 }
 
+namespace {
+
+// Computes the 64-bit FNV-1a hash of a sequence of values. Integers are added
+// in a fixed byte order, and strings and lists are prefixed with their length,
+// so that the result does not depend on the platform and different sequences
+// of values do not produce the same stream of bytes.
+class FingerprintBuilder {
+ public:
+  void AddBytes(const void* data, size_t size) {
+    const auto* const bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i) {
+      hash_ ^= bytes[i];
+      hash_ *= kFnvPrime;
+    }
+  }
+  void AddInt(uint64_t value) {
+    unsigned char bytes[sizeof(value)];
+    for (int i = 0; i < sizeof(value); ++i) {
+      bytes[i] = static_cast<unsigned char>(value >> (8 * i));
+    }
+    AddBytes(bytes, sizeof(bytes));
+  }
+  void AddDouble(double value) {
+    uint64_t bits;
+    static_assert(sizeof(bits) == sizeof(value));
+    std::memcpy(&bits, &value, sizeof(bits));
+    AddInt(bits);
+  }
+  void AddString(std::string_view str) {
+    AddInt(str.size());
+    AddBytes(str.data(), str.size());
+  }
+  void AddStrings(const std::vector<std::string>& strings) {
+    AddInt(strings.size());
+    for (const std::string& str : strings) AddString(str);
+  }
+  void AddInts(const std::vector<int>& values) {
+    AddInt(values.size());
+    for (const int value : values) AddInt(static_cast<uint64_t>(value));
+  }
+
+  void AddAddress(const AddressTuple& address) {
+    AddString(address.base_register);
+    if (!address.base_register.empty()) {
+      AddInt(address.base_register_size);
+    }
+    AddInt(static_cast<uint64_t>(address.displacement));
+    AddString(address.index_register);
+    if (!address.index_register.empty()) {
+      AddInt(address.index_register_size);
+    }
+    AddInt(static_cast<uint64_t>(address.scaling));
+    AddString(address.segment_register);
+    if (!address.segment_register.empty()) {
+      AddInt(address.segment_register_size);
+    }
+    AddStrings(address.base_register_intefered_register);
+    AddInts(address.base_register_intefered_register_sizes);
+    AddStrings(address.index_register_intefered_register);
+    AddInts(address.index_register_intefered_register_sizes);
+    AddStrings(address.segment_register_intefered_register);
+    AddInts(address.segment_register_intefered_register_sizes);
+  }
+
+  void AddOperand(const InstructionOperand& operand) {
+    AddInt(static_cast<uint64_t>(operand.type()));
+    switch (operand.type()) {
+      case OperandType::kUnknown:
+        break;
+      case OperandType::kRegister:
+        AddString(operand.register_name());
+        break;
+      case OperandType::kImmediateValue:
+        AddInt(operand.immediate_value());
+        break;
+      case OperandType::kFpImmediateValue:
+        AddDouble(operand.fp_immediate_value());
+        break;
+      case OperandType::kAddress:
+        AddAddress(operand.address());
+        break;
+      case OperandType::kMemory:
+        AddInt(static_cast<uint64_t>(operand.alias_group_id()));
+        break;
+      case OperandType::kVirtualRegister:
+        AddString(operand.register_name());
+        AddInt(operand.size());
+        AddStrings(operand.getInterferedRegisters());
+        AddInts(operand.getInterferedRegistersSize());
+        break;
+    }
+  }
+  void AddOperands(const std::vector<InstructionOperand>& operands) {
+    AddInt(operands.size());
+    for (const InstructionOperand& operand : operands) AddOperand(operand);
+  }
+
+  void AddInstruction(const Instruction& instruction) {
+    AddString(instruction.mnemonic);
+    AddString(instruction.llvm_mnemonic);
+    AddStrings(instruction.prefixes);
+    AddOperands(instruction.input_operands);
+    AddOperands(instruction.implicit_input_operands);
+    AddOperands(instruction.output_operands);
+    AddOperands(instruction.implicit_output_operands);
+  }
+
+  uint64_t hash() const { return hash_; }
+
+ private:
+  static constexpr uint64_t kFnvOffsetBasis = 0xcbf29ce484222325ULL;
+  static constexpr uint64_t kFnvPrime = 0x100000001b3ULL;
+
+  uint64_t hash_ = kFnvOffsetBasis;
+};
+
+}  // namespace
+
+uint64_t BasicBlockFingerprint(const BasicBlock& block) {
+  return BasicBlockFingerprint(block.instructions);
+}
+
+uint64_t BasicBlockFingerprint(const std::vector<Instruction>& instructions) {
+  FingerprintBuilder builder;
+  builder.AddInt(instructions.size());
+  for (const Instruction& instruction : instructions) {
+    builder.AddInstruction(instruction);
+  }
+  return builder.hash();
+}
+
+uint64_t BasicBlockFingerprint(
+    const std::vector<const Instruction*>& instructions) {
+  FingerprintBuilder builder;
+  builder.AddInt(instructions.size());
+  for (const Instruction* const instruction : instructions) {
+    builder.AddInstruction(*instruction);
+  }
+  return builder.hash();
+}
+
+void InternSymbols(SymbolTable& symbols, Instruction& instruction) {
+  instruction.mnemonic_symbol = symbols.Intern(instruction.mnemonic);
+  for (std::vector<InstructionOperand>* const operands :
+       {&instruction.input_operands, &instruction.implicit_input_operands,
+        &instruction.output_operands, &instruction.implicit_output_operands}) {
+    for (InstructionOperand& operand : *operands) {
+      if (operand.type() != OperandType::kRegister) continue;
+      operand.set_register_symbol(symbols.Intern(operand.register_name()));
+    }
+  }
+}
+
+void InternSymbols(SymbolTable& symbols, BasicBlock& block) {
+  for (Instruction& instruction : block.instructions) {
+    InternSymbols(symbols, instruction);
+  }
+}
+
 }  // namespace gematria
@@ -30,6 +30,9 @@
 #include <string_view>
 #include <utility>
 #include <vector>
+
+#include "gematria/basic_block/symbol_table.h"
+
 namespace gematria {
 
 // Tokens used for instruction canonicalization in Gematria. The values used
@@ -279,6 +282,11 @@ class InstructionOperand {
     return alias_group_id_;
   }
 
+  // Returns the interned symbol of the register name, or kInvalidSymbol when
+  // the register name was not interned. See InternSymbols().
+  SymbolId register_symbol() const { return register_symbol_; }
+  void set_register_symbol(SymbolId symbol) { register_symbol_ = symbol; }
+
  private:
   OperandType type_ = OperandType::kUnknown;
 
@@ -290,6 +298,9 @@ class InstructionOperand {
   int alias_group_id_ = 0;
   std::vector<std::string> interfered_registers_;
   std::vector<int> interfered_registers_size_;
+  // The interned symbol of `register_name_`. This is a cache derived from
+  // `register_name_`; it is not compared by operator==.
+  SymbolId register_symbol_ = kInvalidSymbol;
 };
 
 std::ostream& operator<<(std::ostream& os, const InstructionOperand& operand);
@@ -330,12 +341,22 @@ struct Instruction {
   // creates the object.
   std::string ToString() const;
 
+  // Resets all fields of the instruction to their default values. Unlike
+  // assigning a default-constructed instruction, this keeps the capacity of the
+  // strings and the operand lists, so that an instruction object can be reused
+  // for a sequence of instructions without allocating memory for each of them.
+  void Clear();
+
   // The mnemonic of the instruction used to represent the instruction in the
   // model.
   std::string mnemonic;
   // The LLVM mnemonic of the instruction. Note that the LLVM mnemonics tend to
   // change with LLVM versions, and we do not recommend using it in models.
   std::string llvm_mnemonic;
+  // The interned symbol of `mnemonic`, or kInvalidSymbol when the mnemonic was
+  // not interned. See InternSymbols(). This is a cache derived from `mnemonic`;
+  // it is not compared by operator==.
+  SymbolId mnemonic_symbol = kInvalidSymbol;
 
   // The list of instruction prefixes. These are additional strings that can be
   // added to the mnemonic. In the models, they are typically represented by
@@ -397,6 +418,32 @@ struct BasicBlock {
 
 std::ostream& operator<<(std::ostream& os, const BasicBlock& block);
 
+// Returns a 64-bit fingerprint of `block`. The fingerprint covers all data of
+// the basic block that is used by the models: the mnemonics and prefixes of
+// the instructions and all their operands, including the information about
+// register interference. It does not depend on the address and the size of
+// the instructions. The fingerprint is stable across processes and platforms,
+// so it can be used as a key in persistent caches.
+// Equal basic blocks have equal fingerprints; different basic blocks have
+// different fingerprints with a very high probability.
+uint64_t BasicBlockFingerprint(const BasicBlock& block);
+// A version of BasicBlockFingerprint() that takes the list of instructions in
+// the basic block instead of the basic block object itself.
+uint64_t BasicBlockFingerprint(const std::vector<Instruction>& instructions);
+// A version of BasicBlockFingerprint() that takes pointers to the instructions
+// in the basic block, e.g. a basic block assembled from instructions of
+// another block (see ApplyBasicBlockEdits()). Returns the same value as the
+// other versions for a basic block with copies of the instructions.
+uint64_t BasicBlockFingerprint(
+    const std::vector<const Instruction*>& instructions);
+
+// Interns the mnemonic of `instruction` and the names of its register operands
+// in `symbols`, and stores the IDs in the instruction. Consumers that were set
+// up with the same symbol table (e.g. BasicBlockGraphBuilder) can use the IDs
+// instead of hashing the strings again.
+void InternSymbols(SymbolTable& symbols, Instruction& instruction);
+void InternSymbols(SymbolTable& symbols, BasicBlock& block);
+
 }  // namespace gematria
 
 #endif  // GEMATRIA_BASIC_BLOCK_BASIC_BLOCK_H_
@@ -0,0 +1,62 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "gematria/basic_block/basic_block_edits.h"
+
+#include <optional>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+
+namespace gematria {
+
+std::optional<std::vector<const Instruction*>> ApplyBasicBlockEdits(
+    const std::vector<Instruction>& instructions,
+    const std::vector<BasicBlockEdit>& edits) {
+  std::vector<const Instruction*> result;
+  result.reserve(instructions.size() + edits.size());
+  for (const Instruction& instruction : instructions) {
+    result.push_back(&instruction);
+  }
+  for (const BasicBlockEdit& edit : edits) {
+    const int size = static_cast<int>(result.size());
+    // Insertion is the only edit that accepts the position after the last
+    // instruction.
+    const int max_index = edit.type == BasicBlockEdit::Type::kInsert ? size
+                                                                     : size - 1;
+    if (edit.index < 0 || edit.index > max_index) return std::nullopt;
+    switch (edit.type) {
+      case BasicBlockEdit::Type::kReplace:
+        result[edit.index] = &edit.instruction;
+        break;
+      case BasicBlockEdit::Type::kInsert:
+        result.insert(result.begin() + edit.index, &edit.instruction);
+        break;
+      case BasicBlockEdit::Type::kRemove:
+        result.erase(result.begin() + edit.index);
+        break;
+      case BasicBlockEdit::Type::kMove: {
+        if (edit.to_index < 0 || edit.to_index >= size) return std::nullopt;
+        const Instruction* const moved = result[edit.index];
+        result.erase(result.begin() + edit.index);
+        result.insert(result.begin() + edit.to_index, moved);
+        break;
+      }
+    }
+  }
+  return result;
+}
+
+}  // namespace gematria
@@ -0,0 +1,81 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Contains a representation of edits of a basic block, used to evaluate
+// "what-if" candidates of a compiler pass (e.g. alternative schedules or
+// instruction selections) relative to a base block, without copying the
+// instructions of the base block for each candidate.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_BASIC_BLOCK_BASIC_BLOCK_EDITS_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_BASIC_BLOCK_BASIC_BLOCK_EDITS_H_
+
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+
+namespace gematria {
+
+// A single edit of the list of instructions of a basic block. The indices are
+// positions in the list before the edit is applied; when a sequence of edits
+// is applied, each edit sees the result of the previous ones.
+struct BasicBlockEdit {
+  enum class Type {
+    // Replaces the instruction at `index` with `instruction`.
+    kReplace,
+    // Inserts `instruction` before the instruction at `index`. An index equal
+    // to the number of instructions appends the instruction at the end.
+    kInsert,
+    // Removes the instruction at `index`.
+    kRemove,
+    // Moves the instruction at `index` so that it ends up at `to_index` in the
+    // resulting list.
+    kMove,
+  };
+
+  static BasicBlockEdit Replace(int index, Instruction instruction) {
+    return {Type::kReplace, index, 0, std::move(instruction)};
+  }
+  static BasicBlockEdit Insert(int index, Instruction instruction) {
+    return {Type::kInsert, index, 0, std::move(instruction)};
+  }
+  static BasicBlockEdit Remove(int index) {
+    return {Type::kRemove, index, 0, Instruction()};
+  }
+  static BasicBlockEdit Move(int from_index, int to_index) {
+    return {Type::kMove, from_index, to_index, Instruction()};
+  }
+
+  Type type = Type::kReplace;
+  int index = 0;
+  // The target position of the instruction; used only by kMove.
+  int to_index = 0;
+  // The new instruction; used only by kReplace and kInsert.
+  Instruction instruction;
+};
+
+// Applies `edits` in order to `instructions`, and returns the edited basic
+// block as a list of pointers to the instructions. The pointers point either
+// to elements of `instructions` or to the instructions stored in `edits`, so
+// they are valid only as long as both are alive and not modified. Returns
+// std::nullopt when one of the edits has an index out of range.
+std::optional<std::vector<const Instruction*>> ApplyBasicBlockEdits(
+    const std::vector<Instruction>& instructions,
+    const std::vector<BasicBlockEdit>& edits);
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_BASIC_BLOCK_BASIC_BLOCK_EDITS_H_
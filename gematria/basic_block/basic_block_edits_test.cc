@@ -0,0 +1,107 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "gematria/basic_block/basic_block_edits.h"
+
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::Optional;
+
+Instruction MakeInstruction(const std::string& mnemonic) {
+  return Instruction(mnemonic, mnemonic, /* prefixes = */ {},
+                     /* input_operands = */ {},
+                     /* implicit_input_operands = */ {},
+                     /* output_operands = */ {},
+                     /* implicit_output_operands = */ {});
+}
+
+// Returns the mnemonics of the instructions in `instructions`, or std::nullopt
+// when `instructions` is std::nullopt.
+std::optional<std::vector<std::string>> Mnemonics(
+    const std::optional<std::vector<const Instruction*>>& instructions) {
+  if (!instructions.has_value()) return std::nullopt;
+  std::vector<std::string> mnemonics;
+  for (const Instruction* const instruction : *instructions) {
+    mnemonics.push_back(instruction->mnemonic);
+  }
+  return mnemonics;
+}
+
+class ApplyBasicBlockEditsTest : public ::testing::Test {
+ protected:
+  const std::vector<Instruction> instructions_ = {
+      MakeInstruction("A"), MakeInstruction("B"), MakeInstruction("C")};
+};
+
+TEST_F(ApplyBasicBlockEditsTest, NoEdits) {
+  const std::optional<std::vector<const Instruction*>> edited =
+      ApplyBasicBlockEdits(instructions_, {});
+  EXPECT_THAT(edited, Optional(ElementsAre(&instructions_[0], &instructions_[1],
+                                           &instructions_[2])));
+}
+
+TEST_F(ApplyBasicBlockEditsTest, Replace) {
+  const std::vector<BasicBlockEdit> edits = {
+      BasicBlockEdit::Replace(1, MakeInstruction("X"))};
+  const std::optional<std::vector<const Instruction*>> edited =
+      ApplyBasicBlockEdits(instructions_, edits);
+  EXPECT_THAT(Mnemonics(edited), Optional(ElementsAre("A", "X", "C")));
+  // The instructions that were not edited are not copied.
+  EXPECT_EQ((*edited)[0], &instructions_[0]);
+  EXPECT_EQ((*edited)[1], &edits[0].instruction);
+}
+
+TEST_F(ApplyBasicBlockEditsTest, InsertAndRemove) {
+  const std::vector<BasicBlockEdit> edits = {
+      BasicBlockEdit::Insert(0, MakeInstruction("X")),
+      BasicBlockEdit::Insert(4, MakeInstruction("Y")),
+      BasicBlockEdit::Remove(2)};
+  EXPECT_THAT(Mnemonics(ApplyBasicBlockEdits(instructions_, edits)),
+              Optional(ElementsAre("X", "A", "C", "Y")));
+}
+
+TEST_F(ApplyBasicBlockEditsTest, Move) {
+  EXPECT_THAT(Mnemonics(ApplyBasicBlockEdits(instructions_,
+                                             {BasicBlockEdit::Move(0, 2)})),
+              Optional(ElementsAre("B", "C", "A")));
+  EXPECT_THAT(Mnemonics(ApplyBasicBlockEdits(instructions_,
+                                             {BasicBlockEdit::Move(2, 0)})),
+              Optional(ElementsAre("C", "A", "B")));
+}
+
+TEST_F(ApplyBasicBlockEditsTest, IndexOutOfRange) {
+  EXPECT_EQ(ApplyBasicBlockEdits(instructions_, {BasicBlockEdit::Remove(3)}),
+            std::nullopt);
+  EXPECT_EQ(ApplyBasicBlockEdits(instructions_,
+                                 {BasicBlockEdit::Insert(4, Instruction())}),
+            std::nullopt);
+  EXPECT_EQ(ApplyBasicBlockEdits(instructions_, {BasicBlockEdit::Move(0, 3)}),
+            std::nullopt);
+  EXPECT_EQ(ApplyBasicBlockEdits(instructions_, {BasicBlockEdit::Remove(-1)}),
+            std::nullopt);
+}
+
+}  // namespace
+}  // namespace gematria
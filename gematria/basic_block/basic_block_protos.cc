@@ -71,6 +71,12 @@ AddressTuple AddressTupleFromProto(
 CanonicalizedOperandProto::AddressTuple ProtoFromAddressTuple(
     const AddressTuple& address_tuple) {
   CanonicalizedOperandProto::AddressTuple proto;
+  ProtoFromAddressTuple(address_tuple, proto);
+  return proto;
+}
+
+void ProtoFromAddressTuple(const AddressTuple& address_tuple,
+                           CanonicalizedOperandProto::AddressTuple& proto) {
   proto.set_base_register(address_tuple.base_register);
   proto.set_displacement(address_tuple.displacement);
   proto.set_index_register(address_tuple.index_register);
@@ -102,7 +108,6 @@ CanonicalizedOperandProto::AddressTuple ProtoFromAddressTuple(
       proto.add_segment_intefered_register(std::move(interfered_register));
     }
   }
-  return proto;
 }
 
 InstructionOperand InstructionOperandFromProto(
@@ -137,6 +142,12 @@ InstructionOperand InstructionOperandFromProto(
 CanonicalizedOperandProto ProtoFromInstructionOperand(
     const InstructionOperand& operand) {
   CanonicalizedOperandProto proto;
+  ProtoFromInstructionOperand(operand, proto);
+  return proto;
+}
+
+void ProtoFromInstructionOperand(const InstructionOperand& operand,
+                                 CanonicalizedOperandProto& proto) {
   switch (operand.type()) {
     case OperandType::kRegister:
       proto.set_register_name(operand.register_name());
@@ -148,7 +159,7 @@ CanonicalizedOperandProto ProtoFromInstructionOperand(
       proto.set_fp_immediate_value(operand.fp_immediate_value());
       break;
     case OperandType::kAddress:
-      *proto.mutable_address() = ProtoFromAddressTuple(operand.address());
+      ProtoFromAddressTuple(operand.address(), *proto.mutable_address());
       break;
     case OperandType::kMemory:
       proto.mutable_memory()->set_alias_group_id(operand.alias_group_id());
@@ -163,7 +174,6 @@ CanonicalizedOperandProto ProtoFromInstructionOperand(
     case OperandType::kUnknown:
       break;
   }
-  return proto;
 }
 
 namespace {
@@ -176,14 +186,25 @@ std::vector<InstructionOperand> ToVector(
   return result;
 }
 
+// Replaces the contents of `operands` with the operands from `protos`, reusing
+// the capacity of `operands`.
+void AssignOperands(
+    const google::protobuf::RepeatedPtrField<CanonicalizedOperandProto>&
+        protos,
+    std::vector<InstructionOperand>& operands) {
+  operands.resize(protos.size());
+  std::transform(protos.begin(), protos.end(), operands.begin(),
+                 InstructionOperandFromProto);
+}
+
 void ToRepeatedPtrField(
     const std::vector<InstructionOperand>& operands,
     google::protobuf::RepeatedPtrField<CanonicalizedOperandProto>*
         repeated_field) {
   repeated_field->Reserve(operands.size());
-  std::transform(operands.begin(), operands.end(),
-                 google::protobuf::RepeatedFieldBackInserter(repeated_field),
-                 ProtoFromInstructionOperand);
+  for (const InstructionOperand& operand : operands) {
+    ProtoFromInstructionOperand(operand, *repeated_field->Add());
+  }
 }
 
 }  // namespace
@@ -202,9 +223,30 @@ Instruction InstructionFromProto(const CanonicalizedInstructionProto& proto) {
       ToVector(proto.implicit_output_operands()));
 }
 
+void InstructionFromProto(const CanonicalizedInstructionProto& proto,
+                          Instruction& instruction) {
+  instruction.Clear();
+  instruction.mnemonic = proto.mnemonic();
+  instruction.llvm_mnemonic = proto.llvm_mnemonic();
+  instruction.prefixes.assign(proto.prefixes().begin(),
+                              proto.prefixes().end());
+  AssignOperands(proto.input_operands(), instruction.input_operands);
+  AssignOperands(proto.implicit_input_operands(),
+                 instruction.implicit_input_operands);
+  AssignOperands(proto.output_operands(), instruction.output_operands);
+  AssignOperands(proto.implicit_output_operands(),
+                 instruction.implicit_output_operands);
+}
+
 CanonicalizedInstructionProto ProtoFromInstruction(
     const Instruction& instruction) {
   CanonicalizedInstructionProto proto;
+  ProtoFromInstruction(instruction, proto);
+  return proto;
+}
+
+void ProtoFromInstruction(const Instruction& instruction,
+                          CanonicalizedInstructionProto& proto) {
   proto.set_mnemonic(instruction.mnemonic);
   proto.set_llvm_mnemonic(instruction.llvm_mnemonic);
   proto.mutable_prefixes()->Assign(instruction.prefixes.begin(),
@@ -217,7 +259,6 @@ CanonicalizedInstructionProto ProtoFromInstruction(
                      proto.mutable_output_operands());
   ToRepeatedPtrField(instruction.implicit_output_operands,
                      proto.mutable_implicit_output_operands());
-  return proto;
 }
 
 namespace {
@@ -226,8 +267,9 @@ std::vector<Instruction> ToVector(
     const google::protobuf::RepeatedPtrField<CanonicalizedInstructionProto>&
         protos) {
   std::vector<Instruction> result(protos.size());
-  std::transform(protos.begin(), protos.end(), result.begin(),
-                 InstructionFromProto);
+  for (int i = 0; i < protos.size(); ++i) {
+    InstructionFromProto(protos[i], result[i]);
+  }
   return result;
 }
 
@@ -238,4 +280,12 @@ BasicBlock BasicBlockFromProto(const BasicBlockProto& proto) {
       /* instructions = */ ToVector(proto.canonicalized_instructions()));
 }
 
+void BasicBlockFromProto(const BasicBlockProto& proto, BasicBlock& block) {
+  const auto& instruction_protos = proto.canonicalized_instructions();
+  block.instructions.resize(instruction_protos.size());
+  for (int i = 0; i < instruction_protos.size(); ++i) {
+    InstructionFromProto(instruction_protos[i], block.instructions[i]);
+  }
+}
+
 }  // namespace gematria
@@ -19,9 +19,12 @@
 #ifndef GEMATRIA_BASIC_BLOCK_BASIC_BLOCK_PROTOS_H_
 #define GEMATRIA_BASIC_BLOCK_BASIC_BLOCK_PROTOS_H_
 
+#include <string_view>
+
 #include "gematria/basic_block/basic_block.h"
 #include "gematria/proto/basic_block.pb.h"
 #include "gematria/proto/canonicalized_instruction.pb.h"
+#include "google/protobuf/arena.h"
 
 namespace gematria {
 
@@ -32,6 +35,11 @@ AddressTuple AddressTupleFromProto(
 // Creates a proto representing the given address tuple.
 CanonicalizedOperandProto::AddressTuple ProtoFromAddressTuple(
     const AddressTuple& address_tuple);
+// Fills `proto` with the data from `address_tuple`. Unlike the version that
+// returns a new proto, this can be used to fill in a proto that is allocated
+// on an arena without copying it. Expects that `proto` is empty.
+void ProtoFromAddressTuple(const AddressTuple& address_tuple,
+                           CanonicalizedOperandProto::AddressTuple& proto);
 
 // Creates an instruction operand data structure from a proto.
 InstructionOperand InstructionOperandFromProto(
@@ -40,16 +48,50 @@ InstructionOperand InstructionOperandFromProto(
 // Creates a proto representing the given instruction operand.
 CanonicalizedOperandProto ProtoFromInstructionOperand(
     const InstructionOperand& operand);
+// Fills `proto` with the data from `operand`; see ProtoFromAddressTuple().
+void ProtoFromInstructionOperand(const InstructionOperand& operand,
+                                 CanonicalizedOperandProto& proto);
 
 // Creates an instruction data structure from a proto.
 Instruction InstructionFromProto(const CanonicalizedInstructionProto& proto);
+// Fills `instruction` with the data from a proto. This is equivalent to
+// assigning the result of InstructionFromProto(proto) to `instruction`, but it
+// reuses the memory already allocated by `instruction`.
+void InstructionFromProto(const CanonicalizedInstructionProto& proto,
+                          Instruction& instruction);
 
 // Creates a proto representing the given instruction.
 CanonicalizedInstructionProto ProtoFromInstruction(
     const Instruction& instruction);
+// Fills `proto` with the data from `instruction`; see ProtoFromAddressTuple().
+void ProtoFromInstruction(const Instruction& instruction,
+                          CanonicalizedInstructionProto& proto);
 
 // Creates a basic block data structure from a proto.
 BasicBlock BasicBlockFromProto(const BasicBlockProto& proto);
+// Fills `block` with the data from a proto. This is equivalent to assigning the
+// result of BasicBlockFromProto(proto) to `block`, but it reuses the memory
+// already allocated by `block` and its instructions; when converting a large
+// number of protos, reusing a single basic block object avoids most of the
+// allocations done by the conversion.
+void BasicBlockFromProto(const BasicBlockProto& proto, BasicBlock& block);
+
+// Parses a serialized proto of type `Proto`, e.g. a record read from a
+// TFRecord file, into a new message allocated on `arena`. Returns nullptr when
+// the proto can't be parsed. The message and all its strings and submessages
+// are owned by the arena, and they are all released at once when the arena is
+// destroyed or reset; this avoids most of the heap allocations and
+// deallocations done when parsing a large number of protos one by one.
+template <typename Proto>
+Proto* ParseProtoOnArena(std::string_view serialized_proto,
+                         google::protobuf::Arena& arena) {
+  Proto* const proto = google::protobuf::Arena::CreateMessage<Proto>(&arena);
+  if (!proto->ParseFromArray(serialized_proto.data(),
+                             static_cast<int>(serialized_proto.size()))) {
+    return nullptr;
+  }
+  return proto;
+}
 
 }  // namespace gematria
 
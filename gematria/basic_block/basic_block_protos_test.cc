@@ -14,12 +14,15 @@
 
 #include "gematria/basic_block/basic_block_protos.h"
 
+#include <string>
+
 #include "gematria/basic_block/basic_block.h"
 #include "gematria/proto/basic_block.pb.h"
 #include "gematria/proto/canonicalized_instruction.pb.h"
 #include "gematria/testing/matchers.h"
 #include "gematria/testing/parse_proto.h"
 #include "gmock/gmock.h"
+#include "google/protobuf/arena.h"
 #include "gtest/gtest.h"
 
 namespace gematria {
@@ -212,6 +215,53 @@ TEST(ProtoFromInstructionTest, AllFields) {
               )pb"));
 }
 
+TEST(ProtoFromInstructionTest, OnArena) {
+  const Instruction instruction(
+      /* mnemonic = */ "LEA", /* llvm_mnemonic = */ "LEA64r",
+      /* prefixes = */ {"LOCK"}, /* input_operands = */
+      {InstructionOperand::Address(/* base_register = */ "RBX",
+                                   /* displacement = */ 8,
+                                   /* index_register = */ "RCX",
+                                   /* scaling = */ 2,
+                                   /* segment_register = */ "FS")},
+      /* implicit_input_operands = */ {},
+      /* output_operands = */ {InstructionOperand::Register("RAX")},
+      /* implicit_output_operands = */ {});
+  google::protobuf::Arena arena;
+  CanonicalizedInstructionProto* const proto =
+      google::protobuf::Arena::CreateMessage<CanonicalizedInstructionProto>(
+          &arena);
+  ProtoFromInstruction(instruction, *proto);
+  EXPECT_EQ(proto->GetArena(), &arena);
+  EXPECT_EQ(proto->input_operands(0).GetArena(), &arena);
+  EXPECT_THAT(*proto, EqualsProto(ProtoFromInstruction(instruction)));
+  EXPECT_EQ(InstructionFromProto(*proto), instruction);
+}
+
+TEST(ParseProtoOnArenaTest, ValidProto) {
+  const BasicBlockProto proto = ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "MOV"
+      llvm_mnemonic: "MOV64rr"
+      output_operands: { register_name: "RCX" }
+      input_operands: { register_name: "RAX" }
+    }
+  )pb");
+  google::protobuf::Arena arena;
+  const BasicBlockProto* const parsed_proto =
+      ParseProtoOnArena<BasicBlockProto>(proto.SerializeAsString(), arena);
+  ASSERT_NE(parsed_proto, nullptr);
+  EXPECT_EQ(parsed_proto->GetArena(), &arena);
+  EXPECT_THAT(*parsed_proto, EqualsProto(proto));
+  EXPECT_EQ(BasicBlockFromProto(*parsed_proto), BasicBlockFromProto(proto));
+}
+
+TEST(ParseProtoOnArenaTest, InvalidProto) {
+  google::protobuf::Arena arena;
+  EXPECT_EQ(ParseProtoOnArena<BasicBlockProto>("\xff\xff\xff", arena),
+            nullptr);
+}
+
 TEST(BasicBlockFromProtoTest, SomeInstructions) {
   const BasicBlockProto proto = ParseTextProto(R"pb(
     canonicalized_instructions: {
@@ -279,5 +329,50 @@ TEST(BasicBlockFromProtoTest, VRegInstructions) {
                 {InstructionOperand::Register("EFLAGS")})}));
 }
 
+TEST(BasicBlockFromProtoTest, ReuseBasicBlock) {
+  const BasicBlockProto large_proto = ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "MOV"
+      llvm_mnemonic: "MOV64rr"
+      prefixes: "LOCK"
+      output_operands: { register_name: "RCX" }
+      input_operands: { register_name: "RAX" }
+      implicit_output_operands: { register_name: "EFLAGS" }
+    }
+    canonicalized_instructions: {
+      mnemonic: "NOT"
+      llvm_mnemonic: "NOT64r"
+      output_operands: { register_name: "RCX" }
+      input_operands: { register_name: "RCX" }
+    }
+  )pb");
+  const BasicBlockProto small_proto = ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "ADD"
+      llvm_mnemonic: "ADD64ri32"
+      output_operands: { register_name: "RAX" }
+      input_operands: { register_name: "RAX" }
+      input_operands: { immediate_value: 1 }
+    }
+  )pb");
+
+  BasicBlock block;
+  BasicBlockFromProto(large_proto, block);
+  EXPECT_EQ(block, BasicBlockFromProto(large_proto));
+
+  // Converting a smaller proto into the same object must not leave any data
+  // from the previous basic block behind.
+  block.instructions[0].address = 1234;
+  block.instructions[0].is_valid = false;
+  BasicBlockFromProto(small_proto, block);
+  EXPECT_EQ(block, BasicBlockFromProto(small_proto));
+  ASSERT_EQ(block.instructions.size(), 1);
+  EXPECT_EQ(block.instructions[0].address, 0);
+  EXPECT_TRUE(block.instructions[0].is_valid);
+
+  BasicBlockFromProto(large_proto, block);
+  EXPECT_EQ(block, BasicBlockFromProto(large_proto));
+}
+
 }  // namespace
 }  // namespace gematria
@@ -359,6 +359,31 @@ TEST(InstructionTest, Constructor) {
   EXPECT_EQ(instruction.implicit_output_operands, kImplicitOutputOperands);
 }
 
+TEST(InstructionTest, Clear) {
+  Instruction instruction(
+      /* mnemonic = */ "MOV",
+      /* llvm_mnemonic = */ "MOV32rr",
+      /* prefixes = */ {"LOCK"},
+      /* input_operands = */ {InstructionOperand::Register("RBX")},
+      /* implicit_input_operands = */ {InstructionOperand::MemoryLocation(1)},
+      /* output_operands = */ {InstructionOperand::Register("RAX")},
+      /* implicit_output_operands = */
+      {InstructionOperand::Register("EFLAGS")});
+  instruction.mnemonic_symbol = 3;
+  instruction.address = 1234;
+  instruction.size = 4;
+  instruction.is_valid = false;
+  const size_t input_operands_capacity = instruction.input_operands.capacity();
+
+  instruction.Clear();
+  EXPECT_EQ(instruction, Instruction());
+  EXPECT_EQ(instruction.mnemonic_symbol, kInvalidSymbol);
+  EXPECT_EQ(instruction.address, 0);
+  EXPECT_EQ(instruction.size, 0);
+  EXPECT_TRUE(instruction.is_valid);
+  EXPECT_EQ(instruction.input_operands.capacity(), input_operands_capacity);
+}
+
 TEST(InstructionTest, AsTokenList) {
   constexpr char kMnemonic[] = "MOV";
   constexpr char kLlvmMnemonic[] = "MOV32rr";
@@ -576,5 +601,93 @@ TEST(BasicBlockTest, ToString) {
   EXPECT_EQ(block.ToString(), kExpectedString);
 }
 
+TEST(BasicBlockTest, Fingerprint) {
+  const Instruction instruction(
+      /* mnemonic = */ "ADC",
+      /* llvm_mnemonic = */ "ADC32rr",
+      /* prefixes = */ {"LOCK"},
+      /* input_operands = */
+      {InstructionOperand::Register("RAX"),
+       InstructionOperand::Register("RBX")},
+      /* implicit_input_operands = */ {InstructionOperand::Register("EFLAGS")},
+      /* output_operands = */ {InstructionOperand::Register("RAX")},
+      /* implicit_output_operands = */
+      {InstructionOperand::Register("EFLAGS")});
+  BasicBlock block_1({instruction});
+  BasicBlock block_2({instruction});
+  EXPECT_EQ(BasicBlockFingerprint(block_1), BasicBlockFingerprint(block_2));
+  EXPECT_NE(BasicBlockFingerprint(block_1),
+            BasicBlockFingerprint(BasicBlock()));
+  // The fingerprint of a list of pointers is the same as the fingerprint of a
+  // block with copies of the instructions.
+  EXPECT_EQ(BasicBlockFingerprint(std::vector<const Instruction*>{
+                &block_2.instructions[0]}),
+            BasicBlockFingerprint(block_1));
+
+  // The address and the size of the instructions are not a part of the
+  // fingerprint.
+  block_2.instructions.back().address = 0x1234;
+  block_2.instructions.back().size = 4;
+  EXPECT_EQ(BasicBlockFingerprint(block_1), BasicBlockFingerprint(block_2));
+
+  // Moving an operand between operand lists changes the fingerprint.
+  block_2.instructions.back().implicit_input_operands.clear();
+  block_2.instructions.back().input_operands.push_back(
+      InstructionOperand::Register("EFLAGS"));
+  EXPECT_NE(BasicBlockFingerprint(block_1), BasicBlockFingerprint(block_2));
+
+  // Interference information is a part of the fingerprint.
+  BasicBlock vreg_block_1({Instruction(
+      /* mnemonic = */ "COPY", /* llvm_mnemonic = */ "COPY",
+      /* prefixes = */ {},
+      /* input_operands = */
+      {InstructionOperand::VirtualRegister("%1", 64, {"%2"}, {64})},
+      /* implicit_input_operands = */ {}, /* output_operands = */ {},
+      /* implicit_output_operands = */ {})});
+  BasicBlock vreg_block_2 = vreg_block_1;
+  EXPECT_EQ(BasicBlockFingerprint(vreg_block_1),
+            BasicBlockFingerprint(vreg_block_2));
+  vreg_block_2.instructions.back().input_operands.back() =
+      InstructionOperand::VirtualRegister("%1", 64, {"%3"}, {64});
+  EXPECT_NE(BasicBlockFingerprint(vreg_block_1),
+            BasicBlockFingerprint(vreg_block_2));
+}
+
+TEST(BasicBlockTest, InternSymbols) {
+  BasicBlock block({Instruction(
+      /* mnemonic = */ "ADC",
+      /* llvm_mnemonic = */ "ADC32rr",
+      /* prefixes = */ {},
+      /* input_operands = */
+      {InstructionOperand::Register("RAX"),
+       InstructionOperand::ImmediateValue(1)},
+      /* implicit_input_operands = */ {InstructionOperand::Register("EFLAGS")},
+      /* output_operands = */ {InstructionOperand::Register("RAX")},
+      /* implicit_output_operands = */
+      {InstructionOperand::Register("EFLAGS")})});
+  const BasicBlock original_block = block;
+  EXPECT_EQ(block.instructions[0].mnemonic_symbol, kInvalidSymbol);
+  EXPECT_EQ(block.instructions[0].input_operands[0].register_symbol(),
+            kInvalidSymbol);
+
+  SymbolTable symbols;
+  InternSymbols(symbols, block);
+
+  const Instruction& instruction = block.instructions[0];
+  EXPECT_EQ(symbols.Name(instruction.mnemonic_symbol), "ADC");
+  EXPECT_EQ(symbols.Name(instruction.input_operands[0].register_symbol()),
+            "RAX");
+  EXPECT_EQ(instruction.input_operands[1].register_symbol(), kInvalidSymbol);
+  EXPECT_EQ(
+      symbols.Name(instruction.implicit_input_operands[0].register_symbol()),
+      "EFLAGS");
+  EXPECT_EQ(instruction.output_operands[0].register_symbol(),
+            instruction.input_operands[0].register_symbol());
+  EXPECT_EQ(symbols.size(), 3);
+
+  // The symbols are not a part of the value of the basic block.
+  EXPECT_EQ(block, original_block);
+}
+
 }  // namespace
 }  // namespace gematria
@@ -0,0 +1,307 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/basic_block/compact_basic_block.h"
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/symbol_table.h"
+
+namespace gematria {
+namespace {
+
+// Encodes the instructions of a basic block. The symbols are collected in a
+// separate list, and they are put in front of the instructions only when the
+// basic block is finished, so that the final buffer is allocated just once.
+class CompactBasicBlockEncoder {
+ public:
+  explicit CompactBasicBlockEncoder(SymbolTable& symbols) : symbols_(symbols) {}
+
+  void AddInstruction(const Instruction& instruction) {
+    AddSymbol(instruction.mnemonic_symbol != kInvalidSymbol
+                  ? instruction.mnemonic_symbol
+                  : symbols_.Intern(instruction.mnemonic));
+    AddWord(instruction.prefixes.size());
+    for (const std::string& prefix : instruction.prefixes) {
+      AddString(prefix);
+    }
+    AddOperands(instruction.input_operands);
+    AddOperands(instruction.implicit_input_operands);
+    AddOperands(instruction.output_operands);
+    AddOperands(instruction.implicit_output_operands);
+  }
+
+  std::vector<uint32_t> Finish(int num_instructions, uint64_t fingerprint) {
+    std::vector<uint32_t> words;
+    words.reserve(4 + local_symbols_.size() + body_.size());
+    words.push_back(num_instructions);
+    words.push_back(static_cast<uint32_t>(fingerprint));
+    words.push_back(static_cast<uint32_t>(fingerprint >> 32));
+    words.push_back(local_symbols_.size());
+    words.insert(words.end(), local_symbols_.begin(), local_symbols_.end());
+    words.insert(words.end(), body_.begin(), body_.end());
+    return words;
+  }
+
+ private:
+  void AddWord(uint32_t word) { body_.push_back(word); }
+  void AddUint64(uint64_t value) {
+    AddWord(static_cast<uint32_t>(value));
+    AddWord(static_cast<uint32_t>(value >> 32));
+  }
+
+  // Adds the local symbol of `symbol`. The basic blocks use only a few dozen
+  // distinct symbols, so a linear search is faster than a hash map.
+  void AddSymbol(SymbolId symbol) {
+    for (uint32_t i = 0; i < local_symbols_.size(); ++i) {
+      if (local_symbols_[i] == symbol) {
+        AddWord(i);
+        return;
+      }
+    }
+    AddWord(local_symbols_.size());
+    local_symbols_.push_back(symbol);
+  }
+  void AddString(std::string_view str) { AddSymbol(symbols_.Intern(str)); }
+  void AddRegister(const std::string& name, SymbolId symbol) {
+    if (symbol != kInvalidSymbol) {
+      AddSymbol(symbol);
+    } else {
+      AddString(name);
+    }
+  }
+
+  void AddInterference(const std::vector<std::string>& registers,
+                       const std::vector<int>& sizes) {
+    assert(registers.size() == sizes.size());
+    AddWord(registers.size());
+    for (const std::string& name : registers) AddString(name);
+    for (const int size : sizes) AddWord(static_cast<uint32_t>(size));
+  }
+
+  void AddAddressRegister(const std::string& name, size_t size,
+                          const std::vector<std::string>& interference,
+                          const std::vector<int>& interference_sizes) {
+    if (name.empty()) {
+      AddWord(CompactBasicBlock::kNoSymbol);
+    } else {
+      AddString(name);
+    }
+    AddWord(static_cast<uint32_t>(size));
+    AddInterference(interference, interference_sizes);
+  }
+
+  void AddOperand(const InstructionOperand& operand) {
+    AddWord(static_cast<uint32_t>(operand.type()));
+    switch (operand.type()) {
+      case OperandType::kUnknown:
+        break;
+      case OperandType::kRegister:
+        AddRegister(operand.register_name(), operand.register_symbol());
+        break;
+      case OperandType::kVirtualRegister:
+        AddRegister(operand.register_name(), operand.register_symbol());
+        AddWord(static_cast<uint32_t>(operand.size()));
+        AddInterference(operand.getInterferedRegisters(),
+                        operand.getInterferedRegistersSize());
+        break;
+      case OperandType::kImmediateValue:
+        AddUint64(operand.immediate_value());
+        break;
+      case OperandType::kFpImmediateValue: {
+        const double value = operand.fp_immediate_value();
+        uint64_t bits;
+        static_assert(sizeof(bits) == sizeof(value));
+        std::memcpy(&bits, &value, sizeof(bits));
+        AddUint64(bits);
+      } break;
+      case OperandType::kAddress: {
+        const AddressTuple& address = operand.address();
+        AddAddressRegister(address.base_register, address.base_register_size,
+                           address.base_register_intefered_register,
+                           address.base_register_intefered_register_sizes);
+        AddAddressRegister(address.index_register, address.index_register_size,
+                           address.index_register_intefered_register,
+                           address.index_register_intefered_register_sizes);
+        AddAddressRegister(address.segment_register,
+                           address.segment_register_size,
+                           address.segment_register_intefered_register,
+                           address.segment_register_intefered_register_sizes);
+        AddUint64(static_cast<uint64_t>(address.displacement));
+        AddWord(static_cast<uint32_t>(address.scaling));
+      } break;
+      case OperandType::kMemory:
+        AddWord(static_cast<uint32_t>(operand.alias_group_id()));
+        break;
+    }
+  }
+  void AddOperands(const std::vector<InstructionOperand>& operands) {
+    AddWord(operands.size());
+    for (const InstructionOperand& operand : operands) AddOperand(operand);
+  }
+
+  SymbolTable& symbols_;
+  std::vector<SymbolId> local_symbols_;
+  std::vector<uint32_t> body_;
+};
+
+// Decodes the instructions of a basic block for CompactBasicBlock::
+// ToBasicBlock().
+class CompactBasicBlockDecoder {
+ public:
+  CompactBasicBlockDecoder(const CompactBasicBlock& block,
+                           const SymbolTable& symbols)
+      : block_(block), symbols_(symbols), reader_(block) {}
+
+  Instruction ReadInstruction() {
+    Instruction instruction;
+    const uint32_t mnemonic = reader_.ReadWord();
+    instruction.mnemonic_symbol = block_.symbol(mnemonic);
+    instruction.mnemonic = Name(mnemonic);
+    const uint32_t num_prefixes = reader_.ReadWord();
+    for (uint32_t i = 0; i < num_prefixes; ++i) {
+      instruction.prefixes.push_back(Name(reader_.ReadWord()));
+    }
+    ReadOperands(instruction.input_operands);
+    ReadOperands(instruction.implicit_input_operands);
+    ReadOperands(instruction.output_operands);
+    ReadOperands(instruction.implicit_output_operands);
+    return instruction;
+  }
+
+  bool at_end() const { return reader_.at_end(); }
+
+ private:
+  std::string Name(uint32_t local_symbol) const {
+    if (local_symbol == CompactBasicBlock::kNoSymbol) return std::string();
+    return std::string(symbols_.Name(block_.symbol(local_symbol)));
+  }
+
+  void ReadInterference(std::vector<std::string>& registers,
+                        std::vector<int>& sizes) {
+    const uint32_t num_registers = reader_.ReadWord();
+    for (uint32_t i = 0; i < num_registers; ++i) {
+      registers.push_back(Name(reader_.ReadWord()));
+    }
+    for (uint32_t i = 0; i < num_registers; ++i) {
+      sizes.push_back(reader_.ReadInt());
+    }
+  }
+
+  void ReadAddressRegister(std::string& name, size_t& size,
+                           std::vector<std::string>& interference,
+                           std::vector<int>& interference_sizes) {
+    name = Name(reader_.ReadWord());
+    size = reader_.ReadWord();
+    ReadInterference(interference, interference_sizes);
+  }
+
+  InstructionOperand ReadOperand() {
+    switch (static_cast<OperandType>(reader_.ReadWord())) {
+      case OperandType::kUnknown:
+        return InstructionOperand();
+      case OperandType::kRegister: {
+        const uint32_t name = reader_.ReadWord();
+        InstructionOperand operand = InstructionOperand::Register(Name(name));
+        operand.set_register_symbol(block_.symbol(name));
+        return operand;
+      }
+      case OperandType::kVirtualRegister: {
+        const uint32_t name = reader_.ReadWord();
+        const uint32_t size = reader_.ReadWord();
+        std::vector<std::string> interference;
+        std::vector<int> interference_sizes;
+        ReadInterference(interference, interference_sizes);
+        return InstructionOperand::VirtualRegister(
+            Name(name), size, interference, std::move(interference_sizes));
+      }
+      case OperandType::kImmediateValue:
+        return InstructionOperand::ImmediateValue(reader_.ReadUint64());
+      case OperandType::kFpImmediateValue: {
+        const uint64_t bits = reader_.ReadUint64();
+        double value;
+        static_assert(sizeof(bits) == sizeof(value));
+        std::memcpy(&value, &bits, sizeof(value));
+        return InstructionOperand::FpImmediateValue(value);
+      }
+      case OperandType::kAddress: {
+        AddressTuple address;
+        ReadAddressRegister(address.base_register, address.base_register_size,
+                            address.base_register_intefered_register,
+                            address.base_register_intefered_register_sizes);
+        ReadAddressRegister(address.index_register,
+                            address.index_register_size,
+                            address.index_register_intefered_register,
+                            address.index_register_intefered_register_sizes);
+        ReadAddressRegister(address.segment_register,
+                            address.segment_register_size,
+                            address.segment_register_intefered_register,
+                            address.segment_register_intefered_register_sizes);
+        address.displacement = static_cast<int64_t>(reader_.ReadUint64());
+        address.scaling = reader_.ReadInt();
+        return InstructionOperand::Address(std::move(address));
+      }
+      case OperandType::kMemory:
+        return InstructionOperand::MemoryLocation(reader_.ReadInt());
+    }
+    assert(false && "Unexpected operand type");
+    return InstructionOperand();
+  }
+
+  void ReadOperands(std::vector<InstructionOperand>& operands) {
+    const uint32_t num_operands = reader_.ReadWord();
+    operands.reserve(num_operands);
+    for (uint32_t i = 0; i < num_operands; ++i) {
+      operands.push_back(ReadOperand());
+    }
+  }
+
+  const CompactBasicBlock& block_;
+  const SymbolTable& symbols_;
+  CompactBasicBlock::Reader reader_;
+};
+
+}  // namespace
+
+CompactBasicBlock CompactBasicBlock::FromInstructions(
+    const std::vector<Instruction>& instructions, SymbolTable& symbols) {
+  if (instructions.empty()) return CompactBasicBlock();
+  CompactBasicBlockEncoder encoder(symbols);
+  for (const Instruction& instruction : instructions) {
+    encoder.AddInstruction(instruction);
+  }
+  return CompactBasicBlock(
+      encoder.Finish(static_cast<int>(instructions.size()),
+                     BasicBlockFingerprint(instructions)));
+}
+
+BasicBlock CompactBasicBlock::ToBasicBlock(const SymbolTable& symbols) const {
+  BasicBlock block;
+  block.instructions.reserve(num_instructions());
+  CompactBasicBlockDecoder decoder(*this, symbols);
+  for (int i = 0; i < num_instructions(); ++i) {
+    block.instructions.push_back(decoder.ReadInstruction());
+  }
+  assert(decoder.at_end());
+  return block;
+}
+
+}  // namespace gematria
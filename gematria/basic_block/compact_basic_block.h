@@ -0,0 +1,192 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains a compact, read-only encoding of a canonicalized basic block for
+// code paths that only run inference, e.g. cost models that hold the basic
+// blocks of whole functions before evaluating them. Unlike BasicBlock, the
+// encoding does not keep the LLVM mnemonics, the addresses and sizes of the
+// instructions, or any strings; a basic block is stored in a single contiguous
+// buffer of 32-bit words, and all strings are replaced by symbols from a
+// SymbolTable.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_BASIC_BLOCK_COMPACT_BASIC_BLOCK_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_BASIC_BLOCK_COMPACT_BASIC_BLOCK_H_
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/symbol_table.h"
+
+namespace gematria {
+
+// A basic block encoded in a single buffer of 32-bit words. The buffer starts
+// with a header:
+//   - the number of instructions,
+//   - the fingerprint of the basic block (two words, the low word first),
+//   - the number of symbols S used by the basic block, followed by the S
+//     symbols. The rest of the buffer refers to the symbols by their position
+//     in this list ("local symbols"), or by kNoSymbol.
+// Each instruction is then encoded as:
+//   - the local symbol of the mnemonic,
+//   - the number of prefixes P, followed by P local symbols,
+//   - the explicit input, implicit input, explicit output and implicit output
+//     operands; each list is the number of operands followed by the operands.
+// Each operand starts with its OperandType, followed by:
+//   - kRegister: the local symbol of the register.
+//   - kVirtualRegister: the local symbol of the register, its size in bits,
+//     and the interference list of the register.
+//   - kImmediateValue, kFpImmediateValue: the bits of the value in two words,
+//     the low word first.
+//   - kAddress: the base, index and segment register, each as a local symbol
+//     (kNoSymbol when the register is not used), its size and its
+//     interference list; then the displacement in two words and the scaling.
+//   - kMemory: the alias group ID.
+//   - kUnknown: nothing.
+// An interference list is the number of interfered registers M, followed by M
+// local symbols of the registers and their M sizes.
+//
+// Typical usage:
+//   CompactBasicBlock block =
+//       CompactBasicBlock::FromInstructions(instructions, *symbol_table);
+//   ...
+//   graph_builder.SetSymbolTable(symbol_table);
+//   graph_builder.AddCompactBasicBlock(block);
+class CompactBasicBlock {
+ public:
+  // The local symbol used for registers that are not present, e.g. the index
+  // register of an address without one.
+  static constexpr uint32_t kNoSymbol = 0xffffffff;
+
+  // Creates an empty basic block.
+  CompactBasicBlock() = default;
+
+  CompactBasicBlock(const CompactBasicBlock&) = default;
+  CompactBasicBlock(CompactBasicBlock&&) = default;
+  CompactBasicBlock& operator=(const CompactBasicBlock&) = default;
+  CompactBasicBlock& operator=(CompactBasicBlock&&) = default;
+
+  // Encodes a basic block with the given instructions. The strings of the
+  // instructions are interned in `symbols`. The interned symbols already in
+  // the instructions (see InternSymbols()) are reused, so they must come from
+  // `symbols`. The fingerprint of the basic block is the fingerprint of
+  // `instructions`; see BasicBlockFingerprint().
+  static CompactBasicBlock FromInstructions(
+      const std::vector<Instruction>& instructions, SymbolTable& symbols);
+
+  // Decodes the basic block. The strings are looked up in `symbols`, which
+  // must be the table used to encode the basic block. The mnemonics and the
+  // registers of the instructions have their interned symbols set. The data
+  // that is not encoded is left at the default values; in particular, the
+  // LLVM mnemonics are empty, so the fingerprint of the decoded basic block
+  // may differ from fingerprint().
+  BasicBlock ToBasicBlock(const SymbolTable& symbols) const;
+
+  // Returns true when the basic block has no instructions.
+  bool empty() const { return words_.empty(); }
+
+  // Returns the number of instructions in the basic block.
+  int num_instructions() const {
+    return empty() ? 0 : static_cast<int>(words_[kNumInstructionsWord]);
+  }
+
+  // Returns the fingerprint of the basic block; see BasicBlockFingerprint().
+  uint64_t fingerprint() const {
+    return empty() ? 0
+                   : (static_cast<uint64_t>(words_[kFingerprintWord + 1])
+                      << 32) |
+                         words_[kFingerprintWord];
+  }
+
+  // Returns the number of symbols used by the basic block, and the symbol with
+  // the given local index.
+  int num_symbols() const {
+    return empty() ? 0 : static_cast<int>(words_[kNumSymbolsWord]);
+  }
+  SymbolId symbol(uint32_t local_symbol) const {
+    assert(local_symbol < num_symbols());
+    return words_[kSymbolsWord + local_symbol];
+  }
+
+  // Returns the number of bytes of memory used by the basic block, including
+  // the object itself.
+  size_t memory_bytes() const {
+    return sizeof(*this) + words_.capacity() * sizeof(uint32_t);
+  }
+
+  // Reads the encoded instructions sequentially; the consumer decodes them
+  // using the layout described in the class comment.
+  class Reader {
+   public:
+    // Creates a reader positioned at the first instruction of `block`.
+    explicit Reader(const CompactBasicBlock& block)
+        : next_(block.empty() ? nullptr : block.instructions_begin()),
+          end_(block.empty() ? nullptr
+                             : block.words_.data() + block.words_.size()) {}
+
+    // Returns true when all words of the basic block were read.
+    bool at_end() const { return next_ == end_; }
+
+    uint32_t ReadWord() {
+      assert(next_ < end_);
+      return *next_++;
+    }
+    int32_t ReadInt() { return static_cast<int32_t>(ReadWord()); }
+    uint64_t ReadUint64() {
+      const uint64_t low = ReadWord();
+      return (static_cast<uint64_t>(ReadWord()) << 32) | low;
+    }
+    // Returns a pointer to the next `count` words, and skips them.
+    const uint32_t* ReadWords(size_t count) {
+      assert(next_ + count <= end_);
+      const uint32_t* const words = next_;
+      next_ += count;
+      return words;
+    }
+
+   private:
+    const uint32_t* next_;
+    const uint32_t* end_;
+  };
+
+ private:
+  // The positions of the header fields in `words_`.
+  static constexpr size_t kNumInstructionsWord = 0;
+  static constexpr size_t kFingerprintWord = 1;
+  static constexpr size_t kNumSymbolsWord = 3;
+  static constexpr size_t kSymbolsWord = 4;
+
+  explicit CompactBasicBlock(std::vector<uint32_t> words)
+      : words_(std::move(words)) {}
+
+  const uint32_t* instructions_begin() const {
+    return words_.data() + kSymbolsWord + num_symbols();
+  }
+
+  // The encoded basic block; empty for a basic block without instructions.
+  std::vector<uint32_t> words_;
+};
+
+// Returns the fingerprint of `block`; this is the same as the fingerprint of
+// the instructions from which the block was encoded.
+inline uint64_t BasicBlockFingerprint(const CompactBasicBlock& block) {
+  return block.fingerprint();
+}
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_BASIC_BLOCK_COMPACT_BASIC_BLOCK_H_
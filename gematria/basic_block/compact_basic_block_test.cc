@@ -0,0 +1,152 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/basic_block/compact_basic_block.h"
+
+#include <string>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/symbol_table.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+// Returns the instructions of a basic block that uses all types of operands.
+// The LLVM mnemonics are empty, because they are not encoded.
+std::vector<Instruction> MakeInstructions() {
+  return {
+      Instruction(
+          "LEA", /* llvm_mnemonic = */ "", /* prefixes = */ {"LOCK"},
+          /* input_operands = */
+          {InstructionOperand::Address(
+               /* base_register = */ "RBX", /* displacement = */ -8,
+               /* index_register = */ "RCX", /* scaling = */ 4,
+               /* segment_register = */ ""),
+           InstructionOperand::ImmediateValue(0x123456789abcdef0),
+           InstructionOperand::FpImmediateValue(0.5)},
+          /* implicit_input_operands = */
+          {InstructionOperand::MemoryLocation(3)},
+          /* output_operands = */ {InstructionOperand::Register("RAX")},
+          /* implicit_output_operands = */
+          {InstructionOperand::Register("EFLAGS")}),
+      Instruction(
+          "COPY", /* llvm_mnemonic = */ "", /* prefixes = */ {},
+          /* input_operands = */
+          {InstructionOperand::VirtualRegister("%1", 64, {"%0", "RAX"},
+                                               {64, 64}),
+           InstructionOperand::Address(
+               /* base_register = */ "%2", /* displacement = */ 0,
+               /* index_register = */ "", /* scaling = */ 1,
+               /* segment_register = */ "", /* base_register_size = */ 64,
+               /* index_register_size = */ 64,
+               /* segment_register_size = */ 64,
+               /* base_register_intefered_register = */ {"%1"},
+               /* index_register_intefered_register = */ {},
+               /* segment_register_intefered_register = */ {},
+               /* base_register_intefered_register_sizes = */ {64})},
+          /* implicit_input_operands = */ {},
+          /* output_operands = */
+          {InstructionOperand::VirtualRegister("%0", 32, {"%1"}, {64})},
+          /* implicit_output_operands = */ {})};
+}
+
+TEST(CompactBasicBlockTest, EmptyBlock) {
+  SymbolTable symbols;
+  const CompactBasicBlock block =
+      CompactBasicBlock::FromInstructions({}, symbols);
+  EXPECT_TRUE(block.empty());
+  EXPECT_EQ(block.num_instructions(), 0);
+  EXPECT_EQ(block.num_symbols(), 0);
+  EXPECT_EQ(block.ToBasicBlock(symbols), BasicBlock());
+}
+
+TEST(CompactBasicBlockTest, RoundTrip) {
+  SymbolTable symbols;
+  const std::vector<Instruction> instructions = MakeInstructions();
+  const CompactBasicBlock block =
+      CompactBasicBlock::FromInstructions(instructions, symbols);
+  EXPECT_FALSE(block.empty());
+  EXPECT_EQ(block.num_instructions(), 2);
+  EXPECT_EQ(block.fingerprint(), BasicBlockFingerprint(instructions));
+  EXPECT_EQ(BasicBlockFingerprint(block), block.fingerprint());
+
+  const BasicBlock decoded = block.ToBasicBlock(symbols);
+  EXPECT_EQ(decoded, BasicBlock(instructions));
+  // The LLVM mnemonics were already empty, so the fingerprint is the same.
+  EXPECT_EQ(BasicBlockFingerprint(decoded), block.fingerprint());
+  // The mnemonics and the register names are interned.
+  EXPECT_EQ(decoded.instructions[0].mnemonic_symbol, symbols.Find("LEA"));
+  EXPECT_EQ(decoded.instructions[0].output_operands[0].register_symbol(),
+            symbols.Find("RAX"));
+}
+
+TEST(CompactBasicBlockTest, SymbolsAreShared) {
+  SymbolTable symbols;
+  const std::vector<Instruction> instructions = MakeInstructions();
+  const CompactBasicBlock block =
+      CompactBasicBlock::FromInstructions(instructions, symbols);
+  // Each distinct string is stored once in the list of symbols of the block,
+  // even though some of the registers are used multiple times.
+  std::vector<std::string> names;
+  for (int i = 0; i < block.num_symbols(); ++i) {
+    names.push_back(std::string(symbols.Name(block.symbol(i))));
+  }
+  EXPECT_THAT(names, ::testing::UnorderedElementsAre(
+                         "LEA", "LOCK", "RBX", "RCX", "RAX", "EFLAGS", "COPY",
+                         "%0", "%1", "%2"));
+
+  // Encoding the block again does not add any new symbols to the table.
+  const size_t num_symbols = symbols.size();
+  EXPECT_EQ(CompactBasicBlock::FromInstructions(instructions, symbols)
+                .fingerprint(),
+            block.fingerprint());
+  EXPECT_EQ(symbols.size(), num_symbols);
+}
+
+TEST(CompactBasicBlockTest, ReusesInternedSymbols) {
+  SymbolTable symbols;
+  BasicBlock block(MakeInstructions());
+  InternSymbols(symbols, block);
+  const CompactBasicBlock compact =
+      CompactBasicBlock::FromInstructions(block.instructions, symbols);
+  EXPECT_EQ(compact.ToBasicBlock(symbols), block);
+}
+
+TEST(CompactBasicBlockTest, FingerprintIncludesLlvmMnemonic) {
+  SymbolTable symbols;
+  std::vector<Instruction> instructions = MakeInstructions();
+  instructions[0].llvm_mnemonic = "LEA64r";
+  const CompactBasicBlock block =
+      CompactBasicBlock::FromInstructions(instructions, symbols);
+  // The fingerprint is the one of the original instructions, so that the
+  // compact basic block can be used with caches filled from BasicBlock.
+  EXPECT_EQ(block.fingerprint(), BasicBlockFingerprint(instructions));
+  EXPECT_EQ(block.ToBasicBlock(symbols).instructions[0].llvm_mnemonic, "");
+}
+
+TEST(CompactBasicBlockTest, UsesLessMemory) {
+  SymbolTable symbols;
+  const std::vector<Instruction> instructions = MakeInstructions();
+  const CompactBasicBlock block =
+      CompactBasicBlock::FromInstructions(instructions, symbols);
+  // The instructions alone take more memory than the whole compact block,
+  // without counting any of the memory allocated by them.
+  EXPECT_LT(block.memory_bytes(), instructions.size() * sizeof(Instruction));
+}
+
+}  // namespace
+}  // namespace gematria
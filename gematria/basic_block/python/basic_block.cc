@@ -95,7 +95,13 @@ InstructionOperandVregPropertyOrNone(const InstructionOperand& operand) {
 }
 
 PYBIND11_MODULE(basic_block, m) {
-  m.doc() = "Data structures representing instructions and basic blocks.";
+  m.doc() = R"(Data structures representing instructions and basic blocks.
+
+The methods of these classes are short and they keep the GIL, so the objects
+can be shared between Python threads as any other Python objects. Note that the
+functions that take them as arguments, e.g. the methods of the graph builder,
+may release the GIL; the objects must not be modified by other threads while
+such a function is running.)";
 
   // Use bound versions of the two vector types. This makes changes done in
   // Python code propagate to C++ code.
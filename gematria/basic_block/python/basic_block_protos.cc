@@ -27,13 +27,22 @@ namespace py = ::pybind11;
 PYBIND11_MODULE(basic_block_protos, m) {
   pybind11_protobuf::ImportNativeProtoCasters();
 
-  m.doc() = "Functions for converting protos to Gematria data structures.";
-
-  m.def("basic_block_from_proto", BasicBlockFromProto, py::arg("proto"));
-  m.def("instruction_from_proto", InstructionFromProto, py::arg("proto"));
+  m.doc() = R"(Functions for converting protos to Gematria data structures.
+
+The conversion releases the GIL, so the functions can be called from multiple
+Python threads in parallel. The protos passed to the functions must not be
+modified by other threads during the conversion.)";
+
+  // The protos are converted to C++ and the results are converted back to
+  // Python with the GIL held; only the conversion itself runs without it.
+  m.def("basic_block_from_proto", BasicBlockFromProto, py::arg("proto"),
+        py::call_guard<py::gil_scoped_release>());
+  m.def("instruction_from_proto", InstructionFromProto, py::arg("proto"),
+        py::call_guard<py::gil_scoped_release>());
   m.def("instruction_operand_from_proto", InstructionOperandFromProto,
-        py::arg("proto"));
-  m.def("address_tuple_from_proto", AddressTupleFromProto, py::arg("proto"));
+        py::arg("proto"), py::call_guard<py::gil_scoped_release>());
+  m.def("address_tuple_from_proto", AddressTupleFromProto, py::arg("proto"),
+        py::call_guard<py::gil_scoped_release>());
 }
 
 }  // namespace gematria
@@ -0,0 +1,53 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/basic_block/symbol_table.h"
+
+#include <cassert>
+#include <cstddef>
+#include <mutex>
+#include <string_view>
+
+namespace gematria {
+
+SymbolId SymbolTable::Intern(std::string_view name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = ids_.find(name);
+  if (it != ids_.end()) return it->second;
+
+  const SymbolId id = static_cast<SymbolId>(names_.size());
+  assert(id != kInvalidSymbol);
+  names_.emplace_back(name);
+  ids_.emplace(names_.back(), id);
+  return id;
+}
+
+SymbolId SymbolTable::Find(std::string_view name) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = ids_.find(name);
+  return it == ids_.end() ? kInvalidSymbol : it->second;
+}
+
+std::string_view SymbolTable::Name(SymbolId id) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  assert(id < names_.size());
+  return names_[id];
+}
+
+size_t SymbolTable::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return names_.size();
+}
+
+}  // namespace gematria
@@ -0,0 +1,78 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains a table of interned symbols: strings such as mnemonics and register
+// names that are represented by small integer IDs.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_BASIC_BLOCK_SYMBOL_TABLE_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_BASIC_BLOCK_SYMBOL_TABLE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace gematria {
+
+// The ID of an interned symbol. IDs are assigned by SymbolTable in the order in
+// which the symbols are interned, starting from zero.
+using SymbolId = uint32_t;
+
+// A special value used for "no symbol", i.e. for strings that were not
+// interned.
+inline constexpr SymbolId kInvalidSymbol = std::numeric_limits<SymbolId>::max();
+
+// A thread-safe table of interned symbols. Each distinct string interned in
+// the table gets a unique ID; the IDs are valid for the whole lifetime of the
+// table, and the same table may be shared by multiple producers (e.g.
+// canonicalizers) and consumers (e.g. graph builders).
+class SymbolTable {
+ public:
+  SymbolTable() = default;
+
+  SymbolTable(const SymbolTable&) = delete;
+  SymbolTable& operator=(const SymbolTable&) = delete;
+
+  // Returns the ID of `name`. Adds `name` to the table when it is not there.
+  SymbolId Intern(std::string_view name);
+
+  // Returns the ID of `name`, or kInvalidSymbol when `name` is not in the
+  // table.
+  SymbolId Find(std::string_view name) const;
+
+  // Returns the string of the symbol with the given ID. The ID must have been
+  // returned by Intern() on this table. The returned view is valid for the
+  // whole lifetime of the table.
+  std::string_view Name(SymbolId id) const;
+
+  // Returns the number of symbols in the table.
+  size_t size() const;
+
+ private:
+  mutable std::mutex mutex_;
+  // The strings of the symbols, indexed by their IDs. We use std::deque, so
+  // that the strings do not move when new symbols are added, and the keys of
+  // `ids_` remain valid. Guarded by `mutex_`.
+  std::deque<std::string> names_;
+  // Maps the strings of the symbols to their IDs. Guarded by `mutex_`.
+  std::unordered_map<std::string_view, SymbolId> ids_;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_BASIC_BLOCK_SYMBOL_TABLE_H_
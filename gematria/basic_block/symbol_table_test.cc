@@ -0,0 +1,64 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/basic_block/symbol_table.h"
+
+#include <string>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+TEST(SymbolTableTest, Intern) {
+  SymbolTable symbols;
+  EXPECT_EQ(symbols.size(), 0);
+
+  const SymbolId rax = symbols.Intern("RAX");
+  const SymbolId rbx = symbols.Intern("RBX");
+  EXPECT_EQ(rax, 0);
+  EXPECT_EQ(rbx, 1);
+  EXPECT_EQ(symbols.size(), 2);
+
+  // Interning the same string again returns the same ID.
+  EXPECT_EQ(symbols.Intern(std::string("RAX")), rax);
+  EXPECT_EQ(symbols.size(), 2);
+
+  EXPECT_EQ(symbols.Name(rax), "RAX");
+  EXPECT_EQ(symbols.Name(rbx), "RBX");
+}
+
+TEST(SymbolTableTest, Find) {
+  SymbolTable symbols;
+  const SymbolId mov = symbols.Intern("MOV");
+  EXPECT_EQ(symbols.Find("MOV"), mov);
+  EXPECT_EQ(symbols.Find("ADD"), kInvalidSymbol);
+  EXPECT_EQ(symbols.size(), 1);
+}
+
+TEST(SymbolTableTest, NamesAreStable) {
+  SymbolTable symbols;
+  const SymbolId first = symbols.Intern("first");
+  const std::string_view first_name = symbols.Name(first);
+  for (int i = 0; i < 1000; ++i) {
+    symbols.Intern("symbol" + std::to_string(i));
+  }
+  EXPECT_EQ(first_name.data(), symbols.Name(first).data());
+  EXPECT_EQ(symbols.Find("first"), first);
+  EXPECT_EQ(symbols.Name(symbols.Find("symbol999")), "symbol999");
+}
+
+}  // namespace
+}  // namespace gematria
@@ -15,9 +15,14 @@
 #include "gematria/datasets/bhive_importer.h"
 
 #include <algorithm>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
 #include <memory>
+#include <string>
 #include <string_view>
+#include <system_error>
+#include <tuple>
 #include <utility>
 #include <vector>
 
@@ -29,28 +34,49 @@
 #include "absl/strings/str_format.h"
 #include "absl/strings/str_split.h"
 #include "gematria/basic_block/basic_block_protos.h"
+#include "gematria/datasets/block_deduplicator.h"
+#include "gematria/datasets/mir_block_cache.h"
+#include "gematria/io/record_writer.h"
 #include "gematria/llvm/canonicalizer.h"
 #include "gematria/llvm/disassembler.h"
 #include "gematria/llvm/llvm_to_absl.h"
 #include "gematria/proto/basic_block.pb.h"
 #include "gematria/proto/throughput.pb.h"
 #include "gematria/utils/string.h"
+#include "gematria/utils/trace.h"
 #include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/Twine.h"
 #include "llvm/CodeGen/MachineFunction.h"
 #include "llvm/MC/TargetRegistry.h"
 #include "llvm/Support/Error.h"
+#include "llvm/Support/ErrorOr.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/SourceMgr.h"
 #include "llvm/Support/WithColor.h"
 #include "llvm/Support/raw_ostream.h"
 
-#define DEBUG
-
-#ifdef DEBUG
-#define LOG(X) llvm::errs() << X << "\n"
-#else
-#define LOG(X)
+// Debug logging. The messages are compiled out unless the importer is built
+// with -DGEMATRIA_BHIVE_IMPORTER_LOG_LEVEL=<level>, where the levels are:
+//   1: messages about files and rejected basic blocks,
+//   2: dumps of all machine basic blocks and of the basic block protos.
+#ifndef GEMATRIA_BHIVE_IMPORTER_LOG_LEVEL
+#define GEMATRIA_BHIVE_IMPORTER_LOG_LEVEL 0
 #endif
 
+#define BHIVE_LOG(level, X)                                 \
+  do {                                                      \
+    if constexpr ((level) <= GEMATRIA_BHIVE_IMPORTER_LOG_LEVEL) { \
+      llvm::errs() << X << "\n";                            \
+    }                                                       \
+  } while (false)
+
 // Author: Zhan Shi
 #include "llvm/CodeGen/LiveInterval.h"
 #include "llvm/IR/Function.h"
@@ -65,6 +91,22 @@ namespace {
 // each architecture, since it is guaranteed to always be there.
 constexpr int kDefaultSyntax = 0;
 
+// Adds the wall time between its construction and destruction to `nanos`.
+class ScopedPhaseTimer {
+ public:
+  explicit ScopedPhaseTimer(int64_t& nanos)
+      : nanos_(nanos), start_(std::chrono::steady_clock::now()) {}
+  ~ScopedPhaseTimer() {
+    nanos_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now() - start_)
+                  .count();
+  }
+
+ private:
+  int64_t& nanos_;
+  const std::chrono::steady_clock::time_point start_;
+};
+
 }  // namespace
 
 BHiveImporter::BHiveImporter(const Canonicalizer* canonicalizer, const std::string& model_type)
@@ -81,19 +123,22 @@ BHiveImporter::BHiveImporter(const Canonicalizer* canonicalizer, const std::stri
           *target_machine_.getMCAsmInfo(), *target_machine_.getMCInstrInfo(),
           *target_machine_.getMCRegisterInfo())),
       MMI_(dynamic_cast<const llvm::LLVMTargetMachine*>(&target_machine_)) {
-  // setup super register to sub register mapping
+  // setup super register to sub register mapping. The table is indexed by the
+  // register number, so that the interference graph can be built without
+  // string lookups.
   const llvm::MCRegisterInfo& MRI = *target_machine_.getMCRegisterInfo();
-  for (llvm::MCPhysReg I = 1, E = MRI.getNumRegs(); I != E; ++I) {
-    // Append register definition line.
-    llvm::StringRef reg_name = MRI.getName(I);
-    // push itself to its own superreg2subreg_ list
-    superreg2subreg_[reg_name.str()].push_back(reg_name.str());
-    for (auto SuperReg : MRI.superregs(I)) {
-      if (MRI.isSubRegister(SuperReg, I)) {
-        llvm::StringRef super_reg_name = MRI.getName(SuperReg);
-        superreg2subreg_[super_reg_name.str()].push_back(reg_name.str());
-      }
+  const unsigned num_registers = MRI.getNumRegs();
+  superreg2subreg_offsets_.reserve(num_registers + 1);
+  // Register 0 is the "no register" register; it has no sub-registers.
+  superreg2subreg_offsets_.push_back(0);
+  superreg2subreg_offsets_.push_back(0);
+  for (llvm::MCPhysReg I = 1; I != num_registers; ++I) {
+    name_to_register_[MRI.getName(I)] = I;
+    // The list of each register starts with the register itself.
+    for (const llvm::MCPhysReg sub_reg : MRI.subregs_inclusive(I)) {
+      superreg2subreg_.push_back(sub_reg);
     }
+    superreg2subreg_offsets_.push_back(superreg2subreg_.size());
   }
   // set up model type
   if (model_type == "PER_BB_LIVE_INFO") {
@@ -103,33 +148,41 @@ BHiveImporter::BHiveImporter(const Canonicalizer* canonicalizer, const std::stri
   } else {
     model_type_ = MODEL_TYPE::NO_LIVE_INFO;
   }
-  LOG("model type is " << model_type_ << " raw string is " << model_type);
+  BHIVE_LOG(1, "model type is " << model_type_ << " raw string is "
+                                 << model_type);
   // prettyPrintName2Reg();
   // prettyPrintSuperReg2SubReg();
 }
 
 absl::StatusOr<BasicBlockProto> BHiveImporter::BasicBlockProtoFromMachineCode(
     llvm::ArrayRef<uint8_t> machine_code, uint64_t base_address /*= 0*/) {
+  GEMATRIA_TRACE_SCOPE("BHiveImporter::BasicBlockProtoFromMachineCode");
   BasicBlockProto basic_block_proto;
-  llvm::Expected<std::vector<DisassembledInstruction>> instructions =
-      DisassembleAllInstructions(*disassembler_,
-                                 *target_machine_.getMCInstrInfo(),
-                                 *target_machine_.getMCRegisterInfo(),
-                                 *target_machine_.getMCSubtargetInfo(),
-                                 *mc_inst_printer_, base_address, machine_code);
-  if (llvm::Error error = instructions.takeError()) {
+  // The canonicalized instruction is reused for all instructions in the block
+  // to avoid allocating its operand lists for each of them. The instructions
+  // are added to the proto directly from the disassembler, without storing
+  // them in an intermediate vector.
+  Instruction canonicalized_instruction;
+  if (llvm::Error error = ForEachDisassembledInstruction(
+          *disassembler_, *target_machine_.getMCInstrInfo(),
+          *target_machine_.getMCRegisterInfo(),
+          *target_machine_.getMCSubtargetInfo(), mc_inst_printer_.get(),
+          base_address, machine_code,
+          [&](const DisassembledInstruction& instruction) {
+            MachineInstructionProto& machine_instruction =
+                *basic_block_proto.add_machine_instructions();
+            machine_instruction.set_address(instruction.address);
+            machine_instruction.set_assembly(instruction.assembly);
+            machine_instruction.set_machine_code(instruction.machine_code);
+            canonicalizer_.InstructionFromMCInst(instruction.mc_inst,
+                                                 canonicalized_instruction);
+            ProtoFromInstruction(
+                canonicalized_instruction,
+                *basic_block_proto.add_canonicalized_instructions());
+            return llvm::Error::success();
+          })) {
     return LlvmErrorToStatus(std::move(error));
   }
-
-  for (DisassembledInstruction& instruction : *instructions) {
-    MachineInstructionProto& machine_instruction =
-        *basic_block_proto.add_machine_instructions();
-    machine_instruction.set_address(instruction.address);
-    machine_instruction.set_assembly(instruction.assembly);
-    machine_instruction.set_machine_code(instruction.machine_code);
-    *basic_block_proto.add_canonicalized_instructions() = ProtoFromInstruction(
-        canonicalizer_.InstructionFromMCInst(instruction.mc_inst));
-  }
   return basic_block_proto;
 }
 
@@ -146,18 +199,42 @@ BHiveImporter::BasicBlockProtoFromMachineCodeHex(
                                         base_address);
 }
 
-absl::StatusOr<BasicBlockWithThroughputProto> BHiveImporter::ParseBHiveCsvLine(
-    std::string_view source_name, std::string_view line,
-    size_t machine_code_hex_column_index, size_t throughput_column_index,
-    double throughput_scaling /*= 1.0*/, uint64_t base_address /*= 0*/) {
-  const absl::InlinedVector<std::string_view, 2> columns =
-      absl::StrSplit(line, ',');
-  const int min_required_num_columns =
+namespace {
+
+// The columns of a BHive CSV line used by the importer.
+struct BHiveCsvColumns {
+  std::string_view machine_code_hex;
+  std::string_view throughput;
+};
+
+// Finds the machine code and the throughput columns of a BHive CSV line. Scans
+// the line only up to the last of the two columns and does not split the other
+// columns.
+absl::StatusOr<BHiveCsvColumns> FindBHiveCsvColumns(
+    std::string_view line, size_t machine_code_hex_column_index,
+    size_t throughput_column_index) {
+  const size_t min_required_num_columns =
       std::max(machine_code_hex_column_index, throughput_column_index) + 1;
-  if (columns.size() < min_required_num_columns) {
+  BHiveCsvColumns columns;
+  size_t num_columns = 0;
+  size_t column_start = 0;
+  while (num_columns < min_required_num_columns) {
+    size_t column_end = line.find(',', column_start);
+    if (column_end == std::string_view::npos) column_end = line.size();
+    const std::string_view column =
+        line.substr(column_start, column_end - column_start);
+    if (num_columns == machine_code_hex_column_index) {
+      columns.machine_code_hex = column;
+    }
+    if (num_columns == throughput_column_index) columns.throughput = column;
+    ++num_columns;
+    if (column_end == line.size()) break;
+    column_start = column_end + 1;
+  }
+  if (num_columns < min_required_num_columns) {
     return absl::InvalidArgumentError(absl::StrFormat(
         "Expected `line` to have at least %d columns, found %d: %s",
-        min_required_num_columns, columns.size(), line));
+        min_required_num_columns, num_columns, line));
   }
   if (machine_code_hex_column_index == throughput_column_index) {
     return absl::InvalidArgumentError(absl::StrFormat(
@@ -165,16 +242,14 @@ absl::StatusOr<BasicBlockWithThroughputProto> BHiveImporter::ParseBHiveCsvLine(
         "different, but were both %d: %s",
         machine_code_hex_column_index, line));
   }
-  const std::string_view machine_code_hex =
-      columns[machine_code_hex_column_index];
-  const std::string_view throughput_str = columns[throughput_column_index];
-
-  BasicBlockWithThroughputProto proto;
-  absl::StatusOr<BasicBlockProto> block_proto_or_status =
-      BasicBlockProtoFromMachineCodeHex(machine_code_hex, base_address);
-  if (!block_proto_or_status.ok()) return block_proto_or_status.status();
-  *proto.mutable_basic_block() = std::move(block_proto_or_status).value();
+  return columns;
+}
 
+// Adds the throughput from `throughput_str` to `proto`.
+absl::Status AddThroughputFromCsv(std::string_view source_name,
+                                  std::string_view throughput_str,
+                                  double throughput_scaling,
+                                  BasicBlockWithThroughputProto& proto) {
   double throughput_cycles = 0.0;
   if (!absl::SimpleAtod(throughput_str, &throughput_cycles)) {
     return absl::InvalidArgumentError(
@@ -185,14 +260,104 @@ absl::StatusOr<BasicBlockWithThroughputProto> BHiveImporter::ParseBHiveCsvLine(
   throughput.set_source(source_name);
   throughput.add_inverse_throughput_cycles(throughput_cycles *
                                            throughput_scaling);
+  return absl::OkStatus();
+}
+
+}  // namespace
+
+absl::StatusOr<BasicBlockWithThroughputProto> BHiveImporter::ParseBHiveCsvLine(
+    std::string_view source_name, std::string_view line,
+    size_t machine_code_hex_column_index, size_t throughput_column_index,
+    double throughput_scaling /*= 1.0*/, uint64_t base_address /*= 0*/) {
+  GEMATRIA_TRACE_SCOPE("BHiveImporter::ParseBHiveCsvLine");
+  const absl::StatusOr<BHiveCsvColumns> columns = FindBHiveCsvColumns(
+      line, machine_code_hex_column_index, throughput_column_index);
+  if (!columns.ok()) return columns.status();
 
+  BasicBlockWithThroughputProto proto;
+  absl::StatusOr<BasicBlockProto> block_proto_or_status =
+      BasicBlockProtoFromMachineCodeHex(columns->machine_code_hex,
+                                        base_address);
+  if (!block_proto_or_status.ok()) return block_proto_or_status.status();
+  *proto.mutable_basic_block() = std::move(block_proto_or_status).value();
+
+  if (absl::Status status = AddThroughputFromCsv(
+          source_name, columns->throughput, throughput_scaling, proto);
+      !status.ok()) {
+    return status;
+  }
   return proto;
 }
 
+std::vector<absl::StatusOr<BasicBlockWithThroughputProto>>
+BHiveImporter::ParseBHiveCsvLines(std::string_view source_name,
+                                  const std::vector<std::string>& lines,
+                                  size_t machine_code_hex_column_index,
+                                  size_t throughput_column_index,
+                                  double throughput_scaling /*= 1.0*/,
+                                  uint64_t base_address /*= 0*/) {
+  std::vector<absl::StatusOr<BasicBlockWithThroughputProto>> results;
+  results.reserve(lines.size());
+
+  // Decode the machine code of all lines first, so that the hex decoding runs
+  // in a tight loop over the input and writes to a single buffer.
+  std::vector<absl::StatusOr<BHiveCsvColumns>> columns;
+  columns.reserve(lines.size());
+  // The index of the machine code of each line in `machine_code_batch_`, or -1
+  // when the line can't be parsed.
+  std::vector<int64_t> machine_code_indices(lines.size(), -1);
+  machine_code_batch_.Clear();
+  for (size_t i = 0; i < lines.size(); ++i) {
+    columns.push_back(FindBHiveCsvColumns(
+        lines[i], machine_code_hex_column_index, throughput_column_index));
+    if (columns.back().ok() &&
+        machine_code_batch_.Add(columns.back()->machine_code_hex)) {
+      machine_code_indices[i] = machine_code_batch_.size() - 1;
+    }
+  }
+
+  for (size_t i = 0; i < lines.size(); ++i) {
+    if (!columns[i].ok()) {
+      results.push_back(columns[i].status());
+      continue;
+    }
+    if (machine_code_indices[i] < 0) {
+      results.push_back(absl::InvalidArgumentError(
+          absl::StrCat("cannot parse: ", columns[i]->machine_code_hex)));
+      continue;
+    }
+    const size_t index = machine_code_indices[i];
+    BasicBlockWithThroughputProto proto;
+    absl::StatusOr<BasicBlockProto> block_proto_or_status =
+        BasicBlockProtoFromMachineCode(
+            llvm::ArrayRef<uint8_t>(machine_code_batch_.data(index),
+                                    machine_code_batch_.size(index)),
+            base_address);
+    if (!block_proto_or_status.ok()) {
+      results.push_back(block_proto_or_status.status());
+      continue;
+    }
+    *proto.mutable_basic_block() = std::move(block_proto_or_status).value();
+    if (absl::Status status = AddThroughputFromCsv(
+            source_name, columns[i]->throughput, throughput_scaling, proto);
+        !status.ok()) {
+      results.push_back(std::move(status));
+      continue;
+    }
+    results.push_back(std::move(proto));
+  }
+  return results;
+}
+
 absl::StatusOr<BasicBlockProto> BHiveImporter::BasicBlockProtoFromMBB(
     llvm::MachineBasicBlock* MBB, uint64_t base_address /*= 0*/) {
+  GEMATRIA_TRACE_SCOPE("BHiveImporter::BasicBlockProtoFromMBB");
+  ScopedPhaseTimer timer(mir_import_stats_.convert_blocks_nanos);
   BasicBlockProto basic_block_proto;
-  LOG("MBB is " << *MBB);
+  BHIVE_LOG(2, "MBB is " << *MBB);
+  // The canonicalized instruction is reused for all instructions in the block
+  // to avoid allocating its operand lists for each of them.
+  Instruction I;
   for (llvm::MachineInstr& MI : *MBB) {
     // if MI is a control instruction(ret,branch,jmp), skip it
     if (MI.isInlineAsm() || MI.isTerminator() || MI.isEHLabel()) {
@@ -201,18 +366,20 @@ absl::StatusOr<BasicBlockProto> BHiveImporter::BasicBlockProtoFromMBB(
 
     // Assert MI cannot be a CALL instruction
     if (MI.isCall()) {
-      // LOG("MI is a CALL instruction, abort this BB " << MI);
+      BHIVE_LOG(1, "MI is a CALL instruction, abort this BB " << MI);
+      ++mir_import_stats_.num_call_rejections;
       return absl::InvalidArgumentError(
           absl::StrCat("Cannot handle CALL instruction "));
     }
-    auto I = canonicalizer_.InstructionFromMachineInstr(MI);
+    canonicalizer_.InstructionFromMachineInstr(MI, I);
     if (!I.is_valid) {
-      LOG("MI is not valid, skipping it " << MI);
+      BHIVE_LOG(1, "MI is not valid, skipping it " << MI);
+      ++mir_import_stats_.num_unparsable_rejections;
       return absl::InvalidArgumentError(
           absl::StrCat("Could not parse MachineInstr "));
     }
-    *basic_block_proto.add_canonicalized_instructions() =
-        ProtoFromInstruction(I);
+    ProtoFromInstruction(I,
+                         *basic_block_proto.add_canonicalized_instructions());
   }
   return basic_block_proto;
 }
@@ -221,6 +388,7 @@ absl::StatusOr<BasicBlockWithThroughputProto> BHiveImporter::ParseMIRCsvLine(
     std::string_view source_name, std::string_view line, size_t BB_name_index,
     size_t throughput_column_index, double throughput_scaling /*= 1.0*/,
     uint64_t base_address /*= 0*/) {
+  GEMATRIA_TRACE_SCOPE("BHiveImporter::ParseMIRCsvLine");
   const absl::InlinedVector<std::string_view, 2> columns =
       absl::StrSplit(line, ',');
   const int min_required_num_columns =
@@ -240,16 +408,146 @@ absl::StatusOr<BasicBlockWithThroughputProto> BHiveImporter::ParseMIRCsvLine(
   const std::string_view throughput_str = columns[throughput_column_index];
 
   BasicBlockWithThroughputProto proto;
+  absl::StatusOr<BasicBlockProto> block_proto_or_status =
+      BasicBlockProtoFromMBBName(BB_unique_name, base_address);
+  if (!block_proto_or_status.ok()) return block_proto_or_status.status();
+  *proto.mutable_basic_block() = std::move(block_proto_or_status).value();
+
+  double throughput_cycles = 0.0;
+  if (!absl::SimpleAtod(throughput_str, &throughput_cycles)) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Could not parse throughput value ", throughput_str));
+  }
+
+  ThroughputWithSourceProto& throughput = *proto.add_inverse_throughputs();
+  throughput.set_source(source_name);
+  throughput.add_inverse_throughput_cycles(throughput_cycles *
+                                           throughput_scaling);
+  BHIVE_LOG(2, proto.DebugString());
+
+  return proto;
+}
+
+absl::StatusOr<MIRCsvImportStats> BHiveImporter::ParseMIRCsvFile(
+    std::string_view csv_file_name, const MIRCsvImportOptions& options,
+    RecordWriter& writer) {
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer =
+      llvm::MemoryBuffer::getFile(csv_file_name, /*IsText=*/false,
+                                  /*RequiresNullTerminator=*/false);
+  if (!buffer) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Could not open file ", csv_file_name));
+  }
+
+  MIRCsvImportStats stats;
+  BasicBlockDeduplicator deduplicator;
+  // The buffer for the serialized protos is reused for all lines.
+  std::string serialized_block;
+  llvm::StringRef contents = (*buffer)->getBuffer();
+  while (!contents.empty()) {
+    llvm::StringRef line;
+    std::tie(line, contents) = contents.split('\n');
+    line = line.trim();
+    if (line.empty()) continue;
+    ++stats.num_input_lines;
+    if (options.report_progress && options.progress_interval > 0 &&
+        stats.num_input_lines % options.progress_interval == 0) {
+      options.report_progress(stats);
+    }
+
+    const std::string_view line_view(line.data(), line.size());
+    const absl::InlinedVector<std::string_view, 4> columns =
+        absl::StrSplit(line_view, ',');
+    if (options.throughput_column_index < columns.size()) {
+      double throughput = 0.0;
+      if (absl::SimpleAtod(columns[options.throughput_column_index],
+                           &throughput) &&
+          (throughput < options.min_throughput ||
+           throughput > options.max_throughput)) {
+        ++stats.num_filtered_lines;
+        continue;
+      }
+    }
+
+    absl::StatusOr<BasicBlockWithThroughputProto> proto =
+        ParseMIRCsvLine(options.source_name, line_view, options.BB_name_index,
+                        options.throughput_column_index,
+                        options.throughput_scaling, options.base_address);
+    if (!proto.ok()) {
+      ++stats.num_skipped_lines;
+      continue;
+    }
+    if (options.deduplicate_blocks) {
+      deduplicator.Add(*std::move(proto));
+      continue;
+    }
+    proto->SerializeToString(&serialized_block);
+    if (absl::Status status = writer.Write(serialized_block); !status.ok()) {
+      return status;
+    }
+    ++stats.num_imported_blocks;
+  }
+  if (options.deduplicate_blocks) {
+    stats.num_duplicate_blocks = deduplicator.num_duplicates();
+    for (const BasicBlockWithThroughputProto& block :
+         deduplicator.TakeBlocks()) {
+      block.SerializeToString(&serialized_block);
+      if (absl::Status status = writer.Write(serialized_block); !status.ok()) {
+        return status;
+      }
+      ++stats.num_imported_blocks;
+    }
+  }
+  if (options.report_progress) options.report_progress(stats);
+  return stats;
+}
+
+absl::StatusOr<BasicBlockProto> BHiveImporter::BasicBlockProtoFromMBBName(
+    std::string_view MBB_name, uint64_t base_address /*= 0*/) {
+  // The basic blocks in the cache do not depend on `base_address`, because
+  // BasicBlockProtoFromMBB() does not use it.
+  if (mir_block_cache_ != nullptr) {
+    absl::StatusOr<BasicBlockProto> block_proto_or_status =
+        mir_block_cache_->Find(MBB_name);
+    if (block_proto_or_status.status().code() == absl::StatusCode::kNotFound) {
+      ++mir_import_stats_.num_missing_mbb_rejections;
+      return absl::InvalidArgumentError(
+          absl::StrCat("Could not find MBB with name ", MBB_name));
+    }
+    if (block_proto_or_status.ok()) {
+      ++mir_import_stats_.num_cached_blocks;
+    } else {
+      ++mir_import_stats_.num_cached_rejections;
+    }
+    return block_proto_or_status;
+  }
+
   // convert MBB_name to llvm::StringRef
-  llvm::StringRef MBB_name_ref(BB_unique_name.data(), BB_unique_name.size());
+  llvm::StringRef MBB_name_ref(MBB_name.data(), MBB_name.size());
+
+  // In the lazy mode, parse the machine function that contains the MBB first.
+  if (lazy_mir_buffer_ != nullptr) {
+    const auto function_it = lazy_mbb_to_function_.find(MBB_name_ref);
+    if (function_it == lazy_mbb_to_function_.end()) {
+      ++mir_import_stats_.num_missing_mbb_rejections;
+      return absl::InvalidArgumentError(
+          absl::StrCat("Could not find MBB with name ", MBB_name));
+    }
+    if (absl::Status status = MaterializeLazyFunction(function_it->second);
+        !status.ok()) {
+      return status;
+    }
+  }
 
   // lookup the MBB in the map, if not, return error
-  if (name_to_mbb_.find(MBB_name_ref) == name_to_mbb_.end()) {
+  const auto mbb_it = name_to_mbb_.find(MBB_name_ref);
+  if (mbb_it == name_to_mbb_.end()) {
+    ++mir_import_stats_.num_missing_mbb_rejections;
     return absl::InvalidArgumentError(
-        absl::StrCat("Could not find MBB with name ", BB_unique_name));
+        absl::StrCat("Could not find MBB with name ", MBB_name));
   }
 
-  llvm::MachineBasicBlock* MBB = name_to_mbb_[MBB_name_ref];
+  llvm::MachineBasicBlock* MBB = mbb_it->second;
 
   absl::StatusOr<BasicBlockProto> block_proto_or_status =
       BasicBlockProtoFromMBB(MBB, base_address);
@@ -264,39 +562,117 @@ absl::StatusOr<BasicBlockWithThroughputProto> BHiveImporter::ParseMIRCsvLine(
     auto instrument_result = addInterferenceGraph(
         *block_proto_or_status, func_to_live_intervals_[func_name],
         func_to_live_intervals_[func_name]
-            .BBRangeList[std::string(BB_unique_name)]);
+            .BBRangeList[std::string(MBB_name)]);
     if (!instrument_result.ok()) {
+      BHIVE_LOG(1, "Could not instrument interference graph for BB "
+                       << MBB_name_ref << ": "
+                       << instrument_result.status().ToString());
+      ++mir_import_stats_.num_interference_rejections;
       return absl::InvalidArgumentError(absl::StrCat(
-          "Could not instrument interference graph for BB ", BB_unique_name));
+          "Could not instrument interference graph for BB ", MBB_name));
     }
   }
-  
-  *proto.mutable_basic_block() = std::move(block_proto_or_status).value();
+  ++mir_import_stats_.num_parsed_blocks;
+  return block_proto_or_status;
+}
 
-  double throughput_cycles = 0.0;
-  if (!absl::SimpleAtod(throughput_str, &throughput_cycles)) {
-    return absl::InvalidArgumentError(
-        absl::StrCat("Could not parse throughput value ", throughput_str));
+absl::StatusOr<std::string_view> BHiveImporter::GetFunctionNameOfMBB(
+    std::string_view MBB_name) const {
+  if (mir_block_cache_ != nullptr) {
+    return absl::FailedPreconditionError(
+        "The MIR block cache does not record the functions of basic blocks");
   }
+  const llvm::StringRef MBB_name_ref(MBB_name.data(), MBB_name.size());
+  llvm::StringRef function_name;
+  if (lazy_mir_buffer_ != nullptr) {
+    const auto it = lazy_mbb_to_function_.find(MBB_name_ref);
+    if (it != lazy_mbb_to_function_.end()) {
+      function_name = lazy_functions_[it->second].name;
+    }
+  } else {
+    const auto it = name_to_mbb_.find(MBB_name_ref);
+    if (it != name_to_mbb_.end()) {
+      function_name = it->second->getParent()->getName();
+    }
+  }
+  if (function_name.empty()) {
+    return absl::NotFoundError(
+        absl::StrCat("Could not find MBB with name ", MBB_name));
+  }
+  return std::string_view(function_name.data(), function_name.size());
+}
 
-  ThroughputWithSourceProto& throughput = *proto.add_inverse_throughputs();
-  throughput.set_source(source_name);
-  throughput.add_inverse_throughput_cycles(throughput_cycles *
-                                           throughput_scaling);
-  LOG(proto.DebugString());
+absl::StatusOr<bool> BHiveImporter::LoadMIRModuleWithCache(
+    std::string_view file_name, std::string_view live_info_file_name,
+    std::string_view cache_dir) {
+  std::vector<std::string_view> input_file_names = {file_name};
+  if (model_type_ != MODEL_TYPE::NO_LIVE_INFO) {
+    input_file_names.push_back(live_info_file_name);
+  }
+  absl::StatusOr<uint64_t> key;
+  std::string cache_file_name;
+  absl::StatusOr<std::unique_ptr<MirBlockCache>> cache;
+  {
+    ScopedPhaseTimer timer(mir_import_stats_.load_mir_nanos);
+    key = ComputeMirBlockCacheKey(
+        input_file_names,
+        absl::StrCat("model_type=", static_cast<int>(model_type_),
+                     ";triple=", target_machine_.getTargetTriple().str()));
+    if (!key.ok()) return key.status();
+    llvm::SmallString<128> cache_path{llvm::StringRef(cache_dir)};
+    llvm::sys::path::append(cache_path,
+                            llvm::Twine::utohexstr(*key) + ".mbbcache");
+    cache_file_name = cache_path.str().str();
+    cache = MirBlockCache::Open(cache_file_name, *key);
+  }
+  if (cache.ok()) {
+    BHIVE_LOG(1, "Using MIR block cache " << cache_file_name << " for "
+                                          << file_name);
+    ClearMIRModule();
+    mir_block_cache_ = *std::move(cache);
+    return true;
+  }
 
-  return proto;
+  absl::StatusOr<bool> load_result = LoadMIRModule(file_name);
+  if (!load_result.ok()) return load_result;
+  if (model_type_ != MODEL_TYPE::NO_LIVE_INFO) {
+    load_result = InteferenceGraphParser(live_info_file_name);
+    if (!load_result.ok()) return load_result;
+  }
+
+  MirBlockCacheWriter writer;
+  for (const auto& [MBB_name, MBB] : name_to_mbb_) {
+    const std::string_view name(MBB_name.data(), MBB_name.size());
+    absl::StatusOr<BasicBlockProto> block_proto_or_status =
+        BasicBlockProtoFromMBBName(name);
+    if (block_proto_or_status.ok()) {
+      writer.Add(name, *block_proto_or_status);
+    } else {
+      writer.AddError(name, block_proto_or_status.status());
+    }
+  }
+  // Failing to write the cache does not affect the import.
+  absl::Status write_status = absl::OkStatus();
+  if (std::error_code error = llvm::sys::fs::create_directories(
+          llvm::StringRef(cache_dir))) {
+    write_status = absl::InternalError(absl::StrCat(
+        "Could not create directory ", cache_dir, ": ", error.message()));
+  } else {
+    write_status = writer.Write(cache_file_name, *key);
+  }
+  if (!write_status.ok()) {
+    llvm::WithColor::warning() << "Could not write the MIR block cache: "
+                               << write_status.ToString() << "\n";
+  }
+  return false;
 }
 
 absl::StatusOr<bool> BHiveImporter::LoadMIRModule(std::string_view file_name) {
+  GEMATRIA_TRACE_SCOPE("BHiveImporter::LoadMIRModule");
+  ScopedPhaseTimer timer(mir_import_stats_.load_mir_nanos);
+  BHIVE_LOG(1, "Loading MIR file " << file_name);
   // clear previous loaded module
-  func_to_live_intervals_.clear();
-  name_to_mbb_.clear();
-  if (mir_module_) {
-    for (llvm::Function& F : mir_module_->functions()) {
-      MMI_.deleteMachineFunctionFor(F);
-    }
-  }
+  ClearMIRModule();
 
   // create MIR Parser and read all MBB to the map based on their unique name
   llvm::SMDiagnostic diag;
@@ -341,16 +717,279 @@ absl::StatusOr<bool> BHiveImporter::LoadMIRModule(std::string_view file_name) {
   return true;
 }
 
+namespace {
+
+// A machine function document in the text of a MIR file.
+struct MIRFunctionDocument {
+  llvm::StringRef name;
+  // The text of the document, including the "---" line that starts it.
+  llvm::StringRef text;
+  // The names of the basic blocks of the function, i.e. the names of the
+  // corresponding LLVM IR basic blocks.
+  llvm::SmallVector<llvm::StringRef, 8> block_names;
+};
+
+// Removes the quotes around a YAML scalar, if there are any.
+llvm::StringRef unquoteYAMLScalar(llvm::StringRef value) {
+  if (value.size() >= 2 && (value.front() == '\'' || value.front() == '"') &&
+      value.back() == value.front()) {
+    return value.drop_front().drop_back();
+  }
+  return value;
+}
+
+// Splits the text of a MIR file into the LLVM IR document and the machine
+// function documents, without parsing them. Expects the format printed by
+// llc: each document starts with a "---" line at the beginning of a line and
+// optionally ends with a "..." line, the LLVM IR document starts with "--- |",
+// the name of a machine function is in a "name:" line, and the basic blocks
+// are defined by lines "  bb.{number}.{name}:" in the function body.
+void splitMIRDocuments(llvm::StringRef text, llvm::StringRef& ir_document,
+                       std::vector<MIRFunctionDocument>& functions) {
+  ir_document = llvm::StringRef();
+  functions.clear();
+  // The start of the current document; nullptr when outside of a document.
+  const char* document_start = nullptr;
+  bool is_ir_document = false;
+  auto finish_document = [&](const char* document_end) {
+    if (document_start == nullptr) return;
+    const llvm::StringRef document(document_start,
+                                   document_end - document_start);
+    if (is_ir_document) {
+      if (ir_document.empty()) ir_document = document;
+    } else if (!functions.empty() && functions.back().text.empty()) {
+      functions.back().text = document;
+    }
+    document_start = nullptr;
+  };
+
+  llvm::StringRef rest = text;
+  while (!rest.empty()) {
+    const size_t line_end = rest.find('\n');
+    const llvm::StringRef line_with_end =
+        line_end == llvm::StringRef::npos ? rest : rest.take_front(line_end + 1);
+    const llvm::StringRef line = line_with_end.rtrim();
+    rest = rest.drop_front(line_with_end.size());
+    if (line.startswith("---")) {
+      finish_document(line.data());
+      document_start = line.data();
+      is_ir_document = line.drop_front(3).ltrim().startswith("|");
+      if (!is_ir_document) functions.emplace_back();
+      continue;
+    }
+    if (line == "...") {
+      finish_document(line_with_end.data() + line_with_end.size());
+      continue;
+    }
+    if (document_start == nullptr || is_ir_document) continue;
+    MIRFunctionDocument& function = functions.back();
+    if (line.startswith("name:")) {
+      function.name = unquoteYAMLScalar(line.drop_front(5).trim());
+    } else if (line.startswith("  bb.")) {
+      // Skip the number of the basic block; blocks without a name have no
+      // corresponding LLVM IR basic block.
+      llvm::StringRef block = line.drop_front(5);
+      block = block.drop_while([](char c) { return llvm::isDigit(c); });
+      if (!block.consume_front(".")) continue;
+      const llvm::StringRef block_name =
+          block.take_until([](char c) { return c == ':' || c == ' '; });
+      if (!block_name.empty()) {
+        function.block_names.push_back(unquoteYAMLScalar(block_name));
+      }
+    }
+  }
+  finish_document(text.data() + text.size());
+  // Drop documents that do not look like machine functions.
+  functions.erase(std::remove_if(functions.begin(), functions.end(),
+                                 [](const MIRFunctionDocument& function) {
+                                   return function.name.empty() ||
+                                          function.text.empty();
+                                 }),
+                  functions.end());
+}
+
+// Returns the name of the function defined by an LLVM IR line that starts
+// with "define", e.g. `foo` for "define dso_local i32 @foo(i32 %0) {".
+llvm::StringRef getDefinedFunctionName(llvm::StringRef define_line) {
+  llvm::StringRef name = define_line.drop_until([](char c) { return c == '@'; });
+  name = name.drop_front();
+  if (name.consume_front("\"")) return name.take_until([](char c) {
+    return c == '"';
+  });
+  return name.take_until([](char c) { return c == '('; });
+}
+
+// Appends the LLVM IR document `ir_document` to `out`, replacing the bodies of
+// all functions other than `function_name` with `unreachable`. The other
+// functions stay defined, so that all references to them and all attributes
+// and metadata remain valid, but they take almost no memory after parsing.
+void appendIRDocumentForFunction(llvm::StringRef ir_document,
+                                 llvm::StringRef function_name,
+                                 std::string& out) {
+  // The document is a YAML block scalar with the LLVM IR indented by two
+  // spaces, so a function body starts with "  define" and ends with "  }".
+  bool in_function_body = false;
+  llvm::StringRef rest = ir_document;
+  while (!rest.empty()) {
+    const size_t line_end = rest.find('\n');
+    const llvm::StringRef line_with_end =
+        line_end == llvm::StringRef::npos ? rest : rest.take_front(line_end + 1);
+    const llvm::StringRef line = line_with_end.rtrim();
+    rest = rest.drop_front(line_with_end.size());
+    if (in_function_body) {
+      if (line == "  }") in_function_body = false;
+      continue;
+    }
+    out.append(line_with_end.data(), line_with_end.size());
+    if (line.startswith("  define ") && line.endswith("{") &&
+        getDefinedFunctionName(line) != function_name) {
+      out.append("    unreachable\n  }\n");
+      in_function_body = true;
+    }
+  }
+  if (!out.empty() && out.back() != '\n') out.push_back('\n');
+}
+
+}  // namespace
+
+absl::StatusOr<bool> BHiveImporter::LoadMIRModuleLazily(
+    std::string_view file_name) {
+  GEMATRIA_TRACE_SCOPE("BHiveImporter::LoadMIRModuleLazily");
+  ScopedPhaseTimer timer(mir_import_stats_.load_mir_nanos);
+  BHIVE_LOG(1, "Indexing MIR file " << file_name);
+  ClearMIRModule();
+
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer =
+      llvm::MemoryBuffer::getFile(file_name, /*IsText=*/false,
+                                  /*RequiresNullTerminator=*/false);
+  if (!buffer) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Could not open file ", file_name));
+  }
+  llvm::StringRef ir_document;
+  std::vector<MIRFunctionDocument> functions;
+  splitMIRDocuments((*buffer)->getBuffer(), ir_document, functions);
+  if (ir_document.empty()) {
+    // Without LLVM IR, the basic blocks do not have names.
+    return absl::InvalidArgumentError(
+        absl::StrCat("Could not find the LLVM IR module in file ", file_name));
+  }
+
+  // Same as in LoadMIRModule(), MBB names that are not unique are dropped.
+  llvm::DenseSet<llvm::StringRef> duplicate_names;
+  lazy_functions_.reserve(functions.size());
+  for (const MIRFunctionDocument& function : functions) {
+    const size_t function_index = lazy_functions_.size();
+    lazy_functions_.push_back({function.name, function.text});
+    for (const llvm::StringRef block_name : function.block_names) {
+      if (!lazy_mbb_to_function_.try_emplace(block_name, function_index)
+               .second) {
+        duplicate_names.insert(block_name);
+      }
+    }
+  }
+  for (const llvm::StringRef block_name : duplicate_names) {
+    lazy_mbb_to_function_.erase(block_name);
+  }
+  lazy_ir_document_ = ir_document;
+  lazy_mir_buffer_ = std::move(*buffer);
+  lazy_mir_file_name_ = std::string(file_name);
+  return true;
+}
+
+absl::Status BHiveImporter::MaterializeLazyFunction(size_t function_index) {
+  if (materialized_function_ == function_index) return absl::OkStatus();
+  GEMATRIA_TRACE_SCOPE("BHiveImporter::MaterializeLazyFunction");
+  ScopedPhaseTimer timer(mir_import_stats_.load_mir_nanos);
+  ReleaseMaterializedFunction();
+
+  // The machine function refers to the LLVM IR module through the numbers of
+  // metadata nodes and other slots that are valid only within one parsed MIR
+  // file. We thus parse a MIR file with the LLVM IR reduced to the function and
+  // its dependencies, followed by the machine function.
+  const LazyMachineFunction& function = lazy_functions_[function_index];
+  std::string document;
+  appendIRDocumentForFunction(lazy_ir_document_, function.name, document);
+  document.append(function.document.data(), function.document.size());
+
+  const std::string& file_name = lazy_mir_file_name_;
+  mir_parser_ = llvm::createMIRParser(
+      llvm::MemoryBuffer::getMemBufferCopy(document, file_name), llvm_context_);
+  if (!mir_parser_) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Could not create MIR parser for file ", file_name));
+  }
+  mir_module_ = mir_parser_->parseIRModule();
+  if (!mir_module_) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Could not parse MIR module for function ", function.name.str(),
+        " in file ", file_name));
+  }
+  MMI_.initialize();
+  if (mir_parser_->parseMachineFunctions(*mir_module_, MMI_)) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Could not parse MachineFunction ", function.name.str(), " in file ",
+        file_name));
+  }
+  llvm::Function* const F = mir_module_->getFunction(function.name);
+  llvm::MachineFunction* const MF =
+      F == nullptr ? nullptr : MMI_.getMachineFunction(*F);
+  if (MF == nullptr) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Could not parse MachineFunction ", function.name.str(), " in file ",
+        file_name));
+  }
+  for (llvm::MachineBasicBlock& MBB : *MF) {
+    const auto it = lazy_mbb_to_function_.find(MBB.getName());
+    if (it != lazy_mbb_to_function_.end() && it->second == function_index) {
+      name_to_mbb_[MBB.getName()] = &MBB;
+    }
+  }
+  materialized_function_ = function_index;
+  return absl::OkStatus();
+}
+
+void BHiveImporter::ReleaseMaterializedFunction() {
+  name_to_mbb_.clear();
+  if (materialized_function_ == kNoMaterializedFunction) return;
+  for (llvm::Function& F : mir_module_->functions()) {
+    MMI_.deleteMachineFunctionFor(F);
+  }
+  mir_module_.reset();
+  mir_parser_.reset();
+  materialized_function_ = kNoMaterializedFunction;
+}
+
+void BHiveImporter::ClearMIRModule() {
+  mir_block_cache_.reset();
+  func_to_live_intervals_.clear();
+  name_to_mbb_.clear();
+  if (mir_module_) {
+    for (llvm::Function& F : mir_module_->functions()) {
+      MMI_.deleteMachineFunctionFor(F);
+    }
+  }
+  lazy_mbb_to_function_.clear();
+  lazy_functions_.clear();
+  lazy_ir_document_ = llvm::StringRef();
+  lazy_mir_buffer_.reset();
+  lazy_mir_file_name_.clear();
+  materialized_function_ = kNoMaterializedFunction;
+}
+
+// The debug utilities below print to stderr whenever they are called,
+// independently of GEMATRIA_BHIVE_IMPORTER_LOG_LEVEL.
+
 // Debug Utilities that prints information of a single RegLiveIntervals
 void printRegLiveIntervals(BHiveImporter::RegLiveIntervals LI) {
-  LOG("Information of Single RegLiveIntervals named: " << LI.name);
+  llvm::errs() << "Information of Single RegLiveIntervals named: " << LI.name << "\n";
 
   for (BHiveImporter::BhiveLiveRange range : LI.rangeList) {
-    LOG("  Live range: " << range.first << ", " << range.second);
+    llvm::errs() << "  Live range: " << range.first << ", " << range.second << "\n";
   }
 
-  LOG("  Anchor: " << LI.anchor);
-  LOG("  Weight: " << LI.weight);
+  llvm::errs() << "  Anchor: " << LI.anchor << "\n";
+  llvm::errs() << "  Weight: " << LI.weight << "\n";
 }
 
 // Debug Utilities for FunctionLiveIntervalInfoMap, which includes
@@ -368,24 +1007,35 @@ void printMap(
     // Print live range of register
     for (auto& pairInfo :
          functionInfoPair.second.virtual_register_live_range_func) {
-      LOG("Virtual Register Name: " << pairInfo.first);
+      llvm::errs() << "Virtual Register Name: " << pairInfo.first << "\n";
       printRegLiveIntervals(pairInfo.second);
     }
 
     for (auto& pairInfo :
          functionInfoPair.second.physical_register_live_range_func) {
-      LOG("Physical Register Name: " << pairInfo.first);
+      llvm::errs() << "Physical Register Name: " << pairInfo.second.name << "\n";
       printRegLiveIntervals(pairInfo.second);
     }
 
     // And also we test the BBrange as well
     for (auto& pairInfo : functionInfoPair.second.BBRangeList) {
-      LOG("BB Name: " << pairInfo.first);
-      LOG("  Live range: " << pairInfo.second.first << ", "
-                           << pairInfo.second.second);
+      llvm::errs() << "BB Name: " << pairInfo.first << "\n";
+      llvm::errs() << "  Live range: " << pairInfo.second.first << ", "
+                   << pairInfo.second.second << "\n";
     }
 
-    LOG("-------End of a Function-------");
+    llvm::errs() << "-------End of a Function-------" << "\n";
+  }
+}
+
+void BHiveImporter::prettyPrintSuperReg2SubReg() const {
+  const llvm::MCRegisterInfo& MRI = *target_machine_.getMCRegisterInfo();
+  llvm::errs() << "SuperReg2SubReg: \n";
+  for (llvm::MCPhysReg superreg = 1; superreg < MRI.getNumRegs(); ++superreg) {
+    llvm::errs() << MRI.getName(superreg) << ": \n";
+    for (const llvm::MCPhysReg sub : getSubRegisters(superreg)) {
+      llvm::errs() << "\t" << MRI.getName(sub) << "\n";
+    }
   }
 }
 
@@ -398,179 +1048,251 @@ static bool areIntersected(const BHiveImporter::BhiveLiveRange& range1,
   return true;  // Ranges are intersected.
 }
 
+namespace {
+
+// A tokenizer for one line of the live info file. The line is tokenized in
+// place, without copying it. The methods skip leading whitespace the same way
+// as the `operator>>` extractions on a std::istream.
+class LiveInfoLineTokenizer {
+ public:
+  explicit LiveInfoLineTokenizer(llvm::StringRef line) : rest_(line) {}
+
+  // Returns the next whitespace-delimited token, or an empty string at the end
+  // of the line.
+  llvm::StringRef NextToken() {
+    rest_ = rest_.ltrim();
+    const size_t token_end = rest_.find_first_of(kWhitespace);
+    const llvm::StringRef token = rest_.take_front(token_end);
+    rest_ = rest_.drop_front(token.size());
+    return token;
+  }
+
+  // Skips one non-whitespace character. Returns false at the end of the line.
+  bool SkipChar() {
+    rest_ = rest_.ltrim();
+    if (rest_.empty()) return false;
+    rest_ = rest_.drop_front();
+    return true;
+  }
+
+  // Reads an unsigned decimal number. Returns false when the next token does
+  // not start with a number.
+  bool ReadUnsigned(unsigned int& value) {
+    rest_ = rest_.ltrim();
+    // consumeInteger() returns true on error.
+    return !rest_.consumeInteger(10, value);
+  }
+
+  // Reads a live range in the format "[{start}{slot},{end}{slot}:{value})",
+  // e.g. "[16r,32B:0)". The slot letters and the value number are ignored.
+  bool ReadLiveRange(BHiveImporter::BhiveLiveRange& range) {
+    unsigned int value_number = 0;
+    return SkipChar() && ReadUnsigned(range.first) && SkipChar() &&
+           SkipChar() && ReadUnsigned(range.second) && SkipChar() &&
+           SkipChar() && ReadUnsigned(value_number) && SkipChar();
+  }
+
+ private:
+  static constexpr llvm::StringLiteral kWhitespace = " \t\n\v\f\r";
+
+  llvm::StringRef rest_;
+};
+
+}  // namespace
+
 absl::StatusOr<bool> BHiveImporter::InteferenceGraphParser(
     std::string_view file_name) {
-  // Boilerplate for reading input
-  std::ifstream input_file{std::string(file_name)};
+  return InteferenceGraphParserForFunctions(file_name, nullptr);
+}
 
-  if (!input_file.is_open()) {
+absl::StatusOr<bool> BHiveImporter::InteferenceGraphParserForFunctions(
+    std::string_view file_name,
+    const std::function<bool(std::string_view)>& keep_function) {
+  GEMATRIA_TRACE_SCOPE("BHiveImporter::InteferenceGraphParser");
+  ScopedPhaseTimer timer(mir_import_stats_.parse_live_info_nanos);
+  // The file is memory-mapped when it is large enough, and it is processed in
+  // place: the lines and tokens are references into the buffer.
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer =
+      llvm::MemoryBuffer::getFile(file_name, /*IsText=*/false,
+                                  /*RequiresNullTerminator=*/false);
+  if (!buffer) {
     return absl::InvalidArgumentError(
         absl::StrCat("Could not open file ", file_name));
   }
-  // FunctionLiveIntervalInfo Denotes all live ranges and bb ranges for a single
-  // function FunctionLiveIntervalInfoList is a llvm smal vector that stores
-  // FunctionLiveIntervalInfo We read one line at a time
-  std::string line;
 
-  // For each function, we need to first store an empty info into the hashmap
-  // and then modify its contents while it is in hasmap
-  // To do this, we need to have an allias called "ref" that refers to info
-  // That is already stored in the hashmap
+  // The file contains a sequence of functions. Each function starts with a line
+  // with the name of the function, followed by the live ranges of the
+  // registers, one register per line, e.g.
+  //   %0 [112r,160r:0) 0@112r  weight:0.000000e+00
+  //   AH [272r,304r:1)[384r,416r:0) 0@272r 1@384r
+  // The list of registers is terminated by a "RegMasks" line, followed by the
+  // ranges of the basic blocks of the function, e.g.
+  //   BB_0: 0B 208B
+  // `info` is nullptr while parsing a function that is not kept.
   FunctionLiveIntervalInfo* info = nullptr;
-  std::string curFuncName = "dummy";
   bool isParsingRegister = false;
+  // The register and basic block names are copied to these strings before
+  // using them as keys, so that the lookups do not allocate memory.
+  std::string register_name;
+  std::string bb_name;
+
+  llvm::StringRef contents = (*buffer)->getBuffer();
+  while (!contents.empty()) {
+    llvm::StringRef line;
+    std::tie(line, contents) = contents.split('\n');
+    LiveInfoLineTokenizer tokenizer(line);
+    const llvm::StringRef first_token = tokenizer.NextToken();
+    // Skip empty lines.
+    if (first_token.empty()) continue;
 
-  // Read each line
-  while (std::getline(input_file, line)) {
-    std::istringstream lineStream(line);
-
-    // if we encounter a '%' symbol at the beginning, then we encountered a live
-    // interval register
     if (isParsingRegister) {
-      if (line.substr(0, 8) == "RegMasks") {
+      if (line.startswith("RegMasks")) {
         isParsingRegister = false;
-        // LOG("End of parsing register");
         continue;
       }
-      std::string currentRegister;
-      unsigned int start, end, discard;
-      char dummy;
-
-      bool is_virtual = line[0] == '%';
-
-      // Get the register name first
-      lineStream >> currentRegister;
-
-      // Understand how many life ranges are there in this line
-      uint32_t numberLiveRanges = std::count(line.begin(), line.end(), '[');
-
-      // Now we need to read the starting and ending indices of a live range
-      for (uint32_t count = 0; count < numberLiveRanges; count++) {
-        lineStream >> dummy >> start >> dummy >> dummy >> end >> dummy >>
-            dummy >> discard >> dummy;
-
-        // Since LLVM do not support [] operator we need to find it first
-        auto resultRegLiveIntervals =
-            (is_virtual)
-                ? info->virtual_register_live_range_func.find(currentRegister)
-                : info->physical_register_live_range_func.find(currentRegister);
-
-        // If you find the current register in the register_live_range_func,
-        // you insert a BhiveLiveRange with {start, end} in the range list of
-        // the find return If not, then you insert a new pair: {currentRegister,
-        // RegLiveIntervals}
-        if (is_virtual) {
-          if (resultRegLiveIntervals !=
-              info->virtual_register_live_range_func.end()) {
-            // If you find the register, then you insert a new range
-            resultRegLiveIntervals->second.rangeList.push_back({start, end});
-          } else {
-            // If you do not find the register, then you insert a new pair
-            // {currentRegister, RegLiveIntervals}
-            RegLiveIntervals newRegLiveIntervals;
-            newRegLiveIntervals.name = currentRegister;
-            newRegLiveIntervals.rangeList.push_back({start, end});
-            info->virtual_register_live_range_func.insert(
-                {currentRegister, newRegLiveIntervals});
-          }
-        } else {
-          if (resultRegLiveIntervals !=
-              info->physical_register_live_range_func.end()) {
-            // If you find the register, then you insert a new range
-            resultRegLiveIntervals->second.rangeList.push_back({start, end});
-          } else {
-            // If you do not find the register, then you insert a new pair
-            // {currentRegister, RegLiveIntervals}
-            RegLiveIntervals newRegLiveIntervals;
-            newRegLiveIntervals.name = currentRegister;
-            newRegLiveIntervals.rangeList.push_back({start, end});
-            info->physical_register_live_range_func.insert(
-                {currentRegister, newRegLiveIntervals});
-          }
+      if (info == nullptr) continue;
+      const size_t num_live_ranges = line.count('[');
+      if (num_live_ranges == 0) continue;
+
+      RegLiveIntervals* live_intervals = nullptr;
+      if (line.front() == '%') {
+        auto& live_ranges = info->virtual_register_live_range_func;
+        register_name.assign(first_token.data(), first_token.size());
+        auto it = live_ranges.find(register_name);
+        if (it == live_ranges.end()) {
+          RegLiveIntervals new_live_intervals;
+          new_live_intervals.name = register_name;
+          it = live_ranges.emplace(register_name, std::move(new_live_intervals))
+                   .first;
         }
+        live_intervals = &it->second;
+      } else {
+        // Physical registers that are not known to the target can't be used
+        // by any instruction; their live ranges are ignored.
+        const auto reg_it = name_to_register_.find(first_token);
+        if (reg_it == name_to_register_.end()) continue;
+        auto [it, inserted] =
+            info->physical_register_live_range_func.try_emplace(
+                reg_it->second);
+        if (inserted) it->second.name = first_token.str();
+        live_intervals = &it->second;
+      }
+      llvm::SmallVector<BhiveLiveRange>& range_list = live_intervals->rangeList;
+      range_list.reserve(range_list.size() + num_live_ranges);
+      for (size_t i = 0; i < num_live_ranges; ++i) {
+        BhiveLiveRange range;
+        if (!tokenizer.ReadLiveRange(range)) break;
+        range_list.push_back(range);
+      }
+    } else if (line.startswith("BB_")) {
+      // The name of the basic block is followed by ':'.
+      llvm::StringRef bb_name_token = first_token;
+      bb_name_token.consume_back(":");
+      BhiveLiveRange range;
+      if (info != nullptr && tokenizer.ReadUnsigned(range.first) &&
+          tokenizer.SkipChar() &&
+          tokenizer.ReadUnsigned(range.second)) {
+        bb_name.assign(bb_name_token.data(), bb_name_token.size());
+        info->BBRangeList[bb_name] = range;
       }
-    }
-
-    // If we encounter a "BB_" symbol, then we encounter a BB entry
-    else if (line.substr(0, 3) == "BB_") {
-      std::string currentBB;
-      unsigned int start, end;
-      char dummy;
-      std::string junk;
-
-      // Read name of BB and delete the trailing ':'
-      lineStream >> currentBB;
-      if (currentBB[currentBB.size() - 1] == ':')
-        currentBB.erase(currentBB.size() - 1);
-
-      // read range
-      lineStream >> start >> dummy >> end;
-
-      info->BBRangeList[currentBB] = {start, end};
       isParsingRegister = false;
-    }
-
-    // In this case, we arrived at the definition of a new function
-    // In this case we need to
-    else {
-      // We reached the end of a function, add info to the Map
-      // If this is the beginning of a new function, just add
-      // a dummy value and delete it at the end
-
-      std::string copyName(line);
-      // Store new function name and information
-      lineStream >> curFuncName;
-      // LOG("curr Function name is : " << curFuncName);
-      func_to_live_intervals_[curFuncName] = FunctionLiveIntervalInfo();
-      info = &func_to_live_intervals_[curFuncName];
+    } else {
+      // We arrived at the definition of a new function.
       isParsingRegister = true;
+      if (keep_function &&
+          !keep_function(
+              std::string_view(first_token.data(), first_token.size()))) {
+        info = nullptr;
+        continue;
+      }
+      info = &func_to_live_intervals_[first_token.str()];
+      *info = FunctionLiveIntervalInfo();
     }
   }
 
-  // Now we want to debug and print things inside the FunctionLiveIntervalMap
-  // printMap(func_to_live_intervals_);
   return true;
 }
 
-static absl::StatusOr<bool> checkRegIntersectionsWithBBRange(
-    const BHiveImporter::RegLiveIntervals& reg_live_interval1,
-    const BHiveImporter::RegLiveIntervals& reg_live_interval2,
+namespace {
+
+// The live ranges of one register that intersect with a basic block.
+using RangesInBlock = llvm::SmallVector<BHiveImporter::BhiveLiveRange, 2>;
+
+RangesInBlock getRangesInBlock(
+    const BHiveImporter::RegLiveIntervals& reg_live_interval,
     const BHiveImporter::BhiveLiveRange& bb_range) {
-  bool is_reg1_in_bb = false;
-  const BHiveImporter::BhiveLiveRange* range1HitsBB = nullptr;
-  for (auto& interval : reg_live_interval1.rangeList) {
-    if (areIntersected(interval, bb_range)) {
-      if (is_reg1_in_bb) {
-        // cannot have two live ranges of the same register in
-        // the same basic block. (To avoid confuse graph builder)
-        return absl::InvalidArgumentError(
-            absl::StrCat("Cannot have two live ranges of the same register %s "
-                         "in the same block",
-                         reg_live_interval1.name));
-      }
-      is_reg1_in_bb = true;
-      range1HitsBB = &interval;
-    }
+  RangesInBlock ranges;
+  for (const BHiveImporter::BhiveLiveRange& interval :
+       reg_live_interval.rangeList) {
+    if (areIntersected(interval, bb_range)) ranges.push_back(interval);
   }
-  if (!range1HitsBB) {
-    return false;
+  return ranges;
+}
+
+// Returns the only live range of a register in a basic block, or nullptr when
+// the register is not live in the block.
+absl::StatusOr<const BHiveImporter::BhiveLiveRange*> getUniqueRangeInBlock(
+    const BHiveImporter::RegLiveIntervals& reg_live_interval,
+    const RangesInBlock& ranges_in_block) {
+  if (ranges_in_block.size() > 1) {
+    // cannot have two live ranges of the same register in
+    // the same basic block. (To avoid confuse graph builder)
+    return absl::InvalidArgumentError(
+        absl::StrCat("Cannot have two live ranges of the same register %s "
+                     "in the same block",
+                     reg_live_interval.name));
   }
-  for (auto& interval : reg_live_interval2.rangeList) {
-    if (areIntersected(interval, bb_range)) {
-      if (areIntersected(*range1HitsBB, interval)) {
-        return true;
-      }
-    }
+  if (ranges_in_block.empty()) return nullptr;
+  return &ranges_in_block.front();
+}
+
+bool intersectsAny(const BHiveImporter::BhiveLiveRange& range,
+                   const RangesInBlock& ranges_in_block) {
+  for (const BHiveImporter::BhiveLiveRange& interval : ranges_in_block) {
+    if (areIntersected(range, interval)) return true;
   }
   return false;
 }
 
+// Builds the index of the live ranges of all virtual registers in the function.
+// The IDs in the index are the positions of the registers in the iteration
+// order of virtual_register_live_range_func.
+void buildVirtualRegisterRangeIndex(
+    BHiveImporter::FunctionLiveIntervalInfo& func_live_infos) {
+  std::vector<LiveRangeIndex::Entry> entries;
+  func_live_infos.virtual_register_names.clear();
+  func_live_infos.virtual_register_names.reserve(
+      func_live_infos.virtual_register_live_range_func.size());
+  for (const auto& [vReg, liveInterval] :
+       func_live_infos.virtual_register_live_range_func) {
+    const int id = func_live_infos.virtual_register_names.size();
+    func_live_infos.virtual_register_names.push_back(&vReg);
+    for (const BHiveImporter::BhiveLiveRange& range : liveInterval.rangeList) {
+      entries.push_back({range, id});
+    }
+  }
+  func_live_infos.virtual_register_range_index =
+      LiveRangeIndex(std::move(entries));
+  func_live_infos.has_virtual_register_range_index = true;
+}
+
+}  // namespace
+
 absl::StatusOr<bool> BHiveImporter::addInterferenceGraph(
     BasicBlockProto& bb_proto,
     BHiveImporter::FunctionLiveIntervalInfo& func_live_infos,
     BHiveImporter::BhiveLiveRange& bb_range) {
+  GEMATRIA_TRACE_SCOPE("BHiveImporter::addInterferenceGraph");
+  ScopedPhaseTimer timer(mir_import_stats_.interference_nanos);
   std::unordered_map<std::string, int> live_virtual_registers;
   std::unordered_map<std::string, int> live_physical_registers;
+  // The entries of live_physical_registers with the register numbers.
+  struct LivePhysicalRegister {
+    const std::string* name;
+    llvm::MCPhysReg reg;
+    int size;
+  };
+  llvm::SmallVector<LivePhysicalRegister, 16> live_physical_reg_ids;
 
   // helper function to update live_virtual_registers and
   // live_physical_registers
@@ -605,67 +1327,116 @@ absl::StatusOr<bool> BHiveImporter::addInterferenceGraph(
     }
   };
 
+  auto& virtual_register_live_range_func =
+      func_live_infos.virtual_register_live_range_func;
+  auto& physical_register_live_range_func =
+      func_live_infos.physical_register_live_range_func;
+
+  // The live ranges that intersect with the basic block are computed once per
+  // register; the cache is keyed by the register's entry in func_live_infos.
+  // Registers that are not in func_live_infos are treated as having no live
+  // ranges.
+  const RegLiveIntervals no_live_intervals;
+  std::unordered_map<const RegLiveIntervals*, RangesInBlock> ranges_in_block;
+  auto get_ranges_in_block =
+      [&](const RegLiveIntervals& reg_live_interval) -> const RangesInBlock& {
+    auto [it, inserted] = ranges_in_block.try_emplace(&reg_live_interval);
+    if (inserted) it->second = getRangesInBlock(reg_live_interval, bb_range);
+    return it->second;
+  };
+  auto find_virtual_register =
+      [&](const std::string& name) -> const RegLiveIntervals& {
+    const auto it = virtual_register_live_range_func.find(name);
+    if (it == virtual_register_live_range_func.end()) return no_live_intervals;
+    return it->second;
+  };
+
+  // Set to true when the function has virtual registers that are not used in
+  // the basic block.
+  bool has_non_live_function_registers = false;
+
   auto add_interference_on_name =
       [&](const std::string& name,
           google::protobuf::RepeatedPtrField<std::string>*
               mutable_intefered_register,
           google::protobuf::RepeatedField<int>* mutable_intefered_register_size) {
+        const RegLiveIntervals& name_live_interval =
+            find_virtual_register(name);
+        const absl::StatusOr<const BhiveLiveRange*> name_range =
+            getUniqueRangeInBlock(name_live_interval,
+                                  get_ranges_in_block(name_live_interval));
         for (auto [vReg, vRegSize] : live_virtual_registers) {
           if (vReg == name) continue;
-          assert(func_live_infos.virtual_register_live_range_func.find(vReg) !=
-                     func_live_infos.virtual_register_live_range_func.end() &&
+          assert(virtual_register_live_range_func.find(vReg) !=
+                     virtual_register_live_range_func.end() &&
                  "Virtual register not found in map");
           // If the live range of the two registers intersect, then add
           // interference to proto
-          auto check_result = checkRegIntersectionsWithBBRange(
-              func_live_infos.virtual_register_live_range_func[name],
-              func_live_infos.virtual_register_live_range_func[vReg], bb_range);
-          if (!check_result.ok()) return check_result;
-
-          if (*check_result) {
+          if (!name_range.ok()) {
+            return absl::StatusOr<bool>(name_range.status());
+          }
+          if (*name_range != nullptr &&
+              intersectsAny(**name_range, get_ranges_in_block(
+                                              find_virtual_register(vReg)))) {
             mutable_intefered_register->Add(std::string(vReg));
             mutable_intefered_register_size->Add(std::move(vRegSize));
+            ++mir_import_stats_.num_interference_edges;
           }
         }
         // add interference from physical registers to current operand
-        for (auto [pReg, pRegSize] : live_physical_registers) {
-          auto subRegs = superreg2subreg_[pReg];
+        for (const auto& [pRegName, pReg, pRegSize] : live_physical_reg_ids) {
           // if there's one subReg of Preg that has interference with current
           // operand then add interference to proto
-          for (auto subReg : subRegs) {
-            if (func_live_infos.physical_register_live_range_func.find(
-                    subReg) ==
-                func_live_infos.physical_register_live_range_func.end())
+          for (const llvm::MCPhysReg subReg : getSubRegisters(pReg)) {
+            const auto subRegLiveInterval =
+                physical_register_live_range_func.find(subReg);
+            if (subRegLiveInterval == physical_register_live_range_func.end())
               continue;
-            auto check_result = checkRegIntersectionsWithBBRange(
-                func_live_infos.virtual_register_live_range_func[name],
-                func_live_infos.physical_register_live_range_func[subReg],
-                bb_range);
-            if (!check_result.ok()) return check_result;
-            if (*check_result) {
-              mutable_intefered_register->Add(std::string(pReg));
-              mutable_intefered_register_size->Add(std::move(pRegSize));
+            if (!name_range.ok()) {
+              return absl::StatusOr<bool>(name_range.status());
+            }
+            if (*name_range != nullptr &&
+                intersectsAny(**name_range, get_ranges_in_block(
+                                                subRegLiveInterval->second))) {
+              mutable_intefered_register->Add(std::string(*pRegName));
+              mutable_intefered_register_size->Add(pRegSize);
+              ++mir_import_stats_.num_interference_edges;
               break;
             }
           }
         }
         // if model_type is PER_FUNCTION_LIVE_INFO, then we need to add
-        // interference from the whole function
-        if (model_type_ == MODEL_TYPE::PER_FUNC_LIVE_INFO) {
-          for (auto& [vReg, liveInterval] :
-               func_live_infos.virtual_register_live_range_func) {
+        // interference from the whole function. Instead of checking all
+        // registers of the function, we look up the ones whose live ranges
+        // intersect with the live range of `name` in the index; the IDs are
+        // positions in the iteration order of the function's registers, so
+        // the interferences are added in the same order as by a linear scan.
+        if (model_type_ == MODEL_TYPE::PER_FUNC_LIVE_INFO &&
+            has_non_live_function_registers) {
+          if (!name_range.ok()) {
+            return absl::StatusOr<bool>(name_range.status());
+          }
+          if (*name_range == nullptr) return absl::StatusOr<bool>(true);
+          std::vector<int> interfering_ids;
+          func_live_infos.virtual_register_range_index.ForEachIntersecting(
+              **name_range, [&](const LiveRangeIndex::Entry& entry) {
+                if (areIntersected(entry.range, bb_range)) {
+                  interfering_ids.push_back(entry.id);
+                }
+              });
+          std::sort(interfering_ids.begin(), interfering_ids.end());
+          interfering_ids.erase(
+              std::unique(interfering_ids.begin(), interfering_ids.end()),
+              interfering_ids.end());
+          for (const int id : interfering_ids) {
+            const std::string& vReg =
+                *func_live_infos.virtual_register_names[id];
             if (live_virtual_registers.count(vReg)) continue;
-            // LOG("Adding interference from function " << vReg);
-            auto check_result = checkRegIntersectionsWithBBRange(
-                func_live_infos.virtual_register_live_range_func[name],
-                liveInterval, bb_range);
-            if (!check_result.ok()) return check_result;
-            if (*check_result) {
-              mutable_intefered_register->Add(std::string(vReg));
-              mutable_intefered_register_size->Add(32);
-            }
-          } // for
-        }  
+            mutable_intefered_register->Add(std::string(vReg));
+            mutable_intefered_register_size->Add(32);
+            ++mir_import_stats_.num_interference_edges;
+          }
+        }
         return absl::StatusOr<bool>(true);
       };
 
@@ -724,6 +1495,32 @@ absl::StatusOr<bool> BHiveImporter::addInterferenceGraph(
     }
   }
 
+  // The physical registers are resolved to register numbers once per basic
+  // block. Registers that are not known to the target are skipped. The order
+  // follows live_physical_registers, so that the interferences are added in
+  // the same order as with a lookup by name.
+  live_physical_reg_ids.reserve(live_physical_registers.size());
+  for (const auto& [pReg, pRegSize] : live_physical_registers) {
+    const auto it = name_to_register_.find(pReg);
+    if (it == name_to_register_.end()) continue;
+    live_physical_reg_ids.push_back({&pReg, it->second, pRegSize});
+  }
+
+  // The index of the function's live ranges is built once per function, and
+  // reused by all its basic blocks.
+  if (model_type_ == MODEL_TYPE::PER_FUNC_LIVE_INFO) {
+    if (!func_live_infos.has_virtual_register_range_index) {
+      buildVirtualRegisterRangeIndex(func_live_infos);
+    }
+    size_t num_live_function_registers = 0;
+    for (const auto& [vReg, vRegSize] : live_virtual_registers) {
+      num_live_function_registers +=
+          virtual_register_live_range_func.count(vReg);
+    }
+    has_non_live_function_registers =
+        virtual_register_live_range_func.size() > num_live_function_registers;
+  }
+
   // Iterate over all operands in bb_proto, add interference registers to each
   // operand
   for (auto& instruction : *bb_proto.mutable_canonicalized_instructions()) {
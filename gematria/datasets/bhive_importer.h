@@ -18,28 +18,41 @@
 #ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_BHIVE_IMPORTER_H_
 #define THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_BHIVE_IMPORTER_H_
 
+#include <cstddef>
 #include <cstdint>
+#include <functional>
+#include <limits>
 #include <memory>
 #include <string_view>
 
+#include "absl/status/status.h"
 #include "absl/status/statusor.h"
+#include "gematria/datasets/live_range_index.h"
+#include "gematria/datasets/mir_block_cache.h"
+#include "gematria/io/record_writer.h"
 #include "gematria/llvm/canonicalizer.h"
 #include "gematria/proto/basic_block.pb.h"
 #include "gematria/proto/throughput.pb.h"
+#include "gematria/utils/string.h"
 #include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/CodeGen/MIRParser/MIRParser.h"
 #include "llvm/CodeGen/MachineBasicBlock.h"
 #include "llvm/CodeGen/MachineModuleInfo.h"
 #include "llvm/MC/MCContext.h"
 #include "llvm/MC/MCDisassembler/MCDisassembler.h"
 #include "llvm/MC/MCInstPrinter.h"
+#include "llvm/MC/MCRegister.h"
+#include "llvm/MC/MCRegisterInfo.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Target/TargetMachine.h"
 
 // aUTHOR: Zhan Shi
 #include <fstream>  // std::ifstream
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/SmallVector.h"
@@ -57,15 +70,83 @@
 #include "llvm/Support/WithColor.h"
 #include "llvm/Support/raw_ostream.h"
 
-#define DEBUG
+namespace gematria {
 
-#ifdef DEBUG
-#define LOG(X) llvm::errs() << X << "\n"
-#else
-#define LOG(X)
-#endif
+// Statistics collected by BHiveImporter::ParseMIRCsvFile().
+struct MIRCsvImportStats {
+  // The number of non-empty lines read from the input.
+  int64_t num_input_lines = 0;
+  // The number of basic blocks written to the output.
+  int64_t num_imported_blocks = 0;
+  // The number of lines skipped because of their throughput.
+  int64_t num_filtered_lines = 0;
+  // The number of lines that could not be parsed.
+  int64_t num_skipped_lines = 0;
+  // The number of basic blocks that were merged into another block with the
+  // same canonicalized instructions.
+  int64_t num_duplicate_blocks = 0;
+};
 
-namespace gematria {
+// Statistics collected by a BHiveImporter while importing basic blocks from
+// MIR files. The times are wall times in nanoseconds.
+struct MIRImportStats {
+  // The number of basic blocks converted from MIR, including the blocks
+  // converted when writing a MIR block cache.
+  int64_t num_parsed_blocks = 0;
+  // The number of basic blocks read from a MIR block cache.
+  int64_t num_cached_blocks = 0;
+  // The number of basic blocks rejected because they contain a call.
+  int64_t num_call_rejections = 0;
+  // The number of basic blocks rejected because they contain an instruction
+  // that can't be canonicalized.
+  int64_t num_unparsable_rejections = 0;
+  // The number of requested basic blocks that are not in the MIR module.
+  int64_t num_missing_mbb_rejections = 0;
+  // The number of basic blocks rejected because their interference graph could
+  // not be built.
+  int64_t num_interference_rejections = 0;
+  // The number of requested basic blocks that are recorded as errors in a MIR
+  // block cache.
+  int64_t num_cached_rejections = 0;
+  // The number of registers added to the interference lists of operands.
+  int64_t num_interference_edges = 0;
+
+  // Parsing MIR files, including the on-demand parsing of machine functions
+  // and opening MIR block caches.
+  int64_t load_mir_nanos = 0;
+  // Parsing live info files.
+  int64_t parse_live_info_nanos = 0;
+  // Converting machine basic blocks to protos.
+  int64_t convert_blocks_nanos = 0;
+  // Building the interference graphs.
+  int64_t interference_nanos = 0;
+};
+
+// Options for BHiveImporter::ParseMIRCsvFile().
+struct MIRCsvImportOptions {
+  // The name of the throughput source used in the output protos.
+  std::string source_name;
+  // The index of the column in the CSV containing the name of the basic block.
+  size_t BB_name_index = 0;
+  // The index of the column in the CSV containing the throughput in cycles.
+  size_t throughput_column_index = 1;
+  // The scaling applied to the throughput values from the CSV.
+  double throughput_scaling = 1.0;
+  uint64_t base_address = 0;
+  // Lines whose throughput, before scaling, is outside of the interval
+  // [min_throughput, max_throughput] are skipped without parsing the basic
+  // block.
+  double min_throughput = -std::numeric_limits<double>::infinity();
+  double max_throughput = std::numeric_limits<double>::infinity();
+  // When set, it is called with the statistics collected so far after every
+  // `progress_interval` input lines.
+  std::function<void(const MIRCsvImportStats&)> report_progress;
+  int64_t progress_interval = 1000;
+  // When true, the basic blocks with the same canonicalized instructions are
+  // merged into a single proto as described by BasicBlockDeduplicator. The
+  // blocks are then written only after the whole CSV file was parsed.
+  bool deduplicate_blocks = false;
+};
 
 // Parser for BHive CSV files.
 class BHiveImporter {
@@ -114,9 +195,57 @@ class BHiveImporter {
       size_t machine_code_hex_column_index, size_t throughput_column_index,
       double throughput_scaling = 1.0, uint64_t base_address = 0);
 
+  // A version of ParseBHiveCsvLine() that parses a batch of lines. The result
+  // at index `i` is the result of parsing lines[i]. The machine code of all
+  // lines is decoded to a single buffer before the blocks are disassembled.
+  std::vector<absl::StatusOr<BasicBlockWithThroughputProto>>
+  ParseBHiveCsvLines(std::string_view source_name,
+                     const std::vector<std::string>& lines,
+                     size_t machine_code_hex_column_index,
+                     size_t throughput_column_index,
+                     double throughput_scaling = 1.0,
+                     uint64_t base_address = 0);
+
   // Parse a file containing machine basic blocks, each has a unique name
   absl::StatusOr<bool> LoadMIRModule(std::string_view file_name);
 
+  // A version of LoadMIRModule() for large MIR files. Only indexes the machine
+  // functions in the file by the names of their basic blocks. A machine
+  // function is parsed, together with the parts of the LLVM IR module it needs,
+  // when one of its basic blocks is requested, and it is released when a basic
+  // block of another function is requested. Only one function is kept in
+  // memory at a time, so the CSV lines should be grouped by function.
+  absl::StatusOr<bool> LoadMIRModuleLazily(std::string_view file_name);
+
+  // A version of LoadMIRModule() that keeps the basic blocks extracted from the
+  // MIR file in an on-disk cache in `cache_dir`. The cache is keyed by the
+  // contents of `file_name` and `live_info_file_name`, by the model type, and
+  // by the LLVM target. When there is a cache for the inputs, neither the MIR
+  // file nor the live info file is parsed, and ParseMIRCsvLine() reads the
+  // basic blocks from the cache. Otherwise, loads the MIR module and the live
+  // info (for model types that use it), extracts all basic blocks, and writes
+  // them to the cache. `live_info_file_name` is ignored for NO_LIVE_INFO.
+  // Returns true when the basic blocks were loaded from the cache.
+  absl::StatusOr<bool> LoadMIRModuleWithCache(
+      std::string_view file_name, std::string_view live_info_file_name,
+      std::string_view cache_dir);
+
+  // Returns the basic block with the given name from the loaded MIR module,
+  // including the interference graph when the model type uses live info.
+  // NOTE: YOU MUST RUN LoadMIRModule or LoadMIRModuleWithCache before calling
+  // this function
+  absl::StatusOr<BasicBlockProto> BasicBlockProtoFromMBBName(
+      std::string_view MBB_name, uint64_t base_address = 0);
+
+  // Returns the name of the machine function that contains the basic block
+  // with the given name in the module loaded by LoadMIRModule() or
+  // LoadMIRModuleLazily(). Does not parse any machine function. The returned
+  // string is valid until another module is loaded. Returns an error when the
+  // basic block is not in the module, or when the basic blocks were loaded
+  // from a MIR block cache, which does not record the functions.
+  absl::StatusOr<std::string_view> GetFunctionNameOfMBB(
+      std::string_view MBB_name) const;
+
   // Parses a MIR basic block with throughput from one BHive CSV line. Expects
   // that the line has the format "{BB_name},{throughput}" where {machine_code}
   // is the machine code of the basic block in the hex format accepted by
@@ -124,12 +253,24 @@ class BHiveImporter {
   // throughput of the basic block in text format.
   // Optionally applies `throughput_scaling` to the throughput value, and uses
   // `base_address` as the address of the first instruction in the basic block.
-  // NOTE: YOU MUST RUN LoadMIRModule before calling this function
+  // NOTE: YOU MUST RUN LoadMIRModule or LoadMIRModuleWithCache before calling
+  // this function
   absl::StatusOr<BasicBlockWithThroughputProto> ParseMIRCsvLine(
       std::string_view source_name, std::string_view line, size_t BB_name_index,
       size_t throughput_column_index, double throughput_scaling = 1.0,
       uint64_t base_address = 0);
 
+  // Parses all lines of the MIR CSV file `csv_file_name` as described by
+  // ParseMIRCsvLine(), and writes the basic blocks to `writer` as serialized
+  // BasicBlockWithThroughputProtos. Lines that can't be parsed are counted and
+  // skipped. Returns an error when the file can't be read or when writing
+  // fails.
+  // NOTE: YOU MUST RUN LoadMIRModule or LoadMIRModuleWithCache before calling
+  // this function
+  absl::StatusOr<MIRCsvImportStats> ParseMIRCsvFile(
+      std::string_view csv_file_name, const MIRCsvImportOptions& options,
+      RecordWriter& writer);
+
   typedef std::pair<unsigned int, unsigned int> BhiveLiveRange;
   // Author: Zhan Shi
   // Build the interference graph for each basic block in name_to_mbb_
@@ -146,22 +287,36 @@ class BHiveImporter {
   struct FunctionLiveIntervalInfo {
     std::unordered_map<std::string, RegLiveIntervals>
         virtual_register_live_range_func;
-    std::unordered_map<std::string, RegLiveIntervals>
+    // The live ranges of physical registers, keyed by the register number.
+    llvm::DenseMap<llvm::MCPhysReg, RegLiveIntervals>
         physical_register_live_range_func;
     std::unordered_map<std::string, BhiveLiveRange> BBRangeList;
+    // An index of the live ranges in virtual_register_live_range_func, built
+    // by addInterferenceGraph() on first use. The IDs in the index are
+    // positions in virtual_register_names, which points to the names of the
+    // registers in the iteration order of virtual_register_live_range_func.
+    // The index is valid only as long as the map is not modified.
+    bool has_virtual_register_range_index = false;
+    LiveRangeIndex virtual_register_range_index;
+    std::vector<const std::string*> virtual_register_names;
   };
 
-  // pretty print superreg2subreg_
-  void prettyPrintSuperReg2SubReg() {
-    LOG("SuperReg2SubReg: ");
-    for (auto& [superreg, subreg] : superreg2subreg_) {
-      LOG(superreg << ": ");
-      for (auto& sub : subreg) {
-        LOG("\t" << sub);
-      }
-    }
+  // Returns the register `reg` and all its sub-registers.
+  llvm::ArrayRef<llvm::MCPhysReg> getSubRegisters(llvm::MCPhysReg reg) const {
+    return llvm::ArrayRef<llvm::MCPhysReg>(superreg2subreg_)
+        .slice(superreg2subreg_offsets_[reg],
+               superreg2subreg_offsets_[reg + 1] -
+                   superreg2subreg_offsets_[reg]);
   }
 
+  // pretty print superreg2subreg_ to stderr
+  void prettyPrintSuperReg2SubReg() const;
+
+  // Returns the statistics collected since the importer was created or since
+  // the last call to ResetMIRImportStats().
+  const MIRImportStats& mir_import_stats() const { return mir_import_stats_; }
+  void ResetMIRImportStats() { mir_import_stats_ = MIRImportStats(); }
+
   // Now we are able to obtain the live range for each register
   // We want to for each pair of regsiter, find out if their live range overlap
   // Edge case 1: one live range may have multiple live ranges,
@@ -170,6 +325,13 @@ class BHiveImporter {
   // the other one use another part Also in constructing the live range we need
   // to take in machine instruction/ fucntion
   absl::StatusOr<bool> InteferenceGraphParser(std::string_view file_name);
+  // A version of InteferenceGraphParser() that keeps only the live info of the
+  // functions for which `keep_function(function_name)` returns true; the live
+  // ranges of the other functions are skipped without parsing them. This lets
+  // several importers share the live info of one MIR file by function.
+  absl::StatusOr<bool> InteferenceGraphParserForFunctions(
+      std::string_view file_name,
+      const std::function<bool(std::string_view)>& keep_function);
 
   absl::StatusOr<bool> addInterferenceGraph(BasicBlockProto& bb_proto,
                             FunctionLiveIntervalInfo& func_live_infos,
@@ -181,15 +343,57 @@ class BHiveImporter {
   std::unique_ptr<llvm::MCContext> context_;
   std::unique_ptr<llvm::MCDisassembler> disassembler_;
   std::unique_ptr<llvm::MCInstPrinter> mc_inst_printer_;
+  // The buffer for the machine code decoded by ParseBHiveCsvLines(), reused
+  // across the calls.
+  HexStringBatch machine_code_batch_;
   llvm::DenseMap<llvm::StringRef, llvm::MachineBasicBlock*> name_to_mbb_;
   std::unordered_map<std::string, FunctionLiveIntervalInfo>
       func_to_live_intervals_;
-  std::unordered_map<std::string, std::vector<std::string>> superreg2subreg_;
+  // Maps the names of the registers of the target to their numbers.
+  llvm::StringMap<llvm::MCPhysReg> name_to_register_;
+  // The register itself and its sub-registers, for each register of the
+  // target. The registers of `reg` are superreg2subreg_[i] for all i in
+  // [superreg2subreg_offsets_[reg], superreg2subreg_offsets_[reg + 1]).
+  std::vector<llvm::MCPhysReg> superreg2subreg_;
+  std::vector<uint32_t> superreg2subreg_offsets_;
   llvm::LLVMContext llvm_context_;
   std::unique_ptr<llvm::Module> mir_module_;
   llvm::MachineModuleInfo MMI_;
   std::unique_ptr<llvm::MIRParser> mir_parser_;
+  // The basic blocks loaded by LoadMIRModuleWithCache(); when set, they are
+  // used instead of name_to_mbb_.
+  std::unique_ptr<MirBlockCache> mir_block_cache_;
+
+  // A machine function of a MIR file loaded by LoadMIRModuleLazily().
+  struct LazyMachineFunction {
+    llvm::StringRef name;
+    // The YAML document of the machine function.
+    llvm::StringRef document;
+  };
+  static constexpr size_t kNoMaterializedFunction = ~size_t{0};
+
+  // Parses the machine function lazy_functions_[function_index] and puts its
+  // basic blocks to name_to_mbb_. Releases the previously parsed function and
+  // its LLVM IR module.
+  absl::Status MaterializeLazyFunction(size_t function_index);
+  void ReleaseMaterializedFunction();
+  // Releases the loaded MIR module, machine functions, and live info.
+  void ClearMIRModule();
+
+  // The contents of the file loaded by LoadMIRModuleLazily(); the string refs
+  // in lazy_functions_ and lazy_mbb_to_function_ point into it.
+  std::unique_ptr<llvm::MemoryBuffer> lazy_mir_buffer_;
+  std::string lazy_mir_file_name_;
+  // The LLVM IR document of the file, including the "--- |" line.
+  llvm::StringRef lazy_ir_document_;
+  std::vector<LazyMachineFunction> lazy_functions_;
+  // Maps unique MBB names to the indices of their functions in
+  // lazy_functions_.
+  llvm::DenseMap<llvm::StringRef, size_t> lazy_mbb_to_function_;
+  // The index of the machine function whose basic blocks are in name_to_mbb_.
+  size_t materialized_function_ = kNoMaterializedFunction;
   MODEL_TYPE model_type_;
+  MIRImportStats mir_import_stats_;
 };
 
 }  // namespace gematria
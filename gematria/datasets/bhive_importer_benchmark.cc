@@ -0,0 +1,391 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks for BHiveImporter: parsing BHive CSV lines, parsing MIR CSV lines,
+// parsing live info files, and building the interference graphs.
+//
+// The MIR benchmarks use synthetic machine functions, so that the cost can be
+// measured as a function of the size of the function. A synthetic function has
+// `num_blocks` basic blocks with `instructions_per_block` instructions each.
+// Every instruction defines a new virtual register that is used by the next
+// instruction and by the instruction kLiveRangeWindow positions after it, so
+// about kLiveRangeWindow virtual registers are live at each point; $rdi is live
+// at the beginning of every block, so its live range list has one range per
+// block. The first argument of the MIR benchmarks is `num_blocks`, the second
+// one `instructions_per_block`.
+//
+// Besides the time, the benchmarks report the number of basic blocks processed
+// per second ("blocks").
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/log/check.h"
+#include "absl/status/statusor.h"
+#include "benchmark/benchmark.h"
+#include "gematria/datasets/bhive_importer.h"
+#include "gematria/llvm/canonicalizer.h"
+#include "gematria/llvm/llvm_architecture_support.h"
+#include "gematria/proto/basic_block.pb.h"
+#include "gematria/proto/throughput.pb.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/MC/MCRegister.h"
+#include "llvm/MC/MCRegisterInfo.h"
+#include "llvm/Support/FileSystem.h"
+
+namespace gematria {
+namespace {
+
+constexpr char kSourceName[] = "bhive: skl";
+
+// The basic blocks used by BM_ParseBHiveCsvLine, in the format of the BHive
+// data set.
+constexpr const char* kBHiveCsvLines[] = {
+    "4801d8,98.000000",
+    "4889de4889c24c89ff,100.000000",
+    "488b0748034708,212.000000",
+    "f20f59c1f20f58c2,400.000000",
+    "4c8d0c4f4d01c8,104.000000",
+    "8b4c24084103c8,115.000000",
+    "85c044897c2460,109.000000",
+    "3b31488d5208410f9dc1,205.000000",
+};
+
+// The number of slot indices between two consecutive instructions in the
+// synthetic live info; the same as in the files produced by LLVM.
+constexpr int kSlotsPerInstruction = 16;
+// The distance between the definition of a virtual register and its last use
+// in a synthetic function.
+constexpr int kLiveRangeWindow = 8;
+constexpr char kSyntheticFunctionName[] = "synthetic_function";
+
+const LlvmArchitectureSupport& X86LlvmSupport() {
+  static const LlvmArchitectureSupport* const llvm_support =
+      LlvmArchitectureSupport::X86_64().release();
+  return *llvm_support;
+}
+
+const Canonicalizer& X86CanonicalizerForBenchmarks() {
+  static const Canonicalizer* const canonicalizer =
+      new X86Canonicalizer(&X86LlvmSupport().target_machine());
+  return *canonicalizer;
+}
+
+llvm::MCPhysReg FindRegister(llvm::StringRef name) {
+  const llvm::MCRegisterInfo& register_info =
+      X86LlvmSupport().mc_register_info();
+  for (unsigned reg = 1; reg < register_info.getNumRegs(); ++reg) {
+    if (name == register_info.getName(reg)) return reg;
+  }
+  return 0;
+}
+
+// A synthetic machine function, written to a MIR file and a live info file.
+struct SyntheticFunction {
+  std::string mir_file_name;
+  std::string live_info_file_name;
+  int64_t live_info_file_size = 0;
+  int num_instructions = 0;
+  int num_registers = 0;
+
+  std::vector<std::string> block_names;
+  // The slot index ranges of the basic blocks, in the same order as
+  // `block_names`.
+  std::vector<BHiveImporter::BhiveLiveRange> block_ranges;
+  // The basic blocks of the function imported without live info, i.e. the
+  // inputs of BHiveImporter::addInterferenceGraph().
+  std::vector<BasicBlockProto> block_protos;
+  // The same live info as in the live info file.
+  BHiveImporter::FunctionLiveIntervalInfo live_info;
+
+  // An importer with the MIR file and the live info file loaded.
+  std::unique_ptr<BHiveImporter> importer;
+};
+
+std::string WriteTemporaryFile(llvm::StringRef suffix,
+                               const std::string& contents) {
+  llvm::SmallString<128> path;
+  CHECK(!llvm::sys::fs::createTemporaryFile("bhive_importer_benchmark", suffix,
+                                            path));
+  std::ofstream file(path.c_str());
+  file << contents;
+  CHECK(file.good()) << "Could not write " << path.c_str();
+  return path.str().str();
+}
+
+std::string LiveRangeToString(const BHiveImporter::BhiveLiveRange& range,
+                              char start_kind, int value_number) {
+  return "[" + std::to_string(range.first) + start_kind + "," +
+         std::to_string(range.second) + "r:" + std::to_string(value_number) +
+         ")";
+}
+
+std::unique_ptr<SyntheticFunction> CreateSyntheticFunction(
+    int num_blocks, int instructions_per_block) {
+  auto function = std::make_unique<SyntheticFunction>();
+  const std::string function_name = kSyntheticFunctionName;
+  const llvm::MCPhysReg rdi = FindRegister("RDI");
+  CHECK_NE(rdi, 0);
+  BHiveImporter::RegLiveIntervals& rdi_live_intervals =
+      function->live_info.physical_register_live_range_func[rdi];
+  rdi_live_intervals.name = "RDI";
+
+  std::string ir = "--- |\n  define void @" + function_name + "() {\n";
+  std::string body;
+  std::string virtual_register_live_info;
+  std::string rdi_value_numbers;
+  int block_start = 0;
+  for (int block = 0; block < num_blocks; ++block) {
+    const std::string block_name = "BB_" + std::to_string(block);
+    const int block_end =
+        block_start + kSlotsPerInstruction * (instructions_per_block + 1);
+    const BHiveImporter::BhiveLiveRange block_range(block_start, block_end);
+    function->block_names.push_back(block_name);
+    function->block_ranges.push_back(block_range);
+    function->live_info.BBRangeList[block_name] = block_range;
+
+    ir += "  " + block_name + ":\n";
+    ir += block + 1 < num_blocks
+              ? "    br label %BB_" + std::to_string(block + 1) + "\n"
+              : "    ret void\n";
+    body += "  bb." + std::to_string(block) + "." + block_name + ":\n";
+    body += "    liveins: $rdi\n";
+
+    // $rdi is live from the start of the block to the first instruction.
+    const auto instruction_slot = [&](int instruction) {
+      return block_start + kSlotsPerInstruction * (instruction + 1);
+    };
+    rdi_live_intervals.rangeList.emplace_back(block_start, instruction_slot(0));
+    rdi_value_numbers += " " + std::to_string(block) + "@" +
+                         std::to_string(block_start) + "B-phi";
+
+    const int first_register = block * instructions_per_block;
+    for (int i = 0; i < instructions_per_block; ++i) {
+      const std::string reg = "%" + std::to_string(first_register + i);
+      if (i == 0) {
+        body += "    " + reg + ":gr64 = COPY $rdi\n";
+      } else {
+        body += "    " + reg + ":gr64 = ADD64rr %" +
+                std::to_string(first_register + i - 1) + ", %" +
+                std::to_string(first_register +
+                               std::max(0, i - kLiveRangeWindow)) +
+                ", implicit-def dead $eflags\n";
+      }
+      const int last_use =
+          std::min(i + kLiveRangeWindow, instructions_per_block - 1);
+      const BHiveImporter::BhiveLiveRange range(
+          instruction_slot(i),
+          std::max(instruction_slot(last_use),
+                   instruction_slot(i) + kSlotsPerInstruction / 2));
+      virtual_register_live_info += reg + " " +
+                                    LiveRangeToString(range, 'r', 0) + " 0@" +
+                                    std::to_string(range.first) +
+                                    "r  weight:0.000000e+00\n";
+      BHiveImporter::RegLiveIntervals& live_intervals =
+          function->live_info.virtual_register_live_range_func[reg];
+      live_intervals.name = reg;
+      live_intervals.rangeList.push_back(range);
+    }
+    block_start = block_end;
+  }
+  ir += "  }\n...\n";
+  function->num_instructions = num_blocks * instructions_per_block;
+  function->num_registers = function->num_instructions + 1;
+
+  std::string rdi_live_info = "RDI ";
+  for (size_t i = 0; i < rdi_live_intervals.rangeList.size(); ++i) {
+    rdi_live_info += LiveRangeToString(rdi_live_intervals.rangeList[i], 'B', i);
+  }
+  std::string live_info = function_name + "\n" + rdi_live_info +
+                          rdi_value_numbers + "\n" +
+                          virtual_register_live_info + "RegMasks:\n";
+  for (size_t i = 0; i < function->block_names.size(); ++i) {
+    live_info += function->block_names[i] + ": " +
+                 std::to_string(function->block_ranges[i].first) + "B " +
+                 std::to_string(function->block_ranges[i].second) + "B\n";
+  }
+  const std::string mir = ir + "---\nname: " + function_name +
+                          "\ntracksRegLiveness: true\nliveins:\n"
+                          "  - { reg: '$rdi' }\nbody: |\n" +
+                          body + "...\n";
+
+  function->mir_file_name = WriteTemporaryFile("mir", mir);
+  function->live_info_file_name = WriteTemporaryFile("liveinfo", live_info);
+  function->live_info_file_size = live_info.size();
+
+  {
+    BHiveImporter importer(&X86CanonicalizerForBenchmarks(), "NO_LIVE_INFO");
+    CHECK_OK(importer.LoadMIRModule(function->mir_file_name).status());
+    for (const std::string& block_name : function->block_names) {
+      absl::StatusOr<BasicBlockProto> block_proto =
+          importer.BasicBlockProtoFromMBBName(block_name);
+      CHECK_OK(block_proto.status());
+      function->block_protos.push_back(*std::move(block_proto));
+    }
+  }
+  function->importer = std::make_unique<BHiveImporter>(
+      &X86CanonicalizerForBenchmarks(), "PER_FUNC_LIVE_INFO");
+  CHECK_OK(function->importer->LoadMIRModule(function->mir_file_name).status());
+  CHECK_OK(function->importer
+               ->InteferenceGraphParser(function->live_info_file_name)
+               .status());
+  return function;
+}
+
+// Returns the synthetic function for the arguments of `state`. The functions
+// are created on first use and kept for the whole run, because the benchmark
+// library calls each benchmark function several times.
+SyntheticFunction& GetSyntheticFunction(const benchmark::State& state) {
+  static auto* const functions =
+      new std::map<std::pair<int, int>, std::unique_ptr<SyntheticFunction>>();
+  const std::pair<int, int> key(state.range(0), state.range(1));
+  std::unique_ptr<SyntheticFunction>& function = (*functions)[key];
+  if (function == nullptr) {
+    function = CreateSyntheticFunction(key.first, key.second);
+  }
+  return *function;
+}
+
+void SetBlocksCounter(benchmark::State& state) {
+  state.counters["blocks"] = benchmark::Counter(
+      static_cast<double>(state.iterations()), benchmark::Counter::kIsRate);
+}
+
+void BM_ParseBHiveCsvLine(benchmark::State& state) {
+  BHiveImporter importer(&X86CanonicalizerForBenchmarks());
+  size_t next_line = 0;
+  for (auto _ : state) {
+    absl::StatusOr<BasicBlockWithThroughputProto> block =
+        importer.ParseBHiveCsvLine(kSourceName, kBHiveCsvLines[next_line], 0,
+                                   1);
+    if (!block.ok()) {
+      state.SkipWithError(block.status().ToString().c_str());
+      break;
+    }
+    benchmark::DoNotOptimize(block);
+    next_line = (next_line + 1) % std::size(kBHiveCsvLines);
+  }
+  SetBlocksCounter(state);
+}
+
+void BM_ParseMIRCsvLine(benchmark::State& state) {
+  SyntheticFunction& function = GetSyntheticFunction(state);
+  std::vector<std::string> lines;
+  for (const std::string& block_name : function.block_names) {
+    lines.push_back(block_name + ",1.5");
+  }
+  size_t next_line = 0;
+  for (auto _ : state) {
+    absl::StatusOr<BasicBlockWithThroughputProto> block =
+        function.importer->ParseMIRCsvLine(kSourceName, lines[next_line], 0,
+                                           1);
+    if (!block.ok()) {
+      state.SkipWithError(block.status().ToString().c_str());
+      break;
+    }
+    benchmark::DoNotOptimize(block);
+    next_line = (next_line + 1) % lines.size();
+  }
+  SetBlocksCounter(state);
+}
+
+void BM_InteferenceGraphParser(benchmark::State& state) {
+  SyntheticFunction& function = GetSyntheticFunction(state);
+  BHiveImporter importer(&X86CanonicalizerForBenchmarks(),
+                         "PER_FUNC_LIVE_INFO");
+  for (auto _ : state) {
+    absl::StatusOr<bool> result =
+        importer.InteferenceGraphParser(function.live_info_file_name);
+    if (!result.ok()) {
+      state.SkipWithError(result.status().ToString().c_str());
+      break;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * function.live_info_file_size);
+  state.counters["registers"] =
+      benchmark::Counter(static_cast<double>(state.iterations()) *
+                             function.num_registers,
+                         benchmark::Counter::kIsRate);
+}
+
+// Builds the interference graphs of the blocks of the synthetic function. When
+// `rebuild_index` is true, the index of the live ranges of the function is
+// rebuilt for each block, as if each block came from a different function of
+// the same size; otherwise, it is built once and reused by all blocks.
+void RunAddInterferenceGraph(benchmark::State& state, bool rebuild_index) {
+  SyntheticFunction& function = GetSyntheticFunction(state);
+  BHiveImporter& importer = *function.importer;
+  importer.ResetMIRImportStats();
+  size_t next_block = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    BasicBlockProto block_proto = function.block_protos[next_block];
+    if (rebuild_index) {
+      function.live_info.has_virtual_register_range_index = false;
+    }
+    state.ResumeTiming();
+    absl::StatusOr<bool> result = importer.addInterferenceGraph(
+        block_proto, function.live_info, function.block_ranges[next_block]);
+    if (!result.ok()) {
+      state.SkipWithError(result.status().ToString().c_str());
+      break;
+    }
+    benchmark::DoNotOptimize(block_proto);
+    next_block = (next_block + 1) % function.block_protos.size();
+  }
+  SetBlocksCounter(state);
+  state.counters["interference_edges_per_block"] = benchmark::Counter(
+      static_cast<double>(importer.mir_import_stats().num_interference_edges),
+      benchmark::Counter::kAvgIterations);
+}
+
+void BM_AddInterferenceGraph(benchmark::State& state) {
+  RunAddInterferenceGraph(state, /*rebuild_index=*/false);
+}
+
+void BM_AddInterferenceGraphWithIndexBuild(benchmark::State& state) {
+  RunAddInterferenceGraph(state, /*rebuild_index=*/true);
+}
+
+// Sweeps the size of the function with a fixed size of the basic blocks, and
+// the size of the basic block in a function with a single block.
+void SyntheticFunctionSizes(benchmark::internal::Benchmark* benchmark) {
+  benchmark->ArgNames({"blocks", "instructions_per_block"});
+  for (const int num_blocks : {1, 8, 64, 512}) {
+    for (const int instructions_per_block : {8, 64}) {
+      benchmark->Args({num_blocks, instructions_per_block});
+    }
+  }
+  for (const int instructions_per_block : {256, 1024}) {
+    benchmark->Args({1, instructions_per_block});
+  }
+}
+
+BENCHMARK(BM_ParseBHiveCsvLine);
+BENCHMARK(BM_ParseMIRCsvLine)->Apply(SyntheticFunctionSizes);
+BENCHMARK(BM_InteferenceGraphParser)->Apply(SyntheticFunctionSizes);
+BENCHMARK(BM_AddInterferenceGraph)->Apply(SyntheticFunctionSizes);
+BENCHMARK(BM_AddInterferenceGraphWithIndexBuild)
+    ->Apply(SyntheticFunctionSizes);
+
+}  // namespace
+}  // namespace gematria
@@ -14,8 +14,22 @@
 
 #include "gematria/datasets/bhive_importer.h"
 
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <ios>
 #include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "gematria/io/tfrecord_writer.h"
+#include "gematria/proto/basic_block.pb.h"
+#include "gematria/proto/throughput.pb.h"
 #include "gematria/llvm/canonicalizer.h"
 #include "gematria/llvm/llvm_architecture_support.h"
 #include "gematria/testing/matchers.h"
@@ -226,6 +240,29 @@ TEST_F(BHiveImporterTest, NonStandardColumns) {
                                             })pb")));
 }
 
+TEST_F(BHiveImporterTest, ParseBHiveCsvLines) {
+  const std::vector<std::string> lines = {
+      "4929d2,2.5", "4929",     "4929d2", "4829d38b44246c8b54246848c1fb03,1",
+      "zz,1",       "4929d2,a", ",0"};
+  const std::vector<absl::StatusOr<BasicBlockWithThroughputProto>> results =
+      x86_bhive_importer_->ParseBHiveCsvLines(kSourceName, lines, 0, 1,
+                                              kScaling);
+  ASSERT_EQ(results.size(), lines.size());
+  for (size_t i = 0; i < lines.size(); ++i) {
+    SCOPED_TRACE(lines[i]);
+    const absl::StatusOr<BasicBlockWithThroughputProto> expected =
+        x86_bhive_importer_->ParseBHiveCsvLine(kSourceName, lines[i], 0, 1,
+                                               kScaling);
+    if (expected.ok()) {
+      EXPECT_THAT(results[i], IsOkAndHolds(EqualsProto(*expected)));
+    } else {
+      EXPECT_THAT(results[i], StatusIs(expected.status().code()));
+    }
+  }
+  EXPECT_THAT(results[0], IsOk());
+  EXPECT_THAT(results[1], StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
 TEST_F(BHiveImporterTest, MIRDatasetTest2) {
   EXPECT_THAT(
       x86_bhive_importer_->LoadMIRModule("sample_dataset/native_test.mir"),
@@ -250,5 +287,243 @@ TEST_F(BHiveImporterTest, MIRAddressTupleTest) {
               IsOk());
 }
 
+TEST_F(BHiveImporterTest, MIRImportStats) {
+  ASSERT_OK(x86_bhive_importer_->LoadMIRModule("sample_dataset/data.mir"));
+  ASSERT_OK(
+      x86_bhive_importer_->InteferenceGraphParser("sample_dataset/liveinfo"));
+  ASSERT_OK(x86_bhive_importer_->BasicBlockProtoFromMBBName("BB_0"));
+  EXPECT_THAT(x86_bhive_importer_->BasicBlockProtoFromMBBName("BB_unknown"),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+
+  const MIRImportStats& stats = x86_bhive_importer_->mir_import_stats();
+  EXPECT_EQ(stats.num_parsed_blocks, 1);
+  EXPECT_EQ(stats.num_missing_mbb_rejections, 1);
+  EXPECT_EQ(stats.num_call_rejections, 0);
+  EXPECT_GT(stats.load_mir_nanos, 0);
+  EXPECT_GT(stats.parse_live_info_nanos, 0);
+  EXPECT_GT(stats.convert_blocks_nanos, 0);
+
+  x86_bhive_importer_->ResetMIRImportStats();
+  EXPECT_EQ(x86_bhive_importer_->mir_import_stats().num_parsed_blocks, 0);
+}
+
+// Reads the records from an uncompressed .tfrecord file. Does not verify the
+// checksums.
+std::vector<std::string> ReadTFRecordFile(const std::string& file_name) {
+  std::ifstream in(file_name, std::ios::binary);
+  std::vector<std::string> records;
+  char header[12];
+  while (in.read(header, sizeof(header))) {
+    uint64_t size = 0;
+    for (int i = 0; i < 8; ++i) {
+      size |= uint64_t{static_cast<unsigned char>(header[i])} << (8 * i);
+    }
+    std::string record(size, '\0');
+    char footer[4];
+    in.read(record.data(), size);
+    in.read(footer, sizeof(footer));
+    records.push_back(std::move(record));
+  }
+  return records;
+}
+
+TEST_F(BHiveImporterTest, MIRCsvFile) {
+  const std::string csv_file_name = ::testing::TempDir() + "/mir_csv_file.csv";
+  const std::string tfrecord_file_name =
+      ::testing::TempDir() + "/mir_csv_file.tfrecord";
+  std::ofstream(csv_file_name) << "BB_0,1.5\n"
+                                  "\n"
+                                  "BB_2,100\n"
+                                  "BB_unknown,2\n"
+                                  "BB_2,2.5\r\n";
+  ASSERT_OK(x86_bhive_importer_->LoadMIRModule("sample_dataset/data.mir"));
+  ASSERT_OK(
+      x86_bhive_importer_->InteferenceGraphParser("sample_dataset/liveinfo"));
+
+  MIRCsvImportOptions options;
+  options.source_name = kSourceName;
+  options.throughput_scaling = kScaling;
+  options.max_throughput = 10;
+  int num_progress_reports = 0;
+  options.report_progress = [&](const MIRCsvImportStats&) {
+    ++num_progress_reports;
+  };
+  options.progress_interval = 2;
+  absl::StatusOr<std::unique_ptr<TFRecordWriter>> writer =
+      TFRecordWriter::Open(tfrecord_file_name);
+  ASSERT_OK(writer);
+  const absl::StatusOr<MIRCsvImportStats> stats =
+      x86_bhive_importer_->ParseMIRCsvFile(csv_file_name, options, **writer);
+  ASSERT_OK(stats);
+  ASSERT_OK((*writer)->Close());
+  EXPECT_EQ(stats->num_input_lines, 4);
+  EXPECT_EQ(stats->num_imported_blocks, 2);
+  EXPECT_EQ(stats->num_filtered_lines, 1);
+  EXPECT_EQ(stats->num_skipped_lines, 1);
+  // Two reports after every two lines, and the final one.
+  EXPECT_EQ(num_progress_reports, 3);
+
+  const std::vector<std::string> records =
+      ReadTFRecordFile(tfrecord_file_name);
+  ASSERT_EQ(records.size(), 2);
+  const absl::StatusOr<BasicBlockWithThroughputProto> expected_block =
+      x86_bhive_importer_->ParseMIRCsvLine(kSourceName, "BB_2,2.5", 0, 1,
+                                           kScaling);
+  ASSERT_OK(expected_block);
+  EXPECT_EQ(records[1], expected_block->SerializeAsString());
+}
+
+TEST_F(BHiveImporterTest, MIRLazyLoading) {
+  ASSERT_OK(x86_bhive_importer_->LoadMIRModule("sample_dataset/data.mir"));
+  ASSERT_OK(
+      x86_bhive_importer_->InteferenceGraphParser("sample_dataset/liveinfo"));
+  const absl::StatusOr<BasicBlockProto> block_0 =
+      x86_bhive_importer_->BasicBlockProtoFromMBBName("BB_0");
+  const absl::StatusOr<BasicBlockProto> block_2 =
+      x86_bhive_importer_->BasicBlockProtoFromMBBName("BB_2");
+  ASSERT_OK(block_0);
+  ASSERT_OK(block_2);
+
+  ASSERT_OK(
+      x86_bhive_importer_->LoadMIRModuleLazily("sample_dataset/data.mir"));
+  ASSERT_OK(
+      x86_bhive_importer_->InteferenceGraphParser("sample_dataset/liveinfo"));
+  // BB_0 and BB_2 are in different functions; BB_0 is parsed twice.
+  for (const auto& [name, expected_block] :
+       {std::make_pair("BB_0", &*block_0), std::make_pair("BB_2", &*block_2),
+        std::make_pair("BB_0", &*block_0)}) {
+    const absl::StatusOr<BasicBlockProto> block =
+        x86_bhive_importer_->BasicBlockProtoFromMBBName(name);
+    ASSERT_OK(block);
+    EXPECT_EQ(block->SerializeAsString(), expected_block->SerializeAsString())
+        << name;
+  }
+  EXPECT_THAT(x86_bhive_importer_->BasicBlockProtoFromMBBName("BB_unknown"),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+TEST_F(BHiveImporterTest, MIRBlockCache) {
+  const std::string cache_dir = ::testing::TempDir() + "/mir_block_cache";
+  EXPECT_THAT(x86_bhive_importer_->LoadMIRModuleWithCache(
+                  "sample_dataset/data.mir", "sample_dataset/liveinfo",
+                  cache_dir),
+              IsOkAndHolds(false));
+  const absl::StatusOr<BasicBlockProto> block =
+      x86_bhive_importer_->BasicBlockProtoFromMBBName("BB_0");
+  ASSERT_OK(block);
+
+  // The second load reads the basic blocks from the cache.
+  EXPECT_THAT(x86_bhive_importer_->LoadMIRModuleWithCache(
+                  "sample_dataset/data.mir", "sample_dataset/liveinfo",
+                  cache_dir),
+              IsOkAndHolds(true));
+  const absl::StatusOr<BasicBlockProto> cached_block =
+      x86_bhive_importer_->BasicBlockProtoFromMBBName("BB_0");
+  ASSERT_OK(cached_block);
+  EXPECT_EQ(cached_block->SerializeAsString(), block->SerializeAsString());
+  EXPECT_THAT(x86_bhive_importer_->ParseMIRCsvLine(kSourceName, "BB_0,2.37", 0,
+                                                   1, kScaling),
+              IsOk());
+  EXPECT_THAT(x86_bhive_importer_->BasicBlockProtoFromMBBName("BB_unknown"),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+// The live info of the function that contains BB_0 in sample_dataset/data.mir,
+// as it appears in sample_dataset/liveinfo.
+constexpr absl::string_view kFirstFunctionLiveInfoLines[] = {
+    "__cxx_global_var_init",
+    "%0 [112r,160r:0) 0@112r  weight:0.000000e+00",
+    "%1 [128r,176r:0) 0@128r  weight:0.000000e+00",
+    "%2 [144r,192r:0) 0@144r  weight:0.000000e+00",
+    "%3 [48r,64r:0) 0@48r  weight:0.000000e+00",
+    "RegMasks: 80r 208r",
+    "BB_0: 0B 208B",
+};
+
+class BHiveImporterLiveInfoTest : public BHiveImporterTest {
+ protected:
+  // Writes `contents` to a live info file and returns the serialized proto of
+  // BB_0 from sample_dataset/data.mir with this live info.
+  std::string BB0WithLiveInfo(absl::string_view test_name,
+                              absl::string_view contents) {
+    const std::string file_name =
+        ::testing::TempDir() + "/" + std::string(test_name) + ".liveinfo";
+    std::ofstream(file_name, std::ios::binary) << contents;
+    return BB0WithLiveInfoFile(file_name);
+  }
+
+  std::string BB0WithLiveInfoFile(const std::string& file_name) {
+    BHiveImporter importer(x86_canonicalizer_.get(), "PER_FUNC_LIVE_INFO");
+    EXPECT_OK(importer.LoadMIRModule("sample_dataset/data.mir"));
+    EXPECT_OK(importer.InteferenceGraphParser(file_name));
+    const absl::StatusOr<BasicBlockProto> block =
+        importer.BasicBlockProtoFromMBBName("BB_0");
+    EXPECT_OK(block);
+    return block.ok() ? block->SerializeAsString() : "";
+  }
+
+  // Returns kFirstFunctionLiveInfoLines joined with `separator`, with the
+  // separator also after the last line.
+  static std::string JoinLines(absl::string_view separator) {
+    std::string contents;
+    for (const absl::string_view line : kFirstFunctionLiveInfoLines) {
+      contents.append(line.data(), line.size());
+      contents.append(separator.data(), separator.size());
+    }
+    return contents;
+  }
+};
+
+TEST_F(BHiveImporterLiveInfoTest, SameAsSampleDataset) {
+  const std::string expected_block =
+      BB0WithLiveInfoFile("sample_dataset/liveinfo");
+  EXPECT_EQ(BB0WithLiveInfo("same_as_sample_dataset", JoinLines("\n")),
+            expected_block);
+  // Windows line endings are accepted too.
+  EXPECT_EQ(BB0WithLiveInfo("crlf", JoinLines("\r\n")), expected_block);
+}
+
+TEST_F(BHiveImporterLiveInfoTest, BlankLines) {
+  const std::string expected_block =
+      BB0WithLiveInfoFile("sample_dataset/liveinfo");
+  // Empty lines and lines with only whitespace are skipped everywhere: before
+  // the function name, between the registers, and around the basic blocks.
+  EXPECT_EQ(BB0WithLiveInfo("blank_lines",
+                            "\n  \n" + JoinLines("\n\n \t\n\r\n") + "\n"),
+            expected_block);
+}
+
+TEST_F(BHiveImporterLiveInfoTest, NoTrailingNewline) {
+  const std::string expected_block =
+      BB0WithLiveInfoFile("sample_dataset/liveinfo");
+  std::string contents = JoinLines("\n");
+  contents.pop_back();
+  // The range of BB_0 is on the last line, so it would be lost if the last line
+  // was not parsed.
+  EXPECT_EQ(BB0WithLiveInfo("no_trailing_newline", contents), expected_block);
+}
+
+TEST_F(BHiveImporterLiveInfoTest, MalformedRange) {
+  const std::string expected_block =
+      BB0WithLiveInfoFile("sample_dataset/liveinfo");
+  // The valid ranges before a malformed range are kept, and the lines after it
+  // are parsed normally. %9 is not used by BB_0.
+  const std::string contents = absl::StrCat(
+      kFirstFunctionLiveInfoLines[0], "\n", kFirstFunctionLiveInfoLines[1],
+      "\n", kFirstFunctionLiveInfoLines[2], "\n",
+      kFirstFunctionLiveInfoLines[3], "\n",
+      "%3 [48r,64r:0)[80r,xx:1) 0@48r  weight:0.000000e+00\n", "%9 [\n",
+      kFirstFunctionLiveInfoLines[5], "\n", kFirstFunctionLiveInfoLines[6],
+      "\n");
+  EXPECT_EQ(BB0WithLiveInfo("malformed_range", contents), expected_block);
+}
+
+TEST_F(BHiveImporterLiveInfoTest, MissingFile) {
+  BHiveImporter importer(x86_canonicalizer_.get(), "PER_FUNC_LIVE_INFO");
+  EXPECT_THAT(importer.InteferenceGraphParser(::testing::TempDir() +
+                                              "/does_not_exist.liveinfo"),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
 }  // namespace
 }  // namespace gematria
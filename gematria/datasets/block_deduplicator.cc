@@ -0,0 +1,109 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/datasets/block_deduplicator.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "gematria/proto/basic_block.pb.h"
+#include "gematria/proto/canonicalized_instruction.pb.h"
+#include "gematria/proto/throughput.pb.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/xxhash.h"
+
+namespace gematria {
+
+std::string CanonicalizedBasicBlockKey(const BasicBlockProto& block) {
+  std::string key;
+  std::string serialized_instruction;
+  for (const CanonicalizedInstructionProto& instruction :
+       block.canonicalized_instructions()) {
+    instruction.SerializeToString(&serialized_instruction);
+    // Each instruction is prefixed with its size, so that the concatenation of
+    // the serialized instructions is unambiguous.
+    char size_bytes[4];
+    llvm::support::endian::write32le(size_bytes,
+                                     serialized_instruction.size());
+    key.append(size_bytes, sizeof(size_bytes));
+    key.append(serialized_instruction);
+  }
+  return key;
+}
+
+void MergeInverseThroughputs(const BasicBlockWithThroughputProto& source,
+                             BasicBlockWithThroughputProto& target) {
+  for (const ThroughputWithSourceProto& source_throughput :
+       source.inverse_throughputs()) {
+    ThroughputWithSourceProto* target_throughput = nullptr;
+    for (ThroughputWithSourceProto& throughput :
+         *target.mutable_inverse_throughputs()) {
+      if (throughput.source() == source_throughput.source()) {
+        target_throughput = &throughput;
+        break;
+      }
+    }
+    if (target_throughput == nullptr) {
+      *target.add_inverse_throughputs() = source_throughput;
+      continue;
+    }
+    target_throughput->mutable_inverse_throughput_cycles()->MergeFrom(
+        source_throughput.inverse_throughput_cycles());
+    const int num_prefixes = source_throughput.prefix_inverse_throughputs_size();
+    for (int i = 0; i < num_prefixes; ++i) {
+      if (i >= target_throughput->prefix_inverse_throughputs_size()) {
+        target_throughput->add_prefix_inverse_throughputs();
+      }
+      target_throughput->mutable_prefix_inverse_throughputs(i)
+          ->mutable_inverse_throughput_cycles()
+          ->MergeFrom(source_throughput.prefix_inverse_throughputs(i)
+                          .inverse_throughput_cycles());
+    }
+  }
+}
+
+bool BasicBlockDeduplicator::Add(BasicBlockWithThroughputProto block) {
+  const std::string key = CanonicalizedBasicBlockKey(block.basic_block());
+  const uint64_t hash = llvm::xxHash64(llvm::StringRef(key));
+  const auto [it, inserted] = first_block_by_hash_.try_emplace(hash, kNoBlock);
+  size_t* last_index = &it->second;
+  while (*last_index != kNoBlock) {
+    BasicBlockWithThroughputProto& existing_block = blocks_[*last_index];
+    if (CanonicalizedBasicBlockKey(existing_block.basic_block()) == key) {
+      MergeInverseThroughputs(block, existing_block);
+      existing_block.set_num_duplicates(existing_block.num_duplicates() + 1);
+      ++num_duplicates_;
+      return false;
+    }
+    last_index = &next_block_with_same_hash_[*last_index];
+  }
+  *last_index = blocks_.size();
+  blocks_.push_back(std::move(block));
+  next_block_with_same_hash_.push_back(kNoBlock);
+  return true;
+}
+
+std::vector<BasicBlockWithThroughputProto> BasicBlockDeduplicator::TakeBlocks() {
+  std::vector<BasicBlockWithThroughputProto> blocks = std::move(blocks_);
+  blocks_.clear();
+  next_block_with_same_hash_.clear();
+  first_block_by_hash_.clear();
+  return blocks;
+}
+
+}  // namespace gematria
@@ -0,0 +1,83 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains a class that merges basic blocks with the same canonicalized
+// instructions into a single BasicBlockWithThroughputProto during the import of
+// a data set.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_BLOCK_DEDUPLICATOR_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_BLOCK_DEDUPLICATOR_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "gematria/proto/basic_block.pb.h"
+#include "gematria/proto/throughput.pb.h"
+
+namespace gematria {
+
+// Returns a byte string that is equal for two basic blocks if and only if they
+// have the same canonicalized instructions. The other fields of the block, e.g.
+// the addresses of the machine instructions, do not affect the key.
+std::string CanonicalizedBasicBlockKey(const BasicBlockProto& block);
+
+// Merges the throughputs from `source` into `target`. Throughputs with a source
+// name that is already present in `target` are appended to the existing
+// ThroughputWithSourceProto; other throughputs are added as new entries.
+void MergeInverseThroughputs(const BasicBlockWithThroughputProto& source,
+                             BasicBlockWithThroughputProto& target);
+
+// Collects basic blocks and merges the blocks that have the same canonicalized
+// instructions. The first copy of each block is kept, the throughputs of the
+// other copies are merged into it, and its `num_duplicates` field is
+// incremented for each merged copy.
+//
+// The blocks are looked up by a 64-bit hash of their canonicalized
+// instructions; the keys of blocks with the same hash are compared, so hash
+// collisions never merge different blocks.
+class BasicBlockDeduplicator {
+ public:
+  // Adds `block` to the collection. Returns true when the block is new, and
+  // false when it was merged into a block added before.
+  bool Add(BasicBlockWithThroughputProto block);
+
+  // Returns the unique blocks in the order in which they were first added, and
+  // clears the collection.
+  std::vector<BasicBlockWithThroughputProto> TakeBlocks();
+
+  // Returns the number of unique blocks in the collection.
+  size_t size() const { return blocks_.size(); }
+  // Returns the number of blocks merged into a block added before.
+  int64_t num_duplicates() const { return num_duplicates_; }
+
+ private:
+  static constexpr size_t kNoBlock = static_cast<size_t>(-1);
+
+  // The unique blocks in the order in which they were added.
+  std::vector<BasicBlockWithThroughputProto> blocks_;
+  // The index of the next block in `blocks_` with the same hash, or kNoBlock
+  // when this is the last such block.
+  std::vector<size_t> next_block_with_same_hash_;
+  // Maps the hash of the canonicalized instructions to the index of the first
+  // block in `blocks_` with this hash.
+  absl::flat_hash_map<uint64_t, size_t> first_block_by_hash_;
+  int64_t num_duplicates_ = 0;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_BLOCK_DEDUPLICATOR_H_
@@ -0,0 +1,157 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/datasets/block_deduplicator.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "gematria/proto/basic_block.pb.h"
+#include "gematria/proto/throughput.pb.h"
+#include "gematria/testing/matchers.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+
+BasicBlockWithThroughputProto MakeBlock(const std::string& mnemonic,
+                                        uint64_t address,
+                                        const std::string& source,
+                                        double throughput) {
+  BasicBlockWithThroughputProto block;
+  block.mutable_basic_block()->add_machine_instructions()->set_address(address);
+  block.mutable_basic_block()->add_canonicalized_instructions()->set_mnemonic(
+      mnemonic);
+  ThroughputWithSourceProto& throughput_proto =
+      *block.add_inverse_throughputs();
+  throughput_proto.set_source(source);
+  throughput_proto.add_inverse_throughput_cycles(throughput);
+  return block;
+}
+
+TEST(CanonicalizedBasicBlockKeyTest, IgnoresMachineInstructions) {
+  const BasicBlockWithThroughputProto block1 = MakeBlock("MOV", 0, "a", 1.0);
+  const BasicBlockWithThroughputProto block2 = MakeBlock("MOV", 100, "b", 2.0);
+  const BasicBlockWithThroughputProto block3 = MakeBlock("ADD", 0, "a", 1.0);
+  EXPECT_EQ(CanonicalizedBasicBlockKey(block1.basic_block()),
+            CanonicalizedBasicBlockKey(block2.basic_block()));
+  EXPECT_NE(CanonicalizedBasicBlockKey(block1.basic_block()),
+            CanonicalizedBasicBlockKey(block3.basic_block()));
+}
+
+TEST(CanonicalizedBasicBlockKeyTest, InstructionBoundaries) {
+  BasicBlockProto block1;
+  block1.add_canonicalized_instructions()->set_mnemonic("AB");
+  block1.add_canonicalized_instructions()->set_mnemonic("C");
+  BasicBlockProto block2;
+  block2.add_canonicalized_instructions()->set_mnemonic("A");
+  block2.add_canonicalized_instructions()->set_mnemonic("BC");
+  EXPECT_NE(CanonicalizedBasicBlockKey(block1),
+            CanonicalizedBasicBlockKey(block2));
+}
+
+TEST(MergeInverseThroughputsTest, MergesBySource) {
+  BasicBlockWithThroughputProto target = MakeBlock("MOV", 0, "a", 1.0);
+  target.mutable_inverse_throughputs(0)
+      ->add_prefix_inverse_throughputs()
+      ->add_inverse_throughput_cycles(0.5);
+  BasicBlockWithThroughputProto source = MakeBlock("MOV", 0, "a", 2.0);
+  source.mutable_inverse_throughputs(0)
+      ->add_prefix_inverse_throughputs()
+      ->add_inverse_throughput_cycles(1.5);
+  source.mutable_inverse_throughputs(0)
+      ->add_prefix_inverse_throughputs()
+      ->add_inverse_throughput_cycles(2.0);
+  ThroughputWithSourceProto& other_source = *source.add_inverse_throughputs();
+  other_source.set_source("b");
+  other_source.add_inverse_throughput_cycles(3.0);
+
+  MergeInverseThroughputs(source, target);
+  EXPECT_THAT(target, EqualsProto(R"pb(
+                basic_block {
+                  machine_instructions { address: 0 }
+                  canonicalized_instructions { mnemonic: "MOV" }
+                }
+                inverse_throughputs {
+                  source: "a"
+                  inverse_throughput_cycles: [ 1, 2 ]
+                  prefix_inverse_throughputs {
+                    inverse_throughput_cycles: [ 0.5, 1.5 ]
+                  }
+                  prefix_inverse_throughputs { inverse_throughput_cycles: 2 }
+                }
+                inverse_throughputs {
+                  source: "b"
+                  inverse_throughput_cycles: 3
+                })pb"));
+}
+
+TEST(BasicBlockDeduplicatorTest, Empty) {
+  BasicBlockDeduplicator deduplicator;
+  EXPECT_EQ(deduplicator.size(), 0);
+  EXPECT_EQ(deduplicator.num_duplicates(), 0);
+  EXPECT_THAT(deduplicator.TakeBlocks(), IsEmpty());
+}
+
+TEST(BasicBlockDeduplicatorTest, MergesDuplicates) {
+  BasicBlockDeduplicator deduplicator;
+  EXPECT_TRUE(deduplicator.Add(MakeBlock("MOV", 0, "a", 1.0)));
+  EXPECT_TRUE(deduplicator.Add(MakeBlock("ADD", 0, "a", 5.0)));
+  EXPECT_FALSE(deduplicator.Add(MakeBlock("MOV", 8, "a", 2.0)));
+  EXPECT_FALSE(deduplicator.Add(MakeBlock("MOV", 16, "b", 3.0)));
+  EXPECT_EQ(deduplicator.size(), 2);
+  EXPECT_EQ(deduplicator.num_duplicates(), 2);
+
+  const std::vector<BasicBlockWithThroughputProto> blocks =
+      deduplicator.TakeBlocks();
+  EXPECT_THAT(blocks, ElementsAre(EqualsProto(R"pb(
+                                    basic_block {
+                                      machine_instructions { address: 0 }
+                                      canonicalized_instructions {
+                                        mnemonic: "MOV"
+                                      }
+                                    }
+                                    inverse_throughputs {
+                                      source: "a"
+                                      inverse_throughput_cycles: [ 1, 2 ]
+                                    }
+                                    inverse_throughputs {
+                                      source: "b"
+                                      inverse_throughput_cycles: 3
+                                    }
+                                    num_duplicates: 2)pb"),
+                                  EqualsProto(R"pb(
+                                    basic_block {
+                                      machine_instructions { address: 0 }
+                                      canonicalized_instructions {
+                                        mnemonic: "ADD"
+                                      }
+                                    }
+                                    inverse_throughputs {
+                                      source: "a"
+                                      inverse_throughput_cycles: 5
+                                    })pb")));
+
+  // The deduplicator is empty after TakeBlocks().
+  EXPECT_EQ(deduplicator.size(), 0);
+  EXPECT_TRUE(deduplicator.Add(MakeBlock("MOV", 0, "a", 1.0)));
+}
+
+}  // namespace
+}  // namespace gematria
@@ -18,6 +18,8 @@
 #include <signal.h>
 #include <sys/mman.h>
 #include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/user.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -28,7 +30,9 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <memory>
 
+#include "absl/memory/memory.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/strings/str_format.h"
@@ -45,24 +49,60 @@ namespace {
 // kernel gives us. But if possible, we use this address.
 constexpr uintptr_t kDefaultCodeLocation = 0x2b00'0000'0000;
 
-// The data which is communicated from the child to the parent. The protocol is
-// that the child will either write nothing (if it crashes unexpectedly before
-// getting the chance to write to the pipe), or it will write one copy of this
-// struct. Alignment / size of data types etc. isn't an issue here since this
-// is only ever used for IPC with a forked process, so the ABI will be
-// identical.
+// The data which is communicated from the worker to the parent for each
+// request. The protocol is that the worker will either write nothing (if it
+// crashes unexpectedly before getting the chance to write to the socket), or it
+// will write one copy of this struct. Alignment / size of data types etc. isn't
+// an issue here since this is only ever used for IPC with a forked process, so
+// the ABI will be identical. The same holds for WorkerRequest.
 struct PipedData {
   uintptr_t code_address;
 };
 
+// The request sent from the parent to the worker for each execution of a
+// block. It is followed by `code_size` bytes of the block, and then by
+// `num_accessed_blocks` addresses of blocks that should be mapped.
+struct WorkerRequest {
+  uintptr_t code_location;
+  size_t block_size;
+  size_t code_size;
+  size_t num_accessed_blocks;
+};
+
+// A memory region mapped by the worker for the current request.
+struct WorkerMapping {
+  void* address;
+  size_t size;
+};
+
+// The size of the stack on which the worker processes the requests.
+constexpr size_t kWorkerStackSize = 256 * 1024;
+// The size of the stack on which the worker handles segfaults in
+// FaultHandling::kMapInPlace. The block may set the stack pointer to any
+// value, so the signal handler can't use the stack of the block.
+constexpr size_t kWorkerSignalStackSize = 64 * 1024;
+
+// The state of the worker that is kept between requests. It is stored in a
+// global variable, because each request starts on an empty stack with the
+// registers from the saved state. This is used only in worker processes, each
+// of which has its own copy.
+struct WorkerState {
+  // The regions mapped for the previous request. The array itself is mmapped,
+  // as the worker does not use the heap.
+  WorkerMapping* mappings = nullptr;
+  size_t num_mappings = 0;
+  size_t mappings_capacity = 0;
+};
+WorkerState worker_state;
+
 bool IsRetryable(int err) {
   return err == EINTR || err == EAGAIN || err == EWOULDBLOCK;
 }
 
-absl::Status WriteAll(int fd, const PipedData& piped_data) {
-  auto data_span = absl::MakeConstSpan(
-      reinterpret_cast<const uint8_t*>(&piped_data), sizeof piped_data);
-
+// Writes all of `data_span` to `fd`. Returns 0 on success, and the error
+// number otherwise. The low-level functions do not allocate memory: the worker
+// may be forked from a multi-threaded process, where it can't use the heap.
+int WriteAllNoAlloc(int fd, absl::Span<const uint8_t> data_span) {
   size_t current_offset = 0;
   while (current_offset < data_span.size()) {
     size_t to_write = data_span.size() - current_offset;
@@ -70,26 +110,27 @@ absl::Status WriteAll(int fd, const PipedData& piped_data) {
     ssize_t bytes_written;
     int err;
     do {
-      bytes_written = write(fd, data_span.data() + current_offset, to_write);
+      // MSG_NOSIGNAL prevents SIGPIPE when the other process died.
+      bytes_written = send(fd, data_span.data() + current_offset, to_write,
+                           MSG_NOSIGNAL);
       err = errno;
-    } while (IsRetryable(err));
+    } while (bytes_written < 0 && IsRetryable(err));
 
     if (bytes_written < 0) {
-      return absl::ErrnoToStatus(err, "Failed to write to pipe");
+      return err;
     }
 
     current_offset += bytes_written;
   }
 
-  close(fd);
-  return absl::OkStatus();
+  return 0;
 }
 
-absl::StatusOr<PipedData> ReadAll(int fd) {
-  PipedData piped_data;
-  auto data_span = absl::MakeSpan(reinterpret_cast<uint8_t*>(&piped_data),
-                                  sizeof piped_data);
-
+// Reads exactly `data_span.size()` bytes from `fd`. With `flags` =
+// MSG_DONTWAIT, fails when the data is not available right away. Returns 0 on
+// success, the error number when reading fails, and EIO when the socket was
+// closed before all the data was read.
+int ReadAllNoAlloc(int fd, absl::Span<uint8_t> data_span, int flags = 0) {
   size_t current_offset = 0;
   while (current_offset < data_span.size()) {
     size_t to_read = data_span.size() - current_offset;
@@ -97,129 +138,160 @@ absl::StatusOr<PipedData> ReadAll(int fd) {
     ssize_t bytes_read;
     int err;
     do {
-      bytes_read = read(fd, data_span.data() + current_offset, to_read);
+      bytes_read = recv(fd, data_span.data() + current_offset, to_read, flags);
       err = errno;
-    } while (IsRetryable(err));
+    } while (bytes_read < 0 && err == EINTR);
 
     if (bytes_read < 0) {
-      return absl::ErrnoToStatus(err, "Failed to read from pipe");
+      return err;
     }
 
     if (bytes_read == 0) {
-      break;
+      return EIO;
     }
     current_offset += bytes_read;
   }
 
-  if (current_offset != data_span.size()) {
-    return absl::InternalError("Read less than expected from pipe");
-  }
-  close(fd);
-  return piped_data;
+  return 0;
 }
 
-uintptr_t AlignDown(uintptr_t x, size_t align) { return x - (x % align); }
-
-absl::Status ParentProcessInner(int child_pid, AccessedAddrs& accessed_addrs) {
-  int status;
-  waitpid(child_pid, &status, 0);
-
-  if (!WIFSTOPPED(status)) {
-    return absl::InternalError(absl::StrFormat(
-        "Child terminated with an unexpected status: %d", status));
+absl::Status WriteAll(int fd, absl::Span<const uint8_t> data_span) {
+  const int err = WriteAllNoAlloc(fd, data_span);
+  if (err != 0) {
+    return absl::ErrnoToStatus(err, "Failed to write to socket");
   }
+  return absl::OkStatus();
+}
 
-  // At this point the child is stopped, and we are attached.
-  // TODO(orodley): Since we don't set any ptrace options here, do we actually
-  // need this initial stop and continue, or could the child just PTRACE_TRACEME
-  // and keep going without raising an initial SIGSTOP?
-  ptrace(PTRACE_CONT, child_pid, nullptr, nullptr);
-
-  waitpid(child_pid, &status, 0);
-  if (!WIFSTOPPED(status)) {
-    return absl::InternalError(absl::StrFormat(
-        "Child terminated with an unexpected status: %d", status));
-  }
-
-  int signal = WSTOPSIG(status);
-  if (signal == SIGSEGV) {
-    // SIGSEGV means the block tried to access some unmapped memory, as
-    // expected.
-    siginfo_t siginfo;
-    ptrace(PTRACE_GETSIGINFO, child_pid, 0, &siginfo);
-    uintptr_t addr = AlignDown(reinterpret_cast<uintptr_t>(siginfo.si_addr),
-                               accessed_addrs.block_size);
-
-    if (std::find(accessed_addrs.accessed_blocks.begin(),
-                  accessed_addrs.accessed_blocks.end(),
-                  addr) == accessed_addrs.accessed_blocks.end()) {
-      accessed_addrs.accessed_blocks.push_back(addr);
-    }
-    return absl::OkStatus();
+absl::Status ReadAll(int fd, absl::Span<uint8_t> data_span, int flags = 0) {
+  const int err = ReadAllNoAlloc(fd, data_span, flags);
+  if (err == EIO) {
+    return absl::InternalError("Read less than expected from socket");
   }
-  if (signal == SIGABRT) {
-    // SIGABRT means the block finished, and executed our after-block code which
-    // terminates the process. So, it didn't access any memory.
-    return absl::OkStatus();
+  if (err != 0) {
+    return absl::ErrnoToStatus(err, "Failed to read from socket");
   }
+  return absl::OkStatus();
+}
 
-  return absl::InternalError(absl::StrFormat(
-      "Child stopped with unexpected signal: %s", strsignal(signal)));
+template <typename T>
+absl::Span<const uint8_t> AsBytes(const T& value) {
+  return absl::MakeConstSpan(reinterpret_cast<const uint8_t*>(&value),
+                             sizeof(value));
 }
 
-absl::Status ParentProcess(int child_pid, int pipe_read_fd,
-                           AccessedAddrs& accessed_addrs) {
-  auto result = ParentProcessInner(child_pid, accessed_addrs);
-
-  // Regardless of what happened, kill the child with SIGKILL. If we just detach
-  // with PTRACE_DETACH and let the process resume, it will exit with whatever
-  // signal it was about to exit with before we caught it. If that signal is
-  // SIGSEGV then it could get caught by (e.g.) the terminal and printed. We
-  // don't want that as SIGSEGV is actually normal and expected here, and this
-  // would just be useless noise.
-  int err = kill(child_pid, SIGKILL);
-  if (err != 0) {
-    char* err_str = strerror(err);
-    return absl::InternalError(
-        absl::StrFormat("Failed to kill child process: %s", err_str));
-  }
-  // We must wait on the child after killing it, otherwise it remains as a
-  // zombie process.
-  waitpid(child_pid, nullptr, 0);
+template <typename T>
+absl::Span<uint8_t> AsWritableBytes(T& value) {
+  return absl::MakeSpan(reinterpret_cast<uint8_t*>(&value), sizeof(value));
+}
 
-  if (!result.ok()) {
-    return result;
-  }
+uintptr_t AlignDown(uintptr_t x, size_t align) { return x - (x % align); }
 
-  auto pipe_data = ReadAll(pipe_read_fd);
-  if (!pipe_data.ok()) {
-    return pipe_data.status();
+// Maps `size` bytes of anonymous memory for the worker. Aborts the worker when
+// the memory can't be mapped.
+void* MapWorkerMemory(size_t size) {
+  void* const address = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (address == MAP_FAILED) {
+    perror("mapping worker memory failed");
+    abort();
   }
+  return address;
+}
 
-  accessed_addrs.code_location = pipe_data.value().code_address;
+// Records a region mapped for the current request. The array of the mappings
+// is grown as needed; this is also used from the signal handler, so it may only
+// use async-signal-safe functions.
+void AddWorkerMapping(void* address, size_t size) {
+  if (worker_state.num_mappings == worker_state.mappings_capacity) {
+    const size_t new_capacity =
+        std::max<size_t>(2 * worker_state.mappings_capacity,
+                         getpagesize() / sizeof(WorkerMapping));
+    auto* const new_mappings = static_cast<WorkerMapping*>(
+        MapWorkerMemory(new_capacity * sizeof(WorkerMapping)));
+    if (worker_state.mappings != nullptr) {
+      std::copy_n(worker_state.mappings, worker_state.num_mappings,
+                  new_mappings);
+      munmap(worker_state.mappings,
+             worker_state.mappings_capacity * sizeof(WorkerMapping));
+    }
+    worker_state.mappings = new_mappings;
+    worker_state.mappings_capacity = new_capacity;
+  }
+  worker_state.mappings[worker_state.num_mappings++] = {address, size};
+}
 
-  return absl::OkStatus();
+// The SIGSEGV handler of the worker in FaultHandling::kMapInPlace. Maps the
+// page that the block tried to access and returns, so that the faulting
+// instruction is executed again. The parent records the address when the
+// signal is delivered. When the page can't be mapped, the worker aborts, which
+// the parent sees as the end of the block.
+void MapFaultingPage(int signal, siginfo_t* siginfo, void* context) {
+  const size_t page_size = getpagesize();
+  void* const page = reinterpret_cast<void*>(
+      AlignDown(reinterpret_cast<uintptr_t>(siginfo->si_addr), page_size));
+  // MAP_FIXED_NOREPLACE fails when the page is already mapped, e.g. when the
+  // fault is caused by the protection of the page rather than a missing
+  // mapping. Retrying the instruction would then fault again forever.
+  void* const mapped_address =
+      mmap(page, page_size, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+  if (mapped_address == MAP_FAILED) abort();
+  if (mapped_address != page) {
+    // Kernels before 4.17 treat MAP_FIXED_NOREPLACE as a hint.
+    munmap(mapped_address, page_size);
+    abort();
+  }
+  AddWorkerMapping(mapped_address, page_size);
 }
 
-[[noreturn]] void ChildProcess(absl::Span<const uint8_t> basic_block,
-                               int pipe_write_fd,
-                               const AccessedAddrs& accessed_addrs) {
-  // Make sure the parent is attached before doing anything that they might want
-  // to listen for.
-  ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
-  raise(SIGSTOP);
+// Reads a request from the socket, maps the memory for it and executes the
+// block. Never returns: the block either segfaults, or it executes our
+// after-block code.
+[[noreturn]] void WorkerRunRequest(int socket_fd) {
+  WorkerRequest request;
+  if (ReadAllNoAlloc(socket_fd, AsWritableBytes(request)) != 0) abort();
+
+  // Read the code and the addresses to a temporary buffer; the worker does not
+  // use the heap, as it may be forked from a multi-threaded process.
+  const size_t payload_size =
+      request.code_size + request.num_accessed_blocks * sizeof(uintptr_t);
+  uint8_t* const payload =
+      static_cast<uint8_t*>(MapWorkerMemory(std::max<size_t>(payload_size, 1)));
+  if (ReadAllNoAlloc(socket_fd, absl::MakeSpan(payload, payload_size)) != 0) {
+    abort();
+  }
+  const absl::Span<const uint8_t> basic_block(payload, request.code_size);
+  const absl::Span<const uintptr_t> accessed_blocks(
+      reinterpret_cast<const uintptr_t*>(payload + request.code_size),
+      request.num_accessed_blocks);
+
+  // Unmap the memory from the previous request, so that the block sees fresh
+  // zero-filled pages as in a newly forked process.
+  for (size_t i = 0; i < worker_state.num_mappings; ++i) {
+    munmap(worker_state.mappings[i].address, worker_state.mappings[i].size);
+  }
+  worker_state.num_mappings = 0;
+
+  // The previous request may have ended in the signal handler, where SIGSEGV
+  // is blocked. Resetting the registers does not reset the signal mask.
+  sigset_t segv_set;
+  sigemptyset(&segv_set);
+  sigaddset(&segv_set, SIGSEGV);
+  sigprocmask(SIG_UNBLOCK, &segv_set, nullptr);
 
   // Map all the locations we've previously discovered this code accesses.
-  for (uintptr_t accessed_location : accessed_addrs.accessed_blocks) {
+  for (uintptr_t accessed_location : accessed_blocks) {
     auto location_ptr = reinterpret_cast<void*>(accessed_location);
     void* mapped_address =
-        mmap(location_ptr, accessed_addrs.block_size, PROT_READ | PROT_WRITE,
+        mmap(location_ptr, request.block_size, PROT_READ | PROT_WRITE,
              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
     if (mapped_address == MAP_FAILED) {
       perror("mapping previously discovered address failed");
       abort();
     }
+    AddWorkerMapping(mapped_address, request.block_size);
     if (mapped_address != location_ptr) {
       fputs(
           "tried to map previously discovered address, but mmap couldn't map "
@@ -237,7 +309,7 @@ absl::Status ParentProcess(int child_pid, int pipe_read_fd,
   const auto total_block_size =
       before_block.size() + basic_block.size() + after_block.size();
 
-  uintptr_t desired_code_location = accessed_addrs.code_location;
+  uintptr_t desired_code_location = request.code_location;
   if (desired_code_location == 0) {
     desired_code_location = kDefaultCodeLocation;
   }
@@ -249,13 +321,7 @@ absl::Status ParentProcess(int child_pid, int pipe_read_fd,
     perror("mmap failed");
     abort();
   }
-
-  PipedData piped_data = {.code_address =
-                              reinterpret_cast<uintptr_t>(mapped_address)};
-  auto status = WriteAll(pipe_write_fd, piped_data);
-  if (!status.ok()) {
-    abort();
-  }
+  AddWorkerMapping(mapped_address, total_block_size);
 
   absl::Span<uint8_t> mapped_span = absl::MakeSpan(
       reinterpret_cast<uint8_t*>(mapped_address), total_block_size);
@@ -264,6 +330,15 @@ absl::Status ParentProcess(int child_pid, int pipe_read_fd,
             &mapped_span[before_block.size()]);
   std::copy(after_block.begin(), after_block.end(),
             &mapped_span[before_block.size() + basic_block.size()]);
+  munmap(payload, std::max<size_t>(payload_size, 1));
+
+  // The parent reads the response only once the block has stopped, so it is
+  // written right before the block is executed.
+  PipedData piped_data = {.code_address =
+                              reinterpret_cast<uintptr_t>(mapped_address)};
+  if (WriteAllNoAlloc(socket_fd, AsBytes(piped_data)) != 0) {
+    abort();
+  }
 
   auto mapped_func = reinterpret_cast<void (*)()>(mapped_address);
   mapped_func();
@@ -273,35 +348,31 @@ absl::Status ParentProcess(int child_pid, int pipe_read_fd,
   abort();
 }
 
-absl::Status ForkAndTestAddresses(absl::Span<const uint8_t> basic_block,
-                                  AccessedAddrs& accessed_addrs) {
-  int pipe_fds[2];
-  if (pipe(pipe_fds) != 0) {
-    int err = errno;
-    return absl::ErrnoToStatus(
-        err, "Failed to open pipe for communication with child process: %s");
-  }
-  int pipe_read_fd = pipe_fds[0];
-  int pipe_write_fd = pipe_fds[1];
-
-  pid_t pid = fork();
-  switch (pid) {
-    case -1: {
-      int err = errno;
-      return absl::ErrnoToStatus(err, "Failed to fork");
+[[noreturn]] void WorkerProcess(FaultHandling fault_handling) {
+  if (fault_handling == FaultHandling::kMapInPlace) {
+    stack_t signal_stack = {.ss_sp = MapWorkerMemory(kWorkerSignalStackSize),
+                            .ss_flags = 0,
+                            .ss_size = kWorkerSignalStackSize};
+    struct sigaction action = {};
+    action.sa_sigaction = &MapFaultingPage;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    if (sigaltstack(&signal_stack, nullptr) != 0 ||
+        sigaction(SIGSEGV, &action, nullptr) != 0) {
+      perror("installing the SIGSEGV handler failed");
+      abort();
     }
-    case 0:  // child
-      // Child only writes to the pipe.
-      close(pipe_read_fd);
-
-      // ChildProcess doesn't return.
-      ChildProcess(basic_block, pipe_write_fd, accessed_addrs);
-    default:  // parent
-      // Parent only reads from the pipe.
-      close(pipe_write_fd);
-
-      return ParentProcess(pid, pipe_read_fd, accessed_addrs);
   }
+  // Make sure the parent is attached before doing anything that they might want
+  // to listen for.
+  ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+  raise(SIGSTOP);
+  // The parent never lets the worker continue from here: for each request, it
+  // sets the registers of the worker so that it calls WorkerRunRequest() on
+  // its own stack. Restarting from the entry of a function on an empty stack
+  // does not depend on any stack frames that might have been overwritten by
+  // the previous request.
+  abort();
 }
 
 }  // namespace
@@ -326,15 +397,278 @@ absl::Status ForkAndTestAddresses(absl::Span<const uint8_t> basic_block,
 // * Much more complete testing.
 absl::StatusOr<AccessedAddrs> FindAccessedAddrs(
     absl::Span<const uint8_t> basic_block) {
+  absl::StatusOr<std::unique_ptr<AccessedAddrsFinder>> finder =
+      AccessedAddrsFinder::Create();
+  if (!finder.ok()) {
+    return finder.status();
+  }
+  return (*finder)->FindAccessedAddrs(basic_block);
+}
+
+absl::StatusOr<std::unique_ptr<AccessedAddrsFinder>>
+AccessedAddrsFinder::Create(FaultHandling fault_handling,
+                            int max_blocks_per_worker) {
+  auto finder = absl::WrapUnique(
+      new AccessedAddrsFinder(fault_handling, max_blocks_per_worker));
+  auto status = finder->StartWorker();
+  if (!status.ok()) {
+    return status;
+  }
+  return finder;
+}
+
+AccessedAddrsFinder::~AccessedAddrsFinder() { StopWorker(); }
+
+absl::Status AccessedAddrsFinder::StartWorker() {
+  int socket_fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, socket_fds) != 0) {
+    int err = errno;
+    return absl::ErrnoToStatus(
+        err, "Failed to open socket for communication with worker process");
+  }
+  // The stack on which the worker processes the requests. It is mapped before
+  // the fork, so that the worker has it at an address known to the parent.
+  void* const worker_stack = mmap(nullptr, kWorkerStackSize,
+                                  PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (worker_stack == MAP_FAILED) {
+    int err = errno;
+    close(socket_fds[0]);
+    close(socket_fds[1]);
+    return absl::ErrnoToStatus(err, "Failed to map the worker stack");
+  }
+
+  pid_t pid = fork();
+  switch (pid) {
+    case -1: {
+      int err = errno;
+      close(socket_fds[0]);
+      close(socket_fds[1]);
+      munmap(worker_stack, kWorkerStackSize);
+      return absl::ErrnoToStatus(err, "Failed to fork");
+    }
+    case 0:  // child
+      close(socket_fds[0]);
+
+      // WorkerProcess doesn't return.
+      WorkerProcess(fault_handling_);
+    default:  // parent
+      close(socket_fds[1]);
+      // The worker has its own copy of the stack.
+      munmap(worker_stack, kWorkerStackSize);
+      worker_pid_ = pid;
+      socket_fd_ = socket_fds[0];
+      num_blocks_in_worker_ = 0;
+      ++num_workers_started_;
+  }
+
+  int status;
+  waitpid(worker_pid_, &status, 0);
+  if (!WIFSTOPPED(status) || WSTOPSIG(status) != SIGSTOP) {
+    StopWorker();
+    return absl::InternalError(absl::StrFormat(
+        "Worker terminated with an unexpected status: %d", status));
+  }
+
+  // Kill the worker if the parent dies, so it does not stay stopped forever.
+  ptrace(PTRACE_SETOPTIONS, worker_pid_, nullptr, PTRACE_O_EXITKILL);
+  if (ptrace(PTRACE_GETREGS, worker_pid_, nullptr, &worker_regs_) != 0 ||
+      ptrace(PTRACE_GETFPREGS, worker_pid_, nullptr, &worker_fpregs_) != 0) {
+    int err = errno;
+    StopWorker();
+    return absl::ErrnoToStatus(err, "Failed to read the worker registers");
+  }
+  // Each request starts with a call to WorkerRunRequest(socket_fd) on the
+  // worker stack. The stack pointer is set as if the function was called, with
+  // a null return address.
+  const uintptr_t stack_top =
+      reinterpret_cast<uintptr_t>(worker_stack) + kWorkerStackSize;
+  worker_regs_.rip = reinterpret_cast<uintptr_t>(&WorkerRunRequest);
+  worker_regs_.rsp = stack_top - sizeof(uintptr_t);
+  worker_regs_.rbp = 0;
+  worker_regs_.rdi = socket_fds[1];
+  // The worker is stopped on the exit from the system call that raised
+  // SIGSTOP. Clearing the system call number makes sure that the kernel never
+  // tries to restart it when the registers are set.
+  worker_regs_.orig_rax = -1;
+  if (ptrace(PTRACE_SETREGS, worker_pid_, nullptr, &worker_regs_) != 0) {
+    int err = errno;
+    StopWorker();
+    return absl::ErrnoToStatus(err, "Failed to set the worker registers");
+  }
+  return absl::OkStatus();
+}
+
+void AccessedAddrsFinder::StopWorker() {
+  if (socket_fd_ >= 0) {
+    close(socket_fd_);
+    socket_fd_ = -1;
+  }
+  if (worker_pid_ < 0) return;
+  // Kill the worker with SIGKILL. If we just detach with PTRACE_DETACH and let
+  // the process resume, it will exit with whatever signal it was about to exit
+  // with before we caught it. If that signal is SIGSEGV then it could get
+  // caught by (e.g.) the terminal and printed. We don't want that as SIGSEGV is
+  // actually normal and expected here, and this would just be useless noise.
+  kill(worker_pid_, SIGKILL);
+  // We must wait on the worker after killing it, otherwise it remains as a
+  // zombie process. An error here means that the worker was already reaped.
+  waitpid(worker_pid_, nullptr, 0);
+  worker_pid_ = -1;
+}
+
+absl::Status AccessedAddrsFinder::RunInWorkerInner(
+    absl::Span<const uint8_t> basic_block, AccessedAddrs& accessed_addrs) {
+  // The worker is stopped with the registers from the point where it is ready
+  // to read a request. Continue it without delivering the pending signal.
+  if (ptrace(PTRACE_CONT, worker_pid_, nullptr, nullptr) != 0) {
+    int err = errno;
+    return absl::ErrnoToStatus(err, "Failed to continue the worker");
+  }
+
+  const WorkerRequest request = {
+      .code_location = accessed_addrs.code_location,
+      .block_size = accessed_addrs.block_size,
+      .code_size = basic_block.size(),
+      .num_accessed_blocks = accessed_addrs.accessed_blocks.size()};
+  auto status = WriteAll(socket_fd_, AsBytes(request));
+  if (status.ok()) status = WriteAll(socket_fd_, basic_block);
+  if (status.ok()) {
+    status = WriteAll(
+        socket_fd_,
+        absl::MakeConstSpan(
+            reinterpret_cast<const uint8_t*>(
+                accessed_addrs.accessed_blocks.data()),
+            accessed_addrs.accessed_blocks.size() * sizeof(uintptr_t)));
+  }
+  if (!status.ok()) {
+    return status;
+  }
+
+  ++num_executions_;
+  int wait_status;
+  waitpid(worker_pid_, &wait_status, 0);
+  if (!WIFSTOPPED(wait_status)) {
+    // The worker is gone; there is nothing left to kill.
+    worker_pid_ = -1;
+    return absl::InternalError(absl::StrFormat(
+        "Child terminated with an unexpected status: %d", wait_status));
+  }
+
+  // The worker writes the address of the code right before it executes the
+  // block. When it is not there, the worker failed while preparing the block.
+  PipedData piped_data;
+  status = ReadAll(socket_fd_, AsWritableBytes(piped_data), MSG_DONTWAIT);
+  if (!status.ok()) {
+    return absl::InternalError(absl::StrFormat(
+        "Worker stopped with signal %s before executing the block",
+        strsignal(WSTOPSIG(wait_status))));
+  }
+  accessed_addrs.code_location = piped_data.code_address;
+
+  while (true) {
+    int signal = WSTOPSIG(wait_status);
+    if (signal == SIGSEGV) {
+      // SIGSEGV means the block tried to access some unmapped memory, as
+      // expected.
+      siginfo_t siginfo;
+      ptrace(PTRACE_GETSIGINFO, worker_pid_, 0, &siginfo);
+      uintptr_t addr = AlignDown(reinterpret_cast<uintptr_t>(siginfo.si_addr),
+                                 accessed_addrs.block_size);
+
+      if (std::find(accessed_addrs.accessed_blocks.begin(),
+                    accessed_addrs.accessed_blocks.end(),
+                    addr) == accessed_addrs.accessed_blocks.end()) {
+        accessed_addrs.accessed_blocks.push_back(addr);
+      }
+      if (fault_handling_ == FaultHandling::kRestart) {
+        return absl::OkStatus();
+      }
+      // Deliver the signal to the handler in the worker, which maps the page
+      // and continues the block.
+      if (ptrace(PTRACE_CONT, worker_pid_, nullptr, SIGSEGV) != 0) {
+        int err = errno;
+        return absl::ErrnoToStatus(err, "Failed to continue the worker");
+      }
+      waitpid(worker_pid_, &wait_status, 0);
+      if (!WIFSTOPPED(wait_status)) {
+        worker_pid_ = -1;
+        return absl::InternalError(absl::StrFormat(
+            "Child terminated with an unexpected status: %d", wait_status));
+      }
+      continue;
+    }
+    if (signal == SIGABRT) {
+      // SIGABRT means the block finished, and executed our after-block code
+      // which raises SIGABRT. With FaultHandling::kMapInPlace, it is also
+      // raised by the signal handler when it could not map a page.
+      return absl::OkStatus();
+    }
+
+    return absl::InternalError(absl::StrFormat(
+        "Child stopped with unexpected signal: %s", strsignal(signal)));
+  }
+}
+
+absl::Status AccessedAddrsFinder::RunInWorker(
+    absl::Span<const uint8_t> basic_block, AccessedAddrs& accessed_addrs) {
+  if (worker_pid_ < 0) {
+    auto status = StartWorker();
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  auto status = RunInWorkerInner(basic_block, accessed_addrs);
+  if (status.ok()) {
+    // Reset the worker, so that the next request starts from the saved state.
+    if (ptrace(PTRACE_SETREGS, worker_pid_, nullptr, &worker_regs_) != 0 ||
+        ptrace(PTRACE_SETFPREGS, worker_pid_, nullptr, &worker_fpregs_) != 0) {
+      int err = errno;
+      status = absl::ErrnoToStatus(err, "Failed to reset the worker");
+    }
+  }
+  if (!status.ok()) {
+    // The state of the worker is unknown; a new one is started for the next
+    // request.
+    StopWorker();
+  }
+  return status;
+}
+
+absl::StatusOr<AccessedAddrs> AccessedAddrsFinder::FindAccessedAddrs(
+    absl::Span<const uint8_t> basic_block) {
   AccessedAddrs accessed_addrs = {
       .code_location = 0,
       .block_size = static_cast<size_t>(getpagesize()),
       .accessed_blocks = {}};
 
+  // The writes of the previous blocks to the memory of the worker can't be
+  // undone; replacing the worker bounds the number of blocks they affect.
+  if (max_blocks_per_worker_ > 0 &&
+      num_blocks_in_worker_ >= max_blocks_per_worker_) {
+    StopWorker();
+  }
+  if (worker_pid_ < 0) {
+    auto status = StartWorker();
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  ++num_blocks_in_worker_;
+
+  if (fault_handling_ == FaultHandling::kMapInPlace) {
+    // All the accessed addresses are found in a single execution.
+    auto status = RunInWorker(basic_block, accessed_addrs);
+    if (!status.ok()) {
+      return status;
+    }
+    return accessed_addrs;
+  }
+
   size_t num_accessed_blocks;
   do {
     num_accessed_blocks = accessed_addrs.accessed_blocks.size();
-    auto status = ForkAndTestAddresses(basic_block, accessed_addrs);
+    auto status = RunInWorker(basic_block, accessed_addrs);
     if (!status.ok()) {
       return status;
     }
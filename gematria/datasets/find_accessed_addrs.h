@@ -15,9 +15,15 @@
 #ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_FIND_ACCESSED_ADDRS_H_
 #define THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_FIND_ACCESSED_ADDRS_H_
 
+#include <sys/types.h>
+#include <sys/user.h>
+
+#include <cstddef>
 #include <cstdint>
+#include <memory>
 #include <vector>
 
+#include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/types/span.h"
 
@@ -32,9 +38,112 @@ struct AccessedAddrs {
 // Given a basic block of code, attempt to determine what addresses that code
 // accesses. This is done by executing the code in a new process, so the code
 // must match the architecture on which this function is executed.
+//
+// This creates a new AccessedAddrsFinder for each call; use
+// AccessedAddrsFinder directly to reuse the worker process across blocks.
 absl::StatusOr<AccessedAddrs> FindAccessedAddrs(
     absl::Span<const uint8_t> basic_block);
 
+// Specifies how the worker process handles an access to unmapped memory.
+enum class FaultHandling {
+  // The execution of the block stops at the first segfault. The block is then
+  // executed again with all the addresses found so far mapped, until it runs
+  // without accessing new addresses. A block that accesses N distinct blocks of
+  // memory is executed N + 1 times.
+  kRestart,
+  // A signal handler in the worker maps the faulting page and lets the block
+  // continue from the faulting instruction, so all the accessed addresses are
+  // found in a single execution. When a page can't be mapped (e.g. because it
+  // is outside of the user address space or already mapped by the worker), its
+  // address is recorded and the execution stops there.
+  kMapInPlace,
+};
+
+// Finds the addresses accessed by basic blocks using a persistent worker
+// process. The worker is forked once, and its registers are saved while it is
+// stopped. After each execution of a block, the registers of the worker are
+// reset from the saved state so that it reads the next request from the top of
+// a stack of its own, without forking a new process. The memory mapped for the
+// previous attempt is unmapped by the worker before it maps the memory for the
+// next one.
+//
+// When the worker stops in an unexpected way, it is killed, and a new worker is
+// started for the next block.
+//
+// Only the memory mapped for the blocks is restored between executions. A block
+// that writes to memory that was already mapped in the worker (its stack, its
+// globals, or the libraries it uses), e.g. through an address computed from a
+// value read from memory or through a system call, does not fault, and the
+// write remains visible to the following blocks. Such writes can't be detected
+// by the parent. They can change the accessed addresses found for the
+// following blocks, or make the worker fail. `max_blocks_per_worker` bounds
+// the number of blocks affected by such a write by starting a new worker after
+// that many blocks; FindAccessedAddrs() avoids the problem entirely by using a
+// new worker for each block.
+//
+// The worker is traced by the thread that created the finder, so the finder
+// must be used only from this thread.
+class AccessedAddrsFinder {
+ public:
+  // Creates a finder and starts its worker process. When
+  // `max_blocks_per_worker` is positive, the worker is replaced by a new one
+  // after it processed this many blocks; otherwise, it is kept until it stops
+  // in an unexpected way.
+  static absl::StatusOr<std::unique_ptr<AccessedAddrsFinder>> Create(
+      FaultHandling fault_handling = FaultHandling::kRestart,
+      int max_blocks_per_worker = 0);
+
+  AccessedAddrsFinder(const AccessedAddrsFinder&) = delete;
+  AccessedAddrsFinder& operator=(const AccessedAddrsFinder&) = delete;
+
+  // Kills the worker process.
+  ~AccessedAddrsFinder();
+
+  // Same as the free function FindAccessedAddrs(), but all the executions of
+  // the block run in the worker process.
+  absl::StatusOr<AccessedAddrs> FindAccessedAddrs(
+      absl::Span<const uint8_t> basic_block);
+
+  // Returns the number of worker processes started by this finder.
+  int num_workers_started() const { return num_workers_started_; }
+  // Returns the number of executions of blocks by this finder.
+  int64_t num_executions() const { return num_executions_; }
+
+ private:
+  AccessedAddrsFinder(FaultHandling fault_handling, int max_blocks_per_worker)
+      : fault_handling_(fault_handling),
+        max_blocks_per_worker_(max_blocks_per_worker) {}
+
+  // Starts a new worker process and waits until it is ready to read the first
+  // request.
+  absl::Status StartWorker();
+  // Kills the worker process, if there is one.
+  void StopWorker();
+
+  // Executes `basic_block` in the worker with the blocks from
+  // `accessed_addrs` mapped, and adds the addresses of the blocks that caused a
+  // segfault to `accessed_addrs`. With FaultHandling::kRestart, this is at most
+  // one address per execution.
+  absl::Status RunInWorker(absl::Span<const uint8_t> basic_block,
+                           AccessedAddrs& accessed_addrs);
+  absl::Status RunInWorkerInner(absl::Span<const uint8_t> basic_block,
+                                AccessedAddrs& accessed_addrs);
+
+  const FaultHandling fault_handling_;
+  const int max_blocks_per_worker_;
+  // The process ID of the worker, or -1 when there is no worker.
+  pid_t worker_pid_ = -1;
+  // The parent's end of the socket connected to the worker.
+  int socket_fd_ = -1;
+  // The registers of the worker when it is ready to read a request.
+  user_regs_struct worker_regs_;
+  user_fpregs_struct worker_fpregs_;
+  // The number of blocks processed by the current worker.
+  int num_blocks_in_worker_ = 0;
+  int num_workers_started_ = 0;
+  int64_t num_executions_ = 0;
+};
+
 }  // namespace gematria
 
 #endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_FIND_ACCESSED_ADDRS_H_
@@ -12,14 +12,28 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
 #include "gematria/datasets/bhive_importer.h"
 #include "gematria/datasets/find_accessed_addrs.h"
 #include "gematria/llvm/canonicalizer.h"
@@ -29,6 +43,75 @@
 ABSL_FLAG(std::string, bhive_csv, "", "Filename of the input BHive CSV file");
 ABSL_FLAG(bool, failures_only, false,
           "Only produce output for blocks which FindAccessedAddrs fails on");
+ABSL_FLAG(int, num_workers, 1,
+          "The number of blocks processed in parallel. Each worker thread has "
+          "its own worker process. The output is in the order of the input "
+          "regardless of this value. 0 uses one worker per hardware thread.");
+ABSL_FLAG(bool, map_pages_in_place, false,
+          "Map the pages accessed by a block from a signal handler in the "
+          "worker and continue the block, instead of executing the block again "
+          "for each accessed page.");
+ABSL_FLAG(int, max_blocks_per_worker, 1000,
+          "The number of blocks processed by a worker process before it is "
+          "replaced by a new one. This bounds the number of blocks affected by "
+          "a block that writes to the memory of the worker process itself. 0 "
+          "keeps each worker process until it fails.");
+ABSL_FLAG(std::string, checkpoint_file, "",
+          "A file in which the progress is recorded. When the file exists at "
+          "the start, the blocks processed by the previous run are skipped, "
+          "and the output continues after the output of the previous run.");
+ABSL_FLAG(int, checkpoint_interval, 1000,
+          "The number of blocks processed between two updates of "
+          "--checkpoint_file.");
+
+namespace {
+
+// The progress of a run, as stored in the checkpoint file.
+struct Progress {
+  // The number of lines of the input that were processed and whose output was
+  // printed.
+  int64_t num_lines = 0;
+  int successful_calls = 0;
+  int total_calls = 0;
+};
+
+// Reads the progress from `file_name`. Returns an empty progress when the file
+// does not exist, and std::nullopt when it can't be parsed.
+std::optional<Progress> ReadCheckpoint(const std::string& file_name) {
+  std::ifstream file(file_name);
+  if (!file.is_open()) return Progress();
+  Progress progress;
+  if (!(file >> progress.num_lines >> progress.successful_calls >>
+        progress.total_calls)) {
+    return std::nullopt;
+  }
+  return progress;
+}
+
+// Writes `progress` to `file_name`. The file is replaced atomically, so that
+// an interrupted run never leaves a truncated checkpoint. The output is flushed
+// first, so that the checkpoint never covers output that was not written.
+bool WriteCheckpoint(const std::string& file_name, const Progress& progress) {
+  std::cout.flush();
+  const std::string temp_file_name = file_name + ".tmp";
+  {
+    std::ofstream file(temp_file_name, std::ios::trunc);
+    file << progress.num_lines << " " << progress.successful_calls << " "
+         << progress.total_calls << "\n";
+    file.close();
+    if (!file) return false;
+  }
+  return std::rename(temp_file_name.c_str(), file_name.c_str()) == 0;
+}
+
+// A block from the input, and the result of FindAccessedAddrs() for it.
+struct Block {
+  std::string hex;
+  std::vector<uint8_t> bytes;
+  std::optional<absl::StatusOr<gematria::AccessedAddrs>> addrs;
+};
+
+}  // namespace
 
 int main(int argc, char* argv[]) {
   absl::ParseCommandLine(argc, argv);
@@ -38,33 +121,100 @@ int main(int argc, char* argv[]) {
     std::cerr << "Error: --bhive_csv is required\n";
     return 1;
   }
+  const std::string checkpoint_filename = absl::GetFlag(FLAGS_checkpoint_file);
+  const int checkpoint_interval =
+      std::max(1, absl::GetFlag(FLAGS_checkpoint_interval));
+
+  Progress progress;
+  if (!checkpoint_filename.empty()) {
+    std::optional<Progress> checkpoint = ReadCheckpoint(checkpoint_filename);
+    if (!checkpoint.has_value()) {
+      std::cerr << "Invalid checkpoint file: " << checkpoint_filename << "\n";
+      return 5;
+    }
+    progress = *checkpoint;
+  }
 
   const std::unique_ptr<gematria::LlvmArchitectureSupport> llvm_support =
       gematria::LlvmArchitectureSupport::X86_64();
   gematria::X86Canonicalizer canonicalizer(&llvm_support->target_machine());
   gematria::BHiveImporter bhive_importer(&canonicalizer);
 
-  std::ifstream bhive_csv_file(bhive_filename);
-  int successful_calls = 0;
-  int total_calls = 0;
-  for (std::string line; std::getline(bhive_csv_file, line);) {
-    auto comma_index = line.find(',');
-    if (comma_index == std::string::npos) {
-      std::cerr << "Invalid CSV file: no comma in line '" << line << "'\n";
-      return 2;
+  // The blocks are read and parsed up front; only the blocks not covered by
+  // the checkpoint are kept.
+  std::vector<Block> blocks;
+  {
+    std::ifstream bhive_csv_file(bhive_filename);
+    int64_t line_number = 0;
+    for (std::string line; std::getline(bhive_csv_file, line);
+         ++line_number) {
+      if (line_number < progress.num_lines) continue;
+      auto comma_index = line.find(',');
+      if (comma_index == std::string::npos) {
+        std::cerr << "Invalid CSV file: no comma in line '" << line << "'\n";
+        return 2;
+      }
+
+      std::string_view hex = std::string_view(line).substr(0, comma_index);
+      auto bytes_or = gematria::ParseHexString(hex);
+      if (!bytes_or.has_value()) {
+        std::cerr << "could not parse: " << hex << "\n";
+        return 3;
+      }
+      blocks.push_back(
+          {.hex = std::string(hex), .bytes = std::move(bytes_or).value()});
     }
+  }
 
-    std::string_view hex = std::string_view(line).substr(0, comma_index);
-    auto bytes_or = gematria::ParseHexString(hex);
-    if (!bytes_or.has_value()) {
-      std::cerr << "could not parse: " << hex << "\n";
-      return 3;
+  // Each worker thread has its own finder, and it takes the blocks one by one
+  // from a shared counter. A block that crashes the worker process affects
+  // only the finder of its thread, which starts a new worker process for the
+  // next block. The main thread prints the results in the order of
+  // the input as soon as they are complete.
+  int num_workers = absl::GetFlag(FLAGS_num_workers);
+  if (num_workers <= 0) {
+    num_workers = std::max(1u, std::thread::hardware_concurrency());
+  }
+  num_workers =
+      std::min<size_t>(num_workers, std::max<size_t>(blocks.size(), 1));
+
+  std::mutex mutex;
+  std::condition_variable block_done;
+  std::atomic<size_t> next_block = 0;
+  const gematria::FaultHandling fault_handling =
+      absl::GetFlag(FLAGS_map_pages_in_place)
+          ? gematria::FaultHandling::kMapInPlace
+          : gematria::FaultHandling::kRestart;
+  auto run_worker = [&]() {
+    // The finder must be created by the thread that uses it, as its worker
+    // process is traced by this thread.
+    absl::StatusOr<std::unique_ptr<gematria::AccessedAddrsFinder>> finder =
+        gematria::AccessedAddrsFinder::Create(
+            fault_handling, absl::GetFlag(FLAGS_max_blocks_per_worker));
+    for (size_t i = next_block++; i < blocks.size(); i = next_block++) {
+      absl::StatusOr<gematria::AccessedAddrs> addrs = finder.status();
+      if (finder.ok()) addrs = (*finder)->FindAccessedAddrs(blocks[i].bytes);
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        blocks[i].addrs = std::move(addrs);
+      }
+      block_done.notify_all();
     }
+  };
+  std::vector<std::thread> workers;
+  workers.reserve(num_workers);
+  for (int i = 0; i < num_workers; ++i) workers.emplace_back(run_worker);
 
-    const auto& bytes = bytes_or.value();
-    auto addrs_or = gematria::FindAccessedAddrs(bytes);
+  for (Block& block : blocks) {
+    absl::StatusOr<gematria::AccessedAddrs> addrs_or;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      block_done.wait(lock, [&]() { return block.addrs.has_value(); });
+      addrs_or = std::move(*block.addrs);
+    }
+    const std::string_view hex = block.hex;
     if (addrs_or.ok()) {
-      successful_calls++;
+      progress.successful_calls++;
 
       if (!absl::GetFlag(FLAGS_failures_only)) {
         auto addrs = addrs_or.value();
@@ -84,7 +234,7 @@ int main(int argc, char* argv[]) {
     } else {
       std::cerr << "Failed to find addresses for block '" << hex
                 << "': " << addrs_or.status() << "\n";
-      auto proto = bhive_importer.BasicBlockProtoFromMachineCode(bytes);
+      auto proto = bhive_importer.BasicBlockProtoFromMachineCode(block.bytes);
       if (proto.ok()) {
         std::cerr << "Block disassembly:\n";
         for (const auto& instr : proto->machine_instructions()) {
@@ -92,10 +242,29 @@ int main(int argc, char* argv[]) {
         }
       }
     }
-    total_calls++;
+    progress.total_calls++;
+    progress.num_lines++;
+    // The bytes are no longer needed.
+    block = Block();
+
+    if (!checkpoint_filename.empty() &&
+        progress.total_calls % checkpoint_interval == 0 &&
+        !WriteCheckpoint(checkpoint_filename, progress)) {
+      std::cerr << "Failed to write the checkpoint file "
+                << checkpoint_filename << "\n";
+    }
+  }
+  for (std::thread& worker : workers) worker.join();
+
+  if (!checkpoint_filename.empty() &&
+      !WriteCheckpoint(checkpoint_filename, progress)) {
+    std::cerr << "Failed to write the checkpoint file " << checkpoint_filename
+              << "\n";
+    return 6;
   }
 
   std::cout << "Called FindAccessedAddrs successfully on " << std::dec
-            << successful_calls << " / " << total_calls << " blocks\n";
+            << progress.successful_calls << " / " << progress.total_calls
+            << " blocks\n";
   return 0;
 }
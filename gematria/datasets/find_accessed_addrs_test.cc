@@ -25,6 +25,8 @@
 #include "absl/random/distributions.h"
 #include "absl/random/random.h"
 #include "absl/random/seed_sequences.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
 #include "absl/strings/str_format.h"
 #include "absl/types/span.h"
 #include "gematria/llvm/asm_parser.h"
@@ -93,6 +95,14 @@ class FindAccessedAddrsTest : public testing::Test {
         reinterpret_cast<const uint8_t*>(code.data()), code.size());
     return FindAccessedAddrs(span);
   }
+
+  absl::StatusOr<AccessedAddrs> FindAccessedAddrsAsm(
+      AccessedAddrsFinder& finder, std::string_view textual_assembly) {
+    auto code = Assemble(textual_assembly);
+    auto span = absl::MakeConstSpan(
+        reinterpret_cast<const uint8_t*>(code.data()), code.size());
+    return finder.FindAccessedAddrs(span);
+  }
 };
 
 TEST_F(FindAccessedAddrsTest, BasicMov) {
@@ -161,5 +171,127 @@ TEST_F(FindAccessedAddrsTest, AccessFromRegister) {
                                  ElementsAre(0x10000, 0x20000))));
 }
 
+TEST_F(FindAccessedAddrsTest, FinderReusesWorker) {
+  absl::StatusOr<std::unique_ptr<AccessedAddrsFinder>> finder =
+      AccessedAddrsFinder::Create();
+  ASSERT_OK(finder.status());
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_THAT(FindAccessedAddrsAsm(**finder, R"asm(
+      mov [0x10000], eax
+      mov [0x20000], eax
+    )asm"),
+                IsOkAndHolds(Field(&AccessedAddrs::accessed_blocks,
+                                   ElementsAre(0x10000, 0x20000))));
+    EXPECT_THAT(
+        FindAccessedAddrsAsm(**finder, "mov eax, ebx"),
+        IsOkAndHolds(Field(&AccessedAddrs::accessed_blocks, IsEmpty())));
+  }
+  EXPECT_EQ((*finder)->num_workers_started(), 1);
+}
+
+TEST_F(FindAccessedAddrsTest, FinderRestartsWorkerAfterError) {
+  absl::StatusOr<std::unique_ptr<AccessedAddrsFinder>> finder =
+      AccessedAddrsFinder::Create();
+  ASSERT_OK(finder.status());
+  EXPECT_THAT(FindAccessedAddrsAsm(**finder, "ud2"),
+              StatusIs(absl::StatusCode::kInternal));
+  EXPECT_THAT(FindAccessedAddrsAsm(**finder, "mov [0x10000], eax"),
+              IsOkAndHolds(Field(&AccessedAddrs::accessed_blocks,
+                                 ElementsAre(0x10000))));
+  EXPECT_EQ((*finder)->num_workers_started(), 2);
+}
+
+// The first block stores a pointer to memory that the second block reads and
+// uses as an address. The memory mapped for the first block is not mapped any
+// more for the second one, so the second block reads zero, as in a new worker.
+constexpr std::string_view kStorePointerBlock = R"asm(
+  mov rax, 0x20000
+  mov [0x10000], rax
+)asm";
+constexpr std::string_view kLoadPointerBlock = R"asm(
+  mov rax, [0x10000]
+  mov [rax + 0x30000], ebx
+)asm";
+
+TEST_F(FindAccessedAddrsTest, FinderDoesNotKeepMemoryOfPreviousBlock) {
+  EXPECT_THAT(FindAccessedAddrsAsm(kLoadPointerBlock),
+              IsOkAndHolds(Field(&AccessedAddrs::accessed_blocks,
+                                 ElementsAre(0x10000, 0x30000))));
+
+  for (const FaultHandling fault_handling :
+       {FaultHandling::kRestart, FaultHandling::kMapInPlace}) {
+    absl::StatusOr<std::unique_ptr<AccessedAddrsFinder>> finder =
+        AccessedAddrsFinder::Create(fault_handling);
+    ASSERT_OK(finder.status());
+    EXPECT_THAT(FindAccessedAddrsAsm(**finder, kStorePointerBlock),
+                IsOkAndHolds(Field(&AccessedAddrs::accessed_blocks,
+                                   ElementsAre(0x10000))));
+    EXPECT_THAT(FindAccessedAddrsAsm(**finder, kLoadPointerBlock),
+                IsOkAndHolds(Field(&AccessedAddrs::accessed_blocks,
+                                   ElementsAre(0x10000, 0x30000))));
+    EXPECT_EQ((*finder)->num_workers_started(), 1);
+  }
+}
+
+TEST_F(FindAccessedAddrsTest, FinderReplacesWorkerAfterMaxBlocks) {
+  absl::StatusOr<std::unique_ptr<AccessedAddrsFinder>> finder =
+      AccessedAddrsFinder::Create(FaultHandling::kRestart,
+                                  /*max_blocks_per_worker=*/2);
+  ASSERT_OK(finder.status());
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_THAT(FindAccessedAddrsAsm(**finder, "mov [0x10000], eax"),
+                IsOkAndHolds(Field(&AccessedAddrs::accessed_blocks,
+                                   ElementsAre(0x10000))));
+  }
+  // The blocks are processed by three workers, with 2, 2 and 1 blocks.
+  EXPECT_EQ((*finder)->num_workers_started(), 3);
+  EXPECT_EQ((*finder)->num_executions(), 10);
+}
+
+TEST_F(FindAccessedAddrsTest, MapInPlaceFindsAllAddressesInOneExecution) {
+  absl::StatusOr<std::unique_ptr<AccessedAddrsFinder>> finder =
+      AccessedAddrsFinder::Create(FaultHandling::kMapInPlace);
+  ASSERT_OK(finder.status());
+  EXPECT_THAT(FindAccessedAddrsAsm(**finder, R"asm(
+    mov [0x10000], eax
+    mov [0x20000], eax
+    mov [0x10008], eax
+  )asm"),
+              IsOkAndHolds(Field(&AccessedAddrs::accessed_blocks,
+                                 ElementsAre(0x10000, 0x20000))));
+  EXPECT_EQ((*finder)->num_executions(), 1);
+  EXPECT_THAT(FindAccessedAddrsAsm(**finder, R"asm(
+    mov [eax], eax
+    mov [r11+r12], eax
+  )asm"),
+              IsOkAndHolds(Field(&AccessedAddrs::accessed_blocks,
+                                 ElementsAre(0x10000, 0x20000))));
+  EXPECT_THAT(
+      FindAccessedAddrsAsm(**finder, "mov eax, ebx"),
+      IsOkAndHolds(Field(&AccessedAddrs::accessed_blocks, IsEmpty())));
+  EXPECT_EQ((*finder)->num_executions(), 3);
+  EXPECT_EQ((*finder)->num_workers_started(), 1);
+}
+
+TEST_F(FindAccessedAddrsTest, MapInPlaceStopsAtUnmappableAddress) {
+  absl::StatusOr<std::unique_ptr<AccessedAddrsFinder>> finder =
+      AccessedAddrsFinder::Create(FaultHandling::kMapInPlace);
+  ASSERT_OK(finder.status());
+  // Addresses in the kernel half of the address space can't be mapped, so the
+  // block stops at the first access.
+  EXPECT_THAT(FindAccessedAddrsAsm(**finder, R"asm(
+    movabs rax, 0xffff900000000000
+    mov [rax], eax
+    mov [0x10000], eax
+  )asm"),
+              IsOkAndHolds(Field(&AccessedAddrs::accessed_blocks,
+                                 ElementsAre(0xffff900000000000))));
+  // The worker is still usable.
+  EXPECT_THAT(FindAccessedAddrsAsm(**finder, "mov [0x10000], eax"),
+              IsOkAndHolds(Field(&AccessedAddrs::accessed_blocks,
+                                 ElementsAre(0x10000))));
+  EXPECT_EQ((*finder)->num_workers_started(), 1);
+}
+
 }  // namespace
 }  // namespace gematria
@@ -0,0 +1,70 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/datasets/live_range_index.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace gematria {
+namespace {
+
+// Fills `subtree_max_end` for the subtree of `entries` in [begin, end), and
+// returns the maximal end of a range in the subtree.
+unsigned int BuildSubtree(const std::vector<LiveRangeIndex::Entry>& entries,
+                          size_t begin, size_t end,
+                          std::vector<unsigned int>& subtree_max_end) {
+  if (begin >= end) return 0;
+  const size_t root = begin + (end - begin) / 2;
+  const unsigned int max_end =
+      std::max({entries[root].range.second,
+                BuildSubtree(entries, begin, root, subtree_max_end),
+                BuildSubtree(entries, root + 1, end, subtree_max_end)});
+  subtree_max_end[root] = max_end;
+  return max_end;
+}
+
+}  // namespace
+
+LiveRangeIndex::LiveRangeIndex(std::vector<Entry> entries)
+    : entries_(std::move(entries)) {
+  std::stable_sort(entries_.begin(), entries_.end(),
+                   [](const Entry& left, const Entry& right) {
+                     return left.range.first < right.range.first;
+                   });
+  subtree_max_end_.resize(entries_.size());
+  BuildSubtree(entries_, 0, entries_.size(), subtree_max_end_);
+}
+
+std::vector<int> LiveRangeIndex::FindIntersecting(const Range& query) const {
+  std::vector<int> ids;
+  ForEachIntersecting(query,
+                      [&ids](const Entry& entry) { ids.push_back(entry.id); });
+  std::sort(ids.begin(), ids.end());
+  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+  return ids;
+}
+
+size_t LiveRangeIndex::NumEntriesStartingBefore(unsigned int query_end) const {
+  const auto it = std::lower_bound(
+      entries_.begin(), entries_.end(), query_end,
+      [](const Entry& entry, unsigned int value) {
+        return entry.range.first < value;
+      });
+  return it - entries_.begin();
+}
+
+}  // namespace gematria
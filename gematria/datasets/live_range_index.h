@@ -0,0 +1,104 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains an index of live ranges that finds the ranges intersecting a given
+// range without scanning all of them.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_LIVE_RANGE_INDEX_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_LIVE_RANGE_INDEX_H_
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace gematria {
+
+// A static index of half-open ranges [first, second), each tagged with an
+// integer ID supplied by the user. Two ranges intersect when neither of them
+// ends before the other one starts.
+//
+// The ranges are sorted by their start, and the sorted array is used as an
+// implicit balanced binary tree where each subtree stores the maximal end of
+// its ranges. A query visits only the subtrees that contain an intersecting
+// range, i.e. it takes O((k + 1) * log(n)) time, where n is the number of
+// ranges in the index and k is the number of reported ranges.
+class LiveRangeIndex {
+ public:
+  using Range = std::pair<unsigned int, unsigned int>;
+
+  struct Entry {
+    Range range;
+    int id;
+  };
+
+  LiveRangeIndex() = default;
+  explicit LiveRangeIndex(std::vector<Entry> entries);
+
+  // Calls `callback(entry)` for each entry whose range intersects `query`. The
+  // entries are visited in the order of the starts of their ranges; an ID is
+  // visited multiple times if more than one of its ranges intersects `query`.
+  template <typename Callback>
+  void ForEachIntersecting(const Range& query, Callback&& callback) const;
+
+  // Returns the IDs of the ranges that intersect `query`, sorted and without
+  // duplicates.
+  std::vector<int> FindIntersecting(const Range& query) const;
+
+  size_t size() const { return entries_.size(); }
+  bool empty() const { return entries_.empty(); }
+
+ private:
+  template <typename Callback>
+  void ForEachIntersectingInSubtree(size_t begin, size_t end,
+                                    size_t prefix_end, const Range& query,
+                                    Callback& callback) const;
+
+  // Returns the number of entries whose range starts before `query_end`.
+  size_t NumEntriesStartingBefore(unsigned int query_end) const;
+
+  // The entries sorted by the start of their ranges.
+  std::vector<Entry> entries_;
+  // subtree_max_end_[i] is the maximal end of a range in the subtree rooted at
+  // entries_[i]. The subtree of [begin, end) is rooted at (begin + end) / 2.
+  std::vector<unsigned int> subtree_max_end_;
+};
+
+template <typename Callback>
+void LiveRangeIndex::ForEachIntersecting(const Range& query,
+                                         Callback&& callback) const {
+  const size_t prefix_end = NumEntriesStartingBefore(query.second);
+  ForEachIntersectingInSubtree(0, entries_.size(), prefix_end, query,
+                               callback);
+}
+
+template <typename Callback>
+void LiveRangeIndex::ForEachIntersectingInSubtree(size_t begin, size_t end,
+                                                  size_t prefix_end,
+                                                  const Range& query,
+                                                  Callback& callback) const {
+  // Only the entries in [0, prefix_end) start before the end of the query; all
+  // other entries can be ignored.
+  if (begin >= end || begin >= prefix_end) return;
+  const size_t root = begin + (end - begin) / 2;
+  if (subtree_max_end_[root] <= query.first) return;
+  ForEachIntersectingInSubtree(begin, root, prefix_end, query, callback);
+  if (root >= prefix_end) return;
+  const Entry& entry = entries_[root];
+  if (entry.range.second > query.first) callback(entry);
+  ForEachIntersectingInSubtree(root + 1, end, prefix_end, query, callback);
+}
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_LIVE_RANGE_INDEX_H_
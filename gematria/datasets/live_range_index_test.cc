@@ -0,0 +1,90 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/datasets/live_range_index.h"
+
+#include <random>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+
+using Range = LiveRangeIndex::Range;
+
+TEST(LiveRangeIndexTest, Empty) {
+  const LiveRangeIndex index;
+  EXPECT_TRUE(index.empty());
+  EXPECT_THAT(index.FindIntersecting({0, 100}), IsEmpty());
+}
+
+TEST(LiveRangeIndexTest, FindIntersecting) {
+  const LiveRangeIndex index({{{16, 32}, 0},
+                              {{0, 8}, 1},
+                              {{48, 64}, 2},
+                              {{24, 80}, 3},
+                              {{100, 120}, 1}});
+  EXPECT_EQ(index.size(), 5);
+  EXPECT_THAT(index.FindIntersecting({0, 16}), ElementsAre(1));
+  EXPECT_THAT(index.FindIntersecting({8, 16}), IsEmpty());
+  EXPECT_THAT(index.FindIntersecting({30, 50}), ElementsAre(0, 2, 3));
+  EXPECT_THAT(index.FindIntersecting({64, 110}), ElementsAre(1, 3));
+  EXPECT_THAT(index.FindIntersecting({120, 200}), IsEmpty());
+}
+
+TEST(LiveRangeIndexTest, ForEachIntersectingVisitsRangesByStart) {
+  const LiveRangeIndex index({{{40, 50}, 0}, {{10, 45}, 1}, {{20, 42}, 2}});
+  std::vector<int> ids;
+  index.ForEachIntersecting({41, 42}, [&ids](const LiveRangeIndex::Entry& e) {
+    ids.push_back(e.id);
+  });
+  EXPECT_THAT(ids, ElementsAre(1, 2, 0));
+}
+
+// Checks the index against a linear scan over the ranges.
+TEST(LiveRangeIndexTest, MatchesLinearScan) {
+  std::mt19937 engine(12345);
+  std::uniform_int_distribution<unsigned int> point(0, 1000);
+  std::uniform_int_distribution<unsigned int> length(0, 50);
+  for (int num_ranges : {1, 2, 7, 100, 1000}) {
+    std::vector<LiveRangeIndex::Entry> entries;
+    for (int i = 0; i < num_ranges; ++i) {
+      const unsigned int start = point(engine);
+      entries.push_back({{start, start + length(engine)}, i});
+    }
+    const LiveRangeIndex index(entries);
+    for (int i = 0; i < 100; ++i) {
+      const unsigned int start = point(engine);
+      const Range query = {start, start + length(engine)};
+      std::vector<int> expected_ids;
+      for (const LiveRangeIndex::Entry& entry : entries) {
+        if (!(entry.range.second <= query.first ||
+              query.second <= entry.range.first)) {
+          expected_ids.push_back(entry.id);
+        }
+      }
+      EXPECT_EQ(index.FindIntersecting(query), expected_ids)
+          << "num_ranges = " << num_ranges << ", query = [" << query.first
+          << ", " << query.second << ")";
+    }
+  }
+}
+
+}  // namespace
+}  // namespace gematria
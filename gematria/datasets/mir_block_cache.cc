@@ -0,0 +1,244 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/datasets/mir_block_cache.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "gematria/proto/basic_block.pb.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/ErrorOr.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+
+namespace gematria {
+namespace {
+
+constexpr std::string_view kMagic = "GMBCACHE";
+// Increment when the format of the file or the contents of the basic block
+// protos change.
+constexpr uint32_t kVersion = 1;
+
+constexpr size_t kHeaderSize = kMagic.size() + 4 + 4 + 8;
+constexpr size_t kEntrySize = 8 + 4 + 4 + 8 + 8;
+
+void AppendUInt32(uint32_t value, std::string& out) {
+  char bytes[4];
+  llvm::support::endian::write32le(bytes, value);
+  out.append(bytes, sizeof(bytes));
+}
+
+void AppendUInt64(uint64_t value, std::string& out) {
+  char bytes[8];
+  llvm::support::endian::write64le(bytes, value);
+  out.append(bytes, sizeof(bytes));
+}
+
+// Returns true when [offset, offset + size) is a valid range in a buffer of
+// size `buffer_size`.
+bool IsInBounds(uint64_t offset, uint64_t size, size_t buffer_size) {
+  return offset <= buffer_size && size <= buffer_size - offset;
+}
+
+}  // namespace
+
+absl::StatusOr<uint64_t> ComputeMirBlockCacheKey(
+    const std::vector<std::string_view>& file_names, std::string_view options) {
+  std::string hashes;
+  AppendUInt32(kVersion, hashes);
+  AppendUInt64(llvm::xxHash64(llvm::StringRef(options)), hashes);
+  for (const std::string_view file_name : file_names) {
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer =
+        llvm::MemoryBuffer::getFile(file_name, /*IsText=*/false,
+                                    /*RequiresNullTerminator=*/false);
+    if (!buffer) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Could not open file ", file_name));
+    }
+    AppendUInt64(llvm::xxHash64((*buffer)->getBuffer()), hashes);
+  }
+  return llvm::xxHash64(hashes);
+}
+
+void MirBlockCacheWriter::Add(std::string_view name,
+                              const BasicBlockProto& block) {
+  entries_.push_back({std::string(name), 0, block.SerializeAsString()});
+}
+
+void MirBlockCacheWriter::AddError(std::string_view name,
+                                   const absl::Status& status) {
+  entries_.push_back({std::string(name), kMirBlockCacheErrorFlag,
+                      std::string(status.message())});
+}
+
+absl::Status MirBlockCacheWriter::Write(std::string_view file_name,
+                                        uint64_t key) const {
+  std::vector<const Entry*> sorted_entries;
+  sorted_entries.reserve(entries_.size());
+  for (const Entry& entry : entries_) sorted_entries.push_back(&entry);
+  std::stable_sort(sorted_entries.begin(), sorted_entries.end(),
+                   [](const Entry* left, const Entry* right) {
+                     return left->name < right->name;
+                   });
+
+  std::string contents;
+  contents.append(kMagic);
+  AppendUInt32(kVersion, contents);
+  AppendUInt32(sorted_entries.size(), contents);
+  AppendUInt64(key, contents);
+  uint64_t data_offset = kHeaderSize + kEntrySize * sorted_entries.size();
+  for (const Entry* entry : sorted_entries) {
+    AppendUInt64(data_offset, contents);
+    AppendUInt32(entry->name.size(), contents);
+    AppendUInt32(entry->flags, contents);
+    data_offset += entry->name.size();
+    AppendUInt64(data_offset, contents);
+    AppendUInt64(entry->payload.size(), contents);
+    data_offset += entry->payload.size();
+  }
+  for (const Entry* entry : sorted_entries) {
+    contents.append(entry->name);
+    contents.append(entry->payload);
+  }
+
+  int fd = -1;
+  llvm::SmallString<128> temp_file_name;
+  if (std::error_code error = llvm::sys::fs::createUniqueFile(
+          llvm::StringRef(file_name) + ".tmp%%%%%%", fd, temp_file_name)) {
+    return absl::InternalError(
+        absl::StrCat("Could not create a temporary file for ", file_name, ": ",
+                     error.message()));
+  }
+  {
+    llvm::raw_fd_ostream out(fd, /*shouldClose=*/true);
+    out << contents;
+    out.close();
+    if (out.has_error()) {
+      const std::error_code error = out.error();
+      out.clear_error();
+      llvm::sys::fs::remove(temp_file_name);
+      return absl::InternalError(absl::StrCat(
+          "Could not write ", temp_file_name.str().str(), ": ",
+          error.message()));
+    }
+  }
+  if (std::error_code error =
+          llvm::sys::fs::rename(temp_file_name, llvm::StringRef(file_name))) {
+    llvm::sys::fs::remove(temp_file_name);
+    return absl::InternalError(absl::StrCat("Could not rename ",
+                                            temp_file_name.str().str(), " to ",
+                                            file_name, ": ", error.message()));
+  }
+  return absl::OkStatus();
+}
+
+absl::StatusOr<std::unique_ptr<MirBlockCache>> MirBlockCache::Open(
+    std::string_view file_name, uint64_t key) {
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer =
+      llvm::MemoryBuffer::getFile(file_name, /*IsText=*/false,
+                                  /*RequiresNullTerminator=*/false);
+  if (!buffer) {
+    return absl::NotFoundError(absl::StrCat("Could not open file ", file_name));
+  }
+  const llvm::StringRef contents = (*buffer)->getBuffer();
+  const char* const data = contents.data();
+  if (contents.size() < kHeaderSize || !contents.startswith(kMagic)) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Not a MIR block cache file: ", file_name));
+  }
+  const uint32_t version =
+      llvm::support::endian::read32le(data + kMagic.size());
+  const uint32_t num_entries =
+      llvm::support::endian::read32le(data + kMagic.size() + 4);
+  const uint64_t file_key =
+      llvm::support::endian::read64le(data + kMagic.size() + 8);
+  if (version != kVersion || file_key != key) {
+    return absl::FailedPreconditionError(
+        absl::StrCat("The MIR block cache file ", file_name,
+                     " was created for different inputs"));
+  }
+  if (!IsInBounds(kHeaderSize, uint64_t{kEntrySize} * num_entries,
+                  contents.size())) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Truncated MIR block cache file: ", file_name));
+  }
+
+  std::vector<Entry> entries;
+  entries.reserve(num_entries);
+  for (uint32_t i = 0; i < num_entries; ++i) {
+    const char* const entry_data = data + kHeaderSize + kEntrySize * i;
+    const uint64_t name_offset = llvm::support::endian::read64le(entry_data);
+    const uint32_t name_size = llvm::support::endian::read32le(entry_data + 8);
+    const uint32_t flags = llvm::support::endian::read32le(entry_data + 12);
+    const uint64_t payload_offset =
+        llvm::support::endian::read64le(entry_data + 16);
+    const uint64_t payload_size =
+        llvm::support::endian::read64le(entry_data + 24);
+    if (!IsInBounds(name_offset, name_size, contents.size()) ||
+        !IsInBounds(payload_offset, payload_size, contents.size())) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Truncated MIR block cache file: ", file_name));
+    }
+    entries.push_back({std::string_view(data + name_offset, name_size), flags,
+                       std::string_view(data + payload_offset, payload_size)});
+  }
+  if (!std::is_sorted(entries.begin(), entries.end(),
+                      [](const Entry& left, const Entry& right) {
+                        return left.name < right.name;
+                      })) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Corrupted MIR block cache file: ", file_name));
+  }
+  return std::unique_ptr<MirBlockCache>(
+      new MirBlockCache(std::move(*buffer), std::move(entries)));
+}
+
+absl::StatusOr<BasicBlockProto> MirBlockCache::Find(
+    std::string_view name) const {
+  const auto it = std::lower_bound(
+      entries_.begin(), entries_.end(), name,
+      [](const Entry& entry, std::string_view name) {
+        return entry.name < name;
+      });
+  if (it == entries_.end() || it->name != name) {
+    return absl::NotFoundError(
+        absl::StrCat("Could not find MBB with name ", name));
+  }
+  if (it->flags & kMirBlockCacheErrorFlag) {
+    return absl::InvalidArgumentError(it->payload);
+  }
+  BasicBlockProto block;
+  if (!block.ParseFromArray(it->payload.data(), it->payload.size())) {
+    return absl::InternalError(
+        absl::StrCat("Could not parse the cached basic block ", name));
+  }
+  return block;
+}
+
+}  // namespace gematria
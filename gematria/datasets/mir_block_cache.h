@@ -0,0 +1,118 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains an on-disk cache of the basic blocks extracted from a MIR file. The
+// cache lets repeated imports of the same MIR file (e.g. with different CSV
+// files or throughput columns) skip parsing the MIR and the live info files.
+//
+// The cache file is read through a memory map, and the basic blocks are
+// deserialized only when they are looked up. All integers are little endian.
+// The file has the following layout:
+//   header:  char[8] magic, uint32 version, uint32 num_entries, uint64 key;
+//   entries: num_entries times {uint64 name_offset, uint32 name_size,
+//            uint32 flags, uint64 payload_offset, uint64 payload_size},
+//            sorted by name;
+//   data:    the names and the payloads, referenced by the offsets from the
+//            start of the file.
+// The payload of an entry is a serialized BasicBlockProto, or an error message
+// when the flags contain kMirBlockCacheErrorFlag.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_MIR_BLOCK_CACHE_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_MIR_BLOCK_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "gematria/proto/basic_block.pb.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+namespace gematria {
+
+// Set in the flags of an entry whose basic block could not be extracted.
+inline constexpr uint32_t kMirBlockCacheErrorFlag = 1;
+
+// Computes the key of a cache from the contents of the input files and from
+// `options`, a string that encodes all other parameters that affect the
+// extracted basic blocks. Returns an error when one of the files can't be read.
+absl::StatusOr<uint64_t> ComputeMirBlockCacheKey(
+    const std::vector<std::string_view>& file_names, std::string_view options);
+
+// Collects basic blocks and writes them to a cache file.
+class MirBlockCacheWriter {
+ public:
+  // Adds the basic block with the given name.
+  void Add(std::string_view name, const BasicBlockProto& block);
+  // Records that the basic block with the given name could not be extracted;
+  // MirBlockCache::Find() returns `status` for this block.
+  void AddError(std::string_view name, const absl::Status& status);
+
+  // Writes the cache to `file_name`. The file is written to a temporary file
+  // first and then renamed, so that concurrent readers never see a partially
+  // written cache.
+  absl::Status Write(std::string_view file_name, uint64_t key) const;
+
+ private:
+  struct Entry {
+    std::string name;
+    uint32_t flags;
+    std::string payload;
+  };
+
+  std::vector<Entry> entries_;
+};
+
+// Provides read-only access to the basic blocks in a cache file.
+class MirBlockCache {
+ public:
+  // Opens the cache file `file_name`. Returns an error when the file does not
+  // exist, when it is not a valid cache file, or when it was created with a key
+  // different from `key`.
+  static absl::StatusOr<std::unique_ptr<MirBlockCache>> Open(
+      std::string_view file_name, uint64_t key);
+
+  // Returns the basic block with the given name. Returns a NotFound error when
+  // the cache does not contain the block, and the recorded error when the
+  // block could not be extracted.
+  absl::StatusOr<BasicBlockProto> Find(std::string_view name) const;
+
+  // Returns the number of basic blocks in the cache.
+  size_t size() const { return entries_.size(); }
+
+ private:
+  // The name and the payload of one entry, pointing into `buffer_`.
+  struct Entry {
+    std::string_view name;
+    uint32_t flags;
+    std::string_view payload;
+  };
+
+  MirBlockCache(std::unique_ptr<llvm::MemoryBuffer> buffer,
+                std::vector<Entry> entries)
+      : buffer_(std::move(buffer)), entries_(std::move(entries)) {}
+
+  std::unique_ptr<llvm::MemoryBuffer> buffer_;
+  // The entries of the cache, sorted by name.
+  std::vector<Entry> entries_;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_MIR_BLOCK_CACHE_H_
@@ -0,0 +1,105 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/datasets/mir_block_cache.h"
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "gematria/proto/basic_block.pb.h"
+#include "gematria/testing/matchers.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+constexpr uint64_t kKey = 0x1234567890abcdef;
+
+class MirBlockCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    const ::testing::TestInfo* const test_info =
+        ::testing::UnitTest::GetInstance()->current_test_info();
+    file_name_ =
+        ::testing::TempDir() + "/" + test_info->name() + ".mbbcache";
+  }
+
+  std::string file_name_;
+};
+
+TEST_F(MirBlockCacheTest, WriteAndRead) {
+  BasicBlockProto block;
+  block.add_canonicalized_instructions()->set_mnemonic("MOV");
+  MirBlockCacheWriter writer;
+  writer.Add("BB_2", block);
+  writer.AddError("BB_1", absl::InvalidArgumentError("Cannot handle CALL"));
+  writer.Add("BB_3", BasicBlockProto());
+  ASSERT_OK(writer.Write(file_name_, kKey));
+
+  const absl::StatusOr<std::unique_ptr<MirBlockCache>> cache =
+      MirBlockCache::Open(file_name_, kKey);
+  ASSERT_OK(cache);
+  EXPECT_EQ((*cache)->size(), 3);
+  EXPECT_THAT((*cache)->Find("BB_2"),
+              IsOkAndHolds(EqualsProto(
+                  R"pb(canonicalized_instructions { mnemonic: "MOV" })pb")));
+  EXPECT_THAT((*cache)->Find("BB_3"), IsOkAndHolds(EqualsProto("")));
+  EXPECT_THAT((*cache)->Find("BB_1"),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT((*cache)->Find("BB_4"), StatusIs(absl::StatusCode::kNotFound));
+}
+
+TEST_F(MirBlockCacheTest, DifferentKey) {
+  ASSERT_OK(MirBlockCacheWriter().Write(file_name_, kKey));
+  EXPECT_THAT(MirBlockCache::Open(file_name_, kKey + 1),
+              StatusIs(absl::StatusCode::kFailedPrecondition));
+}
+
+TEST_F(MirBlockCacheTest, MissingFile) {
+  EXPECT_THAT(MirBlockCache::Open(file_name_, kKey),
+              StatusIs(absl::StatusCode::kNotFound));
+}
+
+TEST_F(MirBlockCacheTest, InvalidFile) {
+  std::ofstream(file_name_) << "not a cache file";
+  EXPECT_THAT(MirBlockCache::Open(file_name_, kKey),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+TEST_F(MirBlockCacheTest, ComputeKey) {
+  const std::string input_file_name = file_name_ + ".input";
+  std::ofstream(input_file_name) << "foo";
+  const absl::StatusOr<uint64_t> key =
+      ComputeMirBlockCacheKey({input_file_name}, "options");
+  ASSERT_OK(key);
+  EXPECT_THAT(ComputeMirBlockCacheKey({input_file_name}, "options"),
+              IsOkAndHolds(*key));
+  EXPECT_THAT(ComputeMirBlockCacheKey({input_file_name}, "other options"),
+              IsOkAndHolds(::testing::Ne(*key)));
+
+  std::ofstream(input_file_name) << "bar";
+  EXPECT_THAT(ComputeMirBlockCacheKey({input_file_name}, "options"),
+              IsOkAndHolds(::testing::Ne(*key)));
+
+  EXPECT_THAT(ComputeMirBlockCacheKey({file_name_ + ".missing"}, "options"),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+}  // namespace
+}  // namespace gematria
@@ -0,0 +1,258 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/datasets/parallel_bhive_importer.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "gematria/datasets/bhive_importer.h"
+#include "gematria/datasets/block_deduplicator.h"
+#include "gematria/llvm/canonicalizer.h"
+#include "gematria/proto/throughput.pb.h"
+
+namespace gematria {
+namespace {
+
+// A contiguous range of lines from the input, and the results of parsing them.
+struct Shard {
+  // The index of the first line of the shard in the input.
+  int64_t first_line_number = 0;
+  std::vector<std::string> lines;
+  // The results of parsing `lines`; results[i] corresponds to lines[i]. Written
+  // only by the worker thread that processes the shard, before it sets `done`.
+  std::vector<absl::StatusOr<BasicBlockWithThroughputProto>> results;
+  // Set to true when the shard was processed. Guarded by
+  // ShardProcessor::mutex_.
+  bool done = false;
+};
+
+// A pool of worker threads that parse shards. Each worker thread creates its
+// own canonicalizer and BHive importer when it starts.
+class ShardProcessor {
+ public:
+  ShardProcessor(const BHiveCsvImportOptions& options,
+                 const CanonicalizerFactory& canonicalizer_factory,
+                 int num_threads)
+      : options_(options), canonicalizer_factory_(canonicalizer_factory) {
+    threads_.reserve(num_threads);
+    for (int i = 0; i < num_threads; ++i) {
+      threads_.emplace_back([this]() { ProcessShards(); });
+    }
+  }
+
+  // Stops the worker threads. Shards that were submitted but not picked up by
+  // a worker thread are not processed.
+  ~ShardProcessor() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      shutting_down_ = true;
+    }
+    shard_submitted_.notify_all();
+    for (std::thread& thread : threads_) thread.join();
+  }
+
+  // Adds `shard` to the queue of shards to be processed. The shard must remain
+  // valid until it is done or until the processor is destroyed.
+  void Submit(Shard* shard) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push_back(shard);
+    }
+    shard_submitted_.notify_one();
+  }
+
+  // Blocks until one of the shards in `shards` is done, and returns its index.
+  // When `in_order` is true, waits only for the first shard in `shards`.
+  size_t WaitForDoneShard(const std::deque<std::unique_ptr<Shard>>& shards,
+                          bool in_order) {
+    const size_t num_candidates = in_order ? 1 : shards.size();
+    size_t index = 0;
+    std::unique_lock<std::mutex> lock(mutex_);
+    shard_done_.wait(lock, [&]() {
+      for (index = 0; index < num_candidates; ++index) {
+        if (shards[index]->done) return true;
+      }
+      return false;
+    });
+    return index;
+  }
+
+ private:
+  void ProcessShards() {
+    const std::unique_ptr<Canonicalizer> canonicalizer =
+        canonicalizer_factory_();
+    BHiveImporter importer(canonicalizer.get());
+    while (true) {
+      Shard* shard = nullptr;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        shard_submitted_.wait(
+            lock, [this]() { return shutting_down_ || !queue_.empty(); });
+        if (shutting_down_) return;
+        shard = queue_.front();
+        queue_.pop_front();
+      }
+      shard->results = importer.ParseBHiveCsvLines(
+          options_.source_name, shard->lines,
+          options_.machine_code_hex_column_index,
+          options_.throughput_column_index, options_.throughput_scaling);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        shard->done = true;
+      }
+      shard_done_.notify_all();
+    }
+  }
+
+  const BHiveCsvImportOptions& options_;
+  const CanonicalizerFactory& canonicalizer_factory_;
+
+  std::mutex mutex_;
+  std::condition_variable shard_submitted_;
+  std::condition_variable shard_done_;
+  // Shards that were submitted but not picked up by a worker thread yet.
+  // Guarded by `mutex_`.
+  std::deque<Shard*> queue_;
+  bool shutting_down_ = false;
+
+  std::vector<std::thread> threads_;
+};
+
+}  // namespace
+
+absl::StatusOr<BHiveCsvImportStats> ImportBHiveCsv(
+    const BHiveCsvImportOptions& options,
+    const CanonicalizerFactory& canonicalizer_factory,
+    const CsvLineReader& read_line, const BHiveBlockConsumer& consume_block,
+    const BHiveCsvErrorHandler& handle_error) {
+  if (options.shard_size <= 0) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "shard_size must be positive, it is ", options.shard_size));
+  }
+  if (options.machine_code_hex_column_index ==
+      options.throughput_column_index) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Expected machine code column and throughput column indices to be "
+        "different, but were both ",
+        options.machine_code_hex_column_index));
+  }
+  int num_threads = options.num_threads;
+  if (num_threads <= 0) {
+    num_threads =
+        std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  }
+  // We keep two shards per worker thread in flight, so that the workers do not
+  // need to wait while the calling thread passes the results of one shard to
+  // the consumer and reads the lines of the next one.
+  const size_t max_shards_in_flight = 2 * num_threads;
+
+  BHiveCsvImportStats stats;
+  BasicBlockDeduplicator deduplicator;
+  // The shards in flight in the order of the input. This must be declared
+  // before `processor`, so that the worker threads are stopped before the
+  // shards are destroyed.
+  std::deque<std::unique_ptr<Shard>> shards;
+  ShardProcessor processor(options, canonicalizer_factory, num_threads);
+  bool end_of_input = false;
+  std::string line;
+  while (true) {
+    while (!end_of_input && shards.size() < max_shards_in_flight) {
+      auto shard = std::make_unique<Shard>();
+      shard->first_line_number = stats.num_input_lines;
+      shard->lines.reserve(options.shard_size);
+      while (shard->lines.size() < static_cast<size_t>(options.shard_size)) {
+        if (!read_line(line)) {
+          end_of_input = true;
+          break;
+        }
+        shard->lines.push_back(std::move(line));
+      }
+      if (shard->lines.empty()) break;
+      stats.num_input_lines += shard->lines.size();
+      processor.Submit(shard.get());
+      shards.push_back(std::move(shard));
+    }
+    if (shards.empty()) break;
+
+    const size_t index =
+        processor.WaitForDoneShard(shards, options.preserve_order);
+    const std::unique_ptr<Shard> shard = std::move(shards[index]);
+    shards.erase(shards.begin() + index);
+    for (size_t i = 0; i < shard->results.size(); ++i) {
+      absl::StatusOr<BasicBlockWithThroughputProto>& result = shard->results[i];
+      if (!result.ok()) {
+        ++stats.num_skipped_lines;
+        if (handle_error) {
+          handle_error(shard->first_line_number + i, shard->lines[i],
+                       result.status());
+        }
+        continue;
+      }
+      if (options.deduplicate_blocks) {
+        deduplicator.Add(*std::move(result));
+        continue;
+      }
+      if (absl::Status status = consume_block(*std::move(result));
+          !status.ok()) {
+        return status;
+      }
+      ++stats.num_imported_blocks;
+    }
+  }
+  if (options.deduplicate_blocks) {
+    stats.num_duplicate_blocks = deduplicator.num_duplicates();
+    for (BasicBlockWithThroughputProto& block : deduplicator.TakeBlocks()) {
+      if (absl::Status status = consume_block(std::move(block));
+          !status.ok()) {
+        return status;
+      }
+      ++stats.num_imported_blocks;
+    }
+  }
+  return stats;
+}
+
+absl::StatusOr<BHiveCsvImportStats> ImportBHiveCsvFile(
+    std::string_view file_name, const BHiveCsvImportOptions& options,
+    const CanonicalizerFactory& canonicalizer_factory,
+    const BHiveBlockConsumer& consume_block,
+    const BHiveCsvErrorHandler& handle_error) {
+  std::ifstream file{std::string(file_name)};
+  if (!file.is_open()) {
+    return absl::NotFoundError(absl::StrCat("Could not open ", file_name));
+  }
+  return ImportBHiveCsv(
+      options, canonicalizer_factory,
+      [&file](std::string& line) {
+        return static_cast<bool>(std::getline(file, line));
+      },
+      consume_block, handle_error);
+}
+
+}  // namespace gematria
@@ -0,0 +1,118 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains a multi-threaded importer for BHive CSV files. The importer reads
+// the input in shards of lines, and parses the shards on a pool of worker
+// threads. Each worker thread has its own canonicalizer and BHiveImporter, so
+// that the LLVM disassembler and instruction printer are never shared between
+// threads.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_PARALLEL_BHIVE_IMPORTER_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_PARALLEL_BHIVE_IMPORTER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "gematria/llvm/canonicalizer.h"
+#include "gematria/proto/throughput.pb.h"
+
+namespace gematria {
+
+// Options for ImportBHiveCsv().
+struct BHiveCsvImportOptions {
+  // The name of the throughput source used in the output protos.
+  std::string source_name;
+  // The index of the column in the CSV containing the machine code in hex
+  // format.
+  size_t machine_code_hex_column_index = 0;
+  // The index of the column in the CSV containing the throughput in cycles.
+  size_t throughput_column_index = 1;
+  // The scaling applied to the throughput values from the CSV.
+  double throughput_scaling = 1.0;
+  // The number of worker threads. When zero or negative, the importer uses
+  // one thread per available CPU.
+  int num_threads = 0;
+  // The number of CSV lines processed by a worker thread at once.
+  int shard_size = 1000;
+  // When true, the basic blocks are passed to the consumer in the order of the
+  // lines in the input. When false, they are passed in the order in which the
+  // shards are parsed, which avoids waiting for slow shards.
+  bool preserve_order = true;
+  // When true, the basic blocks with the same canonicalized instructions are
+  // merged into a single proto as described by BasicBlockDeduplicator. The
+  // blocks are then passed to the consumer only after the whole input was
+  // parsed, in the order in which they first appeared.
+  bool deduplicate_blocks = false;
+};
+
+// Statistics collected by ImportBHiveCsv().
+struct BHiveCsvImportStats {
+  // The number of lines read from the input.
+  int64_t num_input_lines = 0;
+  // The number of basic blocks passed to the consumer.
+  int64_t num_imported_blocks = 0;
+  // The number of lines that could not be parsed.
+  int64_t num_skipped_lines = 0;
+  // The number of basic blocks that were merged into another block with the
+  // same canonicalized instructions.
+  int64_t num_duplicate_blocks = 0;
+};
+
+// Creates a new canonicalizer. Called once by each worker thread.
+using CanonicalizerFactory = std::function<std::unique_ptr<Canonicalizer>()>;
+
+// Reads the next line of the input into `line`. Returns false when there are no
+// more lines.
+using CsvLineReader = std::function<bool(std::string& line)>;
+
+// Receives one imported basic block. Returning an error stops the import.
+using BHiveBlockConsumer =
+    std::function<absl::Status(BasicBlockWithThroughputProto block)>;
+
+// Receives the lines that could not be parsed. `line_number` is the zero-based
+// index of the line in the input.
+using BHiveCsvErrorHandler = std::function<void(
+    int64_t line_number, std::string_view line, const absl::Status& status)>;
+
+// Imports basic blocks from BHive CSV lines provided by `read_line`. The lines
+// are parsed in parallel as described by BHiveImporter::ParseBHiveCsvLine().
+// `read_line`, `consume_block` and `handle_error` are all called from the
+// calling thread; `canonicalizer_factory` is called from the worker threads,
+// and it must be thread-safe. `handle_error` may be empty; lines that can't be
+// parsed are then skipped silently.
+// Returns the statistics of the import, or the first error returned by
+// `consume_block`.
+absl::StatusOr<BHiveCsvImportStats> ImportBHiveCsv(
+    const BHiveCsvImportOptions& options,
+    const CanonicalizerFactory& canonicalizer_factory,
+    const CsvLineReader& read_line, const BHiveBlockConsumer& consume_block,
+    const BHiveCsvErrorHandler& handle_error = nullptr);
+
+// A version of ImportBHiveCsv() that reads the lines from a file. Returns an
+// error when the file can't be opened.
+absl::StatusOr<BHiveCsvImportStats> ImportBHiveCsvFile(
+    std::string_view file_name, const BHiveCsvImportOptions& options,
+    const CanonicalizerFactory& canonicalizer_factory,
+    const BHiveBlockConsumer& consume_block,
+    const BHiveCsvErrorHandler& handle_error = nullptr);
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_PARALLEL_BHIVE_IMPORTER_H_
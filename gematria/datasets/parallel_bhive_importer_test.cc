@@ -0,0 +1,192 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/datasets/parallel_bhive_importer.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "gematria/llvm/canonicalizer.h"
+#include "gematria/llvm/llvm_architecture_support.h"
+#include "gematria/proto/throughput.pb.h"
+#include "gematria/testing/matchers.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::UnorderedElementsAreArray;
+
+constexpr std::string_view kSourceName = "bhive: skl";
+
+class ParallelBHiveImporterTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    x86_llvm_ = LlvmArchitectureSupport::X86_64();
+    canonicalizer_factory_ = [this]() -> std::unique_ptr<Canonicalizer> {
+      return std::make_unique<X86Canonicalizer>(&x86_llvm_->target_machine());
+    };
+    options_.source_name = kSourceName;
+    options_.num_threads = 4;
+    options_.shard_size = 3;
+  }
+
+  // Returns a reader that returns the elements of `lines`.
+  static CsvLineReader ReadLines(const std::vector<std::string>& lines) {
+    return [&lines, next = size_t{0}](std::string& line) mutable {
+      if (next == lines.size()) return false;
+      line = lines[next++];
+      return true;
+    };
+  }
+
+  // Returns a list of valid CSV lines, each with a different throughput.
+  static std::vector<std::string> MakeLines(int num_lines) {
+    std::vector<std::string> lines;
+    for (int i = 0; i < num_lines; ++i) {
+      lines.push_back("4929d2," + std::to_string(i));
+    }
+    return lines;
+  }
+
+  std::unique_ptr<LlvmArchitectureSupport> x86_llvm_;
+  CanonicalizerFactory canonicalizer_factory_;
+  BHiveCsvImportOptions options_;
+};
+
+TEST_F(ParallelBHiveImporterTest, PreservesOrder) {
+  const std::vector<std::string> lines = MakeLines(100);
+  std::vector<BasicBlockWithThroughputProto> blocks;
+  const absl::StatusOr<BHiveCsvImportStats> stats = ImportBHiveCsv(
+      options_, canonicalizer_factory_, ReadLines(lines),
+      [&blocks](BasicBlockWithThroughputProto block) {
+        blocks.push_back(std::move(block));
+        return absl::OkStatus();
+      });
+  ASSERT_OK(stats);
+  EXPECT_EQ(stats->num_input_lines, lines.size());
+  EXPECT_EQ(stats->num_imported_blocks, lines.size());
+  EXPECT_EQ(stats->num_skipped_lines, 0);
+
+  ASSERT_EQ(blocks.size(), lines.size());
+  for (size_t i = 0; i < lines.size(); ++i) {
+    ASSERT_EQ(blocks[i].inverse_throughputs_size(), 1);
+    EXPECT_THAT(blocks[i].inverse_throughputs(0).inverse_throughput_cycles(),
+                ElementsAre(static_cast<double>(i)));
+  }
+}
+
+TEST_F(ParallelBHiveImporterTest, AnyOrder) {
+  options_.preserve_order = false;
+  constexpr int kNumLines = 100;
+  const std::vector<std::string> lines = MakeLines(kNumLines);
+  std::vector<int> throughputs;
+  const absl::StatusOr<BHiveCsvImportStats> stats = ImportBHiveCsv(
+      options_, canonicalizer_factory_, ReadLines(lines),
+      [&throughputs](BasicBlockWithThroughputProto block) {
+        throughputs.push_back(
+            block.inverse_throughputs(0).inverse_throughput_cycles(0));
+        return absl::OkStatus();
+      });
+  ASSERT_OK(stats);
+  EXPECT_EQ(stats->num_imported_blocks, lines.size());
+
+  std::vector<int> expected_throughputs;
+  for (int i = 0; i < kNumLines; ++i) expected_throughputs.push_back(i);
+  EXPECT_THAT(throughputs, UnorderedElementsAreArray(expected_throughputs));
+}
+
+TEST_F(ParallelBHiveImporterTest, SkipsInvalidLines) {
+  const std::vector<std::string> lines = {"4929d2,1", "4929d2", "xyz,2",
+                                          "4929d2,3"};
+  std::vector<int64_t> error_line_numbers;
+  int num_blocks = 0;
+  const absl::StatusOr<BHiveCsvImportStats> stats = ImportBHiveCsv(
+      options_, canonicalizer_factory_, ReadLines(lines),
+      [&num_blocks](BasicBlockWithThroughputProto block) {
+        ++num_blocks;
+        return absl::OkStatus();
+      },
+      [&error_line_numbers](int64_t line_number, std::string_view line,
+                            const absl::Status& status) {
+        error_line_numbers.push_back(line_number);
+      });
+  ASSERT_OK(stats);
+  EXPECT_EQ(stats->num_input_lines, 4);
+  EXPECT_EQ(stats->num_imported_blocks, 2);
+  EXPECT_EQ(stats->num_skipped_lines, 2);
+  EXPECT_EQ(num_blocks, 2);
+  EXPECT_THAT(error_line_numbers, ElementsAre(1, 2));
+}
+
+TEST_F(ParallelBHiveImporterTest, DeduplicatesBlocks) {
+  options_.deduplicate_blocks = true;
+  const std::vector<std::string> lines = {"4929d2,1", "4801d8,2", "4929d2,3",
+                                          "4929d2,4", "4929d2,5"};
+  std::vector<BasicBlockWithThroughputProto> blocks;
+  const absl::StatusOr<BHiveCsvImportStats> stats = ImportBHiveCsv(
+      options_, canonicalizer_factory_, ReadLines(lines),
+      [&blocks](BasicBlockWithThroughputProto block) {
+        blocks.push_back(std::move(block));
+        return absl::OkStatus();
+      });
+  ASSERT_OK(stats);
+  EXPECT_EQ(stats->num_input_lines, 5);
+  EXPECT_EQ(stats->num_imported_blocks, 2);
+  EXPECT_EQ(stats->num_duplicate_blocks, 3);
+
+  ASSERT_EQ(blocks.size(), 2);
+  EXPECT_EQ(blocks[0].num_duplicates(), 3);
+  ASSERT_EQ(blocks[0].inverse_throughputs_size(), 1);
+  EXPECT_THAT(blocks[0].inverse_throughputs(0).inverse_throughput_cycles(),
+              ElementsAre(1, 3, 4, 5));
+  EXPECT_EQ(blocks[1].num_duplicates(), 0);
+  ASSERT_EQ(blocks[1].inverse_throughputs_size(), 1);
+  EXPECT_THAT(blocks[1].inverse_throughputs(0).inverse_throughput_cycles(),
+              ElementsAre(2));
+}
+
+TEST_F(ParallelBHiveImporterTest, ConsumerError) {
+  const std::vector<std::string> lines = MakeLines(100);
+  int num_blocks = 0;
+  const absl::StatusOr<BHiveCsvImportStats> stats = ImportBHiveCsv(
+      options_, canonicalizer_factory_, ReadLines(lines),
+      [&num_blocks](BasicBlockWithThroughputProto block) {
+        if (++num_blocks == 10) return absl::InternalError("Stop");
+        return absl::OkStatus();
+      });
+  EXPECT_THAT(stats, StatusIs(absl::StatusCode::kInternal));
+  EXPECT_EQ(num_blocks, 10);
+}
+
+TEST_F(ParallelBHiveImporterTest, InvalidOptions) {
+  options_.throughput_column_index = options_.machine_code_hex_column_index;
+  const std::vector<std::string> lines = MakeLines(1);
+  EXPECT_THAT(ImportBHiveCsv(options_, canonicalizer_factory_,
+                             ReadLines(lines),
+                             [](BasicBlockWithThroughputProto block) {
+                               return absl::OkStatus();
+                             }),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+}  // namespace
+}  // namespace gematria
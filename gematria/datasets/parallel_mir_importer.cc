@@ -0,0 +1,434 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "gematria/datasets/parallel_mir_importer.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "absl/container/inlined_vector.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "gematria/datasets/bhive_importer.h"
+#include "gematria/datasets/block_deduplicator.h"
+#include "gematria/datasets/parallel_bhive_importer.h"
+#include "gematria/llvm/canonicalizer.h"
+#include "gematria/proto/throughput.pb.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+namespace gematria {
+namespace {
+
+struct MIRFileImport;
+
+// The functions of one MIR file owned by one worker thread, and the CSV rows
+// whose basic blocks are in these functions.
+struct MIRImportTask {
+  MIRFileImport* file = nullptr;
+  std::vector<std::string> function_names;
+  // Indices into MIRFileImport::lines. The rows of each function are
+  // contiguous, so that the worker parses each function only once.
+  std::vector<size_t> row_indices;
+};
+
+// One input file and the results of importing it.
+struct MIRFileImport {
+  const MIRImportInput* input = nullptr;
+  // The CSV rows that passed the throughput filter and whose basic blocks are
+  // in the MIR file.
+  std::vector<std::string> lines;
+  // The results of parsing `lines`; results[i] corresponds to lines[i]. Each
+  // element is written only by the worker thread that owns the function of the
+  // basic block, before it marks its task as done.
+  std::vector<absl::StatusOr<BasicBlockWithThroughputProto>> results;
+  std::vector<MIRImportTask> tasks;
+  // The first error encountered by a worker thread when loading the files.
+  // Guarded by MIRTaskProcessor::mutex_.
+  absl::Status load_status;
+  // The number of tasks that are not done yet. Guarded by
+  // MIRTaskProcessor::mutex_.
+  size_t num_pending_tasks = 0;
+};
+
+void AddMIRImportStats(const MIRImportStats& from, MIRImportStats& into) {
+  into.num_parsed_blocks += from.num_parsed_blocks;
+  into.num_cached_blocks += from.num_cached_blocks;
+  into.num_call_rejections += from.num_call_rejections;
+  into.num_unparsable_rejections += from.num_unparsable_rejections;
+  into.num_missing_mbb_rejections += from.num_missing_mbb_rejections;
+  into.num_interference_rejections += from.num_interference_rejections;
+  into.num_cached_rejections += from.num_cached_rejections;
+  into.num_interference_edges += from.num_interference_edges;
+  into.load_mir_nanos += from.load_mir_nanos;
+  into.parse_live_info_nanos += from.parse_live_info_nanos;
+  into.convert_blocks_nanos += from.convert_blocks_nanos;
+  into.interference_nanos += from.interference_nanos;
+}
+
+// A pool of worker threads that run MIR import tasks. Each worker thread has
+// its own canonicalizer and BHive importer.
+class MIRTaskProcessor {
+ public:
+  MIRTaskProcessor(const ParallelMIRImportOptions& options,
+                   const CanonicalizerFactory& canonicalizer_factory,
+                   int num_threads)
+      : options_(options),
+        uses_live_info_(options.model_type != "NO_LIVE_INFO") {
+    // The canonicalizers are created on the calling thread, so that the
+    // factory does not need to be thread-safe.
+    std::vector<std::unique_ptr<Canonicalizer>> canonicalizers;
+    canonicalizers.reserve(num_threads);
+    for (int i = 0; i < num_threads; ++i) {
+      canonicalizers.push_back(canonicalizer_factory());
+    }
+    threads_.reserve(num_threads);
+    for (std::unique_ptr<Canonicalizer>& canonicalizer : canonicalizers) {
+      threads_.emplace_back(
+          [this, canonicalizer = std::move(canonicalizer)]() mutable {
+            ProcessTasks(std::move(canonicalizer));
+          });
+    }
+  }
+
+  // Stops the worker threads. Tasks that were submitted but not picked up by a
+  // worker thread are not processed.
+  ~MIRTaskProcessor() { Stop(); }
+
+  // Stops the worker threads, and returns the sum of the statistics of their
+  // importers.
+  const MIRImportStats& Stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      shutting_down_ = true;
+    }
+    task_submitted_.notify_all();
+    for (std::thread& thread : threads_) {
+      if (thread.joinable()) thread.join();
+    }
+    return mir_import_stats_;
+  }
+
+  // Adds the tasks of `file` to the queue. The file must remain valid until
+  // it is done or until the processor is destroyed.
+  void Submit(MIRFileImport* file) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      file->num_pending_tasks = file->tasks.size();
+      for (MIRImportTask& task : file->tasks) queue_.push_back(&task);
+    }
+    task_submitted_.notify_all();
+  }
+
+  // Blocks until all tasks of `file` are done.
+  void WaitUntilDone(const MIRFileImport& file) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    task_done_.wait(lock, [&file]() { return file.num_pending_tasks == 0; });
+  }
+
+ private:
+  void ProcessTasks(std::unique_ptr<Canonicalizer> canonicalizer) {
+    BHiveImporter importer(canonicalizer.get(), options_.model_type);
+    while (true) {
+      MIRImportTask* task = nullptr;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        task_submitted_.wait(
+            lock, [this]() { return shutting_down_ || !queue_.empty(); });
+        if (shutting_down_) break;
+        task = queue_.front();
+        queue_.pop_front();
+      }
+      const absl::Status status = RunTask(*task, importer);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        MIRFileImport& file = *task->file;
+        if (!status.ok() && file.load_status.ok()) file.load_status = status;
+        --file.num_pending_tasks;
+      }
+      task_done_.notify_all();
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    AddMIRImportStats(importer.mir_import_stats(), mir_import_stats_);
+  }
+
+  // Loads the MIR file and the live info of the functions of `task`, and
+  // parses the rows of the task. Returns an error when the files can't be
+  // loaded.
+  absl::Status RunTask(MIRImportTask& task, BHiveImporter& importer) {
+    MIRFileImport& file = *task.file;
+    if (absl::StatusOr<bool> loaded =
+            importer.LoadMIRModuleLazily(file.input->mir_file_name);
+        !loaded.ok()) {
+      return loaded.status();
+    }
+    if (uses_live_info_) {
+      const std::unordered_set<std::string_view> functions(
+          task.function_names.begin(), task.function_names.end());
+      if (absl::StatusOr<bool> loaded =
+              importer.InteferenceGraphParserForFunctions(
+                  file.input->live_info_file_name,
+                  [&functions](std::string_view function_name) {
+                    return functions.count(function_name) > 0;
+                  });
+          !loaded.ok()) {
+        return loaded.status();
+      }
+    }
+    const MIRCsvImportOptions& csv_options = options_.csv_options;
+    for (const size_t row : task.row_indices) {
+      file.results[row] = importer.ParseMIRCsvLine(
+          csv_options.source_name, file.lines[row], csv_options.BB_name_index,
+          csv_options.throughput_column_index, csv_options.throughput_scaling,
+          csv_options.base_address);
+    }
+    return absl::OkStatus();
+  }
+
+  const ParallelMIRImportOptions& options_;
+  const bool uses_live_info_;
+
+  std::mutex mutex_;
+  std::condition_variable task_submitted_;
+  std::condition_variable task_done_;
+  // Tasks that were submitted but not picked up by a worker thread yet.
+  // Guarded by `mutex_`.
+  std::deque<MIRImportTask*> queue_;
+  bool shutting_down_ = false;
+  // The statistics of the importers of the threads that already stopped.
+  // Guarded by `mutex_`.
+  MIRImportStats mir_import_stats_;
+
+  std::vector<std::thread> threads_;
+};
+
+// Reads the CSV file of `input`, filters the rows, and splits them into at
+// most `max_num_tasks` tasks by the functions of their basic blocks. `router`
+// is used only to look up the functions. Updates `stats` with the rows that
+// are filtered or skipped.
+absl::StatusOr<std::unique_ptr<MIRFileImport>> RouteMIRFile(
+    const MIRImportInput& input, const MIRCsvImportOptions& options,
+    int max_num_tasks, BHiveImporter& router, ParallelMIRImportStats& stats) {
+  if (absl::StatusOr<bool> loaded =
+          router.LoadMIRModuleLazily(input.mir_file_name);
+      !loaded.ok()) {
+    return loaded.status();
+  }
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer =
+      llvm::MemoryBuffer::getFile(input.csv_file_name, /*IsText=*/false,
+                                  /*RequiresNullTerminator=*/false);
+  if (!buffer) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Could not open file ", input.csv_file_name));
+  }
+
+  auto file = std::make_unique<MIRFileImport>();
+  file->input = &input;
+  // The rows of each function, in the order in which the functions first
+  // appear in the CSV file. The names point into the module of `router`.
+  std::vector<std::vector<size_t>> function_rows;
+  std::vector<std::string_view> function_names;
+  std::unordered_map<std::string_view, size_t> function_indices;
+  MIRCsvImportStats csv_stats;
+  llvm::StringRef contents = (*buffer)->getBuffer();
+  while (!contents.empty()) {
+    llvm::StringRef line;
+    std::tie(line, contents) = contents.split('\n');
+    line = line.trim();
+    if (line.empty()) continue;
+    ++csv_stats.num_input_lines;
+
+    // The same filter as in BHiveImporter::ParseMIRCsvFile().
+    const std::string_view line_view(line.data(), line.size());
+    const absl::InlinedVector<std::string_view, 4> columns =
+        absl::StrSplit(line_view, ',');
+    if (options.throughput_column_index < columns.size()) {
+      double throughput = 0.0;
+      if (absl::SimpleAtod(columns[options.throughput_column_index],
+                           &throughput) &&
+          (throughput < options.min_throughput ||
+           throughput > options.max_throughput)) {
+        ++csv_stats.num_filtered_lines;
+        continue;
+      }
+    }
+    if (options.BB_name_index >= columns.size()) {
+      ++csv_stats.num_skipped_lines;
+      continue;
+    }
+    const absl::StatusOr<std::string_view> function_name =
+        router.GetFunctionNameOfMBB(columns[options.BB_name_index]);
+    if (!function_name.ok()) {
+      ++csv_stats.num_skipped_lines;
+      ++stats.mir.num_missing_mbb_rejections;
+      continue;
+    }
+    const auto [it, inserted] =
+        function_indices.try_emplace(*function_name, function_rows.size());
+    if (inserted) {
+      function_rows.emplace_back();
+      function_names.push_back(*function_name);
+    }
+    function_rows[it->second].push_back(file->lines.size());
+    file->lines.emplace_back(line_view);
+  }
+  file->results.resize(file->lines.size());
+
+  // Assign the largest functions first, each to the task with the fewest rows.
+  std::vector<size_t> functions_by_size(function_rows.size());
+  for (size_t i = 0; i < functions_by_size.size(); ++i) {
+    functions_by_size[i] = i;
+  }
+  std::stable_sort(functions_by_size.begin(), functions_by_size.end(),
+                   [&function_rows](size_t a, size_t b) {
+                     return function_rows[a].size() > function_rows[b].size();
+                   });
+  file->tasks.resize(
+      std::min(function_rows.size(), static_cast<size_t>(max_num_tasks)));
+  for (const size_t function : functions_by_size) {
+    MIRImportTask& task = *std::min_element(
+        file->tasks.begin(), file->tasks.end(),
+        [](const MIRImportTask& a, const MIRImportTask& b) {
+          return a.row_indices.size() < b.row_indices.size();
+        });
+    task.file = file.get();
+    task.function_names.emplace_back(function_names[function]);
+    task.row_indices.insert(task.row_indices.end(),
+                            function_rows[function].begin(),
+                            function_rows[function].end());
+  }
+
+  stats.csv.num_input_lines += csv_stats.num_input_lines;
+  stats.csv.num_filtered_lines += csv_stats.num_filtered_lines;
+  stats.csv.num_skipped_lines += csv_stats.num_skipped_lines;
+  return file;
+}
+
+}  // namespace
+
+absl::StatusOr<ParallelMIRImportStats> ImportMIRFiles(
+    const std::vector<MIRImportInput>& inputs,
+    const ParallelMIRImportOptions& options,
+    const CanonicalizerFactory& canonicalizer_factory,
+    const BHiveBlockConsumer& consume_block,
+    const MIRImportErrorHandler& handle_file_error) {
+  const MIRCsvImportOptions& csv_options = options.csv_options;
+  if (csv_options.BB_name_index == csv_options.throughput_column_index) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Expected BB name column and throughput column indices to be "
+        "different, but were both ",
+        csv_options.BB_name_index));
+  }
+  int num_threads = options.num_threads;
+  if (num_threads <= 0) {
+    num_threads =
+        std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  }
+  // As in ImportBHiveCsv(), we keep two files per worker thread in flight, so
+  // that the workers do not need to wait while the calling thread passes the
+  // results of one file to the consumer and routes the rows of the next one.
+  const size_t max_files_in_flight = 2 * num_threads;
+
+  // The router only indexes the MIR files; it never parses machine functions.
+  const std::unique_ptr<Canonicalizer> router_canonicalizer =
+      canonicalizer_factory();
+  BHiveImporter router(router_canonicalizer.get(), options.model_type);
+
+  ParallelMIRImportStats stats;
+  BasicBlockDeduplicator deduplicator;
+  const auto skip_file = [&](const MIRImportInput& input,
+                             const absl::Status& status) {
+    ++stats.num_skipped_files;
+    if (handle_file_error) handle_file_error(input, status);
+  };
+  // The files in flight in the order of the input. This must be declared
+  // before `processor`, so that the worker threads are stopped before the
+  // files are destroyed.
+  std::deque<std::unique_ptr<MIRFileImport>> files;
+  MIRTaskProcessor processor(options, canonicalizer_factory, num_threads);
+  size_t next_input = 0;
+  while (true) {
+    while (next_input < inputs.size() && files.size() < max_files_in_flight) {
+      const MIRImportInput& input = inputs[next_input++];
+      absl::StatusOr<std::unique_ptr<MIRFileImport>> file =
+          RouteMIRFile(input, csv_options, num_threads, router, stats);
+      if (!file.ok()) {
+        skip_file(input, file.status());
+        continue;
+      }
+      processor.Submit(file->get());
+      files.push_back(*std::move(file));
+    }
+    if (files.empty()) break;
+
+    processor.WaitUntilDone(*files.front());
+    const std::unique_ptr<MIRFileImport> file = std::move(files.front());
+    files.pop_front();
+    // The status is no longer written by the worker threads.
+    if (!file->load_status.ok()) {
+      stats.csv.num_skipped_lines += file->lines.size();
+      skip_file(*file->input, file->load_status);
+      continue;
+    }
+    ++stats.num_imported_files;
+    for (absl::StatusOr<BasicBlockWithThroughputProto>& result :
+         file->results) {
+      if (!result.ok()) {
+        ++stats.csv.num_skipped_lines;
+        continue;
+      }
+      if (csv_options.deduplicate_blocks) {
+        deduplicator.Add(*std::move(result));
+        continue;
+      }
+      if (absl::Status status = consume_block(*std::move(result));
+          !status.ok()) {
+        return status;
+      }
+      ++stats.csv.num_imported_blocks;
+    }
+    if (csv_options.report_progress) csv_options.report_progress(stats.csv);
+  }
+  if (csv_options.deduplicate_blocks) {
+    stats.csv.num_duplicate_blocks = deduplicator.num_duplicates();
+    for (BasicBlockWithThroughputProto& block : deduplicator.TakeBlocks()) {
+      if (absl::Status status = consume_block(std::move(block));
+          !status.ok()) {
+        return status;
+      }
+      ++stats.csv.num_imported_blocks;
+    }
+  }
+  AddMIRImportStats(processor.Stop(), stats.mir);
+  return stats;
+}
+
+}  // namespace gematria
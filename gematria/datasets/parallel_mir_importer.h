@@ -0,0 +1,102 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Contains a multi-threaded importer of basic blocks from MIR files. Each
+// worker thread has its own BHiveImporter, i.e. its own LLVM context, MIR
+// parser and canonicalizer, so the LLVM objects are never shared between
+// threads. The CSV rows of each MIR file are routed by the machine function
+// that contains their basic block: each function of a file is owned by one
+// worker, which parses the function and its live info only once, and skips
+// the live info of the functions owned by other workers.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_PARALLEL_MIR_IMPORTER_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_PARALLEL_MIR_IMPORTER_H_
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "gematria/datasets/bhive_importer.h"
+#include "gematria/datasets/parallel_bhive_importer.h"
+
+namespace gematria {
+
+// One MIR file and the CSV file with the basic blocks imported from it.
+struct MIRImportInput {
+  std::string mir_file_name;
+  // The live info file of the MIR file. Ignored for the NO_LIVE_INFO model
+  // type.
+  std::string live_info_file_name;
+  // The CSV file with the names of the basic blocks and their throughputs, as
+  // described by BHiveImporter::ParseMIRCsvLine().
+  std::string csv_file_name;
+};
+
+// Options for ImportMIRFiles().
+struct ParallelMIRImportOptions {
+  // The options for parsing the CSV files. `report_progress` is called after
+  // each input file, and `progress_interval` is ignored.
+  MIRCsvImportOptions csv_options;
+  // The model type of the importers; see BHiveImporter::BHiveImporter().
+  std::string model_type = "NO_LIVE_INFO";
+  // The number of worker threads. When zero or negative, the importer uses
+  // one thread per available CPU.
+  int num_threads = 0;
+};
+
+// Statistics collected by ImportMIRFiles().
+struct ParallelMIRImportStats {
+  // The statistics of all CSV files that were imported.
+  MIRCsvImportStats csv;
+  // The statistics of the importers of all worker threads.
+  MIRImportStats mir;
+  // The number of input files that were imported.
+  int64_t num_imported_files = 0;
+  // The number of input files that could not be loaded.
+  int64_t num_skipped_files = 0;
+};
+
+// Receives the input files that could not be loaded, e.g. because one of the
+// files does not exist or the MIR file can't be parsed.
+using MIRImportErrorHandler =
+    std::function<void(const MIRImportInput& input, const absl::Status&)>;
+
+// Imports basic blocks from `inputs` using multiple threads. Produces the same
+// blocks as calling BHiveImporter::LoadMIRModuleLazily(),
+// BHiveImporter::InteferenceGraphParser() and BHiveImporter::ParseMIRCsvFile()
+// on each input in turn; the blocks are passed to `consume_block` in the order
+// of the inputs and of the lines in the CSV files. Several files are in flight
+// at the same time, so small files are imported in parallel too. With
+// `csv_options.deduplicate_blocks`, the blocks are deduplicated across all
+// inputs, and they are passed to `consume_block` after all inputs are
+// imported.
+// `canonicalizer_factory`, `consume_block` and `handle_file_error` are all
+// called from the calling thread. `handle_file_error` may be empty; files
+// that can't be loaded are then skipped silently.
+// Returns the statistics of the import, or an error when the options are not
+// valid or when `consume_block` returns an error.
+absl::StatusOr<ParallelMIRImportStats> ImportMIRFiles(
+    const std::vector<MIRImportInput>& inputs,
+    const ParallelMIRImportOptions& options,
+    const CanonicalizerFactory& canonicalizer_factory,
+    const BHiveBlockConsumer& consume_block,
+    const MIRImportErrorHandler& handle_file_error = nullptr);
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_PARALLEL_MIR_IMPORTER_H_
@@ -0,0 +1,168 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "gematria/datasets/parallel_mir_importer.h"
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "gematria/datasets/bhive_importer.h"
+#include "gematria/llvm/canonicalizer.h"
+#include "gematria/llvm/llvm_architecture_support.h"
+#include "gematria/proto/throughput.pb.h"
+#include "gematria/testing/matchers.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::ElementsAre;
+
+constexpr std::string_view kSourceName = "bhive: skl";
+constexpr std::string_view kModelType = "PER_FUNC_LIVE_INFO";
+constexpr char kMirFile[] = "sample_dataset/data.mir";
+constexpr char kLiveInfoFile[] = "sample_dataset/liveinfo";
+
+class ParallelMIRImporterTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    x86_llvm_ = LlvmArchitectureSupport::X86_64();
+    canonicalizer_factory_ = [this]() -> std::unique_ptr<Canonicalizer> {
+      return std::make_unique<X86Canonicalizer>(&x86_llvm_->target_machine());
+    };
+    options_.csv_options.source_name = kSourceName;
+    options_.model_type = kModelType;
+    options_.num_threads = 4;
+  }
+
+  // Writes `contents` to a new CSV file, and returns an input that uses it
+  // with the sample MIR file.
+  static MIRImportInput MakeInput(const std::string& name,
+                                  std::string_view contents) {
+    const std::string csv_file_name = ::testing::TempDir() + "/" + name;
+    std::ofstream(csv_file_name) << contents;
+    return {kMirFile, kLiveInfoFile, csv_file_name};
+  }
+
+  // Returns the block parsed by a single-threaded importer from `line`.
+  BasicBlockWithThroughputProto ParseLine(std::string_view line) {
+    X86Canonicalizer canonicalizer(&x86_llvm_->target_machine());
+    BHiveImporter importer(&canonicalizer, std::string(kModelType));
+    EXPECT_OK(importer.LoadMIRModule(kMirFile));
+    EXPECT_OK(importer.InteferenceGraphParser(kLiveInfoFile));
+    absl::StatusOr<BasicBlockWithThroughputProto> block =
+        importer.ParseMIRCsvLine(kSourceName, line, 0, 1);
+    EXPECT_OK(block);
+    return block.ok() ? *block : BasicBlockWithThroughputProto();
+  }
+
+  std::unique_ptr<LlvmArchitectureSupport> x86_llvm_;
+  CanonicalizerFactory canonicalizer_factory_;
+  ParallelMIRImportOptions options_;
+};
+
+TEST_F(ParallelMIRImporterTest, ImportsFilesInOrder) {
+  // BB_0 and BB_2 are in different functions, so they are parsed by different
+  // worker threads.
+  const std::vector<MIRImportInput> inputs = {
+      MakeInput("first.csv", "BB_2,2\nBB_0,1\nBB_unknown,5\nBB_2,3\n"),
+      MakeInput("second.csv", "\nBB_0,4\n")};
+  std::vector<std::string> blocks;
+  const absl::StatusOr<ParallelMIRImportStats> stats = ImportMIRFiles(
+      inputs, options_, canonicalizer_factory_,
+      [&blocks](BasicBlockWithThroughputProto block) {
+        blocks.push_back(block.SerializeAsString());
+        return absl::OkStatus();
+      });
+  ASSERT_OK(stats);
+  EXPECT_EQ(stats->num_imported_files, 2);
+  EXPECT_EQ(stats->num_skipped_files, 0);
+  EXPECT_EQ(stats->csv.num_input_lines, 5);
+  EXPECT_EQ(stats->csv.num_imported_blocks, 4);
+  EXPECT_EQ(stats->csv.num_skipped_lines, 1);
+  EXPECT_EQ(stats->mir.num_missing_mbb_rejections, 1);
+  EXPECT_EQ(stats->mir.num_parsed_blocks, 4);
+  EXPECT_THAT(blocks, ElementsAre(ParseLine("BB_2,2").SerializeAsString(),
+                                  ParseLine("BB_0,1").SerializeAsString(),
+                                  ParseLine("BB_2,3").SerializeAsString(),
+                                  ParseLine("BB_0,4").SerializeAsString()));
+}
+
+TEST_F(ParallelMIRImporterTest, FiltersAndDeduplicates) {
+  options_.csv_options.max_throughput = 10;
+  options_.csv_options.deduplicate_blocks = true;
+  const std::vector<MIRImportInput> inputs = {
+      MakeInput("dedup.csv", "BB_0,1\nBB_2,100\nBB_0,2\n")};
+  std::vector<BasicBlockWithThroughputProto> blocks;
+  const absl::StatusOr<ParallelMIRImportStats> stats = ImportMIRFiles(
+      inputs, options_, canonicalizer_factory_,
+      [&blocks](BasicBlockWithThroughputProto block) {
+        blocks.push_back(std::move(block));
+        return absl::OkStatus();
+      });
+  ASSERT_OK(stats);
+  EXPECT_EQ(stats->csv.num_filtered_lines, 1);
+  EXPECT_EQ(stats->csv.num_duplicate_blocks, 1);
+  EXPECT_EQ(stats->csv.num_imported_blocks, 1);
+  ASSERT_EQ(blocks.size(), 1);
+  EXPECT_EQ(blocks[0].inverse_throughputs_size(), 2);
+}
+
+TEST_F(ParallelMIRImporterTest, SkipsFilesThatCantBeLoaded) {
+  const std::vector<MIRImportInput> inputs = {
+      {"does_not_exist.mir", kLiveInfoFile, "does_not_exist.csv"},
+      MakeInput("valid.csv", "BB_0,1\n")};
+  std::vector<std::string> failed_files;
+  const absl::StatusOr<ParallelMIRImportStats> stats = ImportMIRFiles(
+      inputs, options_, canonicalizer_factory_,
+      [](BasicBlockWithThroughputProto) { return absl::OkStatus(); },
+      [&failed_files](const MIRImportInput& input, const absl::Status&) {
+        failed_files.push_back(input.mir_file_name);
+      });
+  ASSERT_OK(stats);
+  EXPECT_EQ(stats->num_imported_files, 1);
+  EXPECT_EQ(stats->num_skipped_files, 1);
+  EXPECT_EQ(stats->csv.num_imported_blocks, 1);
+  EXPECT_THAT(failed_files, ElementsAre("does_not_exist.mir"));
+}
+
+TEST_F(ParallelMIRImporterTest, ConsumerError) {
+  const std::vector<MIRImportInput> inputs = {
+      MakeInput("consumer_error.csv", "BB_0,1\nBB_2,2\n")};
+  EXPECT_THAT(ImportMIRFiles(inputs, options_, canonicalizer_factory_,
+                             [](BasicBlockWithThroughputProto) {
+                               return absl::InternalError("Write failed");
+                             }),
+              StatusIs(absl::StatusCode::kInternal));
+}
+
+TEST_F(ParallelMIRImporterTest, InvalidColumnIndices) {
+  options_.csv_options.BB_name_index = 1;
+  EXPECT_THAT(ImportMIRFiles({}, options_, canonicalizer_factory_,
+                             [](BasicBlockWithThroughputProto) {
+                               return absl::OkStatus();
+                             }),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+}  // namespace
+}  // namespace gematria
@@ -14,14 +14,30 @@
 
 #include "gematria/datasets/bhive_importer.h"
 
+#include <cstddef>
 #include <cstdint>
+#include <limits>
+#include <memory>
+#include <string>
 #include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
 
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "gematria/datasets/parallel_bhive_importer.h"
+#include "gematria/datasets/parallel_mir_importer.h"
+#include "gematria/io/sharded_tfrecord_writer.h"
+#include "gematria/io/tfrecord_writer.h"
 #include "gematria/llvm/canonicalizer.h"
+#include "gematria/proto/throughput.pb.h"
 #include "llvm/ADT/ArrayRef.h"
 #include "pybind11/cast.h"
 #include "pybind11/detail/common.h"
 #include "pybind11/pybind11.h"
+#include "pybind11/pytypes.h"
+#include "pybind11/stl.h"
 #include "pybind11_abseil/import_status_module.h"
 #include "pybind11_abseil/status_casters.h"
 #include "pybind11_protobuf/native_proto_caster.h"
@@ -30,12 +46,111 @@ namespace gematria {
 
 namespace py = ::pybind11;
 
+namespace {
+
+MIRCsvImportOptions MakeMIRCsvImportOptions(
+    std::string source_name, size_t BB_name_index,
+    size_t throughput_column_index, double throughput_scaling,
+    double min_throughput, double max_throughput,
+    const py::object& report_progress, int64_t progress_interval,
+    bool deduplicate_blocks) {
+  MIRCsvImportOptions options;
+  options.source_name = std::move(source_name);
+  options.BB_name_index = BB_name_index;
+  options.throughput_column_index = throughput_column_index;
+  options.throughput_scaling = throughput_scaling;
+  options.min_throughput = min_throughput;
+  options.max_throughput = max_throughput;
+  options.progress_interval = progress_interval;
+  options.deduplicate_blocks = deduplicate_blocks;
+  if (!report_progress.is_none()) {
+    // The progress callback is called from the import, which runs without
+    // the GIL; `report_progress` must outlive the import.
+    options.report_progress =
+        [&report_progress](const MIRCsvImportStats& stats) {
+          py::gil_scoped_acquire gil;
+          report_progress(stats);
+        };
+  }
+  return options;
+}
+
+BHiveCsvImportOptions MakeBHiveCsvImportOptions(
+    std::string source_name, size_t machine_code_hex_column_index,
+    size_t throughput_column_index, double throughput_scaling,
+    int num_threads, int shard_size, bool preserve_order,
+    bool deduplicate_blocks) {
+  BHiveCsvImportOptions options;
+  options.source_name = std::move(source_name);
+  options.machine_code_hex_column_index = machine_code_hex_column_index;
+  options.throughput_column_index = throughput_column_index;
+  options.throughput_scaling = throughput_scaling;
+  options.num_threads = num_threads;
+  options.shard_size = shard_size;
+  options.preserve_order = preserve_order;
+  options.deduplicate_blocks = deduplicate_blocks;
+  return options;
+}
+
+// Runs ImportBHiveCsv() on the lines from `lines`. Must be called with the
+// GIL; the import runs without it, and the line reader and the error handler
+// re-acquire it to call into Python.
+absl::StatusOr<BHiveCsvImportStats> ImportBHiveCsvFromPython(
+    const Canonicalizer& canonicalizer, const py::iterable& lines,
+    const BHiveCsvImportOptions& options,
+    const BHiveBlockConsumer& consume_block, const py::object& handle_error) {
+  // Each worker thread needs its own canonicalizer. As of 2023-05, we
+  // support only x86-64 so we can create the canonicalizers directly.
+  const llvm::TargetMachine* const target_machine =
+      &canonicalizer.target_machine();
+  const CanonicalizerFactory canonicalizer_factory =
+      [target_machine]() -> std::unique_ptr<Canonicalizer> {
+    return std::make_unique<X86Canonicalizer>(target_machine);
+  };
+
+  py::iterator line_iterator = py::iter(lines);
+  const CsvLineReader read_line = [&line_iterator](std::string& line) {
+    py::gil_scoped_acquire gil;
+    if (line_iterator == py::iterator::sentinel()) return false;
+    line = py::cast<std::string>(*line_iterator);
+    ++line_iterator;
+    return true;
+  };
+  BHiveCsvErrorHandler error_handler;
+  if (!handle_error.is_none()) {
+    error_handler = [&handle_error](int64_t line_number,
+                                    std::string_view line,
+                                    const absl::Status& status) {
+      py::gil_scoped_acquire gil;
+      handle_error(line_number, line, status.ToString());
+    };
+  }
+
+  py::gil_scoped_release no_gil;
+  return ImportBHiveCsv(options, canonicalizer_factory, read_line,
+                        consume_block, error_handler);
+}
+
+}  // namespace
+
 PYBIND11_MODULE(bhive_importer, m) {
   m.doc() = "Support code for importing data from the BHive data set format.";
 
   py::google::ImportStatusModule();
 
-  py::class_<BHiveImporter>(m, "BHiveImporter")
+  // The methods that parse or disassemble basic blocks release the GIL while
+  // they run. The arguments are converted and the results are converted back
+  // with the GIL held.
+  py::class_<BHiveImporter>(
+      m, "BHiveImporter",
+      R"(Converts basic blocks from BHive and MIR data to protos.
+
+      The methods that disassemble machine code, parse CSV lines or load MIR
+      files release the GIL while they run, so that multiple Python threads can
+      import data in parallel. A single BHiveImporter object must be used by at
+      most one thread at a time. Different BHiveImporter objects can be used
+      concurrently if and only if they were created with different
+      canonicalizers; the canonicalizer keeps a cache that is not thread-safe.)")
       .def(  //
           py::init<const Canonicalizer* /* canonicalizer */, const std::string&>(),
           py::arg("canonicalizer"),
@@ -55,6 +170,9 @@ PYBIND11_MODULE(bhive_importer, m) {
             llvm::ArrayRef<uint8_t> machine_code_bytes(
                 reinterpret_cast<const uint8_t*>(machine_code_view.data()),
                 machine_code_view.size());
+            // `machine_code` holds a reference to the bytes object, so the
+            // view remains valid without the GIL.
+            py::gil_scoped_release no_gil;
             return self.BasicBlockProtoFromMachineCode(machine_code_bytes,
                                                        base_address);
           },
@@ -80,6 +198,7 @@ PYBIND11_MODULE(bhive_importer, m) {
           "basic_block_proto_from_hex",
           &BHiveImporter::BasicBlockProtoFromMachineCodeHex,
           py::arg("machine_code_hex"), py::arg("base_address") = uint64_t{0},
+          py::call_guard<py::gil_scoped_release>(),
           R"(Creates a BasicBlockProto from machine code in hex string.
 
           Similar to `basic_block_proto_from_bytes` but the machine code is
@@ -108,6 +227,7 @@ PYBIND11_MODULE(bhive_importer, m) {
           py::arg("throughput_column_index"),
           py::arg("throughput_scaling") = 1.0,
           py::arg("base_address") = uint64_t{0},
+          py::call_guard<py::gil_scoped_release>(),
           R"(Creates a BasicBlockWithThroughputProto from a BHive CSV line.
 
           Takes a string in the format "{machine_code},{throughput}" where
@@ -138,20 +258,442 @@ PYBIND11_MODULE(bhive_importer, m) {
       .def(  //
         "LoadMIRModule",
         &BHiveImporter::LoadMIRModule, py::arg("file_name"),
+        py::call_guard<py::gil_scoped_release>(),
         R"(Load a mir module given a mir file
         )")
+      .def(  //
+          "LoadMIRModuleLazily", &BHiveImporter::LoadMIRModuleLazily,
+          py::arg("file_name"), py::call_guard<py::gil_scoped_release>(),
+          R"(Loads a MIR module, parsing the machine functions on demand.
+
+          Only one machine function is kept in memory at a time; it is parsed
+          when one of its basic blocks is requested and released when a basic
+          block of another function is requested. For best performance, the
+          CSV lines should be grouped by function.
+
+          Args:
+            file_name: The name of the MIR file.
+
+          Raises:
+            StatusNotOk: When the file can't be read or does not contain LLVM
+              IR.)")
+      .def(  //
+          "LoadMIRModuleWithCache", &BHiveImporter::LoadMIRModuleWithCache,
+          py::arg("file_name"), py::arg("live_info_file_name"),
+          py::arg("cache_dir"), py::call_guard<py::gil_scoped_release>(),
+          R"(Loads a MIR module, using an on-disk cache of its basic blocks.
+
+          The cache is stored in `cache_dir` and it is keyed by the contents of
+          the MIR file and of the live info file. When the cache exists, the
+          files are not parsed at all. Otherwise, loads the MIR module and the
+          live info file (for model types that use it), and writes the cache.
+
+          Args:
+            file_name: The name of the MIR file.
+            live_info_file_name: The name of the live info file. Ignored for
+              the NO_LIVE_INFO model type.
+            cache_dir: The directory that contains the cache files.
+
+          Returns:
+            True when the basic blocks were loaded from the cache.
+
+          Raises:
+            StatusNotOk: When loading the MIR module or the live info fails.)")
       .def(
         "ParseMIRCsvLine",
         &BHiveImporter::ParseMIRCsvLine,
         py::arg("source_name"), py::arg("line"),py::arg("BB_name_index"), py::arg("throughput_column_index"),
         py::arg("throughput_scaling") = 1.0, py::arg("base_address") = uint64_t{0},
+        py::call_guard<py::gil_scoped_release>(),
         R"(Creates a BasicBlockWithThroughputProto from a MIR CSV line.)"
+      ).def(
+        "ParseMIRCsvFile",
+        [](BHiveImporter& self, std::string_view csv_file_name,
+           std::string_view output_file_name, std::string source_name,
+           size_t BB_name_index, size_t throughput_column_index,
+           double throughput_scaling, double min_throughput,
+           double max_throughput, bool append, py::object report_progress,
+           int64_t progress_interval,
+           bool deduplicate_blocks) -> absl::StatusOr<MIRCsvImportStats> {
+          const MIRCsvImportOptions options = MakeMIRCsvImportOptions(
+              std::move(source_name), BB_name_index, throughput_column_index,
+              throughput_scaling, min_throughput, max_throughput,
+              report_progress, progress_interval, deduplicate_blocks);
+
+          // The import runs without the GIL; the progress callback
+          // re-acquires it.
+          py::gil_scoped_release no_gil;
+          absl::StatusOr<std::unique_ptr<TFRecordWriter>> writer =
+              TFRecordWriter::Open(output_file_name, append);
+          if (!writer.ok()) return writer.status();
+          absl::StatusOr<MIRCsvImportStats> stats =
+              self.ParseMIRCsvFile(csv_file_name, options, **writer);
+          if (!stats.ok()) return stats.status();
+          if (absl::Status status = (*writer)->Close(); !status.ok()) {
+            return status;
+          }
+          return stats;
+        },
+        py::arg("csv_file_name"), py::arg("output_file_name"),
+        py::arg("source_name"), py::arg("BB_name_index") = size_t{0},
+        py::arg("throughput_column_index") = size_t{1},
+        py::arg("throughput_scaling") = 1.0,
+        py::arg("min_throughput") = -std::numeric_limits<double>::infinity(),
+        py::arg("max_throughput") = std::numeric_limits<double>::infinity(),
+        py::arg("append") = false, py::arg("report_progress") = py::none(),
+        py::arg("progress_interval") = int64_t{1000},
+        py::arg("deduplicate_blocks") = false,
+        R"(Imports all basic blocks from a MIR CSV file to a .tfrecord file.
+
+        Parses the lines of the file as `ParseMIRCsvLine` does and writes the
+        serialized BasicBlockWithThroughputProtos to `output_file_name`. The
+        whole pipeline runs in C++ without the GIL. Lines that can't be parsed
+        are counted and skipped.
+
+        Args:
+          csv_file_name: The name of the CSV file.
+          output_file_name: The name of the local .tfrecord file to write to.
+          source_name: The name of the throughput source used in the output
+            protos.
+          BB_name_index: The index of the column in the CSV containing the
+            name of the basic block.
+          throughput_column_index: The index of the column in the CSV
+            containing the throughput in cycles.
+          throughput_scaling: An optional scaling applied to the throughputs.
+          min_throughput: Lines with a smaller throughput (before scaling) are
+            skipped.
+          max_throughput: Lines with a greater throughput (before scaling) are
+            skipped.
+          append: When True, the blocks are added to the records already in
+            `output_file_name`; otherwise, the file is overwritten.
+          report_progress: An optional callable called with a
+            MIRCsvImportStats object after every `progress_interval` lines and
+            at the end of the file.
+          progress_interval: The number of lines between progress reports.
+          deduplicate_blocks: When True, basic blocks with the same
+            canonicalized instructions are merged into a single proto that
+            contains the throughputs of all copies. The blocks are then written
+            only after the whole file was parsed.
+
+        Returns:
+          A MIRCsvImportStats object with the number of processed lines.
+
+        Raises:
+          StatusNotOk: When the CSV file can't be read or the output can't be
+            written.)"
+      ).def(
+        "ParseMIRCsvFile",
+        [](BHiveImporter& self, std::string_view csv_file_name,
+           ShardedTFRecordWriter& writer, std::string source_name,
+           size_t BB_name_index, size_t throughput_column_index,
+           double throughput_scaling, double min_throughput,
+           double max_throughput, py::object report_progress,
+           int64_t progress_interval,
+           bool deduplicate_blocks) -> absl::StatusOr<MIRCsvImportStats> {
+          const MIRCsvImportOptions options = MakeMIRCsvImportOptions(
+              std::move(source_name), BB_name_index, throughput_column_index,
+              throughput_scaling, min_throughput, max_throughput,
+              report_progress, progress_interval, deduplicate_blocks);
+          py::gil_scoped_release no_gil;
+          return self.ParseMIRCsvFile(csv_file_name, options, writer);
+        },
+        py::arg("csv_file_name"), py::arg("writer"), py::arg("source_name"),
+        py::arg("BB_name_index") = size_t{0},
+        py::arg("throughput_column_index") = size_t{1},
+        py::arg("throughput_scaling") = 1.0,
+        py::arg("min_throughput") = -std::numeric_limits<double>::infinity(),
+        py::arg("max_throughput") = std::numeric_limits<double>::infinity(),
+        py::arg("report_progress") = py::none(),
+        py::arg("progress_interval") = int64_t{1000},
+        py::arg("deduplicate_blocks") = false,
+        R"(Imports all basic blocks from a MIR CSV file to a sharded writer.
+
+        Same as the overload above, but writes the blocks to `writer`, a
+        `gematria.io.python.sharded_tfrecord_writer.ShardedTFRecordWriter`.
+        The writer is not closed, so that the blocks from multiple CSV files
+        can be written to the same output.)"
       ).def(
         "parse_interference_graph",
         &BHiveImporter::InteferenceGraphParser, py::arg("file_name"),
+        py::call_guard<py::gil_scoped_release>(),
         R"(Parse the interference graph from a file)"
       )
-      ;
+      .def_property_readonly(
+          "mir_import_stats",
+          [](const BHiveImporter& self) { return self.mir_import_stats(); },
+          R"(The statistics of the basic blocks imported from MIR files.
+
+          Returns a copy of the statistics collected since the importer was
+          created or since the last call to `ResetMIRImportStats`.)")
+      .def("ResetMIRImportStats", &BHiveImporter::ResetMIRImportStats,
+           R"(Resets the statistics returned by `mir_import_stats`.)");
+
+  py::class_<MIRImportStats>(m, "MIRImportStats")
+      .def_readonly("num_parsed_blocks", &MIRImportStats::num_parsed_blocks)
+      .def_readonly("num_cached_blocks", &MIRImportStats::num_cached_blocks)
+      .def_readonly("num_call_rejections",
+                    &MIRImportStats::num_call_rejections)
+      .def_readonly("num_unparsable_rejections",
+                    &MIRImportStats::num_unparsable_rejections)
+      .def_readonly("num_missing_mbb_rejections",
+                    &MIRImportStats::num_missing_mbb_rejections)
+      .def_readonly("num_interference_rejections",
+                    &MIRImportStats::num_interference_rejections)
+      .def_readonly("num_cached_rejections",
+                    &MIRImportStats::num_cached_rejections)
+      .def_readonly("num_interference_edges",
+                    &MIRImportStats::num_interference_edges)
+      .def_readonly("load_mir_nanos", &MIRImportStats::load_mir_nanos)
+      .def_readonly("parse_live_info_nanos",
+                    &MIRImportStats::parse_live_info_nanos)
+      .def_readonly("convert_blocks_nanos",
+                    &MIRImportStats::convert_blocks_nanos)
+      .def_readonly("interference_nanos", &MIRImportStats::interference_nanos);
+
+  py::class_<MIRCsvImportStats>(m, "MIRCsvImportStats")
+      .def_readonly("num_input_lines", &MIRCsvImportStats::num_input_lines)
+      .def_readonly("num_imported_blocks",
+                    &MIRCsvImportStats::num_imported_blocks)
+      .def_readonly("num_filtered_lines",
+                    &MIRCsvImportStats::num_filtered_lines)
+      .def_readonly("num_skipped_lines", &MIRCsvImportStats::num_skipped_lines)
+      .def_readonly("num_duplicate_blocks",
+                    &MIRCsvImportStats::num_duplicate_blocks);
+
+  py::class_<ParallelMIRImportStats>(m, "ParallelMIRImportStats")
+      .def_readonly("csv", &ParallelMIRImportStats::csv)
+      .def_readonly("mir", &ParallelMIRImportStats::mir)
+      .def_readonly("num_imported_files",
+                    &ParallelMIRImportStats::num_imported_files)
+      .def_readonly("num_skipped_files",
+                    &ParallelMIRImportStats::num_skipped_files);
+
+  m.def(
+      "import_mir_files",
+      [](const Canonicalizer& canonicalizer,
+         const std::vector<std::tuple<std::string, std::string, std::string>>&
+             inputs,
+         ShardedTFRecordWriter& writer, std::string model_type,
+         std::string source_name, size_t BB_name_index,
+         size_t throughput_column_index, double throughput_scaling,
+         double min_throughput, double max_throughput, int num_threads,
+         py::object report_progress, py::object handle_file_error,
+         bool deduplicate_blocks) -> absl::StatusOr<ParallelMIRImportStats> {
+        ParallelMIRImportOptions options;
+        options.csv_options = MakeMIRCsvImportOptions(
+            std::move(source_name), BB_name_index, throughput_column_index,
+            throughput_scaling, min_throughput, max_throughput,
+            report_progress, /*progress_interval=*/0, deduplicate_blocks);
+        options.model_type = std::move(model_type);
+        options.num_threads = num_threads;
+        std::vector<MIRImportInput> mir_inputs;
+        mir_inputs.reserve(inputs.size());
+        for (const auto& [mir_file, live_info_file, csv_file] : inputs) {
+          mir_inputs.push_back({mir_file, live_info_file, csv_file});
+        }
+        // As of 2023-05, we support only x86-64 so we can create the
+        // canonicalizers of the worker threads directly.
+        const llvm::TargetMachine* const target_machine =
+            &canonicalizer.target_machine();
+        const CanonicalizerFactory canonicalizer_factory =
+            [target_machine]() -> std::unique_ptr<Canonicalizer> {
+          return std::make_unique<X86Canonicalizer>(target_machine);
+        };
+        MIRImportErrorHandler error_handler;
+        if (!handle_file_error.is_none()) {
+          error_handler = [&handle_file_error](const MIRImportInput& input,
+                                               const absl::Status& status) {
+            py::gil_scoped_acquire gil;
+            handle_file_error(input.mir_file_name, status.ToString());
+          };
+        }
+        // The blocks are written without the GIL.
+        std::string serialized_block;
+        const BHiveBlockConsumer consume_block =
+            [&writer,
+             &serialized_block](BasicBlockWithThroughputProto block) {
+              block.SerializeToString(&serialized_block);
+              return writer.Write(serialized_block);
+            };
+        py::gil_scoped_release no_gil;
+        return ImportMIRFiles(mir_inputs, options, canonicalizer_factory,
+                              consume_block, error_handler);
+      },
+      py::arg("canonicalizer"), py::arg("inputs"), py::arg("writer"),
+      py::arg("model_type"), py::arg("source_name"),
+      py::arg("BB_name_index") = size_t{0},
+      py::arg("throughput_column_index") = size_t{1},
+      py::arg("throughput_scaling") = 1.0,
+      py::arg("min_throughput") = -std::numeric_limits<double>::infinity(),
+      py::arg("max_throughput") = std::numeric_limits<double>::infinity(),
+      py::arg("num_threads") = 0, py::arg("report_progress") = py::none(),
+      py::arg("handle_file_error") = py::none(),
+      py::arg("deduplicate_blocks") = false,
+      R"(Imports basic blocks from MIR files using multiple threads.
+
+      Each worker thread has its own LLVM context, MIR parser and
+      canonicalizer. The rows of each CSV file are routed to the worker that
+      owns the machine function of their basic block, and each worker parses
+      only the live info of its functions. Supports only x86-64.
+
+      Args:
+        canonicalizer: The canonicalizer whose target machine is used for the
+          worker threads.
+        inputs: A list of (mir_file, live_info_file, csv_file) tuples. The live
+          info file is ignored for the NO_LIVE_INFO model type.
+        writer: A
+          `gematria.io.python.sharded_tfrecord_writer.ShardedTFRecordWriter`
+          that receives the serialized BasicBlockWithThroughputProtos, in the
+          order of `inputs` and of the lines in the CSV files. The writer is not
+          closed.
+        model_type: The model type of the importers.
+        source_name: The name of the throughput source used in the output
+          protos.
+        BB_name_index: The index of the column with the basic block names.
+        throughput_column_index: The index of the column with the throughputs.
+        throughput_scaling: An optional scaling applied to the throughputs.
+        min_throughput: Lines with a smaller throughput are skipped.
+        max_throughput: Lines with a larger throughput are skipped.
+        num_threads: The number of worker threads. When zero or negative, uses
+          one thread per CPU.
+        report_progress: An optional callable called with a MIRCsvImportStats
+          object after each imported file.
+        handle_file_error: An optional callable called with the name of the MIR
+          file and the error message for each input that can't be loaded.
+        deduplicate_blocks: When True, basic blocks with the same
+          canonicalized instructions in any of the inputs are merged into a
+          single proto. The blocks are then written after all inputs are
+          imported.
+
+      Returns:
+        A ParallelMIRImportStats object.
+
+      Raises:
+        StatusNotOk: When the options are not valid or the blocks can't be
+          written.)");
+
+  py::class_<BHiveCsvImportStats>(m, "BHiveCsvImportStats")
+      .def_readonly("num_input_lines", &BHiveCsvImportStats::num_input_lines)
+      .def_readonly("num_imported_blocks",
+                    &BHiveCsvImportStats::num_imported_blocks)
+      .def_readonly("num_skipped_lines",
+                    &BHiveCsvImportStats::num_skipped_lines)
+      .def_readonly("num_duplicate_blocks",
+                    &BHiveCsvImportStats::num_duplicate_blocks);
+
+  m.def(
+      "import_bhive_csv",
+      [](const Canonicalizer& canonicalizer, py::iterable lines,
+         py::function consume_serialized_block, std::string source_name,
+         size_t machine_code_hex_column_index, size_t throughput_column_index,
+         double throughput_scaling, int num_threads, int shard_size,
+         bool preserve_order, py::object handle_error,
+         bool deduplicate_blocks) -> absl::StatusOr<BHiveCsvImportStats> {
+        const BHiveCsvImportOptions options = MakeBHiveCsvImportOptions(
+            std::move(source_name), machine_code_hex_column_index,
+            throughput_column_index, throughput_scaling, num_threads,
+            shard_size, preserve_order, deduplicate_blocks);
+        // The consumer is called without the GIL; it re-acquires it to call
+        // into Python.
+        const BHiveBlockConsumer consume_block =
+            [&consume_serialized_block](BasicBlockWithThroughputProto block) {
+              std::string serialized_block = block.SerializeAsString();
+              py::gil_scoped_acquire gil;
+              consume_serialized_block(py::bytes(serialized_block));
+              return absl::OkStatus();
+            };
+        return ImportBHiveCsvFromPython(canonicalizer, lines, options,
+                                        consume_block, handle_error);
+      },
+      py::arg("canonicalizer"), py::arg("lines"),
+      py::arg("consume_serialized_block"), py::arg("source_name"),
+      py::arg("machine_code_hex_column_index") = size_t{0},
+      py::arg("throughput_column_index") = size_t{1},
+      py::arg("throughput_scaling") = 1.0, py::arg("num_threads") = 0,
+      py::arg("shard_size") = 1000, py::arg("preserve_order") = true,
+      py::arg("handle_error") = py::none(),
+      py::arg("deduplicate_blocks") = false,
+      R"(Imports basic blocks from BHive CSV lines using multiple threads.
+
+      Parses the lines as `basic_block_with_throughput_proto_from_csv_line`
+      does, but processes them in shards on a pool of worker threads. Each
+      worker thread has its own disassembler and canonicalizer. Supports only
+      x86-64.
+
+      Args:
+        canonicalizer: The canonicalizer whose target machine is used for
+          disassembling the instructions.
+        lines: An iterable of CSV lines, e.g. an open text file.
+        consume_serialized_block: Called with each imported
+          BasicBlockWithThroughputProto serialized to `bytes`.
+        source_name: The name of the throughput source used in the output
+          protos.
+        machine_code_hex_column_index: The index of the column in the CSV
+          containing the machine code in hex format.
+        throughput_column_index: The index of the column in the CSV containing
+          the throughput in cycles.
+        throughput_scaling: An optional scaling applied to the throughputs.
+        num_threads: The number of worker threads. When zero or negative, uses
+          one thread per CPU.
+        shard_size: The number of lines processed by a worker thread at once.
+        preserve_order: When True, the blocks are passed to
+          `consume_serialized_block` in the order of `lines`. When False, they
+          are passed in the order in which they were parsed.
+        handle_error: An optional callable called with the zero-based index of
+          the line, the line, and the error message for each line that can't
+          be parsed.
+        deduplicate_blocks: When True, basic blocks with the same canonicalized
+          instructions are merged into a single proto that contains the
+          throughputs of all copies. The blocks are then passed to
+          `consume_serialized_block` only after all lines were parsed.
+
+      Returns:
+        A BHiveCsvImportStats object with the number of processed lines.
+
+      Raises:
+        StatusNotOk: When the options are not valid.)");
+
+  m.def(
+      "import_bhive_csv",
+      [](const Canonicalizer& canonicalizer, py::iterable lines,
+         ShardedTFRecordWriter& writer, std::string source_name,
+         size_t machine_code_hex_column_index, size_t throughput_column_index,
+         double throughput_scaling, int num_threads, int shard_size,
+         bool preserve_order, py::object handle_error,
+         bool deduplicate_blocks) -> absl::StatusOr<BHiveCsvImportStats> {
+        const BHiveCsvImportOptions options = MakeBHiveCsvImportOptions(
+            std::move(source_name), machine_code_hex_column_index,
+            throughput_column_index, throughput_scaling, num_threads,
+            shard_size, preserve_order, deduplicate_blocks);
+        // The blocks are written without the GIL.
+        std::string serialized_block;
+        const BHiveBlockConsumer consume_block =
+            [&writer,
+             &serialized_block](BasicBlockWithThroughputProto block) {
+              block.SerializeToString(&serialized_block);
+              return writer.Write(serialized_block);
+            };
+        return ImportBHiveCsvFromPython(canonicalizer, lines, options,
+                                        consume_block, handle_error);
+      },
+      py::arg("canonicalizer"), py::arg("lines"), py::arg("writer"),
+      py::arg("source_name"),
+      py::arg("machine_code_hex_column_index") = size_t{0},
+      py::arg("throughput_column_index") = size_t{1},
+      py::arg("throughput_scaling") = 1.0, py::arg("num_threads") = 0,
+      py::arg("shard_size") = 1000, py::arg("preserve_order") = true,
+      py::arg("handle_error") = py::none(),
+      py::arg("deduplicate_blocks") = false,
+      R"(Imports basic blocks from BHive CSV lines to a sharded writer.
+
+      Same as the overload above, but writes the serialized blocks directly to
+      `writer`, a
+      `gematria.io.python.sharded_tfrecord_writer.ShardedTFRecordWriter`,
+      without calling into Python. The writer is not closed.
+
+      Raises:
+        StatusNotOk: When the options are not valid or the blocks can't be
+          written.)");
 }
 
 }  // namespace gematria
@@ -246,6 +246,53 @@ class BhiveImporterTest(absltest.TestCase):
         ),
     )
 
+  def test_x86_import_bhive_csv(self):
+    source_name = "test: made-up"
+    lines = [
+        "4829d38b44246c8b54246848c1fb034829d04839c3,10\n",
+        "90,5\n",
+        "invalid,1\n",
+        "4929d2,7\n",
+    ] * 10
+    serialized_blocks = []
+    errors = []
+    stats = bhive_importer.import_bhive_csv(
+        canonicalizer=self._x86_canonicalizer,
+        lines=lines,
+        consume_serialized_block=serialized_blocks.append,
+        source_name=source_name,
+        throughput_scaling=2.0,
+        num_threads=3,
+        shard_size=4,
+        handle_error=lambda line_number, line, error: errors.append(
+            line_number
+        ),
+    )
+    self.assertEqual(stats.num_input_lines, len(lines))
+    self.assertEqual(stats.num_imported_blocks, 30)
+    self.assertEqual(stats.num_skipped_lines, 10)
+    self.assertEqual(errors, list(range(2, len(lines), 4)))
+
+    importer = bhive_importer.BHiveImporter(self._x86_canonicalizer)
+    expected_blocks = [
+        importer.basic_block_with_throughput_proto_from_csv_line(
+            source_name=source_name,
+            line=line,
+            machine_code_hex_column_index=0,
+            throughput_column_index=1,
+            throughput_scaling=2.0,
+        )
+        for line in lines
+        if not line.startswith("invalid")
+    ]
+    self.assertEqual(
+        [
+            throughput_pb2.BasicBlockWithThroughputProto.FromString(block)
+            for block in serialized_blocks
+        ],
+        expected_blocks,
+    )
+
 
 if __name__ == "__main__":
   absltest.main()
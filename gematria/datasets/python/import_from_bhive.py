@@ -30,6 +30,7 @@ from absl import app
 from absl import flags
 from absl import logging
 from gematria.datasets.python import bhive_importer
+from gematria.io.python import sharded_tfrecord_writer
 from gematria.llvm.python import canonicalizer
 from gematria.llvm.python import llvm_architecture_support
 from pybind11_abseil import status
@@ -76,6 +77,56 @@ _THROUGHPUT_COLUMN_INDEX = flags.DEFINE_integer(
     '1',
     'The index of the throughput value column in the input CSV file.',
 )
+_NUM_THREADS = flags.DEFINE_integer(
+    'gematria_num_threads',
+    0,
+    'The number of threads used for parsing the basic blocks. When zero, uses'
+    ' one thread per CPU.',
+)
+_PRESERVE_ORDER = flags.DEFINE_bool(
+    'gematria_preserve_order',
+    True,
+    'When true, the basic blocks are written to the output in the order in'
+    ' which they appear in the input. When false, they are written in the order'
+    ' in which they are parsed, which may be faster.',
+)
+_DEDUPLICATE_BLOCKS = flags.DEFINE_bool(
+    'gematria_deduplicate_blocks',
+    False,
+    'When true, basic blocks with the same canonicalized instructions are'
+    ' merged into a single proto that contains the throughputs of all copies'
+    ' and the number of merged duplicates.',
+)
+_NATIVE_WRITER = flags.DEFINE_bool(
+    'gematria_native_writer',
+    True,
+    'Write the output .tfrecord files in C++, without going through Python.'
+    ' The output must be a local file; use --nogematria_native_writer to'
+    ' write to other file systems supported by tf.io.',
+)
+_NUM_OUTPUT_SHARDS = flags.DEFINE_integer(
+    'gematria_num_output_shards',
+    1,
+    'The number of output shards. When greater than one, the output files are'
+    ' named {gematria_output_tfrecord}-SSSSS-of-NNNNN. Requires'
+    ' --gematria_native_writer.',
+)
+_OUTPUT_COMPRESSION = flags.DEFINE_enum(
+    'gematria_output_compression',
+    'NONE',
+    ['NONE', 'GZIP', 'ZLIB', 'ZSTD'],
+    'The compression of the output files. GZIP and ZLIB files can be read by'
+    ' tf.data with the same compression type; ZSTD files must be decompressed'
+    ' first. Requires --gematria_native_writer.',
+)
+_MAX_OUTPUT_FILE_SIZE = flags.DEFINE_integer(
+    'gematria_max_output_file_size',
+    0,
+    'The maximal size of an output file in bytes, before compression. When'
+    ' set, each shard rolls over to a new file before it exceeds the size.'
+    ' When zero, each shard is written to a single file. Requires'
+    ' --gematria_native_writer.',
+)
 
 
 @flags.multi_flags_validator(
@@ -92,6 +143,26 @@ def _validate_input_columns(flags_dict):
   )
 
 
+@flags.multi_flags_validator(
+    [
+        _NATIVE_WRITER.name,
+        _NUM_OUTPUT_SHARDS.name,
+        _OUTPUT_COMPRESSION.name,
+        _MAX_OUTPUT_FILE_SIZE.name,
+    ],
+    message=(
+        'Sharded, compressed or size-limited output requires'
+        ' --gematria_native_writer'
+    ),
+)
+def _validate_output_options(flags_dict):
+  return flags_dict[_NATIVE_WRITER.name] or (
+      flags_dict[_NUM_OUTPUT_SHARDS.name] == 1
+      and flags_dict[_OUTPUT_COMPRESSION.name] == 'NONE'
+      and flags_dict[_MAX_OUTPUT_FILE_SIZE.name] == 0
+  )
+
+
 def main(argv: Sequence[str]) -> None:
   if len(argv) > 1:
     raise app.UsageError('Too many command-line arguments.')
@@ -109,36 +180,59 @@ def main(argv: Sequence[str]) -> None:
   # LLVM triple. As of 2023-05, this is OK, because we support only x86-64
   # anyway.
   canonicalizer_obj = canonicalizer.Canonicalizer.x86_64(llvm)
-  importer = bhive_importer.BHiveImporter(canonicalizer_obj)
 
+  if _NATIVE_WRITER.value:
+    output_writer = sharded_tfrecord_writer.ShardedTFRecordWriter.open(
+        _OUTPUT_TFRECORD_FILE.value,
+        num_shards=_NUM_OUTPUT_SHARDS.value,
+        compression=_OUTPUT_COMPRESSION.value,
+        max_file_size=_MAX_OUTPUT_FILE_SIZE.value,
+    )
+  else:
+    output_writer = tf.io.TFRecordWriter(_OUTPUT_TFRECORD_FILE.value)
   with (
       tf.io.gfile.GFile(_INPUT_CSV_FILE.value, 'r') as bhive_csv_file,
-      tf.io.TFRecordWriter(_OUTPUT_TFRECORD_FILE.value) as writer,
+      output_writer as writer,
   ):
-    num_input_blocks = 0
-    num_skipped_blocks = 0
-    for line in bhive_csv_file:
-      if num_input_blocks % 1000 == 0:
-        logging.info(
-            'Processed %d blocks, skipped %d.',
-            num_input_blocks,
-            num_skipped_blocks,
-        )
-      num_input_blocks += 1
-      try:
-        block_proto = importer.basic_block_with_throughput_proto_from_csv_line(
-            source_name=_SOURCE_NAME.value,
-            line=line,
-            machine_code_hex_column_index=_MACHINE_CODE_HEX_COLUMN_INDEX.value,
-            throughput_column_index=_THROUGHPUT_COLUMN_INDEX.value,
-            throughput_scaling=_THROUGHPUT_SCALING.value,
-        )
-      except status.StatusNotOk:
-        logging.exception('Could not process line "%s"', line)
-        num_skipped_blocks += 1
-        continue
-
-      writer.write(block_proto.SerializeToString())
+    num_written_blocks = 0
+
+    def write_block(serialized_block: bytes) -> None:
+      nonlocal num_written_blocks
+      writer.write(serialized_block)
+      num_written_blocks += 1
+      if num_written_blocks % 1000 == 0:
+        logging.info('Written %d blocks.', num_written_blocks)
+
+    def log_error(line_number: int, line: str, error: str) -> None:
+      logging.error(
+          'Could not process line %d "%s": %s', line_number, line, error
+      )
+
+    # The native writer is passed to the importer directly, so that the blocks
+    # do not go through Python.
+    if _NATIVE_WRITER.value:
+      output = {'writer': writer}
+    else:
+      output = {'consume_serialized_block': write_block}
+    stats = bhive_importer.import_bhive_csv(
+        canonicalizer=canonicalizer_obj,
+        lines=bhive_csv_file,
+        source_name=_SOURCE_NAME.value,
+        machine_code_hex_column_index=_MACHINE_CODE_HEX_COLUMN_INDEX.value,
+        throughput_column_index=_THROUGHPUT_COLUMN_INDEX.value,
+        throughput_scaling=_THROUGHPUT_SCALING.value,
+        num_threads=_NUM_THREADS.value,
+        preserve_order=_PRESERVE_ORDER.value,
+        handle_error=log_error,
+        deduplicate_blocks=_DEDUPLICATE_BLOCKS.value,
+        **output,
+    )
+    logging.info(
+        'Processed %d blocks, skipped %d, merged %d duplicates.',
+        stats.num_input_lines,
+        stats.num_skipped_lines,
+        stats.num_duplicate_blocks,
+    )
 
 
 if __name__ == '__main__':
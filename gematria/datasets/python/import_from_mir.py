@@ -30,6 +30,7 @@ from absl import app
 from absl import flags
 from absl import logging
 from gematria.datasets.python import bhive_importer
+from gematria.io.python import sharded_tfrecord_writer
 from gematria.llvm.python import canonicalizer
 from gematria.llvm.python import llvm_architecture_support
 from pybind11_abseil import status
@@ -79,6 +80,66 @@ _LLVM_TRIPLE = flags.DEFINE_string(
     'x86_64',
     'The LLVM triple used for disassembling the instructions in the data set.',
 )
+_MIR_CACHE_DIR = flags.DEFINE_string(
+    'gematria_mir_cache_dir',
+    None,
+    'The directory used for caching the basic blocks extracted from the MIR'
+    ' files. When set, repeated imports of the same MIR and live info files'
+    ' do not parse them again.',
+)
+_LAZY_MIR_LOADING = flags.DEFINE_bool(
+    'gematria_lazy_mir_loading',
+    False,
+    'Parse the machine functions in the MIR files only when the CSV lines'
+    ' reference them. Reduces the peak memory use for large MIR files.',
+)
+_NATIVE_IMPORT = flags.DEFINE_bool(
+    'gematria_native_import',
+    True,
+    'Parse the CSV files and write the output .tfrecord file in C++. The'
+    ' output file must be a local file; use --nogematria_native_import to'
+    ' write to other file systems supported by tf.io.',
+)
+_DEDUPLICATE_BLOCKS = flags.DEFINE_bool(
+    'gematria_deduplicate_blocks',
+    False,
+    'When true, basic blocks from the same CSV file that have the same'
+    ' canonicalized instructions are merged into a single proto that contains'
+    ' the throughputs of all copies. Requires --gematria_native_import.',
+)
+_NUM_IMPORT_THREADS = flags.DEFINE_integer(
+    'gematria_num_import_threads',
+    1,
+    'The number of threads used for importing the MIR files. When not one,'
+    ' the files are imported by a native multi-threaded importer where each'
+    ' thread has its own LLVM context and MIR parser; zero or less uses one'
+    ' thread per CPU. Requires --gematria_native_import and does not support'
+    ' --gematria_mir_cache_dir. With --gematria_deduplicate_blocks, the'
+    ' blocks are deduplicated across all CSV files.',
+)
+_NUM_OUTPUT_SHARDS = flags.DEFINE_integer(
+    'gematria_num_output_shards',
+    1,
+    'The number of output shards. When greater than one, the output files are'
+    ' named {gematria_output_tfrecord}-SSSSS-of-NNNNN. Requires'
+    ' --gematria_native_import.',
+)
+_OUTPUT_COMPRESSION = flags.DEFINE_enum(
+    'gematria_output_compression',
+    'NONE',
+    ['NONE', 'GZIP', 'ZLIB', 'ZSTD'],
+    'The compression of the output files. GZIP and ZLIB files can be read by'
+    ' tf.data with the same compression type; ZSTD files must be decompressed'
+    ' first. Requires --gematria_native_import.',
+)
+_MAX_OUTPUT_FILE_SIZE = flags.DEFINE_integer(
+    'gematria_max_output_file_size',
+    0,
+    'The maximal size of an output file in bytes, before compression. When'
+    ' set, each shard rolls over to a new file before it exceeds the size.'
+    ' When zero, each shard is written to a single file. Requires'
+    ' --gematria_native_import.',
+)
 _MACHINE_BASIC_BLOCK_NAME_COLUMN_INDEX = flags.DEFINE_integer(
     'machine_basic_block_name_column_index',
     '0',
@@ -110,6 +171,50 @@ def _validate_input_columns(flags_dict):
   )
 
 
+@flags.multi_flags_validator(
+    [_DEDUPLICATE_BLOCKS.name, _NATIVE_IMPORT.name],
+    message='--gematria_deduplicate_blocks requires --gematria_native_import',
+)
+def _validate_deduplication(flags_dict):
+  return (
+      not flags_dict[_DEDUPLICATE_BLOCKS.name]
+      or flags_dict[_NATIVE_IMPORT.name]
+  )
+
+
+@flags.multi_flags_validator(
+    [
+        _NATIVE_IMPORT.name,
+        _NUM_OUTPUT_SHARDS.name,
+        _OUTPUT_COMPRESSION.name,
+        _MAX_OUTPUT_FILE_SIZE.name,
+    ],
+    message=(
+        'Sharded, compressed or size-limited output requires'
+        ' --gematria_native_import'
+    ),
+)
+def _validate_output_options(flags_dict):
+  return flags_dict[_NATIVE_IMPORT.name] or (
+      flags_dict[_NUM_OUTPUT_SHARDS.name] == 1
+      and flags_dict[_OUTPUT_COMPRESSION.name] == 'NONE'
+      and flags_dict[_MAX_OUTPUT_FILE_SIZE.name] == 0
+  )
+
+
+@flags.multi_flags_validator(
+    [_NUM_IMPORT_THREADS.name, _NATIVE_IMPORT.name, _MIR_CACHE_DIR.name],
+    message=(
+        '--gematria_num_import_threads requires --gematria_native_import and'
+        ' does not support --gematria_mir_cache_dir'
+    ),
+)
+def _validate_import_threads(flags_dict):
+  return flags_dict[_NUM_IMPORT_THREADS.name] == 1 or (
+      flags_dict[_NATIVE_IMPORT.name] and not flags_dict[_MIR_CACHE_DIR.name]
+  )
+
+
 import os
 from gematria.datasets.python import bhive_importer
 from gematria.llvm.python import canonicalizer
@@ -117,10 +222,96 @@ from gematria.llvm.python import llvm_architecture_support
 from pybind11_abseil import status
 import tensorflow as tf
 
+# Blocks whose throughput (before scaling) is outside of this interval are not
+# imported.
+_MIN_THROUGHPUT = 0.1
+_MAX_THROUGHPUT = 10.0
+
+
 def is_mode_interference_graph(model_type):
     return model_type == "PER_BB_LIVE_INFO" or model_type == "PER_FUNC_LIVE_INFO"
 
 
+def _log_mir_import_stats(stats) -> None:
+  logging.info(
+      'Converted %d blocks from MIR and read %d from caches. Rejected: %d'
+      ' with calls, %d unparsable, %d missing, %d without interference'
+      ' graph, %d cached errors. Added %d interference edges.',
+      stats.num_parsed_blocks,
+      stats.num_cached_blocks,
+      stats.num_call_rejections,
+      stats.num_unparsable_rejections,
+      stats.num_missing_mbb_rejections,
+      stats.num_interference_rejections,
+      stats.num_cached_rejections,
+      stats.num_interference_edges,
+  )
+  logging.info(
+      'Time: loading MIR %.3fs, parsing live info %.3fs, converting blocks'
+      ' %.3fs, interference graphs %.3fs.',
+      stats.load_mir_nanos / 1e9,
+      stats.parse_live_info_nanos / 1e9,
+      stats.convert_blocks_nanos / 1e9,
+      stats.interference_nanos / 1e9,
+  )
+
+
+def _import_in_parallel(canonicalizer_obj) -> None:
+  """Imports all MIR files using the native multi-threaded importer."""
+  input_dirs = [_INPUT_DIR.value]
+  if _INPUT_DIR2.value:
+    input_dirs.append(_INPUT_DIR2.value)
+  inputs = []
+  for input_dir in input_dirs:
+    for filename in os.listdir(input_dir):
+      if filename.endswith('.mir'):
+        inputs.append((
+            os.path.join(input_dir, filename),
+            os.path.join(input_dir, filename + '.liveinfo'),
+            os.path.join(input_dir, filename.replace('.mir', '.perf')),
+        ))
+
+  def handle_file_error(mir_file, error):
+    logging.error('Could not load file "%s": %s', mir_file, error)
+
+  with sharded_tfrecord_writer.ShardedTFRecordWriter.open(
+      _OUTPUT_TFRECORD_FILE.value,
+      num_shards=_NUM_OUTPUT_SHARDS.value,
+      compression=_OUTPUT_COMPRESSION.value,
+      max_file_size=_MAX_OUTPUT_FILE_SIZE.value,
+  ) as writer:
+    stats = bhive_importer.import_mir_files(
+        canonicalizer=canonicalizer_obj,
+        inputs=inputs,
+        writer=writer,
+        model_type=_MODEL_TYPE.value,
+        source_name=_SOURCE_NAME.value,
+        BB_name_index=_MACHINE_BASIC_BLOCK_NAME_COLUMN_INDEX.value,
+        throughput_column_index=_THROUGHPUT_COLUMN_INDEX.value,
+        throughput_scaling=_THROUGHPUT_SCALING.value,
+        min_throughput=_MIN_THROUGHPUT,
+        max_throughput=_MAX_THROUGHPUT,
+        num_threads=_NUM_IMPORT_THREADS.value,
+        handle_file_error=handle_file_error,
+        deduplicate_blocks=_DEDUPLICATE_BLOCKS.value,
+    )
+  logging.info(
+      'Processed %d files, skipped %d.',
+      stats.num_imported_files,
+      stats.num_skipped_files,
+  )
+  logging.info(
+      'Imported %d blocks from %d lines, filtered %d, skipped %d, merged %d'
+      ' duplicates.',
+      stats.csv.num_imported_blocks,
+      stats.csv.num_input_lines,
+      stats.csv.num_filtered_lines,
+      stats.csv.num_skipped_lines,
+      stats.csv.num_duplicate_blocks,
+  )
+  _log_mir_import_stats(stats.mir)
+
+
 def main(argv: Sequence[str]) -> None:
   if len(argv) > 1:
     raise app.UsageError('Too many command-line arguments.')
@@ -138,15 +329,27 @@ def main(argv: Sequence[str]) -> None:
   # LLVM triple. As of 2023-05, this is OK, because we support only x86-64
   # anyway.
   canonicalizer_obj = canonicalizer.Canonicalizer.x86_64(llvm)
+  if _NUM_IMPORT_THREADS.value != 1:
+    _import_in_parallel(canonicalizer_obj)
+    return
   if is_mode_interference_graph(_MODEL_TYPE.value):
     logging.info('Creating BHiveImporter with interference graph %s', _MODEL_TYPE.value)
     importer = bhive_importer.BHiveImporter(canonicalizer_obj, _MODEL_TYPE.value)
   else:
     importer = bhive_importer.BHiveImporter(canonicalizer_obj)
   
-  with (
-     tf.io.TFRecordWriter(_OUTPUT_TFRECORD_FILE.value) as writer,
-  ):
+  # The native importer writes the output files directly from C++; all CSV
+  # files are written through the same sharded writer.
+  if _NATIVE_IMPORT.value:
+    output_writer = sharded_tfrecord_writer.ShardedTFRecordWriter.open(
+        _OUTPUT_TFRECORD_FILE.value,
+        num_shards=_NUM_OUTPUT_SHARDS.value,
+        compression=_OUTPUT_COMPRESSION.value,
+        max_file_size=_MAX_OUTPUT_FILE_SIZE.value,
+    )
+  else:
+    output_writer = tf.io.TFRecordWriter(_OUTPUT_TFRECORD_FILE.value)
+  with output_writer as writer:
     num_input_blocks = 0
     num_input_files = 0
     num_skipped_blocks = 0
@@ -170,11 +373,45 @@ def main(argv: Sequence[str]) -> None:
                 try:
                     # load the MIR file
                     logging.info('Procssing %s file', mir_file)
-                    importer.LoadMIRModule(mir_file)
-                    logging.info('Loading live info %s file', liveinfo_file)
-                    # if is interference graph, then we need to load the liveinfo file
-                    importer.parse_interference_graph(liveinfo_file)
+                    if _MIR_CACHE_DIR.value:
+                        importer.LoadMIRModuleWithCache(
+                            mir_file, liveinfo_file, _MIR_CACHE_DIR.value
+                        )
+                    else:
+                        if _LAZY_MIR_LOADING.value:
+                            importer.LoadMIRModuleLazily(mir_file)
+                        else:
+                            importer.LoadMIRModule(mir_file)
+                        logging.info('Loading live info %s file', liveinfo_file)
+                        # if is interference graph, then we need to load the liveinfo file
+                        importer.parse_interference_graph(liveinfo_file)
                     num_input_files += 1
+                    if _NATIVE_IMPORT.value:
+                        stats = importer.ParseMIRCsvFile(
+                            csv_file_name=perf_file,
+                            writer=writer,
+                            source_name=_SOURCE_NAME.value,
+                            BB_name_index=_MACHINE_BASIC_BLOCK_NAME_COLUMN_INDEX.value,
+                            throughput_column_index=_THROUGHPUT_COLUMN_INDEX.value,
+                            throughput_scaling=_THROUGHPUT_SCALING.value,
+                            min_throughput=_MIN_THROUGHPUT,
+                            max_throughput=_MAX_THROUGHPUT,
+                            deduplicate_blocks=_DEDUPLICATE_BLOCKS.value,
+                        )
+                        num_input_blocks += stats.num_input_lines
+                        num_skipped_blocks += (
+                            stats.num_filtered_lines + stats.num_skipped_lines
+                        )
+                        logging.info(
+                            'Imported %d blocks from %s, filtered %d, skipped %d,'
+                            ' merged %d duplicates.',
+                            stats.num_imported_blocks,
+                            perf_file,
+                            stats.num_filtered_lines,
+                            stats.num_skipped_lines,
+                            stats.num_duplicate_blocks,
+                        )
+                        continue
                     # iterate over each line in the corresponding .perf file
                     with tf.io.gfile.GFile(perf_file, 'r') as bhive_csv_file:
                         for line in bhive_csv_file:
@@ -190,7 +427,7 @@ def main(argv: Sequence[str]) -> None:
                                 BB_name = line.split(",")[_MACHINE_BASIC_BLOCK_NAME_COLUMN_INDEX.value]
                                 through_put = line.split(",")[_THROUGHPUT_COLUMN_INDEX.value]
                                 # skip blocks with throughput -1
-                                if float(through_put) == -1 or float(through_put) < 0.1 or float(through_put) > 10:
+                                if float(through_put) == -1 or float(through_put) < _MIN_THROUGHPUT or float(through_put) > _MAX_THROUGHPUT:
                                     num_skipped_blocks += 1
                                     continue
                                 block_proto = importer.ParseMIRCsvLine(
@@ -216,6 +453,7 @@ def main(argv: Sequence[str]) -> None:
         num_input_blocks,
         num_skipped_blocks,
     )
+    _log_mir_import_stats(importer.mir_import_stats)
 
 
 if __name__ == '__main__':
@@ -15,6 +15,8 @@
 #ifndef GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_CONFIGURATION_H_
 #define GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_CONFIGURATION_H_
 
+#include <cstddef>
+
 namespace gematria {
 
 inline constexpr bool kBalanceFlushingTime =
@@ -24,6 +26,35 @@ inline constexpr bool kBalanceFlushingTime =
     false;
 #endif  // GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_BALANCE_FLUSHING_TIME
 
+// The configuration of the multi-threaded benchmarks in multi_threaded_test.cc.
+
+// The largest number of threads used by the multi-threaded benchmarks. The
+// benchmarks run with 1, 2, 4, ... threads up to this number.
+inline constexpr int kMaxNumThreads = 8;
+
+// The distance in bytes between the per-thread counters in the benchmarks that
+// avoid false sharing. Must be at least the size of a cache line; two lines
+// also defeat the adjacent line prefetcher.
+inline constexpr std::size_t kFalseSharingPadding = 128;
+
+// In the read-mostly benchmarks, one thread writes to the shared data once
+// every kReadMostlyWritePeriod passes over the data; the other threads only
+// read it.
+inline constexpr int kReadMostlyWritePeriod = 16;
+
+// The strides in bytes used by the strided access benchmarks. Strides of a
+// page and more defeat the stream prefetchers, which do not cross page
+// boundaries; a page plus a cache line also spreads the accesses over all
+// cache sets.
+inline constexpr std::size_t kStrides[] = {64, 128, 256, 4096, 4096 + 64};
+
+// The NUMA nodes used by the cross-socket benchmarks. The threads run on
+// kNumaThreadNode, and the data is placed on kNumaThreadNode (local) or on
+// kNumaRemoteNode (remote). The benchmarks are skipped when the machine does
+// not have both nodes.
+inline constexpr int kNumaThreadNode = 0;
+inline constexpr int kNumaRemoteNode = 1;
+
 }  // namespace gematria
 
 #endif  // GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_CONFIGURATION_H_
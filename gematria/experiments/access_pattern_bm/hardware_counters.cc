@@ -0,0 +1,323 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/experiments/access_pattern_bm/hardware_counters.h"
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "gematria/proto/throughput.pb.h"
+
+#ifdef GEMATRIA_HAVE_PFM
+#include "perfmon/pfmlib.h"
+#include "perfmon/pfmlib_perf_event.h"
+#endif  // GEMATRIA_HAVE_PFM
+
+namespace gematria {
+namespace {
+
+constexpr uint64_t CacheEvent(uint64_t cache, uint64_t op, uint64_t result) {
+  return cache | (op << 8) | (result << 16);
+}
+
+// Sets `attr` to the generic perf event for `counter`. Returns false when
+// there is no generic event for the counter.
+bool GetGenericEvent(HardwareCounter counter, perf_event_attr& attr) {
+  switch (counter) {
+    case HardwareCounter::kCycles:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_CPU_CYCLES;
+      return true;
+    case HardwareCounter::kInstructions:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+      return true;
+    case HardwareCounter::kL1DataLoads:
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.config =
+          CacheEvent(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+                     PERF_COUNT_HW_CACHE_RESULT_ACCESS);
+      return true;
+    case HardwareCounter::kL1DataLoadMisses:
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.config =
+          CacheEvent(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+                     PERF_COUNT_HW_CACHE_RESULT_MISS);
+      return true;
+    case HardwareCounter::kLlcLoads:
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.config =
+          CacheEvent(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ,
+                     PERF_COUNT_HW_CACHE_RESULT_ACCESS);
+      return true;
+    case HardwareCounter::kLlcLoadMisses:
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.config =
+          CacheEvent(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ,
+                     PERF_COUNT_HW_CACHE_RESULT_MISS);
+      return true;
+    case HardwareCounter::kBranches:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_BRANCH_INSTRUCTIONS;
+      return true;
+    case HardwareCounter::kBranchMisses:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+      return true;
+    case HardwareCounter::kL2Requests:
+    case HardwareCounter::kL2Misses:
+      return false;
+  }
+  return false;
+}
+
+// Sets `attr` to the event described by `event_name`, a raw perf event
+// "r<hex config>" or a libpfm4 event name.
+absl::Status ParseEventName(const std::string& event_name,
+                            perf_event_attr& attr) {
+  if (event_name.size() > 1 && event_name[0] == 'r') {
+    char* end = nullptr;
+    const uint64_t config = std::strtoull(event_name.c_str() + 1, &end, 16);
+    if (*end == '\0') {
+      attr.type = PERF_TYPE_RAW;
+      attr.config = config;
+      return absl::OkStatus();
+    }
+  }
+#ifdef GEMATRIA_HAVE_PFM
+  static const int pfm_status = pfm_initialize();
+  if (pfm_status != PFM_SUCCESS) {
+    return absl::InternalError(absl::StrCat("Could not initialize libpfm4: ",
+                                            pfm_strerror(pfm_status)));
+  }
+  perf_event_attr pfm_attr;
+  std::memset(&pfm_attr, 0, sizeof(pfm_attr));
+  pfm_perf_encode_arg_t arg;
+  std::memset(&arg, 0, sizeof(arg));
+  arg.attr = &pfm_attr;
+  arg.size = sizeof(arg);
+  const int status = pfm_get_os_event_encoding(
+      event_name.c_str(), PFM_PLM3, PFM_OS_PERF_EVENT, &arg);
+  if (status == PFM_SUCCESS) {
+    attr.type = pfm_attr.type;
+    attr.config = pfm_attr.config;
+    attr.config1 = pfm_attr.config1;
+    attr.config2 = pfm_attr.config2;
+    return absl::OkStatus();
+  }
+  return absl::InvalidArgumentError(absl::StrCat(
+      "Unknown event ", event_name, ": ", pfm_strerror(status)));
+#else
+  return absl::InvalidArgumentError(
+      absl::StrCat("Unknown event ", event_name,
+                   "; event names other than r<hex config> need libpfm4"));
+#endif  // GEMATRIA_HAVE_PFM
+}
+
+int OpenPerfEvent(perf_event_attr& attr, bool include_kernel) {
+  attr.size = sizeof(attr);
+  attr.disabled = 0;
+  attr.exclude_kernel = include_kernel ? 0 : 1;
+  attr.exclude_hv = 1;
+  attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return static_cast<int>(syscall(SYS_perf_event_open, &attr, /*pid=*/0,
+                                  /*cpu=*/-1, /*group_fd=*/-1, /*flags=*/0));
+}
+
+void AddValue(const std::optional<double>& value,
+              google::protobuf::RepeatedField<double>* field) {
+  if (value.has_value()) field->Add(*value);
+}
+
+}  // namespace
+
+std::string_view HardwareCounterName(HardwareCounter counter) {
+  switch (counter) {
+    case HardwareCounter::kCycles:
+      return "cycles";
+    case HardwareCounter::kInstructions:
+      return "instructions";
+    case HardwareCounter::kL1DataLoads:
+      return "l1d_loads";
+    case HardwareCounter::kL1DataLoadMisses:
+      return "l1d_load_misses";
+    case HardwareCounter::kL2Requests:
+      return "l2_requests";
+    case HardwareCounter::kL2Misses:
+      return "l2_misses";
+    case HardwareCounter::kLlcLoads:
+      return "llc_loads";
+    case HardwareCounter::kLlcLoadMisses:
+      return "llc_load_misses";
+    case HardwareCounter::kBranches:
+      return "branches";
+    case HardwareCounter::kBranchMisses:
+      return "branch_misses";
+  }
+  return "unknown";
+}
+
+HardwareCounterValues HardwareCounterValues::Difference(
+    const HardwareCounterValues& end, const HardwareCounterValues& start) {
+  HardwareCounterValues difference;
+  for (int i = 0; i < kNumHardwareCounters; ++i) {
+    if (end.values_[i].has_value() && start.values_[i].has_value()) {
+      difference.values_[i] = *end.values_[i] - *start.values_[i];
+    }
+  }
+  return difference;
+}
+
+HardwareCounterSet::HardwareCounterSet() { file_descriptors_.fill(-1); }
+
+HardwareCounterSet::~HardwareCounterSet() {
+  for (const int fd : file_descriptors_) {
+    if (fd >= 0) close(fd);
+  }
+}
+
+absl::StatusOr<std::unique_ptr<HardwareCounterSet>> HardwareCounterSet::Create(
+    const Options& options) {
+  std::unique_ptr<HardwareCounterSet> counters(new HardwareCounterSet());
+  bool has_available_counter = false;
+  for (int i = 0; i < kNumHardwareCounters; ++i) {
+    const auto counter = static_cast<HardwareCounter>(i);
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    if (counter == HardwareCounter::kL2Requests ||
+        counter == HardwareCounter::kL2Misses) {
+      const std::string& event_name = counter == HardwareCounter::kL2Requests
+                                          ? options.l2_requests_event
+                                          : options.l2_misses_event;
+      if (event_name.empty()) continue;
+      if (absl::Status status = ParseEventName(event_name, attr);
+          !status.ok()) {
+        return status;
+      }
+    } else if (!GetGenericEvent(counter, attr)) {
+      continue;
+    }
+    // Counters that can't be opened, e.g. because the machine does not have
+    // the corresponding event, are left unavailable.
+    counters->file_descriptors_[i] =
+        OpenPerfEvent(attr, options.include_kernel);
+    has_available_counter |= counters->file_descriptors_[i] >= 0;
+  }
+  if (!has_available_counter) {
+    return absl::UnavailableError(
+        "Could not open any hardware counter; perf events may be disabled"
+        " or not supported on this machine");
+  }
+  return counters;
+}
+
+HardwareCounterValues HardwareCounterSet::Read() const {
+  HardwareCounterValues values;
+  for (int i = 0; i < kNumHardwareCounters; ++i) {
+    const int fd = file_descriptors_[i];
+    if (fd < 0) continue;
+    struct {
+      uint64_t value;
+      uint64_t time_enabled;
+      uint64_t time_running;
+    } data;
+    if (read(fd, &data, sizeof(data)) != sizeof(data)) continue;
+    // The counter did not run yet, e.g. because the kernel multiplexes more
+    // counters than the machine has. There is no value to scale.
+    if (data.time_running == 0) continue;
+    values[static_cast<HardwareCounter>(i)] =
+        static_cast<double>(data.value) * data.time_enabled /
+        data.time_running;
+  }
+  return values;
+}
+
+void HardwareCounterStats::Add(const HardwareCounterValues& delta,
+                               int64_t num_executions) {
+  num_executions_ += num_executions;
+  for (int i = 0; i < kNumHardwareCounters; ++i) {
+    const auto counter = static_cast<HardwareCounter>(i);
+    if (!delta[counter].has_value()) continue;
+    totals_[counter] = totals_[counter].value_or(0) + *delta[counter];
+  }
+}
+
+std::optional<double> HardwareCounterStats::Mean(
+    HardwareCounter counter) const {
+  if (num_executions_ == 0 || !totals_[counter].has_value()) {
+    return std::nullopt;
+  }
+  return *totals_[counter] / num_executions_;
+}
+
+std::optional<double> HardwareCounterStats::Ratio(
+    HardwareCounter numerator, HardwareCounter denominator) const {
+  if (!totals_[numerator].has_value() || !totals_[denominator].has_value() ||
+      *totals_[denominator] == 0) {
+    return std::nullopt;
+  }
+  return *totals_[numerator] / *totals_[denominator];
+}
+
+void AddHardwareCountersToProto(const HardwareCounterStats& stats,
+                                HardwareCountersWithSourceProto& proto) {
+  AddValue(stats.Mean(HardwareCounter::kCycles), proto.mutable_cycles());
+  AddValue(stats.Mean(HardwareCounter::kInstructions),
+           proto.mutable_instructions());
+  AddValue(stats.Ratio(HardwareCounter::kL1DataLoadMisses,
+                       HardwareCounter::kL1DataLoads),
+           proto.mutable_l1d_miss_ratios());
+  AddValue(
+      stats.Ratio(HardwareCounter::kL2Misses, HardwareCounter::kL2Requests),
+      proto.mutable_l2_miss_ratios());
+  AddValue(
+      stats.Ratio(HardwareCounter::kLlcLoadMisses, HardwareCounter::kLlcLoads),
+      proto.mutable_llc_miss_ratios());
+  AddValue(
+      stats.Ratio(HardwareCounter::kBranchMisses, HardwareCounter::kBranches),
+      proto.mutable_branch_miss_ratios());
+}
+
+void AnnotateBasicBlockWithHardwareCounters(
+    std::string_view source, const HardwareCounterStats& stats,
+    BasicBlockWithThroughputProto& block) {
+  HardwareCountersWithSourceProto* counters = nullptr;
+  for (HardwareCountersWithSourceProto& block_counters :
+       *block.mutable_hardware_counters()) {
+    if (block_counters.source() == source) {
+      counters = &block_counters;
+      break;
+    }
+  }
+  if (counters == nullptr) {
+    counters = block.add_hardware_counters();
+    counters->set_source(std::string(source));
+  }
+  AddHardwareCountersToProto(stats, *counters);
+}
+
+}  // namespace gematria
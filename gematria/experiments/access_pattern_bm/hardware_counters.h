@@ -0,0 +1,224 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains a small library for measuring regions of code with hardware
+// performance counters, and for annotating basic blocks and functions with the
+// measured values, e.g. cache miss ratios.
+//
+// Typical usage:
+//   auto counters = HardwareCounterSet::Create();
+//   HardwareCounterStats stats;
+//   for (int i = 0; i < num_repetitions; ++i) {
+//     ScopedHardwareCounterRegion region(**counters, stats);
+//     FunctionToMeasure();
+//   }
+//   HardwareCountersWithSourceProto proto;
+//   proto.set_source("access_pattern_bm: linked_list");
+//   AddHardwareCountersToProto(stats, proto);
+//
+// The counters are opened with perf_event_open() for the calling thread. The
+// cycles, instructions, L1 data cache, last-level cache and branch counters
+// use the generic perf events. Linux has no generic event for the L2 cache;
+// the L2 events must be set in HardwareCounterSet::Options either as raw perf
+// events ("r<hex config>"), or, when the library is built with
+// `--define pfm=1`, by their libpfm4 names.
+
+#ifndef GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_HARDWARE_COUNTERS_H_
+#define GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_HARDWARE_COUNTERS_H_
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "absl/status/statusor.h"
+#include "gematria/proto/throughput.pb.h"
+
+namespace gematria {
+
+// The hardware counters measured by HardwareCounterSet.
+enum class HardwareCounter {
+  kCycles,
+  kInstructions,
+  kL1DataLoads,
+  kL1DataLoadMisses,
+  kL2Requests,
+  kL2Misses,
+  kLlcLoads,
+  kLlcLoadMisses,
+  kBranches,
+  kBranchMisses,
+};
+
+inline constexpr int kNumHardwareCounters =
+    static_cast<int>(HardwareCounter::kBranchMisses) + 1;
+
+// Returns a human-readable name of `counter`, e.g. "l1d_load_misses".
+std::string_view HardwareCounterName(HardwareCounter counter);
+
+// Values of all hardware counters, indexed by HardwareCounter. The value of a
+// counter is std::nullopt when the counter is not available.
+class HardwareCounterValues {
+ public:
+  const std::optional<double>& operator[](HardwareCounter counter) const {
+    return values_[static_cast<int>(counter)];
+  }
+  std::optional<double>& operator[](HardwareCounter counter) {
+    return values_[static_cast<int>(counter)];
+  }
+
+  // Returns the difference between `end` and `start`. The counters that are
+  // not available in one of them are not available in the result.
+  static HardwareCounterValues Difference(const HardwareCounterValues& end,
+                                          const HardwareCounterValues& start);
+
+ private:
+  std::array<std::optional<double>, kNumHardwareCounters> values_;
+};
+
+// A set of hardware counters opened for the calling thread. The counters run
+// from the creation of the object until its destruction; regions of code are
+// measured by reading the counters before and after the region. When the
+// kernel multiplexes the counters, the values are scaled by the ratio of the
+// time the counter was enabled to the time it was running.
+// The object must be used only by the thread that created it.
+class HardwareCounterSet {
+ public:
+  struct Options {
+    // The events used for kL2Requests and kL2Misses. Each event is either a raw
+    // perf event "r<config>", where <config> is the event configuration in
+    // hex, e.g. "r3f24" for L2_RQSTS.MISS on Skylake, or a libpfm4 event name
+    // when the library is built with libpfm4. When empty, the counter is not
+    // available.
+#ifdef GEMATRIA_HAVE_PFM
+    std::string l2_requests_event = "L2_RQSTS:REFERENCES";
+    std::string l2_misses_event = "L2_RQSTS:MISS";
+#else
+    std::string l2_requests_event;
+    std::string l2_misses_event;
+#endif  // GEMATRIA_HAVE_PFM
+
+    // When true, the counters include the events in the kernel. Counting
+    // kernel events usually requires additional privileges.
+    bool include_kernel = false;
+  };
+
+  // Opens the counters. The counters that are not supported by the machine or
+  // the kernel are marked as not available. Returns an error when an event
+  // name in `options` can't be parsed, or when none of the counters could be
+  // opened, e.g. because perf events are disabled.
+  static absl::StatusOr<std::unique_ptr<HardwareCounterSet>> Create(
+      const Options& options);
+  static absl::StatusOr<std::unique_ptr<HardwareCounterSet>> Create() {
+    return Create(Options());
+  }
+
+  HardwareCounterSet(const HardwareCounterSet&) = delete;
+  HardwareCounterSet& operator=(const HardwareCounterSet&) = delete;
+  ~HardwareCounterSet();
+
+  // Returns true when `counter` was successfully opened.
+  bool IsAvailable(HardwareCounter counter) const {
+    return file_descriptors_[static_cast<int>(counter)] >= 0;
+  }
+
+  // Returns the current values of the counters. Each available counter is read
+  // with its own system call, so the method takes a few microseconds; it
+  // should be used to measure regions that run much longer than that.
+  HardwareCounterValues Read() const;
+
+ private:
+  HardwareCounterSet();
+
+  // The perf event file descriptors, indexed by HardwareCounter; -1 when the
+  // counter is not available.
+  std::array<int, kNumHardwareCounters> file_descriptors_;
+};
+
+// Accumulates the hardware counter values over multiple executions of a
+// region of code.
+class HardwareCounterStats {
+ public:
+  // Adds `delta`, the counter values measured over `num_executions` executions
+  // of the region. Counters that are not available in `delta` are not updated.
+  void Add(const HardwareCounterValues& delta, int64_t num_executions = 1);
+
+  // Returns the number of executions of the region added to the stats.
+  int64_t num_executions() const { return num_executions_; }
+
+  // Returns the mean value of `counter` per execution of the region, or
+  // std::nullopt when the counter was not available or there were no
+  // executions.
+  std::optional<double> Mean(HardwareCounter counter) const;
+
+  // Returns the ratio of the totals of `numerator` and `denominator`, e.g. the
+  // ratio of L1 data cache misses to L1 data cache loads. Returns std::nullopt
+  // when one of the counters is not available or the denominator is zero.
+  std::optional<double> Ratio(HardwareCounter numerator,
+                              HardwareCounter denominator) const;
+
+ private:
+  int64_t num_executions_ = 0;
+  HardwareCounterValues totals_;
+};
+
+// Measures the hardware counters over the lifetime of the object, and adds the
+// difference to `stats` when the object is destroyed. The region may be
+// executed `num_executions` times between the construction and the destruction;
+// the values in `stats` are then per execution. Regions can be nested.
+class ScopedHardwareCounterRegion {
+ public:
+  ScopedHardwareCounterRegion(const HardwareCounterSet& counters,
+                              HardwareCounterStats& stats,
+                              int64_t num_executions = 1)
+      : counters_(counters),
+        stats_(stats),
+        num_executions_(num_executions),
+        start_(counters.Read()) {}
+
+  ScopedHardwareCounterRegion(const ScopedHardwareCounterRegion&) = delete;
+  ScopedHardwareCounterRegion& operator=(const ScopedHardwareCounterRegion&) =
+      delete;
+
+  ~ScopedHardwareCounterRegion() {
+    stats_.Add(HardwareCounterValues::Difference(counters_.Read(), start_),
+               num_executions_);
+  }
+
+ private:
+  const HardwareCounterSet& counters_;
+  HardwareCounterStats& stats_;
+  const int64_t num_executions_;
+  const HardwareCounterValues start_;
+};
+
+// Appends the values from `stats` to `proto`: the mean cycles and instructions
+// per execution, and the miss ratios. Quantities that are not available in
+// `stats` are not added. Does not modify `proto.source()` and
+// `proto.region_name()`.
+void AddHardwareCountersToProto(const HardwareCounterStats& stats,
+                                HardwareCountersWithSourceProto& proto);
+
+// Adds the values from `stats` to the hardware counters of `block` with the
+// given source, as described by AddHardwareCountersToProto(). Adds a new
+// HardwareCountersWithSourceProto to `block` when it has none with `source`.
+void AnnotateBasicBlockWithHardwareCounters(
+    std::string_view source, const HardwareCounterStats& stats,
+    BasicBlockWithThroughputProto& block);
+
+}  // namespace gematria
+
+#endif  // GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_HARDWARE_COUNTERS_H_
@@ -0,0 +1,154 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/experiments/access_pattern_bm/hardware_counters.h"
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "gematria/proto/throughput.pb.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::DoubleEq;
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+using ::testing::Optional;
+
+HardwareCounterValues MakeValues(double loads, double misses) {
+  HardwareCounterValues values;
+  values[HardwareCounter::kCycles] = 100;
+  values[HardwareCounter::kL1DataLoads] = loads;
+  values[HardwareCounter::kL1DataLoadMisses] = misses;
+  return values;
+}
+
+TEST(HardwareCounterValuesTest, Difference) {
+  HardwareCounterValues start = MakeValues(10, 1);
+  HardwareCounterValues end = MakeValues(30, 6);
+  end[HardwareCounter::kBranches] = 5;
+  const HardwareCounterValues difference =
+      HardwareCounterValues::Difference(end, start);
+  EXPECT_THAT(difference[HardwareCounter::kCycles], Optional(0.0));
+  EXPECT_THAT(difference[HardwareCounter::kL1DataLoads], Optional(20.0));
+  EXPECT_THAT(difference[HardwareCounter::kL1DataLoadMisses], Optional(5.0));
+  // Counters that are not available in one of the inputs are not available in
+  // the difference.
+  EXPECT_EQ(difference[HardwareCounter::kBranches], std::nullopt);
+  EXPECT_EQ(difference[HardwareCounter::kInstructions], std::nullopt);
+}
+
+TEST(HardwareCounterStatsTest, Empty) {
+  const HardwareCounterStats stats;
+  EXPECT_EQ(stats.num_executions(), 0);
+  EXPECT_EQ(stats.Mean(HardwareCounter::kCycles), std::nullopt);
+  EXPECT_EQ(stats.Ratio(HardwareCounter::kL1DataLoadMisses,
+                        HardwareCounter::kL1DataLoads),
+            std::nullopt);
+}
+
+TEST(HardwareCounterStatsTest, MeanAndRatio) {
+  HardwareCounterStats stats;
+  stats.Add(MakeValues(10, 1));
+  stats.Add(MakeValues(30, 3), /*num_executions=*/3);
+  EXPECT_EQ(stats.num_executions(), 4);
+  EXPECT_THAT(stats.Mean(HardwareCounter::kCycles), Optional(50.0));
+  EXPECT_THAT(stats.Ratio(HardwareCounter::kL1DataLoadMisses,
+                          HardwareCounter::kL1DataLoads),
+              Optional(DoubleEq(0.1)));
+  EXPECT_EQ(stats.Mean(HardwareCounter::kInstructions), std::nullopt);
+  EXPECT_EQ(
+      stats.Ratio(HardwareCounter::kBranchMisses, HardwareCounter::kBranches),
+      std::nullopt);
+}
+
+TEST(HardwareCounterStatsTest, ZeroDenominator) {
+  HardwareCounterStats stats;
+  stats.Add(MakeValues(0, 0));
+  EXPECT_EQ(stats.Ratio(HardwareCounter::kL1DataLoadMisses,
+                        HardwareCounter::kL1DataLoads),
+            std::nullopt);
+}
+
+TEST(AddHardwareCountersToProtoTest, AddsAvailableValues) {
+  HardwareCounterStats stats;
+  stats.Add(MakeValues(10, 1), /*num_executions=*/2);
+  HardwareCountersWithSourceProto proto;
+  AddHardwareCountersToProto(stats, proto);
+  AddHardwareCountersToProto(stats, proto);
+  EXPECT_THAT(proto.cycles(), ElementsAre(50.0, 50.0));
+  EXPECT_THAT(proto.l1d_miss_ratios(),
+              ElementsAre(DoubleEq(0.1), DoubleEq(0.1)));
+  EXPECT_THAT(proto.instructions(), IsEmpty());
+  EXPECT_THAT(proto.l2_miss_ratios(), IsEmpty());
+  EXPECT_THAT(proto.llc_miss_ratios(), IsEmpty());
+  EXPECT_THAT(proto.branch_miss_ratios(), IsEmpty());
+}
+
+TEST(AnnotateBasicBlockWithHardwareCountersTest, MergesBySource) {
+  HardwareCounterStats stats;
+  stats.Add(MakeValues(10, 1));
+  BasicBlockWithThroughputProto block;
+  AnnotateBasicBlockWithHardwareCounters("a", stats, block);
+  AnnotateBasicBlockWithHardwareCounters("b", stats, block);
+  AnnotateBasicBlockWithHardwareCounters("a", stats, block);
+  ASSERT_EQ(block.hardware_counters_size(), 2);
+  EXPECT_EQ(block.hardware_counters(0).source(), "a");
+  EXPECT_THAT(block.hardware_counters(0).cycles(), ElementsAre(100.0, 100.0));
+  EXPECT_EQ(block.hardware_counters(1).source(), "b");
+  EXPECT_THAT(block.hardware_counters(1).cycles(), ElementsAre(100.0));
+}
+
+TEST(HardwareCounterSetTest, InvalidEventName) {
+  HardwareCounterSet::Options options;
+  options.l2_requests_event = "NOT_AN_EVENT:REALLY";
+  EXPECT_EQ(HardwareCounterSet::Create(options).status().code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST(HardwareCounterSetTest, MeasureRegion) {
+  absl::StatusOr<std::unique_ptr<HardwareCounterSet>> counters =
+      HardwareCounterSet::Create();
+  if (!counters.ok()) {
+    GTEST_SKIP() << "Hardware counters are not available: "
+                 << counters.status();
+  }
+  if (!(*counters)->IsAvailable(HardwareCounter::kInstructions)) {
+    GTEST_SKIP() << "The instruction counter is not available";
+  }
+
+  constexpr int kNumExecutions = 10;
+  HardwareCounterStats stats;
+  volatile int64_t sum = 0;
+  {
+    ScopedHardwareCounterRegion region(**counters, stats, kNumExecutions);
+    for (int i = 0; i < kNumExecutions; ++i) {
+      for (int j = 0; j < 10000; ++j) sum = sum + j;
+    }
+  }
+  EXPECT_EQ(stats.num_executions(), kNumExecutions);
+  // Each execution runs at least one instruction per iteration of the inner
+  // loop.
+  EXPECT_THAT(stats.Mean(HardwareCounter::kInstructions),
+              Optional(::testing::Ge(10000.0)));
+}
+
+}  // namespace
+}  // namespace gematria
@@ -0,0 +1,128 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/experiments/access_pattern_bm/multi_threaded.h"
+
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "absl/base/optimization.h"
+
+namespace gematria {
+
+int GetNumNumaNodes() {
+  int num_nodes = 0;
+  while (std::ifstream("/sys/devices/system/node/node" +
+                       std::to_string(num_nodes) + "/cpulist")
+             .is_open()) {
+    ++num_nodes;
+  }
+  return std::max(num_nodes, 1);
+}
+
+ScopedNumaNodeAffinity::ScopedNumaNodeAffinity(const int node) {
+  if (sched_getaffinity(0, sizeof(original_cpus_), &original_cpus_) != 0) {
+    return;
+  }
+  // The file contains a list of CPU ranges, e.g. "0-3,8-11".
+  std::ifstream cpu_list_file("/sys/devices/system/node/node" +
+                              std::to_string(node) + "/cpulist");
+  std::string cpu_list;
+  if (!std::getline(cpu_list_file, cpu_list)) return;
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  std::stringstream ranges(cpu_list);
+  std::string range;
+  bool has_cpus = false;
+  while (std::getline(ranges, range, ',')) {
+    if (range.empty()) continue;
+    const std::size_t dash = range.find('-');
+    const int first = std::atoi(range.substr(0, dash).c_str());
+    const int last = dash == std::string::npos
+                         ? first
+                         : std::atoi(range.substr(dash + 1).c_str());
+    for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+      CPU_SET(cpu, &cpus);
+      has_cpus = true;
+    }
+  }
+  ok_ = has_cpus && sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+}
+
+ScopedNumaNodeAffinity::~ScopedNumaNodeAffinity() {
+  if (ok_) sched_setaffinity(0, sizeof(original_cpus_), &original_cpus_);
+}
+
+std::unique_ptr<NumaBuffer> NumaBuffer::Create(const std::size_t size,
+                                               const int node) {
+  constexpr int kBitsPerMaskWord = 8 * sizeof(unsigned long);
+  if (node < 0 || node >= kBitsPerMaskWord) return nullptr;
+  void *const data = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (data == MAP_FAILED) return nullptr;
+  // The memory is bound to the node before the pages are allocated, so that
+  // the kernel places them there regardless of the CPU that touches them.
+  const unsigned long node_mask = 1ul << node;
+  if (syscall(SYS_mbind, data, size, MPOL_BIND, &node_mask,
+              /*maxnode=*/kBitsPerMaskWord, /*flags=*/0) != 0) {
+    munmap(data, size);
+    return nullptr;
+  }
+  std::memset(data, 0, size);
+  return std::unique_ptr<NumaBuffer>(new NumaBuffer(data, size));
+}
+
+NumaBuffer::~NumaBuffer() { munmap(data_, size_); }
+
+void CreateRandomCacheLineCycle(void *buffer, const std::size_t size) {
+  constexpr int line_size = ABSL_CACHELINE_SIZE;
+  const std::size_t num_lines = size / line_size;
+  if (num_lines == 0) return;
+  char *const lines = reinterpret_cast<char *>(buffer);
+
+  std::vector<std::size_t> order(num_lines);
+  std::iota(order.begin(), order.end(), 0);
+  std::default_random_engine generator;
+  std::shuffle(order.begin() + 1, order.end(), generator);
+  for (std::size_t i = 0; i < num_lines; ++i) {
+    char *const next = lines + order[(i + 1) % num_lines] * line_size;
+    std::memcpy(lines + order[i] * line_size, &next, sizeof(next));
+  }
+}
+
+const void *ChaseCacheLineCycle(const void *start,
+                                const std::size_t num_steps) {
+  const void *line = start;
+  for (std::size_t i = 0; i < num_steps; ++i) {
+    line = *reinterpret_cast<const void *const *>(line);
+  }
+  return line;
+}
+
+}  // namespace gematria
@@ -0,0 +1,84 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_MULTI_THREADED_H_
+#define GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_MULTI_THREADED_H_
+
+#include <sched.h>
+
+#include <cstddef>
+#include <memory>
+
+namespace gematria {
+
+// Returns the number of NUMA nodes of the machine, as reported by sysfs.
+// Returns 1 when the information is not available.
+int GetNumNumaNodes();
+
+// Restricts the calling thread to the CPUs of a NUMA node for the lifetime of
+// the object, and restores the original CPU affinity of the thread when the
+// object is destroyed.
+class ScopedNumaNodeAffinity {
+ public:
+  explicit ScopedNumaNodeAffinity(int node);
+  ScopedNumaNodeAffinity(const ScopedNumaNodeAffinity &) = delete;
+  ScopedNumaNodeAffinity &operator=(const ScopedNumaNodeAffinity &) = delete;
+  ~ScopedNumaNodeAffinity();
+
+  // Returns true when the thread was restricted to the node; returns false
+  // when the CPUs of the node can't be determined or the affinity can't be
+  // set.
+  bool ok() const { return ok_; }
+
+ private:
+  bool ok_ = false;
+  cpu_set_t original_cpus_;
+};
+
+// A page-aligned buffer whose memory is bound to a NUMA node. The buffer is
+// zero-initialized, and all its pages are allocated when it is created.
+class NumaBuffer {
+ public:
+  // Allocates `size` bytes on the NUMA node `node`. Returns nullptr when the
+  // memory can't be allocated or bound to the node.
+  static std::unique_ptr<NumaBuffer> Create(std::size_t size, int node);
+
+  NumaBuffer(const NumaBuffer &) = delete;
+  NumaBuffer &operator=(const NumaBuffer &) = delete;
+  ~NumaBuffer();
+
+  void *data() const { return data_; }
+  std::size_t size() const { return size_; }
+
+ private:
+  NumaBuffer(void *data, std::size_t size) : data_(data), size_(size) {}
+
+  void *data_;
+  std::size_t size_;
+};
+
+// Links the cache lines of `buffer` into a single cycle in a random order: the
+// first bytes of each cache line are a pointer to the next cache line of the
+// cycle. Following the cycle defeats the hardware prefetchers. `size` is the
+// size of the buffer in bytes; expects that `buffer` is aligned to a cache
+// line.
+void CreateRandomCacheLineCycle(void *buffer, std::size_t size);
+
+// Follows `num_steps` pointers of a cycle created by CreateRandomCacheLineCycle
+// from `start`, and returns the cache line where it stopped.
+const void *ChaseCacheLineCycle(const void *start, std::size_t num_steps);
+
+}  // namespace gematria
+
+#endif  // GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_MULTI_THREADED_H_
@@ -0,0 +1,293 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/experiments/access_pattern_bm/multi_threaded.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "absl/base/optimization.h"
+#include "benchmark/benchmark.h"
+#include "gematria/experiments/access_pattern_bm/configuration.h"
+
+namespace gematria {
+namespace {
+
+constexpr std::size_t kCacheLineSize = ABSL_CACHELINE_SIZE;
+
+struct alignas(kCacheLineSize) CacheLine {
+  char bytes[kCacheLineSize];
+};
+
+// The number of increments of the per-thread counter in one iteration of the
+// false sharing benchmarks.
+constexpr int kIncrementsPerIteration = 1024;
+
+// The number of pointers followed in one iteration of the pointer chasing
+// benchmarks.
+constexpr int kStepsPerIteration = 1024;
+
+// The per-thread counters of the false sharing benchmarks. The counter of the
+// thread with index i is at counter_storage + i * distance.
+alignas(kFalseSharingPadding) char
+    counter_storage[kMaxNumThreads * kFalseSharingPadding];
+
+// Each thread increments its own counter. When `kDistance` is smaller than a
+// cache line, the counters of multiple threads share a cache line, and the
+// line bounces between the cores even though the threads never access the
+// same data.
+template <std::size_t kDistance>
+void BM_PerThreadCounter(benchmark::State &state) {
+  static_assert(kDistance >= sizeof(std::atomic<int64_t>));
+  static_assert(kDistance <= kFalseSharingPadding);
+  auto *const counter = reinterpret_cast<std::atomic<int64_t> *>(
+      counter_storage + state.thread_index() * kDistance);
+  counter->store(0, std::memory_order_relaxed);
+
+  for (auto _ : state) {
+    for (int i = 0; i < kIncrementsPerIteration; ++i) {
+      // A load and a store rather than fetch_add(): the benchmark measures the
+      // cost of moving the cache line between the cores, not of the locked
+      // instruction.
+      counter->store(counter->load(std::memory_order_relaxed) + 1,
+                     std::memory_order_relaxed);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * kIncrementsPerIteration);
+}
+
+BENCHMARK(BM_PerThreadCounter<sizeof(int64_t)>)
+    ->Name("BM_FalseSharing_Packed")
+    ->ThreadRange(1, kMaxNumThreads)
+    ->UseRealTime();
+BENCHMARK(BM_PerThreadCounter<kFalseSharingPadding>)
+    ->Name("BM_FalseSharing_Padded")
+    ->ThreadRange(1, kMaxNumThreads)
+    ->UseRealTime();
+
+// The data shared by all threads in the shared read benchmarks. Allocated
+// before the threads of a benchmark run start, and released when they finish.
+std::unique_ptr<std::atomic<int>[]> shared_data;
+
+void SetUpSharedData(const benchmark::State &state) {
+  const std::size_t size = state.range(0);
+  shared_data = std::make_unique<std::atomic<int>[]>(size);
+  for (std::size_t i = 0; i < size; ++i) {
+    shared_data[i].store(i, std::memory_order_relaxed);
+  }
+}
+
+void TearDownSharedData(const benchmark::State &) { shared_data.reset(); }
+
+// All threads read the shared data. With `kWithWrites`, thread 0 also writes
+// one value in each cache line of the data once every kReadMostlyWritePeriod
+// passes, which invalidates the copies of the lines in the caches of the other
+// cores.
+template <bool kWithWrites>
+void BM_SharedRead(benchmark::State &state) {
+  const std::size_t size = state.range(0);
+  constexpr std::size_t kValuesPerLine = kCacheLineSize / sizeof(int);
+  const bool is_writer = kWithWrites && state.thread_index() == 0;
+  int pass = 0;
+
+  for (auto _ : state) {
+    int sum = 0;
+    for (std::size_t i = 0; i < size; ++i) {
+      sum += shared_data[i].load(std::memory_order_relaxed);
+    }
+    if (is_writer && ++pass == kReadMostlyWritePeriod) {
+      pass = 0;
+      for (std::size_t i = 0; i < size; i += kValuesPerLine) {
+        shared_data[i].store(sum, std::memory_order_relaxed);
+      }
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetBytesProcessed(state.iterations() * size * sizeof(int));
+}
+
+BENCHMARK(BM_SharedRead<false>)
+    ->Name("BM_SharedReadOnly")
+    ->Setup(SetUpSharedData)
+    ->Teardown(TearDownSharedData)
+    ->Range(1 << 10, 1 << 20)
+    ->ThreadRange(1, kMaxNumThreads)
+    ->UseRealTime();
+BENCHMARK(BM_SharedRead<true>)
+    ->Name("BM_SharedReadMostly")
+    ->Setup(SetUpSharedData)
+    ->Teardown(TearDownSharedData)
+    ->Range(1 << 10, 1 << 20)
+    ->ThreadRange(1, kMaxNumThreads)
+    ->UseRealTime();
+
+// The buffer of the NUMA benchmarks; nullptr when the machine does not have
+// the NUMA node or the buffer can't be allocated there.
+std::unique_ptr<NumaBuffer> numa_buffer;
+
+template <int kDataNode>
+void SetUpNumaBuffer(const benchmark::State &state) {
+  if (GetNumNumaNodes() <= std::max(kNumaThreadNode, kDataNode)) return;
+  numa_buffer = NumaBuffer::Create(state.range(0), kDataNode);
+  if (numa_buffer != nullptr) {
+    CreateRandomCacheLineCycle(numa_buffer->data(), numa_buffer->size());
+  }
+}
+
+void TearDownNumaBuffer(const benchmark::State &) { numa_buffer.reset(); }
+
+// Returns false and marks the benchmark as skipped when the NUMA benchmark
+// can't run on this machine.
+bool CheckNumaBenchmark(benchmark::State &state,
+                        const ScopedNumaNodeAffinity &affinity) {
+  if (numa_buffer == nullptr) {
+    state.SkipWithError("The NUMA nodes are not available");
+    return false;
+  }
+  if (!affinity.ok()) {
+    state.SkipWithError("Could not pin the thread to the NUMA node");
+    return false;
+  }
+  return true;
+}
+
+// Each thread reads its own slice of a buffer placed on `kDataNode`, from a
+// CPU of kNumaThreadNode. Measures the bandwidth of local or remote memory.
+template <int kDataNode>
+void BM_NumaBandwidth(benchmark::State &state) {
+  const ScopedNumaNodeAffinity affinity(kNumaThreadNode);
+  if (!CheckNumaBenchmark(state, affinity)) return;
+  const std::size_t slice_size =
+      numa_buffer->size() / sizeof(int64_t) / state.threads();
+  const int64_t *const slice = reinterpret_cast<const int64_t *>(
+                                   numa_buffer->data()) +
+                               state.thread_index() * slice_size;
+
+  for (auto _ : state) {
+    int64_t sum = 0;
+    for (std::size_t i = 0; i < slice_size; ++i) {
+      sum += slice[i];
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetBytesProcessed(state.iterations() * slice_size * sizeof(int64_t));
+}
+
+BENCHMARK(BM_NumaBandwidth<kNumaThreadNode>)
+    ->Name("BM_NumaBandwidth_Local")
+    ->Setup(SetUpNumaBuffer<kNumaThreadNode>)
+    ->Teardown(TearDownNumaBuffer)
+    ->Arg(1 << 28)
+    ->ThreadRange(1, kMaxNumThreads)
+    ->UseRealTime();
+BENCHMARK(BM_NumaBandwidth<kNumaRemoteNode>)
+    ->Name("BM_NumaBandwidth_Remote")
+    ->Setup(SetUpNumaBuffer<kNumaRemoteNode>)
+    ->Teardown(TearDownNumaBuffer)
+    ->Arg(1 << 28)
+    ->ThreadRange(1, kMaxNumThreads)
+    ->UseRealTime();
+
+// Each thread follows the random cache line cycle in a buffer placed on
+// `kDataNode`, from a CPU of kNumaThreadNode. Measures the latency of local or
+// remote memory.
+template <int kDataNode>
+void BM_NumaLatency(benchmark::State &state) {
+  const ScopedNumaNodeAffinity affinity(kNumaThreadNode);
+  if (!CheckNumaBenchmark(state, affinity)) return;
+  // The threads start at different points of the cycle, so that they do not
+  // bring the lines to the cache for each other.
+  const std::size_t num_lines = numa_buffer->size() / kCacheLineSize;
+  const void *line = ChaseCacheLineCycle(
+      numa_buffer->data(),
+      state.thread_index() * (num_lines / state.threads()));
+
+  for (auto _ : state) {
+    line = ChaseCacheLineCycle(line, kStepsPerIteration);
+    benchmark::DoNotOptimize(line);
+  }
+  state.SetItemsProcessed(state.iterations() * kStepsPerIteration);
+}
+
+BENCHMARK(BM_NumaLatency<kNumaThreadNode>)
+    ->Name("BM_NumaLatency_Local")
+    ->Setup(SetUpNumaBuffer<kNumaThreadNode>)
+    ->Teardown(TearDownNumaBuffer)
+    ->Arg(1 << 28)
+    ->ThreadRange(1, kMaxNumThreads)
+    ->UseRealTime();
+BENCHMARK(BM_NumaLatency<kNumaRemoteNode>)
+    ->Name("BM_NumaLatency_Remote")
+    ->Setup(SetUpNumaBuffer<kNumaRemoteNode>)
+    ->Teardown(TearDownNumaBuffer)
+    ->Arg(1 << 28)
+    ->ThreadRange(1, kMaxNumThreads)
+    ->UseRealTime();
+
+void StrideArguments(benchmark::internal::Benchmark *benchmark) {
+  for (const std::size_t stride : kStrides) {
+    for (int64_t size = 1 << 16; size <= 1 << 26; size <<= 5) {
+      benchmark->Args({size, static_cast<int64_t>(stride)});
+    }
+  }
+}
+
+// Reads one value from each cache line of a buffer of `state.range(0)` bytes,
+// visiting the lines with a stride of `state.range(1)` bytes: the benchmark
+// makes `stride / kCacheLineSize` passes over the buffer, and each pass reads
+// every stride-th line. All strides read the same lines, but the larger ones
+// defeat the hardware prefetchers.
+void BM_StridedAccess(benchmark::State &state) {
+  const std::size_t size = state.range(0);
+  const std::size_t stride = state.range(1);
+  auto buffer = std::make_unique<char[]>(size);
+  std::fill_n(buffer.get(), size, 1);
+
+  for (auto _ : state) {
+    int sum = 0;
+    for (std::size_t start = 0; start < stride; start += kCacheLineSize) {
+      for (std::size_t i = start; i < size; i += stride) {
+        sum += buffer[i];
+      }
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * (size / kCacheLineSize));
+}
+
+BENCHMARK(BM_StridedAccess)->Apply(StrideArguments);
+
+// Reads the cache lines of a buffer of `state.range(0)` bytes in a random
+// order, by following the cache line cycle. No hardware prefetcher can predict
+// the accesses; this is the baseline for BM_StridedAccess.
+void BM_RandomCacheLineAccess(benchmark::State &state) {
+  const std::size_t size = state.range(0);
+  auto buffer = std::make_unique<CacheLine[]>(size / kCacheLineSize);
+  CreateRandomCacheLineCycle(buffer.get(), size);
+  const void *line = buffer.get();
+
+  for (auto _ : state) {
+    line = ChaseCacheLineCycle(line, kStepsPerIteration);
+    benchmark::DoNotOptimize(line);
+  }
+  state.SetItemsProcessed(state.iterations() * kStepsPerIteration);
+}
+
+BENCHMARK(BM_RandomCacheLineAccess)->Range(1 << 16, 1 << 26);
+
+}  // namespace
+}  // namespace gematria
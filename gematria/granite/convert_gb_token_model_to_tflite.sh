@@ -26,6 +26,20 @@
 #     --gematria_output_tflite /tmp/gnn.tflite \
 #     --gematria_export_as_seq2seq
 #
+# With --gematria_fuse_gather_segment_sum, each tf.gather whose result is used
+# only by tf.math.unsorted_segment_sum is fused with it into the
+# GatherUnsortedSegmentSum custom op. This avoids materializing the per-edge
+# messages in the graph network.
+#
+# With --gematria_quantization, the converter applies post-training quantization
+# to the model:
+#   - none: the model uses float32 (the default).
+#   - float16: the weights are stored as float16.
+#   - dynamic_range: the weights are quantized to int8, and the activations are
+#     quantized dynamically during inference.
+# Full integer quantization requires a representative data set, and it can't be
+# done from this script; GraphBuilderModelInference accepts such models too.
+#
 # See g3doc/granite-inference-api.md for more details on exporting models to the
 # .tflite format.
 
@@ -37,8 +51,10 @@ function print_error_and_exit() {
 # Parse command-line flags.
 # TODO(ondrasej): Consider using getopt instead of parsing the flags manually.
 gematria_export_as_seq2seq=0
+gematria_fuse_gather_segment_sum=0
 gematria_input_graphdef=""
 gematria_output_tflite=""
+gematria_quantization="none"
 while [[ "$#" -gt 0 ]]; do
   case "$1" in
     --gematria_input_graphdef)
@@ -58,6 +74,16 @@ while [[ "$#" -gt 0 ]]; do
     --gematria_export_as_seq2seq)
       gematria_export_as_seq2seq=1
       ;;
+    --gematria_fuse_gather_segment_sum)
+      gematria_fuse_gather_segment_sum=1
+      ;;
+    --gematria_quantization)
+      gematria_quantization="$2"
+      shift
+      ;;
+    --gematria_quantization=*)
+      gematria_quantization="${1:24}"
+      ;;
     *)
       print_error_and_exit "Unexpected command-line argument: $1"
   esac
@@ -71,6 +97,22 @@ if [[ -z "${gematria_output_tflite}" ]]; then
   print_error_and_exit "Flag --gematria_output_tflite is missing."
 fi
 
+QUANTIZATION_FLAGS=()
+case "${gematria_quantization}" in
+  none)
+    ;;
+  float16)
+    QUANTIZATION_FLAGS=(--post_training_quantize --quantize_to_float16)
+    ;;
+  dynamic_range)
+    QUANTIZATION_FLAGS=(--post_training_quantize)
+    ;;
+  *)
+    print_error_and_exit \
+      "Unexpected value of --gematria_quantization: ${gematria_quantization}"
+esac
+readonly QUANTIZATION_FLAGS
+
 # Prints its arguments joined by a comma.
 function str_join() {
   local IFS=","
@@ -78,9 +120,9 @@ function str_join() {
 }
 
 # The list of inputs of the model. This must contain an entry for each
-# tf.placeholder tensor used in the Python code. The order of the tensors used
-# here must correspond to the input tensor indices defined in
-# gematria/granite/graph_builder_model_inference.cc.
+# tf.placeholder tensor used in the Python code. The inference code looks up
+# the tensors by name, so the names used here must match the tensor names
+# defined in gematria/granite/graph_builder_model_inference.cc.
 readonly INPUT_TENSORS_LIST=(
   ModelBase.delta_block_index_tensor
   GnnModelBase.node_features
@@ -120,12 +162,25 @@ fi
 OUTPUT_TENSORS=$(str_join "${OUTPUT_TENSOR_LIST[@]}")
 readonly OUTPUT_TENSORS
 
+converted_tflite="${gematria_output_tflite}"
+if (( gematria_fuse_gather_segment_sum )); then
+  converted_tflite="$(mktemp --suffix=.tflite)"
+  trap 'rm -f "${converted_tflite}"' EXIT
+fi
+
 tflite_convert \
   --graph_def_file="${gematria_input_graphdef}" \
-  --output_file="${gematria_output_tflite}" \
+  --output_file="${converted_tflite}" \
   --enable_v1_converter \
   --allow_custom_ops \
   --experimental_new_converter \
   --output_arrays="${OUTPUT_TENSORS}" \
   --input_arrays="${INPUT_TENSORS}" \
-  --target_ops="${TARGET_OPS}"
+  --target_ops="${TARGET_OPS}" \
+  "${QUANTIZATION_FLAGS[@]}"
+
+if (( gematria_fuse_gather_segment_sum )); then
+  python3 -m gematria.granite.python.fuse_tflite_gather_segment_sum \
+    --gematria_input_tflite="${converted_tflite}" \
+    --gematria_output_tflite="${gematria_output_tflite}"
+fi
@@ -16,18 +16,24 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <memory>
 #include <ostream>
 #include <sstream>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
 #include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/symbol_table.h"
 #include "gematria/model/oov_token_behavior.h"
+#include "gematria/utils/trace.h"
 
 #ifdef DEBUG
 #define LOG(X) std::cerr << X << "\n"
@@ -42,25 +48,14 @@ namespace {
 
 constexpr BasicBlockGraphBuilder::NodeIndex kInvalidNode(-1);
 constexpr BasicBlockGraphBuilder::TokenIndex kInvalidTokenIndex(-1);
-
-std::unordered_map<std::string, BasicBlockGraphBuilder::TokenIndex> MakeIndex(
-    std::vector<std::string> items) {
-  std::unordered_map<std::string, BasicBlockGraphBuilder::TokenIndex> result;
-  for (BasicBlockGraphBuilder::TokenIndex i = 0; i < items.size(); ++i) {
-    const auto insertion_result = result.emplace(std::move(items[i]), i);
-    if (!insertion_result.second) {
-      // TODO(ondrasej): Make this return a status.
-      std::cerr << "Duplicate item: '" << insertion_result.first->first << "'";
-      std::abort();
-    }
-  }
-  return result;
-}
+// A marker used in the symbol token cache for symbols that were not looked up
+// yet.
+constexpr BasicBlockGraphBuilder::TokenIndex kUnresolvedSymbolToken(-2);
 
 BasicBlockGraphBuilder::TokenIndex FindTokenOrDie(
-    const std::unordered_map<std::string, BasicBlockGraphBuilder::TokenIndex>&
-        tokens,
-    const std::string& token) {
+    const std::unordered_map<std::string_view,
+                             BasicBlockGraphBuilder::TokenIndex>& tokens,
+    std::string_view token) {
   return tokens.at(token);
 }
 
@@ -71,6 +66,167 @@ typename MapType::mapped_type& LookupOrInsert(
   return it->second;
 }
 
+// Upper bounds on the numbers of nodes and edges in the graph of a basic
+// block, estimated from the numbers of instructions and operands without
+// looking up any tokens.
+struct GraphSizeEstimate {
+  int64_t num_nodes = 0;
+  int64_t num_edges = 0;
+};
+
+void AddInterferenceEstimate(const std::vector<std::string>& registers,
+                             GraphSizeEstimate& estimate) {
+  // Each interfering register may add a node and two edges.
+  estimate.num_nodes += registers.size();
+  estimate.num_edges += 2 * registers.size();
+}
+
+// Estimates the size of the graph of `block`; the interfered registers are
+// counted only when `add_interference` is true.
+GraphSizeEstimate EstimateGraphSize(const BasicBlock& block,
+                                    bool add_interference) {
+  GraphSizeEstimate estimate;
+  for (const Instruction& instruction : block.instructions) {
+    // The instruction node, the prefix nodes and their edges, and the
+    // structural dependency edge.
+    estimate.num_nodes += 1 + instruction.prefixes.size();
+    estimate.num_edges += 1 + instruction.prefixes.size();
+    for (const std::vector<InstructionOperand>* const operands :
+         {&instruction.input_operands, &instruction.implicit_input_operands,
+          &instruction.output_operands,
+          &instruction.implicit_output_operands}) {
+      for (const InstructionOperand& operand : *operands) {
+        estimate.num_nodes += 1;
+        estimate.num_edges += 1;
+        if (add_interference &&
+            operand.type() == OperandType::kVirtualRegister) {
+          AddInterferenceEstimate(operand.getInterferedRegisters(), estimate);
+        }
+        if (operand.type() != OperandType::kAddress) continue;
+        // Base, index and segment registers, and the displacement.
+        const AddressTuple& address = operand.address();
+        estimate.num_nodes += 4;
+        estimate.num_edges += 4;
+        if (!add_interference) continue;
+        AddInterferenceEstimate(address.base_register_intefered_register,
+                                estimate);
+        AddInterferenceEstimate(address.index_register_intefered_register,
+                                estimate);
+        AddInterferenceEstimate(address.segment_register_intefered_register,
+                                estimate);
+      }
+    }
+  }
+  return estimate;
+}
+
+using CompactReader = CompactBasicBlock::Reader;
+using InstructionView = BasicBlockGraphBuilder::InstructionView;
+using IntListView = BasicBlockGraphBuilder::IntListView;
+using OperandView = BasicBlockGraphBuilder::OperandView;
+using RegisterView = BasicBlockGraphBuilder::RegisterView;
+using StringListView = BasicBlockGraphBuilder::StringListView;
+
+// Reads the interference list of a register of a compact basic block into
+// `view`. `names` are the names of the local symbols of the basic block.
+void ReadCompactInterference(const std::vector<std::string_view>& names,
+                             CompactReader& reader, RegisterView& view) {
+  const uint32_t num_registers = reader.ReadWord();
+  view.interfered_registers =
+      StringListView(names.data(), reader.ReadWords(num_registers),
+                     num_registers);
+  // The sizes are stored as the bits of int values, which may be read through
+  // the unsigned words of the encoding.
+  view.interfered_register_sizes = IntListView(
+      reinterpret_cast<const int*>(reader.ReadWords(num_registers)),
+      num_registers);
+}
+
+// Reads an address register of a compact basic block into `view`.
+void ReadCompactAddressRegister(const std::vector<std::string_view>& names,
+                                CompactReader& reader, RegisterView& view) {
+  const uint32_t name = reader.ReadWord();
+  view.name =
+      name == CompactBasicBlock::kNoSymbol ? std::string_view() : names[name];
+  reader.ReadWord();  // The size of the register is not used.
+  ReadCompactInterference(names, reader, view);
+}
+
+void ReadCompactOperand(const CompactBasicBlock& block,
+                        const std::vector<std::string_view>& names,
+                        CompactReader& reader, OperandView& view) {
+  view = OperandView();
+  view.type = static_cast<OperandType>(reader.ReadWord());
+  switch (view.type) {
+    case OperandType::kUnknown:
+      break;
+    case OperandType::kRegister: {
+      const uint32_t name = reader.ReadWord();
+      view.register_operand.name = names[name];
+      view.register_symbol = block.symbol(name);
+    } break;
+    case OperandType::kVirtualRegister:
+      view.register_operand.name = names[reader.ReadWord()];
+      view.register_size = reader.ReadInt();
+      ReadCompactInterference(names, reader, view.register_operand);
+      break;
+    case OperandType::kImmediateValue:
+    case OperandType::kFpImmediateValue:
+      // The values of the immediate operands are not used by the graphs.
+      reader.ReadUint64();
+      break;
+    case OperandType::kAddress:
+      ReadCompactAddressRegister(names, reader, view.base_register);
+      ReadCompactAddressRegister(names, reader, view.index_register);
+      ReadCompactAddressRegister(names, reader, view.segment_register);
+      view.displacement = static_cast<int64_t>(reader.ReadUint64());
+      reader.ReadWord();  // The scaling is not used.
+      break;
+    case OperandType::kMemory:
+      view.alias_group_id = reader.ReadInt();
+      break;
+  }
+}
+
+void ReadCompactOperands(const CompactBasicBlock& block,
+                         const std::vector<std::string_view>& names,
+                         CompactReader& reader,
+                         std::vector<OperandView>& views) {
+  views.resize(reader.ReadWord());
+  for (OperandView& view : views) {
+    ReadCompactOperand(block, names, reader, view);
+  }
+}
+
+// Reads the next instruction of a compact basic block into `view`; see the
+// comment of CompactBasicBlock for the layout of the encoding. The views point
+// to `names` and to the buffer of `block`.
+void ReadCompactInstruction(const CompactBasicBlock& block,
+                            const std::vector<std::string_view>& names,
+                            CompactReader& reader, InstructionView& view) {
+  const uint32_t mnemonic = reader.ReadWord();
+  view.mnemonic = names[mnemonic];
+  view.mnemonic_symbol = block.symbol(mnemonic);
+  const uint32_t num_prefixes = reader.ReadWord();
+  view.prefixes =
+      StringListView(names.data(), reader.ReadWords(num_prefixes),
+                     num_prefixes);
+  ReadCompactOperands(block, names, reader, view.input_operands);
+  ReadCompactOperands(block, names, reader, view.implicit_input_operands);
+  ReadCompactOperands(block, names, reader, view.output_operands);
+  ReadCompactOperands(block, names, reader, view.implicit_output_operands);
+}
+
+// Reserves space for `num_additional` elements in `vector`. Grows the capacity
+// at least geometrically, so that calling this for each basic block does not
+// lead to quadratic behavior.
+template <typename T>
+void ReserveAdditional(std::vector<T>& vector, size_t num_additional) {
+  const size_t required = vector.size() + num_additional;
+  if (required <= vector.capacity()) return;
+  vector.reserve(std::max(required, 2 * vector.capacity()));
+}
+
 }  // namespace
 
 #define EXEGESIS_ENUM_CASE(os, enum_value) \
@@ -107,6 +263,15 @@ std::ostream& operator<<(std::ostream& os, EdgeType edge_type) {
   return os;
 }
 
+std::ostream& operator<<(std::ostream& os, LiveInfoMode live_info_mode) {
+  switch (live_info_mode) {
+    EXEGESIS_ENUM_CASE(os, LiveInfoMode::kNoLiveInfo);
+    EXEGESIS_ENUM_CASE(os, LiveInfoMode::kPerBasicBlockLiveInfo);
+    EXEGESIS_ENUM_CASE(os, LiveInfoMode::kPerFunctionLiveInfo);
+  }
+  return os;
+}
+
 #undef EXEGESIS_ENUM_CASE
 
 BasicBlockGraphBuilder::AddBasicBlockTransaction::AddBasicBlockTransaction(
@@ -120,9 +285,12 @@ BasicBlockGraphBuilder::AddBasicBlockTransaction::AddBasicBlockTransaction(
       prev_node_features_size_(graph_builder->node_features_.size()),
       prev_edge_senders_size_(graph_builder->edge_senders_.size()),
       prev_edge_receivers_size_(graph_builder->edge_receivers_.size()),
-      prev_edge_types_size_(graph_builder->edge_receivers_.size()),
-      prev_global_features_size_(graph_builder->global_features_.size()),
-      prev_interference_groups_(graph_builder->interference_groups_) {}
+      prev_edge_types_size_(graph_builder->edge_types_.size()),
+      prev_edge_features_size_(graph_builder->edge_features_.size()),
+      prev_instruction_node_mask_size_(
+          graph_builder->instruction_node_mask_.size()),
+      prev_delta_block_index_size_(graph_builder->delta_block_index_.size()),
+      prev_global_features_size_(graph_builder->global_features_.size()) {}
 
 BasicBlockGraphBuilder::AddBasicBlockTransaction::~AddBasicBlockTransaction() {
   if (!is_committed_) Rollback();
@@ -150,12 +318,38 @@ void BasicBlockGraphBuilder::AddBasicBlockTransaction::Rollback() {
   GEMATRIA_CHECK_AND_RESIZE(edge_senders_);
   GEMATRIA_CHECK_AND_RESIZE(edge_receivers_);
   GEMATRIA_CHECK_AND_RESIZE(edge_types_);
+  GEMATRIA_CHECK_AND_RESIZE(edge_features_);
+  GEMATRIA_CHECK_AND_RESIZE(instruction_node_mask_);
+  GEMATRIA_CHECK_AND_RESIZE(delta_block_index_);
   GEMATRIA_CHECK_AND_RESIZE(global_features_);
-  graph_builder_.interference_groups_ = std::move(prev_interference_groups_);
+  // The per-block maps refer to the nodes and to the instructions of the basic
+  // block that is being rolled back.
+  graph_builder_.register_nodes_.clear();
+  graph_builder_.alias_group_nodes_.clear();
+  graph_builder_.interference_.Clear();
 }
 
 #undef GEMATRIA_CHECK_AND_RESIZE
 
+std::shared_ptr<const BasicBlockGraphBuilder::Vocabulary>
+BasicBlockGraphBuilder::MakeVocabulary(std::vector<std::string> tokens) {
+  auto vocabulary = std::make_shared<Vocabulary>();
+  // The index is built only after the tokens are moved to their final
+  // location, so that the keys of the index remain valid.
+  vocabulary->tokens = std::move(tokens);
+  vocabulary->index.reserve(vocabulary->tokens.size());
+  for (TokenIndex i = 0; i < vocabulary->tokens.size(); ++i) {
+    const auto insertion_result =
+        vocabulary->index.emplace(vocabulary->tokens[i], i);
+    if (!insertion_result.second) {
+      // TODO(ondrasej): Make this return a status.
+      std::cerr << "Duplicate item: '" << insertion_result.first->first << "'";
+      std::abort();
+    }
+  }
+  return vocabulary;
+}
+
 BasicBlockGraphBuilder::BasicBlockGraphBuilder(
     std::vector<std::string> node_tokens, std::string_view immediate_token,
     std::string_view fp_immediate_token, std::string_view address_token,
@@ -163,97 +357,455 @@ BasicBlockGraphBuilder::BasicBlockGraphBuilder(
     OutOfVocabularyTokenBehavior
         out_of_vocabulary_behavior /* = ReturnError() */
     )
-    : node_tokens_(MakeIndex(std::move(node_tokens))),
-      // TODO(ondrasej): Remove the std::string conversions once we switch to
-      // C++20 and std::unordered_map gains templated lookup functions.
-      immediate_token_(
-          FindTokenOrDie(node_tokens_, std::string(immediate_token))),
+    : vocabulary_(MakeVocabulary(std::move(node_tokens))),
+      immediate_token_(FindTokenOrDie(vocabulary_->index, immediate_token)),
       fp_immediate_token_(
-          FindTokenOrDie(node_tokens_, std::string(fp_immediate_token))),
-      address_token_(FindTokenOrDie(node_tokens_, std::string(address_token))),
-      memory_token_(FindTokenOrDie(node_tokens_, std::string(memory_token))),
+          FindTokenOrDie(vocabulary_->index, fp_immediate_token)),
+      address_token_(FindTokenOrDie(vocabulary_->index, address_token)),
+      memory_token_(FindTokenOrDie(vocabulary_->index, memory_token)),
       out_of_vocabulary_behavior_(out_of_vocabulary_behavior),
       replacement_token_(
           out_of_vocabulary_behavior.behavior_type() ==
                   OutOfVocabularyTokenBehavior::BehaviorType::kReturnError
               ? kInvalidTokenIndex
               : FindTokenOrDie(
-                    node_tokens_,
+                    vocabulary_->index,
                     out_of_vocabulary_behavior.replacement_token())) {}
 
+BasicBlockGraphBuilder::BasicBlockGraphBuilder(
+    EmptyCopyTag, const BasicBlockGraphBuilder& other)
+    : vocabulary_(other.vocabulary_),
+      immediate_token_(other.immediate_token_),
+      fp_immediate_token_(other.fp_immediate_token_),
+      address_token_(other.address_token_),
+      memory_token_(other.memory_token_),
+      out_of_vocabulary_behavior_(other.out_of_vocabulary_behavior_),
+      replacement_token_(other.replacement_token_),
+      symbol_table_(other.symbol_table_),
+      symbol_tokens_(other.symbol_tokens_),
+      live_info_mode_(other.live_info_mode_) {}
+
 bool BasicBlockGraphBuilder::AddBasicBlockFromInstructions(
     const std::vector<Instruction>& instructions) {
+  GEMATRIA_TRACE_SCOPE("BasicBlockGraphBuilder::AddBasicBlockFromInstructions");
+  if (instructions.empty()) return false;
+  uint64_t fingerprint = 0;
+  if (deduplicate_blocks_) {
+    fingerprint = BasicBlockFingerprint(instructions);
+    if (AddDuplicateBasicBlock(fingerprint)) return true;
+  }
+  return AddBasicBlockFromInstructionViews(
+      static_cast<int>(instructions.size()), fingerprint,
+      [&instructions](int index, InstructionView& view) {
+        MakeInstructionView(instructions[index], view);
+      });
+}
+
+bool BasicBlockGraphBuilder::AddBasicBlockFromInstructionPointers(
+    const std::vector<const Instruction*>& instructions) {
+  GEMATRIA_TRACE_SCOPE(
+      "BasicBlockGraphBuilder::AddBasicBlockFromInstructionPointers");
   if (instructions.empty()) return false;
-  AddBasicBlockTransaction transaction(this);
+  uint64_t fingerprint = 0;
+  if (deduplicate_blocks_) {
+    fingerprint = BasicBlockFingerprint(instructions);
+    if (AddDuplicateBasicBlock(fingerprint)) return true;
+  }
+  return AddBasicBlockFromInstructionViews(
+      static_cast<int>(instructions.size()), fingerprint,
+      [&instructions](int index, InstructionView& view) {
+        MakeInstructionView(*instructions[index], view);
+      });
+}
+
+bool BasicBlockGraphBuilder::AddCompactBasicBlock(
+    const CompactBasicBlock& block) {
+  GEMATRIA_TRACE_SCOPE("BasicBlockGraphBuilder::AddCompactBasicBlock");
+  assert(symbol_table_ != nullptr &&
+         "Compact basic blocks require a symbol table; see SetSymbolTable()");
+  if (block.empty()) return false;
+  if (deduplicate_blocks_ && AddDuplicateBasicBlock(block.fingerprint())) {
+    return true;
+  }
+  // Each symbol is looked up in the symbol table once per basic block; the
+  // views of the instructions then refer to the names by their local symbols.
+  compact_symbol_names_.resize(block.num_symbols());
+  for (int i = 0; i < block.num_symbols(); ++i) {
+    compact_symbol_names_[i] = symbol_table_->Name(block.symbol(i));
+  }
+  CompactBasicBlock::Reader reader(block);
+  const bool added = AddBasicBlockFromInstructionViews(
+      block.num_instructions(), block.fingerprint(),
+      [this, &block, &reader](int /*index*/, InstructionView& view) {
+        ReadCompactInstruction(block, compact_symbol_names_, reader, view);
+      });
+  assert(!added || reader.at_end());
+  return added;
+}
+
+bool BasicBlockGraphBuilder::AddDuplicateBasicBlock(uint64_t fingerprint) {
+  const auto it = graph_by_fingerprint_.find(fingerprint);
+  if (it == graph_by_fingerprint_.end()) return false;
+  GEMATRIA_TRACE_COUNTER("BasicBlockGraphBuilder::deduplicated_blocks", 1);
+  block_graph_indices_.push_back(it->second);
+  return true;
+}
+
+void BasicBlockGraphBuilder::MakeInstructionView(const Instruction& instruction,
+                                                 InstructionView& view) {
+  view.mnemonic = instruction.mnemonic;
+  view.mnemonic_symbol = instruction.mnemonic_symbol;
+  view.prefixes = instruction.prefixes;
+  const auto make_operand_views = [](const std::vector<InstructionOperand>&
+                                         operands,
+                                     std::vector<OperandView>& views) {
+    views.resize(operands.size());
+    for (size_t i = 0; i < operands.size(); ++i) {
+      const InstructionOperand& operand = operands[i];
+      OperandView& operand_view = views[i];
+      operand_view = OperandView();
+      operand_view.type = operand.type();
+      switch (operand.type()) {
+        case OperandType::kRegister:
+          operand_view.register_operand.name = operand.register_name();
+          operand_view.register_symbol = operand.register_symbol();
+          break;
+        case OperandType::kVirtualRegister:
+          operand_view.register_operand = {
+              operand.register_name(), operand.getInterferedRegisters(),
+              operand.getInterferedRegistersSize()};
+          operand_view.register_size = static_cast<int>(operand.size());
+          break;
+        case OperandType::kAddress: {
+          const AddressTuple& address = operand.address();
+          operand_view.base_register = {
+              address.base_register, address.base_register_intefered_register,
+              address.base_register_intefered_register_sizes};
+          operand_view.index_register = {
+              address.index_register,
+              address.index_register_intefered_register,
+              address.index_register_intefered_register_sizes};
+          operand_view.segment_register = {
+              address.segment_register,
+              address.segment_register_intefered_register,
+              address.segment_register_intefered_register_sizes};
+          operand_view.displacement = address.displacement;
+        } break;
+        case OperandType::kMemory:
+          operand_view.alias_group_id = operand.alias_group_id();
+          break;
+        case OperandType::kImmediateValue:
+        case OperandType::kFpImmediateValue:
+        case OperandType::kUnknown:
+          break;
+      }
+    }
+  };
+  make_operand_views(instruction.input_operands, view.input_operands);
+  make_operand_views(instruction.implicit_input_operands,
+                     view.implicit_input_operands);
+  make_operand_views(instruction.output_operands, view.output_operands);
+  make_operand_views(instruction.implicit_output_operands,
+                     view.implicit_output_operands);
+}
 
+void BasicBlockGraphBuilder::StartBasicBlock() {
   // Clear the maps that are maintained per basic block.
   register_nodes_.clear();
   alias_group_nodes_.clear();
-  interference_groups_.clear();
+  interference_.Clear();
+}
 
-  const int prev_num_nodes = num_nodes();
-  const int prev_num_edges = num_edges();
+template <bool kAddInterference>
+bool BasicBlockGraphBuilder::AddInstruction(
+    const InstructionView& instruction, NodeIndex& previous_instruction_node) {
+  // Add the instruction node.
+  const NodeIndex instruction_node =
+      AddNode(NodeType::kInstruction, instruction.mnemonic,
+              instruction.mnemonic_symbol);
+  if (instruction_node == kInvalidNode) {
+    return false;
+  }
 
-  NodeIndex previous_instruction_node = kInvalidNode;
-  for (const Instruction& instruction : instructions) {
-    // Add the instruction node.
-    const NodeIndex instruction_node =
-        AddNode(NodeType::kInstruction, instruction.mnemonic);
-    if (instruction_node == kInvalidNode) {
+  // Add nodes for prefixes of the instruction.
+  for (size_t i = 0; i < instruction.prefixes.size(); ++i) {
+    const NodeIndex prefix_node =
+        AddNode(NodeType::kPrefix, instruction.prefixes[i]);
+    if (prefix_node == kInvalidNode) {
       return false;
     }
+    AddEdge(EdgeType::kInstructionPrefix, prefix_node, instruction_node);
+  }
 
-    // Add nodes for prefixes of the instruction.
-    for (const std::string& prefix : instruction.prefixes) {
-      const NodeIndex prefix_node = AddNode(NodeType::kPrefix, prefix);
-      if (prefix_node == kInvalidNode) {
-        return false;
-      }
-      AddEdge(EdgeType::kInstructionPrefix, prefix_node, instruction_node);
-    }
+  // Add a structural dependency edge from the previous instruction.
+  if (previous_instruction_node >= 0) {
+    AddEdge(EdgeType::kStructuralDependency, previous_instruction_node,
+            instruction_node);
+  }
 
-    // Add a structural dependency edge from the previous instruction.
-    if (previous_instruction_node >= 0) {
-      AddEdge(EdgeType::kStructuralDependency, previous_instruction_node,
-              instruction_node);
+  // Add edges for input operands. And nodes too, if necessary.
+  for (const OperandView& operand : instruction.input_operands) {
+    if (!AddInputOperand<kAddInterference>(instruction_node, operand)) {
+      return false;
     }
+  }
+  for (const OperandView& operand : instruction.implicit_input_operands) {
+    if (!AddInputOperand<kAddInterference>(instruction_node, operand)) {
+      return false;
+    }
+  }
 
-    // Add edges for input operands. And nodes too, if necessary.
-    for (const InstructionOperand& operand : instruction.input_operands) {
-      if (!AddInputOperand(instruction_node, operand)) return false;
+  // Add edges and nodes for output operands.
+  for (const OperandView& operand : instruction.output_operands) {
+    if (!AddOutputOperand<kAddInterference>(instruction_node, operand)) {
+      return false;
     }
-    for (const InstructionOperand& operand :
-         instruction.implicit_input_operands) {
-      if (!AddInputOperand(instruction_node, operand)) return false;
+  }
+  for (const OperandView& operand : instruction.implicit_output_operands) {
+    if (!AddOutputOperand<kAddInterference>(instruction_node, operand)) {
+      return false;
     }
+  }
+
+  previous_instruction_node = instruction_node;
+  return true;
+}
+
+void BasicBlockGraphBuilder::FinishBasicBlock(int first_node, int first_edge,
+                                              uint64_t fingerprint) {
+  const size_t global_features_offset = global_features_.size();
+  global_features_.resize(global_features_offset + num_node_tokens(), 0);
+  int* const global_features = global_features_.data() + global_features_offset;
+  for (NodeIndex i = first_node; i < node_features_.size(); ++i) {
+    ++global_features[node_features_[i]];
+  }
+
+  // Record the number of nodes and edges created for this graph.
+  num_nodes_per_block_.push_back(num_nodes() - first_node);
+  num_edges_per_block_.push_back(num_edges() - first_edge);
+
+  const int graph_index = num_graphs() - 1;
+  if (deduplicate_blocks_) {
+    graph_by_fingerprint_.emplace(fingerprint, graph_index);
+    graph_fingerprints_.push_back(fingerprint);
+    graph_first_blocks_.push_back(num_blocks());
+  }
+  block_graph_indices_.push_back(graph_index);
+}
 
-    // Add edges and nodes for output operands.
-    for (const InstructionOperand& operand : instruction.output_operands) {
-      if (!AddOutputOperand(instruction_node, operand)) return false;
+std::vector<bool> BasicBlockGraphBuilder::AddBasicBlocksInParallel(
+    const std::vector<BasicBlock>& blocks, int num_threads) {
+  GEMATRIA_TRACE_SCOPE("BasicBlockGraphBuilder::AddBasicBlocksInParallel");
+  std::vector<bool> added(blocks.size(), false);
+  const int num_shards =
+      static_cast<int>(std::min<size_t>(std::max(num_threads, 1),
+                                        blocks.size()));
+  // Deduplication needs to see all blocks that were added before the current
+  // one, so it can't be split into independent shards.
+  if (num_shards <= 1 || deduplicate_blocks_) {
+    ReserveForBasicBlocks(blocks);
+    for (size_t i = 0; i < blocks.size(); ++i) {
+      added[i] = AddBasicBlock(blocks[i]);
     }
-    for (const InstructionOperand& operand :
-         instruction.implicit_output_operands) {
-      if (!AddOutputOperand(instruction_node, operand)) return false;
+    return added;
+  }
+
+  // Each shard is a contiguous range of blocks, so that concatenating the
+  // shards in order preserves the order of the blocks. `std::vector<bool>`
+  // packs its elements, so the shards record their results in their own
+  // vectors rather than writing to `added` concurrently.
+  const size_t shard_size = (blocks.size() + num_shards - 1) / num_shards;
+  std::vector<BasicBlockGraphBuilder> shards;
+  shards.reserve(num_shards);
+  for (int shard = 0; shard < num_shards; ++shard) {
+    shards.push_back(BasicBlockGraphBuilder(EmptyCopyTag(), *this));
+  }
+  std::vector<std::vector<bool>> shard_added(num_shards);
+  std::vector<std::thread> threads;
+  threads.reserve(num_shards);
+  for (int shard = 0; shard < num_shards; ++shard) {
+    const size_t begin = std::min(blocks.size(), shard * shard_size);
+    const size_t end = std::min(blocks.size(), begin + shard_size);
+    threads.emplace_back([&, shard, begin, end]() {
+      shard_added[shard].reserve(end - begin);
+      for (size_t i = begin; i < end; ++i) {
+        shard_added[shard].push_back(shards[shard].AddBasicBlock(blocks[i]));
+      }
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+
+  int total_graphs = 0;
+  int total_nodes = 0;
+  int total_edges = 0;
+  for (const BasicBlockGraphBuilder& shard_builder : shards) {
+    total_graphs += shard_builder.num_graphs();
+    total_nodes += shard_builder.num_nodes();
+    total_edges += shard_builder.num_edges();
+  }
+  Reserve(total_graphs, total_nodes, total_edges);
+
+  size_t block_index = 0;
+  for (int shard = 0; shard < num_shards; ++shard) {
+    AppendShard(shards[shard]);
+    for (const bool shard_block_added : shard_added[shard]) {
+      added[block_index++] = shard_block_added;
     }
+  }
+  return added;
+}
+
+void BasicBlockGraphBuilder::AppendShard(const BasicBlockGraphBuilder& shard) {
+  GEMATRIA_TRACE_SCOPE("BasicBlockGraphBuilder::AppendShard");
+  assert(shard.vocabulary_ == vocabulary_);
+  assert(!deduplicate_blocks_ && !shard.deduplicate_blocks_);
+  const NodeIndex node_offset = num_nodes();
+  const int graph_offset = num_graphs();
 
-    previous_instruction_node = instruction_node;
+  block_graph_indices_.reserve(block_graph_indices_.size() +
+                               shard.block_graph_indices_.size());
+  for (const int graph_index : shard.block_graph_indices_) {
+    block_graph_indices_.push_back(graph_index + graph_offset);
   }
 
-  global_features_.emplace_back(num_node_tokens(), 0);
-  std::vector<int>& global_features = global_features_.back();
-  for (NodeIndex i = prev_num_nodes; i < node_features_.size(); ++i) {
-    ++global_features[node_features_[i]];
+  num_nodes_per_block_.insert(num_nodes_per_block_.end(),
+                              shard.num_nodes_per_block_.begin(),
+                              shard.num_nodes_per_block_.end());
+  num_edges_per_block_.insert(num_edges_per_block_.end(),
+                              shard.num_edges_per_block_.begin(),
+                              shard.num_edges_per_block_.end());
+  node_types_.insert(node_types_.end(), shard.node_types_.begin(),
+                     shard.node_types_.end());
+  node_features_.insert(node_features_.end(), shard.node_features_.begin(),
+                        shard.node_features_.end());
+  edge_senders_.reserve(edge_senders_.size() + shard.edge_senders_.size());
+  for (const NodeIndex sender : shard.edge_senders_) {
+    edge_senders_.push_back(sender + node_offset);
   }
+  edge_receivers_.reserve(edge_receivers_.size() +
+                          shard.edge_receivers_.size());
+  for (const NodeIndex receiver : shard.edge_receivers_) {
+    edge_receivers_.push_back(receiver + node_offset);
+  }
+  edge_types_.insert(edge_types_.end(), shard.edge_types_.begin(),
+                     shard.edge_types_.end());
+  edge_features_.insert(edge_features_.end(), shard.edge_features_.begin(),
+                        shard.edge_features_.end());
+  instruction_node_mask_.insert(instruction_node_mask_.end(),
+                                shard.instruction_node_mask_.begin(),
+                                shard.instruction_node_mask_.end());
+  delta_block_index_.reserve(delta_block_index_.size() +
+                             shard.delta_block_index_.size());
+  for (const int block_index : shard.delta_block_index_) {
+    delta_block_index_.push_back(block_index + graph_offset);
+  }
+  global_features_.insert(global_features_.end(),
+                          shard.global_features_.begin(),
+                          shard.global_features_.end());
 
-  // Record the number of nodes and edges created for this graph.
-  num_nodes_per_block_.push_back(num_nodes() - prev_num_nodes);
-  num_edges_per_block_.push_back(num_edges() - prev_num_edges);
+  // After the shards are appended, the per-block state describes the last
+  // block added by the last shard, as it would after adding the blocks
+  // serially.
+  register_nodes_ = shard.register_nodes_;
+  for (auto& [register_name, node_index] : register_nodes_) {
+    node_index += node_offset;
+  }
+  alias_group_nodes_ = shard.alias_group_nodes_;
+  for (auto& [alias_group_id, node_index] : alias_group_nodes_) {
+    node_index += node_offset;
+  }
+  interference_ = shard.interference_;
+}
 
-  transaction.Commit();
-  return true;
+void BasicBlockGraphBuilder::Reserve(int num_graphs, int num_nodes,
+                                     int num_edges) {
+  ReserveAdditional(block_graph_indices_, num_graphs);
+  ReserveAdditional(num_nodes_per_block_, num_graphs);
+  ReserveAdditional(num_edges_per_block_, num_graphs);
+  ReserveAdditional(global_features_,
+                    static_cast<size_t>(num_graphs) * num_node_tokens());
+
+  ReserveAdditional(node_types_, num_nodes);
+  ReserveAdditional(node_features_, num_nodes);
+  ReserveAdditional(instruction_node_mask_, num_nodes);
+
+  ReserveAdditional(edge_senders_, num_edges);
+  ReserveAdditional(edge_receivers_, num_edges);
+  ReserveAdditional(edge_types_, num_edges);
+  ReserveAdditional(edge_features_, num_edges);
+}
+
+void BasicBlockGraphBuilder::ReserveForBasicBlocks(
+    const std::vector<BasicBlock>& blocks) {
+  int64_t num_instructions = 0;
+  GraphSizeEstimate total;
+  for (const BasicBlock& block : blocks) {
+    const GraphSizeEstimate estimate = EstimateGraphSize(
+        block, live_info_mode_ != LiveInfoMode::kNoLiveInfo);
+    total.num_nodes += estimate.num_nodes;
+    total.num_edges += estimate.num_edges;
+    num_instructions += block.instructions.size();
+  }
+  Reserve(static_cast<int>(blocks.size()), static_cast<int>(total.num_nodes),
+          static_cast<int>(total.num_edges));
+  ReserveAdditional(delta_block_index_, num_instructions);
+}
+
+void BasicBlockGraphBuilder::RemoveLastBasicBlock() {
+  assert(num_blocks() > 0);
+  block_graph_indices_.pop_back();
+  if (deduplicate_blocks_) {
+    // The last basic block was a duplicate of an earlier one; it did not add a
+    // graph.
+    if (graph_first_blocks_.back() != num_blocks()) return;
+    graph_by_fingerprint_.erase(graph_fingerprints_.back());
+    graph_fingerprints_.pop_back();
+    graph_first_blocks_.pop_back();
+  }
+
+  const int num_nodes_to_keep = num_nodes() - num_nodes_per_block_.back();
+  const int num_edges_to_keep = num_edges() - num_edges_per_block_.back();
+  num_nodes_per_block_.pop_back();
+  num_edges_per_block_.pop_back();
+
+  node_types_.resize(num_nodes_to_keep);
+  node_features_.resize(num_nodes_to_keep);
+
+  edge_senders_.resize(num_edges_to_keep);
+  edge_receivers_.resize(num_edges_to_keep);
+  edge_types_.resize(num_edges_to_keep);
+  edge_features_.resize(num_edges_to_keep);
+  instruction_node_mask_.resize(num_nodes_to_keep);
+  // The instructions of the removed graph are at the end of the delta block
+  // index.
+  const int removed_graph_index = num_graphs();
+  while (!delta_block_index_.empty() &&
+         delta_block_index_.back() == removed_graph_index) {
+    delta_block_index_.pop_back();
+  }
+
+  global_features_.resize(global_features_.size() - num_node_tokens());
+  // The interference groups are rebuilt for each basic block; there is no need
+  // to restore the ones of the previous block.
+  interference_.Clear();
+}
+
+void BasicBlockGraphBuilder::SetDeduplicateBlocks(bool enabled) {
+  Reset();
+  deduplicate_blocks_ = enabled;
+}
+
+void BasicBlockGraphBuilder::SetLiveInfoMode(LiveInfoMode live_info_mode) {
+  Reset();
+  live_info_mode_ = live_info_mode;
 }
 
 void BasicBlockGraphBuilder::Reset() {
+  graph_by_fingerprint_.clear();
+  graph_fingerprints_.clear();
+  graph_first_blocks_.clear();
+  block_graph_indices_.clear();
+
   num_nodes_per_block_.clear();
   num_edges_per_block_.clear();
 
@@ -263,15 +815,42 @@ void BasicBlockGraphBuilder::Reset() {
   edge_senders_.clear();
   edge_receivers_.clear();
   edge_types_.clear();
+  edge_features_.clear();
+  instruction_node_mask_.clear();
+  delta_block_index_.clear();
 
   global_features_.clear();
-  interference_groups_.clear();
+  interference_.Clear();
+}
+
+int BasicBlockGraphBuilder::InterferenceMatrix::RegisterIndex(
+    std::string_view register_name) {
+  const auto [it, inserted] =
+      indices_.emplace(register_name, static_cast<int>(names_.size()));
+  if (inserted) {
+    names_.push_back(register_name);
+    // Add a new row to the lower-triangular matrix.
+    bits_.resize(bits_.size() + names_.size(), false);
+  }
+  return it->second;
+}
+
+bool BasicBlockGraphBuilder::InterferenceMatrix::Insert(int a, int b) {
+  std::vector<bool>::reference bit = bits_[BitIndex(a, b)];
+  if (bit) return false;
+  bit = true;
+  return true;
+}
+
+void BasicBlockGraphBuilder::InterferenceMatrix::Clear() {
+  indices_.clear();
+  names_.clear();
+  bits_.clear();
 }
 
 bool BasicBlockGraphBuilder::AddInterference(
-    const std::string& src_name, const std::string& src_token,
-    const std::vector<std::string>& dest_names,
-    const std::vector<int>& dest_sizes) {
+    std::string_view src_name, std::string_view src_token,
+    StringListView dest_names, IntListView dest_sizes) {
   assert(dest_names.size() == dest_sizes.size() &&
          "dest_names and dest_sizes should have the same size");
   assert(
@@ -289,33 +868,36 @@ bool BasicBlockGraphBuilder::AddInterference(
     // happen
     return false;
   }
-  std::vector<std::string> dest_tokens(dest_names.size());
-  for (int i = 0; i < dest_names.size(); ++i) {
-    if (IS_VREG(dest_names[i]))
-      dest_tokens[i] = getVREG_TOKEN(dest_sizes[i]);
-    else
-      dest_tokens[i] = dest_names[i];
-  }
+  const int src_index = interference_.RegisterIndex(src_name);
+  std::string vreg_token;
   for (int i = 0; i < dest_names.size(); ++i) {
-    if (interference_groups_[src_name].count(dest_names[i]) > 0) {
+    const int dest_index = interference_.RegisterIndex(dest_names[i]);
+    if (interference_.Contains(src_index, dest_index)) {
       continue;
     }
-    auto added = AddDependencyOnRegister(
-        operand_node, dest_names[i], dest_tokens[i], EdgeType::kInterference);
+    const std::string_view dest_name = dest_names[i];
+    std::string_view dest_token = dest_name;
+    if (IS_VREG(dest_name)) {
+      vreg_token = getVREG_TOKEN(dest_sizes[i]);
+      dest_token = vreg_token;
+    }
+    auto added = AddDependencyOnRegister(operand_node, dest_name, dest_token,
+                                         EdgeType::kInterference);
     if (!added) return false;
-    added = AddDependencyToRegister(operand_node, dest_names[i], dest_tokens[i],
+    added = AddDependencyToRegister(operand_node, dest_name, dest_token,
                                     EdgeType::kInterference);
     if (!added) return false;
-    interference_groups_[src_name].insert(dest_names[i]);
-    interference_groups_[dest_names[i]].insert(src_name);
+    interference_.Insert(src_index, dest_index);
   }
   LOG("Done adding interference");
   LOG("=====================================");
   LOG("Current interference groups: ");
-  for (auto& [key, value] : interference_groups_) {
-    LOG(key << " -> ");
-    for (auto& v : value) {
-      LOG("  " << v);
+  for (int i = 0; i < interference_.num_registers(); ++i) {
+    LOG(interference_.register_name(i) << " -> ");
+    for (int j = 0; j < interference_.num_registers(); ++j) {
+      if (interference_.Contains(i, j)) {
+        LOG("  " << interference_.register_name(j));
+      }
     }
   }
   LOG("Current register nodes: ");
@@ -326,28 +908,31 @@ bool BasicBlockGraphBuilder::AddInterference(
   return true;
 }
 
-bool BasicBlockGraphBuilder::AddInputOperand(
-    NodeIndex instruction_node, const InstructionOperand& operand) {
+template <bool kAddInterference>
+bool BasicBlockGraphBuilder::AddInputOperand(NodeIndex instruction_node,
+                                             const OperandView& operand) {
   assert(instruction_node >= 0);
   assert(instruction_node < num_nodes());
 
-  switch (operand.type()) {
+  switch (operand.type) {
     case OperandType::kRegister: {
-      if (!AddDependencyOnRegister(instruction_node, operand.register_name(),
-                                   operand.register_name(),
-                                   EdgeType::kInputOperands)) {
+      const std::string_view register_name = operand.register_operand.name;
+      if (!AddDependencyOnRegister(instruction_node, register_name,
+                                   register_name, EdgeType::kInputOperands,
+                                   operand.register_symbol)) {
         return false;
       }
     } break;
     case OperandType::kVirtualRegister: {
-      std::string vreg_name = getVREG_TOKEN(operand.size());
-      if (!AddDependencyOnRegister(instruction_node, operand.register_name(),
-                                   vreg_name, EdgeType::kInputOperands)) {
+      const RegisterView& vreg = operand.register_operand;
+      std::string vreg_name = getVREG_TOKEN(operand.register_size);
+      if (!AddDependencyOnRegister(instruction_node, vreg.name, vreg_name,
+                                   EdgeType::kInputOperands)) {
         return false;
       }
-      if (!AddInterference(operand.register_name(), vreg_name,
-                           operand.getInterferedRegisters(),
-                           operand.getInterferedRegistersSize())) {
+      if (kAddInterference &&
+          !AddInterference(vreg.name, vreg_name, vreg.interfered_registers,
+                           vreg.interfered_register_sizes)) {
         return false;
       }
     } break;
@@ -364,59 +949,18 @@ bool BasicBlockGraphBuilder::AddInputOperand(
     case OperandType::kAddress: {
       const NodeIndex address_node =
           AddNode(NodeType::kAddressOperand, address_token_);
-      const AddressTuple& address_tuple = operand.address();
-      if (!address_tuple.base_register.empty()) {
-        bool is_virtual_reg = IS_VREG(address_tuple.base_register);
-        std::string vreg_token = getVREG_TOKEN(64);
-        bool result = AddDependencyOnRegister(
-            address_node, address_tuple.base_register,
-            is_virtual_reg ? vreg_token : address_tuple.base_register,
-            EdgeType::kAddressBaseRegister);
-        if (is_virtual_reg) {
-          result &= AddInterference(
-              address_tuple.base_register, vreg_token,
-              address_tuple.base_register_intefered_register,
-              address_tuple.base_register_intefered_register_sizes);
-        }
-        if (result == false) {
-          return false;
-        }
-      }
-      if (!address_tuple.index_register.empty()) {
-        bool is_virtual_reg = IS_VREG(address_tuple.index_register);
-        std::string vreg_token = getVREG_TOKEN(64);
-        bool result = AddDependencyOnRegister(
-            address_node, address_tuple.index_register,
-            is_virtual_reg ? vreg_token : address_tuple.index_register,
-            EdgeType::kAddressIndexRegister);
-        if (is_virtual_reg) {
-          result &= AddInterference(
-              address_tuple.index_register, vreg_token,
-              address_tuple.index_register_intefered_register,
-              address_tuple.index_register_intefered_register_sizes);
-        }
-        if (result == false) {
-          return false;
-        }
-      }
-      if (!address_tuple.segment_register.empty()) {
-        bool is_virtual_reg = IS_VREG(address_tuple.segment_register);
-        std::string vreg_token = getVREG_TOKEN(64);
-        bool result = AddDependencyOnRegister(
-            address_node, address_tuple.segment_register,
-            is_virtual_reg ? vreg_token : address_tuple.segment_register,
-            EdgeType::kAddressSegmentRegister);
-        if (is_virtual_reg) {
-          result &= AddInterference(
-              address_tuple.segment_register, vreg_token,
-              address_tuple.segment_register_intefered_register,
-              address_tuple.segment_register_intefered_register_sizes);
-        }
-        if (result == false) {
-          return false;
-        }
+      if (!AddAddressRegister<kAddInterference>(
+              address_node, operand.base_register,
+              EdgeType::kAddressBaseRegister) ||
+          !AddAddressRegister<kAddInterference>(
+              address_node, operand.index_register,
+              EdgeType::kAddressIndexRegister) ||
+          !AddAddressRegister<kAddInterference>(
+              address_node, operand.segment_register,
+              EdgeType::kAddressSegmentRegister)) {
+        return false;
       }
-      if (address_tuple.displacement != 0) {
+      if (operand.displacement != 0) {
         AddEdge(EdgeType::kAddressDisplacement,
                 AddNode(NodeType::kImmediate, immediate_token_), address_node);
       }
@@ -425,7 +969,7 @@ bool BasicBlockGraphBuilder::AddInputOperand(
     } break;
     case OperandType::kMemory: {
       NodeIndex& alias_group_node = LookupOrInsert(
-          alias_group_nodes_, operand.alias_group_id(), kInvalidNode);
+          alias_group_nodes_, operand.alias_group_id, kInvalidNode);
       if (alias_group_node == kInvalidNode) {
         alias_group_node = AddNode(NodeType::kMemoryOperand, memory_token_);
       }
@@ -439,27 +983,50 @@ bool BasicBlockGraphBuilder::AddInputOperand(
   return true;
 }
 
-bool BasicBlockGraphBuilder::AddOutputOperand(
-    NodeIndex instruction_node, const InstructionOperand& operand) {
+template <bool kAddInterference>
+bool BasicBlockGraphBuilder::AddAddressRegister(
+    NodeIndex dependent_node, const RegisterView& address_register,
+    EdgeType edge_type) {
+  if (address_register.name.empty()) return true;
+  const bool is_virtual_reg = IS_VREG(address_register.name);
+  std::string vreg_token = getVREG_TOKEN(64);
+  bool result = AddDependencyOnRegister(
+      dependent_node, address_register.name,
+      is_virtual_reg ? vreg_token : address_register.name, edge_type);
+  if (kAddInterference && is_virtual_reg) {
+    result &= AddInterference(address_register.name, vreg_token,
+                              address_register.interfered_registers,
+                              address_register.interfered_register_sizes);
+  }
+  return result;
+}
+
+template <bool kAddInterference>
+bool BasicBlockGraphBuilder::AddOutputOperand(NodeIndex instruction_node,
+                                              const OperandView& operand) {
   assert(instruction_node >= 0);
   assert(instruction_node < num_nodes());
 
-  switch (operand.type()) {
+  switch (operand.type) {
     case OperandType::kRegister: {
-      const NodeIndex register_node =
-          AddNode(NodeType::kRegister, operand.register_name());
+      const std::string_view register_name = operand.register_operand.name;
+      const NodeIndex register_node = AddNode(
+          NodeType::kRegister, register_name, operand.register_symbol);
       if (register_node == kInvalidNode) return false;
       AddEdge(EdgeType::kOutputOperands, instruction_node, register_node);
-      register_nodes_[operand.register_name()] = register_node;
+      register_nodes_[register_name] = register_node;
     } break;
     case OperandType::kVirtualRegister: {
-      std::string vreg_token = getVREG_TOKEN(operand.size());
-      bool result =
-          AddDependencyToRegister(instruction_node, operand.register_name(),
-                                  vreg_token, EdgeType::kOutputOperands);
-      result &= AddInterference(operand.register_name(), vreg_token,
-                                operand.getInterferedRegisters(),
-                                operand.getInterferedRegistersSize());
+      const RegisterView& vreg = operand.register_operand;
+      std::string vreg_token = getVREG_TOKEN(operand.register_size);
+      bool result = AddDependencyToRegister(instruction_node, vreg.name,
+                                            vreg_token,
+                                            EdgeType::kOutputOperands);
+      if (kAddInterference) {
+        result &= AddInterference(vreg.name, vreg_token,
+                                  vreg.interfered_registers,
+                                  vreg.interfered_register_sizes);
+      }
       if (result == false) {
         return false;
       }
@@ -474,7 +1041,7 @@ bool BasicBlockGraphBuilder::AddOutputOperand(
     case OperandType::kMemory: {
       const NodeIndex alias_group_node =
           AddNode(NodeType::kMemoryOperand, memory_token_);
-      alias_group_nodes_[operand.alias_group_id()] = alias_group_node;
+      alias_group_nodes_[operand.alias_group_id] = alias_group_node;
       AddEdge(EdgeType::kOutputOperands, instruction_node, alias_group_node);
     } break;
     case OperandType::kUnknown:
@@ -486,14 +1053,16 @@ bool BasicBlockGraphBuilder::AddOutputOperand(
 }
 
 bool BasicBlockGraphBuilder::AddDependencyOnRegister(
-    NodeIndex dependent_node, const std::string& register_name,
-    const std::string& register_token, EdgeType edge_type) {
+    NodeIndex dependent_node, std::string_view register_name,
+    std::string_view register_token, EdgeType edge_type,
+    SymbolId register_symbol) {
   NodeIndex& operand_node =
       LookupOrInsert(register_nodes_, register_name, kInvalidNode);
   if (operand_node == kInvalidNode) {
     // Add a node for the register if it doesn't exist. This also updates the
     // node index in `node_by_register`.
-    operand_node = AddNode(NodeType::kRegister, register_token);
+    operand_node =
+        AddNode(NodeType::kRegister, register_token, register_symbol);
   }
   if (operand_node == kInvalidNode) return false;
   AddEdge(edge_type, operand_node, dependent_node);
@@ -501,8 +1070,8 @@ bool BasicBlockGraphBuilder::AddDependencyOnRegister(
 }
 
 bool BasicBlockGraphBuilder::AddDependencyToRegister(
-    NodeIndex dependent_node, const std::string& register_name,
-    const std::string& register_token, EdgeType edge_type) {
+    NodeIndex dependent_node, std::string_view register_name,
+    std::string_view register_token, EdgeType edge_type) {
   NodeIndex& operand_node =
       LookupOrInsert(register_nodes_, register_name, kInvalidNode);
   if (operand_node == kInvalidNode) {
@@ -520,16 +1089,43 @@ BasicBlockGraphBuilder::NodeIndex BasicBlockGraphBuilder::AddNode(
   const NodeIndex new_node_index = num_nodes();
   node_types_.push_back(node_type);
   node_features_.push_back(token_index);
+  const bool is_instruction = node_type == NodeType::kInstruction;
+  instruction_node_mask_.push_back(is_instruction);
+  // The node belongs to the graph that is being added, i.e. the graph with
+  // index num_graphs().
+  if (is_instruction) delta_block_index_.push_back(num_graphs());
   return new_node_index;
 }
 
+void BasicBlockGraphBuilder::SetSymbolTable(
+    std::shared_ptr<const SymbolTable> symbol_table) {
+  symbol_table_ = std::move(symbol_table);
+  symbol_tokens_.clear();
+}
+
+BasicBlockGraphBuilder::TokenIndex BasicBlockGraphBuilder::FindToken(
+    std::string_view token, SymbolId symbol) {
+  if (symbol_table_ == nullptr || symbol == kInvalidSymbol) {
+    const auto it = vocabulary_->index.find(token);
+    return it == vocabulary_->index.end() ? kInvalidTokenIndex : it->second;
+  }
+  assert(symbol_table_->Name(symbol) == token);
+  if (symbol >= symbol_tokens_.size()) {
+    symbol_tokens_.resize(symbol + 1, kUnresolvedSymbolToken);
+  }
+  TokenIndex& token_index = symbol_tokens_[symbol];
+  if (token_index == kUnresolvedSymbolToken) {
+    const auto it = vocabulary_->index.find(token);
+    token_index =
+        it == vocabulary_->index.end() ? kInvalidTokenIndex : it->second;
+  }
+  return token_index;
+}
+
 BasicBlockGraphBuilder::NodeIndex BasicBlockGraphBuilder::AddNode(
-    NodeType node_type, const std::string& token) {
-  const auto it = node_tokens_.find(token);
-  TokenIndex token_index = kInvalidTokenIndex;
-  if (it != node_tokens_.end()) {
-    token_index = it->second;
-  } else {
+    NodeType node_type, std::string_view token, SymbolId symbol) {
+  TokenIndex token_index = FindToken(token, symbol);
+  if (token_index == kInvalidTokenIndex) {
     // TODO(ondrasej): Make this error message optional.
     std::cerr << "Unexpected node token: '" << token << "'";
     switch (out_of_vocabulary_behavior_.behavior_type()) {
@@ -551,43 +1147,74 @@ void BasicBlockGraphBuilder::AddEdge(EdgeType edge_type, NodeIndex sender,
   edge_senders_.push_back(sender);
   edge_receivers_.push_back(receiver);
   edge_types_.push_back(edge_type);
+  edge_features_.push_back(static_cast<int>(edge_type));
+}
+
+std::vector<bool> BasicBlockGraphBuilder::InstructionNodeMask() const {
+  return std::vector<bool>(instruction_node_mask_.begin(),
+                           instruction_node_mask_.end());
+}
+
+void BasicBlockGraphBuilder::WriteEdgeFeatures(int* edge_features) const {
+  assert(edge_features != nullptr || num_edges() == 0);
+  std::copy(edge_features_.begin(), edge_features_.end(), edge_features);
+}
+
+void BasicBlockGraphBuilder::WriteInstructionNodeMask(
+    bool* instruction_node_mask) const {
+  assert(instruction_node_mask != nullptr || num_nodes() == 0);
+  static_assert(sizeof(bool) == sizeof(uint8_t));
+  if (instruction_node_mask_.empty()) return;
+  std::memcpy(instruction_node_mask, instruction_node_mask_.data(),
+              instruction_node_mask_.size());
+}
+
+void BasicBlockGraphBuilder::WriteDeltaBlockIndex(
+    int* delta_block_index) const {
+  assert(delta_block_index != nullptr || num_instructions() == 0);
+  std::copy(delta_block_index_.begin(), delta_block_index_.end(),
+            delta_block_index);
+}
+
+void BasicBlockGraphBuilder::WriteGlobalFeatures(int* global_features) const {
+  std::copy(global_features_.begin(), global_features_.end(), global_features);
 }
 
-std::vector<int> BasicBlockGraphBuilder::EdgeFeatures() const {
-  std::vector<int> edge_features(num_edges());
-  for (int i = 0; i < num_edges(); ++i) {
-    edge_features[i] = static_cast<int>(edge_types_[i]);
+std::vector<std::vector<int>> BasicBlockGraphBuilder::global_features() const {
+  std::vector<std::vector<int>> global_features;
+  global_features.reserve(num_graphs());
+  const int row_size = num_node_tokens();
+  for (auto row_begin = global_features_.begin();
+       row_begin != global_features_.end(); row_begin += row_size) {
+    global_features.emplace_back(row_begin, row_begin + row_size);
   }
-  return edge_features;
+  return global_features;
 }
 
-std::vector<bool> BasicBlockGraphBuilder::InstructionNodeMask() const {
-  std::vector<bool> instruction_node_mask(num_nodes());
-  for (NodeIndex i = 0; i < num_nodes(); ++i) {
-    instruction_node_mask[i] = node_types_[i] == NodeType::kInstruction;
-  }
-  return instruction_node_mask;
-}
-
-std::vector<int> BasicBlockGraphBuilder::DeltaBlockIndex() const {
-  const int num_instructions = static_cast<int>(std::count(
-      node_types_.begin(), node_types_.end(), NodeType::kInstruction));
-  std::vector<int> delta_block_index;
-  delta_block_index.reserve(num_instructions);
-  int block = -1;
-  int block_end = 0;
-  for (int node = 0; node < node_types_.size(); ++node) {
-    if (node_types_[node] != NodeType::kInstruction) continue;
-    while (node >= block_end && block < num_graphs()) {
-      block++;
-      block_end += num_nodes_per_block_[block];
+BasicBlockGraphBuilder::SparseGlobalFeatures
+BasicBlockGraphBuilder::GlobalFeaturesCsr() const {
+  SparseGlobalFeatures csr;
+  csr.row_offsets.reserve(num_graphs() + 1);
+  csr.row_offsets.push_back(0);
+  // The number of non-zero values in a row is bounded by the number of nodes
+  // of the graph; we collect the tokens of the nodes of each graph and count
+  // them instead of scanning the whole dense row.
+  std::vector<TokenIndex> row_tokens;
+  NodeIndex graph_begin = 0;
+  for (const int graph_num_nodes : num_nodes_per_block_) {
+    row_tokens.assign(node_features_.begin() + graph_begin,
+                      node_features_.begin() + graph_begin + graph_num_nodes);
+    std::sort(row_tokens.begin(), row_tokens.end());
+    for (auto it = row_tokens.begin(); it != row_tokens.end();) {
+      const auto token_end = std::upper_bound(it, row_tokens.end(), *it);
+      csr.column_indices.push_back(*it);
+      csr.values.push_back(static_cast<int>(token_end - it));
+      it = token_end;
     }
-    delta_block_index.push_back(block);
+    csr.row_offsets.push_back(static_cast<int>(csr.values.size()));
+    graph_begin += graph_num_nodes;
   }
-  assert(block == num_graphs() - 1);
-  assert(block_end == num_nodes());
-  assert(delta_block_index.size() == num_instructions);
-  return delta_block_index;
+  return csr;
 }
 
 namespace {
@@ -607,6 +1234,21 @@ void StrAppendList(std::stringstream& buffer, std::string_view list_name,
 }
 }  // namespace
 
+bool BasicBlockGraphBuilder::HasSameVocabulary(
+    const BasicBlockGraphBuilder& other) const {
+  // Graph builders created by copying share the vocabulary object; graph
+  // builders created for different models need a full comparison.
+  return (vocabulary_ == other.vocabulary_ ||
+          vocabulary_->tokens == other.vocabulary_->tokens) &&
+         immediate_token_ == other.immediate_token_ &&
+         fp_immediate_token_ == other.fp_immediate_token_ &&
+         address_token_ == other.address_token_ &&
+         memory_token_ == other.memory_token_ &&
+         out_of_vocabulary_behavior_.behavior_type() ==
+             other.out_of_vocabulary_behavior_.behavior_type() &&
+         replacement_token_ == other.replacement_token_;
+}
+
 std::string BasicBlockGraphBuilder::DebugString() const {
   std::stringstream buffer;
 
@@ -628,11 +1270,12 @@ std::string BasicBlockGraphBuilder::DebugString() const {
   }
   buffer << "interference_groups :"
          << "\n";
-  for (const auto& [register_name, interfered_registers] :
-       interference_groups_) {
-    buffer << "  " << register_name << " -> [";
-    for (const auto& interfered_register : interfered_registers) {
-      buffer << " " << interfered_register;
+  for (int i = 0; i < interference_.num_registers(); ++i) {
+    buffer << "  " << interference_.register_name(i) << " -> [";
+    for (int j = 0; j < interference_.num_registers(); ++j) {
+      if (interference_.Contains(i, j)) {
+        buffer << " " << interference_.register_name(j);
+      }
     }
     buffer << " ]\n";
   }
@@ -645,4 +1288,12 @@ std::string BasicBlockGraphBuilder::DebugString() const {
   return buffer.str();
 }
 
+// AddBasicBlockFromInstructionViews() is defined in the header, and it may be
+// instantiated in other translation units; both variants of AddInstruction()
+// are instantiated here, where their definitions are.
+template bool BasicBlockGraphBuilder::AddInstruction<false>(
+    const InstructionView& instruction, NodeIndex& previous_instruction_node);
+template bool BasicBlockGraphBuilder::AddInstruction<true>(
+    const InstructionView& instruction, NodeIndex& previous_instruction_node);
+
 }  // namespace gematria
@@ -89,23 +89,29 @@
 #ifndef GEMATRIA_GRANITE_GRAPH_BUILDER_H_
 #define GEMATRIA_GRANITE_GRAPH_BUILDER_H_
 
+#include <cassert>
 #include <cstddef>
+#include <cstdint>
+#include <memory>
 #include <ostream>
 #include <string>
 #include <string_view>
 #include <unordered_map>
-#include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/compact_basic_block.h"
+#include "gematria/basic_block/symbol_table.h"
 #include "gematria/model/oov_token_behavior.h"
 
 namespace gematria {
 
 // The types of nodes created by the BasicBlockGraphBuilder class. See the
 // documentation of the BasicBlockGraphBuilder class for more information on the
-// types of nodes used by the class.
-enum class NodeType {
+// types of nodes used by the class. The types are stored as a single byte in
+// the graph builder.
+enum class NodeType : uint8_t {
   kInstruction = 0,
   kRegister = 1,
   kImmediate = 2,
@@ -117,8 +123,9 @@ enum class NodeType {
 
 // The types of edges created by the BasicBlockGraphBuilder class. See the
 // documentation of the BasicBlockGraphBuilder class for more information on the
-// types of edges used by the class.
-enum class EdgeType {
+// types of edges used by the class. The types are stored as a single byte in
+// the graph builder.
+enum class EdgeType : uint8_t {
   kStructuralDependency = 0,
   kInputOperands = 1,
   kOutputOperands = 2,
@@ -135,8 +142,24 @@ enum class EdgeType {
   kInstructionPrefix = 9,
 };
 
+// The kinds of live info used by a model; they correspond to the model types
+// of BHiveImporter. The live info determines whether the graphs of the basic
+// blocks contain kInterference edges between the virtual registers.
+enum class LiveInfoMode {
+  // The model does not use live info. The interfered registers of the operands
+  // are ignored, and the graphs do not contain any kInterference edges.
+  kNoLiveInfo,
+  // The interfered registers of the operands were computed from the live
+  // ranges within each basic block.
+  kPerBasicBlockLiveInfo,
+  // The interfered registers of the operands were computed from the live
+  // ranges within the whole function.
+  kPerFunctionLiveInfo,
+};
+
 std::ostream& operator<<(std::ostream& os, NodeType node_type);
 std::ostream& operator<<(std::ostream& os, EdgeType edge_type);
+std::ostream& operator<<(std::ostream& os, LiveInfoMode live_info_mode);
 
 // The basic block graph builder class. See the top-level comment for more
 // information on the format of the graphs produced by this file.
@@ -190,17 +213,213 @@ class BasicBlockGraphBuilder {
   // block instead of the basic block object itself.
   bool AddBasicBlockFromInstructions(
       const std::vector<Instruction>& instructions);
+  // A version of AddBasicBlock that takes pointers to the instructions in the
+  // basic block, e.g. an edited basic block from ApplyBasicBlockEdits(). This
+  // lets the caller evaluate variants of a basic block without copying the
+  // instructions they share. Supports block deduplication; the fingerprint of
+  // the block is the same as for a block with copies of the instructions.
+  bool AddBasicBlockFromInstructionPointers(
+      const std::vector<const Instruction*>& instructions);
+  // A version of AddBasicBlock that reads the basic block from its compact
+  // encoding. The symbols of the basic block are resolved through the symbol
+  // table of the graph builder, so the block must have been encoded with the
+  // table set through SetSymbolTable(). Supports block deduplication; the
+  // fingerprint of the block is the one of the instructions it was encoded
+  // from.
+  bool AddCompactBasicBlock(const CompactBasicBlock& block);
+
+  // Non-owning views of the parts of an instruction used by the graph builder.
+  // They let the graph builder read instructions directly from other
+  // representations, e.g. from a BasicBlockProto (see graph_builder_protos.h),
+  // without copying all the strings to a BasicBlock first. A view is valid
+  // only as long as the data it points to.
+
+  // A list of strings, stored either contiguously, e.g. in a
+  // std::vector<std::string>, as an array of pointers to strings, e.g. in a
+  // google::protobuf::RepeatedPtrField<std::string>, or as an array of indices
+  // into a table of tokens, e.g. in a ColumnarDataset.
+  class StringListView {
+   public:
+    StringListView() = default;
+    StringListView(const std::vector<std::string>& strings)
+        : strings_(strings.data()), size_(strings.size()) {}
+    StringListView(const std::string* const* pointers, size_t size)
+        : pointers_(pointers), size_(size) {}
+    StringListView(const std::string_view* tokens, const uint32_t* indices,
+                   size_t size)
+        : tokens_(tokens), indices_(indices), size_(size) {}
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    std::string_view operator[](size_t index) const {
+      assert(index < size_);
+      if (strings_ != nullptr) return strings_[index];
+      if (pointers_ != nullptr) return *pointers_[index];
+      return tokens_[indices_[index]];
+    }
+
+   private:
+    const std::string* strings_ = nullptr;
+    const std::string* const* pointers_ = nullptr;
+    const std::string_view* tokens_ = nullptr;
+    const uint32_t* indices_ = nullptr;
+    size_t size_ = 0;
+  };
+
+  // A contiguous list of integers.
+  class IntListView {
+   public:
+    IntListView() = default;
+    IntListView(const std::vector<int>& values)
+        : data_(values.data()), size_(values.size()) {}
+    IntListView(const int* data, size_t size) : data_(data), size_(size) {}
+
+    size_t size() const { return size_; }
+    int operator[](size_t index) const {
+      assert(index < size_);
+      return data_[index];
+    }
+
+   private:
+    const int* data_ = nullptr;
+    size_t size_ = 0;
+  };
+
+  // A register used by an operand, and for virtual registers, the registers it
+  // interferes with. `name` is empty when the register is not used.
+  struct RegisterView {
+    std::string_view name;
+    StringListView interfered_registers;
+    IntListView interfered_register_sizes;
+  };
+
+  // An instruction operand. Only the fields used by the operand type are set;
+  // see InstructionOperand for their meaning.
+  struct OperandView {
+    OperandType type = OperandType::kUnknown;
+    // The register of kRegister and kVirtualRegister operands.
+    RegisterView register_operand;
+    SymbolId register_symbol = kInvalidSymbol;
+    // The size of kVirtualRegister operands in bits.
+    int register_size = 0;
+    // The registers and the displacement of kAddress operands.
+    RegisterView base_register;
+    RegisterView index_register;
+    RegisterView segment_register;
+    int64_t displacement = 0;
+    // The alias group of kMemory operands.
+    int alias_group_id = 0;
+  };
+
+  // An instruction of the basic block. The operands are stored in vectors, so
+  // that a single view can be reused for all instructions without allocating
+  // memory for each of them.
+  struct InstructionView {
+    std::string_view mnemonic;
+    SymbolId mnemonic_symbol = kInvalidSymbol;
+    StringListView prefixes;
+    std::vector<OperandView> input_operands;
+    std::vector<OperandView> implicit_input_operands;
+    std::vector<OperandView> output_operands;
+    std::vector<OperandView> implicit_output_operands;
+  };
+
+  // Adds a basic block whose instructions are read through InstructionView
+  // objects. `fill_instruction_view(index, view)` is called for each index in
+  // [0, num_instructions) in order, and it must fill in `view` with the
+  // instruction at that index. The same view object is passed to all calls;
+  // the data it points to must remain valid until the method returns. Returns
+  // the same values as AddBasicBlock().
+  // Block deduplication is defined on the fingerprints of BasicBlock objects,
+  // so this method must not be used when deduplication is enabled.
+  template <typename FillInstructionView>
+  bool AddBasicBlockFromInstructionViews(
+      int num_instructions, const FillInstructionView& fill_instruction_view) {
+    assert(!deduplicate_blocks_);
+    return AddBasicBlockFromInstructionViews(
+        num_instructions, /*fingerprint=*/0, fill_instruction_view);
+  }
+
+  // Adds a list of basic blocks to the graph builder, building their graphs on
+  // up to `num_threads` threads. The blocks are split into contiguous shards
+  // that are built by independent graph builders and then appended to this
+  // one in order, so the resulting batch is identical to the one produced by
+  // calling AddBasicBlock() on each of the blocks in turn. Returns a vector
+  // that has one element per block, true when the block was added. When
+  // `num_threads` is one or less or when block deduplication is enabled, the
+  // blocks are added on the calling thread.
+  std::vector<bool> AddBasicBlocksInParallel(
+      const std::vector<BasicBlock>& blocks, int num_threads);
+
+  // Reserves space for `num_graphs` graphs with `num_nodes` nodes and
+  // `num_edges` edges in total, in addition to the current contents of the
+  // batch. This does not change the contents of the batch; it only avoids
+  // repeated reallocation when the size of the batch is known in advance.
+  void Reserve(int num_graphs, int num_nodes, int num_edges);
+  // Reserves space for the graphs of `blocks`, using an upper bound on the
+  // size of each graph estimated from the numbers of instructions and operands.
+  void ReserveForBasicBlocks(const std::vector<BasicBlock>& blocks);
+
+  // Removes the basic block added last from the graph builder, leaving it in
+  // the state before that basic block was added. The graph builder must
+  // contain at least one basic block.
+  void RemoveLastBasicBlock();
 
   // Resets the graph builder so that it can be used to create a new graph from
   // scratch.
   void Reset();
 
-  // Returns the number of graphs in the batch. This corresponds to the number
-  // of successful calls to AddBasicBlock() since the last call to Reset().
+  // Sets the symbol table used to produce the interned symbols in the added
+  // basic blocks (see InternSymbols() in basic_block.h); nullptr disables the
+  // use of interned symbols. When a symbol table is set, the graph builder
+  // caches the token index of each symbol and looks up the mnemonics and
+  // register names with a valid symbol in the cache instead of hashing their
+  // strings. All symbols in the added blocks must come from this table.
+  void SetSymbolTable(std::shared_ptr<const SymbolTable> symbol_table);
+  const std::shared_ptr<const SymbolTable>& symbol_table() const {
+    return symbol_table_;
+  }
+
+  // Enables or disables deduplication of basic blocks. When enabled, adding a
+  // basic block that has the same fingerprint (see BasicBlockFingerprint()) as
+  // a basic block already in the current batch does not add a new graph;
+  // instead, the basic block is mapped to the graph of its first occurrence.
+  // See block_graph_indices(). Resets the graph builder.
+  void SetDeduplicateBlocks(bool enabled);
+  bool deduplicate_blocks() const { return deduplicate_blocks_; }
+
+  // Sets the live-info mode of the model. The graph builder is specialized at
+  // compile time for models with and without interference edges; with
+  // LiveInfoMode::kNoLiveInfo, the interfered registers of the operands are
+  // not read at all. Both kinds of live info produce the same graphs, they
+  // differ only in how the interfered registers were computed. The default
+  // is LiveInfoMode::kPerFunctionLiveInfo, i.e. all interference data in the
+  // basic blocks is used. Resets the graph builder.
+  void SetLiveInfoMode(LiveInfoMode live_info_mode);
+  LiveInfoMode live_info_mode() const { return live_info_mode_; }
+
+  // Returns the number of graphs in the batch. Without deduplication, this
+  // corresponds to the number of successful calls to AddBasicBlock() since the
+  // last call to Reset().
   int num_graphs() const {
     return static_cast<int>(num_nodes_per_block_.size());
   }
 
+  // Returns the number of basic blocks in the batch, i.e. the number of
+  // successful calls to AddBasicBlock() since the last call to Reset(). This
+  // differs from num_graphs() only when deduplication is enabled.
+  int num_blocks() const {
+    return static_cast<int>(block_graph_indices_.size());
+  }
+
+  // For each basic block in the batch, contains the index of the graph that
+  // represents it. Without deduplication, this is the identity mapping. The
+  // predictions of the model for the graphs can be mapped back to the basic
+  // blocks by gathering them with these indices.
+  const std::vector<int>& block_graph_indices() const {
+    return block_graph_indices_;
+  }
+
   // Returns the number of nodes in the current batch.
   int num_nodes() const { return static_cast<int>(node_types_.size()); }
 
@@ -208,18 +427,17 @@ class BasicBlockGraphBuilder {
   int num_edges() const { return static_cast<int>(edge_senders_.size()); }
 
   // Returns the number of different tokens corresponding to nodes of the graph.
-  int num_node_tokens() const { return static_cast<int>(node_tokens_.size()); }
+  int num_node_tokens() const {
+    return static_cast<int>(vocabulary_->tokens.size());
+  }
 
   // The following getters provide access to the graphs in the current batch.
   // The data structures and the format of the data match the format used by the
   // graph_nets.GraphsTuple class that is fed to TensorFlow when processing the
   // batch.
 
-  // TODO(ondrasej): For simplicity, this class produces the data as lists
-  // (which get converted by pybind11 into Python lists), and the conversion to
-  // NumPy arrays required by TensorFlow must be done from Python. If this
-  // proves to be slowing down the computation, we could create optimize this by
-  // creating NumPy arrays directly from the C++ code.
+  // The Python bindings return copies of these vectors as NumPy arrays; the
+  // data is copied in bulk without creating a Python object for each element.
 
   // The number of nodes for each basic block in the batch. Corresponds to
   // `GraphsTuple.n_node`.
@@ -253,16 +471,44 @@ class BasicBlockGraphBuilder {
   const std::vector<EdgeType>& edge_types() const { return edge_types_; }
 
   // Returns the matrix of global features of the graphs in the batch. This is a
-  // 2D matrix of shape (num_nodes(), num_node_tokens()), in the row-major
+  // 2D matrix of shape (num_graphs(), num_node_tokens()), in the row-major
   // format. Corresponds to `GraphsTuple.globals`.
-  const std::vector<std::vector<int>>& global_features() const {
+  // The matrix is stored in a flat buffer; this method creates a copy of the
+  // data with one vector per row. Prefer global_features_data() or
+  // GlobalFeaturesCsr() when performance matters.
+  std::vector<std::vector<int>> global_features() const;
+
+  // Returns the matrix of global features as a contiguous buffer of
+  // num_graphs() * num_node_tokens() elements in the row-major format.
+  const std::vector<int>& global_features_data() const {
     return global_features_;
   }
 
+  // The global features in the compressed sparse row (CSR) format. The
+  // features of the graph at index `i` are stored in `column_indices` and
+  // `values` at positions row_offsets[i] to row_offsets[i + 1] - 1; the column
+  // indices are sorted in the increasing order within each row, and only
+  // non-zero values are stored.
+  struct SparseGlobalFeatures {
+    // The start of each row in `column_indices` and `values`. Contains
+    // num_graphs() + 1 elements; the last element is the number of non-zero
+    // values in the matrix.
+    std::vector<int> row_offsets;
+    // The column (token) indices of the non-zero values.
+    std::vector<int> column_indices;
+    // The non-zero values.
+    std::vector<int> values;
+  };
+
+  // Returns the matrix of global features in the CSR format. Since most tokens
+  // do not appear in a given basic block, this is typically much smaller than
+  // the dense matrix.
+  SparseGlobalFeatures GlobalFeaturesCsr() const;
+
   // Returns a vector of node features. The feature of each node is the index of
   // the edge type (i.e. the numerical constant associated with the given value
   // of EdgeType). Corresponds to `GraphsTuple.edges`.
-  std::vector<int> EdgeFeatures() const;
+  std::vector<int> EdgeFeatures() const { return edge_features_; }
 
   // Returns a vector of boolean values of size `num_nodes()`.
   // InstructionNodeMask()[i] is true if and only if node_types()[i] is
@@ -278,10 +524,45 @@ class BasicBlockGraphBuilder {
   // and 1 instruction, the return value is {0, 0, 1, 1, 1, 1, 2}.
   // The return value can be used as a value of
   // model_base.ModelBase._delta_block_index_tensor.
-  std::vector<int> DeltaBlockIndex() const;
+  std::vector<int> DeltaBlockIndex() const { return delta_block_index_; }
+
+  // Returns the number of instruction nodes in the current batch. This is also
+  // the size of DeltaBlockIndex().
+  int num_instructions() const {
+    return static_cast<int>(delta_block_index_.size());
+  }
+
+  // The following methods provide access to the data of EdgeFeatures(),
+  // InstructionNodeMask() and DeltaBlockIndex() without copying. The data is
+  // maintained incrementally as basic blocks are added to the batch, so these
+  // methods do not scan the batch. The instruction node mask uses one byte per
+  // node (0 or 1), so that it can be copied directly to a boolean tensor.
+  const std::vector<int>& edge_features() const { return edge_features_; }
+  const std::vector<uint8_t>& instruction_node_mask() const {
+    return instruction_node_mask_;
+  }
+  const std::vector<int>& delta_block_index() const {
+    return delta_block_index_;
+  }
 
-  // TODO(ondrasej): Consider adding methods that directly create NumPy arrays
-  // from the data in this class to avoid the extra conversion.
+  // The following methods write the data of the current batch to a buffer
+  // provided by the caller instead of returning a new vector. This allows
+  // writing the data directly to their final location, e.g. to the input
+  // tensors of a TensorFlow Lite interpreter. The caller is responsible for
+  // providing a buffer of the right size.
+
+  // Writes the data of EdgeFeatures() to `edge_features`. The buffer must have
+  // space for num_edges() elements.
+  void WriteEdgeFeatures(int* edge_features) const;
+  // Writes the data of InstructionNodeMask() to `instruction_node_mask`. The
+  // buffer must have space for num_nodes() elements.
+  void WriteInstructionNodeMask(bool* instruction_node_mask) const;
+  // Writes the data of DeltaBlockIndex() to `delta_block_index`. The buffer
+  // must have space for num_instructions() elements.
+  void WriteDeltaBlockIndex(int* delta_block_index) const;
+  // Writes the data of global_features_data() to `global_features`. The buffer
+  // must have space for num_graphs() * num_node_tokens() elements.
+  void WriteGlobalFeatures(int* global_features) const;
 
   // Methods for accessing the indices of the special tokens in the graph
   // builder. When they return a non-negative value, this value is the index of
@@ -293,11 +574,28 @@ class BasicBlockGraphBuilder {
   TokenIndex memory_token() const { return memory_token_; }
   TokenIndex replacement_token() const { return replacement_token_; }
 
+  // Returns true when `other` maps all tokens to the same token indices as this
+  // graph builder, uses the same special tokens, and handles unknown tokens the
+  // same way. The graphs built by two such graph builders from the same basic
+  // blocks are identical, so they can be fed to each other's models.
+  bool HasSameVocabulary(const BasicBlockGraphBuilder& other) const;
+
   // Converts the contents of the graph builder to a human-readable string
   // representation.
   std::string DebugString() const;
 
  private:
+  // Creates an empty graph builder that has the same vocabulary and
+  // configuration as `other`. Used for the shards built by
+  // AddBasicBlocksInParallel().
+  struct EmptyCopyTag {};
+  BasicBlockGraphBuilder(EmptyCopyTag, const BasicBlockGraphBuilder& other);
+
+  // Appends the contents of `shard` to the current batch, offsetting the node
+  // indices in `shard`. The per-block state of this graph builder is replaced
+  // with the (offset) per-block state of `shard`.
+  void AppendShard(const BasicBlockGraphBuilder& shard);
+
   // Keeps track of the state of the basic block graph builder, and allows
   // reverting it to a state before adding a basic block to the current batch.
   // The class is intended to be used as an RAII object - it is created at the
@@ -323,7 +621,8 @@ class BasicBlockGraphBuilder {
    private:
     // Manually resets the basic block graph builder to the state before the
     // transaction object was created; resizes all the vectors in the builder to
-    // their original size.
+    // their original size, and clears the per-block state. The per-block state
+    // is rebuilt for each basic block, so it does not need to be restored.
     void Rollback();
 
     // The basic block graph builder managed by the transaction.
@@ -340,48 +639,148 @@ class BasicBlockGraphBuilder {
     size_t prev_edge_senders_size_;
     size_t prev_edge_receivers_size_;
     size_t prev_edge_types_size_;
+    size_t prev_edge_features_size_;
+    size_t prev_instruction_node_mask_size_;
+    size_t prev_delta_block_index_size_;
     size_t prev_global_features_size_;
-    std::unordered_map<std::string_view, std::unordered_set<std::string>>
-        prev_interference_groups_;
   };
 
+  // Tracks the pairs of registers that interfere in the basic block that is
+  // being added. The registers are numbered densely in the order in which they
+  // are first seen, and the interference relation is stored as a
+  // lower-triangular bit matrix (including the diagonal), so that checking and
+  // recording a pair does not require hashing a set of strings.
+  class InterferenceMatrix {
+   public:
+    // Returns the dense index of `register_name`; assigns a new index when the
+    // register was not seen since the last call to Clear().
+    int RegisterIndex(std::string_view register_name);
+
+    // Records that the registers with indices `a` and `b` interfere. Returns
+    // false when the pair was already recorded.
+    bool Insert(int a, int b);
+    // Returns true when the registers with indices `a` and `b` interfere.
+    bool Contains(int a, int b) const { return bits_[BitIndex(a, b)]; }
+
+    // Removes all registers and interferences from the matrix.
+    void Clear();
+
+    int num_registers() const { return static_cast<int>(names_.size()); }
+    std::string_view register_name(int index) const { return names_[index]; }
+
+   private:
+    static size_t BitIndex(int a, int b) {
+      if (a < b) std::swap(a, b);
+      return static_cast<size_t>(a) * (a + 1) / 2 + b;
+    }
+
+    // The keys and the elements point to the strings in the instructions of
+    // the basic block.
+    std::unordered_map<std::string_view, int> indices_;
+    std::vector<std::string_view> names_;
+    std::vector<bool> bits_;
+  };
+
+  // The vocabulary of the model. The keys of `index` point to the strings in
+  // `tokens`, and map them to their indices in `tokens`. The vocabulary does
+  // not change after the graph builder is created, and it is shared by all
+  // copies of the graph builder.
+  struct Vocabulary {
+    std::vector<std::string> tokens;
+    std::unordered_map<std::string_view, TokenIndex> index;
+  };
+
+  // Creates the vocabulary for the given list of tokens. Aborts when the list
+  // contains duplicate tokens.
+  static std::shared_ptr<const Vocabulary> MakeVocabulary(
+      std::vector<std::string> tokens);
+
+  // The implementation of the public AddBasicBlockFromInstructionViews().
+  // `fingerprint` is the fingerprint of the basic block; it is used only when
+  // block deduplication is enabled.
+  template <typename FillInstructionView>
+  bool AddBasicBlockFromInstructionViews(
+      int num_instructions, uint64_t fingerprint,
+      const FillInstructionView& fill_instruction_view);
+
+  // Fills in `view` with the data of `instruction`.
+  static void MakeInstructionView(const Instruction& instruction,
+                                  InstructionView& view);
+
+  // When block deduplication is enabled and the batch already contains a graph
+  // with `fingerprint`, maps a new basic block to this graph and returns true.
+  // Otherwise, returns false.
+  bool AddDuplicateBasicBlock(uint64_t fingerprint);
+
+  // Clears the per-block state before adding a new basic block.
+  void StartBasicBlock();
+  // Adds nodes and edges for all instructions of the basic block that is being
+  // added. `kAddInterference` selects the variant of the graph builder: when
+  // false, the interfered registers of the operands are ignored.
+  template <bool kAddInterference, typename FillInstructionView>
+  bool AddInstructions(int num_instructions,
+                       const FillInstructionView& fill_instruction_view);
+  // Adds nodes and edges for a single instruction of the basic block that is
+  // being added. `previous_instruction_node` is the node of the previous
+  // instruction of the basic block, or a negative value for the first
+  // instruction; it is updated to the node of `instruction`.
+  template <bool kAddInterference>
+  bool AddInstruction(const InstructionView& instruction,
+                      NodeIndex& previous_instruction_node);
+  // Records the graph of the basic block that is being added, whose nodes and
+  // edges start at `first_node` and `first_edge`.
+  void FinishBasicBlock(int first_node, int first_edge, uint64_t fingerprint);
+
   // Adds nodes and edges for a single input operand of an instruction.
-  bool AddInputOperand(NodeIndex instruction_node,
-                       const InstructionOperand& operand);
+  template <bool kAddInterference>
+  bool AddInputOperand(NodeIndex instruction_node, const OperandView& operand);
   // Adds nodes and edges for a single output operand of an instruction.
-  bool AddOutputOperand(NodeIndex instruction_node,
-                        const InstructionOperand& operand);
+  template <bool kAddInterference>
+  bool AddOutputOperand(NodeIndex instruction_node, const OperandView& operand);
+  // Adds a dependency of `dependent_node` on a register used in an address
+  // computation, with the interferences of the register when it is virtual
+  // and `kAddInterference` is true.
+  template <bool kAddInterference>
+  bool AddAddressRegister(NodeIndex dependent_node,
+                          const RegisterView& address_register,
+                          EdgeType edge_type);
 
   // Adds dependency of a node (instruction or an address computation node) on
   // a register. Adds the register node if it doesn't exist in the graph.
+  // When `register_symbol` is valid, it must be the interned symbol of
+  // `register_token`.
   bool AddDependencyOnRegister(NodeIndex dependent_node,
-                               const std::string& register_name,
-                               const std::string& register_token,
-                               EdgeType edge_type);
+                               std::string_view register_name,
+                               std::string_view register_token,
+                               EdgeType edge_type,
+                               SymbolId register_symbol = kInvalidSymbol);
 
   bool AddDependencyToRegister(NodeIndex dependent_node,
-                               const std::string& register_name,
-                               const std::string& register_token,
+                               std::string_view register_name,
+                               std::string_view register_token,
                                EdgeType edge_type);
 
-  bool AddInterference(const std::string& src_name,
-                       const std::string& src_token,
-                       const std::vector<std::string>& dest_names,
-                       const std::vector<int>& dest_sizes);
+  bool AddInterference(std::string_view src_name, std::string_view src_token,
+                       StringListView dest_names, IntListView dest_sizes);
 
   // Adds a new node to the batch; the feature of the node is given directly by
   // the caller.
   NodeIndex AddNode(NodeType node_type, TokenIndex token_index);
   // Adds a new edge to the batch; the feature of the node is determined from
   // the token associated with the node. Returns kInvalidNode when the node was
-  // not added.
-  NodeIndex AddNode(NodeType node_type, const std::string& token);
+  // not added. When `symbol` is valid, it must be the interned symbol of
+  // `token`, and the token index is taken from `symbol_tokens_` when possible.
+  NodeIndex AddNode(NodeType node_type, std::string_view token,
+                    SymbolId symbol = kInvalidSymbol);
+  // Returns the token index of `token`, or kInvalidTokenIndex when the token is
+  // not in the vocabulary.
+  TokenIndex FindToken(std::string_view token, SymbolId symbol);
   // Adds a new edge to the batch.
   void AddEdge(EdgeType edge_type, NodeIndex sender, NodeIndex receiver);
 
   // Mapping from string node tokens to indices of embedding vectors used in
   // the models.
-  const std::unordered_map<std::string, TokenIndex> node_tokens_;
+  const std::shared_ptr<const Vocabulary> vocabulary_;
   // Tokens corresponding to nodes in the batch that are not associated directly
   // with a token of the assembly language.
   const TokenIndex immediate_token_;
@@ -392,6 +791,27 @@ class BasicBlockGraphBuilder {
   const OutOfVocabularyTokenBehavior out_of_vocabulary_behavior_;
   const TokenIndex replacement_token_;
 
+  // The symbol table set through SetSymbolTable(), or nullptr.
+  std::shared_ptr<const SymbolTable> symbol_table_;
+  // The token indices of the symbols in `symbol_table_`, indexed by the IDs of
+  // the symbols. Contains kUnresolvedSymbolToken for symbols that were not
+  // looked up yet, and kInvalidTokenIndex for symbols that are not in the
+  // vocabulary. Grows on demand as new symbols are encountered.
+  std::vector<TokenIndex> symbol_tokens_;
+
+  // The state of block deduplication; see SetDeduplicateBlocks(). The maps
+  // and vectors of graphs are used only when `deduplicate_blocks_` is true;
+  // `graph_fingerprints_` contains the fingerprint of each graph in the batch,
+  // and `graph_first_blocks_` the index of the basic block that added it.
+  bool deduplicate_blocks_ = false;
+
+  // The live-info mode; see SetLiveInfoMode().
+  LiveInfoMode live_info_mode_ = LiveInfoMode::kPerFunctionLiveInfo;
+  std::unordered_map<uint64_t, int> graph_by_fingerprint_;
+  std::vector<uint64_t> graph_fingerprints_;
+  std::vector<int> graph_first_blocks_;
+  std::vector<int> block_graph_indices_;
+
   std::vector<int> num_nodes_per_block_;
   std::vector<int> num_edges_per_block_;
 
@@ -402,14 +822,70 @@ class BasicBlockGraphBuilder {
   std::vector<NodeIndex> edge_receivers_;
   std::vector<EdgeType> edge_types_;
 
-  std::vector<std::vector<int>> global_features_;
+  // Derived data maintained together with `node_types_` and `edge_types_`;
+  // see edge_features(), instruction_node_mask() and delta_block_index().
+  std::vector<int> edge_features_;
+  std::vector<uint8_t> instruction_node_mask_;
+  std::vector<int> delta_block_index_;
+
+  // The global features; a flat row-major matrix of shape
+  // (num_graphs(), num_node_tokens()).
+  std::vector<int> global_features_;
 
+  // The per-block state. These maps describe only the basic block that is
+  // being added (or was added last); they are cleared at the beginning of each
+  // basic block by StartBasicBlock(). The keys point to the strings in the
+  // instructions of that basic block.
   std::unordered_map<std::string_view, NodeIndex> register_nodes_;
   std::unordered_map<int, NodeIndex> alias_group_nodes_;
-  std::unordered_map<std::string_view, std::unordered_set<std::string>>
-      interference_groups_;
+  InterferenceMatrix interference_;
+
+  // The view reused for all instructions added to the graph builder.
+  InstructionView instruction_view_;
+  // The names of the symbols of the compact basic block that is being added,
+  // indexed by their local symbols; see AddCompactBasicBlock().
+  std::vector<std::string_view> compact_symbol_names_;
 };
 
+template <typename FillInstructionView>
+bool BasicBlockGraphBuilder::AddBasicBlockFromInstructionViews(
+    int num_instructions, uint64_t fingerprint,
+    const FillInstructionView& fill_instruction_view) {
+  if (num_instructions <= 0) return false;
+  AddBasicBlockTransaction transaction(this);
+  StartBasicBlock();
+
+  const int first_node = num_nodes();
+  const int first_edge = num_edges();
+  // The variant of the graph builder is selected once per basic block, so that
+  // the code for the instructions and operands does not branch on the mode.
+  const bool added =
+      live_info_mode_ == LiveInfoMode::kNoLiveInfo
+          ? AddInstructions</*kAddInterference=*/false>(num_instructions,
+                                                        fill_instruction_view)
+          : AddInstructions</*kAddInterference=*/true>(num_instructions,
+                                                       fill_instruction_view);
+  if (!added) return false;
+  FinishBasicBlock(first_node, first_edge, fingerprint);
+
+  transaction.Commit();
+  return true;
+}
+
+template <bool kAddInterference, typename FillInstructionView>
+bool BasicBlockGraphBuilder::AddInstructions(
+    int num_instructions, const FillInstructionView& fill_instruction_view) {
+  NodeIndex previous_instruction_node = -1;
+  for (int i = 0; i < num_instructions; ++i) {
+    fill_instruction_view(i, instruction_view_);
+    if (!AddInstruction<kAddInterference>(instruction_view_,
+                                          previous_instruction_node)) {
+      return false;
+    }
+  }
+  return true;
+}
+
 }  // namespace gematria
 
 #endif  // GEMATRIA_GRANITE_GRAPH_BUILDER_H_
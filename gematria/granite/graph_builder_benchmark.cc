@@ -0,0 +1,511 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks for BasicBlockGraphBuilder. The benchmarks use realistic basic
+// blocks from three data sets:
+//  - the blocks from gematria/testing/testdata/basic_blocks_with_throughput.
+//  - the blocks imported from the MIR file in sample_dataset/ without live
+//    info; their graphs have no interference edges.
+//  - the same blocks imported with the live info from sample_dataset/liveinfo;
+//    their graphs have interference edges.
+// The first argument of each benchmark selects the data set, the second one
+// the number of basic blocks in the batch; the blocks of the data set are
+// repeated as needed to fill the batch.
+//
+// Besides the time, each benchmark reports the number of basic blocks processed
+// per second ("blocks") and the number of bytes allocated per basic block
+// ("bytes_allocated_per_block").
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <new>
+#include <regex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/log/check.h"
+#include "absl/status/statusor.h"
+#include "benchmark/benchmark.h"
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/basic_block_protos.h"
+#include "gematria/datasets/bhive_importer.h"
+#include "gematria/granite/graph_builder.h"
+#include "gematria/granite/graph_builder_columnar.h"
+#include "gematria/granite/graph_builder_protos.h"
+#include "gematria/io/columnar_dataset.h"
+#include "gematria/llvm/canonicalizer.h"
+#include "gematria/llvm/llvm_architecture_support.h"
+#include "gematria/model/oov_token_behavior.h"
+#include "gematria/proto/basic_block.pb.h"
+#include "gematria/proto/throughput.pb.h"
+#include "google/protobuf/arena.h"
+#include "google/protobuf/text_format.h"
+
+namespace {
+
+// The number of bytes allocated by operator new since the start of the
+// program. Updated by the replacement allocation functions below.
+std::atomic<int64_t> num_allocated_bytes = 0;
+
+void* AllocateAndCount(size_t size) {
+  num_allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+  if (void* const ptr = std::malloc(size == 0 ? 1 : size)) return ptr;
+  throw std::bad_alloc();
+}
+
+}  // namespace
+
+void* operator new(size_t size) { return AllocateAndCount(size); }
+void* operator new[](size_t size) { return AllocateAndCount(size); }
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete[](void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { std::free(ptr); }
+
+namespace gematria {
+namespace {
+
+constexpr char kThroughputTestDataFile[] =
+    "gematria/testing/testdata/basic_blocks_with_throughput.pbtxt";
+constexpr char kMirFile[] = "sample_dataset/data.mir";
+constexpr char kLiveInfoFile[] = "sample_dataset/liveinfo";
+
+constexpr std::string_view kUnknownToken = "_UNKNOWN_";
+constexpr std::string_view kFpImmediateToken = "_FP_IMMEDIATE_";
+
+// The data sets used in the benchmarks. The values are used as the first
+// argument of the benchmarks.
+enum Dataset {
+  kThroughputTestData = 0,
+  kMirWithoutLiveInfo = 1,
+  kMirWithInterference = 2,
+};
+
+std::vector<BasicBlock> LoadThroughputTestData() {
+  std::ifstream file(kThroughputTestDataFile);
+  CHECK(file.is_open()) << "Could not open " << kThroughputTestDataFile;
+  std::stringstream text_proto;
+  text_proto << file.rdbuf();
+  BasicBlockWithThroughputListProto blocks_proto;
+  CHECK(google::protobuf::TextFormat::ParseFromString(text_proto.str(),
+                                                      &blocks_proto));
+  std::vector<BasicBlock> blocks;
+  for (const BasicBlockWithThroughputProto& block_proto :
+       blocks_proto.basic_blocks()) {
+    blocks.push_back(BasicBlockFromProto(block_proto.basic_block()));
+  }
+  return blocks;
+}
+
+// Imports all machine basic blocks from the MIR file. The blocks are named
+// after the IR basic blocks they come from; the names are collected from the
+// `bb.{index}.{name}:` labels in the MIR file.
+std::vector<BasicBlock> LoadMirBlocks(bool with_live_info) {
+  const std::unique_ptr<LlvmArchitectureSupport> llvm_support =
+      LlvmArchitectureSupport::X86_64();
+  const X86Canonicalizer canonicalizer(&llvm_support->target_machine());
+  BHiveImporter importer(&canonicalizer, with_live_info ? "PER_FUNC_LIVE_INFO"
+                                                        : "NO_LIVE_INFO");
+  CHECK_OK(importer.LoadMIRModule(kMirFile).status());
+  if (with_live_info) {
+    CHECK_OK(importer.InteferenceGraphParser(kLiveInfoFile).status());
+  }
+
+  std::ifstream mir_file(kMirFile);
+  CHECK(mir_file.is_open()) << "Could not open " << kMirFile;
+  const std::regex label_regex(R"(^\s*bb\.[0-9]+\.([A-Za-z0-9_]+):)");
+  std::vector<BasicBlock> blocks;
+  std::string line;
+  std::smatch match;
+  while (std::getline(mir_file, line)) {
+    if (!std::regex_search(line, match, label_regex)) continue;
+    // Blocks that can't be imported, e.g. because they contain calls, are
+    // skipped.
+    const absl::StatusOr<BasicBlockProto> block_proto =
+        importer.BasicBlockProtoFromMBBName(match[1].str());
+    if (!block_proto.ok()) continue;
+    BasicBlock block = BasicBlockFromProto(*block_proto);
+    if (!block.instructions.empty()) blocks.push_back(std::move(block));
+  }
+  CHECK(!blocks.empty()) << "No blocks were imported from " << kMirFile;
+  return blocks;
+}
+
+// Returns the basic blocks of `dataset`. The data sets are loaded on first use.
+const std::vector<BasicBlock>& GetBlocks(int dataset) {
+  static const auto* const datasets = new std::vector<std::vector<BasicBlock>>{
+      LoadThroughputTestData(), LoadMirBlocks(/* with_live_info = */ false),
+      LoadMirBlocks(/* with_live_info = */ true)};
+  CHECK_GE(dataset, kThroughputTestData);
+  CHECK_LE(dataset, kMirWithInterference);
+  return (*datasets)[dataset];
+}
+
+// Returns `num_blocks` basic blocks from `dataset`, repeating the data set as
+// many times as needed.
+std::vector<BasicBlock> GetBatch(int dataset, int num_blocks) {
+  const std::vector<BasicBlock>& blocks = GetBlocks(dataset);
+  std::vector<BasicBlock> batch;
+  batch.reserve(num_blocks);
+  for (int i = 0; i < num_blocks; ++i) {
+    batch.push_back(blocks[i % blocks.size()]);
+  }
+  return batch;
+}
+
+// Returns `num_blocks` basic blocks from `dataset` as serialized
+// BasicBlockProtos, as they are read from a TFRecord file.
+std::vector<std::string> GetSerializedBatch(int dataset, int num_blocks) {
+  std::vector<std::string> batch;
+  batch.reserve(num_blocks);
+  BasicBlockProto proto;
+  for (const BasicBlock& block : GetBatch(dataset, num_blocks)) {
+    proto.Clear();
+    for (const Instruction& instruction : block.instructions) {
+      ProtoFromInstruction(instruction,
+                           *proto.add_canonicalized_instructions());
+    }
+    batch.push_back(proto.SerializeAsString());
+  }
+  return batch;
+}
+
+// Writes `num_blocks` basic blocks from `dataset` to a columnar data set in a
+// temporary file, and maps it to memory.
+std::unique_ptr<ColumnarDataset> GetColumnarBatch(int dataset,
+                                                  int num_blocks) {
+  ColumnarDatasetWriter writer;
+  BasicBlockWithThroughputProto proto;
+  for (const std::string& serialized_proto :
+       GetSerializedBatch(dataset, num_blocks)) {
+    CHECK(proto.mutable_basic_block()->ParseFromString(serialized_proto));
+    CHECK_OK(writer.Add(proto));
+  }
+  const char* const temp_dir = std::getenv("TEST_TMPDIR");
+  const std::string file_name =
+      std::string(temp_dir != nullptr ? temp_dir : "/tmp") +
+      "/graph_builder_benchmark_" + std::to_string(dataset) + "_" +
+      std::to_string(num_blocks) + ".gmcol";
+  CHECK_OK(writer.Write(file_name));
+  absl::StatusOr<std::unique_ptr<ColumnarDataset>> columnar_dataset =
+      ColumnarDataset::Open(file_name);
+  CHECK_OK(columnar_dataset.status());
+  return *std::move(columnar_dataset);
+}
+
+// Creates a graph builder whose vocabulary contains all tokens from all data
+// sets, so that the benchmarks measure the same work for all data sets.
+std::unique_ptr<BasicBlockGraphBuilder> CreateGraphBuilder() {
+  std::set<std::string> tokens = {
+      std::string(kImmediateToken),  std::string(kFpImmediateToken),
+      std::string(kAddressToken),    std::string(kMemoryToken),
+      std::string(kUnknownToken),    std::string(kDelimiterToken),
+      std::string(kNoRegisterToken), std::string(kDisplacementToken)};
+  for (const int size : {8, 16, 32, 64, 80, 128, 256, 512}) {
+    tokens.insert(getVREG_TOKEN(size));
+  }
+  for (const int dataset :
+       {kThroughputTestData, kMirWithoutLiveInfo, kMirWithInterference}) {
+    for (const BasicBlock& block : GetBlocks(dataset)) {
+      for (const Instruction& instruction : block.instructions) {
+        const std::vector<std::string> instruction_tokens =
+            instruction.AsTokenList();
+        tokens.insert(instruction_tokens.begin(), instruction_tokens.end());
+      }
+    }
+  }
+  return std::make_unique<BasicBlockGraphBuilder>(
+      std::vector<std::string>(tokens.begin(), tokens.end()),
+      /* immediate_token = */ kImmediateToken,
+      /* fp_immediate_token = */ kFpImmediateToken,
+      /* address_token = */ kAddressToken, /* memory_token = */ kMemoryToken,
+      OutOfVocabularyTokenBehavior::ReplaceWithToken(
+          std::string(kUnknownToken)));
+}
+
+void AddBlocks(BasicBlockGraphBuilder& builder,
+               const std::vector<BasicBlock>& blocks) {
+  for (const BasicBlock& block : blocks) {
+    // All tokens are in the vocabulary, so adding a non-empty block succeeds.
+    CHECK(builder.AddBasicBlock(block));
+  }
+}
+
+// Runs `function` with the timing of the benchmark paused. The bytes allocated
+// by `function` are added to `excluded_bytes`, so that they can be excluded
+// from the allocations reported by the benchmark.
+template <typename Function>
+void RunPaused(benchmark::State& state, int64_t& excluded_bytes,
+               Function function) {
+  state.PauseTiming();
+  const int64_t start_allocated_bytes = num_allocated_bytes.load();
+  function();
+  excluded_bytes += num_allocated_bytes.load() - start_allocated_bytes;
+  state.ResumeTiming();
+}
+
+// Reports the throughput in basic blocks per second and the number of bytes
+// allocated per basic block since `start_allocated_bytes`, without the bytes
+// allocated while the timing was paused.
+void SetCounters(benchmark::State& state, int64_t start_allocated_bytes,
+                 int64_t excluded_bytes, int num_blocks_per_iteration) {
+  const double num_blocks =
+      static_cast<double>(state.iterations()) * num_blocks_per_iteration;
+  const int64_t allocated_bytes =
+      num_allocated_bytes.load() - start_allocated_bytes - excluded_bytes;
+  state.counters["blocks"] =
+      benchmark::Counter(num_blocks, benchmark::Counter::kIsRate);
+  state.counters["bytes_allocated_per_block"] =
+      benchmark::Counter(allocated_bytes / num_blocks);
+}
+
+// Adds the basic blocks to an empty graph builder. The builder is reset after
+// each iteration, so that its buffers are reused as they are during inference.
+void BM_AddBasicBlock(benchmark::State& state) {
+  const std::vector<BasicBlock> blocks =
+      GetBatch(state.range(0), state.range(1));
+  const std::unique_ptr<BasicBlockGraphBuilder> builder = CreateGraphBuilder();
+  // Warm up the buffers of the builder.
+  AddBlocks(*builder, blocks);
+  builder->Reset();
+
+  const int64_t start_allocated_bytes = num_allocated_bytes.load();
+  int64_t excluded_bytes = 0;
+  for (auto _ : state) {
+    AddBlocks(*builder, blocks);
+    RunPaused(state, excluded_bytes, [&]() { builder->Reset(); });
+  }
+  SetCounters(state, start_allocated_bytes, excluded_bytes, blocks.size());
+}
+
+// Parses serialized basic block protos and adds them to the graph builder
+// through a BasicBlock, using a single proto and a single basic block object
+// for all the blocks.
+void BM_AddSerializedProtoViaBasicBlock(benchmark::State& state) {
+  const std::vector<std::string> protos =
+      GetSerializedBatch(state.range(0), state.range(1));
+  const std::unique_ptr<BasicBlockGraphBuilder> builder = CreateGraphBuilder();
+  BasicBlockProto proto;
+  BasicBlock block;
+  const auto add_blocks = [&]() {
+    for (const std::string& serialized_proto : protos) {
+      CHECK(proto.ParseFromString(serialized_proto));
+      BasicBlockFromProto(proto, block);
+      CHECK(builder->AddBasicBlock(block));
+    }
+  };
+  add_blocks();
+  builder->Reset();
+
+  const int64_t start_allocated_bytes = num_allocated_bytes.load();
+  int64_t excluded_bytes = 0;
+  for (auto _ : state) {
+    add_blocks();
+    RunPaused(state, excluded_bytes, [&]() { builder->Reset(); });
+  }
+  SetCounters(state, start_allocated_bytes, excluded_bytes, protos.size());
+}
+
+// Parses serialized basic block protos on an arena and adds them to the graph
+// builder directly from the protos. The arena is reset after each batch.
+void BM_AddSerializedProtoOnArena(benchmark::State& state) {
+  const std::vector<std::string> protos =
+      GetSerializedBatch(state.range(0), state.range(1));
+  const std::unique_ptr<BasicBlockGraphBuilder> builder = CreateGraphBuilder();
+  google::protobuf::Arena arena;
+  const auto add_blocks = [&]() {
+    for (const std::string& serialized_proto : protos) {
+      const BasicBlockProto* const proto =
+          ParseProtoOnArena<BasicBlockProto>(serialized_proto, arena);
+      CHECK(proto != nullptr);
+      CHECK(AddBasicBlockFromProto(*proto, *builder));
+    }
+  };
+  add_blocks();
+  builder->Reset();
+  arena.Reset();
+
+  const int64_t start_allocated_bytes = num_allocated_bytes.load();
+  int64_t excluded_bytes = 0;
+  for (auto _ : state) {
+    add_blocks();
+    RunPaused(state, excluded_bytes, [&]() { builder->Reset(); });
+    arena.Reset();
+  }
+  SetCounters(state, start_allocated_bytes, excluded_bytes, protos.size());
+}
+
+// Adds the basic blocks to the graph builder directly from a memory-mapped
+// columnar data set.
+void BM_AddFromColumnarDataset(benchmark::State& state) {
+  const std::unique_ptr<ColumnarDataset> dataset =
+      GetColumnarBatch(state.range(0), state.range(1));
+  const std::unique_ptr<BasicBlockGraphBuilder> builder = CreateGraphBuilder();
+  const auto add_blocks = [&]() {
+    for (int64_t i = 0; i < dataset->num_blocks(); ++i) {
+      CHECK(AddBasicBlockFromColumnarDataset(*dataset, i, *builder));
+    }
+  };
+  add_blocks();
+  builder->Reset();
+
+  const int64_t start_allocated_bytes = num_allocated_bytes.load();
+  int64_t excluded_bytes = 0;
+  for (auto _ : state) {
+    add_blocks();
+    RunPaused(state, excluded_bytes, [&]() { builder->Reset(); });
+  }
+  SetCounters(state, start_allocated_bytes, excluded_bytes,
+              dataset->num_blocks());
+}
+
+// Resets a graph builder that contains a full batch.
+void BM_Reset(benchmark::State& state) {
+  const std::vector<BasicBlock> blocks =
+      GetBatch(state.range(0), state.range(1));
+  const std::unique_ptr<BasicBlockGraphBuilder> builder = CreateGraphBuilder();
+
+  const int64_t start_allocated_bytes = num_allocated_bytes.load();
+  int64_t excluded_bytes = 0;
+  for (auto _ : state) {
+    RunPaused(state, excluded_bytes, [&]() { AddBlocks(*builder, blocks); });
+    builder->Reset();
+  }
+  SetCounters(state, start_allocated_bytes, excluded_bytes, blocks.size());
+}
+
+// Reads the edge features of a full batch.
+void BM_EdgeFeatures(benchmark::State& state) {
+  const std::vector<BasicBlock> blocks =
+      GetBatch(state.range(0), state.range(1));
+  const std::unique_ptr<BasicBlockGraphBuilder> builder = CreateGraphBuilder();
+  AddBlocks(*builder, blocks);
+
+  const int64_t start_allocated_bytes = num_allocated_bytes.load();
+  for (auto _ : state) {
+    std::vector<int> edge_features = builder->EdgeFeatures();
+    benchmark::DoNotOptimize(edge_features.data());
+  }
+  SetCounters(state, start_allocated_bytes, /* excluded_bytes = */ 0,
+              blocks.size());
+}
+
+// Reads the instruction node mask of a full batch.
+void BM_InstructionNodeMask(benchmark::State& state) {
+  const std::vector<BasicBlock> blocks =
+      GetBatch(state.range(0), state.range(1));
+  const std::unique_ptr<BasicBlockGraphBuilder> builder = CreateGraphBuilder();
+  AddBlocks(*builder, blocks);
+
+  const int64_t start_allocated_bytes = num_allocated_bytes.load();
+  for (auto _ : state) {
+    std::vector<bool> instruction_node_mask = builder->InstructionNodeMask();
+    benchmark::DoNotOptimize(instruction_node_mask);
+  }
+  SetCounters(state, start_allocated_bytes, /* excluded_bytes = */ 0,
+              blocks.size());
+}
+
+// Reads the delta block index of a full batch.
+void BM_DeltaBlockIndex(benchmark::State& state) {
+  const std::vector<BasicBlock> blocks =
+      GetBatch(state.range(0), state.range(1));
+  const std::unique_ptr<BasicBlockGraphBuilder> builder = CreateGraphBuilder();
+  AddBlocks(*builder, blocks);
+
+  const int64_t start_allocated_bytes = num_allocated_bytes.load();
+  for (auto _ : state) {
+    std::vector<int> delta_block_index = builder->DeltaBlockIndex();
+    benchmark::DoNotOptimize(delta_block_index.data());
+  }
+  SetCounters(state, start_allocated_bytes, /* excluded_bytes = */ 0,
+              blocks.size());
+}
+
+// Builds a complete batch the same way as the inference code: adds the basic
+// blocks and writes all the data of the batch to buffers that stand in for the
+// input tensors of the model.
+void BM_BuildBatch(benchmark::State& state) {
+  const std::vector<BasicBlock> blocks =
+      GetBatch(state.range(0), state.range(1));
+  const std::unique_ptr<BasicBlockGraphBuilder> builder = CreateGraphBuilder();
+  std::vector<int> node_features;
+  std::vector<BasicBlockGraphBuilder::NodeIndex> edge_senders;
+  std::vector<BasicBlockGraphBuilder::NodeIndex> edge_receivers;
+  std::vector<int> edge_features;
+  std::vector<int> global_features;
+  std::unique_ptr<bool[]> instruction_node_mask;
+  std::vector<int> delta_block_index;
+  const auto build_batch = [&]() {
+    builder->Reset();
+    AddBlocks(*builder, blocks);
+    node_features.assign(builder->node_features().begin(),
+                         builder->node_features().end());
+    edge_senders.assign(builder->edge_senders().begin(),
+                        builder->edge_senders().end());
+    edge_receivers.assign(builder->edge_receivers().begin(),
+                          builder->edge_receivers().end());
+    edge_features.resize(builder->num_edges());
+    builder->WriteEdgeFeatures(edge_features.data());
+    global_features.resize(builder->num_graphs() * builder->num_node_tokens());
+    builder->WriteGlobalFeatures(global_features.data());
+    builder->WriteInstructionNodeMask(instruction_node_mask.get());
+    delta_block_index.resize(builder->num_instructions());
+    builder->WriteDeltaBlockIndex(delta_block_index.data());
+  };
+  // The first batch sizes the buffers. The mask is a plain array, like the
+  // boolean input tensor it stands in for.
+  AddBlocks(*builder, blocks);
+  instruction_node_mask = std::make_unique<bool[]>(builder->num_nodes());
+  build_batch();
+
+  const int64_t start_allocated_bytes = num_allocated_bytes.load();
+  for (auto _ : state) {
+    build_batch();
+    benchmark::ClobberMemory();
+  }
+  SetCounters(state, start_allocated_bytes, /* excluded_bytes = */ 0,
+              blocks.size());
+}
+
+void DatasetsAndBatchSizes(benchmark::internal::Benchmark* benchmark) {
+  benchmark->ArgNames({"dataset", "num_blocks"});
+  for (const int dataset :
+       {kThroughputTestData, kMirWithoutLiveInfo, kMirWithInterference}) {
+    for (const int num_blocks : {1, 100, 1000}) {
+      benchmark->Args({dataset, num_blocks});
+    }
+  }
+}
+
+BENCHMARK(BM_AddBasicBlock)->Apply(DatasetsAndBatchSizes);
+BENCHMARK(BM_AddSerializedProtoViaBasicBlock)->Apply(DatasetsAndBatchSizes);
+BENCHMARK(BM_AddSerializedProtoOnArena)->Apply(DatasetsAndBatchSizes);
+BENCHMARK(BM_AddFromColumnarDataset)->Apply(DatasetsAndBatchSizes);
+BENCHMARK(BM_Reset)->Apply(DatasetsAndBatchSizes);
+BENCHMARK(BM_EdgeFeatures)->Apply(DatasetsAndBatchSizes);
+BENCHMARK(BM_InstructionNodeMask)->Apply(DatasetsAndBatchSizes);
+BENCHMARK(BM_DeltaBlockIndex)->Apply(DatasetsAndBatchSizes);
+BENCHMARK(BM_BuildBatch)->Apply(DatasetsAndBatchSizes);
+
+}  // namespace
+}  // namespace gematria
@@ -0,0 +1,125 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/granite/graph_builder_columnar.h"
+
+#include <cstdint>
+#include <vector>
+
+#include "absl/types/span.h"
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/basic_block_protos.h"
+#include "gematria/granite/graph_builder.h"
+#include "gematria/io/columnar_dataset.h"
+
+namespace gematria {
+namespace {
+
+using InstructionView = BasicBlockGraphBuilder::InstructionView;
+using IntListView = BasicBlockGraphBuilder::IntListView;
+using OperandView = BasicBlockGraphBuilder::OperandView;
+using RegisterView = BasicBlockGraphBuilder::RegisterView;
+using StringListView = BasicBlockGraphBuilder::StringListView;
+
+RegisterView MakeRegisterView(const ColumnarDataset& dataset,
+                              const ColumnarRegister& reg) {
+  const absl::Span<const uint32_t> interfered_registers =
+      dataset.interfered_registers(reg);
+  const absl::Span<const int32_t> interfered_register_sizes =
+      dataset.interfered_register_sizes(reg);
+  return {dataset.token(reg.name),
+          StringListView(dataset.tokens().data(), interfered_registers.data(),
+                         interfered_registers.size()),
+          IntListView(interfered_register_sizes.data(),
+                      interfered_register_sizes.size())};
+}
+
+void MakeOperandView(const ColumnarDataset& dataset,
+                     const ColumnarOperand& operand, OperandView& view) {
+  view = OperandView();
+  view.type = static_cast<OperandType>(operand.type);
+  switch (view.type) {
+    case OperandType::kUnknown:
+    case OperandType::kImmediateValue:
+    case OperandType::kFpImmediateValue:
+      break;
+    case OperandType::kRegister:
+      view.register_operand.name = dataset.token(
+          operand.registers[ColumnarOperand::kRegister].name);
+      break;
+    case OperandType::kAddress:
+      view.base_register = MakeRegisterView(
+          dataset, operand.registers[ColumnarOperand::kBase]);
+      view.index_register = MakeRegisterView(
+          dataset, operand.registers[ColumnarOperand::kIndex]);
+      view.segment_register = MakeRegisterView(
+          dataset, operand.registers[ColumnarOperand::kSegment]);
+      view.displacement = static_cast<int64_t>(operand.value);
+      break;
+    case OperandType::kMemory:
+      view.alias_group_id = operand.int_value;
+      break;
+    case OperandType::kVirtualRegister: {
+      const ColumnarRegister& reg =
+          operand.registers[ColumnarOperand::kRegister];
+      view.register_operand = MakeRegisterView(dataset, reg);
+      view.register_size = reg.size;
+    } break;
+  }
+}
+
+void MakeOperandViews(const ColumnarDataset& dataset,
+                      absl::Span<const ColumnarOperand> operands,
+                      std::vector<OperandView>& views) {
+  views.resize(operands.size());
+  for (size_t i = 0; i < operands.size(); ++i) {
+    MakeOperandView(dataset, operands[i], views[i]);
+  }
+}
+
+}  // namespace
+
+bool AddBasicBlockFromColumnarDataset(const ColumnarDataset& dataset,
+                                      int64_t block_index,
+                                      BasicBlockGraphBuilder& graph_builder) {
+  // Block deduplication uses fingerprints computed from BasicBlock objects.
+  if (graph_builder.deduplicate_blocks()) {
+    return graph_builder.AddBasicBlock(BasicBlockFromProto(
+        dataset.GetBasicBlockWithThroughputProto(block_index).basic_block()));
+  }
+  const absl::Span<const ColumnarInstruction> instructions =
+      dataset.instructions(dataset.block(block_index));
+  return graph_builder.AddBasicBlockFromInstructionViews(
+      instructions.size(),
+      [&dataset, instructions](int index, InstructionView& view) {
+        const ColumnarInstruction& instruction = instructions[index];
+        const absl::Span<const uint32_t> prefixes =
+            dataset.prefixes(instruction);
+        view.mnemonic = dataset.token(instruction.mnemonic);
+        view.mnemonic_symbol = kInvalidSymbol;
+        view.prefixes = StringListView(dataset.tokens().data(),
+                                       prefixes.data(), prefixes.size());
+        MakeOperandViews(dataset, dataset.input_operands(instruction),
+                         view.input_operands);
+        MakeOperandViews(dataset, dataset.implicit_input_operands(instruction),
+                         view.implicit_input_operands);
+        MakeOperandViews(dataset, dataset.output_operands(instruction),
+                         view.output_operands);
+        MakeOperandViews(dataset,
+                         dataset.implicit_output_operands(instruction),
+                         view.implicit_output_operands);
+      });
+}
+
+}  // namespace gematria
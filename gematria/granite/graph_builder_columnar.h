@@ -0,0 +1,41 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Functions for adding basic blocks to a BasicBlockGraphBuilder directly from
+// a memory-mapped ColumnarDataset. They are kept in a separate library so that
+// the graph builder itself does not depend on the data set format.
+
+#ifndef GEMATRIA_GRANITE_GRAPH_BUILDER_COLUMNAR_H_
+#define GEMATRIA_GRANITE_GRAPH_BUILDER_COLUMNAR_H_
+
+#include <cstdint>
+
+#include "gematria/granite/graph_builder.h"
+#include "gematria/io/columnar_dataset.h"
+
+namespace gematria {
+
+// Adds the basic block with index `block_index` from `dataset` to
+// `graph_builder`. This is equivalent to adding the block from
+// dataset.GetBasicBlockWithThroughputProto(block_index), but unless block
+// deduplication is enabled, the nodes and edges are created directly from the
+// mapped data, without creating any protos or strings. Returns the same value
+// as BasicBlockGraphBuilder::AddBasicBlock().
+bool AddBasicBlockFromColumnarDataset(const ColumnarDataset& dataset,
+                                      int64_t block_index,
+                                      BasicBlockGraphBuilder& graph_builder);
+
+}  // namespace gematria
+
+#endif  // GEMATRIA_GRANITE_GRAPH_BUILDER_COLUMNAR_H_
@@ -0,0 +1,223 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/granite/graph_builder_columnar.h"
+
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "gematria/basic_block/basic_block_protos.h"
+#include "gematria/granite/graph_builder.h"
+#include "gematria/io/columnar_dataset.h"
+#include "gematria/model/oov_token_behavior.h"
+#include "gematria/proto/basic_block.pb.h"
+#include "gematria/proto/throughput.pb.h"
+#include "gematria/testing/matchers.h"
+#include "gematria/testing/parse_proto.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::ElementsAre;
+
+constexpr absl::string_view kImmediateToken = "_IMMEDIATE_";
+constexpr absl::string_view kFpImmediateToken = "_FP_IMMEDIATE_";
+constexpr absl::string_view kAddressToken = "_ADDRESS_";
+constexpr absl::string_view kMemoryToken = "_MEMORY_";
+constexpr absl::string_view kTokens[] = {
+    kImmediateToken, kFpImmediateToken, kAddressToken, kMemoryToken,
+    "COPY",          "LEA",             "LOCK",        "MOV",
+    "MOV32rm",       "MOV64mr",         "NOT",         "RAX",
+    "RBP",           "RBX",             "RDI",         "_VREG32_",
+    "_VREG64_"};
+
+constexpr absl::string_view kX86BasicBlock = R"pb(
+  canonicalized_instructions {
+    mnemonic: "LEA"
+    llvm_mnemonic: "LEA64r"
+    output_operands { register_name: "RDI" }
+    input_operands {
+      address { base_register: "RBX" index_register: "RAX" displacement: 8 }
+    }
+  }
+  canonicalized_instructions {
+    mnemonic: "NOT"
+    llvm_mnemonic: "NOT64m"
+    prefixes: "LOCK"
+    output_operands { memory { alias_group_id: 1 } }
+    input_operands { memory { alias_group_id: 1 } }
+    input_operands { address { base_register: "RDI" scaling: 1 } }
+  }
+  canonicalized_instructions {
+    mnemonic: "MOV"
+    llvm_mnemonic: "MOV64ri"
+    output_operands { register_name: "RAX" }
+    input_operands { immediate_value: 1 }
+  }
+)pb";
+
+constexpr absl::string_view kVirtualRegisterBasicBlock = R"pb(
+  canonicalized_instructions {
+    mnemonic: "COPY"
+    llvm_mnemonic: "COPY"
+    output_operands {
+      virtual_register { name: "%0" size: 64 }
+      intefered_register: "%1"
+      intefered_register: "RDI"
+      intefered_register_sizes: 32
+      intefered_register_sizes: 64
+    }
+    input_operands { register_name: "RDI" }
+  }
+  canonicalized_instructions {
+    mnemonic: "MOV64mr"
+    llvm_mnemonic: "MOV64mr"
+    output_operands { memory { alias_group_id: 1 } }
+    input_operands { address { base_register: "RBP" scaling: 1 } }
+    input_operands {
+      virtual_register { name: "%0" size: 64 }
+      intefered_register: "%1"
+      intefered_register_sizes: 32
+    }
+  }
+  canonicalized_instructions {
+    mnemonic: "MOV32rm"
+    llvm_mnemonic: "MOV32rm"
+    output_operands {
+      virtual_register { name: "%1" size: 32 }
+      intefered_register: "%0"
+      intefered_register_sizes: 64
+    }
+    input_operands { memory { alias_group_id: 1 } }
+    input_operands {
+      address {
+        base_register: "%2"
+        base_register_size: 64
+        base_register_intefered_register: "%0"
+        base_register_intefered_register_sizes: 64
+        scaling: 1
+      }
+    }
+  }
+)pb";
+
+std::unique_ptr<BasicBlockGraphBuilder> CreateBuilder(
+    OutOfVocabularyTokenBehavior out_of_vocabulary_behavior) {
+  return std::make_unique<BasicBlockGraphBuilder>(
+      std::vector<std::string>(std::begin(kTokens), std::end(kTokens)),
+      /*immediate_token =*/kImmediateToken,
+      /*fp_immediate_token =*/kFpImmediateToken,
+      /*address_token =*/kAddressToken,
+      /*memory_token =*/kMemoryToken, out_of_vocabulary_behavior);
+}
+
+// Checks that `actual` contains the same graphs as `expected`.
+void ExpectSameGraphs(const BasicBlockGraphBuilder& actual,
+                      const BasicBlockGraphBuilder& expected) {
+  EXPECT_EQ(actual.num_blocks(), expected.num_blocks());
+  EXPECT_EQ(actual.num_graphs(), expected.num_graphs());
+  EXPECT_EQ(actual.num_nodes_per_block(), expected.num_nodes_per_block());
+  EXPECT_EQ(actual.num_edges_per_block(), expected.num_edges_per_block());
+  EXPECT_EQ(actual.node_types(), expected.node_types());
+  EXPECT_EQ(actual.node_features(), expected.node_features());
+  EXPECT_EQ(actual.edge_senders(), expected.edge_senders());
+  EXPECT_EQ(actual.edge_receivers(), expected.edge_receivers());
+  EXPECT_EQ(actual.edge_types(), expected.edge_types());
+  EXPECT_EQ(actual.global_features_data(), expected.global_features_data());
+  EXPECT_EQ(actual.block_graph_indices(), expected.block_graph_indices());
+}
+
+constexpr absl::string_view kOutOfVocabularyBasicBlock = R"pb(
+  canonicalized_instructions {
+    mnemonic: "MOV"
+    llvm_mnemonic: "MOV64rr"
+    output_operands { register_name: "RAX" }
+    input_operands { register_name: "R15" }
+  }
+)pb";
+
+class AddBasicBlockFromColumnarDatasetTest : public ::testing::Test {
+ protected:
+  // Writes `blocks` to a columnar data set and opens it.
+  void CreateDataset(const std::vector<absl::string_view>& blocks) {
+    ColumnarDatasetWriter writer;
+    for (const absl::string_view block : blocks) {
+      BasicBlockWithThroughputProto proto;
+      *proto.mutable_basic_block() = ParseTextProto(std::string(block));
+      ASSERT_OK(writer.Add(proto));
+    }
+    const ::testing::TestInfo* const test_info =
+        ::testing::UnitTest::GetInstance()->current_test_info();
+    const std::string file_name =
+        ::testing::TempDir() + "/" + test_info->name() + ".gmcol";
+    ASSERT_OK(writer.Write(file_name));
+    absl::StatusOr<std::unique_ptr<ColumnarDataset>> dataset =
+        ColumnarDataset::Open(file_name);
+    ASSERT_OK(dataset);
+    dataset_ = *std::move(dataset);
+  }
+
+  std::unique_ptr<ColumnarDataset> dataset_;
+};
+
+TEST_F(AddBasicBlockFromColumnarDatasetTest, SameGraphAsBasicBlock) {
+  ASSERT_NO_FATAL_FAILURE(
+      CreateDataset({kX86BasicBlock, kVirtualRegisterBasicBlock}));
+  auto expected = CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  auto actual = CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  for (const absl::string_view text_proto :
+       {kX86BasicBlock, kVirtualRegisterBasicBlock}) {
+    ASSERT_TRUE(expected->AddBasicBlock(
+        BasicBlockFromProto(ParseTextProto(std::string(text_proto)))));
+  }
+  for (int i = 0; i < dataset_->num_blocks(); ++i) {
+    ASSERT_TRUE(AddBasicBlockFromColumnarDataset(*dataset_, i, *actual));
+  }
+  ExpectSameGraphs(*actual, *expected);
+}
+
+TEST_F(AddBasicBlockFromColumnarDatasetTest, OutOfVocabularyToken) {
+  ASSERT_NO_FATAL_FAILURE(
+      CreateDataset({kX86BasicBlock, kOutOfVocabularyBasicBlock, ""}));
+  auto builder = CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  ASSERT_TRUE(AddBasicBlockFromColumnarDataset(*dataset_, 0, *builder));
+  EXPECT_FALSE(AddBasicBlockFromColumnarDataset(*dataset_, 1, *builder));
+  EXPECT_FALSE(AddBasicBlockFromColumnarDataset(*dataset_, 2, *builder));
+
+  // The failed blocks did not change the state of the graph builder.
+  auto expected = CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  ASSERT_TRUE(expected->AddBasicBlock(
+      BasicBlockFromProto(ParseTextProto(std::string(kX86BasicBlock)))));
+  ExpectSameGraphs(*builder, *expected);
+}
+
+TEST_F(AddBasicBlockFromColumnarDatasetTest, WithDeduplication) {
+  ASSERT_NO_FATAL_FAILURE(CreateDataset({kX86BasicBlock, kX86BasicBlock}));
+  auto builder = CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  builder->SetDeduplicateBlocks(true);
+  ASSERT_TRUE(AddBasicBlockFromColumnarDataset(*dataset_, 0, *builder));
+  ASSERT_TRUE(AddBasicBlockFromColumnarDataset(*dataset_, 1, *builder));
+  EXPECT_EQ(builder->num_blocks(), 2);
+  EXPECT_EQ(builder->num_graphs(), 1);
+  EXPECT_THAT(builder->block_graph_indices(), ElementsAre(0, 0));
+}
+
+}  // namespace
+}  // namespace gematria
@@ -18,37 +18,56 @@
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <memory>
+#include <optional>
 #include <string>
 #include <string_view>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
 #include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/basic_block_edits.h"
+#include "gematria/basic_block/compact_basic_block.h"
+#include "gematria/basic_block/symbol_table.h"
 #include "gematria/granite/graph_builder.h"
+#include "gematria/granite/prediction_cache.h"
 #include "gematria/model/oov_token_behavior.h"
+#include "gematria/tflite/float16.h"
 #include "gematria/tflite/unsorted_segment_sum_op.h"
 #include "gematria/utils/string.h"
+#include "gematria/utils/trace.h"
 #include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/Twine.h"
 #include "llvm/Support/Errc.h"
 #include "llvm/Support/Error.h"
 #include "tensorflow/lite/c/c_api_types.h"
 #include "tensorflow/lite/c/common.h"
+#include "tensorflow/lite/core/api/op_resolver.h"
+#ifdef GEMATRIA_ENABLE_XNNPACK
+#include "tensorflow/lite/delegates/xnnpack/xnnpack_delegate.h"
+#endif  // GEMATRIA_ENABLE_XNNPACK
 #include "tensorflow/lite/interpreter.h"
 #include "tensorflow/lite/interpreter_builder.h"
 #include "tensorflow/lite/kernels/register.h"
 #include "tensorflow/lite/model_builder.h"
 #include "tensorflow/lite/portable_type_to_tflitetype.h"
+#include "tensorflow/lite/schema/schema_generated.h"
 
 namespace gematria {
 namespace {
 
 using ::tflite::FlatBufferModel;
 
-// The indices of the input tensors in the compiled TensorFlow Lite model. This
-// order of the input tensors must be preserved during the conversion of the
-// model to the .tflite format.
+static_assert(std::is_same_v<PredictionCache::OutputType,
+                             GraphBuilderModelInference::OutputType>,
+              "The prediction cache must store the outputs of the model");
+
+// The indices of the input tensors of the model. These are indices into
+// `kInputTensorNames` and into the vector of resolved tensor indices stored in
+// GraphBuilderModelInference; the actual tensor indices in the interpreter are
+// looked up by name when the inference object is created.
 constexpr int kDeltaBlockIndexTensor = 0;
 constexpr int kGraphNodesTensor = 1;
 constexpr int kGraphEdgesTensor = 2;
@@ -61,6 +80,26 @@ constexpr int kInstructionNodeMaskTensor = 8;
 
 constexpr int kNumInputTensors = 9;
 
+// The names of the input tensors, indexed by the constants above. The names
+// must be the same as the names of the placeholder tensors created by the
+// Python code in gematria/model/python/model_base.py,
+// gematria/granite/python/gnn_model_base.py and
+// gematria/granite/python/graph_builder_model_base.py.
+constexpr std::string_view kInputTensorNames[kNumInputTensors] = {
+    "ModelBase.delta_block_index_tensor",
+    "GnnModelBase.node_features",
+    "GnnModelBase.edge_features",
+    "GnnModelBase.global_features",
+    "GnnModelBase.receivers",
+    "GnnModelBase.senders",
+    "GnnModelBase.num_edges",
+    "GnnModelBase.num_nodes",
+    "GraphBuilderModelBase.instruction_node_mask",
+};
+
+// The name of the output tensor that contains the predictions of the model.
+constexpr std::string_view kOutputTensorName = "ModelBase.output_tensor";
+
 // The indices of special node token indices in the tensor
 // `GraphBuilderModelBase.special_tokens`. For example the token used for
 // address computation nodes can be obtained as
@@ -87,170 +126,101 @@ constexpr std::string_view kSpecialTokensTensorName =
 // Checks that:
 // 1. `tensor` != nullptr,
 // 2. `tensor` has type `tensor_type`.
-// 3. `tensor` has the number of dimensions corresponding to the number of
-// elements of `sizes`, and the sizes in those dimensions are equal to `sizes`.
+// 3. `tensor->dims_signature` has the number of dimensions corresponding to the
+// number of elements of `sizes`, and the sizes in those dimensions are equal to
+// `sizes`. A size of -1 in `sizes` matches a dimension of variable size.
 // Returns `llvm::Error::success()` when all checks pass, an error otherwise.
 //
-// TODO(ondrasej): See if we can replace this function and the one below with
+// TODO(ondrasej): See if we can replace this function with
 // TFModelEvaluatorImpl::checkReportAndInvalidate.
 template <typename... Args>
-llvm::Error CheckTensorTypeAndDimensions(int tensor_index,
-                                         const TfLiteTensor* tensor,
-                                         TfLiteType tensor_type,
-                                         Args... sizes) {
-  const int64_t sizes_array[] = {static_cast<int64_t>(sizes)...};
+llvm::Error CheckTensorTypeAndSignature(int tensor_index,
+                                        const TfLiteTensor* tensor,
+                                        TfLiteType tensor_type,
+                                        Args... sizes) {
+  const int sizes_array[] = {sizes...};
   const int num_dimensions = std::size(sizes_array);
   if (tensor == nullptr) {
     return llvm::createStringError(llvm::errc::invalid_argument,
-                                   "Input tensor was not found at index %d.",
+                                   "Tensor was not found at index %d.",
                                    tensor_index);
   }
   if (tensor->type != tensor_type) {
     return llvm::createStringError(llvm::errc::invalid_argument,
-                                   "Input tensor at index %d has invalid type.",
-                                   tensor_index);
+                                   "Tensor %s at index %d has invalid type.",
+                                   tensor->name, tensor_index);
   }
-  if (tensor->dims->size != num_dimensions) {
+  if (tensor->dims_signature == nullptr ||
+      tensor->dims_signature->size != num_dimensions) {
     return llvm::createStringError(
         llvm::errc::invalid_argument,
-        "Input tensor at index %d has invalid number of dimensions. Expected "
+        "Tensor %s at index %d has invalid number of dimensions. Expected "
         "%d, found %d.",
-        tensor_index, num_dimensions, tensor->dims->size);
-  }
-  for (int i = 0; i < num_dimensions; ++i) {
-    if (tensor->dims->data[i] != sizes_array[i]) {
-      return llvm::createStringError(
-          llvm::errc::invalid_argument,
-          "Input tensor at index %d has unexpected size at dimension %d",
-          tensor_index, i);
-    }
-  }
-
-  return llvm::Error::success();
-}
-
-// Similar to `CheckTensorTypeAndDimensions`, but tests `tensor->dims_signature`
-// rather than `tensor->dims`.
-template <typename... Args>
-llvm::Error CheckTensorSignature(int tensor_index, const TfLiteTensor* tensor,
-                                 Args... sizes) {
-  const int sizes_array[] = {sizes...};
-  const int num_dimensions = std::size(sizes_array);
-  if (tensor == nullptr) {
-    return llvm::createStringError(llvm::errc::invalid_argument,
-                                   "Input tensor was not found at index %d.",
-                                   tensor_index);
-  }
-  if (tensor->dims_signature->size != num_dimensions) {
-    return llvm::createStringError(
-        llvm::errc::invalid_argument,
-        "Input tensor at index %d has invalid number of dimensions. Expected "
-        "%d, found %d.",
-        tensor_index, num_dimensions, tensor->dims_signature->size);
+        tensor->name, tensor_index, num_dimensions,
+        tensor->dims_signature == nullptr ? 0 : tensor->dims_signature->size);
   }
   for (int i = 0; i < num_dimensions; ++i) {
     if (tensor->dims_signature->data[i] != sizes_array[i]) {
       return llvm::createStringError(
           llvm::errc::invalid_argument,
-          "Input tensor at index %d has unexpected size at dimension %d",
-          tensor_index, i);
+          "Tensor %s at index %d has unexpected size at dimension %d",
+          tensor->name, tensor_index, i);
     }
   }
 
   return llvm::Error::success();
 }
 
-// Fills a 1D tensor at the given index in `interpreter` from the given
-// std::vector. Returns an error if the tensor shape does not match the size of
-// the vector or the type of the tensor does not match the requested tensor
-// element type.
-template <typename TensorElementType, typename InputElementType>
-llvm::Error FillTensorFromStdVector(
-    tflite::Interpreter* interpreter,
-    const std::vector<InputElementType>& input_vector, int tensor_index) {
-  const TfLiteTensor* const tensor = interpreter->input_tensor(tensor_index);
-  if (llvm::Error error = CheckTensorTypeAndDimensions(
-          tensor_index, tensor, tflite::typeToTfLiteType<TensorElementType>(),
-          static_cast<int>(input_vector.size()))) {
-    return error;
-  }
+// Returns a pointer to the data of the tensor at the given tensor index in
+// `interpreter`. The type of the tensor must be checked by the caller, and the
+// tensor must be allocated.
+template <typename TensorElementType>
+TensorElementType* MutableTensorData(tflite::Interpreter* interpreter,
+                                     int tensor_index) {
   auto* const tensor_data =
-      interpreter->typed_input_tensor<TensorElementType>(tensor_index);
-  std::copy(input_vector.begin(), input_vector.end(), tensor_data);
-  return llvm::Error::success();
+      interpreter->typed_tensor<TensorElementType>(tensor_index);
+  assert(tensor_data != nullptr ||
+         interpreter->tensor(tensor_index)->bytes == 0);
+  return tensor_data;
 }
 
-// Fills a 2D tensor at the given index in `interpreter` from a given matrix
-// represented as a vector of vectors. The data are added to the tensor in the
-// natural ordering (the inner vectors of the matrix are concatenated into the
-// flat tensor buffer).
-// Returns an error if the tensor shape does not match the shape of the matrix
-// or the type of the tensor does not match the requested tensor element type.
+// Fills a 1D tensor at the given tensor index in `interpreter` from the given
+// std::vector. Expects that the tensor was already resized to at least the size
+// of the vector, and that its type was checked when the model was loaded. When
+// the tensor is larger than the vector, the remaining elements are not
+// modified.
 template <typename TensorElementType, typename InputElementType>
-llvm::Error FillTensorFromStdVectorMatrix(
-    tflite::Interpreter* interpreter,
-    const std::vector<std::vector<InputElementType>>& input_matrix,
-    int tensor_index) {
-  const TfLiteTensor* const tensor = interpreter->input_tensor(tensor_index);
-  if (llvm::Error error = CheckTensorTypeAndDimensions(
-          tensor_index, tensor, tflite::typeToTfLiteType<TensorElementType>(),
-          input_matrix.size(), input_matrix[0].size())) {
-    return error;
-  }
-
-  const int expected_size = tensor->dims->data[1];
-  auto* const tensor_data =
-      interpreter->typed_input_tensor<TensorElementType>(tensor_index);
-  for (int row = 0; row < input_matrix.size(); ++row) {
-    const std::vector<TensorElementType>& row_data = input_matrix[row];
-    if (expected_size != row_data.size()) {
-      return llvm::createStringError(
-          llvm::errc::invalid_argument,
-          "Unexpected row data size. Expected %d, found %d", expected_size,
-          row_data.size());
-    }
-    std::copy(row_data.begin(), row_data.end(),
-              tensor_data + expected_size * row);
-  }
-  return llvm::Error::success();
+void FillTensorFromStdVector(tflite::Interpreter* interpreter,
+                             const std::vector<InputElementType>& input_vector,
+                             int tensor_index) {
+  assert(interpreter->tensor(tensor_index)->dims->size == 1);
+  assert(interpreter->tensor(tensor_index)->dims->data[0] >=
+         input_vector.size());
+  std::copy(input_vector.begin(), input_vector.end(),
+            MutableTensorData<TensorElementType>(interpreter, tensor_index));
 }
 
-// Resizes a 1D tensor at the given index in `interpreter` to a given size.
-// Requires that the tensor is a 1D variable size tensor, i.e. its
-// dims_signature is [-1].
-llvm::Error Resize1DTensor(tflite::Interpreter* interpreter, int tensor_index,
-                           int desired_size) {
-  assert(interpreter != nullptr);
-  const TfLiteTensor* const tensor = interpreter->input_tensor(tensor_index);
-  if (llvm::Error error = CheckTensorSignature(tensor_index, tensor, -1)) {
-    return error;
-  }
-
-  const TfLiteStatus status =
-      interpreter->ResizeInputTensor(tensor_index, {desired_size});
-  if (status != kTfLiteOk) {
-    return llvm::make_error<llvm::StringError>(
-        "Resizing the tensor failed with status " + llvm::Twine(status),
-        llvm::errc::invalid_argument);
-  }
-  return llvm::Error::success();
+// Returns the smallest bucket size from `bucket_sizes` that is greater than or
+// equal to `size`. When `bucket_sizes` is empty or when `size` is greater than
+// all bucket sizes, returns the smallest power of two that is greater than or
+// equal to `size`. `bucket_sizes` must be sorted in the increasing order.
+int RoundUpToBucket(int size, const std::vector<int>& bucket_sizes) {
+  const auto bucket =
+      std::lower_bound(bucket_sizes.begin(), bucket_sizes.end(), size);
+  if (bucket != bucket_sizes.end()) return *bucket;
+  int power_of_two = 1;
+  while (power_of_two < size) power_of_two *= 2;
+  return power_of_two;
 }
 
-// Resizes a 2D tensor at the given index in `interpreter` to a given batch
-// size. Requires that the tensor is a 2D tensor where the first dimension has a
-// variable size, i.e. its dims_signature is [-1, expected_second_dimension].
-llvm::Error Resize2DTensor(tflite::Interpreter* interpreter, int tensor_index,
-                           int desired_first_dimension_size,
-                           int expected_second_dimension_size) {
+// Resizes the input tensor at the given tensor index in `interpreter` to the
+// given shape. The tensor signature is checked when the model is loaded.
+llvm::Error ResizeInputTensor(tflite::Interpreter* interpreter,
+                              int tensor_index,
+                              const std::vector<int>& desired_shape) {
   assert(interpreter != nullptr);
-  const TfLiteTensor* const tensor = interpreter->input_tensor(tensor_index);
-  if (llvm::Error error = CheckTensorSignature(
-          tensor_index, tensor, -1, expected_second_dimension_size)) {
-    return error;
-  }
-  const TfLiteStatus status = interpreter->ResizeInputTensor(
-      tensor_index,
-      {desired_first_dimension_size, expected_second_dimension_size});
+  const TfLiteStatus status =
+      interpreter->ResizeInputTensor(tensor_index, desired_shape);
   if (status != kTfLiteOk) {
     return llvm::make_error<llvm::StringError>(
         "Resizing the tensor failed with status " + llvm::Twine(status),
@@ -273,16 +243,26 @@ llvm::Expected<int> TensorIndexByName(const tflite::Interpreter& interpreter,
     }
   }
   return llvm::make_error<llvm::StringError>(
-      llvm::Twine("Tensor was not found") + name, llvm::errc::invalid_argument);
+      llvm::Twine("Tensor was not found: ") + name,
+      llvm::errc::invalid_argument);
+}
+
+// Creates the op resolver used for Gematria models. The resolver contains all
+// TensorFlow Lite builtin ops and the custom ops used by the models.
+std::unique_ptr<tflite::OpResolver> CreateOpResolver() {
+  auto resolver = std::make_unique<tflite::ops::builtin::BuiltinOpResolver>();
+  resolver->AddCustom(kUnsortedSegmentSumOpName,
+                      RegisterUnsortedSegmentSumOp());
+  resolver->AddCustom(kGatherUnsortedSegmentSumOpName,
+                      RegisterGatherUnsortedSegmentSumOp());
+  return resolver;
 }
 
 // Creates a new interpreter for `tflite_model`. Returns an error when the
 // interpreter can't be created, e.g. when the model uses unsupported TensorFlow
-// ops.
+// ops. `resolver` must outlive the returned interpreter.
 llvm::Expected<std::unique_ptr<tflite::Interpreter>> CreateInterpreter(
-    const FlatBufferModel& tflite_model) {
-  tflite::ops::builtin::BuiltinOpResolver resolver;
-  resolver.AddCustom(kUnsortedSegmentSumOpName, RegisterUnsortedSegmentSumOp());
+    const FlatBufferModel& tflite_model, const tflite::OpResolver& resolver) {
   std::unique_ptr<tflite::Interpreter> interpreter;
   const TfLiteStatus status =
       tflite::InterpreterBuilder(tflite_model, resolver)(&interpreter);
@@ -294,32 +274,143 @@ llvm::Expected<std::unique_ptr<tflite::Interpreter>> CreateInterpreter(
   return interpreter;
 }
 
-// Extracts the list of node tokens from the model. The token list should be a
-// Const tensor, and as such, it should be readable without providing any
-// inputs.
-// Returns an error when the token list tensor is not found or when it is not
-// readable.
-llvm::Expected<std::vector<std::string>> GetNodeTokenList(
-    const tflite::Interpreter& interpreter) {
-  llvm::Expected<int> token_list_tensor_index = TensorIndexByName(
-      interpreter, interpreter.outputs(), kNodeTokensTensorName);
-  if (auto error = token_list_tensor_index.takeError()) return error;
-  const TfLiteTensor* const token_list_tensor =
-      interpreter.tensor(*token_list_tensor_index);
-  assert(token_list_tensor != nullptr);
-
-  const size_t token_list_size_bytes = token_list_tensor->bytes;
-  // The token list tensor is a Const operation, so it should be readable before
-  // running the inference or providing any inputs.
-  const char* const token_list_raw_data = reinterpret_cast<const char*>(
-      interpreter.typed_tensor<uint8_t>(*token_list_tensor_index));
-  if (token_list_raw_data == nullptr) {
+// Returns the total size in bytes of the input tensors for a batch with the
+// given number of graphs, nodes, edges and instructions.
+int64_t InputTensorBytes(int64_t num_graphs, int64_t num_nodes,
+                         int64_t num_edges, int64_t num_instructions,
+                         int64_t num_node_tokens) {
+  const int64_t num_int32_values =
+      num_instructions +             // Delta block index.
+      num_nodes +                    // Node features.
+      3 * num_edges +                // Edge features, receivers and senders.
+      2 * num_graphs +               // Number of nodes and edges per graph.
+      num_graphs * num_node_tokens;  // Global features.
+  return num_int32_values * sizeof(int32_t) +
+         num_nodes * sizeof(bool);  // Instruction node mask.
+}
+
+// Returns the total size in bytes of the tensors of `interpreter` that are
+// allocated in the arena or dynamically.
+int64_t TensorMemoryBytes(const tflite::Interpreter& interpreter) {
+  int64_t total_bytes = 0;
+  for (int i = 0; i < interpreter.tensors_size(); ++i) {
+    const TfLiteTensor* const tensor = interpreter.tensor(i);
+    if (tensor->allocation_type == kTfLiteArenaRw ||
+        tensor->allocation_type == kTfLiteDynamic) {
+      total_bytes += tensor->bytes;
+    }
+  }
+  return total_bytes;
+}
+
+// Sets the number of threads of `interpreter`, creates the delegate requested
+// in `options` and applies it to `interpreter`. Returns the delegate, or a null
+// pointer when no delegate was applied. Returns an error when the interpreter
+// can't be configured, or when the delegate can't be applied and
+// `options.allow_delegate_fallback` is false.
+llvm::Expected<std::unique_ptr<TfLiteDelegate, void (*)(TfLiteDelegate*)>>
+ConfigureInterpreter(tflite::Interpreter& interpreter,
+                     const GraphBuilderModelInferenceOptions& options) {
+  using DelegatePtr =
+      std::unique_ptr<TfLiteDelegate, void (*)(TfLiteDelegate*)>;
+  if (options.num_threads != -1) {
+    if (options.num_threads < 1) {
+      return llvm::createStringError(llvm::errc::invalid_argument,
+                                     "Invalid number of threads: %d",
+                                     options.num_threads);
+    }
+    if (interpreter.SetNumThreads(options.num_threads) != kTfLiteOk) {
+      return llvm::createStringError(llvm::errc::invalid_argument,
+                                     "Could not set the number of threads.");
+    }
+  }
+
+  DelegatePtr delegate(nullptr, [](TfLiteDelegate*) {});
+  switch (options.delegate) {
+    case GraphBuilderModelInferenceOptions::Delegate::kNone:
+      return delegate;
+    case GraphBuilderModelInferenceOptions::Delegate::kXnnPack: {
+#ifdef GEMATRIA_ENABLE_XNNPACK
+      TfLiteXNNPackDelegateOptions xnnpack_options =
+          TfLiteXNNPackDelegateOptionsDefault();
+      if (options.num_threads != -1) {
+        xnnpack_options.num_threads = options.num_threads;
+      }
+      delegate = DelegatePtr(TfLiteXNNPackDelegateCreate(&xnnpack_options),
+                             &TfLiteXNNPackDelegateDelete);
+#endif  // GEMATRIA_ENABLE_XNNPACK
+      break;
+    }
+  }
+
+  if (delegate == nullptr) {
+    if (options.allow_delegate_fallback) return delegate;
+    return llvm::createStringError(llvm::errc::not_supported,
+                                   "The delegate is not available.");
+  }
+  const TfLiteStatus status =
+      interpreter.ModifyGraphWithDelegate(delegate.get());
+  if (status == kTfLiteOk) return delegate;
+  // With kTfLiteDelegateError, the interpreter is restored to the state before
+  // applying the delegate and it can still be used without it. Any other error
+  // leaves the interpreter in an unusable state.
+  if (status == kTfLiteDelegateError && options.allow_delegate_fallback) {
+    delegate.reset();
+    return delegate;
+  }
+  return llvm::createStringError(llvm::errc::not_supported,
+                                 "Could not apply the delegate to the model.");
+}
+
+// Returns the data of the constant tensor `name` among the outputs of the main
+// subgraph of `model`. The data is read directly from the buffers of the
+// flatbuffer, without creating an interpreter. Returns an error when the
+// tensor is not found, when its type is not `tensor_type`, or when its data is
+// not stored in the flatbuffer, i.e. when it is not a constant. The returned
+// view points into the model.
+llvm::Expected<std::string_view> ConstantOutputTensorData(
+    const tflite::Model& model, std::string_view name,
+    tflite::TensorType tensor_type) {
+  if (model.subgraphs() == nullptr || model.subgraphs()->size() == 0 ||
+      model.buffers() == nullptr) {
     return llvm::createStringError(llvm::errc::invalid_argument,
-                                   "The token list could not be read");
+                                   "The model does not have a subgraph");
+  }
+  const tflite::SubGraph& subgraph = *model.subgraphs()->Get(0);
+  if (subgraph.tensors() != nullptr && subgraph.outputs() != nullptr) {
+    for (const int32_t tensor_index : *subgraph.outputs()) {
+      if (tensor_index < 0 ||
+          static_cast<uint32_t>(tensor_index) >= subgraph.tensors()->size()) {
+        continue;
+      }
+      const tflite::Tensor& tensor = *subgraph.tensors()->Get(tensor_index);
+      if (tensor.name() == nullptr ||
+          std::string_view(tensor.name()->c_str(), tensor.name()->size()) !=
+              name) {
+        continue;
+      }
+      if (tensor.type() != tensor_type) {
+        return llvm::createStringError(llvm::errc::invalid_argument,
+                                       "Tensor %s has invalid type.",
+                                       tensor.name()->c_str());
+      }
+      // Buffer 0 is the empty buffer used by all non-constant tensors.
+      const flatbuffers::Vector<uint8_t>* const data =
+          tensor.buffer() > 0 && tensor.buffer() < model.buffers()->size()
+              ? model.buffers()->Get(tensor.buffer())->data()
+              : nullptr;
+      if (data == nullptr) {
+        return llvm::createStringError(llvm::errc::invalid_argument,
+                                       "Tensor %s is not a constant.",
+                                       tensor.name()->c_str());
+      }
+      return std::string_view(reinterpret_cast<const char*>(data->data()),
+                              data->size());
+    }
   }
-  const std::string_view token_list_data(token_list_raw_data,
-                                         token_list_size_bytes);
-  return StrSplitAsCopy(token_list_data, '\0');
+  return llvm::make_error<llvm::StringError>(
+      llvm::Twine("Tensor was not found: ") + name,
+      llvm::errc::invalid_argument);
 }
 
 // Returns token name from `node_token_list` at `token_index`. Returns an error
@@ -335,101 +426,643 @@ llvm::Expected<std::string> GetNodeTokenAtIndex(
   return node_token_list[token_index];
 }
 
+// Looks up the input tensors of the model by their names and checks their
+// types and shape signatures. Returns a vector of the tensor indices in
+// `interpreter`, indexed by the input tensor constants defined above. Returns
+// an error when one of the tensors is missing or when it has an unexpected
+// type or shape.
+llvm::Expected<std::vector<int>> ResolveInputTensors(
+    const tflite::Interpreter& interpreter, int num_node_tokens) {
+  if (interpreter.inputs().size() != kNumInputTensors) {
+    return llvm::createStringError(
+        llvm::errc::invalid_argument,
+        "Unexpected number of input tensors. Expected %d, found %d.",
+        kNumInputTensors, interpreter.inputs().size());
+  }
+  std::vector<int> tensor_indices(kNumInputTensors);
+  for (int i = 0; i < kNumInputTensors; ++i) {
+    llvm::Expected<int> tensor_index = TensorIndexByName(
+        interpreter, interpreter.inputs(), kInputTensorNames[i]);
+    if (llvm::Error error = tensor_index.takeError()) return error;
+    tensor_indices[i] = *tensor_index;
+
+    const TfLiteTensor* const tensor = interpreter.tensor(*tensor_index);
+    llvm::Error error = llvm::Error::success();
+    switch (i) {
+      case kGraphGlobalsTensor:
+        error = CheckTensorTypeAndSignature(
+            *tensor_index, tensor, tflite::typeToTfLiteType<int32_t>(), -1,
+            num_node_tokens);
+        break;
+      case kInstructionNodeMaskTensor:
+        error = CheckTensorTypeAndSignature(
+            *tensor_index, tensor, tflite::typeToTfLiteType<bool>(), -1);
+        break;
+      default:
+        error = CheckTensorTypeAndSignature(
+            *tensor_index, tensor, tflite::typeToTfLiteType<int32_t>(), -1);
+        break;
+    }
+    if (error) return error;
+  }
+  return tensor_indices;
+}
+
+// Looks up the output tensor that contains the predictions of the model and
+// checks its type and shape signature. Returns the index of the tensor in
+// `interpreter`, or an error when the tensor is missing or has an unexpected
+// type or shape. The output may be float32, or float16 and quantized int8 or
+// uint8 for quantized models; the predictions are always converted to floats.
+llvm::Expected<int> ResolveOutputTensor(
+    const tflite::Interpreter& interpreter) {
+  llvm::Expected<int> tensor_index =
+      TensorIndexByName(interpreter, interpreter.outputs(), kOutputTensorName);
+  if (llvm::Error error = tensor_index.takeError()) return error;
+  const TfLiteTensor* const tensor = interpreter.tensor(*tensor_index);
+  assert(tensor != nullptr);
+  switch (tensor->type) {
+    case kTfLiteFloat32:
+    case kTfLiteFloat16:
+      break;
+    case kTfLiteInt8:
+    case kTfLiteUInt8:
+      if (tensor->params.scale <= 0.0f) {
+        return llvm::createStringError(
+            llvm::errc::invalid_argument,
+            "The quantized output tensor has invalid quantization parameters. "
+            "Only per-tensor quantization is supported.");
+      }
+      break;
+    default:
+      return llvm::createStringError(llvm::errc::invalid_argument,
+                                     "The output tensor has invalid type.");
+  }
+  if (tensor->dims_signature != nullptr && tensor->dims_signature->size != 0 &&
+      tensor->dims_signature->size != 2) {
+    return llvm::createStringError(llvm::errc::invalid_argument,
+                                   "Unexpected number of dimensions of the "
+                                   "output tensor. Expected 2, found %d",
+                                   tensor->dims_signature->size);
+  }
+  return *tensor_index;
+}
+
+// Returns the value at `index` in `tensor` as a float. Float16 values are
+// converted, and quantized values are dequantized using the quantization
+// parameters of the tensor. The type of the tensor must be one of the types
+// accepted by ResolveOutputTensor().
+float OutputTensorValue(const TfLiteTensor& tensor, int index) {
+  switch (tensor.type) {
+    case kTfLiteFloat16:
+      return HalfToFloat(tensor.data.f16[index].data);
+    case kTfLiteInt8:
+      return tensor.params.scale *
+             (tensor.data.int8[index] - tensor.params.zero_point);
+    case kTfLiteUInt8:
+      return tensor.params.scale *
+             (tensor.data.uint8[index] - tensor.params.zero_point);
+    default:
+      return tensor.data.f[index];
+  }
+}
+
+// Returns the values in `tensor` from `begin` to `end` as floats; see
+// OutputTensorValue().
+GraphBuilderModelInference::OutputType OutputTensorValues(
+    const TfLiteTensor& tensor, int begin, int end) {
+  GraphBuilderModelInference::OutputType values;
+  values.reserve(end - begin);
+  for (int i = begin; i < end; ++i) {
+    values.push_back(OutputTensorValue(tensor, i));
+  }
+  return values;
+}
+
+// Adds `weight` * `values` to `costs`. `costs` is resized to the number of
+// values when it is empty.
+template <typename Values>
+void AddWeightedValues(
+    double weight, const Values& values,
+    GraphBuilderModelInference::FunctionOutputType& costs) {
+  if (costs.empty()) costs.resize(values.size(), 0.0);
+  assert(costs.size() == values.size());
+  for (int i = 0; i < values.size(); ++i) {
+    costs[i] += values[i] * weight;
+  }
+}
+
+// A view of one row of the output tensor, used to accumulate the predictions
+// without copying them; see AddWeightedValues().
+class OutputTensorRow {
+ public:
+  OutputTensorRow(const TfLiteTensor& tensor, int row, int num_tasks)
+      : tensor_(tensor), begin_(row * num_tasks), num_tasks_(num_tasks) {}
+
+  size_t size() const { return num_tasks_; }
+  float operator[](int task) const {
+    return OutputTensorValue(tensor_, begin_ + task);
+  }
+
+ private:
+  const TfLiteTensor& tensor_;
+  int begin_;
+  int num_tasks_;
+};
+
+// Adds a basic block to `graph_builder`; used by the implementations of
+// GraphBuilderModelInference that accept all types of basic blocks.
+bool AddToGraphBuilder(BasicBlockGraphBuilder& graph_builder,
+                       const BasicBlock& block) {
+  return graph_builder.AddBasicBlock(block);
+}
+bool AddToGraphBuilder(BasicBlockGraphBuilder& graph_builder,
+                       const std::vector<const Instruction*>& instructions) {
+  return graph_builder.AddBasicBlockFromInstructionPointers(instructions);
+}
+bool AddToGraphBuilder(BasicBlockGraphBuilder& graph_builder,
+                       const CompactBasicBlock& block) {
+  return graph_builder.AddCompactBasicBlock(block);
+}
+
 }  // namespace
 
-llvm::Expected<std::unique_ptr<GraphBuilderModelInference>>
-GraphBuilderModelInference::FromTfLiteModel(
-    const tflite::FlatBufferModel* tflite_model) {
-  if (tflite_model == nullptr) {
-    return llvm::make_error<llvm::StringError>(
-        "tflite_model must not be nullptr", llvm::errc::invalid_argument);
+llvm::Expected<GraphBuilderModelVocabulary> ReadGraphBuilderModelVocabulary(
+    const tflite::FlatBufferModel& tflite_model) {
+  const tflite::Model* const model = tflite_model.GetModel();
+  if (model == nullptr) {
+    return llvm::createStringError(llvm::errc::invalid_argument,
+                                   "The model could not be read");
   }
-  llvm::Expected<std::unique_ptr<tflite::Interpreter>> interpreter =
-      CreateInterpreter(*tflite_model);
-  if (auto error = interpreter.takeError()) return error;
+  GraphBuilderModelVocabulary vocabulary;
 
   // Get the list of node tokens used in the model.
-  llvm::Expected<std::vector<std::string>> node_token_list =
-      GetNodeTokenList(**interpreter);
-  if (llvm::Error error = node_token_list.takeError()) return error;
+  llvm::Expected<std::string_view> token_list_data = ConstantOutputTensorData(
+      *model, kNodeTokensTensorName, tflite::TensorType_UINT8);
+  if (llvm::Error error = token_list_data.takeError()) return error;
+  vocabulary.node_tokens = StrSplitAsCopy(*token_list_data, '\0');
 
   // Get the values of the special tensors used in the model.
-  llvm::Expected<int> special_tokens_tensor_index = TensorIndexByName(
-      **interpreter, (*interpreter)->outputs(), kSpecialTokensTensorName);
-  if (llvm::Error error = special_tokens_tensor_index.takeError()) {
-    return error;
-  }
-  const TfLiteTensor* const special_tokens_tensor =
-      (*interpreter)->tensor(*special_tokens_tensor_index);
-  if (llvm::Error error = CheckTensorTypeAndDimensions(
-          *special_tokens_tensor_index, special_tokens_tensor,
-          tflite::typeToTfLiteType<int32_t>(), kNumSpecialNodeTokens)) {
-    return error;
-  }
-  const int32_t* const special_tokens_tensor_data =
-      (*interpreter)->typed_tensor<int32_t>(*special_tokens_tensor_index);
-  if (special_tokens_tensor_data == nullptr) {
+  llvm::Expected<std::string_view> special_tokens_data =
+      ConstantOutputTensorData(*model, kSpecialTokensTensorName,
+                               tflite::TensorType_INT32);
+  if (llvm::Error error = special_tokens_data.takeError()) return error;
+  if (special_tokens_data->size() != kNumSpecialNodeTokens * sizeof(int32_t)) {
     return llvm::createStringError(
         llvm::errc::invalid_argument,
-        "The special token index tensor could not be read");
-  }
-  // We'll be std::move()-ing the node list vector in the same function call
-  // where we use the token names. To be safe from any move effects, we make a
-  // copy of all the tokens instead of taking a const reference.
-  llvm::Expected<std::string> immediate_token = GetNodeTokenAtIndex(
-      *node_token_list, special_tokens_tensor_data[kSpecialNodeTokenImmediate]);
-  if (llvm::Error error = immediate_token.takeError()) return error;
-
-  llvm::Expected<std::string> fp_immediate_token = GetNodeTokenAtIndex(
-      *node_token_list,
-      special_tokens_tensor_data[kSpecialNodeTokenFpImmediate]);
-  if (llvm::Error error = fp_immediate_token.takeError()) return error;
-  llvm::Expected<std::string> address_token = GetNodeTokenAtIndex(
-      *node_token_list, special_tokens_tensor_data[kSpecialNodeTokenAddress]);
-  if (llvm::Error error = address_token.takeError()) return error;
-
-  llvm::Expected<std::string> memory_token = GetNodeTokenAtIndex(
-      *node_token_list, special_tokens_tensor_data[kSpecialNodeTokenMemory]);
-  if (llvm::Error error = memory_token.takeError()) return error;
+        "The special token index tensor has an unexpected size");
+  }
+  // The buffers of the flatbuffer are not guaranteed to be aligned.
+  int32_t special_tokens[kNumSpecialNodeTokens];
+  std::memcpy(special_tokens, special_tokens_data->data(),
+              sizeof(special_tokens));
+
+  const std::pair<int, std::string*> special_token_fields[] = {
+      {kSpecialNodeTokenImmediate, &vocabulary.immediate_token},
+      {kSpecialNodeTokenFpImmediate, &vocabulary.fp_immediate_token},
+      {kSpecialNodeTokenAddress, &vocabulary.address_token},
+      {kSpecialNodeTokenMemory, &vocabulary.memory_token}};
+  for (const auto& [special_token, field] : special_token_fields) {
+    llvm::Expected<std::string> token = GetNodeTokenAtIndex(
+        vocabulary.node_tokens, special_tokens[special_token]);
+    if (llvm::Error error = token.takeError()) return error;
+    *field = *std::move(token);
+  }
   const int32_t replacement_token_index =
-      special_tokens_tensor_data[kSpecialNodeTokenReplacement];
+      special_tokens[kSpecialNodeTokenReplacement];
   // The out-of-vocabulary behavior is represented implicitly in the tensor:
   //   - when a replacement token is specified, the behavior is to replace
   //     unknown tokens with this token.
   //   - when it is not specified (the index is < 0), the behavior is to return
   //     an error on unknown tokens.
-  OutOfVocabularyTokenBehavior out_of_vocabulary_behavior =
-      OutOfVocabularyTokenBehavior::ReturnError();
   if (replacement_token_index >= 0) {
     llvm::Expected<std::string> replacement_token =
-        GetNodeTokenAtIndex(*node_token_list, replacement_token_index);
+        GetNodeTokenAtIndex(vocabulary.node_tokens, replacement_token_index);
     if (llvm::Error error = replacement_token.takeError()) return error;
-    out_of_vocabulary_behavior = OutOfVocabularyTokenBehavior::ReplaceWithToken(
-        *std::move(replacement_token));
+    vocabulary.out_of_vocabulary_behavior =
+        OutOfVocabularyTokenBehavior::ReplaceWithToken(
+            *std::move(replacement_token));
+  }
+  return vocabulary;
+}
+
+llvm::Expected<std::unique_ptr<GraphBuilderModelInference>>
+GraphBuilderModelInference::FromTfLiteModel(
+    const tflite::FlatBufferModel* tflite_model,
+    const GraphBuilderModelInferenceOptions& options) {
+  if (tflite_model == nullptr) {
+    return llvm::make_error<llvm::StringError>(
+        "tflite_model must not be nullptr", llvm::errc::invalid_argument);
   }
+  // The vocabulary is read from the flatbuffer before the interpreter is
+  // created, so that a model without one is rejected cheaply.
+  llvm::Expected<GraphBuilderModelVocabulary> vocabulary =
+      ReadGraphBuilderModelVocabulary(*tflite_model);
+  if (llvm::Error error = vocabulary.takeError()) return error;
+
+  std::unique_ptr<tflite::OpResolver> op_resolver = CreateOpResolver();
+  llvm::Expected<std::unique_ptr<tflite::Interpreter>> interpreter =
+      CreateInterpreter(*tflite_model, *op_resolver);
+  if (auto error = interpreter.takeError()) return error;
+  llvm::Expected<DelegatePtr> delegate =
+      ConfigureInterpreter(**interpreter, options);
+  if (llvm::Error error = delegate.takeError()) return error;
+
+  // Resolve and check all input and output tensors now, so that a model with an
+  // incompatible structure is rejected before it is used for inference. The
+  // global features tensor has one column per node token.
+  llvm::Expected<std::vector<int>> input_tensor_indices = ResolveInputTensors(
+      **interpreter, static_cast<int>(vocabulary->node_tokens.size()));
+  if (llvm::Error error = input_tensor_indices.takeError()) return error;
+  llvm::Expected<int> output_tensor_index = ResolveOutputTensor(**interpreter);
+  if (llvm::Error error = output_tensor_index.takeError()) return error;
 
   auto graph_builder = std::make_unique<BasicBlockGraphBuilder>(
-      *std::move(node_token_list), /* immediate_token = */ *immediate_token,
-      /* fp_immediate_token = */ *fp_immediate_token,
-      /* address_token = */ *address_token, /* memory_token = */ *memory_token,
-      /* out_of_vocabulary_behavior = */ out_of_vocabulary_behavior);
+      std::move(vocabulary->node_tokens),
+      /* immediate_token = */ vocabulary->immediate_token,
+      /* fp_immediate_token = */ vocabulary->fp_immediate_token,
+      /* address_token = */ vocabulary->address_token,
+      /* memory_token = */ vocabulary->memory_token,
+      /* out_of_vocabulary_behavior = */
+      vocabulary->out_of_vocabulary_behavior);
 
   // We can't use std::make_unique<GraphBuilderModelInference>(), because
   // std::make_unique<>() requires a public constructor.
   return std::unique_ptr<GraphBuilderModelInference>(
-      new GraphBuilderModelInference(std::move(graph_builder), tflite_model));
+      new GraphBuilderModelInference(std::move(graph_builder), tflite_model,
+                                     options, std::move(op_resolver),
+                                     std::move(*delegate),
+                                     std::move(*interpreter),
+                                     std::move(*input_tensor_indices),
+                                     *output_tensor_index));
 }
 
 GraphBuilderModelInference::GraphBuilderModelInference(
     std::unique_ptr<BasicBlockGraphBuilder> graph_builder,
-    const FlatBufferModel* tflite_model)
-    : graph_builder_(std::move(graph_builder)), tflite_model_(*tflite_model) {
+    const FlatBufferModel* tflite_model,
+    const GraphBuilderModelInferenceOptions& options,
+    std::unique_ptr<tflite::OpResolver> op_resolver, DelegatePtr delegate,
+    std::unique_ptr<tflite::Interpreter> interpreter,
+    std::vector<int> input_tensor_indices, int output_tensor_index)
+    : graph_builder_(std::move(graph_builder)),
+      tflite_model_(*tflite_model),
+      options_(options),
+      op_resolver_(std::move(op_resolver)),
+      delegate_(std::move(delegate)),
+      interpreter_(std::move(interpreter)),
+      input_tensor_indices_(std::move(input_tensor_indices)),
+      output_tensor_index_(output_tensor_index),
+      input_tensor_sizes_(kNumInputTensors, -1) {
   assert(tflite_model != nullptr);
   assert(graph_builder_ != nullptr);
+  assert(op_resolver_ != nullptr);
+  assert(interpreter_ != nullptr);
+  assert(input_tensor_indices_.size() == kNumInputTensors);
+  graph_builder_->SetDeduplicateBlocks(options_.deduplicate_blocks);
+  graph_builder_->SetLiveInfoMode(options_.live_info_mode);
+  SetShapeBucketing(options_.shape_bucketing, options_.shape_bucket_sizes);
+}
+
+GraphBuilderModelInference::~GraphBuilderModelInference() = default;
+
+llvm::Expected<std::unique_ptr<GraphBuilderModelInference>>
+GraphBuilderModelInference::Clone() const {
+  std::unique_ptr<tflite::OpResolver> op_resolver = CreateOpResolver();
+  llvm::Expected<std::unique_ptr<tflite::Interpreter>> interpreter =
+      CreateInterpreter(tflite_model_, *op_resolver);
+  if (llvm::Error error = interpreter.takeError()) return error;
+  llvm::Expected<DelegatePtr> delegate =
+      ConfigureInterpreter(**interpreter, options_);
+  if (llvm::Error error = delegate.takeError()) return error;
+
+  // The interpreters are created from the same model, so the tensor indices
+  // resolved for this object are valid also for the new interpreter.
+  auto graph_builder =
+      std::make_unique<BasicBlockGraphBuilder>(*graph_builder_);
+  graph_builder->Reset();
+
+  auto clone = std::unique_ptr<GraphBuilderModelInference>(
+      new GraphBuilderModelInference(
+          std::move(graph_builder), &tflite_model_, options_,
+          std::move(op_resolver), std::move(*delegate),
+          std::move(*interpreter), input_tensor_indices_,
+          output_tensor_index_));
+  clone->SetPredictionCache(prediction_cache_);
+  clone->SetShapeBucketing(shape_bucketing_enabled_, shape_bucket_sizes_);
+  return clone;
+}
+
+void GraphBuilderModelInference::SetShapeBucketing(
+    bool enabled, std::vector<int> bucket_sizes) {
+  std::sort(bucket_sizes.begin(), bucket_sizes.end());
+  shape_bucketing_enabled_ = enabled;
+  shape_bucket_sizes_ = std::move(bucket_sizes);
+}
+
+void GraphBuilderModelInference::SetPredictionCache(
+    std::shared_ptr<PredictionCache> prediction_cache) {
+  Reset();
+  prediction_cache_ = std::move(prediction_cache);
 }
 
 bool GraphBuilderModelInference::AddBasicBlockToBatch(const BasicBlock& block) {
-  return graph_builder_->AddBasicBlock(block);
+  return AddToBatch(block);
+}
+
+bool GraphBuilderModelInference::AddInstructionsToBatch(
+    const std::vector<const Instruction*>& instructions) {
+  return AddToBatch(instructions);
+}
+
+void GraphBuilderModelInference::SetSymbolTable(
+    std::shared_ptr<const SymbolTable> symbol_table) {
+  graph_builder_->SetSymbolTable(std::move(symbol_table));
+}
+
+bool GraphBuilderModelInference::AddCompactBasicBlockToBatch(
+    const CompactBasicBlock& block) {
+  return AddToBatch(block);
+}
+
+template <typename Instructions>
+bool GraphBuilderModelInference::AddToBatch(const Instructions& instructions) {
+  if (prediction_cache_ == nullptr) {
+    return AddToGraphBuilder(*graph_builder_, instructions);
+  }
+  const uint64_t fingerprint = BasicBlockFingerprint(instructions);
+  std::optional<OutputType> cached_prediction =
+      prediction_cache_->Lookup(fingerprint);
+  if (!cached_prediction.has_value()) {
+    if (!AddToGraphBuilder(*graph_builder_, instructions)) return false;
+    batch_uncached_fingerprints_.push_back(fingerprint);
+  }
+  batch_cached_predictions_.push_back(std::move(cached_prediction));
+  return true;
+}
+
+GraphBuilderModelInference::AddBasicBlockResult
+GraphBuilderModelInference::TryAddBasicBlockToBatch(const BasicBlock& block) {
+  return TryAddToBatch(block);
+}
+
+GraphBuilderModelInference::AddBasicBlockResult
+GraphBuilderModelInference::TryAddInstructionsToBatch(
+    const std::vector<const Instruction*>& instructions) {
+  return TryAddToBatch(instructions);
+}
+
+GraphBuilderModelInference::AddBasicBlockResult
+GraphBuilderModelInference::TryAddCompactBasicBlockToBatch(
+    const CompactBasicBlock& block) {
+  return TryAddToBatch(block);
+}
+
+template <typename Instructions>
+GraphBuilderModelInference::AddBasicBlockResult
+GraphBuilderModelInference::TryAddToBatch(const Instructions& instructions) {
+  const int prev_num_graphs = graph_builder_->num_graphs();
+  if (!AddToBatch(instructions)) return AddBasicBlockResult::kInvalidBlock;
+  // The prediction was found in the cache, the basic block is a duplicate of
+  // one already in the batch, or this is the first basic block evaluated by the
+  // model in this batch.
+  if (graph_builder_->num_graphs() == prev_num_graphs || prev_num_graphs == 0) {
+    return AddBasicBlockResult::kAdded;
+  }
+
+  const GraphBuilderModelInferenceOptions::BatchBudget& budget =
+      options_.batch_budget;
+  const auto exceeds = [](int64_t value, int64_t limit) {
+    return limit != -1 && value > limit;
+  };
+  // We use the number of nodes as an upper bound on the number of instructions,
+  // because computing the exact number of instructions would make adding
+  // basic blocks quadratic in the size of the batch.
+  const bool batch_is_full =
+      exceeds(graph_builder_->num_graphs(), budget.max_blocks) ||
+      exceeds(graph_builder_->num_nodes(), budget.max_nodes) ||
+      exceeds(graph_builder_->num_edges(), budget.max_edges) ||
+      exceeds(InputTensorBytes(graph_builder_->num_graphs(),
+                               graph_builder_->num_nodes(),
+                               graph_builder_->num_edges(),
+                               graph_builder_->num_nodes(),
+                               graph_builder_->num_node_tokens()),
+              budget.max_input_tensor_bytes);
+  if (!batch_is_full) return AddBasicBlockResult::kAdded;
+
+  graph_builder_->RemoveLastBasicBlock();
+  if (prediction_cache_ != nullptr) {
+    batch_cached_predictions_.pop_back();
+    batch_uncached_fingerprints_.pop_back();
+  }
+  return AddBasicBlockResult::kBatchFull;
+}
+
+llvm::Expected<
+    std::vector<std::optional<GraphBuilderModelInference::OutputType>>>
+GraphBuilderModelInference::RunInferenceInBatches(
+    llvm::ArrayRef<BasicBlock> blocks) {
+  return RunInBatches(blocks);
+}
+
+llvm::Expected<
+    std::vector<std::optional<GraphBuilderModelInference::OutputType>>>
+GraphBuilderModelInference::RunInferenceInBatches(
+    llvm::ArrayRef<CompactBasicBlock> blocks) {
+  return RunInBatches(blocks);
+}
+
+llvm::Expected<std::vector<GraphBuilderModelInference::FunctionOutputType>>
+GraphBuilderModelInference::RunFunctionInferenceInBatches(
+    llvm::ArrayRef<BasicBlock> blocks, llvm::ArrayRef<double> block_weights,
+    llvm::ArrayRef<int> function_num_blocks) {
+  return RunFunctionsInBatches(blocks, block_weights, function_num_blocks);
+}
+
+llvm::Expected<std::vector<GraphBuilderModelInference::FunctionOutputType>>
+GraphBuilderModelInference::RunFunctionInferenceInBatches(
+    llvm::ArrayRef<CompactBasicBlock> blocks,
+    llvm::ArrayRef<double> block_weights,
+    llvm::ArrayRef<int> function_num_blocks) {
+  return RunFunctionsInBatches(blocks, block_weights, function_num_blocks);
+}
+
+llvm::Expected<
+    std::vector<std::optional<GraphBuilderModelInference::OutputType>>>
+GraphBuilderModelInference::RunInferenceOnBlockEdits(
+    const BasicBlock& base_block,
+    llvm::ArrayRef<std::vector<BasicBlockEdit>> candidates) {
+  GEMATRIA_TRACE_SCOPE("GraphBuilderModelInference::RunInferenceOnBlockEdits");
+  // The edited basic blocks point to the instructions of `base_block` and
+  // `candidates`, so no instruction is copied.
+  std::vector<std::vector<const Instruction*>> edited_blocks;
+  edited_blocks.reserve(candidates.size());
+  // The indices of the candidates in `edited_blocks`.
+  std::vector<int> candidate_indices;
+  candidate_indices.reserve(candidates.size());
+  for (int i = 0; i < candidates.size(); ++i) {
+    std::optional<std::vector<const Instruction*>> edited =
+        ApplyBasicBlockEdits(base_block.instructions, candidates[i]);
+    if (!edited.has_value()) continue;
+    edited_blocks.push_back(*std::move(edited));
+    candidate_indices.push_back(i);
+  }
+
+  llvm::Expected<std::vector<std::optional<OutputType>>> edited_predictions =
+      RunInBatches(llvm::ArrayRef<std::vector<const Instruction*>>(
+          edited_blocks));
+  if (llvm::Error error = edited_predictions.takeError()) return error;
+
+  std::vector<std::optional<OutputType>> output(candidates.size());
+  for (int i = 0; i < candidate_indices.size(); ++i) {
+    output[candidate_indices[i]] = std::move((*edited_predictions)[i]);
+  }
+  return output;
+}
+
+template <typename Instructions>
+llvm::Expected<
+    std::vector<std::optional<GraphBuilderModelInference::OutputType>>>
+GraphBuilderModelInference::RunInBatches(llvm::ArrayRef<Instructions> blocks) {
+  assert(graph_builder_->num_graphs() == 0);
+  assert(batch_cached_predictions_.empty());
+
+  std::vector<std::optional<OutputType>> output(blocks.size());
+  // The indices of the basic blocks in the current batch.
+  std::vector<int> batch_block_indices;
+  const auto run_batch = [&]() -> llvm::Error {
+    llvm::Expected<std::vector<OutputType>> predictions = RunInference();
+    Reset();
+    if (llvm::Error error = predictions.takeError()) return error;
+    assert(predictions->size() == batch_block_indices.size());
+    for (int i = 0; i < batch_block_indices.size(); ++i) {
+      output[batch_block_indices[i]] = std::move((*predictions)[i]);
+    }
+    batch_block_indices.clear();
+    return llvm::Error::success();
+  };
+
+  for (int i = 0; i < blocks.size(); ++i) {
+    AddBasicBlockResult result = TryAddToBatch(blocks[i]);
+    if (result == AddBasicBlockResult::kBatchFull) {
+      if (llvm::Error error = run_batch()) return error;
+      result = TryAddToBatch(blocks[i]);
+      assert(result != AddBasicBlockResult::kBatchFull);
+    }
+    if (result == AddBasicBlockResult::kAdded) batch_block_indices.push_back(i);
+  }
+  if (!batch_block_indices.empty()) {
+    if (llvm::Error error = run_batch()) return error;
+  }
+  return output;
+}
+
+template <typename Instructions>
+llvm::Expected<std::vector<GraphBuilderModelInference::FunctionOutputType>>
+GraphBuilderModelInference::RunFunctionsInBatches(
+    llvm::ArrayRef<Instructions> blocks, llvm::ArrayRef<double> block_weights,
+    llvm::ArrayRef<int> function_num_blocks) {
+  GEMATRIA_TRACE_SCOPE(
+      "GraphBuilderModelInference::RunFunctionInferenceInBatches");
+  assert(graph_builder_->num_graphs() == 0);
+  assert(batch_cached_predictions_.empty());
+  assert(blocks.size() == block_weights.size());
+
+  std::vector<FunctionOutputType> costs(function_num_blocks.size());
+  // The weights of the basic blocks in the current batch, and the indices of
+  // the functions to which they belong.
+  std::vector<double> batch_weights;
+  std::vector<int> batch_functions;
+  const auto run_batch = [&]() -> llvm::Error {
+    llvm::Error error =
+        AccumulateBatchCosts(batch_weights, batch_functions, costs);
+    batch_weights.clear();
+    batch_functions.clear();
+    return error;
+  };
+
+  int block = 0;
+  for (int function = 0; function < function_num_blocks.size(); ++function) {
+    for (int i = 0; i < function_num_blocks[function]; ++i, ++block) {
+      assert(block < blocks.size());
+      AddBasicBlockResult result = TryAddToBatch(blocks[block]);
+      if (result == AddBasicBlockResult::kBatchFull) {
+        if (llvm::Error error = run_batch()) return error;
+        result = TryAddToBatch(blocks[block]);
+        assert(result != AddBasicBlockResult::kBatchFull);
+      }
+      if (result == AddBasicBlockResult::kInvalidBlock) {
+        Reset();
+        return llvm::createStringError(
+            llvm::errc::invalid_argument,
+            "Basic block %d of function %d could not be added to a batch", i,
+            function);
+      }
+      batch_weights.push_back(block_weights[block]);
+      batch_functions.push_back(function);
+    }
+  }
+  assert(block == blocks.size());
+  if (!batch_weights.empty()) {
+    if (llvm::Error error = run_batch()) return error;
+  }
+  return costs;
+}
+
+llvm::Error GraphBuilderModelInference::AccumulateBatchCosts(
+    llvm::ArrayRef<double> batch_weights, llvm::ArrayRef<int> batch_functions,
+    std::vector<FunctionOutputType>& costs) {
+  GEMATRIA_TRACE_SCOPE("GraphBuilderModelInference::AccumulateBatchCosts");
+  assert(batch_weights.size() == batch_functions.size());
+  last_batch_stats_ = BatchStats();
+  // The output tensor is nullptr when all predictions come from the cache.
+  const TfLiteTensor* output_tensor = nullptr;
+  int num_tasks = 0;
+  if (graph_builder_->num_graphs() > 0) {
+    llvm::Expected<const TfLiteTensor*> tensor =
+        InvokeInterpreter(*graph_builder_);
+    if (llvm::Error error = tensor.takeError()) {
+      Reset();
+      return error;
+    }
+    output_tensor = *tensor;
+    num_tasks = output_tensor->dims->data[1];
+  }
+
+  // The rows of the output tensor follow the basic blocks in `graph_builder_`;
+  // with deduplication, several basic blocks may share the same row.
+  const std::vector<int>& graph_indices = graph_builder_->block_graph_indices();
+  if (prediction_cache_ == nullptr) {
+    assert(graph_indices.size() == batch_weights.size());
+    for (int i = 0; i < batch_weights.size(); ++i) {
+      AddWeightedValues(
+          batch_weights[i],
+          OutputTensorRow(*output_tensor, graph_indices[i], num_tasks),
+          costs[batch_functions[i]]);
+    }
+  } else {
+    assert(batch_cached_predictions_.size() == batch_weights.size());
+    int new_prediction_index = 0;
+    for (int i = 0; i < batch_weights.size(); ++i) {
+      const std::optional<OutputType>& cached_prediction =
+          batch_cached_predictions_[i];
+      if (cached_prediction.has_value()) {
+        AddWeightedValues(batch_weights[i], *cached_prediction,
+                          costs[batch_functions[i]]);
+        continue;
+      }
+      const int graph_index = graph_indices[new_prediction_index];
+      AddWeightedValues(batch_weights[i],
+                        OutputTensorRow(*output_tensor, graph_index, num_tasks),
+                        costs[batch_functions[i]]);
+      prediction_cache_->Insert(
+          batch_uncached_fingerprints_[new_prediction_index],
+          OutputTensorValues(*output_tensor, graph_index * num_tasks,
+                             (graph_index + 1) * num_tasks));
+      ++new_prediction_index;
+    }
+    assert(new_prediction_index == graph_indices.size());
+  }
+  Reset();
+  return llvm::Error::success();
 }
 
 #define GEMATRIA_RETURN_IF_ERROR(statement)            \
@@ -439,136 +1072,268 @@ bool GraphBuilderModelInference::AddBasicBlockToBatch(const BasicBlock& block) {
 
 llvm::Expected<std::vector<GraphBuilderModelInference::OutputType>>
 GraphBuilderModelInference::RunInference() {
-  if (graph_builder_->num_graphs() == 0) {
+  GEMATRIA_TRACE_SCOPE("GraphBuilderModelInference::RunInference");
+  if (prediction_cache_ == nullptr) {
+    return RunInferenceOnGraphBuilder(*graph_builder_);
+  }
+
+  llvm::Expected<std::vector<OutputType>> new_predictions =
+      RunInferenceOnGraphBuilder(*graph_builder_);
+  if (llvm::Error error = new_predictions.takeError()) return error;
+  assert(new_predictions->size() == batch_uncached_fingerprints_.size());
+
+  // Merge the cached predictions with the new ones, in the order in which the
+  // basic blocks were added to the batch.
+  std::vector<OutputType> output;
+  output.reserve(batch_cached_predictions_.size());
+  int new_prediction_index = 0;
+  for (const std::optional<OutputType>& cached_prediction :
+       batch_cached_predictions_) {
+    if (cached_prediction.has_value()) {
+      output.push_back(*cached_prediction);
+      continue;
+    }
+    OutputType& new_prediction = (*new_predictions)[new_prediction_index];
+    prediction_cache_->Insert(
+        batch_uncached_fingerprints_[new_prediction_index], new_prediction);
+    output.push_back(std::move(new_prediction));
+    ++new_prediction_index;
+  }
+  return output;
+}
+
+llvm::Expected<std::vector<GraphBuilderModelInference::OutputType>>
+GraphBuilderModelInference::RunInferenceOnGraphBuilder(
+    const BasicBlockGraphBuilder& graph_builder) {
+  assert(&graph_builder == graph_builder_.get() ||
+         graph_builder_->HasSameVocabulary(graph_builder));
+  last_batch_stats_ = BatchStats();
+  if (graph_builder.num_graphs() == 0) {
     return std::vector<GraphBuilderModelInference::OutputType>();
   }
 
-  // TODO(ondrasej): Reuse the interpreter across RunInference() calls. The
-  // graph builder class is already stateful, so this should not be an issue
-  // and it could save us some loading time.
-  llvm::Expected<std::unique_ptr<tflite::Interpreter>> interpreter =
-      CreateInterpreter(tflite_model_);
-  if (llvm::Error error = interpreter.takeError()) return error;
+  llvm::Expected<const TfLiteTensor*> output_tensor =
+      InvokeInterpreter(graph_builder);
+  if (llvm::Error error = output_tensor.takeError()) return error;
+  GEMATRIA_TRACE_SCOPE("GraphBuilderModelInference::RunInference/readout");
+  const int num_tasks = (*output_tensor)->dims->data[1];
 
-  // TODO(ondrasej): Move all the checks of the model format to the
-  // initialization of the class.
-  if ((*interpreter)->inputs().size() != kNumInputTensors) {
-    return llvm::createStringError(
-        llvm::errc::invalid_argument,
-        "Unexpected number of input tensors. Expected %d, found %d.",
-        kNumInputTensors, (*interpreter)->inputs().size());
-  }
-
-  const std::vector<bool> instruction_node_mask =
-      graph_builder_->InstructionNodeMask();
-  const std::vector<int> delta_block_index = graph_builder_->DeltaBlockIndex();
-
-  // Resize the input tensors according to the size of the input data.
-  // TODO(ondrasej): Replace the index-based lookups with name-based lookups.
-
-  GEMATRIA_RETURN_IF_ERROR(
-      Resize1DTensor(interpreter->get(), kDeltaBlockIndexTensor,
-                     static_cast<int>(delta_block_index.size())));
-  GEMATRIA_RETURN_IF_ERROR(Resize1DTensor(interpreter->get(), kGraphNodesTensor,
-                                          graph_builder_->num_nodes()));
-  GEMATRIA_RETURN_IF_ERROR(Resize1DTensor(interpreter->get(), kGraphEdgesTensor,
-                                          graph_builder_->num_edges()));
-  GEMATRIA_RETURN_IF_ERROR(Resize1DTensor(
-      interpreter->get(), kGraphReceiversTensor,
-      static_cast<int>(graph_builder_->edge_receivers().size())));
-  GEMATRIA_RETURN_IF_ERROR(
-      Resize1DTensor(interpreter->get(), kGraphSendersTensor,
-                     static_cast<int>(graph_builder_->edge_senders().size())));
-  GEMATRIA_RETURN_IF_ERROR(Resize1DTensor(
-      interpreter->get(), kGraphNEdgeTensor,
-      static_cast<int>(graph_builder_->num_nodes_per_block().size())));
-  GEMATRIA_RETURN_IF_ERROR(Resize1DTensor(
-      interpreter->get(), kGraphNNodeTensor,
-      static_cast<int>(graph_builder_->num_edges_per_block().size())));
-  GEMATRIA_RETURN_IF_ERROR(
-      Resize1DTensor(interpreter->get(), kInstructionNodeMaskTensor,
-                     static_cast<int>(instruction_node_mask.size())));
-  GEMATRIA_RETURN_IF_ERROR(Resize2DTensor(
-      interpreter->get(), kGraphGlobalsTensor,
-      /* desired_first_dimension_size = */ graph_builder_->num_graphs(),
-      /* expected_second_dimension_size = */
-      graph_builder_->num_node_tokens()));
-
-  if (const TfLiteStatus status = (*interpreter)->AllocateTensors();
-      status != kTfLiteOk) {
-    return llvm::make_error<llvm::StringError>(
-        "Could not allocate memory for tensors", llvm::errc::not_enough_memory);
+  // With deduplication, several basic blocks may share the same graph and the
+  // same row of the output tensor.
+  std::vector<OutputType> output;
+  output.reserve(graph_builder.num_blocks());
+  for (const int graph_index : graph_builder.block_graph_indices()) {
+    output.push_back(OutputTensorValues(**output_tensor,
+                                        graph_index * num_tasks,
+                                        (graph_index + 1) * num_tasks));
+  }
+  return output;
+}
+
+llvm::Expected<const TfLiteTensor*>
+GraphBuilderModelInference::InvokeInterpreter(
+    const BasicBlockGraphBuilder& graph_builder) {
+  assert(graph_builder.num_graphs() > 0);
+  tflite::Interpreter* const interpreter = interpreter_.get();
+
+  const int num_graphs = graph_builder.num_graphs();
+  const int num_nodes = graph_builder.num_nodes();
+  const int num_edges = graph_builder.num_edges();
+  const int num_instructions = graph_builder.num_instructions();
+
+  // When shape bucketing is enabled, the batch is padded with one or more
+  // padding graphs so that the sizes of all dimensions are rounded up to a
+  // bucket size. The first padding graph contains all padding nodes and edges;
+  // the other padding graphs are empty. The padding instruction nodes are the
+  // first padding nodes. The padding edges are self-loops on the first padding
+  // node. There are no edges between the padding graphs and the real graphs,
+  // so the padding does not change the predictions for the real graphs.
+  int num_padding_graphs = 0;
+  int num_padding_nodes = 0;
+  int num_padding_edges = 0;
+  int num_padding_instructions = 0;
+  if (shape_bucketing_enabled_) {
+    num_padding_instructions =
+        RoundUpToBucket(num_instructions, shape_bucket_sizes_) -
+        num_instructions;
+    num_padding_nodes =
+        RoundUpToBucket(num_nodes + std::max(1, num_padding_instructions),
+                        shape_bucket_sizes_) -
+        num_nodes;
+    num_padding_edges =
+        RoundUpToBucket(num_edges, shape_bucket_sizes_) - num_edges;
+    num_padding_graphs =
+        RoundUpToBucket(num_graphs + 1, shape_bucket_sizes_) - num_graphs;
+    assert(num_padding_nodes >= num_padding_instructions);
+    assert(num_padding_nodes > 0);
+    assert(num_padding_graphs > 0);
   }
+  const int padded_num_graphs = num_graphs + num_padding_graphs;
+  const int padded_num_nodes = num_nodes + num_padding_nodes;
+  const int padded_num_edges = num_edges + num_padding_edges;
+  const int padded_num_instructions =
+      num_instructions + num_padding_instructions;
 
-  // Fill in the input tensors.
-  if (llvm::Error error = FillTensorFromStdVector<int32_t>(
-          interpreter->get(), delta_block_index, kDeltaBlockIndexTensor)) {
-    return error;
+  // The desired size of the first dimension of each input tensor, indexed by
+  // the input tensor constants.
+  std::vector<int> desired_input_tensor_sizes(kNumInputTensors);
+  desired_input_tensor_sizes[kDeltaBlockIndexTensor] = padded_num_instructions;
+  desired_input_tensor_sizes[kGraphNodesTensor] = padded_num_nodes;
+  desired_input_tensor_sizes[kGraphEdgesTensor] = padded_num_edges;
+  desired_input_tensor_sizes[kGraphGlobalsTensor] = padded_num_graphs;
+  desired_input_tensor_sizes[kGraphReceiversTensor] = padded_num_edges;
+  desired_input_tensor_sizes[kGraphSendersTensor] = padded_num_edges;
+  desired_input_tensor_sizes[kGraphNEdgeTensor] = padded_num_graphs;
+  desired_input_tensor_sizes[kGraphNNodeTensor] = padded_num_graphs;
+  desired_input_tensor_sizes[kInstructionNodeMaskTensor] = padded_num_nodes;
+
+  // Resize only the input tensors whose shape changed since the last batch, and
+  // re-plan the tensor memory only when at least one of them was resized.
+  GEMATRIA_TRACE_SCOPE_BEGIN(resize_scope,
+                             "GraphBuilderModelInference::RunInference/resize");
+  bool needs_allocation = false;
+  for (int input = 0; input < kNumInputTensors; ++input) {
+    const int desired_size = desired_input_tensor_sizes[input];
+    if (desired_size == input_tensor_sizes_[input]) continue;
+    // Invalidate the cached size; it is updated only after the tensors are
+    // successfully allocated.
+    input_tensor_sizes_[input] = -1;
+    needs_allocation = true;
+    std::vector<int> desired_shape = {desired_size};
+    if (input == kGraphGlobalsTensor) {
+      desired_shape.push_back(graph_builder.num_node_tokens());
+    }
+    GEMATRIA_RETURN_IF_ERROR(ResizeInputTensor(
+        interpreter, input_tensor_indices_[input], desired_shape));
   }
-  GEMATRIA_RETURN_IF_ERROR(FillTensorFromStdVector<int32_t>(
-      interpreter->get(), graph_builder_->node_features(), kGraphNodesTensor));
-  GEMATRIA_RETURN_IF_ERROR(FillTensorFromStdVector<int32_t>(
-      interpreter->get(), graph_builder_->EdgeFeatures(), kGraphEdgesTensor));
-  GEMATRIA_RETURN_IF_ERROR(FillTensorFromStdVector<int32_t>(
-      interpreter->get(), graph_builder_->edge_receivers(),
-      kGraphReceiversTensor));
-  GEMATRIA_RETURN_IF_ERROR(FillTensorFromStdVector<int32_t>(
-      interpreter->get(), graph_builder_->edge_senders(), kGraphSendersTensor));
-  GEMATRIA_RETURN_IF_ERROR(FillTensorFromStdVector<int32_t>(
-      interpreter->get(), graph_builder_->num_nodes_per_block(),
-      kGraphNNodeTensor));
-  GEMATRIA_RETURN_IF_ERROR(FillTensorFromStdVector<int32_t>(
-      interpreter->get(), graph_builder_->num_edges_per_block(),
-      kGraphNEdgeTensor));
-  GEMATRIA_RETURN_IF_ERROR(FillTensorFromStdVector<bool>(
-      interpreter->get(), instruction_node_mask, kInstructionNodeMaskTensor));
-  if (auto error = FillTensorFromStdVectorMatrix<int32_t>(
-          interpreter->get(), graph_builder_->global_features(),
-          kGraphGlobalsTensor)) {
-    return error;
+  GEMATRIA_TRACE_SCOPE_END(resize_scope);
+
+  if (needs_allocation) {
+    GEMATRIA_TRACE_SCOPE("GraphBuilderModelInference::RunInference/allocate");
+    if (const TfLiteStatus status = interpreter->AllocateTensors();
+        status != kTfLiteOk) {
+      return llvm::make_error<llvm::StringError>(
+          "Could not allocate memory for tensors",
+          llvm::errc::not_enough_memory);
+    }
+    input_tensor_sizes_ = std::move(desired_input_tensor_sizes);
   }
 
-  if (const TfLiteStatus status = (*interpreter)->Invoke();
+  // Fill in the input tensors. Their types and shapes were checked when the
+  // model was loaded, and they were resized to the right shape above. The
+  // tensors that are not stored in the graph builder are computed directly
+  // into the tensor buffers. The padding, if any, is added after the data of
+  // the real graphs.
+  GEMATRIA_TRACE_SCOPE_BEGIN(fill_scope,
+                             "GraphBuilderModelInference::RunInference/fill");
+  int32_t* const delta_block_index = MutableTensorData<int32_t>(
+      interpreter, input_tensor_indices_[kDeltaBlockIndexTensor]);
+  graph_builder.WriteDeltaBlockIndex(delta_block_index);
+  std::fill_n(delta_block_index + num_instructions, num_padding_instructions,
+              num_graphs);
+
+  int32_t* const node_features = MutableTensorData<int32_t>(
+      interpreter, input_tensor_indices_[kGraphNodesTensor]);
+  FillTensorFromStdVector<int32_t>(interpreter, graph_builder.node_features(),
+                                   input_tensor_indices_[kGraphNodesTensor]);
+  std::fill_n(node_features + num_nodes, num_padding_nodes,
+              graph_builder.immediate_token());
+
+  int32_t* const edge_features = MutableTensorData<int32_t>(
+      interpreter, input_tensor_indices_[kGraphEdgesTensor]);
+  graph_builder.WriteEdgeFeatures(edge_features);
+  std::fill_n(edge_features + num_edges, num_padding_edges,
+              static_cast<int32_t>(EdgeType::kStructuralDependency));
+
+  int32_t* const receivers = MutableTensorData<int32_t>(
+      interpreter, input_tensor_indices_[kGraphReceiversTensor]);
+  FillTensorFromStdVector<int32_t>(
+      interpreter, graph_builder.edge_receivers(),
+      input_tensor_indices_[kGraphReceiversTensor]);
+  std::fill_n(receivers + num_edges, num_padding_edges, num_nodes);
+
+  int32_t* const senders = MutableTensorData<int32_t>(
+      interpreter, input_tensor_indices_[kGraphSendersTensor]);
+  FillTensorFromStdVector<int32_t>(interpreter, graph_builder.edge_senders(),
+                                   input_tensor_indices_[kGraphSendersTensor]);
+  std::fill_n(senders + num_edges, num_padding_edges, num_nodes);
+
+  int32_t* const num_nodes_per_block = MutableTensorData<int32_t>(
+      interpreter, input_tensor_indices_[kGraphNNodeTensor]);
+  FillTensorFromStdVector<int32_t>(interpreter,
+                                   graph_builder.num_nodes_per_block(),
+                                   input_tensor_indices_[kGraphNNodeTensor]);
+  std::fill_n(num_nodes_per_block + num_graphs, num_padding_graphs, 0);
+
+  int32_t* const num_edges_per_block = MutableTensorData<int32_t>(
+      interpreter, input_tensor_indices_[kGraphNEdgeTensor]);
+  FillTensorFromStdVector<int32_t>(interpreter,
+                                   graph_builder.num_edges_per_block(),
+                                   input_tensor_indices_[kGraphNEdgeTensor]);
+  std::fill_n(num_edges_per_block + num_graphs, num_padding_graphs, 0);
+  if (num_padding_graphs > 0) {
+    num_nodes_per_block[num_graphs] = num_padding_nodes;
+    num_edges_per_block[num_graphs] = num_padding_edges;
+  }
+
+  bool* const instruction_node_mask = MutableTensorData<bool>(
+      interpreter, input_tensor_indices_[kInstructionNodeMaskTensor]);
+  graph_builder.WriteInstructionNodeMask(instruction_node_mask);
+  std::fill_n(instruction_node_mask + num_nodes, num_padding_instructions,
+              true);
+  std::fill_n(instruction_node_mask + num_nodes + num_padding_instructions,
+              num_padding_nodes - num_padding_instructions, false);
+
+  int32_t* const global_features = MutableTensorData<int32_t>(
+      interpreter, input_tensor_indices_[kGraphGlobalsTensor]);
+  graph_builder.WriteGlobalFeatures(global_features);
+  std::fill_n(global_features + num_graphs * graph_builder.num_node_tokens(),
+              num_padding_graphs * graph_builder.num_node_tokens(), 0);
+  GEMATRIA_TRACE_SCOPE_END(fill_scope);
+
+  GEMATRIA_TRACE_SCOPE_BEGIN(invoke_scope,
+                             "GraphBuilderModelInference::RunInference/invoke");
+  if (const TfLiteStatus status = interpreter->Invoke();
       status != kTfLiteOk) {
     return llvm::make_error<llvm::StringError>(
         "Invoking the TensorFlow Lite interpreter failed",
         llvm::errc::io_error);
   }
+  GEMATRIA_TRACE_SCOPE_END(invoke_scope);
 
-  const TfLiteTensor* const output_tensor = (*interpreter)->output_tensor(0);
-  if (output_tensor == nullptr) {
-    return llvm::createStringError(llvm::errc::invalid_argument,
-                                   "No output tensor at index 0.");
-  }
-  if (output_tensor->dims->size != 2) {
-    return llvm::createStringError(llvm::errc::invalid_argument,
-                                   "Unexpected number of dimensions of the "
-                                   "output tensor. Expected 2, found %d",
-                                   output_tensor->dims->size);
-  }
-  if (output_tensor->dims->data[0] != graph_builder_->num_graphs()) {
-    return llvm::createStringError(llvm::errc::result_out_of_range,
-                                   "Unexpected number of rows in the output "
-                                   "tensor. Expected %d, found %d.",
-                                   graph_builder_->num_graphs(),
-                                   output_tensor->dims->data[0]);
-  }
-  const int num_tasks = output_tensor->dims->data[1];
-  auto* const output_tensor_data =
-      (*interpreter)->typed_output_tensor<float>(0);
-  assert(output_tensor_data != nullptr);
+  last_batch_stats_.num_blocks = num_graphs;
+  last_batch_stats_.num_nodes = num_nodes;
+  last_batch_stats_.num_edges = num_edges;
+  last_batch_stats_.input_tensor_bytes = InputTensorBytes(
+      padded_num_graphs, padded_num_nodes, padded_num_edges,
+      padded_num_instructions, graph_builder.num_node_tokens());
+  last_batch_stats_.tensor_memory_bytes = TensorMemoryBytes(*interpreter);
+  peak_tensor_memory_bytes_ = std::max(peak_tensor_memory_bytes_,
+                                       last_batch_stats_.tensor_memory_bytes);
 
-  std::vector<OutputType> output;
-  output.reserve(graph_builder_->num_graphs());
-  for (int i = 0; i < graph_builder_->num_graphs(); ++i) {
-    output.emplace_back(output_tensor_data + i * num_tasks,
-                        output_tensor_data + (i + 1) * num_tasks);
+  const TfLiteTensor* const output_tensor =
+      interpreter->tensor(output_tensor_index_);
+  assert(output_tensor != nullptr);
+  // With padding, the output tensor may contain rows also for some or all of
+  // the padding graphs; these are ignored.
+  if (output_tensor->dims->size != 2 ||
+      output_tensor->dims->data[0] < num_graphs ||
+      output_tensor->dims->data[0] > padded_num_graphs) {
+    return llvm::createStringError(llvm::errc::result_out_of_range,
+                                   "Unexpected shape of the output tensor. "
+                                   "Expected %d rows.",
+                                   num_graphs);
   }
-  return output;
+  assert(output_tensor->data.raw != nullptr);
+  return output_tensor;
 }
 
 #undef GEMATRIA_RETURN_IF_ERROR
 
-void GraphBuilderModelInference::Reset() { graph_builder_->Reset(); }
+void GraphBuilderModelInference::Reset() {
+  graph_builder_->Reset();
+  batch_cached_predictions_.clear();
+  batch_uncached_fingerprints_.clear();
+}
 
 }  // namespace gematria
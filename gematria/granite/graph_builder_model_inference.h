@@ -15,17 +15,120 @@
 #ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BUILDER_MODEL_INFERENCE_H_
 #define THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BUILDER_MODEL_INFERENCE_H_
 
+#include <cstdint>
 #include <memory>
+#include <optional>
+#include <string>
 #include <vector>
 
 #include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/basic_block_edits.h"
+#include "gematria/basic_block/compact_basic_block.h"
+#include "gematria/basic_block/symbol_table.h"
 #include "gematria/granite/graph_builder.h"
+#include "gematria/model/oov_token_behavior.h"
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/Support/Error.h"
+#include "tensorflow/lite/c/common.h"
 #include "tensorflow/lite/model_builder.h"
 
+struct TfLiteDelegate;
+
+namespace tflite {
+class Interpreter;
+class OpResolver;
+}  // namespace tflite
+
 namespace gematria {
 
+class PredictionCache;
+
+// Options that control how GraphBuilderModelInference creates and configures
+// the TensorFlow Lite interpreter, and how it forms batches.
+struct GraphBuilderModelInferenceOptions {
+  // Limits on the size of the batches formed by
+  // GraphBuilderModelInference::TryAddBasicBlockToBatch() and
+  // GraphBuilderModelInference::RunInferenceInBatches(). A value of -1 means
+  // that the quantity is not limited. The limits apply only to the basic blocks
+  // evaluated by the model, not to basic blocks whose predictions are taken
+  // from the prediction cache.
+  struct BatchBudget {
+    // The maximal number of basic blocks in a batch.
+    int max_blocks = -1;
+    // The maximal number of nodes in the graphs of a batch.
+    int max_nodes = -1;
+    // The maximal number of edges in the graphs of a batch.
+    int max_edges = -1;
+    // The maximal size of the input tensors of a batch in bytes, not counting
+    // the padding added by shape bucketing.
+    int64_t max_input_tensor_bytes = -1;
+  };
+
+  // The TensorFlow Lite delegates that can be used to run the model.
+  enum class Delegate {
+    // No delegate is applied explicitly; the model runs with the default
+    // TensorFlow Lite kernels.
+    kNone,
+    // The XNNPACK delegate for CPUs. Available only when the inference
+    // library is built with XNNPACK support.
+    kXnnPack,
+  };
+
+  // The number of threads used by the interpreter and by the delegate. When -1,
+  // the number of threads is chosen by TensorFlow Lite.
+  int num_threads = -1;
+
+  // The delegate applied to the model.
+  Delegate delegate = Delegate::kNone;
+
+  // When true and `delegate` can't be created or applied to the model, the
+  // model runs with the default TensorFlow Lite kernels. When false, creating
+  // the inference object fails in this case.
+  bool allow_delegate_fallback = true;
+
+  // The limits on the size of batches.
+  BatchBudget batch_budget;
+
+  // When true, basic blocks that appear multiple times in a batch are
+  // evaluated by the model only once, and the prediction is copied to all
+  // their occurrences. See BasicBlockGraphBuilder::SetDeduplicateBlocks().
+  bool deduplicate_blocks = false;
+
+  // The live-info mode of the model. With LiveInfoMode::kNoLiveInfo, the graph
+  // builder uses the variant without interference edges. See
+  // BasicBlockGraphBuilder::SetLiveInfoMode().
+  LiveInfoMode live_info_mode = LiveInfoMode::kPerFunctionLiveInfo;
+
+  // When true, the shapes of the input tensors are rounded up to
+  // `shape_bucket_sizes`, or to powers of two when `shape_bucket_sizes` is
+  // empty. See GraphBuilderModelInference::SetShapeBucketing().
+  bool shape_bucketing = false;
+  std::vector<int> shape_bucket_sizes;
+};
+
+// The configuration of the graph builder of a trained GRANITE model: the node
+// tokens and the special tokens, with the same meaning as the arguments of the
+// BasicBlockGraphBuilder constructor.
+struct GraphBuilderModelVocabulary {
+  std::vector<std::string> node_tokens;
+  std::string immediate_token;
+  std::string fp_immediate_token;
+  std::string address_token;
+  std::string memory_token;
+  OutOfVocabularyTokenBehavior out_of_vocabulary_behavior =
+      OutOfVocabularyTokenBehavior::ReturnError();
+};
+
+// Reads the vocabulary of a model stored in the .tflite format. The
+// vocabulary is read directly from the constant buffers of the flatbuffer,
+// without creating a TensorFlow Lite interpreter, so this is cheap even for
+// large models; it lets tools check or compare the vocabularies of models
+// before loading them for inference. Returns an error when the model does not
+// contain the node token definitions.
+llvm::Expected<GraphBuilderModelVocabulary> ReadGraphBuilderModelVocabulary(
+    const tflite::FlatBufferModel& tflite_model);
+
 // Runs inference with a trained GRANITE model. The class uses TensorFlow Lite
 // and a model stored in the .tflite format to do the inference in-process.
 //
@@ -51,46 +154,308 @@ class GraphBuilderModelInference {
   // definition of this type may change in the future.
   using OutputType = llvm::SmallVector<float, 4>;
 
+  // The type used for the costs of a function computed by
+  // RunFunctionInferenceInBatches(): the weighted sums of the predictions for
+  // the basic blocks of the function, one per task of the model. The sums are
+  // kept in double precision, because a function may have thousands of basic
+  // blocks with very different weights.
+  using FunctionOutputType = llvm::SmallVector<double, 4>;
+
+  // The result of TryAddBasicBlockToBatch().
+  enum class AddBasicBlockResult {
+    // The basic block was added to the batch.
+    kAdded,
+    // The basic block could not be added to any batch, e.g. because it
+    // contains an unknown token.
+    kInvalidBlock,
+    // The basic block was not added, because the batch would exceed the batch
+    // budget. The basic block should be added to the next batch.
+    kBatchFull,
+  };
+
+  // Statistics about a batch processed by RunInference().
+  struct BatchStats {
+    // The number of basic blocks, nodes and edges evaluated by the model, not
+    // counting the padding.
+    int num_blocks = 0;
+    int num_nodes = 0;
+    int num_edges = 0;
+    // The size of the input tensors in bytes, including the padding.
+    int64_t input_tensor_bytes = 0;
+    // The total size of the tensors allocated by the interpreter in its arena
+    // or dynamically, in bytes. TensorFlow Lite reuses the arena memory between
+    // tensors whose lifetimes do not overlap, so this is an upper bound on the
+    // actual size of the arena.
+    int64_t tensor_memory_bytes = 0;
+  };
+
   // Creates the inference object from a model stored in the .tflite format.
   // Expects that the .tflite model contains also the definitions of node tokens
-  // and creates a graph builder internally based on these definitions. Returns
-  // an error when the model can't be loaded or it does not have all components
-  // including the node token definitions.
+  // and creates a graph builder internally based on these definitions. The
+  // input and output tensors of the model are looked up by name and their
+  // types and shapes are checked here. Returns an error when the model can't be
+  // loaded or it does not have all components including the node token
+  // definitions and the expected input and output tensors.
   // Does not take ownership of `tflite_model`; the object must remain alive for
-  // the whole lifetime of the inference object.
+  // the whole lifetime of the inference object. `options` control the
+  // creation of the TensorFlow Lite interpreter.
   static llvm::Expected<std::unique_ptr<GraphBuilderModelInference>>
-  FromTfLiteModel(const tflite::FlatBufferModel* tflite_model);
+  FromTfLiteModel(const tflite::FlatBufferModel* tflite_model,
+                  const GraphBuilderModelInferenceOptions& options = {});
+
+  ~GraphBuilderModelInference();
+
+  // Creates a new inference object for the same model. The new object has its
+  // own graph builder and its own interpreter, and it can be used
+  // independently of (and concurrently with) this object. The vocabulary and
+  // the tensor layout are copied from this object instead of being read from
+  // the model again. The new object shares the prediction cache with this
+  // object, and uses the same interpreter options and shape bucketing
+  // configuration. The current batch of this object is not copied.
+  llvm::Expected<std::unique_ptr<GraphBuilderModelInference>> Clone() const;
+
+  // Enables or disables bucketing of the shapes of the input tensors. When
+  // enabled, each batch is padded with padding graphs so that the number of
+  // graphs, nodes, edges and instructions in the batch are rounded up to one
+  // of `bucket_sizes`, or to the next power of two when `bucket_sizes` is empty
+  // or the size is larger than all buckets. The padding graphs are not
+  // connected to the real graphs, so the predictions for the basic blocks in
+  // the batch do not change. With bucketing, the memory of the interpreter is
+  // re-planned only when the size of the batch crosses a bucket boundary.
+  // The initial configuration is taken from the options.
+  void SetShapeBucketing(bool enabled, std::vector<int> bucket_sizes = {});
+
+  // Sets the cache of predictions used by this object; nullptr disables the
+  // cache. When a cache is set, AddBasicBlockToBatch() looks up each basic
+  // block in the cache, and only basic blocks that are not found are added to
+  // the graph of the batch; RunInference() adds the new predictions to the
+  // cache. The cache may be shared with other inference objects that use the
+  // same model. Resets the current batch.
+  void SetPredictionCache(std::shared_ptr<PredictionCache> prediction_cache);
+
+  // Returns the cache of predictions used by this object, or nullptr when the
+  // cache is not used.
+  const std::shared_ptr<PredictionCache>& prediction_cache() const {
+    return prediction_cache_;
+  }
 
   // Adds a basic block to the current batch. Returns true when the basic block
   // was successfully added, otherwise false.
   // TODO(ondrasej): Add API that would allow rejecting blocks with unknown
   // tokens even if a replacement token was specified.
+  // Does not check the batch budget from the options; see
+  // TryAddBasicBlockToBatch().
   bool AddBasicBlockToBatch(const BasicBlock& block);
 
+  // Adds a basic block to the current batch, unless the batch would exceed the
+  // batch budget from the options. The first basic block evaluated by the model
+  // is always accepted, even if it does not fit the budget on its own.
+  AddBasicBlockResult TryAddBasicBlockToBatch(const BasicBlock& block);
+
+  // Versions of AddBasicBlockToBatch() and TryAddBasicBlockToBatch() that take
+  // pointers to the instructions of the basic block, e.g. an edited basic block
+  // from ApplyBasicBlockEdits(). The instructions must remain valid until
+  // RunInference() returns. The prediction cache uses the same fingerprints as
+  // for basic blocks with copies of the instructions.
+  bool AddInstructionsToBatch(
+      const std::vector<const Instruction*>& instructions);
+  AddBasicBlockResult TryAddInstructionsToBatch(
+      const std::vector<const Instruction*>& instructions);
+
+  // Sets the symbol table used to resolve the symbols of the basic blocks; see
+  // BasicBlockGraphBuilder::SetSymbolTable(). A symbol table is required for
+  // basic blocks in the compact encoding.
+  void SetSymbolTable(std::shared_ptr<const SymbolTable> symbol_table);
+
+  // Versions of AddBasicBlockToBatch() and TryAddBasicBlockToBatch() that take
+  // a basic block in the compact encoding. The basic block must be encoded with
+  // the symbol table set through SetSymbolTable(). The prediction cache uses
+  // the same fingerprints as for the basic block the compact block was encoded
+  // from.
+  bool AddCompactBasicBlockToBatch(const CompactBasicBlock& block);
+  AddBasicBlockResult TryAddCompactBasicBlockToBatch(
+      const CompactBasicBlock& block);
+
   // Runs inference on the current batch. Returns a vector that contains
   // predictions for all basic blocks from the current batch in the order in
   // which they are added. The output for each basic block are the predictions
   // from all heads of the model.
+  // The interpreter is reused across calls; the input tensors are resized and
+  // the tensor memory is re-planned only when the shapes of the inputs differ
+  // from the previous call.
   llvm::Expected<std::vector<OutputType>> RunInference();
 
+  // Runs inference on `blocks`, splitting them into as many batches as needed
+  // to stay within the batch budget from the options. The current batch must
+  // be empty, and it is empty again when the method returns. Returns a vector
+  // with one element per basic block in `blocks`, in the same order; the
+  // element is std::nullopt when the basic block could not be added to a
+  // batch.
+  llvm::Expected<std::vector<std::optional<OutputType>>> RunInferenceInBatches(
+      llvm::ArrayRef<BasicBlock> blocks);
+  // A version of RunInferenceInBatches() for basic blocks in the compact
+  // encoding; see AddCompactBasicBlockToBatch().
+  llvm::Expected<std::vector<std::optional<OutputType>>> RunInferenceInBatches(
+      llvm::ArrayRef<CompactBasicBlock> blocks);
+
+  // Runs inference on the basic blocks of one or more functions, and returns
+  // the cost of each function instead of the predictions for the basic blocks.
+  // The basic blocks of each function are consecutive in `blocks`;
+  // `function_num_blocks[i]` is the number of basic blocks of the i-th
+  // function. The cost of a function is the sum of the predictions for its
+  // basic blocks multiplied by `block_weights`, e.g. the execution frequencies
+  // of the basic blocks. The sums are accumulated in the order of the basic
+  // blocks directly from the output tensor of the model and from the
+  // prediction cache, so no per-block predictions are created. Batching
+  // follows the batch budget as in RunInferenceInBatches(). The current batch
+  // must be empty, and it is empty again when the method returns.
+  // Returns an error when one of the basic blocks could not be added to a
+  // batch. The cost of a function without basic blocks is an empty vector.
+  llvm::Expected<std::vector<FunctionOutputType>>
+  RunFunctionInferenceInBatches(llvm::ArrayRef<BasicBlock> blocks,
+                                llvm::ArrayRef<double> block_weights,
+                                llvm::ArrayRef<int> function_num_blocks);
+  llvm::Expected<std::vector<FunctionOutputType>>
+  RunFunctionInferenceInBatches(llvm::ArrayRef<CompactBasicBlock> blocks,
+                                llvm::ArrayRef<double> block_weights,
+                                llvm::ArrayRef<int> function_num_blocks);
+
+  // Evaluates "what-if" candidates of a compiler pass, e.g. alternative
+  // schedules or instruction selections of `base_block`. Each candidate is a
+  // list of edits of `base_block` (see ApplyBasicBlockEdits()); an empty list
+  // evaluates the base block itself. The candidates share the instructions of
+  // the base block instead of copying them, duplicate candidates are evaluated
+  // only once when block deduplication is enabled, and all candidates are
+  // evaluated in as few batches as the batch budget allows. The current batch
+  // must be empty, and it is empty again when the method returns.
+  // Returns one prediction per candidate; the element is std::nullopt when
+  // the edits of the candidate are not valid for `base_block` or when the
+  // edited basic block could not be added to a batch.
+  llvm::Expected<std::vector<std::optional<OutputType>>>
+  RunInferenceOnBlockEdits(
+      const BasicBlock& base_block,
+      llvm::ArrayRef<std::vector<BasicBlockEdit>> candidates);
+
+  // Runs inference on the basic blocks in `graph_builder` instead of the
+  // current batch, without using the prediction cache. Returns one prediction
+  // per basic block added to `graph_builder`, including the deduplicated ones.
+  // `graph_builder` must have the same vocabulary as the graph builder of this
+  // object (see BasicBlockGraphBuilder::HasSameVocabulary()). This lets several
+  // models trained with the same vocabulary evaluate a batch that is built
+  // only once; see GraphBuilderMultiModelInference.
+  llvm::Expected<std::vector<OutputType>> RunInferenceOnGraphBuilder(
+      const BasicBlockGraphBuilder& graph_builder);
+
+  // Returns the graph builder that holds the current batch.
+  const BasicBlockGraphBuilder& graph_builder() const {
+    return *graph_builder_;
+  }
+
+  // Returns the statistics about the last batch processed by RunInference().
+  const BatchStats& last_batch_stats() const { return last_batch_stats_; }
+
+  // Returns the largest value of BatchStats::tensor_memory_bytes over all
+  // batches processed by this object.
+  int64_t peak_tensor_memory_bytes() const {
+    return peak_tensor_memory_bytes_;
+  }
+
   // Removes all basic blocks from the current batch. Note that RunInference()
   // does not call this method automatically.
   // TODO(ondrasej): See if this method could be removed from the API.
   void Reset();
 
  private:
+  // An owning pointer to a TensorFlow Lite delegate. Each type of delegate has
+  // its own function for deleting the delegate object.
+  using DelegatePtr =
+      std::unique_ptr<TfLiteDelegate, void (*)(TfLiteDelegate*)>;
+
   // Creates the inference object for the given graph builder object and the
   // given model in the .tflite format. Note that `graph_builder` is a property
   // of the trained model and it should be set up the same way as during the
   // training of the model.
-  // Causes a CHECK-failure if the model inputs and outputs do not match the
-  // structure of a model based on the BasicBlockGraphBuilder class.
+  // `input_tensor_indices` and `output_tensor_index` are the indices of the
+  // input and output tensors in `interpreter`, resolved and checked by
+  // FromTfLiteModel().
   GraphBuilderModelInference(
       std::unique_ptr<BasicBlockGraphBuilder> graph_builder,
-      const tflite::FlatBufferModel* tflite_model);
+      const tflite::FlatBufferModel* tflite_model,
+      const GraphBuilderModelInferenceOptions& options,
+      std::unique_ptr<tflite::OpResolver> op_resolver, DelegatePtr delegate,
+      std::unique_ptr<tflite::Interpreter> interpreter,
+      std::vector<int> input_tensor_indices, int output_tensor_index);
+
+  // The implementations of the methods for adding basic blocks and for running
+  // inference in batches. `Instructions` is either BasicBlock or a list of
+  // pointers to instructions.
+  template <typename Instructions>
+  bool AddToBatch(const Instructions& instructions);
+  template <typename Instructions>
+  AddBasicBlockResult TryAddToBatch(const Instructions& instructions);
+  template <typename Instructions>
+  llvm::Expected<std::vector<std::optional<OutputType>>> RunInBatches(
+      llvm::ArrayRef<Instructions> blocks);
+  template <typename Instructions>
+  llvm::Expected<std::vector<FunctionOutputType>> RunFunctionsInBatches(
+      llvm::ArrayRef<Instructions> blocks, llvm::ArrayRef<double> block_weights,
+      llvm::ArrayRef<int> function_num_blocks);
+
+  // Fills the input tensors from `graph_builder`, which must not be empty, and
+  // invokes the interpreter. Returns the output tensor of the model; it has
+  // one row of predictions per graph in `graph_builder`, possibly followed by
+  // rows for the padding graphs. The tensor remains valid until the next call.
+  llvm::Expected<const TfLiteTensor*> InvokeInterpreter(
+      const BasicBlockGraphBuilder& graph_builder);
+
+  // Runs inference on the current batch, and adds the predictions for each
+  // basic block in the batch multiplied by `batch_weights[i]` to
+  // `costs[batch_functions[i]]`, where `i` is the index of the basic block in
+  // the batch. Updates the prediction cache and resets the current batch.
+  llvm::Error AccumulateBatchCosts(llvm::ArrayRef<double> batch_weights,
+                                   llvm::ArrayRef<int> batch_functions,
+                                   std::vector<FunctionOutputType>& costs);
 
   std::unique_ptr<BasicBlockGraphBuilder> graph_builder_;
   const tflite::FlatBufferModel& tflite_model_;
+  const GraphBuilderModelInferenceOptions options_;
+
+  // The op resolver used to create `interpreter_`. It must outlive the
+  // interpreter.
+  std::unique_ptr<tflite::OpResolver> op_resolver_;
+  // The delegate applied to `interpreter_`, or nullptr when no delegate is
+  // used. It must outlive the interpreter.
+  DelegatePtr delegate_;
+  // The interpreter used for all calls to RunInference().
+  std::unique_ptr<tflite::Interpreter> interpreter_;
+  // The indices of the input tensors in `interpreter_`, in the order defined
+  // by the input tensor constants in graph_builder_model_inference.cc.
+  std::vector<int> input_tensor_indices_;
+  // The index of the output tensor with the predictions in `interpreter_`.
+  int output_tensor_index_;
+  // The size of the first dimension of each input tensor, in the same order as
+  // `input_tensor_indices_`, as of the last successful call to
+  // AllocateTensors(). A negative value means that the tensor was not resized
+  // and allocated yet.
+  std::vector<int> input_tensor_sizes_;
+
+  // The configuration of shape bucketing; see SetShapeBucketing(). The bucket
+  // sizes are sorted in the increasing order.
+  bool shape_bucketing_enabled_ = false;
+  std::vector<int> shape_bucket_sizes_;
+
+  std::shared_ptr<PredictionCache> prediction_cache_;
+  // The following members are used only when `prediction_cache_` is not null.
+  // For each basic block in the current batch, contains the prediction found
+  // in the cache, or std::nullopt when the basic block was not found and it was
+  // added to `graph_builder_`.
+  std::vector<std::optional<OutputType>> batch_cached_predictions_;
+  // The fingerprints of the basic blocks added to `graph_builder_` in the
+  // current batch, in the order in which they were added.
+  std::vector<uint64_t> batch_uncached_fingerprints_;
+
+  BatchStats last_batch_stats_;
+  int64_t peak_tensor_memory_bytes_ = 0;
 };
 
 }  // namespace gematria
@@ -0,0 +1,176 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "gematria/granite/graph_builder_model_inference_batcher.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <future>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/granite/graph_builder_model_inference_pool.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/Error.h"
+
+namespace gematria {
+
+llvm::Expected<std::unique_ptr<GraphBuilderModelInferenceBatcher>>
+GraphBuilderModelInferenceBatcher::Create(
+    GraphBuilderModelInferencePool* pool,
+    const GraphBuilderModelInferenceBatcherOptions& options) {
+  if (options.max_blocks_per_batch <= 0) {
+    return llvm::createStringError(
+        llvm::errc::invalid_argument,
+        "max_blocks_per_batch must be positive, it is %d",
+        options.max_blocks_per_batch);
+  }
+  if (options.max_batch_delay.count() < 0) {
+    return llvm::createStringError(llvm::errc::invalid_argument,
+                                   "max_batch_delay must not be negative");
+  }
+  // We can't use std::make_unique<GraphBuilderModelInferenceBatcher>(),
+  // because std::make_unique<>() requires a public constructor.
+  return std::unique_ptr<GraphBuilderModelInferenceBatcher>(
+      new GraphBuilderModelInferenceBatcher(pool, options));
+}
+
+GraphBuilderModelInferenceBatcher::GraphBuilderModelInferenceBatcher(
+    GraphBuilderModelInferencePool* pool,
+    const GraphBuilderModelInferenceBatcherOptions& options)
+    : pool_(pool), options_(options) {
+  // With one dispatcher per worker, a new batch can be collected while all the
+  // other workers are busy, and no dispatcher waits for a worker.
+  dispatchers_.reserve(pool_->num_workers());
+  for (int i = 0; i < pool_->num_workers(); ++i) {
+    dispatchers_.emplace_back([this]() { RunDispatcher(); });
+  }
+}
+
+GraphBuilderModelInferenceBatcher::~GraphBuilderModelInferenceBatcher() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    shutting_down_ = true;
+  }
+  request_added_.notify_all();
+  for (std::thread& dispatcher : dispatchers_) dispatcher.join();
+}
+
+std::future<GraphBuilderModelInferenceBatcher::Result>
+GraphBuilderModelInferenceBatcher::Submit(BasicBlock block) {
+  Request request{std::move(block), Clock::now(), {}};
+  std::future<Result> result = request.result.get_future();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_requests_.push_back(std::move(request));
+    stats_.max_queue_depth =
+        std::max<int64_t>(stats_.max_queue_depth, pending_requests_.size());
+  }
+  // Wake up all dispatchers: an idle one may need to start a new batch, and
+  // the one collecting a batch may have reached `max_blocks_per_batch`.
+  request_added_.notify_all();
+  return result;
+}
+
+GraphBuilderModelInferenceBatcher::Stats
+GraphBuilderModelInferenceBatcher::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Stats stats = stats_;
+  stats.queue_depth = static_cast<int64_t>(pending_requests_.size());
+  return stats;
+}
+
+void GraphBuilderModelInferenceBatcher::RunDispatcher() {
+  const size_t max_blocks_per_batch = options_.max_blocks_per_batch;
+  std::vector<Request> batch;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    request_added_.wait(lock, [this]() {
+      return shutting_down_ || !pending_requests_.empty();
+    });
+    // The pending requests are processed also during the shutdown.
+    if (pending_requests_.empty()) return;
+
+    // Wait for more requests until the batch is full or until the oldest
+    // request reaches the deadline. Another dispatcher may take the requests
+    // in the meantime; in that case, we start over with the next oldest one.
+    const Clock::time_point deadline =
+        pending_requests_.front().submit_time + options_.max_batch_delay;
+    request_added_.wait_until(lock, deadline, [&]() {
+      return shutting_down_ || pending_requests_.size() >= max_blocks_per_batch;
+    });
+    if (pending_requests_.empty()) continue;
+
+    const size_t batch_size =
+        std::min(pending_requests_.size(), max_blocks_per_batch);
+    batch.assign(
+        std::make_move_iterator(pending_requests_.begin()),
+        std::make_move_iterator(pending_requests_.begin() + batch_size));
+    pending_requests_.erase(pending_requests_.begin(),
+                            pending_requests_.begin() + batch_size);
+    // Let an idle dispatcher start collecting the next batch.
+    if (!pending_requests_.empty()) request_added_.notify_one();
+
+    lock.unlock();
+    ProcessBatch(batch);
+    const Clock::time_point end_time = Clock::now();
+    lock.lock();
+
+    ++stats_.num_batches;
+    stats_.num_requests += batch.size();
+    for (const Request& request : batch) {
+      const int64_t latency_ns =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              end_time - request.submit_time)
+              .count();
+      stats_.total_latency_ns += latency_ns;
+      stats_.max_latency_ns = std::max(stats_.max_latency_ns, latency_ns);
+    }
+    batch.clear();
+  }
+}
+
+void GraphBuilderModelInferenceBatcher::ProcessBatch(
+    std::vector<Request>& requests) {
+  std::vector<BasicBlock> blocks;
+  blocks.reserve(requests.size());
+  for (Request& request : requests) {
+    blocks.push_back(std::move(request.block));
+  }
+  llvm::Expected<std::vector<std::optional<OutputType>>> predictions =
+      pool_->RunInference(blocks);
+  if (llvm::Error error = predictions.takeError()) {
+    // llvm::Error can't be copied; each request gets its own error with the
+    // same message.
+    const std::string message = llvm::toString(std::move(error));
+    for (Request& request : requests) {
+      request.result.set_value(
+          llvm::createStringError(llvm::errc::io_error, "%s", message.c_str()));
+    }
+    return;
+  }
+  for (size_t i = 0; i < requests.size(); ++i) {
+    requests[i].result.set_value(std::move((*predictions)[i]));
+  }
+}
+
+}  // namespace gematria
@@ -0,0 +1,154 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Contains a request batcher for GraphBuilderModelInferencePool. The batcher
+// collects basic blocks submitted by independent, concurrent callers, and runs
+// them through the model in batches, so that callers that have only one basic
+// block at a time still get the throughput of batched inference.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BUILDER_MODEL_INFERENCE_BATCHER_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BUILDER_MODEL_INFERENCE_BATCHER_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/granite/graph_builder_model_inference.h"
+#include "gematria/granite/graph_builder_model_inference_pool.h"
+#include "llvm/Support/Error.h"
+
+namespace gematria {
+
+// Options of GraphBuilderModelInferenceBatcher.
+struct GraphBuilderModelInferenceBatcherOptions {
+  // The maximal number of basic blocks coalesced into one batch. Note that the
+  // pool may still split the batch further when it has a batch budget. Must be
+  // positive.
+  int max_blocks_per_batch = 256;
+  // The maximal time a basic block waits for other requests before its batch
+  // is started. A batch is started earlier when it reaches
+  // `max_blocks_per_batch`. Zero means that each batch contains only the
+  // requests that were waiting when a worker became available.
+  std::chrono::microseconds max_batch_delay = std::chrono::microseconds(1000);
+};
+
+// Collects basic blocks from concurrent callers into batches and runs them on
+// a GraphBuilderModelInferencePool. The batcher runs one dispatcher thread per
+// worker of the pool; each dispatcher takes the oldest pending requests, waits
+// until it has `max_blocks_per_batch` blocks or until the oldest block waited
+// for `max_batch_delay`, and runs the batch on the pool.
+//
+// Typical usage:
+//   auto pool = GraphBuilderModelInferencePool::FromTfLiteModel(...);
+//   auto batcher = GraphBuilderModelInferenceBatcher::Create(pool->get(), {});
+//   // From any thread:
+//   std::future<GraphBuilderModelInferenceBatcher::Result> prediction =
+//       (*batcher)->Submit(std::move(block));
+//   ...
+//   GraphBuilderModelInferenceBatcher::Result result = prediction.get();
+class GraphBuilderModelInferenceBatcher {
+ public:
+  using OutputType = GraphBuilderModelInference::OutputType;
+  // The result of a request. The optional is std::nullopt when the basic block
+  // could not be added to the batch (see
+  // GraphBuilderModelInference::AddBasicBlockToBatch()); the error is set when
+  // the inference of the whole batch failed.
+  using Result = llvm::Expected<std::optional<OutputType>>;
+
+  // Queue and latency statistics of the batcher. The latencies are measured
+  // from the call to Submit() to the time when the result is available.
+  struct Stats {
+    // The number of requests that were already processed.
+    int64_t num_requests = 0;
+    // The number of batches that were already processed.
+    int64_t num_batches = 0;
+    // The number of requests that wait for a batch.
+    int64_t queue_depth = 0;
+    // The maximal number of requests that waited for a batch at the same time.
+    int64_t max_queue_depth = 0;
+    // The sum and the maximum of the latencies of all processed requests.
+    int64_t total_latency_ns = 0;
+    int64_t max_latency_ns = 0;
+  };
+
+  // Creates a batcher that runs the requests on `pool`. Returns an error when
+  // the options are not valid. Does not take ownership of `pool`; the pool must
+  // remain alive for the whole lifetime of the batcher.
+  static llvm::Expected<std::unique_ptr<GraphBuilderModelInferenceBatcher>>
+  Create(GraphBuilderModelInferencePool* pool,
+         const GraphBuilderModelInferenceBatcherOptions& options);
+
+  GraphBuilderModelInferenceBatcher(const GraphBuilderModelInferenceBatcher&) =
+      delete;
+  GraphBuilderModelInferenceBatcher& operator=(
+      const GraphBuilderModelInferenceBatcher&) = delete;
+
+  // Processes all pending requests and stops the dispatcher threads.
+  ~GraphBuilderModelInferenceBatcher();
+
+  // Submits `block` for inference. Returns a future that becomes ready when
+  // the batch with the block is processed. Thread-safe.
+  std::future<Result> Submit(BasicBlock block);
+
+  // Returns the current statistics of the batcher. Thread-safe.
+  Stats GetStats() const;
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Request {
+    BasicBlock block;
+    Clock::time_point submit_time;
+    std::promise<Result> result;
+  };
+
+  GraphBuilderModelInferenceBatcher(
+      GraphBuilderModelInferencePool* pool,
+      const GraphBuilderModelInferenceBatcherOptions& options);
+
+  // The main loop of a dispatcher thread.
+  void RunDispatcher();
+
+  // Runs inference on `requests` and fulfills their promises.
+  void ProcessBatch(std::vector<Request>& requests);
+
+  GraphBuilderModelInferencePool* const pool_;
+  const GraphBuilderModelInferenceBatcherOptions options_;
+
+  mutable std::mutex mutex_;
+  // Notified when a request is added and when the batcher is shutting down.
+  std::condition_variable request_added_;
+  // The requests that wait for a batch, in the order of submission. Guarded by
+  // `mutex_`.
+  std::deque<Request> pending_requests_;
+  // Set to true when the batcher is destroyed. Guarded by `mutex_`.
+  bool shutting_down_ = false;
+  // Guarded by `mutex_`; `stats_.queue_depth` is computed in GetStats().
+  Stats stats_;
+
+  std::vector<std::thread> dispatchers_;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BUILDER_MODEL_INFERENCE_BATCHER_H_
@@ -0,0 +1,231 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/granite/graph_builder_model_inference_batcher.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <future>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/strings/string_view.h"
+#include "file/base/path.h"
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/basic_block_protos.h"
+#include "gematria/granite/graph_builder_model_inference_pool.h"
+#include "gematria/testing/parse_proto.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/Error.h"
+#include "tensorflow/lite/model_builder.h"
+#include "testing/base/public/googletest.h"
+
+namespace gematria {
+namespace {
+
+using Batcher = GraphBuilderModelInferenceBatcher;
+using OutputType = Batcher::OutputType;
+
+void AbortOnError(llvm::Error error) {
+  if (error) {
+    llvm::dbgs() << "Fatal error: " << error << "\n";
+    std::abort();
+  }
+}
+
+// The path of the model used in the tests, relative to the source directory of
+// the test.
+constexpr absl::string_view kModelPath =
+    "llvm_cm/test/X86/Inputs/gb-token-mit-2022_12_02.tflite";
+
+// Basic blocks used in the tests.
+constexpr absl::string_view kBasicBlocks[] = {
+    R"pb(
+      canonicalized_instructions {
+        mnemonic: "MOV"
+        llvm_mnemonic: "MOV64rr"
+        output_operands { register_name: "RSI" }
+        input_operands { register_name: "RBX" }
+      })pb",
+    R"pb(
+      canonicalized_instructions: {
+        mnemonic: "LEA"
+        llvm_mnemonic: "LEA64r"  # size=6
+        output_operands: { register_name: "RDI" }
+        input_operands: {
+          address: { base_register: "RBX" displacement: 8 scaling: 1 }
+        }
+      })pb",
+    R"pb(
+      canonicalized_instructions {
+        mnemonic: "ADD"
+        llvm_mnemonic: "ADD64rr"
+        output_operands { register_name: "RAX" }
+        input_operands { register_name: "RAX" }
+        input_operands { register_name: "RCX" }
+        implicit_output_operands { register_name: "EFLAGS" }
+      })pb",
+};
+
+class GraphBuilderModelInferenceBatcherTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    const std::string model_path =
+        file::JoinPath(absl::GetFlag(FLAGS_test_srcdir), kModelPath);
+    tflite_model_ = tflite::FlatBufferModel::BuildFromFile(model_path.c_str());
+    ASSERT_NE(tflite_model_, nullptr);
+    llvm::Expected<std::unique_ptr<GraphBuilderModelInferencePool>> pool =
+        GraphBuilderModelInferencePool::FromTfLiteModel(tflite_model_.get(),
+                                                        2);
+    AbortOnError(pool.takeError());
+    pool_ = std::move(*pool);
+
+    for (const absl::string_view block_proto : kBasicBlocks) {
+      basic_blocks_.push_back(BasicBlockFromProto(ParseTextProto(block_proto)));
+    }
+    // The predictions of the blocks, each evaluated in a batch of its own.
+    for (const BasicBlock& block : basic_blocks_) {
+      llvm::Expected<std::vector<std::optional<OutputType>>> prediction =
+          pool_->RunInference({block});
+      AbortOnError(prediction.takeError());
+      ASSERT_TRUE((*prediction)[0].has_value());
+      expected_predictions_.push_back(*(*prediction)[0]);
+    }
+  }
+
+  std::unique_ptr<Batcher> CreateBatcher(
+      const GraphBuilderModelInferenceBatcherOptions& options) {
+    llvm::Expected<std::unique_ptr<Batcher>> batcher =
+        Batcher::Create(pool_.get(), options);
+    AbortOnError(batcher.takeError());
+    return std::move(*batcher);
+  }
+
+  // Checks that `prediction` is the prediction for the block at `index`. The
+  // predictions of a batch may differ from the predictions of individual
+  // blocks by the rounding errors.
+  void ExpectPrediction(Batcher::Result prediction, int index) {
+    AbortOnError(prediction.takeError());
+    ASSERT_TRUE(prediction->has_value());
+    const OutputType& expected = expected_predictions_[index];
+    ASSERT_EQ((*prediction)->size(), expected.size());
+    for (size_t i = 0; i < expected.size(); ++i) {
+      EXPECT_NEAR((**prediction)[i], expected[i], 1e-3 * std::abs(expected[i]));
+    }
+  }
+
+  std::unique_ptr<tflite::FlatBufferModel> tflite_model_;
+  std::unique_ptr<GraphBuilderModelInferencePool> pool_;
+  std::vector<BasicBlock> basic_blocks_;
+  std::vector<OutputType> expected_predictions_;
+};
+
+TEST_F(GraphBuilderModelInferenceBatcherTest, InvalidOptions) {
+  GraphBuilderModelInferenceBatcherOptions options;
+  options.max_blocks_per_batch = 0;
+  llvm::Expected<std::unique_ptr<Batcher>> batcher =
+      Batcher::Create(pool_.get(), options);
+  EXPECT_FALSE(static_cast<bool>(batcher));
+  llvm::consumeError(batcher.takeError());
+
+  options.max_blocks_per_batch = 1;
+  options.max_batch_delay = std::chrono::microseconds(-1);
+  batcher = Batcher::Create(pool_.get(), options);
+  EXPECT_FALSE(static_cast<bool>(batcher));
+  llvm::consumeError(batcher.takeError());
+}
+
+TEST_F(GraphBuilderModelInferenceBatcherTest, SubmitFromManyThreads) {
+  constexpr int kNumThreads = 8;
+  constexpr int kNumRequestsPerThread = 10;
+  std::unique_ptr<Batcher> batcher = CreateBatcher({});
+
+  std::vector<std::thread> threads;
+  std::vector<std::vector<Batcher::Result>> results(kNumThreads);
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&, i]() {
+      std::vector<std::future<Batcher::Result>> futures;
+      for (int j = 0; j < kNumRequestsPerThread; ++j) {
+        futures.push_back(batcher->Submit(
+            basic_blocks_[(i + j) % basic_blocks_.size()]));
+      }
+      for (std::future<Batcher::Result>& future : futures) {
+        results[i].push_back(future.get());
+      }
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+
+  for (int i = 0; i < kNumThreads; ++i) {
+    for (int j = 0; j < kNumRequestsPerThread; ++j) {
+      SCOPED_TRACE(testing::Message() << "thread " << i << ", request " << j);
+      ExpectPrediction(std::move(results[i][j]),
+                       (i + j) % basic_blocks_.size());
+    }
+  }
+  const Batcher::Stats stats = batcher->GetStats();
+  EXPECT_EQ(stats.num_requests, kNumThreads * kNumRequestsPerThread);
+  EXPECT_GE(stats.num_batches, 1);
+  EXPECT_LE(stats.num_batches, stats.num_requests);
+  EXPECT_EQ(stats.queue_depth, 0);
+  EXPECT_GE(stats.max_queue_depth, 1);
+  EXPECT_GE(stats.total_latency_ns, stats.max_latency_ns);
+}
+
+TEST_F(GraphBuilderModelInferenceBatcherTest, MaxBlocksPerBatch) {
+  constexpr int kNumRequests = 6;
+  GraphBuilderModelInferenceBatcherOptions options;
+  options.max_blocks_per_batch = 1;
+  std::unique_ptr<Batcher> batcher = CreateBatcher(options);
+  std::vector<std::future<Batcher::Result>> futures;
+  for (int i = 0; i < kNumRequests; ++i) {
+    futures.push_back(batcher->Submit(basic_blocks_[i % basic_blocks_.size()]));
+  }
+  for (int i = 0; i < kNumRequests; ++i) {
+    SCOPED_TRACE(i);
+    ExpectPrediction(futures[i].get(), i % basic_blocks_.size());
+  }
+  const Batcher::Stats stats = batcher->GetStats();
+  EXPECT_EQ(stats.num_requests, kNumRequests);
+  EXPECT_EQ(stats.num_batches, kNumRequests);
+}
+
+TEST_F(GraphBuilderModelInferenceBatcherTest, DestructorProcessesRequests) {
+  GraphBuilderModelInferenceBatcherOptions options;
+  // A long delay; the batches are started by the destructor.
+  options.max_batch_delay = std::chrono::seconds(60);
+  std::unique_ptr<Batcher> batcher = CreateBatcher(options);
+  std::vector<std::future<Batcher::Result>> futures;
+  for (const BasicBlock& block : basic_blocks_) {
+    futures.push_back(batcher->Submit(block));
+  }
+  batcher.reset();
+  for (size_t i = 0; i < futures.size(); ++i) {
+    SCOPED_TRACE(i);
+    ASSERT_EQ(futures[i].wait_for(std::chrono::seconds(0)),
+              std::future_status::ready);
+    ExpectPrediction(futures[i].get(), i);
+  }
+}
+
+}  // namespace
+}  // namespace gematria
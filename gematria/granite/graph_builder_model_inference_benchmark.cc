@@ -0,0 +1,332 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures the end-to-end throughput and latency of Gematria model inference:
+// hex decoding, disassembly, canonicalization, graph construction and running
+// the model, for a sweep of batch sizes and numbers of threads.
+//
+// Typical usage:
+//   llvm-granite-benchmark \
+//     --gematria_tflite_file \
+//         llvm_cm/test/X86/Inputs/gb-token-mit-2022_12_02.tflite \
+//     --gematria_batch_sizes 1,10,100 \
+//     --gematria_thread_counts 1,2,4
+//
+// When --gematria_basic_block_hex_file is not set, the tool uses a small
+// built-in set of basic blocks, so that it can run without any input data. The
+// blocks are evaluated in a loop until each configuration runs the requested
+// number of batches.
+//
+// The results are printed to stdout in the CSV format, one row per
+// configuration and stage; the latencies are per batch, in microseconds. The
+// blocks/s column is the number of blocks processed by the stage divided by the
+// total time spent in the stage.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/granite/graph_builder_model_inference.h"
+#include "gematria/llvm/canonicalizer.h"
+#include "gematria/llvm/disassembler.h"
+#include "gematria/llvm/llvm_architecture_support.h"
+#include "gematria/utils/string.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/raw_ostream.h"
+#include "tensorflow/lite/model_builder.h"
+
+namespace gematria {
+namespace {
+
+namespace cl = llvm::cl;
+
+cl::opt<std::string> tflite_file(
+    "gematria_tflite_file", cl::value_desc("tflite_file"),
+    cl::desc("The path to the .tflite file that contains the trained model."));
+cl::opt<std::string> basic_block_hex_file(
+    "gematria_basic_block_hex_file", cl::value_desc("hex_file"),
+    cl::desc("The file from which the tool reads basic blocks in the hex format"
+             " used in the BHive data set, one basic block per line. When"
+             " empty, the tool uses a small built-in set of basic blocks."));
+cl::list<int> batch_sizes(
+    "gematria_batch_sizes", cl::CommaSeparated, cl::value_desc("num_blocks"),
+    cl::desc("The numbers of basic blocks per batch to benchmark. Defaults to"
+             " 1,10,100."));
+cl::list<int> thread_counts(
+    "gematria_thread_counts", cl::CommaSeparated,
+    cl::value_desc("num_threads"),
+    cl::desc("The numbers of interpreter threads to benchmark. Defaults to"
+             " 1."));
+cl::opt<int> num_batches(
+    "gematria_num_batches", cl::init(100), cl::value_desc("num_batches"),
+    cl::desc("The number of measured batches for each configuration."));
+cl::opt<int> num_warmup_batches(
+    "gematria_num_warmup_batches", cl::init(5), cl::value_desc("num_batches"),
+    cl::desc("The number of batches evaluated before the measurement for each"
+             " configuration. The warm-up batches let the interpreter allocate"
+             " its tensors and fill the caches."));
+
+// Basic blocks used when no input file is given. Each block is valid x86-64
+// code without control flow instructions, and uses only tokens known to the
+// models trained on BHive.
+constexpr const char* kBuiltinHexBlocks[] = {
+    // add rax, rbx
+    "4801d8",
+    // mov rsi, rbx; mov rdx, rax; mov rdi, r15
+    "4889de4889c24c89ff",
+    // mov rax, qword ptr [rdi]; add rax, qword ptr [rdi + 8]
+    "488b0748034708",
+    // mulsd xmm0, xmm1; addsd xmm0, xmm2
+    "f20f59c1f20f58c2",
+    // lea r9, [rdi + 2*rcx]; add r8, r9
+    "4c8d0c4f4d01c8",
+    // mov ecx, dword ptr [rsp + 8]; add ecx, r8d
+    "8b4c24084103c8",
+};
+
+// The stages of the inference measured by the tool. The values are indices
+// into StageTimes::batch_seconds.
+enum Stage {
+  kHexDecode,
+  kDisassembly,
+  kCanonicalization,
+  kGraphBuild,
+  kInference,
+  kEndToEnd,
+  kNumStages,
+};
+
+constexpr const char* kStageNames[kNumStages] = {
+    "hex_decode",      "disassembly", "canonicalization",
+    "graph_build",     "inference",   "end_to_end",
+};
+
+using Clock = std::chrono::steady_clock;
+
+double SecondsSince(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Returns the value at `quantile` of `values` using the nearest-rank method.
+// Reorders `values`; expects that `values` is not empty.
+double Percentile(std::vector<double>& values, double quantile) {
+  const size_t rank = std::min(
+      values.size() - 1, static_cast<size_t>(quantile * values.size()));
+  std::nth_element(values.begin(), values.begin() + rank, values.end());
+  return values[rank];
+}
+
+// The time spent in each stage by each measured batch of one configuration.
+struct StageTimes {
+  std::vector<double> batch_seconds[kNumStages];
+  int64_t num_blocks = 0;
+};
+
+llvm::Expected<std::vector<std::string>> ReadHexBlocks() {
+  if (basic_block_hex_file.empty()) {
+    return std::vector<std::string>(std::begin(kBuiltinHexBlocks),
+                                    std::end(kBuiltinHexBlocks));
+  }
+  std::ifstream hex_file(basic_block_hex_file);
+  if (!hex_file.is_open()) {
+    return llvm::createStringError(llvm::errc::io_error,
+                                   "Could not open the basic block file: %s",
+                                   basic_block_hex_file.c_str());
+  }
+  std::vector<std::string> hex_blocks;
+  std::string line;
+  while (std::getline(hex_file, line)) {
+    StripAsciiWhitespace(&line);
+    if (!line.empty()) hex_blocks.push_back(line);
+  }
+  if (hex_blocks.empty()) {
+    return llvm::createStringError(llvm::errc::invalid_argument,
+                                   "The basic block file is empty.");
+  }
+  return hex_blocks;
+}
+
+// Evaluates `num_warmup_batches + num_batches` batches of `batch_size` blocks
+// from `hex_blocks` with `num_threads` interpreter threads, and returns the
+// times of the measured batches.
+llvm::Expected<StageTimes> RunConfiguration(
+    const LlvmArchitectureSupport& llvm_support,
+    const tflite::FlatBufferModel& model,
+    const std::vector<std::string>& hex_blocks, int batch_size,
+    int num_threads) {
+  GraphBuilderModelInferenceOptions options;
+  options.num_threads = num_threads;
+  options.batch_budget.max_blocks = batch_size;
+  llvm::Expected<std::unique_ptr<GraphBuilderModelInference>> inference =
+      GraphBuilderModelInference::FromTfLiteModel(&model, options);
+  if (llvm::Error error = inference.takeError()) return error;
+
+  X86Canonicalizer canonicalizer(&llvm_support.target_machine());
+  // The buffers are reused across blocks, the same way as in the inference
+  // tool.
+  BasicBlock block;
+  HexStringBatch machine_code;
+  std::vector<DisassembledInstruction> disassembled_instructions;
+
+  StageTimes times;
+  size_t next_block = 0;
+  for (int batch = 0; batch < num_warmup_batches + num_batches; ++batch) {
+    double stage_seconds[kNumStages] = {};
+    const Clock::time_point batch_start = Clock::now();
+    int num_blocks_in_batch = 0;
+    while (num_blocks_in_batch < batch_size) {
+      const std::string& hex_block = hex_blocks[next_block];
+      next_block = (next_block + 1) % hex_blocks.size();
+
+      Clock::time_point start = Clock::now();
+      machine_code.Clear();
+      if (!machine_code.Add(hex_block)) {
+        return llvm::createStringError(llvm::errc::invalid_argument,
+                                       "Can't parse input line: %s",
+                                       hex_block.c_str());
+      }
+      stage_seconds[kHexDecode] += SecondsSince(start);
+
+      start = Clock::now();
+      if (llvm::Error error = DisassembleAllInstructions(
+              llvm_support.mc_disassembler(), llvm_support.mc_instr_info(),
+              llvm_support.mc_register_info(),
+              llvm_support.mc_subtarget_info(), /*printer=*/nullptr, 0,
+              llvm::ArrayRef<uint8_t>(machine_code.data(0),
+                                      machine_code.size(0)),
+              disassembled_instructions)) {
+        return error;
+      }
+      stage_seconds[kDisassembly] += SecondsSince(start);
+
+      start = Clock::now();
+      block.instructions.resize(disassembled_instructions.size());
+      for (size_t i = 0; i < disassembled_instructions.size(); ++i) {
+        canonicalizer.InstructionFromMCInst(
+            disassembled_instructions[i].mc_inst, block.instructions[i]);
+      }
+      stage_seconds[kCanonicalization] += SecondsSince(start);
+
+      start = Clock::now();
+      const GraphBuilderModelInference::AddBasicBlockResult result =
+          (*inference)->TryAddBasicBlockToBatch(block);
+      stage_seconds[kGraphBuild] += SecondsSince(start);
+      if (result ==
+          GraphBuilderModelInference::AddBasicBlockResult::kInvalidBlock) {
+        return llvm::createStringError(llvm::errc::invalid_argument,
+                                       "Invalid basic block: %s",
+                                       hex_block.c_str());
+      }
+      // The budget allows exactly `batch_size` blocks, so the batch can't be
+      // full before the loop ends.
+      ++num_blocks_in_batch;
+    }
+
+    const Clock::time_point start = Clock::now();
+    llvm::Expected<std::vector<GraphBuilderModelInference::OutputType>>
+        predictions = (*inference)->RunInference();
+    if (llvm::Error error = predictions.takeError()) return error;
+    stage_seconds[kInference] = SecondsSince(start);
+    (*inference)->Reset();
+    stage_seconds[kEndToEnd] = SecondsSince(batch_start);
+
+    if (batch < num_warmup_batches) continue;
+    for (int stage = 0; stage < kNumStages; ++stage) {
+      times.batch_seconds[stage].push_back(stage_seconds[stage]);
+    }
+    times.num_blocks += num_blocks_in_batch;
+  }
+  return times;
+}
+
+void PrintResults(int batch_size, int num_threads, StageTimes& times) {
+  for (int stage = 0; stage < kNumStages; ++stage) {
+    std::vector<double>& seconds = times.batch_seconds[stage];
+    double total_seconds = 0;
+    for (const double value : seconds) total_seconds += value;
+    const double blocks_per_second =
+        total_seconds > 0 ? times.num_blocks / total_seconds : 0;
+    const double p50_us = Percentile(seconds, 0.5) * 1e6;
+    const double p99_us = Percentile(seconds, 0.99) * 1e6;
+    std::cout << batch_size << "," << num_threads << "," << kStageNames[stage]
+              << "," << p50_us << "," << p99_us << "," << blocks_per_second
+              << std::endl;
+  }
+}
+
+llvm::Error RunBenchmarksFromCommandLineFlags() {
+  if (num_batches <= 0) {
+    return llvm::createStringError(llvm::errc::invalid_argument,
+                                   "--gematria_num_batches must be positive.");
+  }
+  std::vector<int> batch_size_values(batch_sizes.begin(), batch_sizes.end());
+  if (batch_size_values.empty()) batch_size_values = {1, 10, 100};
+  std::vector<int> thread_count_values(thread_counts.begin(),
+                                       thread_counts.end());
+  if (thread_count_values.empty()) thread_count_values = {1};
+  for (const int batch_size : batch_size_values) {
+    if (batch_size <= 0) {
+      return llvm::createStringError(llvm::errc::invalid_argument,
+                                     "Batch sizes must be positive.");
+    }
+  }
+
+  constexpr char kLlvmTriple[] = "x86_64-unknown-unknown";
+  llvm::Expected<std::unique_ptr<LlvmArchitectureSupport>> llvm_support =
+      LlvmArchitectureSupport::FromTriple(kLlvmTriple, "", "");
+  if (llvm::Error error = llvm_support.takeError()) return error;
+
+  const std::unique_ptr<tflite::FlatBufferModel> model =
+      tflite::FlatBufferModel::BuildFromFile(tflite_file.c_str());
+  if (model == nullptr) {
+    return llvm::createStringError(llvm::errc::io_error,
+                                   "Could not load the TfLite model.");
+  }
+  llvm::Expected<std::vector<std::string>> hex_blocks = ReadHexBlocks();
+  if (llvm::Error error = hex_blocks.takeError()) return error;
+
+  std::cout << "batch_size,num_threads,stage,p50_us,p99_us,blocks_per_second"
+            << std::endl;
+  for (const int batch_size : batch_size_values) {
+    for (const int num_threads : thread_count_values) {
+      llvm::Expected<StageTimes> times = RunConfiguration(
+          **llvm_support, *model, *hex_blocks, batch_size, num_threads);
+      if (llvm::Error error = times.takeError()) return error;
+      PrintResults(batch_size, num_threads, *times);
+    }
+  }
+  return llvm::Error::success();
+}
+
+}  // namespace
+}  // namespace gematria
+
+int main(int argc, char* argv[]) {
+  llvm::cl::ParseCommandLineOptions(argc, argv);
+  llvm::Error error = gematria::RunBenchmarksFromCommandLineFlags();
+  if (error) {
+    llvm::errs() << error;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,330 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Evaluates a Gematria model on a data set of basic blocks with known inverse
+// throughputs, and prints the error metrics of its predictions. This is a
+// native replacement of running the model from Python and collecting the
+// metrics with the TensorFlow loss code: the blocks are streamed from the
+// input, disassembled on a pool of parser threads, and evaluated in batches on
+// a pool of TensorFlow Lite interpreters.
+//
+// Typical usage:
+//   llvm-granite-eval \
+//     --gematria_tflite_file models/granite_model.tflite \
+//     --gematria_input_csv bhive/skl.csv \
+//     --gematria_throughput_scaling 0.01 \
+//     --gematria_collected_percentile_ranks 50,90,95,99
+//
+// The input is a CSV file in the BHive format: each line contains the machine
+// code of a basic block as a hex string and its inverse throughput in cycles.
+// For models with more than one task, --gematria_throughput_column_indices
+// lists the columns with the expected values of the tasks, in the order of the
+// tasks.
+//
+// The metrics are the same as the ones reported by ModelBase during training
+// (see gematria/model/python/loss_utils.py): the mean absolute and squared
+// errors, the mean absolute and squared percentage errors, and the requested
+// percentiles of the absolute and absolute percentage errors. They are printed
+// to stdout, one line per task and metric group.
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <istream>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/granite/graph_builder.h"
+#include "gematria/granite/graph_builder_model_inference.h"
+#include "gematria/granite/graph_builder_model_inference_pool.h"
+#include "gematria/granite/hex_basic_block_parser.h"
+#include "gematria/granite/prediction_error_stats.h"
+#include "gematria/llvm/llvm_architecture_support.h"
+#include "gematria/utils/string.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/raw_ostream.h"
+#include "tensorflow/lite/model_builder.h"
+
+namespace gematria {
+namespace {
+
+namespace cl = llvm::cl;
+
+cl::opt<std::string> tflite_file(
+    "gematria_tflite_file", cl::value_desc("tflite_file"),
+    cl::desc("The path to the .tflite file that contains the trained model."));
+cl::opt<std::string> input_csv(
+    "gematria_input_csv", cl::value_desc("csv_file"),
+    cl::desc("The BHive CSV file with the basic blocks and their inverse"
+             " throughputs. Use '-' to read from stdin."));
+cl::opt<int> machine_code_hex_column_index(
+    "gematria_machine_code_hex_column_index", cl::init(0),
+    cl::value_desc("column_index"),
+    cl::desc("The index of the machine code hex column in the input CSV."));
+cl::list<int> throughput_column_indices(
+    "gematria_throughput_column_indices", cl::CommaSeparated,
+    cl::value_desc("column_indices"),
+    cl::desc("The indices of the columns with the expected inverse throughputs"
+             " in the input CSV, one per task of the model. Defaults to 1."));
+cl::opt<double> throughput_scaling(
+    "gematria_throughput_scaling", cl::init(1.0), cl::value_desc("scaling"),
+    cl::desc("The scaling coefficient applied to the throughput values from"
+             " the CSV file."));
+cl::list<int> collected_percentile_ranks(
+    "gematria_collected_percentile_ranks", cl::CommaSeparated,
+    cl::value_desc("ranks"),
+    cl::desc("The percentile ranks of the absolute and absolute percentage"
+             " errors reported by the tool."));
+cl::opt<int> batch_size(
+    "gematria_batch_size", cl::init(256), cl::value_desc("num_blocks"),
+    cl::desc("The number of basic blocks evaluated in one batch."));
+cl::opt<int> num_workers(
+    "gematria_num_workers",
+    cl::init(
+        static_cast<int>(std::max(1u, std::thread::hardware_concurrency()))),
+    cl::value_desc("num_workers"),
+    cl::desc("The number of batches evaluated concurrently, each with its own"
+             " TensorFlow Lite interpreter."));
+cl::opt<int> num_parser_threads(
+    "gematria_num_parser_threads", cl::init(1), cl::value_desc("num_threads"),
+    cl::desc("The number of threads that disassemble and canonicalize the"
+             " input blocks."));
+cl::opt<int> num_threads(
+    "gematria_num_threads", cl::init(1), cl::value_desc("num_threads"),
+    cl::desc("The number of threads used by each TensorFlow Lite interpreter."
+             " When -1, the interpreters use their default number of"
+             " threads."));
+cl::opt<GraphBuilderModelInferenceOptions::Delegate> delegate(
+    "gematria_delegate",
+    cl::init(GraphBuilderModelInferenceOptions::Delegate::kNone),
+    cl::desc("The TensorFlow Lite delegate used to run the model."),
+    cl::values(clEnumValN(GraphBuilderModelInferenceOptions::Delegate::kNone,
+                          "none", "Run all ops with the built-in kernels."),
+               clEnumValN(GraphBuilderModelInferenceOptions::Delegate::kXnnPack,
+                          "xnnpack", "Run supported ops with XNNPACK.")));
+cl::opt<LiveInfoMode> live_info_mode(
+    "gematria_live_info_mode", cl::init(LiveInfoMode::kNoLiveInfo),
+    cl::desc("The live-info mode of the model. Basic blocks parsed from"
+             " machine code have no live info, so the default skips the"
+             " interference edges entirely."),
+    cl::values(clEnumValN(LiveInfoMode::kNoLiveInfo, "none",
+                          "The model does not use live info."),
+               clEnumValN(LiveInfoMode::kPerBasicBlockLiveInfo, "per_bb",
+                          "The model uses per-basic block live info."),
+               clEnumValN(LiveInfoMode::kPerFunctionLiveInfo, "per_func",
+                          "The model uses per-function live info.")));
+
+// The errors collected from one batch.
+struct BatchResult {
+  PredictionErrorStats stats;
+  // The number of blocks that could not be added to the batch, e.g. because
+  // they contain tokens that are not in the vocabulary of the model.
+  int64_t num_invalid_blocks = 0;
+};
+
+// Waits for the blocks of the batch from the parser pool, evaluates them on
+// `pool`, and collects the errors of the predictions. `expected_outputs`
+// contains the expected values of all tasks for the first block, followed by
+// the values for the second block, etc.
+llvm::Expected<BatchResult> EvaluateBatch(
+    GraphBuilderModelInferencePool& pool,
+    std::future<HexBasicBlockParserPool::Result> parsed_blocks,
+    const std::vector<double>& expected_outputs, int num_tasks,
+    const std::vector<int>& percentile_ranks) {
+  HexBasicBlockParserPool::Result blocks = parsed_blocks.get();
+  if (llvm::Error error = blocks.takeError()) return std::move(error);
+  llvm::Expected<
+      std::vector<std::optional<GraphBuilderModelInference::OutputType>>>
+      predictions = pool.RunInference(*blocks);
+  if (llvm::Error error = predictions.takeError()) return std::move(error);
+
+  BatchResult result{PredictionErrorStats(percentile_ranks)};
+  const llvm::ArrayRef<double> all_expected_outputs(expected_outputs);
+  for (size_t i = 0; i < predictions->size(); ++i) {
+    const std::optional<GraphBuilderModelInference::OutputType>& prediction =
+        (*predictions)[i];
+    if (!prediction.has_value()) {
+      ++result.num_invalid_blocks;
+      continue;
+    }
+    if (llvm::Error error = result.stats.Add(
+            *prediction, all_expected_outputs.slice(i * num_tasks, num_tasks)))
+      return std::move(error);
+  }
+  return result;
+}
+
+llvm::Error EvaluateModelFromCommandLineFlags() {
+  std::vector<int> column_indices(throughput_column_indices.begin(),
+                                  throughput_column_indices.end());
+  if (column_indices.empty()) column_indices.push_back(1);
+  const int num_tasks = static_cast<int>(column_indices.size());
+  const std::vector<int> percentile_ranks(collected_percentile_ranks.begin(),
+                                          collected_percentile_ranks.end());
+  for (const int rank : percentile_ranks) {
+    if (rank < 0 || rank > 100) {
+      return llvm::createStringError(llvm::errc::invalid_argument,
+                                     "Invalid percentile rank: %d", rank);
+    }
+  }
+  if (batch_size <= 0) {
+    return llvm::createStringError(llvm::errc::invalid_argument,
+                                   "The batch size must be positive.");
+  }
+
+  constexpr char kLlvmTriple[] = "x86_64-unknown-unknown";
+  llvm::Expected<std::unique_ptr<LlvmArchitectureSupport>> llvm_support =
+      LlvmArchitectureSupport::FromTriple(kLlvmTriple, "", "");
+  if (llvm::Error error = llvm_support.takeError()) return error;
+
+  const std::unique_ptr<tflite::FlatBufferModel> model =
+      tflite::FlatBufferModel::BuildFromFile(tflite_file.c_str());
+  if (model == nullptr) {
+    return llvm::createStringError(llvm::errc::io_error,
+                                   "Could not load the TfLite model.");
+  }
+  GraphBuilderModelInferenceOptions options;
+  options.num_threads = num_threads;
+  options.delegate = delegate;
+  options.live_info_mode = live_info_mode;
+  llvm::Expected<std::unique_ptr<GraphBuilderModelInferencePool>> pool =
+      GraphBuilderModelInferencePool::FromTfLiteModel(model.get(), num_workers,
+                                                      options);
+  if (llvm::Error error = pool.takeError()) return error;
+  HexBasicBlockParserPool parser_pool(**llvm_support, num_parser_threads);
+
+  // The batches that are being evaluated, in the order of the input. Keeping
+  // two batches per worker in flight lets the parsers and the interpreters
+  // work in parallel with reading the input.
+  std::deque<std::future<llvm::Expected<BatchResult>>> pending_batches;
+  const size_t max_batches_in_flight = 2 * (*pool)->num_workers();
+  PredictionErrorStats stats(percentile_ranks);
+  int64_t num_invalid_blocks = 0;
+  const auto merge_oldest_pending_batch = [&]() -> llvm::Error {
+    llvm::Expected<BatchResult> result = pending_batches.front().get();
+    pending_batches.pop_front();
+    if (llvm::Error error = result.takeError()) return error;
+    num_invalid_blocks += result->num_invalid_blocks;
+    return stats.Merge(result->stats);
+  };
+
+  std::vector<std::string> hex_strings;
+  std::vector<double> expected_outputs;
+  const auto submit_batch = [&]() -> llvm::Error {
+    std::future<HexBasicBlockParserPool::Result> parsed_blocks =
+        parser_pool.ParseAsync(std::move(hex_strings));
+    hex_strings.clear();
+    pending_batches.push_back(std::async(
+        std::launch::async,
+        [&pool, &percentile_ranks, num_tasks,
+         parsed_blocks = std::move(parsed_blocks),
+         expected_outputs = std::move(expected_outputs)]() mutable {
+          return EvaluateBatch(**pool, std::move(parsed_blocks),
+                               expected_outputs, num_tasks, percentile_ranks);
+        }));
+    expected_outputs.clear();
+    while (pending_batches.size() >= max_batches_in_flight) {
+      if (llvm::Error error = merge_oldest_pending_batch()) return error;
+    }
+    return llvm::Error::success();
+  };
+
+  std::ifstream csv_file;
+  std::istream* input = &std::cin;
+  if (input_csv != "-") {
+    csv_file.open(input_csv);
+    if (!csv_file.is_open()) {
+      return llvm::createStringError(llvm::errc::io_error,
+                                     "Could not open the input file: %s",
+                                     input_csv.c_str());
+    }
+    input = &csv_file;
+  }
+  std::string line;
+  int64_t line_number = 0;
+  while (std::getline(*input, line)) {
+    ++line_number;
+    StripAsciiWhitespace(&line);
+    if (line.empty()) continue;
+    const std::vector<std::string> columns = StrSplitAsCopy(line, ',');
+    const auto get_column = [&](int index) -> llvm::Expected<std::string> {
+      if (index < 0 || index >= static_cast<int>(columns.size())) {
+        return llvm::createStringError(
+            llvm::errc::invalid_argument,
+            "Line %lld does not have column %d: %s",
+            static_cast<long long>(line_number), index, line.c_str());
+      }
+      return columns[index];
+    };
+    llvm::Expected<std::string> hex_string =
+        get_column(machine_code_hex_column_index);
+    if (llvm::Error error = hex_string.takeError()) return error;
+    hex_strings.push_back(std::move(*hex_string));
+    for (const int column_index : column_indices) {
+      llvm::Expected<std::string> column = get_column(column_index);
+      if (llvm::Error error = column.takeError()) return error;
+      double throughput = 0;
+      if (llvm::StringRef(*column).trim().getAsDouble(throughput)) {
+        return llvm::createStringError(
+            llvm::errc::invalid_argument,
+            "Invalid inverse throughput on line %lld: %s",
+            static_cast<long long>(line_number), column->c_str());
+      }
+      expected_outputs.push_back(throughput * throughput_scaling);
+    }
+    if (hex_strings.size() >= static_cast<size_t>(batch_size)) {
+      if (llvm::Error error = submit_batch()) return error;
+    }
+  }
+  if (!hex_strings.empty()) {
+    if (llvm::Error error = submit_batch()) return error;
+  }
+  while (!pending_batches.empty()) {
+    if (llvm::Error error = merge_oldest_pending_batch()) return error;
+  }
+
+  std::cout << "Evaluated " << stats.num_blocks() << " blocks, skipped "
+            << num_invalid_blocks << " invalid blocks.\n";
+  std::cout << FormatTaskErrorStats(stats.GetTaskStats(),
+                                    stats.percentile_ranks());
+  return llvm::Error::success();
+}
+
+}  // namespace
+}  // namespace gematria
+
+int main(int argc, char* argv[]) {
+  llvm::cl::ParseCommandLineOptions(argc, argv);
+  std::ios::sync_with_stdio(false);
+  llvm::Error error = gematria::EvaluateModelFromCommandLineFlags();
+  if (error) {
+    llvm::errs() << error;
+    return 1;
+  }
+  return 0;
+}
@@ -17,26 +17,52 @@
 // Typical usage:
 //   graph_builder_model_inference_main \
 //     --gematria_tflite_file models/granite_model.tflite \
-//     --gematria_basic_block_hex_file /dev/stdin
+//     --gematria_basic_block_hex_file -
+//
+// The input is streamed: the blocks are disassembled and canonicalized in
+// chunks on --gematria_num_parser_threads worker threads while the main thread
+// feeds the parsed blocks to the model, and the output is buffered and printed
+// in the order of the input.
+//
+// With --gematria_reference_tflite_file, the tool also evaluates the blocks
+// with a reference model, typically the float32 version of a quantized model,
+// and prints the differences between the predictions of the two models to
+// stderr.
+//
+// With --gematria_server_socket, the tool instead keeps the model loaded and
+// serves requests from other processes on a Unix domain socket; see
+// graph_builder_model_inference_server.h for the protocol.
 
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <deque>
 #include <fstream>
+#include <future>
 #include <iostream>
+#include <istream>
 #include <limits>
 #include <memory>
+#include <optional>
 #include <ostream>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include "gematria/basic_block/basic_block.h"
+#include "gematria/granite/graph_builder.h"
 #include "gematria/granite/graph_builder_model_inference.h"
-#include "gematria/llvm/canonicalizer.h"
-#include "gematria/llvm/disassembler.h"
+#include "gematria/granite/graph_builder_model_inference_batcher.h"
+#include "gematria/granite/graph_builder_model_inference_pipeline.h"
+#include "gematria/granite/graph_builder_model_inference_pool.h"
+#include "gematria/granite/graph_builder_model_inference_server.h"
+#include "gematria/granite/hex_basic_block_parser.h"
 #include "gematria/llvm/llvm_architecture_support.h"
 #include "gematria/utils/string.h"
-#include "llvm/MC/MCContext.h"
-#include "llvm/MC/MCInst.h"
-#include "llvm/MC/MCInstPrinter.h"
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Errc.h"
 #include "llvm/Support/Error.h"
@@ -51,16 +77,105 @@ namespace cl = llvm::cl;
 cl::opt<std::string> tflite_file(
     "gematria_tflite_file", cl::value_desc("tflite_file"),
     cl::desc("The path to the .tflite file that contains the trained model."));
+cl::opt<std::string> reference_tflite_file(
+    "gematria_reference_tflite_file", cl::value_desc("tflite_file"),
+    cl::desc("The path to a .tflite file with a reference model. When set, the"
+             " blocks are also evaluated with the reference model, and the"
+             " differences between the predictions are printed to stderr."));
 cl::opt<std::string> basic_block_hex_file(
     "gematria_basic_block_hex_file", cl::value_desc("hex_file"),
     cl::desc(
         "The file from which the tool reads basic blocks in the hex format used"
-        " in the BHive data set, one basic block per line."));
+        " in the BHive data set, one basic block per line. Use '-' to read"
+        " from stdin."));
+cl::opt<int> num_parser_threads(
+    "gematria_num_parser_threads", cl::init(1), cl::value_desc("num_threads"),
+    cl::desc("The number of threads that disassemble and canonicalize the"
+             " input blocks, in addition to the thread running the model."));
 cl::opt<int> max_blocks_per_batch(
     "gematria_max_blocks_per_batch", cl::init(std::numeric_limits<int>::max()),
     cl::value_desc("num_blocks"),
     cl::desc("The maximal number of blocks per batch. When non-positive, all"
              " blocks are put into the same batch."));
+cl::opt<int> max_nodes_per_batch(
+    "gematria_max_nodes_per_batch", cl::init(-1), cl::value_desc("num_nodes"),
+    cl::desc("The maximal number of graph nodes per batch. When non-positive,"
+             " the number of nodes is not limited."));
+cl::opt<int> max_edges_per_batch(
+    "gematria_max_edges_per_batch", cl::init(-1), cl::value_desc("num_edges"),
+    cl::desc("The maximal number of graph edges per batch. When non-positive,"
+             " the number of edges is not limited."));
+cl::opt<int64_t> max_input_bytes_per_batch(
+    "gematria_max_input_bytes_per_batch", cl::init(-1),
+    cl::value_desc("bytes"),
+    cl::desc("The maximal size of the input tensors of a batch in bytes. When"
+             " non-positive, the size is not limited."));
+cl::opt<bool> deduplicate_blocks(
+    "gematria_deduplicate_blocks", cl::init(false),
+    cl::desc("Evaluate basic blocks that appear multiple times in a batch only"
+             " once."));
+cl::opt<bool> shape_bucketing(
+    "gematria_shape_bucketing", cl::init(false),
+    cl::desc("Pad each batch so that the shapes of the input tensors are"
+             " rounded up to --gematria_shape_bucket_sizes. The interpreter"
+             " then re-plans its memory only when a batch crosses a bucket"
+             " boundary. The predictions do not change."));
+cl::list<int> shape_bucket_sizes(
+    "gematria_shape_bucket_sizes", cl::CommaSeparated, cl::value_desc("sizes"),
+    cl::desc("The bucket sizes used with --gematria_shape_bucketing. Sizes"
+             " larger than all buckets, or all sizes when empty, are rounded"
+             " up to a power of two."));
+cl::opt<bool> print_batch_stats(
+    "gematria_print_batch_stats", cl::init(false),
+    cl::desc("Print the peak size of the tensor memory of the interpreter to"
+             " stderr after processing all blocks."));
+cl::opt<int> num_threads(
+    "gematria_num_threads", cl::init(-1), cl::value_desc("num_threads"),
+    cl::desc("The number of threads used by the TensorFlow Lite interpreter."
+             " When -1, the interpreter uses its default number of threads."));
+cl::opt<GraphBuilderModelInferenceOptions::Delegate> delegate(
+    "gematria_delegate",
+    cl::init(GraphBuilderModelInferenceOptions::Delegate::kNone),
+    cl::desc("The TensorFlow Lite delegate used to run the model."),
+    cl::values(clEnumValN(GraphBuilderModelInferenceOptions::Delegate::kNone,
+                          "none", "Run all ops with the built-in kernels."),
+               clEnumValN(GraphBuilderModelInferenceOptions::Delegate::kXnnPack,
+                          "xnnpack", "Run supported ops with XNNPACK.")));
+cl::opt<LiveInfoMode> live_info_mode(
+    "gematria_live_info_mode", cl::init(LiveInfoMode::kNoLiveInfo),
+    cl::desc("The live-info mode of the model. Basic blocks parsed from"
+             " machine code have no live info, so the default skips the"
+             " interference edges entirely."),
+    cl::values(clEnumValN(LiveInfoMode::kNoLiveInfo, "none",
+                          "The model does not use live info."),
+               clEnumValN(LiveInfoMode::kPerBasicBlockLiveInfo, "per_bb",
+                          "The model uses per-basic block live info."),
+               clEnumValN(LiveInfoMode::kPerFunctionLiveInfo, "per_func",
+                          "The model uses per-function live info.")));
+cl::opt<bool> allow_delegate_fallback(
+    "gematria_allow_delegate_fallback", cl::init(true),
+    cl::desc("Use the built-in kernels when the delegate is not available or"
+             " can't be applied to the model, instead of failing."));
+cl::opt<std::string> server_socket(
+    "gematria_server_socket", cl::value_desc("socket_path"),
+    cl::desc("When set, the tool runs as a server on a Unix domain socket at"
+             " this path instead of reading --gematria_basic_block_hex_file."));
+cl::opt<int> server_num_workers(
+    "gematria_server_num_workers",
+    cl::init(
+        static_cast<int>(std::max(1u, std::thread::hardware_concurrency()))),
+    cl::value_desc("num_workers"),
+    cl::desc("The number of batches the server runs concurrently."));
+cl::opt<int> server_max_blocks_per_batch(
+    "gematria_server_max_blocks_per_batch", cl::init(256),
+    cl::value_desc("num_blocks"),
+    cl::desc("The maximal number of requests the server coalesces into one"
+             " batch."));
+cl::opt<int> server_max_batch_delay_us(
+    "gematria_server_max_batch_delay_us", cl::init(1000),
+    cl::value_desc("microseconds"),
+    cl::desc("The maximal time a request waits for other requests before the"
+             " server starts its batch."));
 
 void PrintPredictionsToStdout(
     const GraphBuilderModelInference::OutputType& predictions) {
@@ -70,6 +185,99 @@ void PrintPredictionsToStdout(
   }
 }
 
+// Evaluates `blocks` with the model from --gematria_reference_tflite_file, and
+// prints the mean and the maximal absolute and relative differences between
+// its predictions and `predictions` to stderr, separately for each task.
+llvm::Error PrintDeltasFromReferenceModel(
+    const GraphBuilderModelInferenceOptions& options,
+    llvm::ArrayRef<BasicBlock> blocks,
+    llvm::ArrayRef<GraphBuilderModelInference::OutputType> predictions) {
+  assert(blocks.size() == predictions.size());
+  const std::unique_ptr<tflite::FlatBufferModel> model =
+      tflite::FlatBufferModel::BuildFromFile(reference_tflite_file.c_str());
+  if (model == nullptr) {
+    return llvm::createStringError(
+        llvm::errc::io_error, "Could not load the reference TfLite model.");
+  }
+  llvm::Expected<std::unique_ptr<GraphBuilderModelInference>> inference =
+      GraphBuilderModelInference::FromTfLiteModel(model.get(), options);
+  if (llvm::Error error = inference.takeError()) return error;
+  llvm::Expected<
+      std::vector<std::optional<GraphBuilderModelInference::OutputType>>>
+      reference_predictions = (*inference)->RunInferenceInBatches(blocks);
+  if (llvm::Error error = reference_predictions.takeError()) return error;
+
+  struct TaskDeltas {
+    double sum_absolute = 0;
+    double max_absolute = 0;
+    double sum_relative = 0;
+    double max_relative = 0;
+  };
+  std::vector<TaskDeltas> deltas;
+  int num_compared_blocks = 0;
+  for (size_t i = 0; i < predictions.size(); ++i) {
+    const std::optional<GraphBuilderModelInference::OutputType>& reference =
+        (*reference_predictions)[i];
+    if (!reference.has_value()) continue;
+    if (reference->size() != predictions[i].size()) {
+      return llvm::createStringError(
+          llvm::errc::invalid_argument,
+          "The reference model has a different number of tasks.");
+    }
+    deltas.resize(reference->size());
+    ++num_compared_blocks;
+    for (size_t task = 0; task < reference->size(); ++task) {
+      const double absolute =
+          std::abs(double{predictions[i][task]} - (*reference)[task]);
+      const double relative =
+          (*reference)[task] == 0 ? 0 : absolute / std::abs((*reference)[task]);
+      TaskDeltas& task_deltas = deltas[task];
+      task_deltas.sum_absolute += absolute;
+      task_deltas.max_absolute = std::max(task_deltas.max_absolute, absolute);
+      task_deltas.sum_relative += relative;
+      task_deltas.max_relative = std::max(task_deltas.max_relative, relative);
+    }
+  }
+
+  std::cerr << "Compared " << num_compared_blocks
+            << " blocks with the reference model.\n";
+  if (num_compared_blocks == 0) return llvm::Error::success();
+  for (size_t task = 0; task < deltas.size(); ++task) {
+    const TaskDeltas& task_deltas = deltas[task];
+    std::cerr << "Task " << task << ": mean absolute delta "
+              << task_deltas.sum_absolute / num_compared_blocks
+              << ", max absolute delta " << task_deltas.max_absolute
+              << ", mean relative delta "
+              << task_deltas.sum_relative / num_compared_blocks
+              << ", max relative delta " << task_deltas.max_relative << "\n";
+  }
+  return llvm::Error::success();
+}
+
+// Runs the inference server until a client shuts it down.
+llvm::Error RunServerFromCommandLineFlags(
+    const LlvmArchitectureSupport& llvm_support,
+    const tflite::FlatBufferModel* model,
+    const GraphBuilderModelInferenceOptions& options) {
+  llvm::Expected<std::unique_ptr<GraphBuilderModelInferencePool>> pool =
+      GraphBuilderModelInferencePool::FromTfLiteModel(
+          model, server_num_workers, options);
+  if (llvm::Error error = pool.takeError()) return error;
+  GraphBuilderModelInferenceBatcherOptions batcher_options;
+  batcher_options.max_blocks_per_batch = server_max_blocks_per_batch;
+  batcher_options.max_batch_delay =
+      std::chrono::microseconds(server_max_batch_delay_us);
+  llvm::Expected<std::unique_ptr<GraphBuilderModelInferenceBatcher>> batcher =
+      GraphBuilderModelInferenceBatcher::Create(pool->get(), batcher_options);
+  if (llvm::Error error = batcher.takeError()) return error;
+  llvm::Expected<std::unique_ptr<GraphBuilderModelInferenceServer>> server =
+      GraphBuilderModelInferenceServer::Create(server_socket, &llvm_support,
+                                               batcher->get());
+  if (llvm::Error error = server.takeError()) return error;
+  std::cerr << "Serving on " << server_socket << "\n";
+  return (*server)->Run();
+}
+
 llvm::Error ProcessBasicBlocksFromCommandLineFlags() {
   constexpr char kLlvmTriple[] = "x86_64-unknown-unknown";
   llvm::Expected<std::unique_ptr<LlvmArchitectureSupport>> llvm_support =
@@ -82,90 +290,173 @@ llvm::Error ProcessBasicBlocksFromCommandLineFlags() {
     return llvm::createStringError(llvm::errc::io_error,
                                    "Could not load the TfLite model.");
   }
-  llvm::Expected<std::unique_ptr<GraphBuilderModelInference>>
-      expected_inference =
-          GraphBuilderModelInference::FromTfLiteModel(model.get());
-  if (llvm::Error error = expected_inference.takeError()) return error;
-  GraphBuilderModelInference& inference = **expected_inference;
-
-  X86Canonicalizer canonicalizer(&(*llvm_support)->target_machine());
+  GraphBuilderModelInferenceOptions options;
+  options.num_threads = num_threads;
+  options.delegate = delegate;
+  options.allow_delegate_fallback = allow_delegate_fallback;
+  // The flags use non-positive values for "no limit"; the budget uses -1.
+  const auto limit_or_none = [](int64_t value) -> int64_t {
+    return value > 0 ? value : -1;
+  };
+  options.batch_budget.max_blocks = limit_or_none(max_blocks_per_batch);
+  options.batch_budget.max_nodes = limit_or_none(max_nodes_per_batch);
+  options.batch_budget.max_edges = limit_or_none(max_edges_per_batch);
+  options.batch_budget.max_input_tensor_bytes =
+      limit_or_none(max_input_bytes_per_batch);
+  options.deduplicate_blocks = deduplicate_blocks;
+  options.live_info_mode = live_info_mode;
+  options.shape_bucketing = shape_bucketing;
+  options.shape_bucket_sizes.assign(shape_bucket_sizes.begin(),
+                                    shape_bucket_sizes.end());
+  if (!server_socket.empty()) {
+    return RunServerFromCommandLineFlags(**llvm_support, model.get(), options);
+  }
+  llvm::Expected<std::unique_ptr<GraphBuilderModelInferencePipeline>>
+      expected_pipeline = GraphBuilderModelInferencePipeline::FromTfLiteModel(
+          model.get(), options);
+  if (llvm::Error error = expected_pipeline.takeError()) return error;
+  GraphBuilderModelInferencePipeline& pipeline = **expected_pipeline;
 
-  std::unique_ptr<llvm::MCInstPrinter> inst_printer =
-      (*llvm_support)->CreateMCInstPrinter(0);
+  HexBasicBlockParserPool parser_pool(**llvm_support, num_parser_threads);
 
-  const auto run_inference_for_batch =
-      [&](const std::vector<BasicBlock>& batch) -> llvm::Error {
-    inference.Reset();
+  // A batch submitted to the pipeline whose predictions were not printed yet.
+  struct PendingBatch {
     std::vector<bool> is_valid_block;
-    is_valid_block.reserve(batch.size());
-    for (const BasicBlock& block : batch) {
-      is_valid_block.push_back(inference.AddBasicBlockToBatch(block));
-      if (!is_valid_block.back()) {
-        std::cerr << "Invalid basic block:\n" << block.ToString() << "\n";
-      }
-    }
-    llvm::Expected<std::vector<GraphBuilderModelInference::OutputType>>
-        predictions = inference.RunInference();
+    std::future<GraphBuilderModelInferencePipeline::BatchResult> predictions;
+  };
+  // The batches are printed in the order of submission. Printing of a batch is
+  // delayed until the next batch is submitted, so that the pipeline can build
+  // the next batch while the model runs on the previous one.
+  std::deque<PendingBatch> pending_batches;
+  std::vector<bool> is_valid_block;
+  // The valid blocks and their predictions, kept for the comparison with the
+  // reference model.
+  const bool compare_with_reference = !reference_tflite_file.empty();
+  std::vector<BasicBlock> valid_blocks;
+  std::vector<GraphBuilderModelInference::OutputType> valid_block_predictions;
+
+  const auto print_oldest_pending_batch = [&]() -> llvm::Error {
+    assert(!pending_batches.empty());
+    PendingBatch batch = std::move(pending_batches.front());
+    pending_batches.pop_front();
+    GraphBuilderModelInferencePipeline::BatchResult predictions =
+        batch.predictions.get();
     if (llvm::Error error = predictions.takeError()) return error;
 
     int prediction_index = 0;
-    for (const bool is_valid : is_valid_block) {
+    for (const bool is_valid : batch.is_valid_block) {
       if (is_valid) {
-        PrintPredictionsToStdout((*predictions)[prediction_index++]);
+        PrintPredictionsToStdout((*predictions)[prediction_index]);
+        if (compare_with_reference) {
+          valid_block_predictions.push_back(
+              std::move((*predictions)[prediction_index]));
+        }
+        ++prediction_index;
       } else {
         std::cout << "Invalid block";
       }
-      std::cout << std::endl;
+      // No std::endl: flushing after each block would dominate the runtime on
+      // large inputs; the output is flushed when the tool exits.
+      std::cout << "\n";
+    }
+    return llvm::Error::success();
+  };
+  const auto submit_batch = [&]() -> llvm::Error {
+    pending_batches.push_back(
+        PendingBatch{std::move(is_valid_block), pipeline.SubmitBatch()});
+    is_valid_block.clear();
+    while (pending_batches.size() >= pipeline.num_buffers()) {
+      if (llvm::Error error = print_oldest_pending_batch()) return error;
     }
     return llvm::Error::success();
   };
 
-  std::vector<BasicBlock> batch;
-
-  std::ifstream hex_file(basic_block_hex_file);
-  while (!hex_file.eof()) {
-    std::string line;
-    std::getline(hex_file, line);
-    StripAsciiWhitespace(&line);
-    if (line.empty()) continue;
-
-    auto machine_code = ParseHexString(line);
-    if (!machine_code.has_value()) {
-      return llvm::createStringError(llvm::errc::invalid_argument,
-                                     "Can't parse input line: %s",
-                                     line.c_str());
+  // The chunks of input lines submitted to the parser pool, in the order of
+  // the input. Keeping two chunks per parser thread in flight lets the parsers
+  // work ahead while the main thread adds the blocks to batches.
+  std::deque<std::future<HexBasicBlockParserPool::Result>> parsed_chunks;
+  const size_t max_chunks_in_flight = 2 * parser_pool.num_threads();
+  // The blocks of the last consumed chunk are sent back to the parser pool with
+  // the next chunk, so that their instructions and operand lists do not need
+  // to be allocated for each block.
+  std::vector<BasicBlock> reusable_blocks;
+  const auto add_oldest_parsed_chunk_to_batch = [&]() -> llvm::Error {
+    assert(!parsed_chunks.empty());
+    HexBasicBlockParserPool::Result blocks = parsed_chunks.front().get();
+    parsed_chunks.pop_front();
+    if (llvm::Error error = blocks.takeError()) return error;
+    for (const BasicBlock& block : *blocks) {
+      GraphBuilderModelInference::AddBasicBlockResult result =
+          pipeline.TryAddBasicBlockToBatch(block);
+      if (result ==
+          GraphBuilderModelInference::AddBasicBlockResult::kBatchFull) {
+        if (llvm::Error error = submit_batch()) return error;
+        result = pipeline.TryAddBasicBlockToBatch(block);
+      }
+      is_valid_block.push_back(
+          result == GraphBuilderModelInference::AddBasicBlockResult::kAdded);
+      if (!is_valid_block.back()) {
+        std::cerr << "Invalid basic block:\n" << block.ToString() << "\n";
+      } else if (compare_with_reference) {
+        valid_blocks.push_back(block);
+      }
     }
+    reusable_blocks = std::move(*blocks);
+    return llvm::Error::success();
+  };
 
-    llvm::Expected<std::vector<DisassembledInstruction>>
-        disassembled_instructions =
-            DisassembleAllInstructions((*llvm_support)->mc_disassembler(),
-                                       (*llvm_support)->mc_instr_info(),
-                                       (*llvm_support)->mc_register_info(),
-                                       (*llvm_support)->mc_subtarget_info(),
-                                       *inst_printer, 0, *machine_code);
-    if (llvm::Error error = disassembled_instructions.takeError()) {
-      return error;
+  std::ifstream hex_file;
+  std::istream* input = &std::cin;
+  if (basic_block_hex_file != "-") {
+    hex_file.open(basic_block_hex_file);
+    if (!hex_file.is_open()) {
+      return llvm::createStringError(llvm::errc::io_error,
+                                     "Could not open the input file: %s",
+                                     basic_block_hex_file.c_str());
     }
-    std::vector<llvm::MCInst> mc_insts;
-    mc_insts.reserve(disassembled_instructions->size());
-    for (const DisassembledInstruction& disassembled_instruction :
-         *disassembled_instructions) {
-      mc_insts.push_back(std::move(disassembled_instruction.mc_inst));
+    input = &hex_file;
+  }
+  constexpr size_t kLinesPerChunk = 256;
+  std::vector<std::string> chunk;
+  std::string line;
+  const auto submit_chunk = [&]() -> llvm::Error {
+    parsed_chunks.push_back(
+        parser_pool.ParseAsync(std::move(chunk), std::move(reusable_blocks)));
+    chunk.clear();
+    reusable_blocks.clear();
+    while (parsed_chunks.size() >= max_chunks_in_flight) {
+      if (llvm::Error error = add_oldest_parsed_chunk_to_batch()) return error;
     }
-
-    if (batch.size() == max_blocks_per_batch) {
-      if (llvm::Error error = run_inference_for_batch(batch)) {
-        return error;
-      }
-      batch.clear();
+    return llvm::Error::success();
+  };
+  while (std::getline(*input, line)) {
+    StripAsciiWhitespace(&line);
+    if (line.empty()) continue;
+    chunk.push_back(std::move(line));
+    if (chunk.size() >= kLinesPerChunk) {
+      if (llvm::Error error = submit_chunk()) return error;
     }
-    batch.push_back(canonicalizer.BasicBlockFromMCInst(mc_insts));
+  }
+  if (!chunk.empty()) {
+    if (llvm::Error error = submit_chunk()) return error;
+  }
+  while (!parsed_chunks.empty()) {
+    if (llvm::Error error = add_oldest_parsed_chunk_to_batch()) return error;
   }
   // Process all remaining blocks.
-  if (!batch.empty()) {
-    if (llvm::Error error = run_inference_for_batch(batch)) {
-      return error;
-    }
+  if (!is_valid_block.empty()) {
+    if (llvm::Error error = submit_batch()) return error;
+  }
+  while (!pending_batches.empty()) {
+    if (llvm::Error error = print_oldest_pending_batch()) return error;
+  }
+  if (print_batch_stats) {
+    std::cerr << "Peak tensor memory: " << pipeline.peak_tensor_memory_bytes()
+              << " bytes\n";
+  }
+  if (compare_with_reference) {
+    return PrintDeltasFromReferenceModel(options, valid_blocks,
+                                         valid_block_predictions);
   }
 
   return llvm::Error::success();
@@ -176,6 +467,9 @@ llvm::Error ProcessBasicBlocksFromCommandLineFlags() {
 
 int main(int argc, char* argv[]) {
   llvm::cl::ParseCommandLineOptions(argc, argv);
+  // The tool reads and writes large amounts of text through std::cin and
+  // std::cout; it does not use the C stdio streams.
+  std::ios::sync_with_stdio(false);
   llvm::Error error = gematria::ProcessBasicBlocksFromCommandLineFlags();
   if (error) {
     llvm::errs() << error;
@@ -0,0 +1,138 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/granite/graph_builder_model_inference_pipeline.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/granite/graph_builder_model_inference.h"
+#include "gematria/granite/graph_builder_model_inference_pool.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/Error.h"
+#include "tensorflow/lite/model_builder.h"
+
+namespace gematria {
+
+llvm::Expected<std::unique_ptr<GraphBuilderModelInferencePipeline>>
+GraphBuilderModelInferencePipeline::FromTfLiteModel(
+    const tflite::FlatBufferModel* tflite_model,
+    const GraphBuilderModelInferenceOptions& options, int num_buffers) {
+  if (num_buffers < 2) {
+    return llvm::createStringError(llvm::errc::invalid_argument,
+                                   "num_buffers must be at least 2, it is %d",
+                                   num_buffers);
+  }
+  llvm::Expected<std::unique_ptr<GraphBuilderModelInferencePool>> pool =
+      GraphBuilderModelInferencePool::FromTfLiteModel(tflite_model,
+                                                      num_buffers, options);
+  if (llvm::Error error = pool.takeError()) return error;
+
+  // We can't use std::make_unique<GraphBuilderModelInferencePipeline>(),
+  // because std::make_unique<>() requires a public constructor.
+  return std::unique_ptr<GraphBuilderModelInferencePipeline>(
+      new GraphBuilderModelInferencePipeline(std::move(*pool)));
+}
+
+GraphBuilderModelInferencePipeline::GraphBuilderModelInferencePipeline(
+    std::unique_ptr<GraphBuilderModelInferencePool> pool)
+    : pool_(std::move(pool)),
+      run_batch_([](GraphBuilderModelInference& inference) {
+        return inference.RunInference();
+      }) {
+  assert(pool_ != nullptr);
+  current_worker_.emplace(pool_->Acquire());
+  inference_thread_ = std::thread([this]() { ProcessJobs(); });
+}
+
+GraphBuilderModelInferencePipeline::~GraphBuilderModelInferencePipeline() {
+  // The lease must be returned before the pool is destroyed.
+  current_worker_.reset();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    shutting_down_ = true;
+  }
+  job_added_.notify_one();
+  inference_thread_.join();
+}
+
+bool GraphBuilderModelInferencePipeline::AddBasicBlockToBatch(
+    const BasicBlock& block) {
+  assert(current_worker_.has_value());
+  return (*current_worker_)->AddBasicBlockToBatch(block);
+}
+
+GraphBuilderModelInference::AddBasicBlockResult
+GraphBuilderModelInferencePipeline::TryAddBasicBlockToBatch(
+    const BasicBlock& block) {
+  assert(current_worker_.has_value());
+  return (*current_worker_)->TryAddBasicBlockToBatch(block);
+}
+
+int64_t GraphBuilderModelInferencePipeline::peak_tensor_memory_bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return peak_tensor_memory_bytes_;
+}
+
+std::future<GraphBuilderModelInferencePipeline::BatchResult>
+GraphBuilderModelInferencePipeline::SubmitBatch() {
+  assert(current_worker_.has_value());
+  std::promise<BatchResult> result;
+  std::future<BatchResult> future = result.get_future();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    jobs_.push_back(Job{std::move(*current_worker_), std::move(result)});
+  }
+  current_worker_.reset();
+  job_added_.notify_one();
+  // This blocks until the inference thread returns one of the workers to the
+  // pool when all of them are in flight.
+  current_worker_.emplace(pool_->Acquire());
+  return future;
+}
+
+void GraphBuilderModelInferencePipeline::ProcessJobs() {
+  while (true) {
+    std::optional<Job> job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      job_added_.wait(lock,
+                      [this]() { return shutting_down_ || !jobs_.empty(); });
+      // Finish all submitted jobs before exiting.
+      if (jobs_.empty()) return;
+      job.emplace(std::move(jobs_.front()));
+      jobs_.pop_front();
+    }
+    BatchResult result = run_batch_(*job->worker);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      peak_tensor_memory_bytes_ =
+          std::max(peak_tensor_memory_bytes_,
+                   job->worker->peak_tensor_memory_bytes());
+    }
+    job->result.set_value(std::move(result));
+    // Destroying the job returns the worker to the pool, where it can be used
+    // for a new batch.
+  }
+}
+
+}  // namespace gematria
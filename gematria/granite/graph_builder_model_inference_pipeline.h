@@ -0,0 +1,161 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BUILDER_MODEL_INFERENCE_PIPELINE_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BUILDER_MODEL_INFERENCE_PIPELINE_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/granite/graph_builder_model_inference.h"
+#include "gematria/granite/graph_builder_model_inference_pool.h"
+#include "llvm/Support/Error.h"
+#include "tensorflow/lite/model_builder.h"
+
+namespace gematria {
+
+// Runs inference with a trained GRANITE model asynchronously, so that building
+// the graphs for one batch overlaps with running the model on the previous
+// batches.
+//
+// The pipeline has `num_buffers` GraphBuilderModelInference objects. The
+// caller adds basic blocks to the batch in one of them; SubmitBatch() hands the
+// batch to a background thread that runs the model, and immediately starts a
+// new batch in another inference object. SubmitBatch() blocks only when all
+// inference objects are busy, i.e. when there are `num_buffers` batches in
+// flight. The batches are processed in the order in which they were submitted.
+//
+// The methods for building and submitting batches are not thread-safe; the
+// pipeline is meant to be fed by a single producer thread. The returned futures
+// can be consumed from any thread.
+//
+// Typical usage:
+//   auto pipeline = GraphBuilderModelInferencePipeline::FromTfLiteModel(
+//       tflite_model.get());
+//   for (const auto& batch : batches) {
+//     for (const BasicBlock& block : batch) {
+//       (*pipeline)->AddBasicBlockToBatch(block);
+//     }
+//     futures.push_back((*pipeline)->SubmitBatch());
+//   }
+//   for (auto& future : futures) {
+//     llvm::Expected<...> predictions = future.get();
+//     ...
+//   }
+class GraphBuilderModelInferencePipeline {
+ public:
+  using OutputType = GraphBuilderModelInference::OutputType;
+  // The result of inference on one batch; the value is the same as the value
+  // returned by GraphBuilderModelInference::RunInference().
+  using BatchResult = llvm::Expected<std::vector<OutputType>>;
+
+  // Creates a pipeline for a model stored in the .tflite format. Returns an
+  // error when the model can't be loaded (see
+  // GraphBuilderModelInference::FromTfLiteModel()) or when `num_buffers` is
+  // smaller than two.
+  // Does not take ownership of `tflite_model`; the object must remain alive for
+  // the whole lifetime of the pipeline.
+  static llvm::Expected<std::unique_ptr<GraphBuilderModelInferencePipeline>>
+  FromTfLiteModel(const tflite::FlatBufferModel* tflite_model,
+                  const GraphBuilderModelInferenceOptions& options = {},
+                  int num_buffers = 2);
+
+  // Waits until all submitted batches are processed. Basic blocks added to the
+  // batch after the last call to SubmitBatch() are discarded.
+  ~GraphBuilderModelInferencePipeline();
+
+  GraphBuilderModelInferencePipeline(
+      const GraphBuilderModelInferencePipeline&) = delete;
+  GraphBuilderModelInferencePipeline& operator=(
+      const GraphBuilderModelInferencePipeline&) = delete;
+
+  // Adds a basic block to the current batch. Returns true when the basic block
+  // was successfully added; see GraphBuilderModelInference::
+  // AddBasicBlockToBatch() for more details.
+  bool AddBasicBlockToBatch(const BasicBlock& block);
+
+  // Adds a basic block to the current batch unless the batch would exceed the
+  // batch budget from the options; see GraphBuilderModelInference::
+  // TryAddBasicBlockToBatch() for more details. When the result is kBatchFull,
+  // the caller should submit the batch and add the basic block again.
+  GraphBuilderModelInference::AddBasicBlockResult TryAddBasicBlockToBatch(
+      const BasicBlock& block);
+
+  // Submits the current batch for inference and starts a new empty batch.
+  // Returns a future that receives the predictions for the basic blocks that
+  // were successfully added to the batch, in the order in which they were
+  // added. Blocks until an inference object is available for the new batch.
+  // As with any llvm::Expected<>, the result must be taken from the future and
+  // checked, even if the caller is not interested in it.
+  std::future<BatchResult> SubmitBatch();
+
+  // Returns the number of inference objects used by the pipeline.
+  int num_buffers() const { return pool_->num_workers(); }
+
+  // Returns the largest size of tensor memory used by the interpreter for any
+  // of the processed batches; see GraphBuilderModelInference::BatchStats.
+  // Thread-safe.
+  int64_t peak_tensor_memory_bytes() const;
+
+ private:
+  friend class GraphBuilderModelInferencePipelineTestPeer;
+
+  // A batch submitted for inference.
+  struct Job {
+    GraphBuilderModelInferencePool::Lease worker;
+    std::promise<BatchResult> result;
+  };
+
+  explicit GraphBuilderModelInferencePipeline(
+      std::unique_ptr<GraphBuilderModelInferencePool> pool);
+
+  // The main loop of `inference_thread_`. Runs inference on the jobs in
+  // `jobs_` until the pipeline is destroyed and all jobs are processed.
+  void ProcessJobs();
+
+  const std::unique_ptr<GraphBuilderModelInferencePool> pool_;
+  // Runs the inference on the batch of a worker. This is
+  // GraphBuilderModelInference::RunInference(); tests replace it to inject
+  // errors.
+  std::function<BatchResult(GraphBuilderModelInference&)> run_batch_;
+  // The worker that holds the batch being built by the caller.
+  std::optional<GraphBuilderModelInferencePool::Lease> current_worker_;
+
+  mutable std::mutex mutex_;
+  // Notified each time a job is added to `jobs_` and when the pipeline is
+  // being destroyed.
+  std::condition_variable job_added_;
+  // The submitted jobs, in the order of submission. Guarded by `mutex_`.
+  std::deque<Job> jobs_;
+  // Set to true when the pipeline is being destroyed. Guarded by `mutex_`.
+  bool shutting_down_ = false;
+  // The largest tensor memory size over all processed batches. Guarded by
+  // `mutex_`.
+  int64_t peak_tensor_memory_bytes_ = 0;
+
+  std::thread inference_thread_;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BUILDER_MODEL_INFERENCE_PIPELINE_H_
@@ -0,0 +1,248 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/granite/graph_builder_model_inference_pipeline.h"
+
+#include <cstdlib>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/strings/string_view.h"
+#include "file/base/path.h"
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/basic_block_protos.h"
+#include "gematria/granite/graph_builder_model_inference.h"
+#include "gematria/testing/parse_proto.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/Error.h"
+#include "tensorflow/lite/model_builder.h"
+#include "testing/base/public/googletest.h"
+
+namespace gematria {
+
+// Gives the tests access to the private members of the pipeline.
+class GraphBuilderModelInferencePipelineTestPeer {
+ public:
+  using RunBatchFunction =
+      std::function<GraphBuilderModelInferencePipeline::BatchResult(
+          GraphBuilderModelInference&)>;
+
+  // Replaces the function that runs the inference on a batch. Must be called
+  // before the first batch is submitted.
+  static void SetRunBatch(GraphBuilderModelInferencePipeline& pipeline,
+                          RunBatchFunction run_batch) {
+    pipeline.run_batch_ = std::move(run_batch);
+  }
+};
+
+namespace {
+
+using ::testing::ElementsAreArray;
+using ::testing::HasSubstr;
+using ::testing::IsEmpty;
+using ::testing::SizeIs;
+
+using BatchResult = GraphBuilderModelInferencePipeline::BatchResult;
+using OutputType = GraphBuilderModelInference::OutputType;
+
+void AbortOnError(llvm::Error error) {
+  if (error) {
+    llvm::dbgs() << "Fatal error: " << error << "\n";
+    std::abort();
+  }
+}
+
+// The path of the model used in the tests, relative to the source directory of
+// the test.
+constexpr absl::string_view kModelPath =
+    "llvm_cm/test/X86/Inputs/gb-token-mit-2022_12_02.tflite";
+
+// Basic blocks used in the tests.
+constexpr absl::string_view kBasicBlocks[] = {
+    R"pb(
+      canonicalized_instructions {
+        mnemonic: "MOV"
+        llvm_mnemonic: "MOV64rr"
+        output_operands { register_name: "RSI" }
+        input_operands { register_name: "RBX" }
+      })pb",
+    R"pb(
+      canonicalized_instructions: {
+        mnemonic: "LEA"
+        llvm_mnemonic: "LEA64r"  # size=6
+        output_operands: { register_name: "RDI" }
+        input_operands: {
+          address: { base_register: "RBX" displacement: 8 scaling: 1 }
+        }
+      })pb",
+    R"pb(
+      canonicalized_instructions {
+        mnemonic: "ADD"
+        llvm_mnemonic: "ADD64rr"
+        output_operands { register_name: "RAX" }
+        input_operands { register_name: "RAX" }
+        input_operands { register_name: "RCX" }
+        implicit_output_operands { register_name: "EFLAGS" }
+      })pb",
+};
+
+class GraphBuilderModelInferencePipelineTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    const std::string model_path =
+        file::JoinPath(absl::GetFlag(FLAGS_test_srcdir), kModelPath);
+    tflite_model_ = tflite::FlatBufferModel::BuildFromFile(model_path.c_str());
+    ASSERT_NE(tflite_model_, nullptr);
+    for (const absl::string_view block_proto : kBasicBlocks) {
+      basic_blocks_.push_back(BasicBlockFromProto(ParseTextProto(block_proto)));
+    }
+  }
+
+  std::unique_ptr<GraphBuilderModelInferencePipeline> CreatePipeline(
+      int num_buffers) {
+    llvm::Expected<std::unique_ptr<GraphBuilderModelInferencePipeline>>
+        pipeline = GraphBuilderModelInferencePipeline::FromTfLiteModel(
+            tflite_model_.get(), {}, num_buffers);
+    AbortOnError(pipeline.takeError());
+    return std::move(*pipeline);
+  }
+
+  // Returns the basic blocks of the batch with the given index. The batches
+  // have different sizes and contents, so that their predictions can't be
+  // mixed up.
+  std::vector<BasicBlock> GetBatch(int batch_index) const {
+    std::vector<BasicBlock> batch;
+    for (int i = 0; i <= batch_index % 4; ++i) {
+      batch.push_back(basic_blocks_[(batch_index + i) % basic_blocks_.size()]);
+    }
+    return batch;
+  }
+
+  // Runs the inference on `blocks` without using the pipeline.
+  std::vector<OutputType> RunBatchDirectly(
+      const std::vector<BasicBlock>& blocks) {
+    llvm::Expected<std::unique_ptr<GraphBuilderModelInference>> inference =
+        GraphBuilderModelInference::FromTfLiteModel(tflite_model_.get());
+    AbortOnError(inference.takeError());
+    for (const BasicBlock& block : blocks) {
+      EXPECT_TRUE((*inference)->AddBasicBlockToBatch(block));
+    }
+    llvm::Expected<std::vector<OutputType>> predictions =
+        (*inference)->RunInference();
+    AbortOnError(predictions.takeError());
+    return std::move(*predictions);
+  }
+
+  std::unique_ptr<tflite::FlatBufferModel> tflite_model_;
+  std::vector<BasicBlock> basic_blocks_;
+};
+
+TEST_F(GraphBuilderModelInferencePipelineTest, InvalidNumBuffers) {
+  llvm::Expected<std::unique_ptr<GraphBuilderModelInferencePipeline>>
+      pipeline = GraphBuilderModelInferencePipeline::FromTfLiteModel(
+          tflite_model_.get(), {}, 1);
+  EXPECT_FALSE(static_cast<bool>(pipeline));
+  llvm::consumeError(pipeline.takeError());
+}
+
+TEST_F(GraphBuilderModelInferencePipelineTest, EmptyBatch) {
+  std::unique_ptr<GraphBuilderModelInferencePipeline> pipeline =
+      CreatePipeline(2);
+  BatchResult result = pipeline->SubmitBatch().get();
+  AbortOnError(result.takeError());
+  EXPECT_THAT(*result, IsEmpty());
+}
+
+TEST_F(GraphBuilderModelInferencePipelineTest, ResultsInSubmissionOrder) {
+  constexpr int kNumBatches = 10;
+  std::unique_ptr<GraphBuilderModelInferencePipeline> pipeline =
+      CreatePipeline(3);
+  EXPECT_EQ(pipeline->num_buffers(), 3);
+
+  std::vector<std::future<BatchResult>> futures;
+  for (int i = 0; i < kNumBatches; ++i) {
+    for (const BasicBlock& block : GetBatch(i)) {
+      ASSERT_TRUE(pipeline->AddBasicBlockToBatch(block));
+    }
+    futures.push_back(pipeline->SubmitBatch());
+  }
+
+  // Consume the futures in the reverse order; each of them must still have
+  // the predictions for its own batch.
+  for (int i = kNumBatches - 1; i >= 0; --i) {
+    SCOPED_TRACE(i);
+    BatchResult result = futures[i].get();
+    AbortOnError(result.takeError());
+    EXPECT_THAT(*result, ElementsAreArray(RunBatchDirectly(GetBatch(i))));
+  }
+}
+
+TEST_F(GraphBuilderModelInferencePipelineTest, ErrorReachesItsFuture) {
+  constexpr int kNumBatches = 4;
+  constexpr int kFailingBatchSize = 2;
+  std::unique_ptr<GraphBuilderModelInferencePipeline> pipeline =
+      CreatePipeline(2);
+  // Fail the only batch with two basic blocks; the batch sizes are 1, 2, 3 and
+  // 4.
+  GraphBuilderModelInferencePipelineTestPeer::SetRunBatch(
+      *pipeline, [](GraphBuilderModelInference& inference) -> BatchResult {
+        if (inference.graph_builder().num_blocks() == kFailingBatchSize) {
+          return llvm::createStringError(llvm::errc::io_error,
+                                         "injected error");
+        }
+        return inference.RunInference();
+      });
+
+  std::vector<std::future<BatchResult>> futures;
+  for (int i = 0; i < kNumBatches; ++i) {
+    const std::vector<BasicBlock> batch = GetBatch(i);
+    ASSERT_THAT(batch, SizeIs(i + 1));
+    for (const BasicBlock& block : batch) {
+      ASSERT_TRUE(pipeline->AddBasicBlockToBatch(block));
+    }
+    futures.push_back(pipeline->SubmitBatch());
+  }
+
+  for (int i = 0; i < kNumBatches; ++i) {
+    SCOPED_TRACE(i);
+    BatchResult result = futures[i].get();
+    if (i + 1 == kFailingBatchSize) {
+      ASSERT_FALSE(static_cast<bool>(result));
+      EXPECT_THAT(llvm::toString(result.takeError()),
+                  HasSubstr("injected error"));
+      continue;
+    }
+    AbortOnError(result.takeError());
+    EXPECT_THAT(*result, ElementsAreArray(RunBatchDirectly(GetBatch(i))));
+  }
+
+  // The pipeline keeps working after the error.
+  for (const BasicBlock& block : GetBatch(0)) {
+    ASSERT_TRUE(pipeline->AddBasicBlockToBatch(block));
+  }
+  BatchResult result = pipeline->SubmitBatch().get();
+  AbortOnError(result.takeError());
+  EXPECT_THAT(*result, ElementsAreArray(RunBatchDirectly(GetBatch(0))));
+}
+
+}  // namespace
+}  // namespace gematria
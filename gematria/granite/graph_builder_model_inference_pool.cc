@@ -0,0 +1,145 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/granite/graph_builder_model_inference_pool.h"
+
+#include <cassert>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/granite/graph_builder_model_inference.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/Error.h"
+#include "tensorflow/lite/model_builder.h"
+
+namespace gematria {
+
+GraphBuilderModelInferencePool::Lease::Lease(
+    GraphBuilderModelInferencePool* pool, int worker_index)
+    : pool_(pool),
+      worker_index_(worker_index),
+      inference_(pool->workers_[worker_index].get()) {}
+
+GraphBuilderModelInferencePool::Lease::Lease(Lease&& other)
+    : pool_(other.pool_),
+      worker_index_(other.worker_index_),
+      inference_(other.inference_) {
+  other.pool_ = nullptr;
+  other.inference_ = nullptr;
+}
+
+GraphBuilderModelInferencePool::Lease&
+GraphBuilderModelInferencePool::Lease::operator=(Lease&& other) {
+  if (this != &other) {
+    Release();
+    pool_ = other.pool_;
+    worker_index_ = other.worker_index_;
+    inference_ = other.inference_;
+    other.pool_ = nullptr;
+    other.inference_ = nullptr;
+  }
+  return *this;
+}
+
+GraphBuilderModelInferencePool::Lease::~Lease() { Release(); }
+
+void GraphBuilderModelInferencePool::Lease::Release() {
+  if (pool_ == nullptr) return;
+  pool_->Release(worker_index_);
+  pool_ = nullptr;
+  inference_ = nullptr;
+}
+
+llvm::Expected<std::unique_ptr<GraphBuilderModelInferencePool>>
+GraphBuilderModelInferencePool::FromTfLiteModel(
+    const tflite::FlatBufferModel* tflite_model, int num_workers,
+    const GraphBuilderModelInferenceOptions& options) {
+  if (num_workers <= 0) {
+    return llvm::createStringError(llvm::errc::invalid_argument,
+                                   "num_workers must be positive, it is %d",
+                                   num_workers);
+  }
+  llvm::Expected<std::unique_ptr<GraphBuilderModelInference>> first_worker =
+      GraphBuilderModelInference::FromTfLiteModel(tflite_model, options);
+  if (llvm::Error error = first_worker.takeError()) return error;
+
+  std::vector<std::unique_ptr<GraphBuilderModelInference>> workers;
+  workers.reserve(num_workers);
+  workers.push_back(std::move(*first_worker));
+  // The remaining workers are cloned from the first one, so that the node
+  // token list and the tensor layout are read from the model only once.
+  while (workers.size() < num_workers) {
+    llvm::Expected<std::unique_ptr<GraphBuilderModelInference>> worker =
+        workers.front()->Clone();
+    if (llvm::Error error = worker.takeError()) return error;
+    workers.push_back(std::move(*worker));
+  }
+
+  // We can't use std::make_unique<GraphBuilderModelInferencePool>(), because
+  // std::make_unique<>() requires a public constructor.
+  return std::unique_ptr<GraphBuilderModelInferencePool>(
+      new GraphBuilderModelInferencePool(std::move(workers)));
+}
+
+GraphBuilderModelInferencePool::GraphBuilderModelInferencePool(
+    std::vector<std::unique_ptr<GraphBuilderModelInference>> workers)
+    : workers_(std::move(workers)) {
+  assert(!workers_.empty());
+  available_workers_.reserve(workers_.size());
+  // The workers are taken from the back of the vector; go in reverse order
+  // so that a single-threaded user always gets the first worker.
+  for (int i = num_workers() - 1; i >= 0; --i) {
+    available_workers_.push_back(i);
+  }
+}
+
+int GraphBuilderModelInferencePool::num_available_workers() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return static_cast<int>(available_workers_.size());
+}
+
+GraphBuilderModelInferencePool::Lease
+GraphBuilderModelInferencePool::Acquire() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  worker_released_.wait(lock, [this]() { return !available_workers_.empty(); });
+  const int worker_index = available_workers_.back();
+  available_workers_.pop_back();
+  return Lease(this, worker_index);
+}
+
+void GraphBuilderModelInferencePool::Release(int worker_index) {
+  // Reset the worker before it is returned to the pool. This does not need the
+  // lock, because the worker is still exclusively owned by the caller.
+  workers_[worker_index]->Reset();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    available_workers_.push_back(worker_index);
+  }
+  worker_released_.notify_one();
+}
+
+llvm::Expected<
+    std::vector<std::optional<GraphBuilderModelInferencePool::OutputType>>>
+GraphBuilderModelInferencePool::RunInference(
+    llvm::ArrayRef<BasicBlock> blocks) {
+  Lease worker = Acquire();
+  return worker->RunInferenceInBatches(blocks);
+}
+
+}  // namespace gematria
@@ -0,0 +1,128 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BUILDER_MODEL_INFERENCE_POOL_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BUILDER_MODEL_INFERENCE_POOL_H_
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/granite/graph_builder_model_inference.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/Error.h"
+#include "tensorflow/lite/model_builder.h"
+
+namespace gematria {
+
+// A thread-safe pool of GraphBuilderModelInference objects for the same model.
+// The model and its vocabulary are loaded once; each worker in the pool has its
+// own graph builder and its own TensorFlow Lite interpreter, so up to
+// num_workers() batches can be processed concurrently.
+//
+// The pool can be used in two ways:
+//  - threads can lease a worker with Acquire() and use the
+//    GraphBuilderModelInference API directly; the worker is returned to the
+//    pool when the lease is destroyed.
+//  - threads can call RunInference() with a batch of basic blocks; the method
+//    leases a worker, runs the inference and returns the worker to the pool.
+//
+// Typical usage:
+//   auto tflite_model = tflite::FlatBufferModel::BuildFromFile(...);
+//   auto pool = GraphBuilderModelInferencePool::FromTfLiteModel(
+//       tflite_model.get(), std::thread::hardware_concurrency());
+//   // From any thread:
+//   const auto predictions = (*pool)->RunInference(basic_blocks);
+class GraphBuilderModelInferencePool {
+ public:
+  using OutputType = GraphBuilderModelInference::OutputType;
+
+  // An exclusive lease of one worker of the pool. The worker is reset and
+  // returned to the pool when the lease is destroyed.
+  class Lease {
+   public:
+    Lease(Lease&& other);
+    Lease& operator=(Lease&& other);
+    Lease(const Lease&) = delete;
+    Lease& operator=(const Lease&) = delete;
+    ~Lease();
+
+    GraphBuilderModelInference& operator*() const { return *inference_; }
+    GraphBuilderModelInference* operator->() const { return inference_; }
+
+   private:
+    friend class GraphBuilderModelInferencePool;
+
+    Lease(GraphBuilderModelInferencePool* pool, int worker_index);
+
+    // Returns the worker to the pool, if this lease still holds one.
+    void Release();
+
+    GraphBuilderModelInferencePool* pool_;
+    int worker_index_;
+    GraphBuilderModelInference* inference_;
+  };
+
+  // Creates a pool with `num_workers` workers for a model stored in the
+  // .tflite format. Returns an error when the model can't be loaded (see
+  // GraphBuilderModelInference::FromTfLiteModel()) or when `num_workers` is not
+  // positive. All workers are configured using `options`.
+  // Does not take ownership of `tflite_model`; the object must remain alive for
+  // the whole lifetime of the pool.
+  static llvm::Expected<std::unique_ptr<GraphBuilderModelInferencePool>>
+  FromTfLiteModel(const tflite::FlatBufferModel* tflite_model, int num_workers,
+                  const GraphBuilderModelInferenceOptions& options = {});
+
+  // Returns the number of workers in the pool.
+  int num_workers() const { return static_cast<int>(workers_.size()); }
+  // Returns the number of workers that are not leased. Thread-safe.
+  int num_available_workers() const;
+
+  // Leases a worker from the pool. Blocks until a worker is available. The
+  // batch of the returned worker is empty. Thread-safe. The lease must be
+  // destroyed before the pool.
+  Lease Acquire();
+
+  // Runs inference on `blocks` using one of the workers of the pool. Blocks
+  // until a worker is available. Returns a vector with one element per basic
+  // block in `blocks`, in the same order; the element is std::nullopt when the
+  // basic block could not be added to the batch (see
+  // GraphBuilderModelInference::AddBasicBlockToBatch()). When the options used
+  // to create the pool have a batch budget, the blocks are split into multiple
+  // batches as needed. Thread-safe.
+  llvm::Expected<std::vector<std::optional<OutputType>>> RunInference(
+      llvm::ArrayRef<BasicBlock> blocks);
+
+ private:
+  explicit GraphBuilderModelInferencePool(
+      std::vector<std::unique_ptr<GraphBuilderModelInference>> workers);
+
+  // Resets the worker at `worker_index` and marks it as available.
+  void Release(int worker_index);
+
+  const std::vector<std::unique_ptr<GraphBuilderModelInference>> workers_;
+
+  mutable std::mutex mutex_;
+  // Notified each time a worker is returned to the pool.
+  std::condition_variable worker_released_;
+  // The indices of workers that are not leased. Guarded by `mutex_`.
+  std::vector<int> available_workers_;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BUILDER_MODEL_INFERENCE_POOL_H_
@@ -0,0 +1,216 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/granite/graph_builder_model_inference_pool.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/strings/string_view.h"
+#include "file/base/path.h"
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/basic_block_protos.h"
+#include "gematria/granite/graph_builder_model_inference.h"
+#include "gematria/testing/parse_proto.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/Error.h"
+#include "tensorflow/lite/model_builder.h"
+#include "testing/base/public/googletest.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::Ne;
+using ::testing::Optional;
+
+using OutputType = GraphBuilderModelInferencePool::OutputType;
+
+void AbortOnError(llvm::Error error) {
+  if (error) {
+    llvm::dbgs() << "Fatal error: " << error << "\n";
+    std::abort();
+  }
+}
+
+// The path of the model used in the tests, relative to the source directory of
+// the test.
+constexpr absl::string_view kModelPath =
+    "llvm_cm/test/X86/Inputs/gb-token-mit-2022_12_02.tflite";
+
+constexpr absl::string_view kBasicBlock = R"pb(
+  canonicalized_instructions: {
+    mnemonic: "LEA"
+    llvm_mnemonic: "LEA64r"  # size=6
+    output_operands: { register_name: "RDI" }
+    input_operands: {
+      address: { base_register: "RBX" displacement: 8 scaling: 1 }
+    }
+  })pb";
+
+class GraphBuilderModelInferencePoolTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    const std::string model_path =
+        file::JoinPath(absl::GetFlag(FLAGS_test_srcdir), kModelPath);
+    tflite_model_ = tflite::FlatBufferModel::BuildFromFile(model_path.c_str());
+    ASSERT_NE(tflite_model_, nullptr);
+  }
+
+  std::unique_ptr<GraphBuilderModelInferencePool> CreatePool(int num_workers) {
+    llvm::Expected<std::unique_ptr<GraphBuilderModelInferencePool>> pool =
+        GraphBuilderModelInferencePool::FromTfLiteModel(tflite_model_.get(),
+                                                        num_workers);
+    AbortOnError(pool.takeError());
+    return std::move(*pool);
+  }
+
+  std::unique_ptr<tflite::FlatBufferModel> tflite_model_;
+};
+
+TEST_F(GraphBuilderModelInferencePoolTest, InvalidNumWorkers) {
+  llvm::Expected<std::unique_ptr<GraphBuilderModelInferencePool>> pool =
+      GraphBuilderModelInferencePool::FromTfLiteModel(tflite_model_.get(), 0);
+  EXPECT_FALSE(static_cast<bool>(pool));
+  llvm::consumeError(pool.takeError());
+}
+
+TEST_F(GraphBuilderModelInferencePoolTest, AcquireAndRelease) {
+  std::unique_ptr<GraphBuilderModelInferencePool> pool = CreatePool(2);
+  EXPECT_EQ(pool->num_workers(), 2);
+  EXPECT_EQ(pool->num_available_workers(), 2);
+  {
+    GraphBuilderModelInferencePool::Lease first = pool->Acquire();
+    EXPECT_EQ(pool->num_available_workers(), 1);
+    GraphBuilderModelInferencePool::Lease second = pool->Acquire();
+    EXPECT_EQ(pool->num_available_workers(), 0);
+    EXPECT_NE(&*first, &*second);
+  }
+  EXPECT_EQ(pool->num_available_workers(), 2);
+}
+
+TEST_F(GraphBuilderModelInferencePoolTest, MoveConstructedLeaseReleasesOnce) {
+  std::unique_ptr<GraphBuilderModelInferencePool> pool = CreatePool(2);
+  {
+    std::optional<GraphBuilderModelInferencePool::Lease> original(
+        pool->Acquire());
+    GraphBuilderModelInference* const worker = &**original;
+    GraphBuilderModelInferencePool::Lease moved(std::move(*original));
+    EXPECT_EQ(&*moved, worker);
+    EXPECT_EQ(pool->num_available_workers(), 1);
+    // Destroying the moved-from lease does not return the worker.
+    original.reset();
+    EXPECT_EQ(pool->num_available_workers(), 1);
+  }
+  EXPECT_EQ(pool->num_available_workers(), 2);
+}
+
+TEST_F(GraphBuilderModelInferencePoolTest, MoveAssignedLeaseReleasesOnce) {
+  std::unique_ptr<GraphBuilderModelInferencePool> pool = CreatePool(2);
+  {
+    GraphBuilderModelInferencePool::Lease first = pool->Acquire();
+    std::optional<GraphBuilderModelInferencePool::Lease> second(
+        pool->Acquire());
+    GraphBuilderModelInference* const second_worker = &**second;
+    EXPECT_EQ(pool->num_available_workers(), 0);
+
+    // The assignment returns the worker held by `first` to the pool.
+    first = std::move(*second);
+    EXPECT_EQ(&*first, second_worker);
+    EXPECT_EQ(pool->num_available_workers(), 1);
+    second.reset();
+    EXPECT_EQ(pool->num_available_workers(), 1);
+
+    // Self-assignment keeps the worker.
+    GraphBuilderModelInferencePool::Lease& alias = first;
+    first = std::move(alias);
+    EXPECT_EQ(&*first, second_worker);
+    EXPECT_EQ(pool->num_available_workers(), 1);
+  }
+  EXPECT_EQ(pool->num_available_workers(), 2);
+}
+
+TEST_F(GraphBuilderModelInferencePoolTest, AcquireBlocksUntilRelease) {
+  std::unique_ptr<GraphBuilderModelInferencePool> pool = CreatePool(1);
+  std::optional<GraphBuilderModelInferencePool::Lease> lease(pool->Acquire());
+  GraphBuilderModelInference* const worker = &**lease;
+
+  std::atomic<bool> acquired = false;
+  GraphBuilderModelInference* acquired_worker = nullptr;
+  std::thread thread([&]() {
+    GraphBuilderModelInferencePool::Lease second_lease = pool->Acquire();
+    acquired_worker = &*second_lease;
+    acquired = true;
+  });
+
+  // The pool is empty, so the thread must wait for the lease to be released.
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_FALSE(acquired);
+  lease.reset();
+  thread.join();
+  EXPECT_TRUE(acquired);
+  EXPECT_EQ(acquired_worker, worker);
+  EXPECT_EQ(pool->num_available_workers(), 1);
+}
+
+TEST_F(GraphBuilderModelInferencePoolTest, ReleaseResetsWorker) {
+  std::unique_ptr<GraphBuilderModelInferencePool> pool = CreatePool(1);
+  const BasicBlock block = BasicBlockFromProto(ParseTextProto(kBasicBlock));
+  {
+    GraphBuilderModelInferencePool::Lease lease = pool->Acquire();
+    ASSERT_TRUE(lease->AddBasicBlockToBatch(block));
+  }
+  GraphBuilderModelInferencePool::Lease lease = pool->Acquire();
+  EXPECT_EQ(lease->graph_builder().num_graphs(), 0);
+}
+
+TEST_F(GraphBuilderModelInferencePoolTest, RunInferenceFromManyThreads) {
+  constexpr int kNumThreads = 8;
+  std::unique_ptr<GraphBuilderModelInferencePool> pool = CreatePool(2);
+  const std::vector<BasicBlock> blocks = {
+      BasicBlockFromProto(ParseTextProto(kBasicBlock))};
+
+  llvm::Expected<std::vector<std::optional<OutputType>>> expected_predictions =
+      pool->RunInference(blocks);
+  AbortOnError(expected_predictions.takeError());
+  ASSERT_THAT(*expected_predictions, ElementsAre(Ne(std::nullopt)));
+
+  std::vector<std::thread> threads;
+  std::vector<std::optional<OutputType>> predictions(kNumThreads);
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&, i]() {
+      auto thread_predictions = pool->RunInference(blocks);
+      AbortOnError(thread_predictions.takeError());
+      predictions[i] = (*thread_predictions)[0];
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+  for (const auto& prediction : predictions) {
+    EXPECT_THAT(prediction, Optional((*expected_predictions)[0].value()));
+  }
+  EXPECT_EQ(pool->num_available_workers(), 2);
+}
+
+}  // namespace
+}  // namespace gematria
@@ -0,0 +1,381 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "gematria/granite/graph_builder_model_inference_server.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/granite/graph_builder_model_inference_batcher.h"
+#include "gematria/granite/hex_basic_block_parser.h"
+#include "gematria/llvm/llvm_architecture_support.h"
+#include "gematria/utils/string.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/Error.h"
+
+namespace gematria {
+namespace {
+
+constexpr std::string_view kStatsCommand = "!stats";
+constexpr std::string_view kShutdownCommand = "!shutdown";
+
+// Returns an error for a failed system call `what`, based on the current value
+// of errno.
+llvm::Error ErrorFromErrno(const char* what) {
+  const int error_number = errno;
+  return llvm::createStringError(
+      std::error_code(error_number, std::generic_category()), "%s failed: %s",
+      what, std::strerror(error_number));
+}
+
+// Writes all of `data` to the socket `fd`. Returns false when the data can't
+// be written, e.g. because the client closed the connection.
+bool WriteAll(int fd, std::string_view data) {
+  while (!data.empty()) {
+    // MSG_NOSIGNAL: a closed connection must not kill the server with SIGPIPE.
+    const ssize_t num_written =
+        ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+    if (num_written < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data.remove_prefix(num_written);
+  }
+  return true;
+}
+
+// Reads lines from a socket through a buffer.
+class LineReader {
+ public:
+  explicit LineReader(int fd) : fd_(fd) {}
+
+  // Reads the next line to `line`, without the line terminator. Returns false
+  // when there are no more lines, i.e. the connection was closed or reading
+  // from it failed. A non-empty last line without a terminator is returned as
+  // a line.
+  bool ReadLine(std::string& line) {
+    while (true) {
+      const size_t line_end = buffer_.find('\n', position_);
+      if (line_end != std::string::npos) {
+        line.assign(buffer_, position_, line_end - position_);
+        position_ = line_end + 1;
+        return true;
+      }
+      // Move the incomplete line to the start of the buffer and read more.
+      buffer_.erase(0, position_);
+      position_ = 0;
+      const size_t old_size = buffer_.size();
+      buffer_.resize(old_size + kReadSize);
+      ssize_t num_read;
+      do {
+        num_read = ::recv(fd_, buffer_.data() + old_size, kReadSize, 0);
+      } while (num_read < 0 && errno == EINTR);
+      buffer_.resize(old_size + std::max<ssize_t>(num_read, 0));
+      if (num_read <= 0) {
+        if (buffer_.empty()) return false;
+        line = std::move(buffer_);
+        buffer_.clear();
+        return true;
+      }
+    }
+  }
+
+ private:
+  static constexpr size_t kReadSize = 64 * 1024;
+
+  const int fd_;
+  std::string buffer_;
+  // The position of the first byte in `buffer_` that was not returned yet.
+  size_t position_ = 0;
+};
+
+// Appends the predictions to `out` in the same format as the one-shot mode of
+// llvm-granite.
+void AppendPredictions(
+    const GraphBuilderModelInferenceBatcher::OutputType& predictions,
+    std::string& out) {
+  char buffer[32];
+  for (size_t i = 0; i < predictions.size(); ++i) {
+    if (i > 0) out += ',';
+    const int size =
+        std::snprintf(buffer, sizeof(buffer), "%g", double{predictions[i]});
+    out.append(buffer, size);
+  }
+}
+
+// A response to a request that is not sent yet. Either `prediction` is set, or
+// the response is `text`.
+struct PendingResponse {
+  std::optional<std::future<GraphBuilderModelInferenceBatcher::Result>>
+      prediction;
+  std::string text;
+};
+
+// Formats the response to a prediction request.
+std::string FormatPrediction(GraphBuilderModelInferenceBatcher::Result result) {
+  if (llvm::Error error = result.takeError()) {
+    return "Error: " + llvm::toString(std::move(error));
+  }
+  if (!result->has_value()) return "Invalid block";
+  std::string out;
+  AppendPredictions(**result, out);
+  return out;
+}
+
+}  // namespace
+
+llvm::Expected<std::unique_ptr<GraphBuilderModelInferenceServer>>
+GraphBuilderModelInferenceServer::Create(
+    std::string_view socket_path, const LlvmArchitectureSupport* llvm_support,
+    GraphBuilderModelInferenceBatcher* batcher) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (socket_path.empty() || socket_path.size() >= sizeof(address.sun_path)) {
+    return llvm::createStringError(llvm::errc::invalid_argument,
+                                   "Invalid socket path: %s",
+                                   std::string(socket_path).c_str());
+  }
+  socket_path.copy(address.sun_path, socket_path.size());
+
+  const int listen_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0) return ErrorFromErrno("socket()");
+  // Remove a stale socket left by a previous instance of the server.
+  ::unlink(address.sun_path);
+  if (::bind(listen_fd, reinterpret_cast<const sockaddr*>(&address),
+             sizeof(address)) != 0 ||
+      ::listen(listen_fd, SOMAXCONN) != 0) {
+    llvm::Error error = ErrorFromErrno("bind() or listen()");
+    ::close(listen_fd);
+    return error;
+  }
+
+  // We can't use std::make_unique<GraphBuilderModelInferenceServer>(),
+  // because std::make_unique<>() requires a public constructor.
+  return std::unique_ptr<GraphBuilderModelInferenceServer>(
+      new GraphBuilderModelInferenceServer(std::string(socket_path), listen_fd,
+                                           llvm_support, batcher));
+}
+
+GraphBuilderModelInferenceServer::GraphBuilderModelInferenceServer(
+    std::string socket_path, int listen_fd,
+    const LlvmArchitectureSupport* llvm_support,
+    GraphBuilderModelInferenceBatcher* batcher)
+    : socket_path_(std::move(socket_path)),
+      listen_fd_(listen_fd),
+      llvm_support_(llvm_support),
+      batcher_(batcher) {}
+
+GraphBuilderModelInferenceServer::~GraphBuilderModelInferenceServer() {
+  Shutdown();
+  std::vector<std::thread> connection_threads;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    connection_threads.swap(connection_threads_);
+  }
+  for (std::thread& thread : connection_threads) thread.join();
+  ::close(listen_fd_);
+  ::unlink(socket_path_.c_str());
+}
+
+llvm::Error GraphBuilderModelInferenceServer::Run() {
+  llvm::Error error = llvm::Error::success();
+  while (!shutting_down_) {
+    const int connection_fd =
+        ::accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (connection_fd < 0) {
+      if (shutting_down_) break;
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      error = ErrorFromErrno("accept()");
+      Shutdown();
+      break;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Shutdown() might have been called after accept() returned.
+    if (shutting_down_) {
+      ::close(connection_fd);
+      break;
+    }
+    connection_fds_.insert(connection_fd);
+    connection_threads_.emplace_back(
+        [this, connection_fd]() { ServeConnection(connection_fd); });
+  }
+
+  // No new threads are added after `shutting_down_` is set.
+  std::vector<std::thread> connection_threads;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    connection_threads.swap(connection_threads_);
+  }
+  for (std::thread& thread : connection_threads) thread.join();
+  return error;
+}
+
+void GraphBuilderModelInferenceServer::Shutdown() {
+  if (shutting_down_.exchange(true)) return;
+  // Unblocks accept() in Run().
+  ::shutdown(listen_fd_, SHUT_RDWR);
+  // Makes the connections see the end of their input; the responses to the
+  // requests that were already read are still written.
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const int connection_fd : connection_fds_) {
+    ::shutdown(connection_fd, SHUT_RD);
+  }
+}
+
+void GraphBuilderModelInferenceServer::ServeConnection(int connection_fd) {
+  std::mutex responses_mutex;
+  std::condition_variable response_added;
+  // The responses in the order of the requests. Guarded by `responses_mutex`.
+  std::deque<PendingResponse> responses;
+  // Set to true when there are no more requests. Guarded by `responses_mutex`.
+  bool reading_done = false;
+
+  // The responses are written from a separate thread, so that the connection
+  // can keep reading and submitting requests while the earlier ones are
+  // processed by the batcher.
+  std::thread writer([&]() {
+    std::string output;
+    bool write_failed = false;
+    const auto flush = [&]() {
+      if (!write_failed && !WriteAll(connection_fd, output)) {
+        // The client is gone; stop reading, and discard the remaining
+        // responses.
+        write_failed = true;
+        ::shutdown(connection_fd, SHUT_RDWR);
+      }
+      output.clear();
+    };
+    std::unique_lock<std::mutex> lock(responses_mutex);
+    while (true) {
+      if (responses.empty() && !output.empty()) {
+        lock.unlock();
+        flush();
+        lock.lock();
+      }
+      response_added.wait(lock,
+                          [&]() { return reading_done || !responses.empty(); });
+      if (responses.empty()) break;
+      PendingResponse response = std::move(responses.front());
+      responses.pop_front();
+      lock.unlock();
+      if (response.prediction.has_value()) {
+        // Send what we have before waiting for the batcher.
+        if (!output.empty() &&
+            response.prediction->wait_for(std::chrono::seconds(0)) !=
+                std::future_status::ready) {
+          flush();
+        }
+        output += FormatPrediction(response.prediction->get());
+      } else {
+        output += response.text;
+      }
+      output += '\n';
+      lock.lock();
+    }
+    lock.unlock();
+    flush();
+  });
+
+  const auto add_response = [&](PendingResponse response) {
+    {
+      std::lock_guard<std::mutex> lock(responses_mutex);
+      responses.push_back(std::move(response));
+    }
+    response_added.notify_one();
+  };
+
+  HexBasicBlockParser parser(*llvm_support_);
+  LineReader reader(connection_fd);
+  std::string line;
+  while (reader.ReadLine(line)) {
+    StripAsciiWhitespace(&line);
+    if (line.empty()) continue;
+    PendingResponse response;
+    if (line == kStatsCommand) {
+      response.text = FormatStats();
+    } else if (line == kShutdownCommand) {
+      Shutdown();
+      response.text = "OK";
+    } else {
+      // The block is moved to the batcher, so it can't be reused across lines.
+      BasicBlock block;
+      if (llvm::Error error = parser.ParseBasicBlock(line, block)) {
+        response.text = "Error: " + llvm::toString(std::move(error));
+      } else {
+        response.prediction = batcher_->Submit(std::move(block));
+      }
+    }
+    add_response(std::move(response));
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(responses_mutex);
+    reading_done = true;
+  }
+  response_added.notify_one();
+  writer.join();
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    connection_fds_.erase(connection_fd);
+  }
+  ::close(connection_fd);
+}
+
+std::string GraphBuilderModelInferenceServer::FormatStats() const {
+  const GraphBuilderModelInferenceBatcher::Stats stats = batcher_->GetStats();
+  const double mean_batch_size =
+      stats.num_batches == 0
+          ? 0.0
+          : static_cast<double>(stats.num_requests) / stats.num_batches;
+  const double mean_latency_us =
+      stats.num_requests == 0
+          ? 0.0
+          : stats.total_latency_ns / 1000.0 / stats.num_requests;
+  char buffer[256];
+  const int size = std::snprintf(
+      buffer, sizeof(buffer),
+      "num_requests=%lld num_batches=%lld mean_batch_size=%.3f "
+      "queue_depth=%lld max_queue_depth=%lld mean_latency_us=%.3f "
+      "max_latency_us=%.3f",
+      static_cast<long long>(stats.num_requests),
+      static_cast<long long>(stats.num_batches), mean_batch_size,
+      static_cast<long long>(stats.queue_depth),
+      static_cast<long long>(stats.max_queue_depth), mean_latency_us,
+      stats.max_latency_ns / 1000.0);
+  return std::string(buffer, size);
+}
+
+}  // namespace gematria
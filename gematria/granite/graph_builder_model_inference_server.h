@@ -0,0 +1,114 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Contains a server that keeps a model loaded and serves inference requests
+// from other processes over a Unix domain socket.
+//
+// The protocol is line-based, and it extends the input and output formats of
+// the one-shot mode of llvm-granite:
+//  - each non-empty request line is a basic block in the hex format used in
+//    the BHive data set. The server responds with one line per block: the
+//    comma-separated predictions of the model, "Invalid block" when the block
+//    can't be processed by the model, or "Error: <message>" when the block
+//    can't be parsed or the inference failed.
+//  - the line "!stats" returns one line with the statistics of the batcher:
+//    the number of processed requests and batches, the current and the maximal
+//    queue depth, and the mean and the maximal request latency.
+//  - the line "!shutdown" stops the server; the server responds with "OK".
+// The responses are sent in the order of the requests on each connection. A
+// client may send many requests before reading the responses; the requests of
+// all connections are coalesced into batches by the batcher.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BUILDER_MODEL_INFERENCE_SERVER_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BUILDER_MODEL_INFERENCE_SERVER_H_
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "gematria/granite/graph_builder_model_inference_batcher.h"
+#include "gematria/llvm/llvm_architecture_support.h"
+#include "llvm/Support/Error.h"
+
+namespace gematria {
+
+// Serves inference requests over a Unix domain socket, using the protocol
+// described above. Each connection is served by its own threads, which parse
+// the basic blocks and write the responses; the inference itself runs on the
+// batcher.
+class GraphBuilderModelInferenceServer {
+ public:
+  // Creates a server listening on a Unix domain socket at `socket_path`.
+  // Removes an existing socket file at that path. Returns an error when the
+  // socket can't be created. Does not take ownership of `llvm_support` and
+  // `batcher`; both must remain alive for the whole lifetime of the server.
+  static llvm::Expected<std::unique_ptr<GraphBuilderModelInferenceServer>>
+  Create(std::string_view socket_path,
+         const LlvmArchitectureSupport* llvm_support,
+         GraphBuilderModelInferenceBatcher* batcher);
+
+  GraphBuilderModelInferenceServer(const GraphBuilderModelInferenceServer&) =
+      delete;
+  GraphBuilderModelInferenceServer& operator=(
+      const GraphBuilderModelInferenceServer&) = delete;
+
+  // Closes the socket and removes the socket file.
+  ~GraphBuilderModelInferenceServer();
+
+  // Accepts and serves connections until Shutdown() is called or a client
+  // sends "!shutdown". Waits until all connections are closed before
+  // returning. Must be called at most once.
+  llvm::Error Run();
+
+  // Stops accepting new connections and stops reading requests from the open
+  // connections; the responses to the requests that were already read are
+  // still sent. Thread-safe.
+  void Shutdown();
+
+ private:
+  GraphBuilderModelInferenceServer(
+      std::string socket_path, int listen_fd,
+      const LlvmArchitectureSupport* llvm_support,
+      GraphBuilderModelInferenceBatcher* batcher);
+
+  // Serves a single connection; runs on its own thread and closes
+  // `connection_fd` when the connection is finished.
+  void ServeConnection(int connection_fd);
+
+  // Returns the "!stats" response line.
+  std::string FormatStats() const;
+
+  const std::string socket_path_;
+  const int listen_fd_;
+  const LlvmArchitectureSupport* const llvm_support_;
+  GraphBuilderModelInferenceBatcher* const batcher_;
+
+  std::atomic<bool> shutting_down_ = false;
+
+  std::mutex mutex_;
+  // The sockets of the open connections. Guarded by `mutex_`.
+  std::unordered_set<int> connection_fds_;
+  // The threads serving the connections. Guarded by `mutex_`.
+  std::vector<std::thread> connection_threads_;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BUILDER_MODEL_INFERENCE_SERVER_H_
@@ -20,6 +20,7 @@
 #include <iostream>
 #include <iterator>
 #include <memory>
+#include <optional>
 #include <string>
 #include <utility>
 #include <vector>
@@ -33,6 +34,7 @@
 #include "file/base/path.h"
 #include "gematria/basic_block/basic_block.h"
 #include "gematria/basic_block/basic_block_protos.h"
+#include "gematria/granite/graph_builder.h"
 #include "gematria/llvm/llvm_to_absl.h"
 #include "gematria/testing/parse_proto.h"
 #include "gmock/gmock.h"
@@ -49,6 +51,8 @@ using ::testing::ElementsAre;
 using ::testing::ElementsAreArray;
 using ::testing::FloatNear;
 using ::testing::Matcher;
+using ::testing::Optional;
+using ::testing::Pointwise;
 using ::testing::SizeIs;
 using ::testing::status::IsOkAndHolds;
 
@@ -134,5 +138,210 @@ BasicBlockWithInvalidTokenOutputMatcher() {
                      FloatNear(36.2444115, kTolerance));
 }
 
+// The path of the model used in the tests, relative to the source directory of
+// the test.
+constexpr absl::string_view kModelPath =
+    "llvm_cm/test/X86/Inputs/gb-token-mit-2022_12_02.tflite";
+
+class GraphBuilderModelInferenceTest : public ::testing::Test {
+ protected:
+  using OutputType = GraphBuilderModelInference::OutputType;
+
+  void SetUp() override {
+    const std::string model_path =
+        file::JoinPath(absl::GetFlag(FLAGS_test_srcdir), kModelPath);
+    tflite_model_ = tflite::FlatBufferModel::BuildFromFile(model_path.c_str());
+    ASSERT_NE(tflite_model_, nullptr);
+    for (const absl::string_view block_proto : kBasicBlocks) {
+      basic_blocks_.push_back(BasicBlockFromProto(ParseTextProto(block_proto)));
+    }
+  }
+
+  // Creates an inference object for the test model with `options`.
+  std::unique_ptr<GraphBuilderModelInference> CreateInference(
+      const GraphBuilderModelInferenceOptions& options = {}) {
+    llvm::Expected<std::unique_ptr<GraphBuilderModelInference>> inference =
+        GraphBuilderModelInference::FromTfLiteModel(tflite_model_.get(),
+                                                    options);
+    AbortOnError(inference.takeError());
+    return std::move(*inference);
+  }
+
+  // Adds `blocks` to the batch of `inference`, runs the inference and resets
+  // the batch.
+  static std::vector<OutputType> RunBatch(
+      GraphBuilderModelInference& inference,
+      const std::vector<BasicBlock>& blocks) {
+    for (const BasicBlock& block : blocks) {
+      EXPECT_TRUE(inference.AddBasicBlockToBatch(block));
+    }
+    llvm::Expected<std::vector<OutputType>> predictions =
+        inference.RunInference();
+    AbortOnError(predictions.takeError());
+    inference.Reset();
+    return std::move(*predictions);
+  }
+
+  std::unique_ptr<tflite::FlatBufferModel> tflite_model_;
+  std::vector<BasicBlock> basic_blocks_;
+};
+
+TEST_F(GraphBuilderModelInferenceTest, ShapeBucketingKeepsPredictions) {
+  std::unique_ptr<GraphBuilderModelInference> inference = CreateInference();
+  const std::vector<OutputType> expected_predictions =
+      RunBatch(*inference, basic_blocks_);
+  ASSERT_THAT(expected_predictions, SizeIs(basic_blocks_.size()));
+
+  // The default buckets are powers of two.
+  inference->SetShapeBucketing(true);
+  EXPECT_THAT(RunBatch(*inference, basic_blocks_),
+              ElementsAreArray(expected_predictions));
+  // A batch of a different size re-plans the memory; the predictions are still
+  // the same.
+  EXPECT_THAT(RunBatch(*inference, {basic_blocks_[1]}),
+              ElementsAre(expected_predictions[1]));
+  EXPECT_THAT(RunBatch(*inference, basic_blocks_),
+              ElementsAreArray(expected_predictions));
+
+  // Bucketing configured through the options behaves the same way.
+  GraphBuilderModelInferenceOptions options;
+  options.shape_bucketing = true;
+  options.shape_bucket_sizes = {3, 100};
+  std::unique_ptr<GraphBuilderModelInference> bucketed_inference =
+      CreateInference(options);
+  EXPECT_THAT(RunBatch(*bucketed_inference, basic_blocks_),
+              ElementsAreArray(expected_predictions));
+}
+
+TEST_F(GraphBuilderModelInferenceTest, ShapeBucketingOnBucketBoundaries) {
+  std::unique_ptr<GraphBuilderModelInference> inference = CreateInference();
+  for (const BasicBlock& block : basic_blocks_) {
+    ASSERT_TRUE(inference->AddBasicBlockToBatch(block));
+  }
+  const BasicBlockGraphBuilder& graph_builder = inference->graph_builder();
+  const int num_graphs = graph_builder.num_graphs();
+  const int num_nodes = graph_builder.num_nodes();
+  const int num_edges = graph_builder.num_edges();
+  const int num_instructions = graph_builder.num_instructions();
+  llvm::Expected<std::vector<OutputType>> expected_predictions =
+      inference->RunInference();
+  AbortOnError(expected_predictions.takeError());
+  inference->Reset();
+
+  // The numbers of instructions, nodes and edges are exactly on bucket
+  // boundaries, so there are no padding instructions and no padding edges. The
+  // padding graph still gets one padding node, which takes the nodes to the
+  // next bucket.
+  inference->SetShapeBucketing(true, {num_instructions, num_nodes, num_edges,
+                                      num_nodes + 1, num_graphs + 1});
+  EXPECT_THAT(RunBatch(*inference, basic_blocks_),
+              ElementsAreArray(*expected_predictions));
+
+  // Only the number of nodes is on a bucket boundary. The padding instructions
+  // take the nodes over the boundary.
+  inference->SetShapeBucketing(
+      true, {num_instructions + 1, num_nodes, num_nodes + 2, num_edges + 1,
+             num_graphs + 1});
+  EXPECT_THAT(RunBatch(*inference, basic_blocks_),
+              ElementsAreArray(*expected_predictions));
+
+  // Disabling bucketing removes the padding again.
+  inference->SetShapeBucketing(false);
+  EXPECT_THAT(RunBatch(*inference, basic_blocks_),
+              ElementsAreArray(*expected_predictions));
+}
+
+// Returns a matcher for the outputs of RunInferenceInBatches() that expects
+// the same predictions as `predictions`, up to kTolerance.
+std::vector<Matcher<std::optional<GraphBuilderModelInference::OutputType>>>
+NearPredictions(
+    const std::vector<GraphBuilderModelInference::OutputType>& predictions) {
+  std::vector<Matcher<std::optional<GraphBuilderModelInference::OutputType>>>
+      matchers;
+  for (const GraphBuilderModelInference::OutputType& prediction : predictions) {
+    matchers.push_back(
+        Optional(Pointwise(FloatNear(kTolerance), prediction)));
+  }
+  return matchers;
+}
+
+TEST_F(GraphBuilderModelInferenceTest, TryAddBasicBlockToBatchWithBudget) {
+  GraphBuilderModelInferenceOptions options;
+  options.batch_budget.max_blocks = 1;
+  std::unique_ptr<GraphBuilderModelInference> inference =
+      CreateInference(options);
+  EXPECT_EQ(inference->TryAddBasicBlockToBatch(basic_blocks_[0]),
+            GraphBuilderModelInference::AddBasicBlockResult::kAdded);
+  EXPECT_EQ(inference->TryAddBasicBlockToBatch(basic_blocks_[1]),
+            GraphBuilderModelInference::AddBasicBlockResult::kBatchFull);
+  // The rejected basic block is removed from the batch.
+  EXPECT_EQ(inference->graph_builder().num_blocks(), 1);
+  inference->Reset();
+  EXPECT_EQ(inference->TryAddBasicBlockToBatch(basic_blocks_[1]),
+            GraphBuilderModelInference::AddBasicBlockResult::kAdded);
+}
+
+TEST_F(GraphBuilderModelInferenceTest, SingleBlockExceedsBudget) {
+  GraphBuilderModelInferenceOptions options;
+  options.batch_budget.max_nodes = 1;
+  options.batch_budget.max_edges = 1;
+  options.batch_budget.max_input_tensor_bytes = 1;
+  std::unique_ptr<GraphBuilderModelInference> inference =
+      CreateInference(options);
+  // The first basic block is accepted even though it does not fit the budget.
+  EXPECT_EQ(inference->TryAddBasicBlockToBatch(basic_blocks_[0]),
+            GraphBuilderModelInference::AddBasicBlockResult::kAdded);
+  EXPECT_GT(inference->graph_builder().num_nodes(), 1);
+  inference->Reset();
+
+  std::unique_ptr<GraphBuilderModelInference> unlimited_inference =
+      CreateInference();
+  const std::vector<OutputType> expected_predictions =
+      RunBatch(*unlimited_inference, {basic_blocks_[0]});
+  llvm::Expected<std::vector<std::optional<OutputType>>> predictions =
+      inference->RunInferenceInBatches(basic_blocks_[0]);
+  AbortOnError(predictions.takeError());
+  EXPECT_THAT(*predictions,
+              ElementsAreArray(NearPredictions(expected_predictions)));
+}
+
+TEST_F(GraphBuilderModelInferenceTest, RunInferenceInBatchesWithTinyBudget) {
+  // Repeat the basic blocks, so that there are more batches than blocks in
+  // kBasicBlocks.
+  std::vector<BasicBlock> blocks;
+  for (int i = 0; i < 3; ++i) {
+    blocks.insert(blocks.end(), basic_blocks_.begin(), basic_blocks_.end());
+  }
+  std::unique_ptr<GraphBuilderModelInference> unlimited_inference =
+      CreateInference();
+  const std::vector<OutputType> expected_predictions =
+      RunBatch(*unlimited_inference, blocks);
+
+  // No two basic blocks fit into a batch together, so each batch has exactly
+  // one basic block.
+  GraphBuilderModelInferenceOptions options;
+  options.batch_budget.max_nodes = 1;
+  std::unique_ptr<GraphBuilderModelInference> inference =
+      CreateInference(options);
+  llvm::Expected<std::vector<std::optional<OutputType>>> predictions =
+      inference->RunInferenceInBatches(blocks);
+  AbortOnError(predictions.takeError());
+  EXPECT_THAT(*predictions,
+              ElementsAreArray(NearPredictions(expected_predictions)));
+  EXPECT_EQ(inference->last_batch_stats().num_blocks, 1);
+  // The batch is empty when the method returns.
+  EXPECT_EQ(inference->graph_builder().num_graphs(), 0);
+
+  // A budget that fits two basic blocks gives the same predictions.
+  options.batch_budget.max_nodes = -1;
+  options.batch_budget.max_blocks = 2;
+  inference = CreateInference(options);
+  predictions = inference->RunInferenceInBatches(blocks);
+  AbortOnError(predictions.takeError());
+  EXPECT_THAT(*predictions,
+              ElementsAreArray(NearPredictions(expected_predictions)));
+  EXPECT_EQ(inference->last_batch_stats().num_blocks, 2);
+}
+
 }  // namespace
 }  // namespace gematria
@@ -0,0 +1,136 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "gematria/granite/graph_builder_multi_model_inference.h"
+
+#include <cassert>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/granite/graph_builder.h"
+#include "gematria/granite/graph_builder_model_inference.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/Error.h"
+#include "tensorflow/lite/model_builder.h"
+
+namespace gematria {
+
+llvm::Expected<std::unique_ptr<GraphBuilderMultiModelInference>>
+GraphBuilderMultiModelInference::FromTfLiteModels(
+    llvm::ArrayRef<const tflite::FlatBufferModel*> tflite_models,
+    const GraphBuilderModelInferenceOptions& options) {
+  if (tflite_models.empty()) {
+    return llvm::createStringError(llvm::errc::invalid_argument,
+                                   "At least one model is required");
+  }
+  std::vector<std::unique_ptr<GraphBuilderModelInference>> models;
+  models.reserve(tflite_models.size());
+  for (const tflite::FlatBufferModel* const tflite_model : tflite_models) {
+    llvm::Expected<std::unique_ptr<GraphBuilderModelInference>> model =
+        GraphBuilderModelInference::FromTfLiteModel(tflite_model, options);
+    if (llvm::Error error = model.takeError()) return error;
+    if (!models.empty() && !models.front()->graph_builder().HasSameVocabulary(
+                               (*model)->graph_builder())) {
+      return llvm::createStringError(
+          llvm::errc::invalid_argument,
+          "The model at index %zu does not have the same vocabulary as the "
+          "first model",
+          models.size());
+    }
+    models.push_back(std::move(*model));
+  }
+  // We can't use std::make_unique<GraphBuilderMultiModelInference>(), because
+  // std::make_unique<>() requires a public constructor.
+  return std::unique_ptr<GraphBuilderMultiModelInference>(
+      new GraphBuilderMultiModelInference(std::move(models)));
+}
+
+GraphBuilderMultiModelInference::GraphBuilderMultiModelInference(
+    std::vector<std::unique_ptr<GraphBuilderModelInference>> models)
+    : models_(std::move(models)), selected_tasks_(models_.size()) {
+  assert(!models_.empty());
+}
+
+llvm::Error GraphBuilderMultiModelInference::SelectTasks(
+    int model_index, std::optional<std::vector<int>> tasks) {
+  if (model_index < 0 || model_index >= num_models()) {
+    return llvm::createStringError(llvm::errc::invalid_argument,
+                                   "Invalid model index: %d", model_index);
+  }
+  if (tasks.has_value()) {
+    for (const int task : *tasks) {
+      if (task < 0) {
+        return llvm::createStringError(llvm::errc::invalid_argument,
+                                       "Invalid task index: %d", task);
+      }
+    }
+  }
+  selected_tasks_[model_index] = std::move(tasks);
+  return llvm::Error::success();
+}
+
+bool GraphBuilderMultiModelInference::AddBasicBlockToBatch(
+    const BasicBlock& block) {
+  return models_.front()->AddBasicBlockToBatch(block);
+}
+
+GraphBuilderMultiModelInference::AddBasicBlockResult
+GraphBuilderMultiModelInference::TryAddBasicBlockToBatch(
+    const BasicBlock& block) {
+  return models_.front()->TryAddBasicBlockToBatch(block);
+}
+
+llvm::Expected<
+    std::vector<std::vector<GraphBuilderMultiModelInference::OutputType>>>
+GraphBuilderMultiModelInference::RunInference() {
+  const BasicBlockGraphBuilder& graph_builder =
+      models_.front()->graph_builder();
+  std::vector<std::vector<OutputType>> output(models_.size());
+  for (int model_index = 0; model_index < num_models(); ++model_index) {
+    const std::optional<std::vector<int>>& tasks = selected_tasks_[model_index];
+    if (tasks.has_value() && tasks->empty()) continue;
+    llvm::Expected<std::vector<OutputType>> predictions =
+        models_[model_index]->RunInferenceOnGraphBuilder(graph_builder);
+    if (llvm::Error error = predictions.takeError()) return error;
+    if (!tasks.has_value()) {
+      output[model_index] = std::move(*predictions);
+      continue;
+    }
+    std::vector<OutputType>& model_output = output[model_index];
+    model_output.reserve(predictions->size());
+    for (const OutputType& prediction : *predictions) {
+      OutputType& selected = model_output.emplace_back();
+      selected.reserve(tasks->size());
+      for (const int task : *tasks) {
+        if (task >= static_cast<int>(prediction.size())) {
+          return llvm::createStringError(
+              llvm::errc::invalid_argument,
+              "Task %d is out of range for the model at index %d", task,
+              model_index);
+        }
+        selected.push_back(prediction[task]);
+      }
+    }
+  }
+  return output;
+}
+
+void GraphBuilderMultiModelInference::Reset() { models_.front()->Reset(); }
+
+}  // namespace gematria
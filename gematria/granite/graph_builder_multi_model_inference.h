@@ -0,0 +1,113 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BUILDER_MULTI_MODEL_INFERENCE_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BUILDER_MULTI_MODEL_INFERENCE_H_
+
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/granite/graph_builder_model_inference.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/Error.h"
+#include "tensorflow/lite/model_builder.h"
+
+namespace gematria {
+
+// Runs inference with several trained GRANITE models on the same basic blocks,
+// e.g. models for different microarchitectures or different generations of a
+// model. The models must be trained with the same vocabulary; the graphs of a
+// batch are then built only once and fed to the interpreters of all models.
+//
+// Each model may return only some of its tasks, e.g. only the microarchitecture
+// a client is interested in; a model with no selected tasks is not evaluated
+// at all. Note that all tasks of a model are computed by a single output
+// tensor, so selecting a subset of the tasks of an evaluated model saves only
+// the copying of the outputs.
+//
+// Typical usage:
+//   auto inference = GraphBuilderMultiModelInference::FromTfLiteModels(
+//       {skylake_model.get(), zen2_model.get()});
+//   for (const BasicBlock& block : input_basic_blocks) {
+//     (*inference)->AddBasicBlockToBatch(block);
+//   }
+//   // predictions[model_index][block_index] are the outputs of a model.
+//   const auto predictions = (*inference)->RunInference();
+class GraphBuilderMultiModelInference {
+ public:
+  using OutputType = GraphBuilderModelInference::OutputType;
+  using AddBasicBlockResult = GraphBuilderModelInference::AddBasicBlockResult;
+
+  // Creates the inference object for `tflite_models`. Returns an error when
+  // `tflite_models` is empty, when one of the models can't be loaded (see
+  // GraphBuilderModelInference::FromTfLiteModel()), or when the models do not
+  // have the same vocabulary. All models are configured using `options`; the
+  // batch budget and block deduplication apply to the shared batch.
+  // Does not take ownership of the models; they must remain alive for the
+  // whole lifetime of the inference object.
+  static llvm::Expected<std::unique_ptr<GraphBuilderMultiModelInference>>
+  FromTfLiteModels(llvm::ArrayRef<const tflite::FlatBufferModel*> tflite_models,
+                   const GraphBuilderModelInferenceOptions& options = {});
+
+  // Returns the number of models.
+  int num_models() const { return static_cast<int>(models_.size()); }
+
+  // Selects the tasks returned for the model at `model_index`. With
+  // std::nullopt, which is the default, RunInference() returns all tasks of
+  // the model. Otherwise, it returns only the values of `tasks`, in this
+  // order; when `tasks` is empty, the model is not evaluated and its output is
+  // empty. Returns an error when `model_index` is out of range or when a task
+  // index is negative; task indices that exceed the number of tasks of the
+  // model are reported by RunInference().
+  llvm::Error SelectTasks(int model_index,
+                          std::optional<std::vector<int>> tasks);
+
+  // Adds a basic block to the current batch. Returns true when the basic block
+  // was successfully added, otherwise false. Does not check the batch budget
+  // from the options; see TryAddBasicBlockToBatch().
+  bool AddBasicBlockToBatch(const BasicBlock& block);
+
+  // Adds a basic block to the current batch, unless the batch would exceed the
+  // batch budget from the options. See
+  // GraphBuilderModelInference::TryAddBasicBlockToBatch().
+  AddBasicBlockResult TryAddBasicBlockToBatch(const BasicBlock& block);
+
+  // Runs all models with at least one selected task on the current batch.
+  // Returns a vector with one element per model; the element contains one
+  // prediction per basic block in the current batch, in the order in which
+  // they were added, or it is empty when the model has no selected tasks.
+  // Does not reset the current batch.
+  llvm::Expected<std::vector<std::vector<OutputType>>> RunInference();
+
+  // Removes all basic blocks from the current batch.
+  void Reset();
+
+ private:
+  explicit GraphBuilderMultiModelInference(
+      std::vector<std::unique_ptr<GraphBuilderModelInference>> models);
+
+  // The batch is built in the graph builder of the first model; the other
+  // models read it through
+  // GraphBuilderModelInference::RunInferenceOnGraphBuilder().
+  const std::vector<std::unique_ptr<GraphBuilderModelInference>> models_;
+  // The tasks selected by SelectTasks(), one entry per model.
+  std::vector<std::optional<std::vector<int>>> selected_tasks_;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BUILDER_MULTI_MODEL_INFERENCE_H_
@@ -0,0 +1,234 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/granite/graph_builder_multi_model_inference.h"
+
+#include <cstdlib>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/strings/string_view.h"
+#include "file/base/path.h"
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/basic_block_protos.h"
+#include "gematria/testing/parse_proto.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/Error.h"
+#include "tensorflow/lite/model_builder.h"
+#include "testing/base/public/googletest.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::ElementsAreArray;
+using ::testing::FloatNear;
+using ::testing::HasSubstr;
+using ::testing::IsEmpty;
+using ::testing::Matcher;
+
+using OutputType = GraphBuilderMultiModelInference::OutputType;
+
+// The tolerance used when matching the output of the model with the expected
+// results.
+constexpr float kTolerance = 1e-3;
+
+void AbortOnError(llvm::Error error) {
+  if (error) {
+    llvm::dbgs() << "Fatal error: " << error << "\n";
+    std::abort();
+  }
+}
+
+// The path of the model used in the tests, relative to the source directory of
+// the test.
+constexpr absl::string_view kModelPath =
+    "llvm_cm/test/X86/Inputs/gb-token-mit-2022_12_02.tflite";
+
+// Basic blocks used in the tests. The model has three tasks; the expected
+// values of the tasks for each block are in kExpectedPredictions.
+constexpr absl::string_view kBasicBlocks[] = {
+    R"pb(
+      canonicalized_instructions {
+        mnemonic: "MOV"
+        llvm_mnemonic: "MOV64rr"
+        output_operands { register_name: "RSI" }
+        input_operands { register_name: "RBX" }
+      }
+      canonicalized_instructions {
+        mnemonic: "MOV"
+        llvm_mnemonic: "MOV64rr"
+        output_operands { register_name: "RDX" }
+        input_operands { register_name: "RAX" }
+      }
+      canonicalized_instructions {
+        mnemonic: "MOV"
+        llvm_mnemonic: "MOV64rr"
+        output_operands { register_name: "RDI" }
+        input_operands { register_name: "R15" }
+      })pb",
+    R"pb(
+      canonicalized_instructions: {
+        mnemonic: "LEA"
+        llvm_mnemonic: "LEA64r"  # size=6
+        output_operands: { register_name: "RDI" }
+        input_operands: {
+          address: { base_register: "RBX" displacement: 8 scaling: 1 }
+        }
+      })pb",
+};
+
+constexpr float kExpectedPredictions[][3] = {
+    {88.2726, 101.896561, 86.6651535},
+    {37.455822, 35.8950844, 35.4254227},
+};
+
+// Returns a matcher for the prediction of the block at `block_index` in
+// kBasicBlocks that contains the values of `tasks`, in this order.
+Matcher<OutputType> TaskValues(int block_index, std::vector<int> tasks) {
+  std::vector<Matcher<float>> task_matchers;
+  for (const int task : tasks) {
+    task_matchers.push_back(
+        FloatNear(kExpectedPredictions[block_index][task], kTolerance));
+  }
+  return ElementsAreArray(task_matchers);
+}
+
+class GraphBuilderMultiModelInferenceTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    const std::string model_path =
+        file::JoinPath(absl::GetFlag(FLAGS_test_srcdir), kModelPath);
+    tflite_model_ = tflite::FlatBufferModel::BuildFromFile(model_path.c_str());
+    ASSERT_NE(tflite_model_, nullptr);
+    for (const absl::string_view block_proto : kBasicBlocks) {
+      basic_blocks_.push_back(BasicBlockFromProto(ParseTextProto(block_proto)));
+    }
+  }
+
+  // Creates an inference object that runs the test model `num_models` times.
+  std::unique_ptr<GraphBuilderMultiModelInference> CreateInference(
+      int num_models) {
+    const std::vector<const tflite::FlatBufferModel*> models(
+        num_models, tflite_model_.get());
+    llvm::Expected<std::unique_ptr<GraphBuilderMultiModelInference>>
+        inference = GraphBuilderMultiModelInference::FromTfLiteModels(models);
+    AbortOnError(inference.takeError());
+    return std::move(*inference);
+  }
+
+  // Adds all blocks from basic_blocks_ to the batch of `inference` and runs
+  // the inference.
+  llvm::Expected<std::vector<std::vector<OutputType>>> RunBatch(
+      GraphBuilderMultiModelInference& inference) {
+    for (const BasicBlock& block : basic_blocks_) {
+      EXPECT_TRUE(inference.AddBasicBlockToBatch(block));
+    }
+    return inference.RunInference();
+  }
+
+  std::unique_ptr<tflite::FlatBufferModel> tflite_model_;
+  std::vector<BasicBlock> basic_blocks_;
+};
+
+TEST_F(GraphBuilderMultiModelInferenceTest, NoModels) {
+  llvm::Expected<std::unique_ptr<GraphBuilderMultiModelInference>> inference =
+      GraphBuilderMultiModelInference::FromTfLiteModels({});
+  EXPECT_FALSE(static_cast<bool>(inference));
+  llvm::consumeError(inference.takeError());
+}
+
+TEST_F(GraphBuilderMultiModelInferenceTest, AllTasks) {
+  std::unique_ptr<GraphBuilderMultiModelInference> inference =
+      CreateInference(2);
+  EXPECT_EQ(inference->num_models(), 2);
+  llvm::Expected<std::vector<std::vector<OutputType>>> predictions =
+      RunBatch(*inference);
+  AbortOnError(predictions.takeError());
+  const auto expected_block_predictions =
+      ElementsAre(TaskValues(0, {0, 1, 2}), TaskValues(1, {0, 1, 2}));
+  EXPECT_THAT(*predictions, ElementsAre(expected_block_predictions,
+                                        expected_block_predictions));
+}
+
+TEST_F(GraphBuilderMultiModelInferenceTest, SelectedTasksLandInTheirColumns) {
+  std::unique_ptr<GraphBuilderMultiModelInference> inference =
+      CreateInference(3);
+  // The first model returns only the last task; the second one returns the
+  // tasks in a different order than the model, including a duplicate; the
+  // third model keeps all tasks.
+  AbortOnError(inference->SelectTasks(0, std::vector<int>{2}));
+  AbortOnError(inference->SelectTasks(1, std::vector<int>{1, 0, 1}));
+  llvm::Expected<std::vector<std::vector<OutputType>>> predictions =
+      RunBatch(*inference);
+  AbortOnError(predictions.takeError());
+  ASSERT_EQ(predictions->size(), 3);
+
+  EXPECT_THAT((*predictions)[0],
+              ElementsAre(TaskValues(0, {2}), TaskValues(1, {2})));
+  EXPECT_THAT((*predictions)[1],
+              ElementsAre(TaskValues(0, {1, 0, 1}), TaskValues(1, {1, 0, 1})));
+  EXPECT_THAT((*predictions)[2], ElementsAre(TaskValues(0, {0, 1, 2}),
+                                             TaskValues(1, {0, 1, 2})));
+}
+
+TEST_F(GraphBuilderMultiModelInferenceTest, ModelWithNoTasksIsSkipped) {
+  std::unique_ptr<GraphBuilderMultiModelInference> inference =
+      CreateInference(2);
+  AbortOnError(inference->SelectTasks(0, std::vector<int>{}));
+  llvm::Expected<std::vector<std::vector<OutputType>>> predictions =
+      RunBatch(*inference);
+  AbortOnError(predictions.takeError());
+  ASSERT_EQ(predictions->size(), 2);
+  EXPECT_THAT((*predictions)[0], IsEmpty());
+  EXPECT_EQ((*predictions)[1].size(), basic_blocks_.size());
+
+  // Selecting std::nullopt returns all tasks again.
+  AbortOnError(inference->SelectTasks(0, std::nullopt));
+  predictions = inference->RunInference();
+  AbortOnError(predictions.takeError());
+  EXPECT_EQ((*predictions)[0], (*predictions)[1]);
+}
+
+TEST_F(GraphBuilderMultiModelInferenceTest, InvalidTaskSelection) {
+  std::unique_ptr<GraphBuilderMultiModelInference> inference =
+      CreateInference(2);
+  llvm::Error error = inference->SelectTasks(2, std::nullopt);
+  EXPECT_THAT(llvm::toString(std::move(error)),
+              HasSubstr("Invalid model index"));
+  error = inference->SelectTasks(-1, std::nullopt);
+  EXPECT_THAT(llvm::toString(std::move(error)),
+              HasSubstr("Invalid model index"));
+  error = inference->SelectTasks(0, std::vector<int>{0, -1});
+  EXPECT_THAT(llvm::toString(std::move(error)),
+              HasSubstr("Invalid task index"));
+
+  // Task indices out of the range of the model are detected when running the
+  // inference.
+  AbortOnError(inference->SelectTasks(1, std::vector<int>{3}));
+  llvm::Expected<std::vector<std::vector<OutputType>>> predictions =
+      RunBatch(*inference);
+  ASSERT_FALSE(static_cast<bool>(predictions));
+  EXPECT_THAT(llvm::toString(predictions.takeError()),
+              HasSubstr("Task 3 is out of range for the model at index 1"));
+}
+
+}  // namespace
+}  // namespace gematria
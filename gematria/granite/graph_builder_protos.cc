@@ -0,0 +1,196 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/granite/graph_builder_protos.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/types/span.h"
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/basic_block_protos.h"
+#include "gematria/granite/graph_builder.h"
+#include "gematria/io/tfrecord_reader.h"
+#include "gematria/proto/basic_block.pb.h"
+#include "gematria/proto/canonicalized_instruction.pb.h"
+#include "gematria/proto/throughput.pb.h"
+#include "google/protobuf/arena.h"
+#include "google/protobuf/repeated_field.h"
+#include "google/protobuf/repeated_ptr_field.h"
+
+namespace gematria {
+namespace {
+
+using InstructionView = BasicBlockGraphBuilder::InstructionView;
+using IntListView = BasicBlockGraphBuilder::IntListView;
+using OperandView = BasicBlockGraphBuilder::OperandView;
+using RegisterView = BasicBlockGraphBuilder::RegisterView;
+using StringListView = BasicBlockGraphBuilder::StringListView;
+
+StringListView ToView(
+    const google::protobuf::RepeatedPtrField<std::string>& strings) {
+  return StringListView(strings.data(), strings.size());
+}
+
+IntListView ToView(const google::protobuf::RepeatedField<int>& values) {
+  return IntListView(values.data(), values.size());
+}
+
+void MakeOperandView(const CanonicalizedOperandProto& proto,
+                     OperandView& view) {
+  view = OperandView();
+  switch (proto.operand_case()) {
+    case CanonicalizedOperandProto::OPERAND_NOT_SET:
+      view.type = OperandType::kUnknown;
+      break;
+    case CanonicalizedOperandProto::kRegisterName:
+      view.type = OperandType::kRegister;
+      view.register_operand.name = proto.register_name();
+      break;
+    case CanonicalizedOperandProto::kImmediateValue:
+      view.type = OperandType::kImmediateValue;
+      break;
+    case CanonicalizedOperandProto::kFpImmediateValue:
+      view.type = OperandType::kFpImmediateValue;
+      break;
+    case CanonicalizedOperandProto::kAddress: {
+      const CanonicalizedOperandProto::AddressTuple& address = proto.address();
+      view.type = OperandType::kAddress;
+      view.base_register = {
+          address.base_register(),
+          ToView(address.base_register_intefered_register()),
+          ToView(address.base_register_intefered_register_sizes())};
+      view.index_register = {
+          address.index_register(),
+          ToView(address.index_register_intefered_register()),
+          ToView(address.index_register_intefered_register_sizes())};
+      view.segment_register = {
+          address.segment(), ToView(address.segment_intefered_register()),
+          ToView(address.segment_intefered_register_sizes())};
+      view.displacement = address.displacement();
+    } break;
+    case CanonicalizedOperandProto::kMemory:
+      view.type = OperandType::kMemory;
+      view.alias_group_id = proto.memory().alias_group_id();
+      break;
+    case CanonicalizedOperandProto::kVirtualRegister:
+      view.type = OperandType::kVirtualRegister;
+      view.register_operand = {proto.virtual_register().name(),
+                               ToView(proto.intefered_register()),
+                               ToView(proto.intefered_register_sizes())};
+      view.register_size = proto.virtual_register().size();
+      break;
+  }
+}
+
+void MakeOperandViews(
+    const google::protobuf::RepeatedPtrField<CanonicalizedOperandProto>&
+        protos,
+    std::vector<OperandView>& views) {
+  views.resize(protos.size());
+  for (int i = 0; i < protos.size(); ++i) {
+    MakeOperandView(protos[i], views[i]);
+  }
+}
+
+}  // namespace
+
+bool AddBasicBlockFromProto(const BasicBlockProto& proto,
+                            BasicBlockGraphBuilder& graph_builder) {
+  // Block deduplication uses fingerprints computed from BasicBlock objects.
+  if (graph_builder.deduplicate_blocks()) {
+    return graph_builder.AddBasicBlock(BasicBlockFromProto(proto));
+  }
+  const auto& instructions = proto.canonicalized_instructions();
+  return graph_builder.AddBasicBlockFromInstructionViews(
+      instructions.size(), [&instructions](int index, InstructionView& view) {
+        const CanonicalizedInstructionProto& instruction = instructions[index];
+        view.mnemonic = instruction.mnemonic();
+        view.mnemonic_symbol = kInvalidSymbol;
+        view.prefixes = ToView(instruction.prefixes());
+        MakeOperandViews(instruction.input_operands(), view.input_operands);
+        MakeOperandViews(instruction.implicit_input_operands(),
+                         view.implicit_input_operands);
+        MakeOperandViews(instruction.output_operands(), view.output_operands);
+        MakeOperandViews(instruction.implicit_output_operands(),
+                         view.implicit_output_operands);
+      });
+}
+
+absl::StatusOr<std::vector<bool>> AddBasicBlocksFromSerializedProtos(
+    absl::Span<const std::string_view> serialized_protos,
+    BasicBlockGraphBuilder& graph_builder) {
+  std::vector<bool> results;
+  results.reserve(serialized_protos.size());
+  google::protobuf::Arena arena;
+  for (const std::string_view serialized_proto : serialized_protos) {
+    const BasicBlockProto* const proto =
+        ParseProtoOnArena<BasicBlockProto>(serialized_proto, arena);
+    if (proto == nullptr) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Could not parse BasicBlockProto at index ", results.size()));
+    }
+    results.push_back(AddBasicBlockFromProto(*proto, graph_builder));
+    arena.Reset();
+  }
+  return results;
+}
+
+absl::StatusOr<std::vector<bool>> AddBasicBlocksFromTFRecordFile(
+    std::string_view file_name, int64_t first_record, int64_t num_records,
+    BasicBlockGraphBuilder& graph_builder) {
+  if (first_record < 0) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("first_record must not be negative, was ", first_record));
+  }
+  absl::StatusOr<std::unique_ptr<TFRecordReader>> reader =
+      TFRecordReader::Open(file_name);
+  if (!reader.ok()) return reader.status();
+
+  std::string record;
+  for (int64_t i = 0; i < first_record; ++i) {
+    absl::StatusOr<bool> has_record = (*reader)->Read(record);
+    if (!has_record.ok()) return has_record.status();
+    if (!*has_record) return std::vector<bool>();
+  }
+
+  std::vector<bool> results;
+  if (num_records > 0) results.reserve(num_records);
+  google::protobuf::Arena arena;
+  while (num_records < 0 ||
+         static_cast<int64_t>(results.size()) < num_records) {
+    absl::StatusOr<bool> has_record = (*reader)->Read(record);
+    if (!has_record.ok()) return has_record.status();
+    if (!*has_record) break;
+    const BasicBlockWithThroughputProto* const proto =
+        ParseProtoOnArena<BasicBlockWithThroughputProto>(record, arena);
+    if (proto == nullptr) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Could not parse record ", (*reader)->num_records() - 1,
+                       " of ", file_name, " as BasicBlockWithThroughputProto"));
+    }
+    results.push_back(
+        AddBasicBlockFromProto(proto->basic_block(), graph_builder));
+    arena.Reset();
+  }
+  return results;
+}
+
+}  // namespace gematria
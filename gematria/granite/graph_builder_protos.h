@@ -0,0 +1,64 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Functions for adding basic blocks to a BasicBlockGraphBuilder directly from
+// protos. They are kept in a separate library so that the graph builder itself
+// does not depend on protos.
+
+#ifndef GEMATRIA_GRANITE_GRAPH_BUILDER_PROTOS_H_
+#define GEMATRIA_GRANITE_GRAPH_BUILDER_PROTOS_H_
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include "absl/status/statusor.h"
+#include "absl/types/span.h"
+#include "gematria/granite/graph_builder.h"
+#include "gematria/proto/basic_block.pb.h"
+
+namespace gematria {
+
+// Adds the basic block from `proto` to `graph_builder`. This is equivalent to
+// graph_builder.AddBasicBlock(BasicBlockFromProto(proto)), but unless block
+// deduplication is enabled, the nodes and edges are created directly from the
+// fields of the proto, without copying them to a BasicBlock first. The proto
+// may be allocated on an arena. Returns the same value as AddBasicBlock().
+bool AddBasicBlockFromProto(const BasicBlockProto& proto,
+                            BasicBlockGraphBuilder& graph_builder);
+
+// Parses each element of `serialized_protos` as a BasicBlockProto and adds it
+// to `graph_builder` using AddBasicBlockFromProto(). The protos are parsed on
+// an arena that is reused for all of them. Returns the values returned by
+// AddBasicBlockFromProto() for the blocks, in the order of
+// `serialized_protos`. Returns an error when one of the protos can't be
+// parsed; the blocks before it remain in `graph_builder`.
+absl::StatusOr<std::vector<bool>> AddBasicBlocksFromSerializedProtos(
+    absl::Span<const std::string_view> serialized_protos,
+    BasicBlockGraphBuilder& graph_builder);
+
+// Reads the records of the .tfrecord file `file_name` with indices
+// [first_record, first_record + num_records), parses them as
+// BasicBlockWithThroughputProto, and adds their basic blocks to
+// `graph_builder` as AddBasicBlocksFromSerializedProtos() does. When
+// `num_records` is negative, reads all records from `first_record` to the end
+// of the file; the range may also end beyond the end of the file. Returns an
+// error when the file can't be read or a record can't be parsed.
+absl::StatusOr<std::vector<bool>> AddBasicBlocksFromTFRecordFile(
+    std::string_view file_name, int64_t first_record, int64_t num_records,
+    BasicBlockGraphBuilder& graph_builder);
+
+}  // namespace gematria
+
+#endif  // GEMATRIA_GRANITE_GRAPH_BUILDER_PROTOS_H_
@@ -0,0 +1,325 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/granite/graph_builder_protos.h"
+
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "gematria/basic_block/basic_block_protos.h"
+#include "gematria/granite/graph_builder.h"
+#include "gematria/io/tfrecord_writer.h"
+#include "gematria/model/oov_token_behavior.h"
+#include "gematria/proto/basic_block.pb.h"
+#include "gematria/proto/throughput.pb.h"
+#include "gematria/testing/matchers.h"
+#include "gematria/testing/parse_proto.h"
+#include "gmock/gmock.h"
+#include "google/protobuf/arena.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+using ::testing::Not;
+
+constexpr absl::string_view kImmediateToken = "_IMMEDIATE_";
+constexpr absl::string_view kFpImmediateToken = "_FP_IMMEDIATE_";
+constexpr absl::string_view kAddressToken = "_ADDRESS_";
+constexpr absl::string_view kMemoryToken = "_MEMORY_";
+constexpr absl::string_view kTokens[] = {
+    kImmediateToken, kFpImmediateToken, kAddressToken, kMemoryToken,
+    "COPY",          "LEA",             "LOCK",        "MOV",
+    "MOV32rm",       "MOV64mr",         "NOT",         "RAX",
+    "RBP",           "RBX",             "RDI",         "_VREG32_",
+    "_VREG64_"};
+
+constexpr absl::string_view kX86BasicBlock = R"pb(
+  canonicalized_instructions {
+    mnemonic: "LEA"
+    llvm_mnemonic: "LEA64r"
+    output_operands { register_name: "RDI" }
+    input_operands {
+      address { base_register: "RBX" index_register: "RAX" displacement: 8 }
+    }
+  }
+  canonicalized_instructions {
+    mnemonic: "NOT"
+    llvm_mnemonic: "NOT64m"
+    prefixes: "LOCK"
+    output_operands { memory { alias_group_id: 1 } }
+    input_operands { memory { alias_group_id: 1 } }
+    input_operands { address { base_register: "RDI" scaling: 1 } }
+  }
+  canonicalized_instructions {
+    mnemonic: "MOV"
+    llvm_mnemonic: "MOV64ri"
+    output_operands { register_name: "RAX" }
+    input_operands { immediate_value: 1 }
+  }
+)pb";
+
+constexpr absl::string_view kVirtualRegisterBasicBlock = R"pb(
+  canonicalized_instructions {
+    mnemonic: "COPY"
+    llvm_mnemonic: "COPY"
+    output_operands {
+      virtual_register { name: "%0" size: 64 }
+      intefered_register: "%1"
+      intefered_register: "RDI"
+      intefered_register_sizes: 32
+      intefered_register_sizes: 64
+    }
+    input_operands { register_name: "RDI" }
+  }
+  canonicalized_instructions {
+    mnemonic: "MOV64mr"
+    llvm_mnemonic: "MOV64mr"
+    output_operands { memory { alias_group_id: 1 } }
+    input_operands { address { base_register: "RBP" scaling: 1 } }
+    input_operands {
+      virtual_register { name: "%0" size: 64 }
+      intefered_register: "%1"
+      intefered_register_sizes: 32
+    }
+  }
+  canonicalized_instructions {
+    mnemonic: "MOV32rm"
+    llvm_mnemonic: "MOV32rm"
+    output_operands {
+      virtual_register { name: "%1" size: 32 }
+      intefered_register: "%0"
+      intefered_register_sizes: 64
+    }
+    input_operands { memory { alias_group_id: 1 } }
+    input_operands {
+      address {
+        base_register: "%2"
+        base_register_size: 64
+        base_register_intefered_register: "%0"
+        base_register_intefered_register_sizes: 64
+        scaling: 1
+      }
+    }
+  }
+)pb";
+
+std::unique_ptr<BasicBlockGraphBuilder> CreateBuilder(
+    OutOfVocabularyTokenBehavior out_of_vocabulary_behavior) {
+  return std::make_unique<BasicBlockGraphBuilder>(
+      std::vector<std::string>(std::begin(kTokens), std::end(kTokens)),
+      /*immediate_token =*/kImmediateToken,
+      /*fp_immediate_token =*/kFpImmediateToken,
+      /*address_token =*/kAddressToken,
+      /*memory_token =*/kMemoryToken, out_of_vocabulary_behavior);
+}
+
+// Checks that `actual` contains the same graphs as `expected`.
+void ExpectSameGraphs(const BasicBlockGraphBuilder& actual,
+                      const BasicBlockGraphBuilder& expected) {
+  EXPECT_EQ(actual.num_blocks(), expected.num_blocks());
+  EXPECT_EQ(actual.num_graphs(), expected.num_graphs());
+  EXPECT_EQ(actual.num_nodes_per_block(), expected.num_nodes_per_block());
+  EXPECT_EQ(actual.num_edges_per_block(), expected.num_edges_per_block());
+  EXPECT_EQ(actual.node_types(), expected.node_types());
+  EXPECT_EQ(actual.node_features(), expected.node_features());
+  EXPECT_EQ(actual.edge_senders(), expected.edge_senders());
+  EXPECT_EQ(actual.edge_receivers(), expected.edge_receivers());
+  EXPECT_EQ(actual.edge_types(), expected.edge_types());
+  EXPECT_EQ(actual.global_features_data(), expected.global_features_data());
+  EXPECT_EQ(actual.block_graph_indices(), expected.block_graph_indices());
+}
+
+TEST(AddBasicBlockFromProtoTest, SameGraphAsBasicBlock) {
+  for (const absl::string_view text_proto :
+       {kX86BasicBlock, kVirtualRegisterBasicBlock}) {
+    SCOPED_TRACE(text_proto);
+    const BasicBlockProto proto = ParseTextProto(std::string(text_proto));
+    auto expected = CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+    ASSERT_TRUE(expected->AddBasicBlock(BasicBlockFromProto(proto)));
+    ASSERT_TRUE(expected->AddBasicBlock(BasicBlockFromProto(proto)));
+
+    auto actual = CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+    ASSERT_TRUE(AddBasicBlockFromProto(proto, *actual));
+    ASSERT_TRUE(AddBasicBlockFromProto(proto, *actual));
+    ExpectSameGraphs(*actual, *expected);
+  }
+}
+
+TEST(AddBasicBlockFromProtoTest, ProtoOnArena) {
+  const BasicBlockProto proto = ParseTextProto(std::string(kX86BasicBlock));
+  google::protobuf::Arena arena;
+  const BasicBlockProto* const arena_proto =
+      ParseProtoOnArena<BasicBlockProto>(proto.SerializeAsString(), arena);
+  ASSERT_NE(arena_proto, nullptr);
+
+  auto expected = CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  ASSERT_TRUE(expected->AddBasicBlock(BasicBlockFromProto(proto)));
+  auto actual = CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  ASSERT_TRUE(AddBasicBlockFromProto(*arena_proto, *actual));
+  ExpectSameGraphs(*actual, *expected);
+}
+
+TEST(AddBasicBlockFromProtoTest, OutOfVocabularyToken) {
+  const BasicBlockProto proto = ParseTextProto(std::string(kX86BasicBlock));
+  const BasicBlockProto invalid_proto = ParseTextProto(R"pb(
+    canonicalized_instructions {
+      mnemonic: "MOV"
+      llvm_mnemonic: "MOV64rr"
+      output_operands { register_name: "RAX" }
+      input_operands { register_name: "R15" }
+    }
+  )pb");
+
+  auto builder = CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  ASSERT_TRUE(AddBasicBlockFromProto(proto, *builder));
+  EXPECT_FALSE(AddBasicBlockFromProto(invalid_proto, *builder));
+  EXPECT_FALSE(AddBasicBlockFromProto(BasicBlockProto(), *builder));
+
+  // The failed blocks did not change the state of the graph builder.
+  auto expected = CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  ASSERT_TRUE(expected->AddBasicBlock(BasicBlockFromProto(proto)));
+  ExpectSameGraphs(*builder, *expected);
+}
+
+TEST(AddBasicBlockFromProtoTest, WithDeduplication) {
+  const BasicBlockProto proto = ParseTextProto(std::string(kX86BasicBlock));
+  auto builder = CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  builder->SetDeduplicateBlocks(true);
+  ASSERT_TRUE(AddBasicBlockFromProto(proto, *builder));
+  ASSERT_TRUE(AddBasicBlockFromProto(proto, *builder));
+  EXPECT_EQ(builder->num_blocks(), 2);
+  EXPECT_EQ(builder->num_graphs(), 1);
+  EXPECT_THAT(builder->block_graph_indices(), ElementsAre(0, 0));
+}
+
+constexpr absl::string_view kOutOfVocabularyBasicBlock = R"pb(
+  canonicalized_instructions {
+    mnemonic: "MOV"
+    llvm_mnemonic: "MOV64rr"
+    output_operands { register_name: "RAX" }
+    input_operands { register_name: "R15" }
+  }
+)pb";
+
+TEST(AddBasicBlocksFromSerializedProtosTest, AddsAllBlocks) {
+  const BasicBlockProto proto = ParseTextProto(std::string(kX86BasicBlock));
+  const BasicBlockProto virtual_register_proto =
+      ParseTextProto(std::string(kVirtualRegisterBasicBlock));
+  const BasicBlockProto invalid_proto =
+      ParseTextProto(std::string(kOutOfVocabularyBasicBlock));
+  const std::string serialized[] = {proto.SerializeAsString(),
+                                    invalid_proto.SerializeAsString(),
+                                    virtual_register_proto.SerializeAsString()};
+  const std::vector<std::string_view> views(std::begin(serialized),
+                                            std::end(serialized));
+
+  auto builder = CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  EXPECT_THAT(AddBasicBlocksFromSerializedProtos(views, *builder),
+              IsOkAndHolds(ElementsAre(true, false, true)));
+
+  auto expected = CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  ASSERT_TRUE(expected->AddBasicBlock(BasicBlockFromProto(proto)));
+  ASSERT_TRUE(
+      expected->AddBasicBlock(BasicBlockFromProto(virtual_register_proto)));
+  ExpectSameGraphs(*builder, *expected);
+}
+
+TEST(AddBasicBlocksFromSerializedProtosTest, InvalidProto) {
+  const std::string_view serialized[] = {"\xff\xff\xff"};
+  auto builder = CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  EXPECT_THAT(AddBasicBlocksFromSerializedProtos(serialized, *builder),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_EQ(builder->num_blocks(), 0);
+}
+
+class AddBasicBlocksFromTFRecordFileTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    const ::testing::TestInfo* const test_info =
+        ::testing::UnitTest::GetInstance()->current_test_info();
+    file_name_ = ::testing::TempDir() + "/" + test_info->name() + ".tfrecord";
+  }
+
+  // Writes `blocks` to `file_name_`, each of them wrapped in a
+  // BasicBlockWithThroughputProto.
+  void WriteBlocks(const std::vector<BasicBlockProto>& blocks) {
+    absl::StatusOr<std::unique_ptr<TFRecordWriter>> writer =
+        TFRecordWriter::Open(file_name_);
+    ASSERT_OK(writer);
+    for (const BasicBlockProto& block : blocks) {
+      BasicBlockWithThroughputProto proto;
+      *proto.mutable_basic_block() = block;
+      ASSERT_THAT((*writer)->Write(proto.SerializeAsString()), IsOk());
+    }
+    ASSERT_THAT((*writer)->Close(), IsOk());
+  }
+
+  std::string file_name_;
+};
+
+TEST_F(AddBasicBlocksFromTFRecordFileTest, ReadsRange) {
+  const BasicBlockProto proto = ParseTextProto(std::string(kX86BasicBlock));
+  const BasicBlockProto virtual_register_proto =
+      ParseTextProto(std::string(kVirtualRegisterBasicBlock));
+  const BasicBlockProto invalid_proto =
+      ParseTextProto(std::string(kOutOfVocabularyBasicBlock));
+  WriteBlocks({proto, invalid_proto, virtual_register_proto, proto});
+
+  auto builder = CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  EXPECT_THAT(AddBasicBlocksFromTFRecordFile(file_name_, /*first_record=*/1,
+                                             /*num_records=*/2, *builder),
+              IsOkAndHolds(ElementsAre(false, true)));
+
+  auto expected = CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  ASSERT_TRUE(
+      expected->AddBasicBlock(BasicBlockFromProto(virtual_register_proto)));
+  ExpectSameGraphs(*builder, *expected);
+}
+
+TEST_F(AddBasicBlocksFromTFRecordFileTest, ReadsToEndOfFile) {
+  const BasicBlockProto proto = ParseTextProto(std::string(kX86BasicBlock));
+  WriteBlocks({proto, proto, proto});
+
+  auto builder = CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  EXPECT_THAT(AddBasicBlocksFromTFRecordFile(file_name_, /*first_record=*/1,
+                                             /*num_records=*/-1, *builder),
+              IsOkAndHolds(ElementsAre(true, true)));
+  EXPECT_THAT(AddBasicBlocksFromTFRecordFile(file_name_, /*first_record=*/2,
+                                             /*num_records=*/10, *builder),
+              IsOkAndHolds(ElementsAre(true)));
+  EXPECT_THAT(AddBasicBlocksFromTFRecordFile(file_name_, /*first_record=*/5,
+                                             /*num_records=*/10, *builder),
+              IsOkAndHolds(IsEmpty()));
+  EXPECT_EQ(builder->num_blocks(), 3);
+}
+
+TEST_F(AddBasicBlocksFromTFRecordFileTest, MissingFile) {
+  auto builder = CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  EXPECT_THAT(AddBasicBlocksFromTFRecordFile(file_name_, /*first_record=*/0,
+                                             /*num_records=*/-1, *builder),
+              Not(IsOk()));
+}
+
+}  // namespace
+}  // namespace gematria
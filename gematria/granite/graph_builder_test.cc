@@ -15,16 +15,21 @@
 #include "gematria/granite/graph_builder.h"
 
 #include <algorithm>
+#include <cstdint>
 #include <iostream>
 #include <iterator>
 #include <memory>
+#include <optional>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "absl/strings/string_view.h"
 #include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/basic_block_edits.h"
 #include "gematria/basic_block/basic_block_protos.h"
+#include "gematria/basic_block/compact_basic_block.h"
+#include "gematria/basic_block/symbol_table.h"
 #include "gematria/model/oov_token_behavior.h"
 #include "gematria/proto/basic_block.pb.h"
 #include "gematria/testing/parse_proto.h"
@@ -530,6 +535,465 @@ TEST_F(BasicBlockGraphBuilderTest, MultipleBasicBlocks) {
   EXPECT_THAT(builder_->DeltaBlockIndex(), ElementsAre(0, 1));
 }
 
+TEST_F(BasicBlockGraphBuilderTest, RemoveLastBasicBlock) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  ASSERT_TRUE(builder_->AddBasicBlock(BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "NOT"
+      llvm_mnemonic: "NOT64r"
+      output_operands: { register_name: "RCX" }
+      input_operands: { register_name: "RCX" }
+    })pb"))));
+  ASSERT_TRUE(builder_->AddBasicBlock(BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "MOV"
+      llvm_mnemonic: "MOV64rr"
+      output_operands: { register_name: "RAX" }
+      input_operands: { register_name: "RCX" }
+    }
+    canonicalized_instructions: {
+      mnemonic: "NOT"
+      llvm_mnemonic: "NOT64r"
+      output_operands: { register_name: "RAX" }
+      input_operands: { register_name: "RAX" }
+    })pb"))));
+  ASSERT_EQ(builder_->num_graphs(), 2);
+
+  builder_->RemoveLastBasicBlock();
+
+  EXPECT_EQ(builder_->num_graphs(), 1);
+  EXPECT_EQ(builder_->num_nodes(), 3);
+  EXPECT_EQ(builder_->num_edges(), 2);
+  EXPECT_THAT(builder_->num_nodes_per_block(), ElementsAre(3));
+  EXPECT_THAT(builder_->num_edges_per_block(), ElementsAre(2));
+  EXPECT_THAT(builder_->node_types(),
+              ElementsAre(NodeType::kInstruction, NodeType::kRegister,
+                          NodeType::kRegister));
+  EXPECT_THAT(builder_->node_features(),
+              ElementsAre(TokenIndex("NOT"), TokenIndex("RCX"),
+                          TokenIndex("RCX")));
+  EXPECT_THAT(builder_->edge_senders(), ElementsAre(1, 0));
+  EXPECT_THAT(builder_->edge_receivers(), ElementsAre(0, 2));
+  EXPECT_THAT(
+      builder_->global_features(),
+      ElementsAre(ElementsAre(0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 2, 0, 0, 0, 0)));
+
+  // The graph builder can be used to add more basic blocks.
+  ASSERT_TRUE(builder_->AddBasicBlock(BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "NOT"
+      llvm_mnemonic: "NOT64r"
+      output_operands: { register_name: "RCX" }
+      input_operands: { register_name: "RCX" }
+    })pb"))));
+  EXPECT_THAT(builder_->num_nodes_per_block(), ElementsAre(3, 3));
+  EXPECT_THAT(builder_->edge_senders(), ElementsAre(1, 0, 4, 3));
+  EXPECT_THAT(builder_->DeltaBlockIndex(), ElementsAre(0, 1));
+}
+
+TEST_F(BasicBlockGraphBuilderTest, CopyOutlivesOriginal) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  auto copy = std::make_unique<BasicBlockGraphBuilder>(*builder_);
+  builder_.reset();
+
+  ASSERT_TRUE(copy->AddBasicBlock(BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "NOT"
+      llvm_mnemonic: "NOT64r"
+      output_operands: { register_name: "RCX" }
+      input_operands: { register_name: "RCX" }
+    })pb"))));
+  EXPECT_EQ(copy->num_node_tokens(), std::size(kTokens));
+  EXPECT_THAT(copy->node_features(),
+              ElementsAre(TokenIndex("NOT"), TokenIndex("RCX"),
+                          TokenIndex("RCX")));
+}
+
+TEST_F(BasicBlockGraphBuilderTest, HasSameVocabulary) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  const BasicBlockGraphBuilder copy(*builder_);
+  EXPECT_TRUE(builder_->HasSameVocabulary(copy));
+
+  // A graph builder created separately from the same tokens.
+  std::vector<std::string> tokens(std::begin(kTokens), std::end(kTokens));
+  const BasicBlockGraphBuilder same_tokens(
+      tokens, kImmediateToken, kFpImmediateToken, kAddressToken, kMemoryToken,
+      OutOfVocabularyTokenBehavior::ReturnError());
+  EXPECT_TRUE(builder_->HasSameVocabulary(same_tokens));
+
+  const BasicBlockGraphBuilder replace_token(
+      tokens, kImmediateToken, kFpImmediateToken, kAddressToken, kMemoryToken,
+      OutOfVocabularyTokenBehavior::ReplaceWithToken(
+          std::string(kUnknownToken)));
+  EXPECT_FALSE(builder_->HasSameVocabulary(replace_token));
+
+  std::swap(tokens[5], tokens[6]);
+  const BasicBlockGraphBuilder different_order(
+      tokens, kImmediateToken, kFpImmediateToken, kAddressToken, kMemoryToken,
+      OutOfVocabularyTokenBehavior::ReturnError());
+  EXPECT_FALSE(builder_->HasSameVocabulary(different_order));
+}
+
+TEST_F(BasicBlockGraphBuilderTest, InternedSymbols) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  auto symbols = std::make_shared<SymbolTable>();
+  builder_->SetSymbolTable(symbols);
+
+  BasicBlock block = BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "MOV"
+      llvm_mnemonic: "MOV64rr"
+      output_operands: { register_name: "RAX" }
+      input_operands: { register_name: "RBX" }
+    }
+    canonicalized_instructions: {
+      mnemonic: "NOT"
+      llvm_mnemonic: "NOT64r"
+      output_operands: { register_name: "RAX" }
+      input_operands: { register_name: "RAX" }
+    })pb"));
+  InternSymbols(*symbols, block);
+  // Add the block twice, so that the second time uses the cached tokens.
+  ASSERT_TRUE(builder_->AddBasicBlock(block));
+  ASSERT_TRUE(builder_->AddBasicBlock(block));
+  EXPECT_THAT(builder_->node_features(),
+              ElementsAre(TokenIndex("MOV"), TokenIndex("RBX"),
+                          TokenIndex("RAX"), TokenIndex("NOT"),
+                          TokenIndex("RAX"), TokenIndex("MOV"),
+                          TokenIndex("RBX"), TokenIndex("RAX"),
+                          TokenIndex("NOT"), TokenIndex("RAX")));
+
+  // Symbols that are not in the vocabulary are still rejected.
+  BasicBlock unknown_block = BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: { mnemonic: "FOOBAR" llvm_mnemonic: "FOO" }
+  )pb"));
+  InternSymbols(*symbols, unknown_block);
+  EXPECT_FALSE(builder_->AddBasicBlock(unknown_block));
+  EXPECT_FALSE(builder_->AddBasicBlock(unknown_block));
+  EXPECT_EQ(builder_->num_graphs(), 2);
+}
+
+TEST_F(BasicBlockGraphBuilderTest, AddBasicBlocksInParallel) {
+  const BasicBlock blocks[] = {
+      BasicBlockFromProto(ParseTextProto(R"pb(
+        canonicalized_instructions: {
+          mnemonic: "NOT"
+          llvm_mnemonic: "NOT64r"
+          output_operands: { register_name: "RCX" }
+          input_operands: { register_name: "RCX" }
+        })pb")),
+      BasicBlockFromProto(ParseTextProto(R"pb(
+        canonicalized_instructions: {
+          mnemonic: "ThisInstructionDoesNotExist"
+          llvm_mnemonic: "FOO"
+        })pb")),
+      BasicBlockFromProto(ParseTextProto(R"pb(
+        canonicalized_instructions: {
+          mnemonic: "MOV"
+          llvm_mnemonic: "MOV64rr"
+          output_operands: { register_name: "RAX" }
+          input_operands: { register_name: "RBX" }
+        }
+        canonicalized_instructions: {
+          mnemonic: "NOT"
+          llvm_mnemonic: "NOT64r"
+          output_operands: { register_name: "RAX" }
+          input_operands: { register_name: "RAX" }
+        })pb"))};
+  std::vector<BasicBlock> many_blocks;
+  std::vector<bool> expected_added;
+  for (int i = 0; i < 50; ++i) {
+    many_blocks.push_back(blocks[i % std::size(blocks)]);
+    expected_added.push_back(i % std::size(blocks) != 1);
+  }
+
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  for (const int num_threads : {1, 4, 100}) {
+    SCOPED_TRACE(num_threads);
+    builder_->Reset();
+    // Add one block up front, to check that the shards are appended after the
+    // existing contents of the batch.
+    ASSERT_TRUE(builder_->AddBasicBlock(blocks[0]));
+    EXPECT_EQ(builder_->AddBasicBlocksInParallel(many_blocks, num_threads),
+              expected_added);
+
+    BasicBlockGraphBuilder expected_builder(*builder_);
+    expected_builder.Reset();
+    ASSERT_TRUE(expected_builder.AddBasicBlock(blocks[0]));
+    for (const BasicBlock& block : many_blocks) {
+      expected_builder.AddBasicBlock(block);
+    }
+
+    EXPECT_EQ(builder_->num_nodes_per_block(),
+              expected_builder.num_nodes_per_block());
+    EXPECT_EQ(builder_->num_edges_per_block(),
+              expected_builder.num_edges_per_block());
+    EXPECT_EQ(builder_->node_types(), expected_builder.node_types());
+    EXPECT_EQ(builder_->node_features(), expected_builder.node_features());
+    EXPECT_EQ(builder_->edge_senders(), expected_builder.edge_senders());
+    EXPECT_EQ(builder_->edge_receivers(), expected_builder.edge_receivers());
+    EXPECT_EQ(builder_->edge_types(), expected_builder.edge_types());
+    EXPECT_EQ(builder_->global_features(), expected_builder.global_features());
+  }
+}
+
+TEST_F(BasicBlockGraphBuilderTest, DeduplicateBlocks) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  builder_->SetDeduplicateBlocks(true);
+  const BasicBlock not_block = BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "NOT"
+      llvm_mnemonic: "NOT64r"
+      output_operands: { register_name: "RCX" }
+      input_operands: { register_name: "RCX" }
+    })pb"));
+  const BasicBlock mov_block = BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "MOV"
+      llvm_mnemonic: "MOV64rr"
+      output_operands: { register_name: "RAX" }
+      input_operands: { register_name: "RBX" }
+    })pb"));
+
+  ASSERT_TRUE(builder_->AddBasicBlock(not_block));
+  ASSERT_TRUE(builder_->AddBasicBlock(not_block));
+  ASSERT_TRUE(builder_->AddBasicBlock(mov_block));
+  ASSERT_TRUE(builder_->AddBasicBlock(not_block));
+  EXPECT_EQ(builder_->num_blocks(), 4);
+  EXPECT_EQ(builder_->num_graphs(), 2);
+  EXPECT_THAT(builder_->block_graph_indices(), ElementsAre(0, 0, 1, 0));
+  EXPECT_THAT(builder_->num_nodes_per_block(), ElementsAre(3, 3));
+  EXPECT_THAT(builder_->node_features(),
+              ElementsAre(TokenIndex("NOT"), TokenIndex("RCX"),
+                          TokenIndex("RCX"), TokenIndex("MOV"),
+                          TokenIndex("RBX"), TokenIndex("RAX")));
+
+  // Removing a duplicate does not remove its graph.
+  builder_->RemoveLastBasicBlock();
+  EXPECT_THAT(builder_->block_graph_indices(), ElementsAre(0, 0, 1));
+  EXPECT_EQ(builder_->num_graphs(), 2);
+  builder_->RemoveLastBasicBlock();
+  EXPECT_THAT(builder_->block_graph_indices(), ElementsAre(0, 0));
+  EXPECT_EQ(builder_->num_graphs(), 1);
+  builder_->RemoveLastBasicBlock();
+  EXPECT_THAT(builder_->block_graph_indices(), ElementsAre(0));
+  EXPECT_EQ(builder_->num_graphs(), 1);
+
+  // The removed graph is built again when its basic block is added again.
+  ASSERT_TRUE(builder_->AddBasicBlock(mov_block));
+  EXPECT_THAT(builder_->block_graph_indices(), ElementsAre(0, 1));
+  EXPECT_EQ(builder_->num_graphs(), 2);
+
+  builder_->Reset();
+  EXPECT_EQ(builder_->num_blocks(), 0);
+  ASSERT_TRUE(builder_->AddBasicBlock(mov_block));
+  EXPECT_THAT(builder_->block_graph_indices(), ElementsAre(0));
+}
+
+TEST_F(BasicBlockGraphBuilderTest, EditedBasicBlocks) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  builder_->SetDeduplicateBlocks(true);
+  const BasicBlock block = BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "NOT"
+      llvm_mnemonic: "NOT64r"
+      output_operands: { register_name: "RCX" }
+      input_operands: { register_name: "RCX" }
+    }
+    canonicalized_instructions: {
+      mnemonic: "MOV"
+      llvm_mnemonic: "MOV64rr"
+      output_operands: { register_name: "RAX" }
+      input_operands: { register_name: "RBX" }
+    })pb"));
+  const std::optional<std::vector<const Instruction*>> swapped =
+      ApplyBasicBlockEdits(block.instructions, {BasicBlockEdit::Move(1, 0)});
+  ASSERT_TRUE(swapped.has_value());
+
+  ASSERT_TRUE(builder_->AddBasicBlockFromInstructionPointers(*swapped));
+  EXPECT_THAT(builder_->node_features(),
+              ElementsAre(TokenIndex("MOV"), TokenIndex("RBX"),
+                          TokenIndex("RAX"), TokenIndex("NOT"),
+                          TokenIndex("RCX"), TokenIndex("RCX")));
+
+  // An edited block is a duplicate of a basic block with copies of the same
+  // instructions, and vice versa.
+  ASSERT_TRUE(builder_->AddBasicBlock(
+      BasicBlock({block.instructions[1], block.instructions[0]})));
+  ASSERT_TRUE(builder_->AddBasicBlock(block));
+  ASSERT_TRUE(builder_->AddBasicBlockFromInstructionPointers(
+      std::vector<const Instruction*>{&block.instructions[0],
+                                      &block.instructions[1]}));
+  EXPECT_THAT(builder_->block_graph_indices(), ElementsAre(0, 0, 1, 1));
+
+  EXPECT_FALSE(builder_->AddBasicBlockFromInstructionPointers(
+      std::vector<const Instruction*>()));
+}
+
+TEST_F(BasicBlockGraphBuilderTest, WriteToBuffers) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  ASSERT_TRUE(builder_->AddBasicBlock(BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "NOT"
+      llvm_mnemonic: "NOT64r"
+      output_operands: { register_name: "RCX" }
+      input_operands: { register_name: "RCX" }
+    })pb"))));
+  ASSERT_TRUE(builder_->AddBasicBlock(BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "MOV"
+      llvm_mnemonic: "MOV64rr"
+      output_operands: { register_name: "RAX" }
+      input_operands: { register_name: "RBX" }
+    }
+    canonicalized_instructions: {
+      mnemonic: "NOT"
+      llvm_mnemonic: "NOT64r"
+      output_operands: { register_name: "RAX" }
+      input_operands: { register_name: "RAX" }
+    })pb"))));
+
+  EXPECT_EQ(builder_->num_instructions(), 3);
+
+  std::vector<int> edge_features(builder_->num_edges());
+  builder_->WriteEdgeFeatures(edge_features.data());
+  EXPECT_EQ(edge_features, builder_->EdgeFeatures());
+
+  std::unique_ptr<bool[]> instruction_node_mask(
+      new bool[builder_->num_nodes()]);
+  builder_->WriteInstructionNodeMask(instruction_node_mask.get());
+  const std::vector<bool> expected_instruction_node_mask =
+      builder_->InstructionNodeMask();
+  for (int i = 0; i < builder_->num_nodes(); ++i) {
+    EXPECT_EQ(instruction_node_mask[i], expected_instruction_node_mask[i])
+        << "i = " << i;
+  }
+
+  std::vector<int> delta_block_index(builder_->num_instructions());
+  builder_->WriteDeltaBlockIndex(delta_block_index.data());
+  EXPECT_THAT(delta_block_index, ElementsAre(0, 1, 1));
+
+  std::vector<int> global_features(builder_->num_graphs() *
+                                   builder_->num_node_tokens());
+  builder_->WriteGlobalFeatures(global_features.data());
+  std::vector<int> expected_global_features;
+  for (const std::vector<int>& row : builder_->global_features()) {
+    expected_global_features.insert(expected_global_features.end(),
+                                    row.begin(), row.end());
+  }
+  EXPECT_EQ(global_features, expected_global_features);
+  EXPECT_EQ(builder_->global_features_data(), expected_global_features);
+}
+
+TEST_F(BasicBlockGraphBuilderTest, DerivedDataAfterRemoveAndRollback) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  ASSERT_TRUE(builder_->AddBasicBlock(BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "NOT"
+      llvm_mnemonic: "NOT64r"
+      output_operands: { register_name: "RCX" }
+      input_operands: { register_name: "RCX" }
+    })pb"))));
+  const std::vector<int> edge_features = builder_->edge_features();
+  const std::vector<uint8_t> instruction_node_mask =
+      builder_->instruction_node_mask();
+  const std::vector<int> delta_block_index = builder_->delta_block_index();
+  EXPECT_THAT(instruction_node_mask, ElementsAre(1, 0, 0));
+  EXPECT_THAT(delta_block_index, ElementsAre(0));
+
+  ASSERT_TRUE(builder_->AddBasicBlock(BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "MOV"
+      llvm_mnemonic: "MOV64rr"
+      output_operands: { register_name: "RAX" }
+      input_operands: { register_name: "RBX" }
+    }
+    canonicalized_instructions: {
+      mnemonic: "NOT"
+      llvm_mnemonic: "NOT64r"
+      output_operands: { register_name: "RAX" }
+      input_operands: { register_name: "RAX" }
+    })pb"))));
+  EXPECT_THAT(builder_->delta_block_index(), ElementsAre(0, 1, 1));
+  builder_->RemoveLastBasicBlock();
+  EXPECT_EQ(builder_->edge_features(), edge_features);
+  EXPECT_EQ(builder_->instruction_node_mask(), instruction_node_mask);
+  EXPECT_EQ(builder_->delta_block_index(), delta_block_index);
+
+  // A block that is rejected in the middle leaves the data unchanged.
+  EXPECT_FALSE(builder_->AddBasicBlock(BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "NOT"
+      llvm_mnemonic: "NOT64r"
+      output_operands: { register_name: "RCX" }
+      input_operands: { register_name: "RCX" }
+    }
+    canonicalized_instructions: {
+      mnemonic: "ThisInstructionDoesNotExist"
+      llvm_mnemonic: "FOO"
+    })pb"))));
+  EXPECT_EQ(builder_->edge_features(), edge_features);
+  EXPECT_EQ(builder_->instruction_node_mask(), instruction_node_mask);
+  EXPECT_EQ(builder_->delta_block_index(), delta_block_index);
+}
+
+TEST_F(BasicBlockGraphBuilderTest, Reserve) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  const BasicBlock block = BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "LEA"
+      llvm_mnemonic: "LEA64r"
+      output_operands: { register_name: "RDI" }
+      input_operands: {
+        address: { base_register: "RBX" displacement: 8 scaling: 1 }
+      }
+    })pb"));
+  builder_->ReserveForBasicBlocks({block});
+  EXPECT_EQ(builder_->num_graphs(), 0);
+  EXPECT_EQ(builder_->num_nodes(), 0);
+
+  const int num_edges_capacity = builder_->edge_senders().capacity();
+  const int num_nodes_capacity = builder_->node_features().capacity();
+  ASSERT_TRUE(builder_->AddBasicBlock(block));
+  // The estimate is an upper bound, so adding the block did not reallocate.
+  EXPECT_EQ(builder_->edge_senders().capacity(), num_edges_capacity);
+  EXPECT_EQ(builder_->node_features().capacity(), num_nodes_capacity);
+
+  builder_->Reserve(10, 100, 100);
+  EXPECT_EQ(builder_->num_graphs(), 1);
+  EXPECT_THAT(builder_->node_features(),
+              ElementsAre(TokenIndex("LEA"), TokenIndex(kAddressToken),
+                          TokenIndex("RBX"), TokenIndex(kImmediateToken),
+                          TokenIndex("RDI")));
+}
+
+TEST_F(BasicBlockGraphBuilderTest, GlobalFeaturesCsr) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  ASSERT_TRUE(builder_->AddBasicBlock(BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "NOT"
+      llvm_mnemonic: "NOT64r"
+      output_operands: { register_name: "RCX" }
+      input_operands: { register_name: "RCX" }
+    })pb"))));
+  ASSERT_TRUE(builder_->AddBasicBlock(BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "MOV"
+      llvm_mnemonic: "MOV64rr"
+      output_operands: { register_name: "RAX" }
+      input_operands: { register_name: "RBX" }
+    })pb"))));
+
+  const BasicBlockGraphBuilder::SparseGlobalFeatures csr =
+      builder_->GlobalFeaturesCsr();
+  EXPECT_THAT(csr.row_offsets, ElementsAre(0, 2, 5));
+  EXPECT_THAT(csr.column_indices,
+              ElementsAre(TokenIndex("NOT"), TokenIndex("RCX"),
+                          TokenIndex("MOV"), TokenIndex("RAX"),
+                          TokenIndex("RBX")));
+  EXPECT_THAT(csr.values, ElementsAre(1, 2, 1, 1, 1));
+}
+
 TEST_F(BasicBlockGraphBuilderTest, TwoNops) {
   CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
   ASSERT_TRUE(builder_->AddBasicBlock(BasicBlockFromProto(ParseTextProto(R"pb(
@@ -613,5 +1077,175 @@ TEST_F(BasicBlockGraphBuilderTestVReg, VRegTest) {
   std::cerr << builder_->DebugString() << std::endl;
 }
 
+TEST_F(BasicBlockGraphBuilderTestVReg, InterferenceEdgesAreNotDuplicated) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  ASSERT_TRUE(builder_->AddBasicBlock(BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions {
+      mnemonic: "COPY"
+      llvm_mnemonic: "COPY"
+      output_operands {
+        virtual_register { name: "%0" size: 64 }
+        intefered_register: "%1"
+        intefered_register: "%1"
+        intefered_register_sizes: 64
+        intefered_register_sizes: 64
+      }
+      input_operands {
+        virtual_register { name: "%1" size: 64 }
+        intefered_register: "%0"
+        intefered_register_sizes: 64
+      }
+    }
+  )pb"))));
+  // The pair (%0, %1) is recorded once, i.e. with one edge in each direction,
+  // even though it appears three times in the basic block.
+  EXPECT_EQ(std::count(builder_->edge_types().begin(),
+                       builder_->edge_types().end(), EdgeType::kInterference),
+            2);
+}
+
+TEST_F(BasicBlockGraphBuilderTestVReg, NoLiveInfoIgnoresInterference) {
+  const BasicBlock block_with_interference =
+      BasicBlockFromProto(ParseTextProto(R"pb(
+        canonicalized_instructions {
+          mnemonic: "COPY"
+          llvm_mnemonic: "COPY"
+          output_operands {
+            virtual_register { name: "%0" size: 64 }
+            intefered_register: "%1"
+            intefered_register_sizes: 64
+          }
+          input_operands {
+            virtual_register { name: "%1" size: 64 }
+            intefered_register: "%0"
+            intefered_register_sizes: 64
+          }
+        }
+        canonicalized_instructions {
+          mnemonic: "MOV32rm"
+          llvm_mnemonic: "MOV32rm"
+          output_operands {
+            virtual_register { name: "%5" size: 32 }
+            intefered_register: "%0"
+            intefered_register_sizes: 64
+          }
+          input_operands { memory { alias_group_id: 1 } }
+          input_operands {
+            address {
+              base_register: "%6"
+              base_register_size: 64
+              base_register_intefered_register: "%0"
+              base_register_intefered_register_sizes: 64
+              scaling: 1
+            }
+          }
+        }
+      )pb"));
+  const BasicBlock block_without_interference =
+      BasicBlockFromProto(ParseTextProto(R"pb(
+        canonicalized_instructions {
+          mnemonic: "COPY"
+          llvm_mnemonic: "COPY"
+          output_operands { virtual_register { name: "%0" size: 64 } }
+          input_operands { virtual_register { name: "%1" size: 64 } }
+        }
+        canonicalized_instructions {
+          mnemonic: "MOV32rm"
+          llvm_mnemonic: "MOV32rm"
+          output_operands { virtual_register { name: "%5" size: 32 } }
+          input_operands { memory { alias_group_id: 1 } }
+          input_operands {
+            address {
+              base_register: "%6"
+              base_register_size: 64
+              scaling: 1
+            }
+          }
+        }
+      )pb"));
+
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  ASSERT_TRUE(builder_->AddBasicBlock(block_without_interference));
+  const std::vector<int> expected_node_features = builder_->node_features();
+  const std::vector<int> expected_edge_senders = builder_->edge_senders();
+  const std::vector<int> expected_edge_receivers = builder_->edge_receivers();
+  const std::vector<int> expected_edge_features = builder_->EdgeFeatures();
+
+  builder_->Reset();
+  ASSERT_TRUE(builder_->AddBasicBlock(block_with_interference));
+  EXPECT_GT(std::count(builder_->edge_types().begin(),
+                       builder_->edge_types().end(), EdgeType::kInterference),
+            0);
+
+  builder_->SetLiveInfoMode(LiveInfoMode::kNoLiveInfo);
+  EXPECT_EQ(builder_->live_info_mode(), LiveInfoMode::kNoLiveInfo);
+  EXPECT_EQ(builder_->num_graphs(), 0);
+  ASSERT_TRUE(builder_->AddBasicBlock(block_with_interference));
+  EXPECT_EQ(builder_->node_features(), expected_node_features);
+  EXPECT_EQ(builder_->edge_senders(), expected_edge_senders);
+  EXPECT_EQ(builder_->edge_receivers(), expected_edge_receivers);
+  EXPECT_EQ(builder_->EdgeFeatures(), expected_edge_features);
+}
+
+TEST_F(BasicBlockGraphBuilderTestVReg, CompactBasicBlock) {
+  const BasicBlock block = BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions {
+      mnemonic: "COPY"
+      llvm_mnemonic: "COPY"
+      output_operands {
+        virtual_register { name: "%0" size: 64 }
+        intefered_register: "%1"
+        intefered_register_sizes: 64
+      }
+      input_operands {
+        virtual_register { name: "%1" size: 64 }
+        intefered_register: "%0"
+        intefered_register_sizes: 64
+      }
+    }
+    canonicalized_instructions {
+      mnemonic: "MOV32rm"
+      llvm_mnemonic: "MOV32rm"
+      output_operands { register_name: "EAX" }
+      input_operands { memory { alias_group_id: 1 } }
+      input_operands {
+        address {
+          base_register: "%6"
+          base_register_size: 64
+          base_register_intefered_register: "%0"
+          base_register_intefered_register_sizes: 64
+          displacement: 16
+          scaling: 1
+        }
+      }
+      input_operands { immediate_value: 5 }
+    }
+  )pb"));
+
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  ASSERT_TRUE(builder_->AddBasicBlock(block));
+  const std::vector<int> expected_node_features = builder_->node_features();
+  const std::vector<int> expected_edge_senders = builder_->edge_senders();
+  const std::vector<int> expected_edge_receivers = builder_->edge_receivers();
+  const std::vector<int> expected_edge_features = builder_->EdgeFeatures();
+
+  auto symbols = std::make_shared<SymbolTable>();
+  const CompactBasicBlock compact =
+      CompactBasicBlock::FromInstructions(block.instructions, *symbols);
+  builder_->Reset();
+  builder_->SetSymbolTable(symbols);
+  builder_->SetDeduplicateBlocks(true);
+  ASSERT_TRUE(builder_->AddCompactBasicBlock(compact));
+  EXPECT_EQ(builder_->node_features(), expected_node_features);
+  EXPECT_EQ(builder_->edge_senders(), expected_edge_senders);
+  EXPECT_EQ(builder_->edge_receivers(), expected_edge_receivers);
+  EXPECT_EQ(builder_->EdgeFeatures(), expected_edge_features);
+
+  // The compact basic block is deduplicated with the original one.
+  ASSERT_TRUE(builder_->AddBasicBlock(block));
+  EXPECT_THAT(builder_->block_graph_indices(), ElementsAre(0, 0));
+  EXPECT_FALSE(builder_->AddCompactBasicBlock(CompactBasicBlock()));
+}
+
 }  // namespace
 }  // namespace gematria
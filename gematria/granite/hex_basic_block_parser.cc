@@ -0,0 +1,130 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "gematria/granite/hex_basic_block_parser.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <future>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/llvm/disassembler.h"
+#include "gematria/llvm/llvm_architecture_support.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/Error.h"
+
+namespace gematria {
+
+HexBasicBlockParser::HexBasicBlockParser(
+    const LlvmArchitectureSupport& llvm_support)
+    : llvm_support_(llvm_support),
+      disassembler_context_(llvm_support),
+      canonicalizer_(&llvm_support.target_machine()) {}
+
+llvm::Error HexBasicBlockParser::ParseBasicBlock(std::string_view hex_string,
+                                                 BasicBlock& block) {
+  machine_code_.Clear();
+  if (!machine_code_.Add(hex_string)) {
+    return llvm::createStringError(llvm::errc::invalid_argument,
+                                   "Can't parse input line: %s",
+                                   std::string(hex_string).c_str());
+  }
+
+  // The assembly is not needed for inference, and the instructions are
+  // disassembled into a vector reused across blocks.
+  if (llvm::Error error = DisassembleAllInstructions(
+          disassembler_context_.mc_disassembler(),
+          llvm_support_.mc_instr_info(), llvm_support_.mc_register_info(),
+          llvm_support_.mc_subtarget_info(), /*printer=*/nullptr, 0,
+          llvm::ArrayRef<uint8_t>(machine_code_.data(0), machine_code_.size(0)),
+          disassembled_instructions_)) {
+    return error;
+  }
+  // The instructions are canonicalized directly from the disassembler output,
+  // without copying them to a separate vector of MCInsts.
+  block.instructions.resize(disassembled_instructions_.size());
+  for (size_t i = 0; i < disassembled_instructions_.size(); ++i) {
+    canonicalizer_.InstructionFromMCInst(disassembled_instructions_[i].mc_inst,
+                                         block.instructions[i]);
+  }
+  return llvm::Error::success();
+}
+
+HexBasicBlockParserPool::HexBasicBlockParserPool(
+    const LlvmArchitectureSupport& llvm_support, int num_threads)
+    : llvm_support_(llvm_support) {
+  num_threads = std::max(num_threads, 1);
+  threads_.reserve(num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    threads_.emplace_back([this]() { RunWorker(); });
+  }
+}
+
+HexBasicBlockParserPool::~HexBasicBlockParserPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    shutting_down_ = true;
+  }
+  task_added_.notify_all();
+  for (std::thread& thread : threads_) thread.join();
+}
+
+std::future<HexBasicBlockParserPool::Result>
+HexBasicBlockParserPool::ParseAsync(std::vector<std::string> hex_strings,
+                                    std::vector<BasicBlock> blocks) {
+  Task task{std::move(hex_strings), std::move(blocks), {}};
+  std::future<Result> result = task.result.get_future();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push_back(std::move(task));
+  }
+  task_added_.notify_one();
+  return result;
+}
+
+void HexBasicBlockParserPool::RunWorker() {
+  HexBasicBlockParser parser(llvm_support_);
+  while (true) {
+    Task task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      task_added_.wait(lock,
+                       [this]() { return shutting_down_ || !tasks_.empty(); });
+      // The remaining tasks are processed also during the shutdown.
+      if (tasks_.empty()) return;
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    const auto parse_blocks = [&]() -> Result {
+      task.blocks.resize(task.hex_strings.size());
+      for (size_t i = 0; i < task.hex_strings.size(); ++i) {
+        if (llvm::Error error =
+                parser.ParseBasicBlock(task.hex_strings[i], task.blocks[i])) {
+          return error;
+        }
+      }
+      return std::move(task.blocks);
+    };
+    task.result.set_value(parse_blocks());
+  }
+}
+
+}  // namespace gematria
@@ -0,0 +1,131 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Contains a parser of basic blocks in the hex format used in the BHive data
+// set, shared by the llvm-granite command-line modes.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_HEX_BASIC_BLOCK_PARSER_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_HEX_BASIC_BLOCK_PARSER_H_
+
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/llvm/canonicalizer.h"
+#include "gematria/llvm/disassembler.h"
+#include "gematria/llvm/llvm_architecture_support.h"
+#include "gematria/utils/string.h"
+#include "llvm/Support/Error.h"
+
+namespace gematria {
+
+// Disassembles and canonicalizes basic blocks from hex strings. The parser
+// keeps its own disassembler context and reuses its buffers across calls; it
+// is not thread-safe, but parsers created for the same LlvmArchitectureSupport
+// can be used from different threads at the same time. The architecture
+// support must outlive the parser.
+class HexBasicBlockParser {
+ public:
+  explicit HexBasicBlockParser(const LlvmArchitectureSupport& llvm_support);
+
+  // Parses the machine code in `hex_string` and stores the canonicalized
+  // instructions in `block`. The instructions of `block` are overwritten in
+  // place, so that their operand lists do not need to be allocated again when
+  // the same block is reused across calls. Returns an error when `hex_string`
+  // is not a valid hex string or when the code can't be disassembled; the
+  // contents of `block` are unspecified in that case.
+  llvm::Error ParseBasicBlock(std::string_view hex_string, BasicBlock& block);
+
+ private:
+  const LlvmArchitectureSupport& llvm_support_;
+  LlvmDisassemblerContext disassembler_context_;
+  X86Canonicalizer canonicalizer_;
+  // The buffers for the machine code and the disassembled instructions of the
+  // current block, reused across blocks.
+  HexStringBatch machine_code_;
+  std::vector<DisassembledInstruction> disassembled_instructions_;
+};
+
+// Parses chunks of hex strings on a pool of worker threads, each of which has
+// its own HexBasicBlockParser. Used to move the disassembly and the
+// canonicalization off the thread that feeds the model. The chunks are
+// independent; callers that need the blocks in the input order keep the
+// futures in the order of submission.
+//
+// Typical usage:
+//   HexBasicBlockParserPool pool(llvm_support, num_threads);
+//   std::deque<std::future<HexBasicBlockParserPool::Result>> chunks;
+//   chunks.push_back(pool.ParseAsync(std::move(lines)));
+//   ...
+//   HexBasicBlockParserPool::Result blocks = chunks.front().get();
+class HexBasicBlockParserPool {
+ public:
+  // The parsed blocks of a chunk, in the order of the hex strings, or the
+  // error from the first hex string that could not be parsed.
+  using Result = llvm::Expected<std::vector<BasicBlock>>;
+
+  // Creates a pool with `num_threads` worker threads; uses one thread when
+  // `num_threads` is not positive. The architecture support must outlive the
+  // pool.
+  HexBasicBlockParserPool(const LlvmArchitectureSupport& llvm_support,
+                          int num_threads);
+
+  HexBasicBlockParserPool(const HexBasicBlockParserPool&) = delete;
+  HexBasicBlockParserPool& operator=(const HexBasicBlockParserPool&) = delete;
+
+  // Parses the chunks that were already submitted and stops the threads.
+  ~HexBasicBlockParserPool();
+
+  // Parses `hex_strings` on one of the worker threads. The blocks in `blocks`,
+  // typically the blocks of a chunk that was already consumed, are reused for
+  // the output to avoid allocating their instructions again. Thread-safe.
+  std::future<Result> ParseAsync(std::vector<std::string> hex_strings,
+                                 std::vector<BasicBlock> blocks = {});
+
+  // Returns the number of worker threads.
+  int num_threads() const { return static_cast<int>(threads_.size()); }
+
+ private:
+  struct Task {
+    std::vector<std::string> hex_strings;
+    std::vector<BasicBlock> blocks;
+    std::promise<Result> result;
+  };
+
+  // The main loop of a worker thread.
+  void RunWorker();
+
+  const LlvmArchitectureSupport& llvm_support_;
+
+  std::mutex mutex_;
+  // Notified when a task is added and when the pool is shutting down.
+  std::condition_variable task_added_;
+  // The tasks that were not started yet. Guarded by `mutex_`.
+  std::deque<Task> tasks_;
+  // Set to true when the pool is destroyed. Guarded by `mutex_`.
+  bool shutting_down_ = false;
+
+  std::vector<std::thread> threads_;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_HEX_BASIC_BLOCK_PARSER_H_
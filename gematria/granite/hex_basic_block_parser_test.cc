@@ -0,0 +1,201 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/granite/hex_basic_block_parser.h"
+
+#include <future>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/llvm/llvm_architecture_support.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "llvm/Support/Error.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::HasSubstr;
+using ::testing::IsEmpty;
+using ::testing::SizeIs;
+
+// ADD RAX, RBX.
+constexpr char kAddHex[] = "4801D8";
+// XOR QWORD PTR [RCX], RAX.
+constexpr char kXorHex[] = "483101";
+
+Instruction AddInstruction() {
+  return Instruction(
+      /* mnemonic= */ "ADD", /* llvm_mnemonic= */ "ADD64rr",
+      /* prefixes= */ {},
+      /* input_operands= */
+      {InstructionOperand::Register("RAX"),
+       InstructionOperand::Register("RBX")},
+      /* implicit_input_operands= */ {},
+      /* output_operands= */ {InstructionOperand::Register("RAX")},
+      /* implicit_output_operands= */
+      {InstructionOperand::Register("EFLAGS")});
+}
+
+Instruction XorInstruction() {
+  return Instruction(
+      /* mnemonic= */ "XOR", /* llvm_mnemonic= */ "XOR64mr",
+      /* prefixes= */ {},
+      /* input_operands= */
+      {InstructionOperand::MemoryLocation(1),
+       InstructionOperand::Address(
+           /* base_register= */ "RCX",
+           /* displacement= */ 0,
+           /* index_register= */ std::string(),
+           /* scaling= */ 1,
+           /* segment_register= */ std::string()),
+       InstructionOperand::Register("RAX")},
+      /* implicit_input_operands= */ {},
+      /* output_operands= */ {InstructionOperand::MemoryLocation(1)},
+      /* implicit_output_operands= */
+      {InstructionOperand::Register("EFLAGS")});
+}
+
+class HexBasicBlockParserTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    llvm_support_ = LlvmArchitectureSupport::X86_64();
+    parser_ = std::make_unique<HexBasicBlockParser>(*llvm_support_);
+  }
+
+  // Parses `hex_string` into `block_`. Returns the error message, or an empty
+  // string when the block was parsed.
+  std::string Parse(const std::string& hex_string) {
+    llvm::Error error = parser_->ParseBasicBlock(hex_string, block_);
+    if (!error) return "";
+    return llvm::toString(std::move(error));
+  }
+
+  std::unique_ptr<LlvmArchitectureSupport> llvm_support_;
+  std::unique_ptr<HexBasicBlockParser> parser_;
+  BasicBlock block_;
+};
+
+TEST_F(HexBasicBlockParserTest, ValidHex) {
+  EXPECT_EQ(Parse(std::string(kAddHex) + kXorHex), "");
+  EXPECT_THAT(block_.instructions,
+              ElementsAre(AddInstruction(), XorInstruction()));
+}
+
+TEST_F(HexBasicBlockParserTest, LowerCaseHex) {
+  EXPECT_EQ(Parse("4801d8"), "");
+  EXPECT_THAT(block_.instructions, ElementsAre(AddInstruction()));
+}
+
+TEST_F(HexBasicBlockParserTest, OddLength) {
+  EXPECT_THAT(Parse("4801D"), HasSubstr("Can't parse input line: 4801D"));
+}
+
+TEST_F(HexBasicBlockParserTest, NonHexCharacters) {
+  EXPECT_THAT(Parse("4801XY"), HasSubstr("Can't parse input line: 4801XY"));
+  EXPECT_THAT(Parse("48 01 D8"), HasSubstr("Can't parse input line"));
+  EXPECT_THAT(Parse("4801D8\n"), HasSubstr("Can't parse input line"));
+}
+
+TEST_F(HexBasicBlockParserTest, EmptyInput) {
+  block_.instructions.push_back(AddInstruction());
+  EXPECT_EQ(Parse(""), "");
+  EXPECT_THAT(block_.instructions, IsEmpty());
+}
+
+TEST_F(HexBasicBlockParserTest, InvalidMachineCode) {
+  // A truncated instruction: the REX prefix and the opcode of ADD without the
+  // ModRM byte.
+  EXPECT_THAT(Parse("4801"), HasSubstr("Parsing of machine code failed"));
+}
+
+TEST_F(HexBasicBlockParserTest, ReusesBlock) {
+  EXPECT_EQ(Parse(std::string(kXorHex) + kAddHex), "");
+  EXPECT_THAT(block_.instructions,
+              ElementsAre(XorInstruction(), AddInstruction()));
+  // The instructions of the previous block are overwritten, and the extra ones
+  // are removed.
+  EXPECT_EQ(Parse(kAddHex), "");
+  EXPECT_THAT(block_.instructions, ElementsAre(AddInstruction()));
+}
+
+TEST_F(HexBasicBlockParserTest, ParsesAfterError) {
+  EXPECT_THAT(Parse("4801XY"), HasSubstr("Can't parse input line"));
+  EXPECT_THAT(Parse("4801"), HasSubstr("Parsing of machine code failed"));
+  EXPECT_EQ(Parse(kXorHex), "");
+  EXPECT_THAT(block_.instructions, ElementsAre(XorInstruction()));
+}
+
+TEST_F(HexBasicBlockParserTest, PoolKeepsChunksInOrder) {
+  constexpr int kNumChunks = 8;
+  HexBasicBlockParserPool pool(*llvm_support_, 3);
+  EXPECT_EQ(pool.num_threads(), 3);
+
+  // Chunk `i` has `i` blocks, alternating between ADD and XOR.
+  std::vector<std::future<HexBasicBlockParserPool::Result>> chunks;
+  for (int i = 0; i < kNumChunks; ++i) {
+    std::vector<std::string> hex_strings;
+    for (int j = 0; j < i; ++j) {
+      hex_strings.push_back(j % 2 ? kXorHex : kAddHex);
+    }
+    chunks.push_back(pool.ParseAsync(std::move(hex_strings)));
+  }
+  for (int i = 0; i < kNumChunks; ++i) {
+    SCOPED_TRACE(i);
+    HexBasicBlockParserPool::Result blocks = chunks[i].get();
+    ASSERT_TRUE(static_cast<bool>(blocks)) << toString(blocks.takeError());
+    ASSERT_THAT(*blocks, SizeIs(i));
+    for (int j = 0; j < i; ++j) {
+      EXPECT_THAT((*blocks)[j].instructions,
+                  ElementsAre(j % 2 ? XorInstruction() : AddInstruction()));
+    }
+  }
+}
+
+TEST_F(HexBasicBlockParserTest, PoolReusesBlocks) {
+  HexBasicBlockParserPool pool(*llvm_support_, 0);
+  EXPECT_EQ(pool.num_threads(), 1);
+  std::vector<BasicBlock> reused(3);
+  reused[0].instructions = {XorInstruction(), XorInstruction()};
+  HexBasicBlockParserPool::Result blocks =
+      pool.ParseAsync({kAddHex}, std::move(reused)).get();
+  ASSERT_TRUE(static_cast<bool>(blocks)) << toString(blocks.takeError());
+  ASSERT_THAT(*blocks, SizeIs(1));
+  EXPECT_THAT((*blocks)[0].instructions, ElementsAre(AddInstruction()));
+}
+
+TEST_F(HexBasicBlockParserTest, PoolReportsErrorOfItsChunk) {
+  HexBasicBlockParserPool pool(*llvm_support_, 2);
+  std::future<HexBasicBlockParserPool::Result> valid =
+      pool.ParseAsync({kAddHex, kXorHex});
+  std::future<HexBasicBlockParserPool::Result> invalid =
+      pool.ParseAsync({kAddHex, "4801D", kXorHex});
+
+  HexBasicBlockParserPool::Result invalid_blocks = invalid.get();
+  ASSERT_FALSE(static_cast<bool>(invalid_blocks));
+  EXPECT_THAT(llvm::toString(invalid_blocks.takeError()),
+              HasSubstr("Can't parse input line: 4801D"));
+
+  HexBasicBlockParserPool::Result valid_blocks = valid.get();
+  ASSERT_TRUE(static_cast<bool>(valid_blocks))
+      << toString(valid_blocks.takeError());
+  EXPECT_THAT(*valid_blocks, SizeIs(2));
+}
+
+}  // namespace
+}  // namespace gematria
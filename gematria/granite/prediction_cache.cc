@@ -0,0 +1,82 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/granite/prediction_cache.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+namespace gematria {
+
+PredictionCache::PredictionCache(size_t max_size) : max_size_(max_size) {}
+
+std::optional<PredictionCache::OutputType> PredictionCache::Lookup(
+    uint64_t fingerprint) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = index_.find(fingerprint);
+  if (it == index_.end()) {
+    ++num_misses_;
+    return std::nullopt;
+  }
+  ++num_hits_;
+  // Move the entry to the front of the list; this does not invalidate the
+  // iterators stored in `index_`.
+  entries_.splice(entries_.begin(), entries_, it->second);
+  return it->second->second;
+}
+
+void PredictionCache::Insert(uint64_t fingerprint, OutputType prediction) {
+  if (max_size_ == 0) return;
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = index_.find(fingerprint);
+  if (it != index_.end()) {
+    it->second->second = std::move(prediction);
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return;
+  }
+  if (entries_.size() >= max_size_) {
+    index_.erase(entries_.back().first);
+    entries_.pop_back();
+  }
+  entries_.emplace_front(fingerprint, std::move(prediction));
+  index_.emplace(fingerprint, entries_.begin());
+}
+
+void PredictionCache::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+  index_.clear();
+  num_hits_ = 0;
+  num_misses_ = 0;
+}
+
+size_t PredictionCache::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.size();
+}
+
+int64_t PredictionCache::num_hits() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return num_hits_;
+}
+
+int64_t PredictionCache::num_misses() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return num_misses_;
+}
+
+}  // namespace gematria
@@ -0,0 +1,98 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains a cache of predictions of a model, keyed by the fingerprint of the
+// basic block (see BasicBlockFingerprint() in basic_block.h).
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_PREDICTION_CACHE_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_PREDICTION_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+
+#include "llvm/ADT/SmallVector.h"
+
+namespace gematria {
+
+// A thread-safe least-recently-used cache of predictions of a model. The keys
+// are basic block fingerprints; the values are the outputs of the model for
+// the basic block. A single cache may be shared by multiple inference objects
+// as long as they all use the same model.
+//
+// Note that the cache stores only the fingerprints of the basic blocks, not
+// the basic blocks themselves; a fingerprint collision would return the
+// prediction for a different basic block.
+class PredictionCache {
+ public:
+  // The type of the predictions; the same as
+  // GraphBuilderModelInference::OutputType.
+  using OutputType = llvm::SmallVector<float, 4>;
+
+  // Creates a cache that holds at most `max_size` predictions. When the cache
+  // is full, adding a new prediction evicts the least recently used one. A
+  // cache with `max_size` == 0 never stores any predictions.
+  explicit PredictionCache(size_t max_size);
+
+  PredictionCache(const PredictionCache&) = delete;
+  PredictionCache& operator=(const PredictionCache&) = delete;
+
+  // Looks up the prediction for the basic block with the given fingerprint.
+  // Returns std::nullopt when the prediction is not in the cache. Updates the
+  // hit/miss counters.
+  std::optional<OutputType> Lookup(uint64_t fingerprint);
+
+  // Adds a prediction to the cache. Replaces the existing prediction when there
+  // is already one for `fingerprint`.
+  void Insert(uint64_t fingerprint, OutputType prediction);
+
+  // Removes all predictions from the cache and resets the counters.
+  void Clear();
+
+  // Returns the maximal number of predictions in the cache.
+  size_t max_size() const { return max_size_; }
+  // Returns the current number of predictions in the cache.
+  size_t size() const;
+
+  // Returns the number of calls to Lookup() that found a prediction in the
+  // cache.
+  int64_t num_hits() const;
+  // Returns the number of calls to Lookup() that did not find a prediction in
+  // the cache.
+  int64_t num_misses() const;
+
+ private:
+  using Entry = std::pair<uint64_t, OutputType>;
+
+  const size_t max_size_;
+
+  mutable std::mutex mutex_;
+  // The cached predictions, ordered from the most recently used one to the
+  // least recently used one. Guarded by `mutex_`.
+  std::list<Entry> entries_;
+  // Maps fingerprints to their entries in `entries_`. Guarded by `mutex_`.
+  std::unordered_map<uint64_t, std::list<Entry>::iterator> index_;
+
+  // Guarded by `mutex_`.
+  int64_t num_hits_ = 0;
+  int64_t num_misses_ = 0;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_PREDICTION_CACHE_H_
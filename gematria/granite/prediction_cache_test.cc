@@ -0,0 +1,132 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/granite/prediction_cache.h"
+
+#include <optional>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::Optional;
+
+using OutputType = PredictionCache::OutputType;
+
+TEST(PredictionCacheTest, Empty) {
+  PredictionCache cache(3);
+  EXPECT_EQ(cache.max_size(), 3);
+  EXPECT_EQ(cache.size(), 0);
+  EXPECT_EQ(cache.num_hits(), 0);
+  EXPECT_EQ(cache.num_misses(), 0);
+  EXPECT_EQ(cache.Lookup(1), std::nullopt);
+  EXPECT_EQ(cache.num_misses(), 1);
+}
+
+TEST(PredictionCacheTest, InsertAndLookup) {
+  PredictionCache cache(3);
+  cache.Insert(1, OutputType{1.0f});
+  cache.Insert(2, OutputType{2.0f, 3.0f});
+  EXPECT_EQ(cache.size(), 2);
+
+  EXPECT_THAT(cache.Lookup(1), Optional(ElementsAre(1.0f)));
+  EXPECT_THAT(cache.Lookup(2), Optional(ElementsAre(2.0f, 3.0f)));
+  EXPECT_EQ(cache.Lookup(3), std::nullopt);
+  EXPECT_EQ(cache.num_hits(), 2);
+  EXPECT_EQ(cache.num_misses(), 1);
+}
+
+TEST(PredictionCacheTest, InsertReplacesPrediction) {
+  PredictionCache cache(3);
+  cache.Insert(1, OutputType{1.0f});
+  cache.Insert(1, OutputType{2.0f});
+  EXPECT_EQ(cache.size(), 1);
+  EXPECT_THAT(cache.Lookup(1), Optional(ElementsAre(2.0f)));
+}
+
+TEST(PredictionCacheTest, EvictsLeastRecentlyInserted) {
+  PredictionCache cache(2);
+  cache.Insert(1, OutputType{1.0f});
+  cache.Insert(2, OutputType{2.0f});
+  cache.Insert(3, OutputType{3.0f});
+  EXPECT_EQ(cache.size(), 2);
+  EXPECT_EQ(cache.Lookup(1), std::nullopt);
+  EXPECT_THAT(cache.Lookup(2), Optional(ElementsAre(2.0f)));
+  EXPECT_THAT(cache.Lookup(3), Optional(ElementsAre(3.0f)));
+}
+
+TEST(PredictionCacheTest, LookupRefreshesEntry) {
+  PredictionCache cache(2);
+  cache.Insert(1, OutputType{1.0f});
+  cache.Insert(2, OutputType{2.0f});
+  // Using the prediction for 1 makes 2 the least recently used one.
+  EXPECT_THAT(cache.Lookup(1), Optional(ElementsAre(1.0f)));
+  cache.Insert(3, OutputType{3.0f});
+  EXPECT_EQ(cache.Lookup(2), std::nullopt);
+  EXPECT_THAT(cache.Lookup(1), Optional(ElementsAre(1.0f)));
+  EXPECT_THAT(cache.Lookup(3), Optional(ElementsAre(3.0f)));
+}
+
+TEST(PredictionCacheTest, InsertRefreshesEntry) {
+  PredictionCache cache(2);
+  cache.Insert(1, OutputType{1.0f});
+  cache.Insert(2, OutputType{2.0f});
+  // Replacing the prediction for 1 makes 2 the least recently used one.
+  cache.Insert(1, OutputType{4.0f});
+  cache.Insert(3, OutputType{3.0f});
+  EXPECT_EQ(cache.Lookup(2), std::nullopt);
+  EXPECT_THAT(cache.Lookup(1), Optional(ElementsAre(4.0f)));
+  EXPECT_THAT(cache.Lookup(3), Optional(ElementsAre(3.0f)));
+}
+
+TEST(PredictionCacheTest, MaxSizeZero) {
+  PredictionCache cache(0);
+  cache.Insert(1, OutputType{1.0f});
+  EXPECT_EQ(cache.size(), 0);
+  EXPECT_EQ(cache.Lookup(1), std::nullopt);
+  EXPECT_EQ(cache.num_hits(), 0);
+  EXPECT_EQ(cache.num_misses(), 1);
+}
+
+TEST(PredictionCacheTest, MaxSizeOne) {
+  PredictionCache cache(1);
+  cache.Insert(1, OutputType{1.0f});
+  EXPECT_THAT(cache.Lookup(1), Optional(ElementsAre(1.0f)));
+  cache.Insert(2, OutputType{2.0f});
+  EXPECT_EQ(cache.size(), 1);
+  EXPECT_EQ(cache.Lookup(1), std::nullopt);
+  EXPECT_THAT(cache.Lookup(2), Optional(ElementsAre(2.0f)));
+  EXPECT_EQ(cache.num_hits(), 2);
+  EXPECT_EQ(cache.num_misses(), 1);
+}
+
+TEST(PredictionCacheTest, Clear) {
+  PredictionCache cache(2);
+  cache.Insert(1, OutputType{1.0f});
+  EXPECT_THAT(cache.Lookup(1), Optional(ElementsAre(1.0f)));
+  EXPECT_EQ(cache.Lookup(2), std::nullopt);
+
+  cache.Clear();
+  EXPECT_EQ(cache.size(), 0);
+  EXPECT_EQ(cache.num_hits(), 0);
+  EXPECT_EQ(cache.num_misses(), 0);
+  EXPECT_EQ(cache.Lookup(1), std::nullopt);
+  EXPECT_EQ(cache.num_misses(), 1);
+}
+
+}  // namespace
+}  // namespace gematria
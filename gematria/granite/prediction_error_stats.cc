@@ -0,0 +1,186 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "gematria/granite/prediction_error_stats.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/Error.h"
+
+namespace gematria {
+namespace {
+
+// Returns the percentiles of `values` for `percentile_ranks`, using the
+// "nearest" interpolation. Reorders `values`.
+std::vector<double> GetPercentiles(const std::vector<int>& percentile_ranks,
+                                   std::vector<double>& values) {
+  std::vector<double> percentiles;
+  percentiles.reserve(percentile_ranks.size());
+  if (values.empty()) {
+    percentiles.resize(percentile_ranks.size(), 0.0);
+    return percentiles;
+  }
+  for (const int rank : percentile_ranks) {
+    // std::nearbyint() rounds halfway cases to even, like tf.round().
+    const auto index = static_cast<ptrdiff_t>(
+        std::nearbyint((values.size() - 1) * (rank / 100.0)));
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    percentiles.push_back(values[index]);
+  }
+  return percentiles;
+}
+
+}  // namespace
+
+PredictionErrorStats::PredictionErrorStats(std::vector<int> percentile_ranks)
+    : percentile_ranks_(std::move(percentile_ranks)) {
+  assert(std::all_of(percentile_ranks_.begin(), percentile_ranks_.end(),
+                     [](int rank) { return rank >= 0 && rank <= 100; }));
+}
+
+llvm::Error PredictionErrorStats::Add(llvm::ArrayRef<float> predictions,
+                                      llvm::ArrayRef<double> expected_outputs) {
+  if (predictions.size() != expected_outputs.size()) {
+    return llvm::createStringError(
+        llvm::errc::invalid_argument,
+        "The number of predictions (%zu) and expected outputs (%zu) differ.",
+        predictions.size(), expected_outputs.size());
+  }
+  if (num_blocks_ == 0) {
+    tasks_.resize(predictions.size());
+  } else if (predictions.size() != tasks_.size()) {
+    return llvm::createStringError(
+        llvm::errc::invalid_argument,
+        "Expected %zu tasks, got %zu predictions.", tasks_.size(),
+        predictions.size());
+  }
+  ++num_blocks_;
+  const bool keep_errors = !percentile_ranks_.empty();
+  for (size_t task = 0; task < tasks_.size(); ++task) {
+    const double absolute_error =
+        std::abs(double{predictions[task]} - expected_outputs[task]);
+    const double absolute_percentage_error =
+        absolute_error / expected_outputs[task];
+    TaskAccumulator& accumulator = tasks_[task];
+    accumulator.sum_absolute_errors += absolute_error;
+    accumulator.sum_squared_errors += absolute_error * absolute_error;
+    accumulator.sum_absolute_percentage_errors += absolute_percentage_error;
+    accumulator.sum_squared_percentage_errors +=
+        absolute_percentage_error * absolute_percentage_error;
+    if (keep_errors) {
+      accumulator.absolute_errors.push_back(absolute_error);
+      accumulator.absolute_percentage_errors.push_back(
+          absolute_percentage_error);
+    }
+  }
+  return llvm::Error::success();
+}
+
+llvm::Error PredictionErrorStats::Merge(const PredictionErrorStats& other) {
+  if (other.num_blocks_ == 0) return llvm::Error::success();
+  if (percentile_ranks_ != other.percentile_ranks_) {
+    return llvm::createStringError(
+        llvm::errc::invalid_argument,
+        "The accumulators use different percentile ranks.");
+  }
+  if (num_blocks_ == 0) {
+    tasks_.resize(other.tasks_.size());
+  } else if (tasks_.size() != other.tasks_.size()) {
+    return llvm::createStringError(
+        llvm::errc::invalid_argument,
+        "Expected %zu tasks, the other accumulator has %zu tasks.",
+        tasks_.size(), other.tasks_.size());
+  }
+  num_blocks_ += other.num_blocks_;
+  for (size_t task = 0; task < tasks_.size(); ++task) {
+    TaskAccumulator& accumulator = tasks_[task];
+    const TaskAccumulator& other_accumulator = other.tasks_[task];
+    accumulator.sum_absolute_errors += other_accumulator.sum_absolute_errors;
+    accumulator.sum_squared_errors += other_accumulator.sum_squared_errors;
+    accumulator.sum_absolute_percentage_errors +=
+        other_accumulator.sum_absolute_percentage_errors;
+    accumulator.sum_squared_percentage_errors +=
+        other_accumulator.sum_squared_percentage_errors;
+    accumulator.absolute_errors.insert(
+        accumulator.absolute_errors.end(),
+        other_accumulator.absolute_errors.begin(),
+        other_accumulator.absolute_errors.end());
+    accumulator.absolute_percentage_errors.insert(
+        accumulator.absolute_percentage_errors.end(),
+        other_accumulator.absolute_percentage_errors.begin(),
+        other_accumulator.absolute_percentage_errors.end());
+  }
+  return llvm::Error::success();
+}
+
+std::vector<TaskErrorStats> PredictionErrorStats::GetTaskStats() const {
+  std::vector<TaskErrorStats> task_stats;
+  task_stats.reserve(tasks_.size());
+  for (const TaskAccumulator& accumulator : tasks_) {
+    TaskErrorStats& stats = task_stats.emplace_back();
+    stats.num_predictions = num_blocks_;
+    stats.mean_absolute_error = accumulator.sum_absolute_errors / num_blocks_;
+    stats.mean_squared_error = accumulator.sum_squared_errors / num_blocks_;
+    stats.mean_absolute_percentage_error =
+        accumulator.sum_absolute_percentage_errors / num_blocks_;
+    stats.mean_squared_percentage_error =
+        accumulator.sum_squared_percentage_errors / num_blocks_;
+    std::vector<double> values = accumulator.absolute_errors;
+    stats.absolute_error_percentiles =
+        GetPercentiles(percentile_ranks_, values);
+    values = accumulator.absolute_percentage_errors;
+    stats.absolute_percentage_error_percentiles =
+        GetPercentiles(percentile_ranks_, values);
+  }
+  return task_stats;
+}
+
+std::string FormatTaskErrorStats(const std::vector<TaskErrorStats>& task_stats,
+                                 const std::vector<int>& percentile_ranks) {
+  std::ostringstream out;
+  const auto format_percentiles = [&](const std::vector<double>& percentiles) {
+    assert(percentiles.size() == percentile_ranks.size());
+    for (size_t i = 0; i < percentiles.size(); ++i) {
+      out << " p" << percentile_ranks[i] << "=" << percentiles[i];
+    }
+    out << "\n";
+  };
+  for (size_t task = 0; task < task_stats.size(); ++task) {
+    const TaskErrorStats& stats = task_stats[task];
+    out << "Task " << task << ": num_predictions=" << stats.num_predictions
+        << " mae=" << stats.mean_absolute_error
+        << " mse=" << stats.mean_squared_error
+        << " mape=" << stats.mean_absolute_percentage_error
+        << " mspe=" << stats.mean_squared_percentage_error << "\n";
+    if (percentile_ranks.empty()) continue;
+    out << "Task " << task << " absolute error percentiles:";
+    format_percentiles(stats.absolute_error_percentiles);
+    out << "Task " << task << " absolute percentage error percentiles:";
+    format_percentiles(stats.absolute_percentage_error_percentiles);
+  }
+  return out.str();
+}
+
+}  // namespace gematria
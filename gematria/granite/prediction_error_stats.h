@@ -0,0 +1,120 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Contains a streaming accumulator of the errors of model predictions. It
+// computes the same error metrics as the Python model evaluation code in
+// gematria/model/python/loss_utils.py, without keeping the basic blocks or the
+// predictions in memory.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_PREDICTION_ERROR_STATS_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_PREDICTION_ERROR_STATS_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/Error.h"
+
+namespace gematria {
+
+// The error metrics of the predictions for one task of a model.
+struct TaskErrorStats {
+  // The number of predictions collected for the task.
+  int64_t num_predictions = 0;
+
+  double mean_absolute_error = 0;
+  double mean_squared_error = 0;
+  // The errors relative to the expected value, i.e. |delta| / expected.
+  double mean_absolute_percentage_error = 0;
+  double mean_squared_percentage_error = 0;
+
+  // The percentiles of the absolute errors and of the absolute percentage
+  // errors, one per element of the percentile ranks of the accumulator.
+  std::vector<double> absolute_error_percentiles;
+  std::vector<double> absolute_percentage_error_percentiles;
+};
+
+// Accumulates the errors of the predictions of a model for a stream of basic
+// blocks, separately for each task. The sums for the mean errors are updated as
+// the predictions are added; for the percentiles, the accumulator keeps the
+// absolute errors of the predictions, i.e. two doubles per block and task.
+//
+// The metrics follow LossComputation in loss_utils.py: the percentage errors
+// are relative to the expected value, and the percentiles use the "nearest"
+// interpolation of tfp.stats.percentile().
+//
+// The accumulator is not thread-safe. Multi-threaded evaluation uses one
+// accumulator per thread, and combines them with Merge().
+//
+// Typical usage:
+//   PredictionErrorStats stats({50, 90, 99});
+//   for (...) {
+//     if (llvm::Error error = stats.Add(predictions, expected_outputs)) ...
+//   }
+//   const std::vector<TaskErrorStats> task_stats = stats.GetTaskStats();
+class PredictionErrorStats {
+ public:
+  // Creates an empty accumulator that collects the percentiles for
+  // `percentile_ranks`. The ranks must be in the range [0, 100].
+  explicit PredictionErrorStats(std::vector<int> percentile_ranks = {});
+
+  // Adds the predictions of the model for one basic block and the expected
+  // values for the basic block. The number of tasks is determined by the first
+  // block added to the accumulator. Returns an error when `predictions` and
+  // `expected_outputs` have a different size, or when the size does not match
+  // the number of tasks; the accumulator is not modified in that case.
+  llvm::Error Add(llvm::ArrayRef<float> predictions,
+                  llvm::ArrayRef<double> expected_outputs);
+
+  // Adds all predictions collected by `other` to this accumulator. Returns an
+  // error when both accumulators have predictions and their numbers of tasks
+  // or their percentile ranks differ.
+  llvm::Error Merge(const PredictionErrorStats& other);
+
+  // Returns the number of basic blocks added to the accumulator.
+  int64_t num_blocks() const { return num_blocks_; }
+  // Returns the number of tasks, or zero when no block was added yet.
+  int num_tasks() const { return static_cast<int>(tasks_.size()); }
+  const std::vector<int>& percentile_ranks() const { return percentile_ranks_; }
+
+  // Computes the error metrics for each task. The metrics of an accumulator
+  // without any blocks are all zero.
+  std::vector<TaskErrorStats> GetTaskStats() const;
+
+ private:
+  struct TaskAccumulator {
+    double sum_absolute_errors = 0;
+    double sum_squared_errors = 0;
+    double sum_absolute_percentage_errors = 0;
+    double sum_squared_percentage_errors = 0;
+    // Kept only when there are percentile ranks.
+    std::vector<double> absolute_errors;
+    std::vector<double> absolute_percentage_errors;
+  };
+
+  std::vector<int> percentile_ranks_;
+  int64_t num_blocks_ = 0;
+  std::vector<TaskAccumulator> tasks_;
+};
+
+// Formats `task_stats` as a human-readable report, with one line per task and
+// metric. `percentile_ranks` are the ranks used to collect the percentiles.
+std::string FormatTaskErrorStats(const std::vector<TaskErrorStats>& task_stats,
+                                 const std::vector<int>& percentile_ranks);
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_PREDICTION_ERROR_STATS_H_
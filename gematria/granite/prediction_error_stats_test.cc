@@ -0,0 +1,123 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "gematria/granite/prediction_error_stats.h"
+
+#include <vector>
+
+#include "gematria/llvm/llvm_to_absl.h"
+#include "gematria/testing/matchers.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::DoubleEq;
+using ::testing::ElementsAre;
+using ::testing::HasSubstr;
+using ::testing::IsEmpty;
+
+TEST(PredictionErrorStatsTest, Empty) {
+  const PredictionErrorStats stats({50});
+  EXPECT_EQ(stats.num_blocks(), 0);
+  EXPECT_EQ(stats.num_tasks(), 0);
+  EXPECT_THAT(stats.GetTaskStats(), IsEmpty());
+}
+
+TEST(PredictionErrorStatsTest, MeanErrors) {
+  PredictionErrorStats stats;
+  EXPECT_OK(LlvmErrorToStatus(stats.Add({1.0f, 3.0f}, {2.0, 2.0})));
+  EXPECT_OK(LlvmErrorToStatus(stats.Add({7.0f, 4.0f}, {4.0, 4.0})));
+  EXPECT_EQ(stats.num_blocks(), 2);
+  ASSERT_EQ(stats.num_tasks(), 2);
+
+  const std::vector<TaskErrorStats> task_stats = stats.GetTaskStats();
+  ASSERT_EQ(task_stats.size(), 2);
+  // Task 0: the absolute errors are 1 and 3, the percentage errors are 0.5 and
+  // 0.75.
+  EXPECT_EQ(task_stats[0].num_predictions, 2);
+  EXPECT_THAT(task_stats[0].mean_absolute_error, DoubleEq(2.0));
+  EXPECT_THAT(task_stats[0].mean_squared_error, DoubleEq(5.0));
+  EXPECT_THAT(task_stats[0].mean_absolute_percentage_error, DoubleEq(0.625));
+  EXPECT_THAT(task_stats[0].mean_squared_percentage_error,
+              DoubleEq((0.25 + 0.5625) / 2));
+  EXPECT_THAT(task_stats[0].absolute_error_percentiles, IsEmpty());
+  // Task 1: the absolute errors are 1 and 0.
+  EXPECT_THAT(task_stats[1].mean_absolute_error, DoubleEq(0.5));
+  EXPECT_THAT(task_stats[1].mean_absolute_percentage_error, DoubleEq(0.25));
+}
+
+TEST(PredictionErrorStatsTest, Percentiles) {
+  PredictionErrorStats stats({0, 50, 90, 100});
+  for (int i = 1; i <= 11; ++i) {
+    EXPECT_OK(LlvmErrorToStatus(stats.Add({10.0f + i}, {10.0})));
+  }
+  const std::vector<TaskErrorStats> task_stats = stats.GetTaskStats();
+  ASSERT_EQ(task_stats.size(), 1);
+  EXPECT_THAT(task_stats[0].absolute_error_percentiles,
+              ElementsAre(1.0, 6.0, 10.0, 11.0));
+  EXPECT_THAT(task_stats[0].absolute_percentage_error_percentiles,
+              ElementsAre(DoubleEq(0.1), DoubleEq(0.6), DoubleEq(1.0),
+                          DoubleEq(1.1)));
+}
+
+TEST(PredictionErrorStatsTest, InvalidSizes) {
+  PredictionErrorStats stats;
+  EXPECT_FALSE(LlvmErrorToStatus(stats.Add({1.0f}, {1.0, 2.0})).ok());
+  EXPECT_EQ(stats.num_blocks(), 0);
+  EXPECT_OK(LlvmErrorToStatus(stats.Add({1.0f}, {1.0})));
+  EXPECT_FALSE(LlvmErrorToStatus(stats.Add({1.0f, 2.0f}, {1.0, 2.0})).ok());
+  EXPECT_EQ(stats.num_blocks(), 1);
+}
+
+TEST(PredictionErrorStatsTest, Merge) {
+  PredictionErrorStats stats({50});
+  PredictionErrorStats first({50});
+  PredictionErrorStats second({50});
+  EXPECT_OK(LlvmErrorToStatus(first.Add({2.0f}, {1.0})));
+  EXPECT_OK(LlvmErrorToStatus(second.Add({4.0f}, {1.0})));
+  EXPECT_OK(LlvmErrorToStatus(second.Add({5.0f}, {1.0})));
+
+  EXPECT_OK(LlvmErrorToStatus(stats.Merge(first)));
+  EXPECT_OK(LlvmErrorToStatus(stats.Merge(second)));
+  EXPECT_OK(LlvmErrorToStatus(stats.Merge(PredictionErrorStats({50}))));
+  EXPECT_EQ(stats.num_blocks(), 3);
+  const std::vector<TaskErrorStats> task_stats = stats.GetTaskStats();
+  ASSERT_EQ(task_stats.size(), 1);
+  EXPECT_THAT(task_stats[0].mean_absolute_error, DoubleEq(8.0 / 3));
+  EXPECT_THAT(task_stats[0].absolute_error_percentiles, ElementsAre(3.0));
+
+  PredictionErrorStats other_ranks({90});
+  EXPECT_OK(LlvmErrorToStatus(other_ranks.Add({2.0f}, {1.0})));
+  EXPECT_FALSE(LlvmErrorToStatus(stats.Merge(other_ranks)).ok());
+  PredictionErrorStats two_tasks({50});
+  EXPECT_OK(LlvmErrorToStatus(two_tasks.Add({2.0f, 3.0f}, {1.0, 1.0})));
+  EXPECT_FALSE(LlvmErrorToStatus(stats.Merge(two_tasks)).ok());
+  EXPECT_EQ(stats.num_blocks(), 3);
+}
+
+TEST(PredictionErrorStatsTest, Format) {
+  PredictionErrorStats stats({50});
+  EXPECT_OK(LlvmErrorToStatus(stats.Add({3.0f}, {2.0})));
+  const std::string report =
+      FormatTaskErrorStats(stats.GetTaskStats(), stats.percentile_ranks());
+  EXPECT_THAT(report, HasSubstr("Task 0: num_predictions=1 mae=1 mse=1 "
+                                "mape=0.5 mspe=0.25\n"));
+  EXPECT_THAT(report, HasSubstr("Task 0 absolute error percentiles: p50=1\n"));
+}
+
+}  // namespace
+}  // namespace gematria
@@ -0,0 +1,205 @@
+# Copyright 2023 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+r"""Fuses gather + unsorted segment sum pairs in a .tflite model.
+
+Graph network models aggregate the messages along the edges of the graph by
+gathering the node embeddings with `tf.gather(nodes, senders)` and summing them
+with `tf.math.unsorted_segment_sum(..., receivers, num_nodes)`. In a .tflite
+model, this materializes a tensor with a row for each edge. This tool replaces
+each such pair of ops with the `GatherUnsortedSegmentSum` custom op implemented
+in gematria/tflite/unsorted_segment_sum_op.cc, which reads the gathered rows
+directly.
+
+A pair is fused only when the result of the gather is used only by the segment
+sum, the gather is along the first axis, the gathered params are float32, the
+indices and the segment IDs are int32 vectors, and the number of segments is an
+int32 scalar. Other pairs are left unchanged, because the fused kernel would
+reject or misread their inputs.
+
+Usage:
+  fuse_tflite_gather_segment_sum \
+      --gematria_input_tflite=/tmp/gnn.tflite \
+      --gematria_output_tflite=/tmp/gnn_fused.tflite
+"""
+
+from collections.abc import Sequence
+from typing import Optional
+
+from absl import app
+from absl import flags
+from absl import logging
+from tensorflow.lite.python import schema_py_generated as schema_fb
+from tensorflow.lite.tools import flatbuffer_utils
+
+_INPUT_TFLITE = flags.DEFINE_string(
+    'gematria_input_tflite',
+    None,
+    'The .tflite model to read.',
+    required=True,
+)
+_OUTPUT_TFLITE = flags.DEFINE_string(
+    'gematria_output_tflite',
+    None,
+    'The file to write the fused .tflite model to.',
+    required=True,
+)
+
+# The name of the unsorted segment sum custom op used when the model does not
+# use the builtin op. Must match kUnsortedSegmentSumOpName.
+UNSORTED_SEGMENT_SUM_OP_NAME = 'UnsortedSegmentSum'
+# The name of the fused op. Must match kGatherUnsortedSegmentSumOpName.
+GATHER_UNSORTED_SEGMENT_SUM_OP_NAME = 'GatherUnsortedSegmentSum'
+
+
+def _builtin_code(op_code: schema_fb.OperatorCodeT) -> int:
+  # Models created by older converters have only the deprecated field.
+  return max(op_code.builtinCode, op_code.deprecatedBuiltinCode)
+
+
+def _custom_code(op_code: schema_fb.OperatorCodeT) -> Optional[str]:
+  if op_code.customCode is None:
+    return None
+  if isinstance(op_code.customCode, bytes):
+    return op_code.customCode.decode('utf-8')
+  return op_code.customCode
+
+
+def _is_unsorted_segment_sum(op_code: schema_fb.OperatorCodeT) -> bool:
+  builtin_code = _builtin_code(op_code)
+  if builtin_code == schema_fb.BuiltinOperator.CUSTOM:
+    return _custom_code(op_code) == UNSORTED_SEGMENT_SUM_OP_NAME
+  # The builtin op exists only in newer versions of TensorFlow Lite.
+  return builtin_code == getattr(
+      schema_fb.BuiltinOperator, 'UNSORTED_SEGMENT_SUM', None
+  )
+
+
+def _is_fusable_gather(
+    subgraph: schema_fb.SubGraphT,
+    op: schema_fb.OperatorT,
+    op_code: schema_fb.OperatorCodeT,
+) -> bool:
+  if _builtin_code(op_code) != schema_fb.BuiltinOperator.GATHER:
+    return False
+  options = op.builtinOptions
+  if options is not None and (options.axis != 0 or options.batchDims != 0):
+    return False
+  params = subgraph.tensors[op.inputs[0]]
+  if params.type != schema_fb.TensorType.FLOAT32:
+    return False
+  return _is_int32_vector(subgraph.tensors[op.inputs[1]])
+
+
+def _is_int32_vector(tensor: schema_fb.TensorT) -> bool:
+  # A tensor without a shape in the flatbuffer is a scalar.
+  return (
+      tensor.type == schema_fb.TensorType.INT32
+      and tensor.shape is not None
+      and len(tensor.shape) == 1
+  )
+
+
+def _is_int32_scalar(tensor: schema_fb.TensorT) -> bool:
+  # A tensor without a shape in the flatbuffer is a scalar.
+  return tensor.type == schema_fb.TensorType.INT32 and (
+      tensor.shape is None or len(tensor.shape) == 0
+  )
+
+
+def _get_fused_op_code_index(model: schema_fb.ModelT) -> int:
+  """Returns the index of the op code of the fused op; adds it when needed."""
+  for index, op_code in enumerate(model.operatorCodes):
+    if (
+        _builtin_code(op_code) == schema_fb.BuiltinOperator.CUSTOM
+        and _custom_code(op_code) == GATHER_UNSORTED_SEGMENT_SUM_OP_NAME
+    ):
+      return index
+  op_code = schema_fb.OperatorCodeT()
+  op_code.builtinCode = schema_fb.BuiltinOperator.CUSTOM
+  op_code.deprecatedBuiltinCode = schema_fb.BuiltinOperator.CUSTOM
+  op_code.customCode = GATHER_UNSORTED_SEGMENT_SUM_OP_NAME
+  op_code.version = 1
+  model.operatorCodes.append(op_code)
+  return len(model.operatorCodes) - 1
+
+
+def fuse_gather_segment_sum(model: schema_fb.ModelT) -> int:
+  """Fuses the gather + unsorted segment sum pairs in `model` in place.
+
+  Args:
+    model: The model, in the flatbuffer object API representation.
+
+  Returns:
+    The number of fused pairs.
+  """
+  num_fused = 0
+  for subgraph in model.subgraphs:
+    producers = {}
+    num_uses = {}
+    for op_index, op in enumerate(subgraph.operators):
+      for tensor in op.outputs:
+        producers[tensor] = op_index
+      for tensor in op.inputs:
+        num_uses[tensor] = num_uses.get(tensor, 0) + 1
+    for tensor in subgraph.outputs:
+      num_uses[tensor] = num_uses.get(tensor, 0) + 1
+
+    removed_ops = set()
+    for op in subgraph.operators:
+      if not _is_unsorted_segment_sum(model.operatorCodes[op.opcodeIndex]):
+        continue
+      data, segment_ids, num_segments = op.inputs
+      gather_index = producers.get(data)
+      if gather_index is None or num_uses[data] != 1:
+        continue
+      gather = subgraph.operators[gather_index]
+      if not _is_fusable_gather(
+          subgraph, gather, model.operatorCodes[gather.opcodeIndex]
+      ):
+        continue
+      if not _is_int32_vector(subgraph.tensors[segment_ids]):
+        continue
+      if not _is_int32_scalar(subgraph.tensors[num_segments]):
+        continue
+
+      # The fused op replaces the segment sum; its inputs are all available
+      # there, because they were available at the gather that precedes it.
+      params, indices = gather.inputs
+      op.opcodeIndex = _get_fused_op_code_index(model)
+      op.inputs = [params, indices, segment_ids, num_segments]
+      op.builtinOptionsType = schema_fb.BuiltinOptions.NONE
+      op.builtinOptions = None
+      op.customOptions = None
+      removed_ops.add(gather_index)
+      num_fused += 1
+
+    subgraph.operators = [
+        op
+        for op_index, op in enumerate(subgraph.operators)
+        if op_index not in removed_ops
+    ]
+  return num_fused
+
+
+def main(argv: Sequence[str]) -> None:
+  if len(argv) > 1:
+    raise app.UsageError('Too many command-line arguments.')
+  model = flatbuffer_utils.read_model(_INPUT_TFLITE.value)
+  num_fused = fuse_gather_segment_sum(model)
+  logging.info('Fused %d gather + unsorted segment sum pairs.', num_fused)
+  flatbuffer_utils.write_model(model, _OUTPUT_TFLITE.value)
+
+
+if __name__ == '__main__':
+  app.run(main)
@@ -0,0 +1,174 @@
+# Copyright 2023 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+from gematria.granite.python import fuse_tflite_gather_segment_sum
+import tensorflow as tf
+from tensorflow.lite.python import schema_py_generated as schema_fb
+from tensorflow.lite.tools import flatbuffer_utils
+
+
+def _convert(function, *input_specs) -> schema_fb.ModelT:
+  concrete_function = tf.function(function).get_concrete_function(
+      *input_specs
+  )
+  converter = tf.lite.TFLiteConverter.from_concrete_functions(
+      [concrete_function], concrete_function
+  )
+  converter.allow_custom_ops = True
+  return flatbuffer_utils.convert_bytearray_to_object(converter.convert())
+
+
+_BUILTIN_OP_NAMES = {
+    value: name
+    for name, value in vars(schema_fb.BuiltinOperator).items()
+    if not name.startswith('_')
+}
+
+
+def _op_names(model: schema_fb.ModelT) -> list[str]:
+  """Returns the names of the ops in the main subgraph of `model`."""
+  names = []
+  for op in model.subgraphs[0].operators:
+    op_code = model.operatorCodes[op.opcodeIndex]
+    builtin_code = max(op_code.builtinCode, op_code.deprecatedBuiltinCode)
+    if builtin_code == schema_fb.BuiltinOperator.CUSTOM:
+      custom_code = op_code.customCode
+      if isinstance(custom_code, bytes):
+        custom_code = custom_code.decode('utf-8')
+      names.append(custom_code)
+    else:
+      names.append(_BUILTIN_OP_NAMES[builtin_code])
+  return names
+
+
+def _convert_message_aggregation() -> schema_fb.ModelT:
+  """Returns a model with one gather + unsorted segment sum pair."""
+
+  def aggregate(nodes, senders, receivers):
+    return tf.math.unsorted_segment_sum(
+        tf.gather(nodes, senders), receivers, tf.shape(nodes)[0]
+    )
+
+  return _convert(
+      aggregate,
+      tf.TensorSpec((None, 4), tf.float32),
+      tf.TensorSpec((None,), tf.int32),
+      tf.TensorSpec((None,), tf.int32),
+  )
+
+
+def _find_op(model: schema_fb.ModelT, names: tuple[str, ...]):
+  """Returns the only op in the main subgraph whose name is in `names`."""
+  (index,) = [
+      index for index, name in enumerate(_op_names(model)) if name in names
+  ]
+  return model.subgraphs[0].operators[index]
+
+
+# The names of the segment sum op; it is a custom op in older versions of
+# TensorFlow Lite.
+_SEGMENT_SUM_OP_NAMES = (
+    'UNSORTED_SEGMENT_SUM',
+    fuse_tflite_gather_segment_sum.UNSORTED_SEGMENT_SUM_OP_NAME,
+)
+
+
+class FuseGatherSegmentSumTest(tf.test.TestCase):
+
+  def test_fuse_message_aggregation(self):
+    def aggregate(nodes, senders, receivers):
+      return tf.math.unsorted_segment_sum(
+          tf.gather(nodes, senders), receivers, tf.shape(nodes)[0]
+      )
+
+    model = _convert(
+        aggregate,
+        tf.TensorSpec((None, 4), tf.float32),
+        tf.TensorSpec((None,), tf.int32),
+        tf.TensorSpec((None,), tf.int32),
+    )
+    self.assertIn('GATHER', _op_names(model))
+
+    num_fused = fuse_tflite_gather_segment_sum.fuse_gather_segment_sum(model)
+    self.assertEqual(num_fused, 1)
+    op_names = _op_names(model)
+    self.assertNotIn('GATHER', op_names)
+    self.assertIn(
+        fuse_tflite_gather_segment_sum.GATHER_UNSORTED_SEGMENT_SUM_OP_NAME,
+        op_names,
+    )
+
+  def test_keep_gather_with_other_uses(self):
+    def aggregate(nodes, senders, receivers):
+      messages = tf.gather(nodes, senders)
+      return (
+          tf.math.unsorted_segment_sum(messages, receivers, tf.shape(nodes)[0]),
+          messages,
+      )
+
+    model = _convert(
+        aggregate,
+        tf.TensorSpec((None, 4), tf.float32),
+        tf.TensorSpec((None,), tf.int32),
+        tf.TensorSpec((None,), tf.int32),
+    )
+    num_fused = fuse_tflite_gather_segment_sum.fuse_gather_segment_sum(model)
+    self.assertEqual(num_fused, 0)
+    self.assertIn('GATHER', _op_names(model))
+
+  def test_keep_gather_of_non_float_params(self):
+    def aggregate(nodes, senders, receivers):
+      return tf.math.unsorted_segment_sum(
+          tf.gather(nodes, senders), receivers, tf.shape(nodes)[0]
+      )
+
+    model = _convert(
+        aggregate,
+        tf.TensorSpec((None, 4), tf.int32),
+        tf.TensorSpec((None,), tf.int32),
+        tf.TensorSpec((None,), tf.int32),
+    )
+    num_fused = fuse_tflite_gather_segment_sum.fuse_gather_segment_sum(model)
+    self.assertEqual(num_fused, 0)
+    self.assertIn('GATHER', _op_names(model))
+
+  def test_keep_gather_with_non_scalar_num_segments(self):
+    model = _convert_message_aggregation()
+    # The converter always produces a scalar; make it a vector to check that
+    # the pattern is not fused.
+    segment_sum = _find_op(model, _SEGMENT_SUM_OP_NAMES)
+    model.subgraphs[0].tensors[segment_sum.inputs[2]].shape = [1]
+    num_fused = fuse_tflite_gather_segment_sum.fuse_gather_segment_sum(model)
+    self.assertEqual(num_fused, 0)
+    self.assertIn('GATHER', _op_names(model))
+
+  def test_keep_gather_with_scalar_indices(self):
+    model = _convert_message_aggregation()
+    # A tensor without a shape is a scalar.
+    gather = _find_op(model, ('GATHER',))
+    model.subgraphs[0].tensors[gather.inputs[1]].shape = None
+    num_fused = fuse_tflite_gather_segment_sum.fuse_gather_segment_sum(model)
+    self.assertEqual(num_fused, 0)
+    self.assertIn('GATHER', _op_names(model))
+
+  def test_keep_gather_with_scalar_segment_ids(self):
+    model = _convert_message_aggregation()
+    segment_sum = _find_op(model, _SEGMENT_SUM_OP_NAMES)
+    model.subgraphs[0].tensors[segment_sum.inputs[1]].shape = None
+    num_fused = fuse_tflite_gather_segment_sum.fuse_gather_segment_sum(model)
+    self.assertEqual(num_fused, 0)
+    self.assertIn('GATHER', _op_names(model))
+
+if __name__ == '__main__':
+  tf.test.main()
@@ -14,16 +14,25 @@
 
 #include "gematria/granite/graph_builder.h"
 
+#include <cstdint>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
+#include "absl/status/statusor.h"
 #include "absl/strings/string_view.h"
+#include "gematria/granite/graph_builder_protos.h"
 #include "gematria/model/oov_token_behavior.h"
 #include "gematria/proto/canonicalized_instruction.pb.h"
 #include "pybind11/cast.h"
 #include "pybind11/detail/common.h"
+#include "pybind11/numpy.h"
 #include "pybind11/pybind11.h"
+#include "pybind11/pytypes.h"
 #include "pybind11/stl.h"
+#include "pybind11_abseil/import_status_module.h"
+#include "pybind11_abseil/status_casters.h"
 #include "pybind11_protobuf/native_proto_caster.h"
 
 namespace gematria {
@@ -35,12 +44,48 @@ constexpr const char* const kModuleDocstring =
     R"(Conversion of basic blocks to a graph representation.
 
 See the comments in the C++ version of the class for more details on the graph
-representation and the conversion process.)";
+representation and the conversion process.
+
+The methods that add basic blocks to the batch release the GIL while they run,
+so that multiple Python threads can build batches in parallel. A single
+BasicBlockGraphBuilder object must be used by at most one thread at a time;
+different BasicBlockGraphBuilder objects can be used concurrently. The basic
+blocks passed to the builder must not be modified by other threads while the
+builder is processing them.)";
+
+// Returns a NumPy array with a copy of `data`. The data is copied in bulk
+// instead of converting each element to a Python object. We do not return
+// views of the buffers of the graph builder, because the buffers are
+// reallocated as basic blocks are added to the batch, and the models modify
+// some of the arrays in place (e.g. when injecting out-of-vocabulary tokens).
+template <typename T>
+py::array_t<T> ToNumPyArray(const std::vector<T>& data) {
+  return py::array_t<T>(static_cast<py::ssize_t>(data.size()), data.data());
+}
+
+// A version of ToNumPyArray() for the instruction node mask. The mask is
+// stored as one byte per node with values 0 or 1, which is also the memory
+// layout of a NumPy array of booleans.
+py::array_t<bool> ToNumPyBoolArray(const std::vector<uint8_t>& data) {
+  static_assert(sizeof(bool) == sizeof(uint8_t));
+  return py::array_t<bool>(static_cast<py::ssize_t>(data.size()),
+                           reinterpret_cast<const bool*>(data.data()));
+}
+
+// AddBasicBlocksFromTFRecordFile() with the graph builder as the first
+// argument, so that it can be bound as a method.
+absl::StatusOr<std::vector<bool>> AddBasicBlocksFromTFRecordFileForPython(
+    BasicBlockGraphBuilder& self, std::string_view file_name,
+    int64_t first_record, int64_t num_records) {
+  return AddBasicBlocksFromTFRecordFile(file_name, first_record, num_records,
+                                        self);
+}
 
 PYBIND11_MODULE(graph_builder, m) {
   m.doc() = kModuleDocstring;
 
   pybind11_protobuf::ImportNativeProtoCasters();
+  py::google::ImportStatusModule();
 
   py::enum_<NodeType>(m, "NodeType")
       .value("INSTRUCTION", NodeType::kInstruction)
@@ -62,6 +107,12 @@ PYBIND11_MODULE(graph_builder, m) {
       .value("INTERFERENCE", EdgeType::kInterference)
       .export_values();
 
+  py::enum_<LiveInfoMode>(m, "LiveInfoMode")
+      .value("NO_LIVE_INFO", LiveInfoMode::kNoLiveInfo)
+      .value("PER_BB_LIVE_INFO", LiveInfoMode::kPerBasicBlockLiveInfo)
+      .value("PER_FUNC_LIVE_INFO", LiveInfoMode::kPerFunctionLiveInfo)
+      .export_values();
+
   py::class_<BasicBlockGraphBuilder>(m, "BasicBlockGraphBuilder")
       .def(
           py::init<std::vector<std::string> /* node_tokens */,
@@ -74,33 +125,166 @@ PYBIND11_MODULE(graph_builder, m) {
           py::arg("node_tokens"), py::arg("immediate_token"),
           py::arg("fp_immediate_token"), py::arg("address_token"),
           py::arg("memory_token"), py::arg("out_of_vocabulary_behavior"))
+      // The arguments are converted and the results are converted back with
+      // the GIL held; the builder itself touches only its own state, and it
+      // can run without the GIL.
       .def("add_basic_block", &BasicBlockGraphBuilder::AddBasicBlock,
-           py::arg("block"))
+           py::arg("block"), py::call_guard<py::gil_scoped_release>())
       .def("add_basic_block_from_instructions",
            &BasicBlockGraphBuilder::AddBasicBlockFromInstructions,
-           py::arg("instructions"))
-      .def("reset", &BasicBlockGraphBuilder::Reset)
+           py::arg("instructions"), py::call_guard<py::gil_scoped_release>())
+      .def("add_basic_blocks_in_parallel",
+           &BasicBlockGraphBuilder::AddBasicBlocksInParallel,
+           py::arg("blocks"), py::arg("num_threads"),
+           py::call_guard<py::gil_scoped_release>())
+      .def(
+          "add_basic_blocks_from_serialized_protos",
+          [](BasicBlockGraphBuilder& self,
+             const py::sequence& serialized_protos)
+              -> absl::StatusOr<std::vector<bool>> {
+            // Keep references to the bytes objects, so that the views remain
+            // valid without the GIL even when another thread modifies
+            // `serialized_protos`.
+            std::vector<py::bytes> protos;
+            std::vector<std::string_view> views;
+            protos.reserve(serialized_protos.size());
+            views.reserve(serialized_protos.size());
+            for (const py::handle serialized_proto : serialized_protos) {
+              protos.push_back(py::cast<py::bytes>(serialized_proto));
+              views.push_back(protos.back());
+            }
+            py::gil_scoped_release no_gil;
+            return AddBasicBlocksFromSerializedProtos(views, self);
+          },
+          py::arg("serialized_protos"),
+          R"(Adds basic blocks from serialized BasicBlockProtos.
+
+          The protos are parsed and added to the batch in C++, without creating
+          the Python BasicBlock objects, and without the GIL.
+
+          Args:
+            serialized_protos: A sequence of `bytes` objects, each containing
+              a serialized BasicBlockProto.
+
+          Returns:
+            A list of booleans, one per proto, with the values that
+            `add_basic_block` would return for the basic blocks.
+
+          Raises:
+            StatusNotOk: When one of the protos can't be parsed. The blocks
+              before it remain in the batch.)")
+      .def("add_basic_blocks_from_tfrecord_file",
+           &AddBasicBlocksFromTFRecordFileForPython, py::arg("file_name"),
+           py::arg("first_record") = int64_t{0},
+           py::arg("num_records") = int64_t{-1},
+           py::call_guard<py::gil_scoped_release>(),
+           R"(Adds basic blocks from a range of records of a .tfrecord file.
+
+          Reads the records with indices [first_record,
+          first_record + num_records) from a local uncompressed .tfrecord file
+          of BasicBlockWithThroughputProtos, and adds their basic blocks to the
+          batch. The whole process runs in C++ without the GIL.
+
+          Args:
+            file_name: The name of the .tfrecord file.
+            first_record: The index of the first record to add.
+            num_records: The maximal number of records to add. When negative,
+              adds all records until the end of the file.
+
+          Returns:
+            A list of booleans, one per record read from the file, with the
+            values that `add_basic_block` would return for the basic blocks.
+
+          Raises:
+            StatusNotOk: When the file can't be read or a record can't be
+              parsed.)")
+      .def("reset", &BasicBlockGraphBuilder::Reset,
+           py::call_guard<py::gil_scoped_release>())
+      .def("reserve", &BasicBlockGraphBuilder::Reserve, py::arg("num_graphs"),
+           py::arg("num_nodes"), py::arg("num_edges"),
+           py::call_guard<py::gil_scoped_release>())
+      .def("reserve_for_basic_blocks",
+           &BasicBlockGraphBuilder::ReserveForBasicBlocks, py::arg("blocks"),
+           py::call_guard<py::gil_scoped_release>())
+      .def("set_deduplicate_blocks",
+           &BasicBlockGraphBuilder::SetDeduplicateBlocks, py::arg("enabled"))
+      .def_property_readonly("deduplicate_blocks",
+                             &BasicBlockGraphBuilder::deduplicate_blocks)
+      .def("set_live_info_mode", &BasicBlockGraphBuilder::SetLiveInfoMode,
+           py::arg("live_info_mode"))
+      .def_property_readonly("live_info_mode",
+                             &BasicBlockGraphBuilder::live_info_mode)
+      .def_property_readonly("num_blocks", &BasicBlockGraphBuilder::num_blocks)
+      .def_property_readonly("block_graph_indices",
+                             [](const BasicBlockGraphBuilder& builder) {
+                               return ToNumPyArray(
+                                   builder.block_graph_indices());
+                             })
       .def_property_readonly("num_node_tokens",
                              &BasicBlockGraphBuilder::num_node_tokens)
       .def_property_readonly("num_graphs", &BasicBlockGraphBuilder::num_graphs)
       .def_property_readonly("num_nodes", &BasicBlockGraphBuilder::num_nodes)
       .def_property_readonly("num_edges", &BasicBlockGraphBuilder::num_edges)
       .def_property_readonly("num_nodes_per_block",
-                             &BasicBlockGraphBuilder::num_nodes_per_block)
+                             [](const BasicBlockGraphBuilder& builder) {
+                               return ToNumPyArray(
+                                   builder.num_nodes_per_block());
+                             })
       .def_property_readonly("num_edges_per_block",
-                             &BasicBlockGraphBuilder::num_edges_per_block)
+                             [](const BasicBlockGraphBuilder& builder) {
+                               return ToNumPyArray(
+                                   builder.num_edges_per_block());
+                             })
       .def_property_readonly("node_features",
-                             &BasicBlockGraphBuilder::node_features)
+                             [](const BasicBlockGraphBuilder& builder) {
+                               return ToNumPyArray(builder.node_features());
+                             })
       .def_property_readonly("instruction_node_mask",
-                             &BasicBlockGraphBuilder::InstructionNodeMask)
+                             [](const BasicBlockGraphBuilder& builder) {
+                               return ToNumPyBoolArray(
+                                   builder.instruction_node_mask());
+                             })
+      .def_property_readonly("delta_block_index",
+                             [](const BasicBlockGraphBuilder& builder) {
+                               return ToNumPyArray(
+                                   builder.delta_block_index());
+                             })
       .def_property_readonly("edge_senders",
-                             &BasicBlockGraphBuilder::edge_senders)
+                             [](const BasicBlockGraphBuilder& builder) {
+                               return ToNumPyArray(builder.edge_senders());
+                             })
       .def_property_readonly("edge_receivers",
-                             &BasicBlockGraphBuilder::edge_receivers)
+                             [](const BasicBlockGraphBuilder& builder) {
+                               return ToNumPyArray(builder.edge_receivers());
+                             })
       .def_property_readonly("edge_features",
-                             &BasicBlockGraphBuilder::EdgeFeatures)
-      .def_property_readonly("global_features",
-                             &BasicBlockGraphBuilder::global_features)
+                             [](const BasicBlockGraphBuilder& builder) {
+                               return ToNumPyArray(builder.edge_features());
+                             })
+      .def_property_readonly(
+          "global_features",
+          [](const BasicBlockGraphBuilder& builder) {
+            // The global features are returned as a 2D array of shape
+            // (num_graphs, num_node_tokens).
+            return py::array_t<int>(
+                {static_cast<py::ssize_t>(builder.num_graphs()),
+                 static_cast<py::ssize_t>(builder.num_node_tokens())},
+                builder.global_features_data().data());
+          })
+      .def_property_readonly("global_features_data",
+                             [](const BasicBlockGraphBuilder& builder) {
+                               return ToNumPyArray(
+                                   builder.global_features_data());
+                             })
+      .def_property_readonly(
+          "global_features_csr",
+          [](const BasicBlockGraphBuilder& builder) {
+            const BasicBlockGraphBuilder::SparseGlobalFeatures csr =
+                builder.GlobalFeaturesCsr();
+            return py::make_tuple(ToNumPyArray(csr.row_offsets),
+                                  ToNumPyArray(csr.column_indices),
+                                  ToNumPyArray(csr.values));
+          })
       .def_property_readonly("immediate_token",
                              &BasicBlockGraphBuilder::immediate_token)
       .def_property_readonly("fp_immediate_token",
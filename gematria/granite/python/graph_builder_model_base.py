@@ -129,7 +129,9 @@ class GraphBuilderModelBase(
     )
     self._instruction_node_mask = None
     self._instruction_features = None
-    self._batch_graph_builder = graph_builder.BasicBlockGraphBuilder(
+    # The arguments are kept so that self._clone_for_batch_scheduling() can
+    # create a new graph builder with the same configuration.
+    self._graph_builder_kwargs = dict(
         node_tokens=self._token_list,
         immediate_token=immediate_token,
         fp_immediate_token=fp_immediate_token,
@@ -137,6 +139,9 @@ class GraphBuilderModelBase(
         memory_token=memory_token,
         out_of_vocabulary_behavior=self._oov_behavior,
     )
+    self._batch_graph_builder = graph_builder.BasicBlockGraphBuilder(
+        **self._graph_builder_kwargs
+    )
 
     self._special_tokens_tensor = None
 
@@ -196,6 +201,14 @@ class GraphBuilderModelBase(
         self._graphs_tuple_outputs.nodes, self._instruction_node_mask
     )
 
+  # @Override
+  def _clone_for_batch_scheduling(self) -> 'GraphBuilderModelBase':
+    clone = super()._clone_for_batch_scheduling()
+    clone._batch_graph_builder = graph_builder.BasicBlockGraphBuilder(
+        **self._graph_builder_kwargs
+    )
+    return clone
+
   # @Override
   def _start_batch(self) -> None:
     super()._start_batch()
@@ -204,14 +217,17 @@ class GraphBuilderModelBase(
   # @Override
   def _make_batch_feed_dict(self) -> model_base.FeedDict:
     feed_dict = super()._make_batch_feed_dict()
-    feed_dict[self._instruction_node_mask] = np.array(
-        self._batch_graph_builder.instruction_node_mask, dtype=bool
+    feed_dict[self._instruction_node_mask] = (
+        self._batch_graph_builder.instruction_node_mask
     )
     return feed_dict
 
   # @Override
   def _make_batch_graphs_tuple(self):
-    node_features = np.array(
+    # The graph builder returns new NumPy arrays on each access, so it is safe
+    # to modify them in place. np.asarray() copies the data only when the dtype
+    # of the array does not match the one used by the model.
+    node_features = np.asarray(
         self._batch_graph_builder.node_features,
         dtype=self._graph_node_feature_spec.dtype.as_numpy_dtype,
     )
@@ -228,30 +244,30 @@ class GraphBuilderModelBase(
       node_features[injection_mask] = self._oov_token
     return graph_nets.graphs.GraphsTuple(
         nodes=node_features,
-        edges=np.array(
+        edges=np.asarray(
             self._batch_graph_builder.edge_features,
             dtype=self._graph_edge_feature_spec.dtype.as_numpy_dtype,
         ),
         # NOTE(ondrasej): The graph globals are not normalized by the number of
         # nodes in the graph. We could do it here, but we can also do it by
         # introducing a LayerNorm layer in the first graph network module.
-        globals=np.array(
+        globals=np.asarray(
             self._batch_graph_builder.global_features,
             dtype=self._graph_global_feature_spec.dtype.as_numpy_dtype,
         ),
-        receivers=np.array(
+        receivers=np.asarray(
             self._batch_graph_builder.edge_receivers,
             dtype=self._graph_index_dtype.as_numpy_dtype,
         ),
-        senders=np.array(
+        senders=np.asarray(
             self._batch_graph_builder.edge_senders,
             dtype=self._graph_index_dtype.as_numpy_dtype,
         ),
-        n_node=np.array(
+        n_node=np.asarray(
             self._batch_graph_builder.num_nodes_per_block,
             dtype=self._graph_index_dtype.as_numpy_dtype,
         ),
-        n_edge=np.array(
+        n_edge=np.asarray(
             self._batch_graph_builder.num_edges_per_block,
             dtype=self._graph_index_dtype.as_numpy_dtype,
         ),
@@ -13,12 +13,16 @@
 # limitations under the License.
 
 import itertools
+from os import path
+import threading
 
 from absl.testing import absltest
 from gematria.basic_block.python import tokens
 from gematria.granite.python import graph_builder
+from gematria.io.python import sharded_tfrecord_writer
 from gematria.model.python import oov_token_behavior
 from gematria.testing.python import basic_blocks_with_throughput
+import numpy as np
 
 # A list of tokens that contains all the "helper" tokens used by the graph
 # builder but no tokens for the actual assembly code. Transforming a non-empty
@@ -71,6 +75,13 @@ class BasicBlockGraphBuilderTest(
     self.assertLen(global_features, num_blocks)
     for global_feature in global_features:
       self.assertLen(global_feature, builder.num_node_tokens)
+    self.assertLen(
+        builder.global_features_data, num_blocks * builder.num_node_tokens
+    )
+    row_offsets, column_indices, values = builder.global_features_csr
+    self.assertLen(row_offsets, num_blocks + 1)
+    self.assertLen(column_indices, row_offsets[-1])
+    self.assertLen(values, row_offsets[-1])
 
     if builder.num_edges:
       self.assertLess(max(edge_senders), builder.num_edges)
@@ -137,6 +148,204 @@ class BasicBlockGraphBuilderTest(
 
     self.assertBuilderIsSelfConsistent(builder, num_blocks)
 
+  def test_add_basic_blocks_in_parallel(self):
+    def make_builder():
+      return graph_builder.BasicBlockGraphBuilder(
+          node_tokens=self.tokens,
+          immediate_token=tokens.IMMEDIATE,
+          fp_immediate_token=tokens.IMMEDIATE,
+          address_token=tokens.ADDRESS,
+          memory_token=tokens.MEMORY,
+          out_of_vocabulary_behavior=(
+              _OutOfVocabularyTokenBehavior.return_error()
+          ),
+      )
+
+    serial_builder = make_builder()
+    for block in self.blocks:
+      self.assertTrue(serial_builder.add_basic_block(block))
+
+    parallel_builder = make_builder()
+    self.assertEqual(
+        parallel_builder.add_basic_blocks_in_parallel(
+            self.blocks, num_threads=4
+        ),
+        [True] * len(self.blocks),
+    )
+
+    self.assertBuilderIsSelfConsistent(parallel_builder, len(self.blocks))
+    np.testing.assert_array_equal(
+        parallel_builder.node_features, serial_builder.node_features
+    )
+    np.testing.assert_array_equal(
+        parallel_builder.edge_senders, serial_builder.edge_senders
+    )
+    np.testing.assert_array_equal(
+        parallel_builder.edge_receivers, serial_builder.edge_receivers
+    )
+    np.testing.assert_array_equal(
+        parallel_builder.edge_features, serial_builder.edge_features
+    )
+
+  def test_builders_in_python_threads(self):
+    num_threads = 4
+    builders = [
+        graph_builder.BasicBlockGraphBuilder(
+            node_tokens=self.tokens,
+            immediate_token=tokens.IMMEDIATE,
+            fp_immediate_token=tokens.IMMEDIATE,
+            address_token=tokens.ADDRESS,
+            memory_token=tokens.MEMORY,
+            out_of_vocabulary_behavior=(
+                _OutOfVocabularyTokenBehavior.return_error()
+            ),
+        )
+        for _ in range(num_threads)
+    ]
+    results = [None] * num_threads
+
+    def add_blocks(index):
+      results[index] = [
+          builders[index].add_basic_block(block) for block in self.blocks
+      ]
+
+    threads = [
+        threading.Thread(target=add_blocks, args=(index,))
+        for index in range(num_threads)
+    ]
+    for thread in threads:
+      thread.start()
+    for thread in threads:
+      thread.join()
+
+    for builder, result in zip(builders, results):
+      self.assertEqual(result, [True] * len(self.blocks))
+      self.assertBuilderIsSelfConsistent(builder, len(self.blocks))
+      np.testing.assert_array_equal(
+          builder.node_features, builders[0].node_features
+      )
+      np.testing.assert_array_equal(
+          builder.edge_senders, builders[0].edge_senders
+      )
+
+  def assertSameGraphs(self, actual, expected):
+    self.assertEqual(actual.num_graphs, expected.num_graphs)
+    np.testing.assert_array_equal(actual.node_features, expected.node_features)
+    np.testing.assert_array_equal(actual.edge_senders, expected.edge_senders)
+    np.testing.assert_array_equal(
+        actual.edge_receivers, expected.edge_receivers
+    )
+    np.testing.assert_array_equal(actual.edge_features, expected.edge_features)
+    np.testing.assert_array_equal(
+        actual.global_features_data, expected.global_features_data
+    )
+
+  def make_builder(self):
+    return graph_builder.BasicBlockGraphBuilder(
+        node_tokens=self.tokens,
+        immediate_token=tokens.IMMEDIATE,
+        fp_immediate_token=tokens.IMMEDIATE,
+        address_token=tokens.ADDRESS,
+        memory_token=tokens.MEMORY,
+        out_of_vocabulary_behavior=_OutOfVocabularyTokenBehavior.return_error(),
+    )
+
+  def test_add_basic_blocks_from_serialized_protos(self):
+    expected = self.make_builder()
+    for block in self.blocks:
+      self.assertTrue(expected.add_basic_block(block))
+
+    builder = self.make_builder()
+    self.assertEqual(
+        builder.add_basic_blocks_from_serialized_protos([
+            proto.basic_block.SerializeToString()
+            for proto in self.block_protos
+        ]),
+        [True] * len(self.block_protos),
+    )
+    self.assertBuilderIsSelfConsistent(builder, len(self.blocks))
+    self.assertSameGraphs(builder, expected)
+
+  def test_add_basic_blocks_from_tfrecord_file(self):
+    base_name = path.join(self.create_tempdir().full_path, 'blocks.tfrecord')
+    with sharded_tfrecord_writer.ShardedTFRecordWriter.open(
+        base_name
+    ) as writer:
+      for proto in self.block_protos:
+        writer.write(proto.SerializeToString())
+    (file_name,) = writer.file_names
+
+    expected = self.make_builder()
+    for block in self.blocks[2:5]:
+      self.assertTrue(expected.add_basic_block(block))
+
+    builder = self.make_builder()
+    self.assertEqual(
+        builder.add_basic_blocks_from_tfrecord_file(
+            file_name, first_record=2, num_records=3
+        ),
+        [True] * 3,
+    )
+    self.assertBuilderIsSelfConsistent(builder, 3)
+    self.assertSameGraphs(builder, expected)
+
+  def test_deduplicate_blocks(self):
+    builder = graph_builder.BasicBlockGraphBuilder(
+        node_tokens=self.tokens,
+        immediate_token=tokens.IMMEDIATE,
+        fp_immediate_token=tokens.IMMEDIATE,
+        address_token=tokens.ADDRESS,
+        memory_token=tokens.MEMORY,
+        out_of_vocabulary_behavior=_OutOfVocabularyTokenBehavior.return_error(),
+    )
+    builder.set_deduplicate_blocks(True)
+    self.assertTrue(builder.deduplicate_blocks)
+
+    self.assertTrue(builder.add_basic_block(self.blocks[0]))
+    self.assertTrue(builder.add_basic_block(self.blocks[0]))
+    self.assertEqual(builder.num_blocks, 2)
+    np.testing.assert_array_equal(builder.block_graph_indices, [0, 0])
+    self.assertBuilderIsSelfConsistent(builder, 1)
+
+  def test_numpy_arrays(self):
+    builder = graph_builder.BasicBlockGraphBuilder(
+        node_tokens=self.tokens,
+        immediate_token=tokens.IMMEDIATE,
+        fp_immediate_token=tokens.IMMEDIATE,
+        address_token=tokens.ADDRESS,
+        memory_token=tokens.MEMORY,
+        out_of_vocabulary_behavior=_OutOfVocabularyTokenBehavior.return_error(),
+    )
+    self.assertTrue(builder.add_basic_block(self.blocks[0]))
+    self.assertTrue(builder.add_basic_block(self.blocks[1]))
+
+    node_features = builder.node_features
+    self.assertIsInstance(node_features, np.ndarray)
+    self.assertEqual(node_features.dtype, np.int32)
+    self.assertEqual(builder.edge_senders.dtype, np.int32)
+    self.assertEqual(builder.instruction_node_mask.dtype, np.bool_)
+    self.assertEqual(
+        builder.global_features.shape, (2, builder.num_node_tokens)
+    )
+    np.testing.assert_array_equal(
+        builder.global_features.reshape(-1), builder.global_features_data
+    )
+    self.assertEqual(
+        np.count_nonzero(builder.instruction_node_mask),
+        len(builder.delta_block_index),
+    )
+
+    # The arrays are copies of the data; modifying them does not change the
+    # graph builder, and they remain valid after the builder is reset.
+    expected_node_features = node_features.copy()
+    builder.node_features[0] += 1
+    np.testing.assert_array_equal(
+        builder.node_features, expected_node_features
+    )
+    builder.reset()
+    self.assertEqual(builder.num_nodes, 0)
+    np.testing.assert_array_equal(node_features, expected_node_features)
+
   def test_out_of_vocabulary_tokens_return_error(self):
     builder = graph_builder.BasicBlockGraphBuilder(
         node_tokens=_STRUCTURAL_TOKENS,
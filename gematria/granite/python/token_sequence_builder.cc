@@ -0,0 +1,112 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "gematria/granite/token_sequence_builder.h"
+
+#include <string>
+#include <vector>
+
+#include "gematria/model/oov_token_behavior.h"
+#include "pybind11/cast.h"
+#include "pybind11/detail/common.h"
+#include "pybind11/numpy.h"
+#include "pybind11/pybind11.h"
+#include "pybind11/stl.h"
+
+namespace gematria {
+namespace {
+
+namespace py = ::pybind11;
+
+constexpr const char* const kModuleDocstring =
+    R"(Conversion of basic blocks to sequences of token indices.
+
+See the comments in the C++ version of the class for more details on the
+format of the token sequences.
+
+The methods that add basic blocks to the batch release the GIL while they run.
+A single TokenSequenceBuilder object must be used by at most one thread at a
+time; different TokenSequenceBuilder objects can be used concurrently.)";
+
+// Returns a NumPy array with a copy of `data`; see the comment of the same
+// function in graph_builder.cc.
+py::array_t<int> ToNumPyArray(const std::vector<int>& data) {
+  return py::array_t<int>(static_cast<py::ssize_t>(data.size()), data.data());
+}
+
+PYBIND11_MODULE(token_sequence_builder, m) {
+  m.doc() = kModuleDocstring;
+
+  py::class_<TokenSequenceBuilder>(m, "TokenSequenceBuilder")
+      .def(py::init<std::vector<std::string> /* tokens */,
+                    OutOfVocabularyTokenBehavior /* oov_behavior */>(),
+           py::arg("tokens"), py::arg("out_of_vocabulary_behavior"))
+      // The arguments are converted and the results are converted back with
+      // the GIL held; the builder itself touches only its own state, and it
+      // can run without the GIL.
+      .def("add_basic_block", &TokenSequenceBuilder::AddBasicBlock,
+           py::arg("block"), py::call_guard<py::gil_scoped_release>())
+      .def("add_basic_block_from_instructions",
+           &TokenSequenceBuilder::AddBasicBlockFromInstructions,
+           py::arg("instructions"), py::call_guard<py::gil_scoped_release>())
+      .def("reset", &TokenSequenceBuilder::Reset)
+      .def_property_readonly("num_blocks", &TokenSequenceBuilder::num_blocks)
+      .def_property_readonly("num_instructions",
+                             &TokenSequenceBuilder::num_instructions)
+      .def_property_readonly("vocabulary_size",
+                             &TokenSequenceBuilder::vocabulary_size)
+      .def_property_readonly("token_sequence",
+                             [](const TokenSequenceBuilder& builder) {
+                               return ToNumPyArray(builder.token_sequence());
+                             })
+      .def_property_readonly("num_tokens_per_instruction",
+                             [](const TokenSequenceBuilder& builder) {
+                               return ToNumPyArray(
+                                   builder.num_tokens_per_instruction());
+                             })
+      .def_property_readonly("num_instructions_per_block",
+                             [](const TokenSequenceBuilder& builder) {
+                               return ToNumPyArray(
+                                   builder.num_instructions_per_block());
+                             })
+      .def_property_readonly("instruction_token_offsets",
+                             [](const TokenSequenceBuilder& builder) {
+                               return ToNumPyArray(
+                                   builder.instruction_token_offsets());
+                             })
+      .def_property_readonly("max_tokens_per_instruction",
+                             &TokenSequenceBuilder::max_tokens_per_instruction)
+      .def(
+          "padded_token_sequence",
+          [](const TokenSequenceBuilder& builder, int padding_token) {
+            // The padded tokens are returned as a 2D array of shape
+            // (num_instructions, max_tokens_per_instruction).
+            const std::vector<int> padded =
+                builder.PaddedTokenSequence(padding_token);
+            return py::array_t<int>(
+                {static_cast<py::ssize_t>(builder.num_instructions()),
+                 static_cast<py::ssize_t>(
+                     builder.max_tokens_per_instruction())},
+                padded.data());
+          },
+          py::arg("padding_token"))
+      .def_property_readonly("last_unknown_token",
+                             &TokenSequenceBuilder::last_unknown_token)
+      .def_property_readonly("replacement_token",
+                             &TokenSequenceBuilder::replacement_token);
+}
+
+}  // namespace
+}  // namespace gematria
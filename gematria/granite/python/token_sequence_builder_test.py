@@ -0,0 +1,106 @@
+# Copyright 2023 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+from absl.testing import absltest
+from gematria.granite.python import token_sequence_builder
+from gematria.model.python import oov_token_behavior
+from gematria.testing.python import basic_blocks_with_throughput
+import numpy as np
+
+_OutOfVocabularyTokenBehavior = oov_token_behavior.OutOfVocabularyTokenBehavior
+
+
+class TokenSequenceBuilderTest(
+    basic_blocks_with_throughput.TestCase, absltest.TestCase
+):
+  """Test for the TokenSequenceBuilder class wrapper.
+
+  Most of the functionality is tested in the corresponding cc_test(). Here we
+  test that the builder produces the same tokens as
+  `Instruction.as_token_list()`, and that all methods return data in the
+  expected shape.
+  """
+
+  def setUp(self):
+    self.num_blocks = 10
+    super().setUp()
+    self.token_index = {token: i for i, token in enumerate(self.tokens)}
+
+  def test_same_tokens_as_python(self):
+    builder = token_sequence_builder.TokenSequenceBuilder(
+        tokens=self.tokens,
+        out_of_vocabulary_behavior=_OutOfVocabularyTokenBehavior.return_error(),
+    )
+    expected_tokens = []
+    expected_num_tokens_per_instruction = []
+    for block in self.blocks:
+      self.assertTrue(builder.add_basic_block(block))
+      for instruction in block.instructions:
+        tokens = instruction.as_token_list()
+        expected_num_tokens_per_instruction.append(len(tokens))
+        expected_tokens.extend(self.token_index[token] for token in tokens)
+
+    self.assertEqual(builder.num_blocks, len(self.blocks))
+    np.testing.assert_array_equal(builder.token_sequence, expected_tokens)
+    np.testing.assert_array_equal(
+        builder.num_tokens_per_instruction, expected_num_tokens_per_instruction
+    )
+    np.testing.assert_array_equal(
+        builder.num_instructions_per_block,
+        [len(block.instructions) for block in self.blocks],
+    )
+    np.testing.assert_array_equal(
+        builder.instruction_token_offsets,
+        np.cumsum([0] + expected_num_tokens_per_instruction),
+    )
+
+  def test_padded_token_sequence(self):
+    builder = token_sequence_builder.TokenSequenceBuilder(
+        tokens=self.tokens,
+        out_of_vocabulary_behavior=_OutOfVocabularyTokenBehavior.return_error(),
+    )
+    for block in self.blocks:
+      self.assertTrue(builder.add_basic_block(block))
+
+    padded = builder.padded_token_sequence(padding_token=-1)
+    self.assertEqual(
+        padded.shape,
+        (builder.num_instructions, builder.max_tokens_per_instruction),
+    )
+    np.testing.assert_array_equal(padded[padded >= 0], builder.token_sequence)
+
+  def test_unknown_token(self):
+    builder = token_sequence_builder.TokenSequenceBuilder(
+        tokens=self.tokens[1:],
+        out_of_vocabulary_behavior=_OutOfVocabularyTokenBehavior.return_error(),
+    )
+    self.assertFalse(
+        all(builder.add_basic_block(block) for block in self.blocks)
+    )
+    self.assertEqual(builder.last_unknown_token, self.tokens[0])
+
+  def test_reset(self):
+    builder = token_sequence_builder.TokenSequenceBuilder(
+        tokens=self.tokens,
+        out_of_vocabulary_behavior=_OutOfVocabularyTokenBehavior.return_error(),
+    )
+    self.assertTrue(builder.add_basic_block(self.blocks[0]))
+    builder.reset()
+    self.assertEqual(builder.num_blocks, 0)
+    self.assertEqual(builder.num_instructions, 0)
+    self.assertEmpty(builder.token_sequence)
+
+
+if __name__ == '__main__':
+  absltest.main()
@@ -0,0 +1,132 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "gematria/granite/token_sequence_builder.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/model/oov_token_behavior.h"
+
+namespace gematria {
+namespace {
+
+constexpr TokenSequenceBuilder::TokenIndex kInvalidTokenIndex(-1);
+
+std::unordered_map<std::string_view, TokenSequenceBuilder::TokenIndex>
+MakeTokenIndex(const std::vector<std::string>& tokens) {
+  std::unordered_map<std::string_view, TokenSequenceBuilder::TokenIndex> index;
+  index.reserve(tokens.size());
+  for (TokenSequenceBuilder::TokenIndex i = 0; i < tokens.size(); ++i) {
+    const auto insertion_result = index.emplace(tokens[i], i);
+    if (!insertion_result.second) {
+      // TODO(ondrasej): Make this return a status.
+      std::cerr << "Duplicate item: '" << insertion_result.first->first << "'";
+      std::abort();
+    }
+  }
+  return index;
+}
+
+TokenSequenceBuilder::TokenIndex FindReplacementTokenOrDie(
+    const std::unordered_map<std::string_view,
+                             TokenSequenceBuilder::TokenIndex>& index,
+    const OutOfVocabularyTokenBehavior& out_of_vocabulary_behavior) {
+  if (out_of_vocabulary_behavior.behavior_type() ==
+      OutOfVocabularyTokenBehavior::BehaviorType::kReturnError) {
+    return kInvalidTokenIndex;
+  }
+  return index.at(out_of_vocabulary_behavior.replacement_token());
+}
+
+}  // namespace
+
+TokenSequenceBuilder::TokenSequenceBuilder(
+    std::vector<std::string> tokens,
+    OutOfVocabularyTokenBehavior
+        out_of_vocabulary_behavior /* = ReturnError() */)
+    : tokens_(std::move(tokens)),
+      token_index_(MakeTokenIndex(tokens_)),
+      replacement_token_(FindReplacementTokenOrDie(
+          token_index_, out_of_vocabulary_behavior)) {}
+
+bool TokenSequenceBuilder::AddBasicBlockFromInstructions(
+    const std::vector<Instruction>& instructions) {
+  const size_t previous_num_tokens = token_sequence_.size();
+  const size_t previous_num_instructions = num_tokens_per_instruction_.size();
+  int max_tokens_per_instruction = max_tokens_per_instruction_;
+  for (const Instruction& instruction : instructions) {
+    instruction_tokens_.clear();
+    instruction.AddTokensToList(instruction_tokens_);
+    for (const std::string& token : instruction_tokens_) {
+      const auto it = token_index_.find(token);
+      TokenIndex token_index =
+          it == token_index_.end() ? kInvalidTokenIndex : it->second;
+      if (token_index == kInvalidTokenIndex) {
+        if (replacement_token_ == kInvalidTokenIndex) {
+          // Roll back the instructions of the block that were already added.
+          token_sequence_.resize(previous_num_tokens);
+          num_tokens_per_instruction_.resize(previous_num_instructions);
+          instruction_token_offsets_.resize(previous_num_instructions + 1);
+          last_unknown_token_ = token;
+          return false;
+        }
+        token_index = replacement_token_;
+      }
+      token_sequence_.push_back(token_index);
+    }
+    const int num_tokens = static_cast<int>(instruction_tokens_.size());
+    num_tokens_per_instruction_.push_back(num_tokens);
+    instruction_token_offsets_.push_back(
+        static_cast<int>(token_sequence_.size()));
+    max_tokens_per_instruction =
+        std::max(max_tokens_per_instruction, num_tokens);
+  }
+  num_instructions_per_block_.push_back(static_cast<int>(instructions.size()));
+  max_tokens_per_instruction_ = max_tokens_per_instruction;
+  return true;
+}
+
+void TokenSequenceBuilder::Reset() {
+  token_sequence_.clear();
+  num_tokens_per_instruction_.clear();
+  num_instructions_per_block_.clear();
+  instruction_token_offsets_.assign(1, 0);
+  max_tokens_per_instruction_ = 0;
+  last_unknown_token_.clear();
+}
+
+std::vector<TokenSequenceBuilder::TokenIndex>
+TokenSequenceBuilder::PaddedTokenSequence(TokenIndex padding_token) const {
+  std::vector<TokenIndex> padded(
+      static_cast<size_t>(num_instructions()) * max_tokens_per_instruction_,
+      padding_token);
+  for (int i = 0; i < num_instructions(); ++i) {
+    std::copy(token_sequence_.begin() + instruction_token_offsets_[i],
+              token_sequence_.begin() + instruction_token_offsets_[i + 1],
+              padded.begin() + static_cast<size_t>(i) *
+                                   max_tokens_per_instruction_);
+  }
+  return padded;
+}
+
+}  // namespace gematria
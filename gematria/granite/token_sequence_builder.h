@@ -0,0 +1,145 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Contains a batch tokenizer for the sequence-based models, e.g. the
+// hierarchical LSTM model. It converts basic blocks to sequences of token
+// indices in C++, in the format used by SequenceModelBase:
+//  - a flat sequence of the indices of the tokens of all instructions of all
+//    basic blocks in the batch, in the natural order,
+//  - the number of tokens in each instruction, and
+//  - the number of instructions in each basic block.
+// The tokens of each instruction are the same as those returned by
+// Instruction::AsTokenList(), and the vocabulary and the handling of
+// out-of-vocabulary tokens work the same way as in BasicBlockGraphBuilder.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_TOKEN_SEQUENCE_BUILDER_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_TOKEN_SEQUENCE_BUILDER_H_
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/model/oov_token_behavior.h"
+
+namespace gematria {
+
+class TokenSequenceBuilder {
+ public:
+  // The index of a token in the vocabulary.
+  using TokenIndex = int;
+
+  // Creates a new token sequence builder for the vocabulary `tokens`; the index
+  // of each token is its position in `tokens`. When the out-of-vocabulary
+  // behavior is kReplaceToken, the replacement token must appear in `tokens`.
+  // Aborts when `tokens` contains duplicate tokens or when the replacement
+  // token is not in `tokens`.
+  explicit TokenSequenceBuilder(
+      std::vector<std::string> tokens,
+      OutOfVocabularyTokenBehavior out_of_vocabulary_behavior =
+          OutOfVocabularyTokenBehavior::ReturnError());
+
+  TokenSequenceBuilder(const TokenSequenceBuilder&) = delete;
+  TokenSequenceBuilder& operator=(const TokenSequenceBuilder&) = delete;
+
+  // Adds the tokens of `block` to the batch. Returns true when the block was
+  // added; returns false when the block contains a token that is not in the
+  // vocabulary and the out-of-vocabulary behavior is kReturnError. When this
+  // happens, the batch is left in the previous state, and the unknown token is
+  // available through last_unknown_token().
+  bool AddBasicBlock(const BasicBlock& block) {
+    return AddBasicBlockFromInstructions(block.instructions);
+  }
+  // A version of AddBasicBlock() that takes the list of instructions in the
+  // basic block instead of the basic block object itself.
+  bool AddBasicBlockFromInstructions(
+      const std::vector<Instruction>& instructions);
+
+  // Removes all basic blocks from the batch.
+  void Reset();
+
+  // The number of basic blocks in the batch.
+  int num_blocks() const {
+    return static_cast<int>(num_instructions_per_block_.size());
+  }
+  // The number of instructions of all basic blocks in the batch.
+  int num_instructions() const {
+    return static_cast<int>(num_tokens_per_instruction_.size());
+  }
+  // The number of tokens in the vocabulary.
+  int vocabulary_size() const { return static_cast<int>(tokens_.size()); }
+
+  // The indices of the tokens of all instructions in the batch.
+  const std::vector<TokenIndex>& token_sequence() const {
+    return token_sequence_;
+  }
+  // The number of tokens of each instruction in the batch.
+  const std::vector<int>& num_tokens_per_instruction() const {
+    return num_tokens_per_instruction_;
+  }
+  // The number of instructions of each basic block in the batch.
+  const std::vector<int>& num_instructions_per_block() const {
+    return num_instructions_per_block_;
+  }
+  // The offsets of the first token of each instruction in token_sequence(),
+  // followed by the total number of tokens; i.e. the tokens of the i-th
+  // instruction are at [offsets[i], offsets[i + 1]). Contains
+  // num_instructions() + 1 elements.
+  const std::vector<int>& instruction_token_offsets() const {
+    return instruction_token_offsets_;
+  }
+  // The number of tokens of the longest instruction in the batch, or 0 when
+  // the batch is empty.
+  int max_tokens_per_instruction() const {
+    return max_tokens_per_instruction_;
+  }
+
+  // Returns the tokens of the batch as a dense matrix of shape
+  // (num_instructions(), max_tokens_per_instruction()) in row-major order,
+  // where each row contains the tokens of one instruction followed by
+  // `padding_token` up to the length of the row.
+  std::vector<TokenIndex> PaddedTokenSequence(TokenIndex padding_token) const;
+
+  // The unknown token that caused the last call to AddBasicBlock() to fail, or
+  // an empty string when no call failed since the last call to Reset().
+  const std::string& last_unknown_token() const { return last_unknown_token_; }
+
+  // The index of the out-of-vocabulary replacement token, or -1 when the
+  // out-of-vocabulary behavior is kReturnError.
+  TokenIndex replacement_token() const { return replacement_token_; }
+
+ private:
+  // The vocabulary. The keys of `token_index_` point to the strings in
+  // `tokens_`.
+  const std::vector<std::string> tokens_;
+  const std::unordered_map<std::string_view, TokenIndex> token_index_;
+  const TokenIndex replacement_token_;
+
+  std::vector<TokenIndex> token_sequence_;
+  std::vector<int> num_tokens_per_instruction_;
+  std::vector<int> num_instructions_per_block_;
+  std::vector<int> instruction_token_offsets_ = {0};
+  int max_tokens_per_instruction_ = 0;
+  std::string last_unknown_token_;
+
+  // A buffer for the tokens of the instruction that is being added; it is
+  // reused across instructions to avoid reallocating it.
+  std::vector<std::string> instruction_tokens_;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_TOKEN_SEQUENCE_BUILDER_H_
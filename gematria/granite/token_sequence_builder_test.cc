@@ -0,0 +1,229 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "gematria/granite/token_sequence_builder.h"
+
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/basic_block_protos.h"
+#include "gematria/model/oov_token_behavior.h"
+#include "gematria/proto/basic_block.pb.h"
+#include "gematria/testing/parse_proto.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::ElementsAreArray;
+using ::testing::IsEmpty;
+
+constexpr std::string_view kTokens[] = {
+    kDelimiterToken, kImmediateToken, kAddressToken, kMemoryToken,
+    kNoRegisterToken, "LEA", "LOCK", "MOV", "NOT", "RAX", "RBX", "RDI",
+    "_UNKNOWN_"};
+
+int TokenIndex(std::string_view token) {
+  const auto it = std::find(std::begin(kTokens), std::end(kTokens), token);
+  EXPECT_NE(it, std::end(kTokens)) << "Invalid token: " << token;
+  return static_cast<int>(it - std::begin(kTokens));
+}
+
+BasicBlock BasicBlockFromTextProto(const char* text_proto) {
+  return BasicBlockFromProto(ParseTextProto(text_proto));
+}
+
+// Returns the token indices of the tokens of `block`, as computed from
+// Instruction::AsTokenList().
+std::vector<int> ExpectedTokenSequence(const BasicBlock& block) {
+  std::vector<int> token_sequence;
+  for (const Instruction& instruction : block.instructions) {
+    for (const std::string& token : instruction.AsTokenList()) {
+      token_sequence.push_back(TokenIndex(token));
+    }
+  }
+  return token_sequence;
+}
+
+class TokenSequenceBuilderTest : public ::testing::Test {
+ protected:
+  void CreateBuilder(OutOfVocabularyTokenBehavior out_of_vocabulary_behavior) {
+    builder_ = std::make_unique<TokenSequenceBuilder>(
+        std::vector<std::string>(std::begin(kTokens), std::end(kTokens)),
+        out_of_vocabulary_behavior);
+  }
+
+  std::unique_ptr<TokenSequenceBuilder> builder_;
+};
+
+constexpr char kTwoInstructions[] = R"pb(
+  canonicalized_instructions {
+    mnemonic: "LEA"
+    output_operands { register_name: "RDI" }
+    input_operands {
+      address { base_register: "RBX" index_register: "RAX" scaling: 1 }
+    }
+  }
+  canonicalized_instructions {
+    mnemonic: "NOT"
+    prefixes: "LOCK"
+    output_operands { memory { alias_group_id: 1 } }
+    input_operands { memory { alias_group_id: 1 } }
+  }
+)pb";
+
+constexpr char kOneInstruction[] = R"pb(
+  canonicalized_instructions {
+    mnemonic: "MOV"
+    output_operands { register_name: "RAX" }
+    input_operands { immediate_value: 1 }
+  }
+)pb";
+
+TEST_F(TokenSequenceBuilderTest, EmptyBatch) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  EXPECT_EQ(builder_->num_blocks(), 0);
+  EXPECT_EQ(builder_->num_instructions(), 0);
+  EXPECT_EQ(builder_->vocabulary_size(), std::size(kTokens));
+  EXPECT_THAT(builder_->token_sequence(), IsEmpty());
+  EXPECT_THAT(builder_->instruction_token_offsets(), ElementsAre(0));
+  EXPECT_EQ(builder_->max_tokens_per_instruction(), 0);
+  EXPECT_THAT(builder_->PaddedTokenSequence(-1), IsEmpty());
+  EXPECT_EQ(builder_->replacement_token(), -1);
+}
+
+TEST_F(TokenSequenceBuilderTest, MultipleBlocks) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  const BasicBlock first = BasicBlockFromTextProto(kTwoInstructions);
+  const BasicBlock second = BasicBlockFromTextProto(kOneInstruction);
+  ASSERT_TRUE(builder_->AddBasicBlock(first));
+  ASSERT_TRUE(builder_->AddBasicBlock(second));
+
+  std::vector<int> expected_tokens = ExpectedTokenSequence(first);
+  const std::vector<int> second_tokens = ExpectedTokenSequence(second);
+  expected_tokens.insert(expected_tokens.end(), second_tokens.begin(),
+                         second_tokens.end());
+
+  EXPECT_EQ(builder_->num_blocks(), 2);
+  EXPECT_EQ(builder_->num_instructions(), 3);
+  EXPECT_THAT(builder_->token_sequence(), ElementsAreArray(expected_tokens));
+  EXPECT_THAT(builder_->num_instructions_per_block(), ElementsAre(2, 1));
+
+  std::vector<int> expected_num_tokens;
+  for (const BasicBlock* block : {&first, &second}) {
+    for (const Instruction& instruction : block->instructions) {
+      expected_num_tokens.push_back(instruction.AsTokenList().size());
+    }
+  }
+  EXPECT_THAT(builder_->num_tokens_per_instruction(),
+              ElementsAreArray(expected_num_tokens));
+  EXPECT_THAT(
+      builder_->instruction_token_offsets(),
+      ElementsAre(0, expected_num_tokens[0],
+                  expected_num_tokens[0] + expected_num_tokens[1],
+                  expected_tokens.size()));
+  EXPECT_EQ(builder_->max_tokens_per_instruction(),
+            *std::max_element(expected_num_tokens.begin(),
+                              expected_num_tokens.end()));
+}
+
+TEST_F(TokenSequenceBuilderTest, PaddedTokenSequence) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  const BasicBlock block = BasicBlockFromTextProto(kTwoInstructions);
+  ASSERT_TRUE(builder_->AddBasicBlock(block));
+
+  constexpr int kPadding = -1;
+  const int row_size = builder_->max_tokens_per_instruction();
+  std::vector<int> expected;
+  for (const Instruction& instruction : block.instructions) {
+    const std::vector<std::string> tokens = instruction.AsTokenList();
+    for (const std::string& token : tokens) {
+      expected.push_back(TokenIndex(token));
+    }
+    expected.resize(expected.size() + row_size - tokens.size(), kPadding);
+  }
+  EXPECT_THAT(builder_->PaddedTokenSequence(kPadding),
+              ElementsAreArray(expected));
+}
+
+TEST_F(TokenSequenceBuilderTest, UnknownTokenReturnsError) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  ASSERT_TRUE(
+      builder_->AddBasicBlock(BasicBlockFromTextProto(kOneInstruction)));
+  const std::vector<int> tokens_before = builder_->token_sequence();
+
+  // The first instruction is valid, the second uses an unknown register.
+  EXPECT_FALSE(builder_->AddBasicBlock(BasicBlockFromTextProto(R"pb(
+    canonicalized_instructions {
+      mnemonic: "MOV"
+      output_operands { register_name: "RAX" }
+      input_operands { register_name: "RDI" }
+    }
+    canonicalized_instructions {
+      mnemonic: "MOV"
+      output_operands { register_name: "RAX" }
+      input_operands { register_name: "R15" }
+    }
+  )pb")));
+  EXPECT_EQ(builder_->last_unknown_token(), "R15");
+
+  // The builder is left in the previous state.
+  EXPECT_EQ(builder_->num_blocks(), 1);
+  EXPECT_EQ(builder_->num_instructions(), 1);
+  EXPECT_EQ(builder_->token_sequence(), tokens_before);
+  EXPECT_THAT(builder_->instruction_token_offsets(),
+              ElementsAre(0, tokens_before.size()));
+  EXPECT_EQ(builder_->max_tokens_per_instruction(), tokens_before.size());
+}
+
+TEST_F(TokenSequenceBuilderTest, UnknownTokenIsReplaced) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReplaceWithToken("_UNKNOWN_"));
+  EXPECT_EQ(builder_->replacement_token(), TokenIndex("_UNKNOWN_"));
+  ASSERT_TRUE(builder_->AddBasicBlock(BasicBlockFromTextProto(R"pb(
+    canonicalized_instructions {
+      mnemonic: "MOV"
+      output_operands { register_name: "RAX" }
+      input_operands { register_name: "R15" }
+    }
+  )pb")));
+  EXPECT_THAT(builder_->token_sequence(),
+              ElementsAre(TokenIndex("MOV"), TokenIndex(kDelimiterToken),
+                          TokenIndex("RAX"), TokenIndex(kDelimiterToken),
+                          TokenIndex("_UNKNOWN_"),
+                          TokenIndex(kDelimiterToken)));
+  EXPECT_THAT(builder_->last_unknown_token(), IsEmpty());
+}
+
+TEST_F(TokenSequenceBuilderTest, Reset) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  ASSERT_TRUE(
+      builder_->AddBasicBlock(BasicBlockFromTextProto(kTwoInstructions)));
+  builder_->Reset();
+  EXPECT_EQ(builder_->num_blocks(), 0);
+  EXPECT_EQ(builder_->num_instructions(), 0);
+  EXPECT_THAT(builder_->token_sequence(), IsEmpty());
+  EXPECT_THAT(builder_->instruction_token_offsets(), ElementsAre(0));
+  EXPECT_EQ(builder_->max_tokens_per_instruction(), 0);
+}
+
+}  // namespace
+}  // namespace gematria
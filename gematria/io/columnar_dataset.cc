@@ -0,0 +1,628 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/io/columnar_dataset.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <ios>
+#include <limits>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/types/span.h"
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/proto/basic_block.pb.h"
+#include "gematria/proto/canonicalized_instruction.pb.h"
+#include "gematria/proto/throughput.pb.h"
+
+namespace gematria {
+namespace {
+
+// Returns true when [first, first + num) is a valid range in an array of
+// `size` elements.
+bool IsValidRange(uint64_t first, uint64_t num, uint64_t size) {
+  return first <= size && num <= size - first;
+}
+
+bool IsValidOperandType(uint32_t type) {
+  return type <= static_cast<uint32_t>(OperandType::kVirtualRegister);
+}
+
+// Returns the size of the records stored in `section`, in bytes.
+size_t RecordSize(ColumnarSection section) {
+  switch (section) {
+    case ColumnarSection::kTokenOffsets:
+      return sizeof(uint64_t);
+    case ColumnarSection::kTokenChars:
+      return sizeof(char);
+    case ColumnarSection::kBlocks:
+      return sizeof(ColumnarBlock);
+    case ColumnarSection::kInstructions:
+      return sizeof(ColumnarInstruction);
+    case ColumnarSection::kPrefixes:
+    case ColumnarSection::kInterferedRegisters:
+      return sizeof(uint32_t);
+    case ColumnarSection::kOperands:
+      return sizeof(ColumnarOperand);
+    case ColumnarSection::kInterferedRegisterSizes:
+      return sizeof(int32_t);
+    case ColumnarSection::kThroughputs:
+      return sizeof(ColumnarThroughput);
+    case ColumnarSection::kPrefixThroughputs:
+      return sizeof(ColumnarValueRange);
+    case ColumnarSection::kThroughputValues:
+      return sizeof(double);
+  }
+  return 0;
+}
+
+uint64_t AlignUp(uint64_t offset) {
+  return (offset + kColumnarDatasetAlignment - 1) /
+         kColumnarDatasetAlignment * kColumnarDatasetAlignment;
+}
+
+template <typename T>
+void AppendRange(const google::protobuf::RepeatedField<T>& values,
+                 std::vector<T>& out) {
+  out.insert(out.end(), values.begin(), values.end());
+}
+
+}  // namespace
+
+uint32_t ColumnarDatasetWriter::InternToken(std::string_view token) {
+  const auto [it, inserted] = token_indices_.emplace(
+      std::string(token), static_cast<uint32_t>(token_indices_.size()));
+  if (inserted) {
+    token_chars_.append(token);
+    token_offsets_.push_back(token_chars_.size());
+  }
+  return it->second;
+}
+
+ColumnarRegister ColumnarDatasetWriter::MakeRegister(
+    std::string_view name, int32_t size,
+    const google::protobuf::RepeatedPtrField<std::string>& interfered_registers,
+    const google::protobuf::RepeatedField<int32_t>&
+        interfered_register_sizes) {
+  ColumnarRegister reg = {};
+  reg.name = name.empty() ? kColumnarNoToken : InternToken(name);
+  reg.size = size;
+  reg.first_interfered_register = interfered_registers_.size();
+  reg.num_interfered_registers = interfered_registers.size();
+  for (int i = 0; i < interfered_registers.size(); ++i) {
+    interfered_registers_.push_back(InternToken(interfered_registers[i]));
+    // The protos do not enforce that the lists have the same size; missing
+    // sizes are stored as zero.
+    interfered_register_sizes_.push_back(
+        i < interfered_register_sizes.size() ? interfered_register_sizes[i]
+                                             : 0);
+  }
+  return reg;
+}
+
+void ColumnarDatasetWriter::AddOperand(const CanonicalizedOperandProto& proto) {
+  ColumnarOperand operand = {};
+  for (ColumnarRegister& reg : operand.registers) {
+    reg.name = kColumnarNoToken;
+  }
+  // The top-level interference lists are stored with the register of the
+  // operand; for operands that are not registers, the register has no name.
+  std::string_view register_name;
+  int32_t register_size = 0;
+  switch (proto.operand_case()) {
+    case CanonicalizedOperandProto::OPERAND_NOT_SET:
+      operand.type = static_cast<uint32_t>(OperandType::kUnknown);
+      break;
+    case CanonicalizedOperandProto::kRegisterName:
+      operand.type = static_cast<uint32_t>(OperandType::kRegister);
+      register_name = proto.register_name();
+      break;
+    case CanonicalizedOperandProto::kImmediateValue:
+      operand.type = static_cast<uint32_t>(OperandType::kImmediateValue);
+      operand.value = proto.immediate_value();
+      break;
+    case CanonicalizedOperandProto::kFpImmediateValue: {
+      operand.type = static_cast<uint32_t>(OperandType::kFpImmediateValue);
+      const double value = proto.fp_immediate_value();
+      static_assert(sizeof(value) == sizeof(operand.value));
+      std::memcpy(&operand.value, &value, sizeof(value));
+    } break;
+    case CanonicalizedOperandProto::kAddress: {
+      const CanonicalizedOperandProto::AddressTuple& address = proto.address();
+      operand.type = static_cast<uint32_t>(OperandType::kAddress);
+      operand.int_value = address.scaling();
+      operand.value = static_cast<uint64_t>(address.displacement());
+      operand.registers[ColumnarOperand::kBase] = MakeRegister(
+          address.base_register(), address.base_register_size(),
+          address.base_register_intefered_register(),
+          address.base_register_intefered_register_sizes());
+      operand.registers[ColumnarOperand::kIndex] = MakeRegister(
+          address.index_register(), address.index_register_size(),
+          address.index_register_intefered_register(),
+          address.index_register_intefered_register_sizes());
+      operand.registers[ColumnarOperand::kSegment] =
+          MakeRegister(address.segment(), address.segment_size(),
+                       address.segment_intefered_register(),
+                       address.segment_intefered_register_sizes());
+    } break;
+    case CanonicalizedOperandProto::kMemory:
+      operand.type = static_cast<uint32_t>(OperandType::kMemory);
+      operand.int_value = proto.memory().alias_group_id();
+      break;
+    case CanonicalizedOperandProto::kVirtualRegister:
+      operand.type = static_cast<uint32_t>(OperandType::kVirtualRegister);
+      register_name = proto.virtual_register().name();
+      register_size = proto.virtual_register().size();
+      break;
+  }
+  if (proto.operand_case() != CanonicalizedOperandProto::kAddress) {
+    operand.registers[ColumnarOperand::kRegister] =
+        MakeRegister(register_name, register_size, proto.intefered_register(),
+                     proto.intefered_register_sizes());
+  }
+  operands_.push_back(operand);
+}
+
+absl::Status ColumnarDatasetWriter::Add(
+    const BasicBlockWithThroughputProto& proto) {
+  const auto& instruction_protos =
+      proto.basic_block().canonicalized_instructions();
+  constexpr int kMaxOperands = std::numeric_limits<uint16_t>::max();
+  for (const CanonicalizedInstructionProto& instruction : instruction_protos) {
+    if (instruction.input_operands_size() > kMaxOperands ||
+        instruction.implicit_input_operands_size() > kMaxOperands ||
+        instruction.output_operands_size() > kMaxOperands ||
+        instruction.implicit_output_operands_size() > kMaxOperands) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Too many operands of instruction ",
+                       instruction.mnemonic(), " in block ", blocks_.size()));
+    }
+  }
+  ColumnarBlock block = {};
+  block.first_instruction = instructions_.size();
+  block.num_instructions = instruction_protos.size();
+  block.first_throughput = throughputs_.size();
+  block.num_throughputs = proto.inverse_throughputs_size();
+  block.num_duplicates = proto.num_duplicates();
+
+  for (const CanonicalizedInstructionProto& instruction_proto :
+       instruction_protos) {
+    ColumnarInstruction instruction = {};
+    instruction.mnemonic = InternToken(instruction_proto.mnemonic());
+    instruction.llvm_mnemonic = InternToken(instruction_proto.llvm_mnemonic());
+    instruction.first_prefix = prefixes_.size();
+    instruction.num_prefixes = instruction_proto.prefixes_size();
+    for (const std::string& prefix : instruction_proto.prefixes()) {
+      prefixes_.push_back(InternToken(prefix));
+    }
+    instruction.first_operand = operands_.size();
+    instruction.num_input_operands = instruction_proto.input_operands_size();
+    instruction.num_implicit_input_operands =
+        instruction_proto.implicit_input_operands_size();
+    instruction.num_output_operands = instruction_proto.output_operands_size();
+    instruction.num_implicit_output_operands =
+        instruction_proto.implicit_output_operands_size();
+    for (const auto* operands :
+         {&instruction_proto.input_operands(),
+          &instruction_proto.implicit_input_operands(),
+          &instruction_proto.output_operands(),
+          &instruction_proto.implicit_output_operands()}) {
+      for (const CanonicalizedOperandProto& operand : *operands) {
+        AddOperand(operand);
+      }
+    }
+    instructions_.push_back(instruction);
+  }
+
+  for (const ThroughputWithSourceProto& throughput_proto :
+       proto.inverse_throughputs()) {
+    ColumnarThroughput throughput = {};
+    throughput.source = InternToken(throughput_proto.source());
+    throughput.first_value = throughput_values_.size();
+    throughput.num_values = throughput_proto.inverse_throughput_cycles_size();
+    AppendRange(throughput_proto.inverse_throughput_cycles(),
+                throughput_values_);
+    throughput.first_prefix_throughput = prefix_throughputs_.size();
+    throughput.num_prefix_throughputs =
+        throughput_proto.prefix_inverse_throughputs_size();
+    for (const auto& prefix : throughput_proto.prefix_inverse_throughputs()) {
+      prefix_throughputs_.push_back(
+          {throughput_values_.size(),
+           static_cast<uint64_t>(prefix.inverse_throughput_cycles_size())});
+      AppendRange(prefix.inverse_throughput_cycles(), throughput_values_);
+    }
+    throughputs_.push_back(throughput);
+  }
+  blocks_.push_back(block);
+  return absl::OkStatus();
+}
+
+absl::Status ColumnarDatasetWriter::Write(std::string_view file_name) const {
+  struct SectionData {
+    const void* data;
+    uint64_t num_records;
+  };
+  const SectionData sections[kNumColumnarSections] = {
+      {token_offsets_.data(), token_offsets_.size()},
+      {token_chars_.data(), token_chars_.size()},
+      {blocks_.data(), blocks_.size()},
+      {instructions_.data(), instructions_.size()},
+      {prefixes_.data(), prefixes_.size()},
+      {operands_.data(), operands_.size()},
+      {interfered_registers_.data(), interfered_registers_.size()},
+      {interfered_register_sizes_.data(), interfered_register_sizes_.size()},
+      {throughputs_.data(), throughputs_.size()},
+      {prefix_throughputs_.data(), prefix_throughputs_.size()},
+      {throughput_values_.data(), throughput_values_.size()},
+  };
+
+  // kColumnarNoToken must not be a valid token index.
+  if (token_indices_.size() >= kColumnarNoToken) {
+    return absl::ResourceExhaustedError("Too many distinct tokens");
+  }
+
+  ColumnarDatasetHeader header = {};
+  std::memcpy(header.magic, kColumnarDatasetMagic, sizeof(header.magic));
+  header.version = kColumnarDatasetVersion;
+  header.byte_order_mark = kColumnarDatasetByteOrderMark;
+  uint64_t offset = AlignUp(sizeof(header));
+  for (int i = 0; i < kNumColumnarSections; ++i) {
+    header.sections[i].offset = offset;
+    header.sections[i].num_records = sections[i].num_records;
+    offset = AlignUp(offset + sections[i].num_records *
+                                  RecordSize(static_cast<ColumnarSection>(i)));
+  }
+
+  const std::string file_name_str(file_name);
+  std::ofstream out(file_name_str, std::ios::binary | std::ios::trunc);
+  if (!out.is_open()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Could not open file ", file_name, " for writing"));
+  }
+  static constexpr char kPadding[kColumnarDatasetAlignment] = {};
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  uint64_t position = sizeof(header);
+  for (int i = 0; i < kNumColumnarSections; ++i) {
+    out.write(kPadding, header.sections[i].offset - position);
+    const uint64_t size = sections[i].num_records *
+                          RecordSize(static_cast<ColumnarSection>(i));
+    out.write(static_cast<const char*>(sections[i].data), size);
+    position = header.sections[i].offset + size;
+  }
+  out.write(kPadding, offset - position);
+  out.close();
+  if (!out) {
+    return absl::InternalError(absl::StrCat("Could not write ", file_name));
+  }
+  return absl::OkStatus();
+}
+
+absl::StatusOr<std::unique_ptr<ColumnarDataset>> ColumnarDataset::Open(
+    std::string_view file_name) {
+  const std::string file_name_str(file_name);
+  const int fd = open(file_name_str.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Could not open file ", file_name, ": ", std::strerror(errno)));
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0) {
+    const int error = errno;
+    close(fd);
+    return absl::InternalError(absl::StrCat(
+        "Could not get the size of ", file_name, ": ", std::strerror(error)));
+  }
+  const size_t size = file_stat.st_size;
+  if (size < sizeof(ColumnarDatasetHeader)) {
+    close(fd);
+    return absl::InvalidArgumentError(
+        absl::StrCat(file_name, " is not a columnar data set"));
+  }
+  void* const data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  const int error = errno;
+  // The mapping keeps a reference to the file.
+  close(fd);
+  if (data == MAP_FAILED) {
+    return absl::InternalError(absl::StrCat("Could not map ", file_name, ": ",
+                                            std::strerror(error)));
+  }
+  std::unique_ptr<ColumnarDataset> dataset(new ColumnarDataset(data, size));
+  if (absl::Status status = dataset->Initialize(); !status.ok()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat(file_name, ": ", status.message()));
+  }
+  return dataset;
+}
+
+ColumnarDataset::~ColumnarDataset() { munmap(data_, size_); }
+
+absl::Status ColumnarDataset::Initialize() {
+  const char* const bytes = static_cast<const char*>(data_);
+  const auto* const header =
+      reinterpret_cast<const ColumnarDatasetHeader*>(bytes);
+  if (std::memcmp(header->magic, kColumnarDatasetMagic,
+                  sizeof(header->magic)) != 0) {
+    return absl::InvalidArgumentError("Not a columnar data set");
+  }
+  if (header->byte_order_mark != kColumnarDatasetByteOrderMark) {
+    return absl::InvalidArgumentError(
+        "The data set was written with a different byte order");
+  }
+  if (header->version != kColumnarDatasetVersion) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Unsupported version ", header->version));
+  }
+
+  // Checks the location of a section and returns a span pointing to it.
+  const auto get_section = [&](ColumnarSection section, auto& span) {
+    using Record = typename std::remove_reference_t<decltype(span)>::value_type;
+    const ColumnarSectionInfo& info =
+        header->sections[static_cast<int>(section)];
+    if (info.offset % kColumnarDatasetAlignment != 0 ||
+        !IsValidRange(info.offset, 0, size_) ||
+        info.num_records > (size_ - info.offset) / sizeof(Record)) {
+      return false;
+    }
+    span = absl::MakeConstSpan(
+        reinterpret_cast<const Record*>(bytes + info.offset),
+        info.num_records);
+    return true;
+  };
+  absl::Span<const uint64_t> token_offsets;
+  absl::Span<const char> token_chars;
+  if (!get_section(ColumnarSection::kTokenOffsets, token_offsets) ||
+      !get_section(ColumnarSection::kTokenChars, token_chars) ||
+      !get_section(ColumnarSection::kBlocks, blocks_) ||
+      !get_section(ColumnarSection::kInstructions, instructions_) ||
+      !get_section(ColumnarSection::kPrefixes, prefixes_) ||
+      !get_section(ColumnarSection::kOperands, operands_) ||
+      !get_section(ColumnarSection::kInterferedRegisters,
+                   interfered_registers_) ||
+      !get_section(ColumnarSection::kInterferedRegisterSizes,
+                   interfered_register_sizes_) ||
+      !get_section(ColumnarSection::kThroughputs, throughputs_) ||
+      !get_section(ColumnarSection::kPrefixThroughputs, prefix_throughputs_) ||
+      !get_section(ColumnarSection::kThroughputValues, throughput_values_)) {
+    return absl::InvalidArgumentError("Invalid section location");
+  }
+
+  if (token_offsets.empty() || token_offsets[0] != 0 ||
+      token_offsets.size() - 1 >= kColumnarNoToken) {
+    return absl::InvalidArgumentError("Invalid token table");
+  }
+  tokens_.reserve(token_offsets.size() - 1);
+  for (size_t i = 1; i < token_offsets.size(); ++i) {
+    if (token_offsets[i] < token_offsets[i - 1] ||
+        token_offsets[i] > token_chars.size()) {
+      return absl::InvalidArgumentError("Invalid token table");
+    }
+    tokens_.emplace_back(token_chars.data() + token_offsets[i - 1],
+                         token_offsets[i] - token_offsets[i - 1]);
+  }
+  const uint64_t num_tokens = tokens_.size();
+  const auto is_valid_token = [num_tokens](uint32_t token) {
+    return token < num_tokens;
+  };
+
+  for (const ColumnarBlock& block : blocks_) {
+    if (!IsValidRange(block.first_instruction, block.num_instructions,
+                      instructions_.size()) ||
+        !IsValidRange(block.first_throughput, block.num_throughputs,
+                      throughputs_.size())) {
+      return absl::InvalidArgumentError("Invalid block");
+    }
+  }
+  for (const ColumnarInstruction& instruction : instructions_) {
+    const uint64_t num_operands = uint64_t{instruction.num_input_operands} +
+                                  instruction.num_implicit_input_operands +
+                                  instruction.num_output_operands +
+                                  instruction.num_implicit_output_operands;
+    if (!is_valid_token(instruction.mnemonic) ||
+        !is_valid_token(instruction.llvm_mnemonic) ||
+        !IsValidRange(instruction.first_prefix, instruction.num_prefixes,
+                      prefixes_.size()) ||
+        !IsValidRange(instruction.first_operand, num_operands,
+                      operands_.size())) {
+      return absl::InvalidArgumentError("Invalid instruction");
+    }
+  }
+  for (const uint32_t prefix : prefixes_) {
+    if (!is_valid_token(prefix)) {
+      return absl::InvalidArgumentError("Invalid prefix");
+    }
+  }
+  for (const ColumnarOperand& operand : operands_) {
+    if (!IsValidOperandType(operand.type)) {
+      return absl::InvalidArgumentError("Invalid operand type");
+    }
+    for (const ColumnarRegister& reg : operand.registers) {
+      if ((reg.name != kColumnarNoToken && !is_valid_token(reg.name)) ||
+          !IsValidRange(reg.first_interfered_register,
+                        reg.num_interfered_registers,
+                        interfered_registers_.size())) {
+        return absl::InvalidArgumentError("Invalid operand register");
+      }
+    }
+  }
+  if (interfered_register_sizes_.size() != interfered_registers_.size()) {
+    return absl::InvalidArgumentError("Invalid interference lists");
+  }
+  for (const uint32_t interfered_register : interfered_registers_) {
+    if (!is_valid_token(interfered_register)) {
+      return absl::InvalidArgumentError("Invalid interfered register");
+    }
+  }
+  for (const ColumnarThroughput& throughput : throughputs_) {
+    if (!is_valid_token(throughput.source) ||
+        !IsValidRange(throughput.first_value, throughput.num_values,
+                      throughput_values_.size()) ||
+        !IsValidRange(throughput.first_prefix_throughput,
+                      throughput.num_prefix_throughputs,
+                      prefix_throughputs_.size())) {
+      return absl::InvalidArgumentError("Invalid throughput");
+    }
+  }
+  for (const ColumnarValueRange& range : prefix_throughputs_) {
+    if (!IsValidRange(range.first_value, range.num_values,
+                      throughput_values_.size())) {
+      return absl::InvalidArgumentError("Invalid prefix throughput");
+    }
+  }
+  return absl::OkStatus();
+}
+
+BasicBlockWithThroughputProto ColumnarDataset::GetBasicBlockWithThroughputProto(
+    int64_t index) const {
+  const ColumnarBlock& columnar_block = block(index);
+  BasicBlockWithThroughputProto proto;
+  proto.set_num_duplicates(columnar_block.num_duplicates);
+
+  const auto set_operand = [this](const ColumnarOperand& operand,
+                                  CanonicalizedOperandProto& operand_proto) {
+    const ColumnarRegister& reg = operand.registers[ColumnarOperand::kRegister];
+    if (operand.type != static_cast<uint32_t>(OperandType::kAddress)) {
+      for (const uint32_t name : interfered_registers(reg)) {
+        operand_proto.add_intefered_register(std::string(token(name)));
+      }
+      for (const int32_t size : interfered_register_sizes(reg)) {
+        operand_proto.add_intefered_register_sizes(size);
+      }
+    }
+    switch (static_cast<OperandType>(operand.type)) {
+      case OperandType::kUnknown:
+        break;
+      case OperandType::kRegister:
+        operand_proto.set_register_name(std::string(token(reg.name)));
+        break;
+      case OperandType::kImmediateValue:
+        operand_proto.set_immediate_value(operand.value);
+        break;
+      case OperandType::kFpImmediateValue: {
+        double value;
+        std::memcpy(&value, &operand.value, sizeof(value));
+        operand_proto.set_fp_immediate_value(value);
+      } break;
+      case OperandType::kAddress: {
+        CanonicalizedOperandProto::AddressTuple& address =
+            *operand_proto.mutable_address();
+        address.set_scaling(operand.int_value);
+        address.set_displacement(static_cast<int64_t>(operand.value));
+        const ColumnarRegister& base =
+            operand.registers[ColumnarOperand::kBase];
+        address.set_base_register(std::string(token(base.name)));
+        address.set_base_register_size(base.size);
+        for (const uint32_t name : interfered_registers(base)) {
+          address.add_base_register_intefered_register(
+              std::string(token(name)));
+        }
+        for (const int32_t size : interfered_register_sizes(base)) {
+          address.add_base_register_intefered_register_sizes(size);
+        }
+        const ColumnarRegister& index =
+            operand.registers[ColumnarOperand::kIndex];
+        address.set_index_register(std::string(token(index.name)));
+        address.set_index_register_size(index.size);
+        for (const uint32_t name : interfered_registers(index)) {
+          address.add_index_register_intefered_register(
+              std::string(token(name)));
+        }
+        for (const int32_t size : interfered_register_sizes(index)) {
+          address.add_index_register_intefered_register_sizes(size);
+        }
+        const ColumnarRegister& segment =
+            operand.registers[ColumnarOperand::kSegment];
+        address.set_segment(std::string(token(segment.name)));
+        address.set_segment_size(segment.size);
+        for (const uint32_t name : interfered_registers(segment)) {
+          address.add_segment_intefered_register(std::string(token(name)));
+        }
+        for (const int32_t size : interfered_register_sizes(segment)) {
+          address.add_segment_intefered_register_sizes(size);
+        }
+      } break;
+      case OperandType::kMemory:
+        operand_proto.mutable_memory()->set_alias_group_id(operand.int_value);
+        break;
+      case OperandType::kVirtualRegister: {
+        CanonicalizedOperandProto::VirtualRegister& virtual_register =
+            *operand_proto.mutable_virtual_register();
+        virtual_register.set_name(std::string(token(reg.name)));
+        virtual_register.set_size(reg.size);
+      } break;
+    }
+  };
+  const auto add_operands =
+      [&set_operand](
+          absl::Span<const ColumnarOperand> operands,
+          google::protobuf::RepeatedPtrField<CanonicalizedOperandProto>&
+              operand_protos) {
+        for (const ColumnarOperand& operand : operands) {
+          set_operand(operand, *operand_protos.Add());
+        }
+      };
+
+  BasicBlockProto& block_proto = *proto.mutable_basic_block();
+  for (const ColumnarInstruction& instruction :
+       instructions(columnar_block)) {
+    CanonicalizedInstructionProto& instruction_proto =
+        *block_proto.add_canonicalized_instructions();
+    instruction_proto.set_mnemonic(std::string(token(instruction.mnemonic)));
+    instruction_proto.set_llvm_mnemonic(
+        std::string(token(instruction.llvm_mnemonic)));
+    for (const uint32_t prefix : prefixes(instruction)) {
+      instruction_proto.add_prefixes(std::string(token(prefix)));
+    }
+    add_operands(input_operands(instruction),
+                 *instruction_proto.mutable_input_operands());
+    add_operands(implicit_input_operands(instruction),
+                 *instruction_proto.mutable_implicit_input_operands());
+    add_operands(output_operands(instruction),
+                 *instruction_proto.mutable_output_operands());
+    add_operands(implicit_output_operands(instruction),
+                 *instruction_proto.mutable_implicit_output_operands());
+  }
+
+  for (const ColumnarThroughput& throughput : throughputs(columnar_block)) {
+    ThroughputWithSourceProto& throughput_proto =
+        *proto.add_inverse_throughputs();
+    throughput_proto.set_source(std::string(token(throughput.source)));
+    for (const double value : inverse_throughputs(throughput)) {
+      throughput_proto.add_inverse_throughput_cycles(value);
+    }
+    for (const ColumnarValueRange& range : prefix_throughputs(throughput)) {
+      auto& prefix_proto = *throughput_proto.add_prefix_inverse_throughputs();
+      for (const double value : values(range)) {
+        prefix_proto.add_inverse_throughput_cycles(value);
+      }
+    }
+  }
+  return proto;
+}
+
+}  // namespace gematria
@@ -0,0 +1,363 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains a compact columnar on-disk format for data sets of basic blocks with
+// throughput, and a reader that memory-maps the files. Unlike a .tfrecord file
+// of BasicBlockWithThroughputProto, the data in the file can be used directly
+// without parsing: the reader only validates the layout when the file is
+// opened, and all data are then read straight from the mapped memory. Repeated
+// passes over the data set (e.g. training epochs) cost no parsing or
+// allocation. The file can also be mapped from NumPy; see
+// gematria/io/python/columnar_dataset.py.
+//
+// The file stores the canonicalized instructions of the basic blocks and their
+// inverse throughputs, including the prefix throughputs, and the number of
+// duplicates of each block. The machine instructions and the hardware counters
+// of the blocks are not stored.
+//
+// All strings (mnemonics, prefixes, register names and throughput sources)
+// are interned in a table of tokens and referenced by their index. The file
+// starts with a ColumnarDatasetHeader followed by the sections described by
+// `ColumnarDatasetHeader::sections`; each section is a flat array of records of
+// one of the types below, and it starts at an offset aligned to
+// kColumnarDatasetAlignment. Ranges of records in other sections are stored as
+// the index of the first record and the number of records. All numbers use the
+// byte order of the machine that wrote the file; the reader rejects files with
+// a different byte order.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_IO_COLUMNAR_DATASET_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_IO_COLUMNAR_DATASET_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/types/span.h"
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/proto/basic_block.pb.h"
+#include "gematria/proto/canonicalized_instruction.pb.h"
+#include "gematria/proto/throughput.pb.h"
+
+namespace gematria {
+
+inline constexpr char kColumnarDatasetMagic[8] = {'G', 'M', 'C', 'O',
+                                                  'L', 'D', 'S', '\0'};
+inline constexpr uint32_t kColumnarDatasetVersion = 1;
+// Stored in the header to detect files written with a different byte order.
+inline constexpr uint32_t kColumnarDatasetByteOrderMark = 0x01020304;
+// The alignment of the sections in the file, in bytes.
+inline constexpr size_t kColumnarDatasetAlignment = 64;
+// The token index used for registers that are not used by an operand.
+inline constexpr uint32_t kColumnarNoToken = 0xffffffff;
+
+// The sections of the file, in the order in which they are stored.
+enum class ColumnarSection : uint32_t {
+  // uint64_t[num_tokens + 1]; the token with index `i` is stored in
+  // kTokenChars at [offsets[i], offsets[i + 1]).
+  kTokenOffsets,
+  // char[]; the characters of all tokens.
+  kTokenChars,
+  // ColumnarBlock[num_blocks].
+  kBlocks,
+  // ColumnarInstruction[].
+  kInstructions,
+  // uint32_t[]; the token indices of the prefixes of the instructions.
+  kPrefixes,
+  // ColumnarOperand[].
+  kOperands,
+  // uint32_t[]; the token indices of the registers in the interference lists.
+  kInterferedRegisters,
+  // int32_t[]; the sizes of the registers in kInterferedRegisters, in bits.
+  kInterferedRegisterSizes,
+  // ColumnarThroughput[].
+  kThroughputs,
+  // ColumnarValueRange[]; the ranges of kThroughputValues with the prefix
+  // inverse throughputs.
+  kPrefixThroughputs,
+  // double[]; the inverse throughputs in cycles.
+  kThroughputValues,
+};
+inline constexpr int kNumColumnarSections = 11;
+
+// The location of a section in the file.
+struct ColumnarSectionInfo {
+  // The offset of the section from the start of the file, in bytes.
+  uint64_t offset;
+  // The number of records in the section.
+  uint64_t num_records;
+};
+
+struct ColumnarDatasetHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order_mark;
+  ColumnarSectionInfo sections[kNumColumnarSections];
+};
+
+struct ColumnarBlock {
+  // The range of the instructions of the block in kInstructions.
+  uint64_t first_instruction;
+  uint32_t num_instructions;
+  // The number of throughput sources of the block.
+  uint32_t num_throughputs;
+  // The index of the first throughput of the block in kThroughputs.
+  uint64_t first_throughput;
+  int64_t num_duplicates;
+};
+
+struct ColumnarInstruction {
+  uint32_t mnemonic;
+  uint32_t llvm_mnemonic;
+  // The range of the prefixes of the instruction in kPrefixes.
+  uint64_t first_prefix;
+  uint32_t num_prefixes;
+  // The number of the input, implicit input, output and implicit output
+  // operands. The operands are stored consecutively in this order in
+  // kOperands, starting at `first_operand`.
+  uint16_t num_input_operands;
+  uint16_t num_implicit_input_operands;
+  uint16_t num_output_operands;
+  uint16_t num_implicit_output_operands;
+  uint64_t first_operand;
+};
+
+// A register used by an operand, with its interference list.
+struct ColumnarRegister {
+  // The range of the interference list in kInterferedRegisters and
+  // kInterferedRegisterSizes.
+  uint64_t first_interfered_register;
+  uint32_t num_interfered_registers;
+  // The token index of the register name, or kColumnarNoToken when the
+  // register is not used.
+  uint32_t name;
+  // The size of the register in bits. Used only by virtual registers.
+  int32_t size;
+  uint32_t reserved;
+};
+
+struct ColumnarOperand {
+  // The index of the register operand or of the address registers in
+  // `registers`.
+  enum RegisterIndex { kRegister = 0, kBase = 0, kIndex = 1, kSegment = 2 };
+
+  // The OperandType of the operand.
+  uint32_t type;
+  // The alias group ID of kMemory operands, and the scaling of kAddress
+  // operands.
+  int32_t int_value;
+  // The immediate value of kImmediateValue operands, the bits of the value of
+  // kFpImmediateValue operands, and the displacement of kAddress operands.
+  uint64_t value;
+  // The register of kRegister and kVirtualRegister operands, or the base,
+  // index and segment registers of kAddress operands. For all other operand
+  // types, `registers[kRegister]` has no name and it holds only the
+  // interference list of the operand.
+  ColumnarRegister registers[3];
+};
+
+struct ColumnarThroughput {
+  // The token index of the source of the throughput.
+  uint32_t source;
+  // The range of the inverse throughputs in kThroughputValues.
+  uint32_t num_values;
+  uint64_t first_value;
+  // The range of the prefix inverse throughputs in kPrefixThroughputs.
+  uint64_t first_prefix_throughput;
+  uint32_t num_prefix_throughputs;
+  uint32_t reserved;
+};
+
+struct ColumnarValueRange {
+  uint64_t first_value;
+  uint64_t num_values;
+};
+
+static_assert(sizeof(ColumnarDatasetHeader) == 16 + 16 * kNumColumnarSections);
+static_assert(sizeof(ColumnarBlock) == 32);
+static_assert(sizeof(ColumnarInstruction) == 40);
+static_assert(sizeof(ColumnarRegister) == 24);
+static_assert(sizeof(ColumnarOperand) == 88);
+static_assert(sizeof(ColumnarThroughput) == 32);
+static_assert(sizeof(ColumnarValueRange) == 16);
+
+// Collects basic blocks and writes them to a file in the columnar format. The
+// whole data set is kept in memory until it is written.
+class ColumnarDatasetWriter {
+ public:
+  ColumnarDatasetWriter() = default;
+
+  // Adds a basic block with its throughputs to the data set. Returns an error
+  // when the block can't be represented in the format, e.g. when an
+  // instruction has more than 65535 operands of one kind.
+  absl::Status Add(const BasicBlockWithThroughputProto& proto);
+
+  int64_t num_blocks() const { return blocks_.size(); }
+
+  // Writes the data set to `file_name`. Returns an error when the file can't
+  // be written.
+  absl::Status Write(std::string_view file_name) const;
+
+ private:
+  uint32_t InternToken(std::string_view token);
+  void AddOperand(const CanonicalizedOperandProto& proto);
+  ColumnarRegister MakeRegister(
+      std::string_view name, int32_t size,
+      const google::protobuf::RepeatedPtrField<std::string>&
+          interfered_registers,
+      const google::protobuf::RepeatedField<int32_t>&
+          interfered_register_sizes);
+
+  std::unordered_map<std::string, uint32_t> token_indices_;
+  std::vector<uint64_t> token_offsets_ = {0};
+  std::string token_chars_;
+  std::vector<ColumnarBlock> blocks_;
+  std::vector<ColumnarInstruction> instructions_;
+  std::vector<uint32_t> prefixes_;
+  std::vector<ColumnarOperand> operands_;
+  std::vector<uint32_t> interfered_registers_;
+  std::vector<int32_t> interfered_register_sizes_;
+  std::vector<ColumnarThroughput> throughputs_;
+  std::vector<ColumnarValueRange> prefix_throughputs_;
+  std::vector<double> throughput_values_;
+};
+
+// A read-only view of a data set in the columnar format, backed by a memory
+// mapping of the file. The object is immutable after it is opened, and it can
+// be used from multiple threads at the same time. All accessors expect valid
+// indices; the validity of all ranges and token indices in the file is checked
+// when it is opened.
+class ColumnarDataset {
+ public:
+  // Maps `file_name` to memory and validates its contents. Returns an error
+  // when the file can't be mapped or when it is not a valid data set.
+  static absl::StatusOr<std::unique_ptr<ColumnarDataset>> Open(
+      std::string_view file_name);
+
+  ColumnarDataset(const ColumnarDataset&) = delete;
+  ColumnarDataset& operator=(const ColumnarDataset&) = delete;
+  ~ColumnarDataset();
+
+  int64_t num_blocks() const { return blocks_.size(); }
+  const ColumnarBlock& block(int64_t index) const { return blocks_[index]; }
+
+  // Returns the tokens of the data set; `tokens()[i]` is the token with index
+  // `i`. The string views point to the mapped memory.
+  absl::Span<const std::string_view> tokens() const { return tokens_; }
+  // Returns the token with the given index, or an empty string for
+  // kColumnarNoToken.
+  std::string_view token(uint32_t index) const {
+    return index == kColumnarNoToken ? std::string_view() : tokens_[index];
+  }
+
+  absl::Span<const ColumnarInstruction> instructions(
+      const ColumnarBlock& block) const {
+    return instructions_.subspan(block.first_instruction,
+                                 block.num_instructions);
+  }
+  absl::Span<const uint32_t> prefixes(
+      const ColumnarInstruction& instruction) const {
+    return prefixes_.subspan(instruction.first_prefix,
+                             instruction.num_prefixes);
+  }
+  absl::Span<const ColumnarOperand> input_operands(
+      const ColumnarInstruction& instruction) const {
+    return operands_.subspan(instruction.first_operand,
+                             instruction.num_input_operands);
+  }
+  absl::Span<const ColumnarOperand> implicit_input_operands(
+      const ColumnarInstruction& instruction) const {
+    return operands_.subspan(
+        instruction.first_operand + instruction.num_input_operands,
+        instruction.num_implicit_input_operands);
+  }
+  absl::Span<const ColumnarOperand> output_operands(
+      const ColumnarInstruction& instruction) const {
+    return operands_.subspan(instruction.first_operand +
+                                 instruction.num_input_operands +
+                                 instruction.num_implicit_input_operands,
+                             instruction.num_output_operands);
+  }
+  absl::Span<const ColumnarOperand> implicit_output_operands(
+      const ColumnarInstruction& instruction) const {
+    return operands_.subspan(instruction.first_operand +
+                                 instruction.num_input_operands +
+                                 instruction.num_implicit_input_operands +
+                                 instruction.num_output_operands,
+                             instruction.num_implicit_output_operands);
+  }
+  absl::Span<const uint32_t> interfered_registers(
+      const ColumnarRegister& reg) const {
+    return interfered_registers_.subspan(reg.first_interfered_register,
+                                         reg.num_interfered_registers);
+  }
+  absl::Span<const int32_t> interfered_register_sizes(
+      const ColumnarRegister& reg) const {
+    return interfered_register_sizes_.subspan(reg.first_interfered_register,
+                                              reg.num_interfered_registers);
+  }
+
+  absl::Span<const ColumnarThroughput> throughputs(
+      const ColumnarBlock& block) const {
+    return throughputs_.subspan(block.first_throughput, block.num_throughputs);
+  }
+  absl::Span<const double> inverse_throughputs(
+      const ColumnarThroughput& throughput) const {
+    return throughput_values_.subspan(throughput.first_value,
+                                      throughput.num_values);
+  }
+  absl::Span<const ColumnarValueRange> prefix_throughputs(
+      const ColumnarThroughput& throughput) const {
+    return prefix_throughputs_.subspan(throughput.first_prefix_throughput,
+                                       throughput.num_prefix_throughputs);
+  }
+  absl::Span<const double> values(const ColumnarValueRange& range) const {
+    return throughput_values_.subspan(range.first_value, range.num_values);
+  }
+
+  // Reconstructs the proto of the basic block with the given index. The proto
+  // contains only the data stored in the file.
+  BasicBlockWithThroughputProto GetBasicBlockWithThroughputProto(
+      int64_t index) const;
+
+ private:
+  ColumnarDataset(void* data, size_t size) : data_(data), size_(size) {}
+
+  // Sets up the spans pointing to the sections of the file and checks that
+  // all ranges and token indices in the file are valid.
+  absl::Status Initialize();
+
+  void* data_;
+  size_t size_;
+
+  std::vector<std::string_view> tokens_;
+  absl::Span<const ColumnarBlock> blocks_;
+  absl::Span<const ColumnarInstruction> instructions_;
+  absl::Span<const uint32_t> prefixes_;
+  absl::Span<const ColumnarOperand> operands_;
+  absl::Span<const uint32_t> interfered_registers_;
+  absl::Span<const int32_t> interfered_register_sizes_;
+  absl::Span<const ColumnarThroughput> throughputs_;
+  absl::Span<const ColumnarValueRange> prefix_throughputs_;
+  absl::Span<const double> throughput_values_;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_IO_COLUMNAR_DATASET_H_
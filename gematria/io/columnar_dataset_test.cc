@@ -0,0 +1,220 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/io/columnar_dataset.h"
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "gematria/proto/throughput.pb.h"
+#include "gematria/testing/matchers.h"
+#include "gematria/testing/parse_proto.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+
+constexpr std::string_view kBlocks[] = {
+    R"pb(
+      basic_block {
+        canonicalized_instructions {
+          mnemonic: "LEA"
+          llvm_mnemonic: "LEA64r"
+          output_operands { register_name: "RDI" }
+          input_operands {
+            address {
+              base_register: "RBX"
+              base_register_intefered_register: "EBX"
+              base_register_intefered_register_sizes: 32
+              index_register: "RAX"
+              displacement: -8
+              scaling: 2
+            }
+          }
+        }
+        canonicalized_instructions {
+          mnemonic: "ADD"
+          llvm_mnemonic: "ADD64mi32"
+          prefixes: "LOCK"
+          input_operands { memory { alias_group_id: 1 } }
+          input_operands { immediate_value: 12345678901 }
+          output_operands { memory { alias_group_id: 1 } }
+          implicit_output_operands { register_name: "EFLAGS" }
+        }
+      }
+      inverse_throughputs {
+        source: "hsw"
+        inverse_throughput_cycles: 1.5
+        inverse_throughput_cycles: 2
+        prefix_inverse_throughputs { inverse_throughput_cycles: 1 }
+        prefix_inverse_throughputs {
+          inverse_throughput_cycles: 1.5
+          inverse_throughput_cycles: 1.75
+        }
+      }
+      inverse_throughputs { source: "skl" inverse_throughput_cycles: 1.25 }
+      num_duplicates: 3
+    )pb",
+    R"pb(
+      basic_block {
+        canonicalized_instructions {
+          mnemonic: "MOV"
+          llvm_mnemonic: "MOV32rr"
+          output_operands {
+            virtual_register { name: "%1" size: 32 }
+            intefered_register: "%2"
+            intefered_register: "EAX"
+            intefered_register_sizes: 32
+            intefered_register_sizes: 32
+          }
+          input_operands { register_name: "EBX" }
+          implicit_input_operands { fp_immediate_value: 0.5 }
+          implicit_input_operands {}
+        }
+      }
+    )pb",
+    R"pb(
+      basic_block {}
+      inverse_throughputs { source: "hsw" }
+    )pb"};
+
+class ColumnarDatasetTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    const ::testing::TestInfo* const test_info =
+        ::testing::UnitTest::GetInstance()->current_test_info();
+    file_name_ = ::testing::TempDir() + "/" + test_info->name() + ".gmcol";
+  }
+
+  void WriteBlocks() {
+    ColumnarDatasetWriter writer;
+    for (const std::string_view block : kBlocks) {
+      ASSERT_THAT(writer.Add(ParseTextProto(std::string(block))), IsOk());
+    }
+    EXPECT_EQ(writer.num_blocks(), std::size(kBlocks));
+    ASSERT_THAT(writer.Write(file_name_), IsOk());
+  }
+
+  std::string ReadFile() const {
+    std::ifstream in(file_name_, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in),
+                       std::istreambuf_iterator<char>());
+  }
+
+  void WriteFile(const std::string& contents) const {
+    std::ofstream out(file_name_, std::ios::binary | std::ios::trunc);
+    out.write(contents.data(), contents.size());
+  }
+
+  std::string file_name_;
+};
+
+TEST_F(ColumnarDatasetTest, RoundTrip) {
+  WriteBlocks();
+  absl::StatusOr<std::unique_ptr<ColumnarDataset>> dataset =
+      ColumnarDataset::Open(file_name_);
+  ASSERT_OK(dataset);
+  ASSERT_EQ((*dataset)->num_blocks(), std::size(kBlocks));
+  for (int i = 0; i < std::size(kBlocks); ++i) {
+    SCOPED_TRACE(i);
+    EXPECT_THAT((*dataset)->GetBasicBlockWithThroughputProto(i),
+                EqualsProto(kBlocks[i]));
+  }
+}
+
+TEST_F(ColumnarDatasetTest, Accessors) {
+  WriteBlocks();
+  absl::StatusOr<std::unique_ptr<ColumnarDataset>> dataset =
+      ColumnarDataset::Open(file_name_);
+  ASSERT_OK(dataset);
+  const ColumnarDataset& data = **dataset;
+
+  const ColumnarBlock& block = data.block(0);
+  EXPECT_EQ(block.num_duplicates, 3);
+  const absl::Span<const ColumnarInstruction> instructions =
+      data.instructions(block);
+  ASSERT_EQ(instructions.size(), 2);
+  EXPECT_EQ(data.token(instructions[1].mnemonic), "ADD");
+  ASSERT_EQ(data.prefixes(instructions[1]).size(), 1);
+  EXPECT_EQ(data.token(data.prefixes(instructions[1])[0]), "LOCK");
+  EXPECT_EQ(data.input_operands(instructions[1]).size(), 2);
+  EXPECT_EQ(data.output_operands(instructions[1]).size(), 1);
+  ASSERT_EQ(data.implicit_output_operands(instructions[1]).size(), 1);
+  const ColumnarOperand& flags = data.implicit_output_operands(
+      instructions[1])[0];
+  EXPECT_EQ(flags.type, static_cast<uint32_t>(OperandType::kRegister));
+  EXPECT_EQ(data.token(flags.registers[ColumnarOperand::kRegister].name),
+            "EFLAGS");
+
+  const absl::Span<const ColumnarThroughput> throughputs =
+      data.throughputs(block);
+  ASSERT_EQ(throughputs.size(), 2);
+  EXPECT_EQ(data.token(throughputs[0].source), "hsw");
+  EXPECT_THAT(data.inverse_throughputs(throughputs[0]), ElementsAre(1.5, 2));
+  ASSERT_EQ(data.prefix_throughputs(throughputs[0]).size(), 2);
+  EXPECT_THAT(data.values(data.prefix_throughputs(throughputs[0])[1]),
+              ElementsAre(1.5, 1.75));
+  EXPECT_THAT(data.instructions(data.block(2)), IsEmpty());
+
+  // Tokens are interned; "hsw" is stored only once.
+  EXPECT_EQ(data.token(data.throughputs(data.block(2))[0].source), "hsw");
+  EXPECT_EQ(data.throughputs(data.block(2))[0].source, throughputs[0].source);
+}
+
+TEST_F(ColumnarDatasetTest, EmptyDataset) {
+  ColumnarDatasetWriter writer;
+  ASSERT_THAT(writer.Write(file_name_), IsOk());
+  absl::StatusOr<std::unique_ptr<ColumnarDataset>> dataset =
+      ColumnarDataset::Open(file_name_);
+  ASSERT_OK(dataset);
+  EXPECT_EQ((*dataset)->num_blocks(), 0);
+  EXPECT_THAT((*dataset)->tokens(), IsEmpty());
+}
+
+TEST_F(ColumnarDatasetTest, InvalidMagic) {
+  WriteBlocks();
+  std::string contents = ReadFile();
+  contents[0] = 'X';
+  WriteFile(contents);
+  EXPECT_THAT(ColumnarDataset::Open(file_name_),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+TEST_F(ColumnarDatasetTest, TruncatedFile) {
+  WriteBlocks();
+  const std::string contents = ReadFile();
+  WriteFile(contents.substr(0, contents.size() - 128));
+  EXPECT_THAT(ColumnarDataset::Open(file_name_),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+  WriteFile(contents.substr(0, 16));
+  EXPECT_THAT(ColumnarDataset::Open(file_name_),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+TEST_F(ColumnarDatasetTest, InvalidFileName) {
+  EXPECT_THAT(ColumnarDataset::Open(file_name_ + ".does_not_exist"),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+}  // namespace
+}  // namespace gematria
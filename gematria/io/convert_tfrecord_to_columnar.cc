@@ -0,0 +1,92 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Converts one or more .tfrecord files with BasicBlockWithThroughputProto
+// records to a single file in the columnar format (see columnar_dataset.h).
+//
+// Usage:
+//   convert_tfrecord_to_columnar
+//     --input=/path/to/a.tfrecord,/path/to/b.tfrecord
+//     --output=/path/to/dataset.gmcol
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "gematria/io/columnar_dataset.h"
+#include "gematria/io/tfrecord_reader.h"
+#include "gematria/proto/throughput.pb.h"
+
+ABSL_FLAG(std::vector<std::string>, input, {},
+          "A comma-separated list of the input .tfrecord files. The blocks are "
+          "stored in the output in the order of the files and of the records.");
+ABSL_FLAG(std::string, output, "", "The name of the output file.");
+
+int main(int argc, char* argv[]) {
+  absl::ParseCommandLine(argc, argv);
+
+  const std::vector<std::string> input_files = absl::GetFlag(FLAGS_input);
+  const std::string output_file = absl::GetFlag(FLAGS_output);
+  if (input_files.empty()) {
+    std::cerr << "Error: --input is required\n";
+    return 1;
+  }
+  if (output_file.empty()) {
+    std::cerr << "Error: --output is required\n";
+    return 1;
+  }
+
+  gematria::ColumnarDatasetWriter writer;
+  std::string record;
+  gematria::BasicBlockWithThroughputProto proto;
+  for (const std::string& input_file : input_files) {
+    absl::StatusOr<std::unique_ptr<gematria::TFRecordReader>> reader =
+        gematria::TFRecordReader::Open(input_file);
+    if (!reader.ok()) {
+      std::cerr << reader.status() << "\n";
+      return 2;
+    }
+    while (true) {
+      const absl::StatusOr<bool> has_record = (*reader)->Read(record);
+      if (!has_record.ok()) {
+        std::cerr << input_file << ": " << has_record.status() << "\n";
+        return 2;
+      }
+      if (!*has_record) break;
+      if (!proto.ParseFromString(record)) {
+        std::cerr << input_file << ": could not parse record "
+                  << (*reader)->num_records() - 1 << "\n";
+        return 3;
+      }
+      if (absl::Status status = writer.Add(proto); !status.ok()) {
+        std::cerr << input_file << ": " << status << "\n";
+        return 3;
+      }
+    }
+  }
+
+  if (absl::Status status = writer.Write(output_file); !status.ok()) {
+    std::cerr << status << "\n";
+    return 4;
+  }
+  std::cout << "Wrote " << writer.num_blocks() << " blocks to " << output_file
+            << "\n";
+  return 0;
+}
@@ -0,0 +1,264 @@
+# Copyright 2023 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""Reads data sets in the columnar format through NumPy memory maps.
+
+The format is described and written by gematria/io/columnar_dataset.h. Files
+can be created from .tfrecord files with
+gematria/io/convert_tfrecord_to_columnar. The sections of the file are exposed
+as NumPy arrays backed by a read-only memory map of the file, so that opening a
+data set does not read or parse the data, and all sections can be processed
+with vectorized NumPy code.
+"""
+
+from collections.abc import Sequence
+import enum
+
+import numpy as np
+
+_MAGIC = b'GMCOLDS\0'
+_VERSION = 1
+_BYTE_ORDER_MARK = 0x01020304
+
+# The token index used for registers that are not used by an operand.
+NO_TOKEN = 0xFFFFFFFF
+
+
+class Section(enum.IntEnum):
+  """The sections of the file, in the order of ColumnarSection."""
+
+  TOKEN_OFFSETS = 0
+  TOKEN_CHARS = 1
+  BLOCKS = 2
+  INSTRUCTIONS = 3
+  PREFIXES = 4
+  OPERANDS = 5
+  INTERFERED_REGISTERS = 6
+  INTERFERED_REGISTER_SIZES = 7
+  THROUGHPUTS = 8
+  PREFIX_THROUGHPUTS = 9
+  THROUGHPUT_VALUES = 10
+
+
+# The dtypes of the records use the same alignment and padding as the C++
+# structs.
+_HEADER_DTYPE = np.dtype([
+    ('magic', 'S8'),
+    ('version', '=u4'),
+    ('byte_order_mark', '=u4'),
+    ('sections', [('offset', '=u8'), ('num_records', '=u8')], len(Section)),
+], align=True)
+
+BLOCK_DTYPE = np.dtype([
+    ('first_instruction', '=u8'),
+    ('num_instructions', '=u4'),
+    ('num_throughputs', '=u4'),
+    ('first_throughput', '=u8'),
+    ('num_duplicates', '=i8'),
+], align=True)
+
+INSTRUCTION_DTYPE = np.dtype([
+    ('mnemonic', '=u4'),
+    ('llvm_mnemonic', '=u4'),
+    ('first_prefix', '=u8'),
+    ('num_prefixes', '=u4'),
+    ('num_input_operands', '=u2'),
+    ('num_implicit_input_operands', '=u2'),
+    ('num_output_operands', '=u2'),
+    ('num_implicit_output_operands', '=u2'),
+    ('first_operand', '=u8'),
+], align=True)
+
+REGISTER_DTYPE = np.dtype([
+    ('first_interfered_register', '=u8'),
+    ('num_interfered_registers', '=u4'),
+    ('name', '=u4'),
+    ('size', '=i4'),
+    ('reserved', '=u4'),
+], align=True)
+
+# `registers` holds the register of register operands, or the base, index and
+# segment registers of address operands.
+OPERAND_DTYPE = np.dtype([
+    ('type', '=u4'),
+    ('int_value', '=i4'),
+    ('value', '=u8'),
+    ('registers', REGISTER_DTYPE, 3),
+], align=True)
+
+THROUGHPUT_DTYPE = np.dtype([
+    ('source', '=u4'),
+    ('num_values', '=u4'),
+    ('first_value', '=u8'),
+    ('first_prefix_throughput', '=u8'),
+    ('num_prefix_throughputs', '=u4'),
+    ('reserved', '=u4'),
+], align=True)
+
+VALUE_RANGE_DTYPE = np.dtype([
+    ('first_value', '=u8'),
+    ('num_values', '=u8'),
+], align=True)
+
+_SECTION_DTYPES = {
+    Section.TOKEN_OFFSETS: np.dtype('=u8'),
+    Section.TOKEN_CHARS: np.dtype('u1'),
+    Section.BLOCKS: BLOCK_DTYPE,
+    Section.INSTRUCTIONS: INSTRUCTION_DTYPE,
+    Section.PREFIXES: np.dtype('=u4'),
+    Section.OPERANDS: OPERAND_DTYPE,
+    Section.INTERFERED_REGISTERS: np.dtype('=u4'),
+    Section.INTERFERED_REGISTER_SIZES: np.dtype('=i4'),
+    Section.THROUGHPUTS: THROUGHPUT_DTYPE,
+    Section.PREFIX_THROUGHPUTS: VALUE_RANGE_DTYPE,
+    Section.THROUGHPUT_VALUES: np.dtype('=f8'),
+}
+
+
+class ColumnarDataset:
+  """A read-only view of a data set in the columnar format.
+
+  The sections of the file are available as NumPy arrays in `blocks`,
+  `instructions`, `prefixes`, `operands`, `interfered_registers`,
+  `interfered_register_sizes`, `throughputs`, `prefix_throughputs` and
+  `throughput_values`; the fields of the records are the same as in the C++
+  structs in columnar_dataset.h. The arrays are backed by the memory map and
+  they are read-only.
+  """
+
+  def __init__(self, filename: str):
+    """Maps the data set in `filename` to memory.
+
+    Args:
+      filename: The name of the file with the data set.
+
+    Raises:
+      ValueError: When the file is not a valid data set.
+    """
+    self._data = np.memmap(filename, dtype=np.uint8, mode='r')
+    if self._data.size < _HEADER_DTYPE.itemsize:
+      raise ValueError(f'{filename} is not a columnar data set')
+    header = self._data[: _HEADER_DTYPE.itemsize].view(_HEADER_DTYPE)[0]
+    if header['magic'] != _MAGIC.rstrip(b'\0'):
+      raise ValueError(f'{filename} is not a columnar data set')
+    if header['byte_order_mark'] != _BYTE_ORDER_MARK:
+      raise ValueError(
+          f'{filename} was written with a different byte order'
+      )
+    if header['version'] != _VERSION:
+      raise ValueError(f'Unsupported version {header["version"]}')
+
+    sections = []
+    for section in Section:
+      offset, num_records = header['sections'][section]
+      dtype = _SECTION_DTYPES[section]
+      end = int(offset) + int(num_records) * dtype.itemsize
+      if end > self._data.size:
+        raise ValueError(f'Invalid location of section {section.name}')
+      sections.append(self._data[int(offset) : end].view(dtype))
+
+    token_offsets = sections[Section.TOKEN_OFFSETS]
+    token_chars = sections[Section.TOKEN_CHARS].tobytes()
+    self._tokens = tuple(
+        token_chars[begin:end].decode('utf-8')
+        for begin, end in zip(token_offsets[:-1], token_offsets[1:])
+    )
+    self.blocks = sections[Section.BLOCKS]
+    self.instructions = sections[Section.INSTRUCTIONS]
+    self.prefixes = sections[Section.PREFIXES]
+    self.operands = sections[Section.OPERANDS]
+    self.interfered_registers = sections[Section.INTERFERED_REGISTERS]
+    self.interfered_register_sizes = sections[
+        Section.INTERFERED_REGISTER_SIZES
+    ]
+    self.throughputs = sections[Section.THROUGHPUTS]
+    self.prefix_throughputs = sections[Section.PREFIX_THROUGHPUTS]
+    self.throughput_values = sections[Section.THROUGHPUT_VALUES]
+
+  @property
+  def tokens(self) -> Sequence[str]:
+    """The tokens of the data set; `tokens[i]` is the token with index `i`."""
+    return self._tokens
+
+  @property
+  def num_blocks(self) -> int:
+    return self.blocks.size
+
+  def token(self, index: int) -> str:
+    """Returns the token with `index`, or '' for NO_TOKEN."""
+    return '' if index == NO_TOKEN else self._tokens[index]
+
+  def mnemonics(self, block_index: int) -> list[str]:
+    """Returns the mnemonics of the instructions of a block."""
+    block = self.blocks[block_index]
+    first = int(block['first_instruction'])
+    instructions = self.instructions[
+        first : first + int(block['num_instructions'])
+    ]
+    return [self._tokens[index] for index in instructions['mnemonic']]
+
+  def inverse_throughputs(self, block_index: int) -> dict[str, np.ndarray]:
+    """Returns the inverse throughputs of a block, keyed by their source."""
+    block = self.blocks[block_index]
+    first = int(block['first_throughput'])
+    result = {}
+    for throughput in self.throughputs[
+        first : first + int(block['num_throughputs'])
+    ]:
+      first_value = int(throughput['first_value'])
+      result[self._tokens[throughput['source']]] = self.throughput_values[
+          first_value : first_value + int(throughput['num_values'])
+      ]
+    return result
+
+  def mean_inverse_throughputs(self, source: str) -> np.ndarray:
+    """Returns the mean inverse throughput from `source` for all blocks.
+
+    Args:
+      source: The source of the throughputs.
+
+    Returns:
+      An array with one element per block. The element is the mean of the
+      inverse throughputs of the block from `source`, or NaN when the block
+      does not have any inverse throughputs from that source.
+    """
+    result = np.full(self.num_blocks, np.nan)
+    try:
+      source_index = self._tokens.index(source)
+    except ValueError:
+      return result
+    # The throughputs of the blocks are stored in the order of the blocks, so
+    # the block of each throughput is found by a binary search.
+    (throughput_indices,) = np.nonzero(
+        self.throughputs['source'] == source_index
+    )
+    if throughput_indices.size == 0:
+      return result
+    block_indices = (
+        np.searchsorted(
+            self.blocks['first_throughput'], throughput_indices, side='right'
+        )
+        - 1
+    )
+    selected = self.throughputs[throughput_indices]
+    num_values = selected['num_values'].astype(np.int64)
+    # Sums the values of each throughput through a cumulative sum over all
+    # values.
+    cumulative = np.concatenate(([0.0], np.cumsum(self.throughput_values)))
+    first_value = selected['first_value'].astype(np.int64)
+    sums = cumulative[first_value + num_values] - cumulative[first_value]
+    with np.errstate(invalid='ignore', divide='ignore'):
+      means = sums / num_values
+    has_values = num_values > 0
+    result[block_indices[has_values]] = means[has_values]
+    return result
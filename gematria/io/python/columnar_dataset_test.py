@@ -0,0 +1,157 @@
+# Copyright 2023 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import os
+import subprocess
+
+from absl.testing import absltest
+from gematria.io.python import columnar_dataset
+from gematria.io.python import tfrecord
+from gematria.proto import basic_block_pb2
+from gematria.proto import canonicalized_instruction_pb2
+from gematria.proto import throughput_pb2
+import numpy as np
+from rules_python.python.runfiles import runfiles
+
+_CONVERTER_RESOURCE_PATH = (
+    'com_google_gematria/gematria/io/convert_tfrecord_to_columnar'
+)
+
+_CanonicalizedInstructionProto = (
+    canonicalized_instruction_pb2.CanonicalizedInstructionProto
+)
+_CanonicalizedOperandProto = (
+    canonicalized_instruction_pb2.CanonicalizedOperandProto
+)
+_ThroughputWithSourceProto = throughput_pb2.ThroughputWithSourceProto
+
+_BLOCKS = (
+    throughput_pb2.BasicBlockWithThroughputProto(
+        basic_block=basic_block_pb2.BasicBlockProto(
+            canonicalized_instructions=(
+                _CanonicalizedInstructionProto(
+                    mnemonic='MOV',
+                    llvm_mnemonic='MOV64rr',
+                    input_operands=(
+                        _CanonicalizedOperandProto(register_name='RAX'),
+                    ),
+                    output_operands=(
+                        _CanonicalizedOperandProto(register_name='RBX'),
+                    ),
+                ),
+                _CanonicalizedInstructionProto(
+                    mnemonic='ADD', prefixes=('LOCK',)
+                ),
+            )
+        ),
+        inverse_throughputs=(
+            _ThroughputWithSourceProto(
+                source='hsw', inverse_throughput_cycles=(1.0, 2.0)
+            ),
+            _ThroughputWithSourceProto(
+                source='skl', inverse_throughput_cycles=(3.0,)
+            ),
+        ),
+    ),
+    throughput_pb2.BasicBlockWithThroughputProto(
+        basic_block=basic_block_pb2.BasicBlockProto(
+            canonicalized_instructions=(
+                _CanonicalizedInstructionProto(mnemonic='NOP'),
+            )
+        ),
+    ),
+    throughput_pb2.BasicBlockWithThroughputProto(
+        basic_block=basic_block_pb2.BasicBlockProto(
+            canonicalized_instructions=(
+                _CanonicalizedInstructionProto(mnemonic='MOV'),
+            )
+        ),
+        inverse_throughputs=(
+            _ThroughputWithSourceProto(
+                source='hsw', inverse_throughput_cycles=(5.0,)
+            ),
+        ),
+    ),
+)
+
+
+class ColumnarDatasetTest(absltest.TestCase):
+
+  def setUp(self):
+    super().setUp()
+    temp_dir = self.create_tempdir()
+    tfrecord_filename = os.path.join(temp_dir, 'blocks.tfrecord')
+    self.filename = os.path.join(temp_dir, 'blocks.gmcol')
+    tfrecord.write_protos(tfrecord_filename, _BLOCKS)
+
+    runfiles_dir = os.environ.get('PYTHON_RUNFILES')
+    runfiles_env = runfiles.Create({'RUNFILES_DIR': runfiles_dir})
+    assert runfiles_env is not None
+    subprocess.run(
+        (
+            runfiles_env.Rlocation(_CONVERTER_RESOURCE_PATH),
+            f'--input={tfrecord_filename}',
+            f'--output={self.filename}',
+        ),
+        check=True,
+    )
+
+  def test_blocks(self):
+    dataset = columnar_dataset.ColumnarDataset(self.filename)
+    self.assertEqual(dataset.num_blocks, len(_BLOCKS))
+    self.assertEqual(dataset.mnemonics(0), ['MOV', 'ADD'])
+    self.assertEqual(dataset.mnemonics(1), ['NOP'])
+    self.assertEqual(dataset.mnemonics(2), ['MOV'])
+    self.assertEqual(dataset.instructions.size, 4)
+
+    add = dataset.instructions[1]
+    first_prefix = add['first_prefix']
+    self.assertEqual(dataset.token(dataset.prefixes[first_prefix]), 'LOCK')
+
+    mov = dataset.instructions[0]
+    self.assertEqual(mov['num_input_operands'], 1)
+    self.assertEqual(mov['num_output_operands'], 1)
+    operands = dataset.operands[mov['first_operand'] :][:2]
+    self.assertEqual(
+        [dataset.token(name) for name in operands['registers'][:, 0]['name']],
+        ['RAX', 'RBX'],
+    )
+
+  def test_inverse_throughputs(self):
+    dataset = columnar_dataset.ColumnarDataset(self.filename)
+    throughputs = dataset.inverse_throughputs(0)
+    self.assertCountEqual(throughputs.keys(), ('hsw', 'skl'))
+    np.testing.assert_array_equal(throughputs['hsw'], (1.0, 2.0))
+    np.testing.assert_array_equal(throughputs['skl'], (3.0,))
+    self.assertEqual(dataset.inverse_throughputs(1), {})
+
+    np.testing.assert_array_equal(
+        dataset.mean_inverse_throughputs('hsw'), (1.5, np.nan, 5.0)
+    )
+    np.testing.assert_array_equal(
+        dataset.mean_inverse_throughputs('skl'), (3.0, np.nan, np.nan)
+    )
+    np.testing.assert_array_equal(
+        dataset.mean_inverse_throughputs('unknown'), (np.nan, np.nan, np.nan)
+    )
+
+  def test_invalid_file(self):
+    with open(self.filename, 'r+b') as f:
+      f.write(b'X')
+    with self.assertRaises(ValueError):
+      columnar_dataset.ColumnarDataset(self.filename)
+
+
+if __name__ == '__main__':
+  absltest.main()
@@ -0,0 +1,143 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/io/sharded_tfrecord_writer.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "pybind11/detail/common.h"
+#include "pybind11/pybind11.h"
+#include "pybind11/pytypes.h"
+#include "pybind11/stl.h"
+#include "pybind11_abseil/import_status_module.h"
+#include "pybind11_abseil/status_casters.h"
+
+namespace gematria {
+
+namespace py = ::pybind11;
+
+PYBIND11_MODULE(sharded_tfrecord_writer, m) {
+  m.doc() = "A native writer for sharded and compressed .tfrecord files.";
+
+  py::google::ImportStatusModule();
+
+  py::class_<ShardedTFRecordWriter>(
+      m, "ShardedTFRecordWriter",
+      R"(Writes records to a set of local .tfrecord files.
+
+      The records are assigned to the shards in a round-robin fashion, and each
+      shard compresses and writes its data on a background thread. The writer
+      can be passed to the native importers in
+      `gematria.datasets.python.bhive_importer`, which then write the records
+      without going through Python.
+
+      The writer can be used as a context manager; it is closed when the
+      context is exited.)")
+      .def_static(
+          "open",
+          [](std::string_view base_name, int num_shards,
+             std::string_view compression, int compression_level,
+             int64_t max_file_size,
+             int64_t max_queued_bytes_per_shard)
+              -> absl::StatusOr<std::unique_ptr<ShardedTFRecordWriter>> {
+            ShardedTFRecordWriterOptions options;
+            options.num_shards = num_shards;
+            absl::StatusOr<TFRecordCompression> compression_type =
+                ParseTFRecordCompression(compression);
+            if (!compression_type.ok()) return compression_type.status();
+            options.compression = *compression_type;
+            options.compression_level = compression_level;
+            options.max_file_size = max_file_size;
+            options.max_queued_bytes_per_shard = max_queued_bytes_per_shard;
+            return ShardedTFRecordWriter::Open(base_name, options);
+          },
+          py::arg("base_name"), py::arg("num_shards") = 1,
+          py::arg("compression") = std::string("NONE"),
+          py::arg("compression_level") = -1,
+          py::arg("max_file_size") = int64_t{0},
+          py::arg("max_queued_bytes_per_shard") = int64_t{64} << 20,
+          R"(Opens a new writer.
+
+          Args:
+            base_name: The name of the output file; when there are multiple
+              shards or `max_file_size` is set, the names of the files are
+              `base_name` followed by the index of the shard, the number of
+              shards and the index of the file in the shard.
+            num_shards: The number of shards.
+            compression: The compression type: "NONE", "GZIP", "ZLIB" or
+              "ZSTD". GZIP and ZLIB files can be read by tf.data with the same
+              compression type; ZSTD files must be decompressed first.
+            compression_level: The compression level; -1 uses the default
+              level of the compression library.
+            max_file_size: The maximal size of a file in bytes, before
+              compression. When zero, each shard is written to a single file.
+            max_queued_bytes_per_shard: The maximal number of bytes waiting to
+              be compressed and written by each shard.
+
+          Returns:
+            The new writer.
+
+          Raises:
+            StatusNotOk: When the options are not valid.)")
+      .def(
+          "write",
+          [](ShardedTFRecordWriter& self, py::bytes record) {
+            const std::string_view record_view = record;
+            // Write() may block while the queue of the shard is full.
+            py::gil_scoped_release no_gil;
+            return self.Write(record_view);
+          },
+          py::arg("record"),
+          R"(Writes a single record to the next shard.
+
+          Raises:
+            StatusNotOk: When the writer is closed or writing of the previous
+              records failed.)")
+      .def(
+          "close",
+          [](ShardedTFRecordWriter& self) {
+            py::gil_scoped_release no_gil;
+            return self.Close();
+          },
+          R"(Writes out all pending records and closes all files.
+
+          Raises:
+            StatusNotOk: When any of the records could not be written.)")
+      .def("__enter__",
+           [](ShardedTFRecordWriter& self) -> ShardedTFRecordWriter& {
+             return self;
+           },
+           py::return_value_policy::reference)
+      .def("__exit__",
+           [](ShardedTFRecordWriter& self, py::object, py::object,
+              py::object) {
+             py::gil_scoped_release no_gil;
+             return self.Close();
+           })
+      .def_property_readonly(
+          "num_records", &ShardedTFRecordWriter::num_records,
+          R"(The number of records written through the writer.)")
+      .def_property_readonly(
+          "file_names", &ShardedTFRecordWriter::file_names,
+          R"(The names of all files written by the writer.
+
+          Empty until the writer is closed.)");
+}
+
+}  // namespace gematria
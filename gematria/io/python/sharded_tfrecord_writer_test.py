@@ -0,0 +1,72 @@
+# Copyright 2023 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+from os import path
+
+from absl.testing import absltest
+from absl.testing import parameterized
+from gematria.io.python import sharded_tfrecord_writer
+from pybind11_abseil import status
+import tensorflow as tf
+
+_RECORDS = tuple(f'record {i}'.encode() for i in range(10))
+
+
+def _read_records(file_names, compression):
+  dataset = tf.data.TFRecordDataset(file_names, compression_type=compression)
+  return [record.numpy() for record in dataset]
+
+
+class ShardedTFRecordWriterTest(parameterized.TestCase):
+
+  @parameterized.parameters('NONE', 'GZIP', 'ZLIB')
+  def test_write_and_read_with_tf_data(self, compression):
+    base_name = path.join(self.create_tempdir().full_path, 'output.tfrecord')
+    with sharded_tfrecord_writer.ShardedTFRecordWriter.open(
+        base_name, num_shards=3, compression=compression
+    ) as writer:
+      for record in _RECORDS:
+        writer.write(record)
+    self.assertEqual(writer.num_records, len(_RECORDS))
+    self.assertSequenceEqual(
+        writer.file_names,
+        [f'{base_name}-{shard:05d}-of-00003' for shard in range(3)],
+    )
+
+    tf_compression = '' if compression == 'NONE' else compression
+    self.assertCountEqual(
+        _read_records(writer.file_names, tf_compression), _RECORDS
+    )
+
+  def test_roll_over(self):
+    base_name = path.join(self.create_tempdir().full_path, 'output.tfrecord')
+    writer = sharded_tfrecord_writer.ShardedTFRecordWriter.open(
+        base_name, max_file_size=100
+    )
+    for record in _RECORDS:
+      writer.write(record)
+    writer.close()
+    # Each record takes 24 bytes, so each file holds four of them.
+    self.assertLen(writer.file_names, 3)
+    self.assertSequenceEqual(_read_records(writer.file_names, ''), _RECORDS)
+
+  def test_invalid_compression(self):
+    base_name = path.join(self.create_tempdir().full_path, 'output.tfrecord')
+    with self.assertRaises(status.StatusNotOk):
+      sharded_tfrecord_writer.ShardedTFRecordWriter.open(
+          base_name, compression='LZ4'
+      )
+
+
+if __name__ == '__main__':
+  absltest.main()
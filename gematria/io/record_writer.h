@@ -0,0 +1,47 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains the interface of the writers that store serialized records, e.g.
+// basic blocks, in files. It lets the importers write their output to a single
+// .tfrecord file or to a set of shards through the same code.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_IO_RECORD_WRITER_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_IO_RECORD_WRITER_H_
+
+#include <cstdint>
+#include <string_view>
+
+#include "absl/status/status.h"
+
+namespace gematria {
+
+class RecordWriter {
+ public:
+  virtual ~RecordWriter() = default;
+
+  // Writes a single record.
+  virtual absl::Status Write(std::string_view record) = 0;
+
+  // Flushes and closes the output. Returns an error when some of the records
+  // could not be written. No records can be written after the writer is
+  // closed.
+  virtual absl::Status Close() = 0;
+
+  // Returns the number of records written through this writer.
+  virtual int64_t num_records() const = 0;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_IO_RECORD_WRITER_H_
@@ -0,0 +1,470 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/io/sharded_tfrecord_writer.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <ios>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "gematria/io/tfrecord_writer.h"
+#include "zlib.h"
+#include "zstd.h"
+
+namespace gematria {
+namespace {
+
+// The number of bytes of framed records collected on the calling thread before
+// they are passed to the background thread of the shard.
+constexpr size_t kChunkSize = size_t{1} << 20;
+// The size of the buffer for the compressed data.
+constexpr size_t kCompressionBufferSize = size_t{256} << 10;
+
+// Compresses a stream of data in chunks.
+class Compressor {
+ public:
+  virtual ~Compressor() = default;
+
+  // Compresses `data` and appends the compressed data to `out`. When `finish`
+  // is true, also finishes the compressed stream; no more data can be
+  // compressed after that.
+  virtual absl::Status Compress(std::string_view data, bool finish,
+                                std::string& out) = 0;
+};
+
+class NoCompressor : public Compressor {
+ public:
+  absl::Status Compress(std::string_view data, bool finish,
+                        std::string& out) override {
+    out.append(data);
+    return absl::OkStatus();
+  }
+};
+
+// Compresses the data with zlib, using the same stream format as TensorFlow:
+// a single zlib stream for ZLIB, and a single gzip member for GZIP.
+class ZlibCompressor : public Compressor {
+ public:
+  static absl::StatusOr<std::unique_ptr<Compressor>> Create(bool gzip,
+                                                            int level) {
+    std::unique_ptr<ZlibCompressor> compressor(new ZlibCompressor());
+    // Adding 16 to the window bits makes zlib write the gzip header.
+    const int window_bits = gzip ? MAX_WBITS + 16 : MAX_WBITS;
+    const int result =
+        deflateInit2(&compressor->stream_, level, Z_DEFLATED, window_bits,
+                     /*memLevel=*/8, Z_DEFAULT_STRATEGY);
+    if (result != Z_OK) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Could not initialize zlib with level ", level));
+    }
+    compressor->initialized_ = true;
+    return compressor;
+  }
+
+  ~ZlibCompressor() override {
+    if (initialized_) deflateEnd(&stream_);
+  }
+
+  absl::Status Compress(std::string_view data, bool finish,
+                        std::string& out) override {
+    // zlib counts the input in uInt, so the data is passed in pieces.
+    constexpr size_t kMaxPieceSize = size_t{1} << 30;
+    do {
+      const size_t piece_size = std::min(data.size(), kMaxPieceSize);
+      stream_.next_in =
+          reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+      stream_.avail_in = static_cast<uInt>(piece_size);
+      data.remove_prefix(piece_size);
+      const int flush = finish && data.empty() ? Z_FINISH : Z_NO_FLUSH;
+      do {
+        stream_.next_out = reinterpret_cast<Bytef*>(buffer_.data());
+        stream_.avail_out = static_cast<uInt>(buffer_.size());
+        if (deflate(&stream_, flush) == Z_STREAM_ERROR) {
+          return absl::InternalError("zlib compression failed");
+        }
+        out.append(buffer_.data(), buffer_.size() - stream_.avail_out);
+      } while (stream_.avail_out == 0);
+    } while (!data.empty());
+    return absl::OkStatus();
+  }
+
+ private:
+  ZlibCompressor() : buffer_(kCompressionBufferSize) {}
+
+  z_stream stream_ = {};
+  bool initialized_ = false;
+  std::vector<char> buffer_;
+};
+
+class ZstdCompressor : public Compressor {
+ public:
+  static absl::StatusOr<std::unique_ptr<Compressor>> Create(int level) {
+    std::unique_ptr<ZstdCompressor> compressor(new ZstdCompressor());
+    if (compressor->context_ == nullptr) {
+      return absl::InternalError("Could not create a zstd context");
+    }
+    if (level != -1) {
+      const size_t result = ZSTD_CCtx_setParameter(
+          compressor->context_, ZSTD_c_compressionLevel, level);
+      if (ZSTD_isError(result)) {
+        return absl::InvalidArgumentError(
+            absl::StrCat("Invalid zstd compression level ", level, ": ",
+                         ZSTD_getErrorName(result)));
+      }
+    }
+    return compressor;
+  }
+
+  ~ZstdCompressor() override { ZSTD_freeCCtx(context_); }
+
+  absl::Status Compress(std::string_view data, bool finish,
+                        std::string& out) override {
+    ZSTD_inBuffer input = {data.data(), data.size(), 0};
+    const ZSTD_EndDirective mode = finish ? ZSTD_e_end : ZSTD_e_continue;
+    while (true) {
+      ZSTD_outBuffer output = {buffer_.data(), buffer_.size(), 0};
+      const size_t remaining =
+          ZSTD_compressStream2(context_, &output, &input, mode);
+      if (ZSTD_isError(remaining)) {
+        return absl::InternalError(absl::StrCat(
+            "zstd compression failed: ", ZSTD_getErrorName(remaining)));
+      }
+      out.append(buffer_.data(), output.pos);
+      // With ZSTD_e_end, `remaining` is the number of bytes that still need to
+      // be flushed; otherwise, it is enough to consume the whole input.
+      if (finish ? remaining == 0 : input.pos == input.size) break;
+    }
+    return absl::OkStatus();
+  }
+
+ private:
+  ZstdCompressor()
+      : context_(ZSTD_createCCtx()), buffer_(kCompressionBufferSize) {}
+
+  ZSTD_CCtx* const context_;
+  std::vector<char> buffer_;
+};
+
+absl::StatusOr<std::unique_ptr<Compressor>> CreateCompressor(
+    const ShardedTFRecordWriterOptions& options) {
+  switch (options.compression) {
+    case TFRecordCompression::kNone:
+      return std::make_unique<NoCompressor>();
+    case TFRecordCompression::kGzip:
+      return ZlibCompressor::Create(/*gzip=*/true, options.compression_level);
+    case TFRecordCompression::kZlib:
+      return ZlibCompressor::Create(/*gzip=*/false, options.compression_level);
+    case TFRecordCompression::kZstd:
+      return ZstdCompressor::Create(options.compression_level);
+  }
+  return absl::InvalidArgumentError("Unknown compression type");
+}
+
+}  // namespace
+
+absl::StatusOr<TFRecordCompression> ParseTFRecordCompression(
+    std::string_view name) {
+  const std::string upper_name = absl::AsciiStrToUpper(name);
+  if (upper_name.empty() || upper_name == "NONE") {
+    return TFRecordCompression::kNone;
+  }
+  if (upper_name == "GZIP") return TFRecordCompression::kGzip;
+  if (upper_name == "ZLIB") return TFRecordCompression::kZlib;
+  if (upper_name == "ZSTD") return TFRecordCompression::kZstd;
+  return absl::InvalidArgumentError(
+      absl::StrCat("Unknown compression type: ", name));
+}
+
+// One shard of the output. The records are framed and collected in `pending_`
+// by the calling thread; full chunks are passed through a queue to the
+// background thread, which compresses them and writes them to the current file
+// of the shard.
+class ShardedTFRecordWriter::Shard {
+ public:
+  Shard(std::string base_name, int index,
+        const ShardedTFRecordWriterOptions& options)
+      : base_name_(std::move(base_name)),
+        index_(index),
+        options_(options),
+        thread_([this]() { Run(); }) {}
+
+  ~Shard() {
+    if (thread_.joinable()) {
+      StartFinishing();
+      Join().IgnoreError();
+    }
+  }
+
+  // Adds a record to the shard. Must not be called concurrently with itself
+  // or with StartFinishing().
+  absl::Status Add(std::string_view record) {
+    const int64_t framed_size = record.size() + kTFRecordOverhead;
+    if (options_.max_file_size > 0 && file_size_ > 0 &&
+        file_size_ + framed_size > options_.max_file_size) {
+      if (absl::Status status = Submit(/*end_file=*/true); !status.ok()) {
+        return status;
+      }
+    }
+    AppendTFRecord(record, pending_);
+    file_size_ += framed_size;
+    if (pending_.size() >= kChunkSize) return Submit(/*end_file=*/false);
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return status_;
+  }
+
+  // Passes the remaining records to the background thread, and tells it to
+  // close the file and stop. A shard that did not receive any records still
+  // writes an empty file.
+  void StartFinishing() {
+    if (file_size_ > 0 || !has_files_) Submit(/*end_file=*/true).IgnoreError();
+    const std::lock_guard<std::mutex> lock(mutex_);
+    finishing_ = true;
+    queue_changed_.notify_all();
+  }
+
+  // Waits until the background thread stops, and returns the first error it
+  // encountered.
+  absl::Status Join() {
+    thread_.join();
+    return status_;
+  }
+
+  // The names of the files written by the shard. Valid after Join().
+  const std::vector<std::string>& file_names() const { return file_names_; }
+
+ private:
+  struct Chunk {
+    std::string data;
+    // When true, the current file is closed after the chunk is written.
+    bool end_file = false;
+  };
+
+  // Moves the pending records to the queue of the background thread. Blocks
+  // while the queue is full.
+  absl::Status Submit(bool end_file) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    queue_changed_.wait(lock, [this]() {
+      return queue_.empty() || !status_.ok() ||
+             queued_bytes_ + static_cast<int64_t>(pending_.size()) <=
+                 options_.max_queued_bytes_per_shard;
+    });
+    if (!status_.ok()) return status_;
+    queued_bytes_ += pending_.size();
+    queue_.push_back({std::move(pending_), end_file});
+    pending_.clear();
+    if (end_file) {
+      file_size_ = 0;
+      has_files_ = true;
+    }
+    queue_changed_.notify_all();
+    return absl::OkStatus();
+  }
+
+  // The main function of the background thread.
+  void Run() {
+    while (true) {
+      Chunk chunk;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        queue_changed_.wait(lock,
+                            [this]() { return !queue_.empty() || finishing_; });
+        if (queue_.empty()) return;
+        chunk = std::move(queue_.front());
+        queue_.pop_front();
+      }
+      // After an error, the remaining chunks are dropped.
+      absl::Status status = failed_ ? absl::OkStatus() : WriteChunk(chunk);
+      failed_ = failed_ || !status.ok();
+      {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        queued_bytes_ -= chunk.data.size();
+        if (status_.ok()) status_ = std::move(status);
+        queue_changed_.notify_all();
+      }
+    }
+  }
+
+  // Compresses and writes `chunk` to the current file, opening a new file
+  // when needed. Called only from the background thread.
+  absl::Status WriteChunk(const Chunk& chunk) {
+    if (!out_.is_open()) {
+      std::string file_name = FileName(file_names_.size());
+      out_.open(file_name, std::ios::binary | std::ios::trunc);
+      if (!out_.is_open()) {
+        return absl::InvalidArgumentError(
+            absl::StrCat("Could not open file ", file_name, " for writing"));
+      }
+      file_names_.push_back(std::move(file_name));
+      absl::StatusOr<std::unique_ptr<Compressor>> compressor =
+          CreateCompressor(options_);
+      if (!compressor.ok()) return compressor.status();
+      compressor_ = *std::move(compressor);
+    }
+    compressed_.clear();
+    if (absl::Status status =
+            compressor_->Compress(chunk.data, chunk.end_file, compressed_);
+        !status.ok()) {
+      return status;
+    }
+    out_.write(compressed_.data(), compressed_.size());
+    if (chunk.end_file) out_.close();
+    if (!out_) {
+      return absl::InternalError(
+          absl::StrCat("Could not write ", file_names_.back()));
+    }
+    return absl::OkStatus();
+  }
+
+  std::string FileName(int file_index) const {
+    if (options_.max_file_size > 0) {
+      return absl::StrFormat("%s-%05d-of-%05d-%05d", base_name_, index_,
+                             options_.num_shards, file_index);
+    }
+    if (options_.num_shards > 1) {
+      return absl::StrFormat("%s-%05d-of-%05d", base_name_, index_,
+                             options_.num_shards);
+    }
+    return base_name_;
+  }
+
+  const std::string base_name_;
+  const int index_;
+  const ShardedTFRecordWriterOptions options_;
+
+  // Used only by the calling threads, which are serialized by the mutex of
+  // the writer.
+  std::string pending_;
+  // The number of bytes of framed records in the current file, including the
+  // pending records.
+  int64_t file_size_ = 0;
+  // True when at least one file was passed to the background thread.
+  bool has_files_ = false;
+
+  // Protects the members below; `queue_changed_` is notified whenever any of
+  // them changes.
+  std::mutex mutex_;
+  std::condition_variable queue_changed_;
+  std::deque<Chunk> queue_;
+  int64_t queued_bytes_ = 0;
+  bool finishing_ = false;
+  absl::Status status_;
+
+  // Used only by the background thread.
+  bool failed_ = false;
+  std::ofstream out_;
+  std::unique_ptr<Compressor> compressor_;
+  std::string compressed_;
+  std::vector<std::string> file_names_;
+
+  // Declared last, so that the thread starts after all other members were
+  // initialized.
+  std::thread thread_;
+};
+
+absl::StatusOr<std::unique_ptr<ShardedTFRecordWriter>>
+ShardedTFRecordWriter::Open(std::string_view base_name,
+                            const ShardedTFRecordWriterOptions& options) {
+  if (options.num_shards < 1) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("The number of shards must be positive, was ",
+                     options.num_shards));
+  }
+  if (options.max_file_size < 0) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "The maximal file size must not be negative, was ",
+        options.max_file_size));
+  }
+  // Checks the compression options before starting the threads.
+  if (absl::StatusOr<std::unique_ptr<Compressor>> compressor =
+          CreateCompressor(options);
+      !compressor.ok()) {
+    return compressor.status();
+  }
+  std::vector<std::unique_ptr<Shard>> shards;
+  shards.reserve(options.num_shards);
+  for (int i = 0; i < options.num_shards; ++i) {
+    shards.push_back(std::make_unique<Shard>(std::string(base_name), i,
+                                             options));
+  }
+  return std::unique_ptr<ShardedTFRecordWriter>(
+      new ShardedTFRecordWriter(std::move(shards)));
+}
+
+ShardedTFRecordWriter::ShardedTFRecordWriter(
+    std::vector<std::unique_ptr<Shard>> shards)
+    : shards_(std::move(shards)) {}
+
+ShardedTFRecordWriter::~ShardedTFRecordWriter() { Close().IgnoreError(); }
+
+absl::Status ShardedTFRecordWriter::Write(std::string_view record) {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  if (closed_) {
+    return absl::FailedPreconditionError("The writer is closed");
+  }
+  Shard& shard = *shards_[num_records_ % shards_.size()];
+  if (absl::Status status = shard.Add(record); !status.ok()) return status;
+  ++num_records_;
+  return absl::OkStatus();
+}
+
+absl::Status ShardedTFRecordWriter::Close() {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  if (closed_) return close_status_;
+  closed_ = true;
+  // All shards are finished in parallel.
+  for (const std::unique_ptr<Shard>& shard : shards_) {
+    shard->StartFinishing();
+  }
+  for (const std::unique_ptr<Shard>& shard : shards_) {
+    if (absl::Status status = shard->Join();
+        !status.ok() && close_status_.ok()) {
+      close_status_ = std::move(status);
+    }
+  }
+  return close_status_;
+}
+
+int64_t ShardedTFRecordWriter::num_records() const {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  return num_records_;
+}
+
+std::vector<std::string> ShardedTFRecordWriter::file_names() const {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<std::string> file_names;
+  if (!closed_) return file_names;
+  for (const std::unique_ptr<Shard>& shard : shards_) {
+    file_names.insert(file_names.end(), shard->file_names().begin(),
+                      shard->file_names().end());
+  }
+  return file_names;
+}
+
+}  // namespace gematria
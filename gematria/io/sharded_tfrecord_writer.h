@@ -0,0 +1,130 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains a writer that distributes records over multiple .tfrecord files
+// (shards), optionally compressed. The records are framed on the calling
+// thread, and each shard compresses and writes its data on its own background
+// thread, so that the writer keeps up with multi-threaded producers such as
+// the parallel BHive importer. Downstream readers can then read the shards in
+// parallel.
+//
+// The records are assigned to the shards in a round-robin fashion. When
+// `max_file_size` is set, each shard rolls over to a new file before its
+// current file would exceed the limit. The files are named:
+//   - `base_name`, when there is a single shard and no rollover,
+//   - `base_name-SSSSS-of-NNNNN` when there are multiple shards and no
+//     rollover,
+//   - `base_name-SSSSS-of-NNNNN-PPPPP` with rollover,
+// where SSSSS is the index of the shard, NNNNN the number of shards, and PPPPP
+// the index of the file within the shard.
+//
+// GZIP and ZLIB compressed files can be read directly by tf.data with the
+// same compression type. TensorFlow does not support ZSTD compressed
+// .tfrecord files; these must be decompressed first, e.g. with `zstd -d`.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_IO_SHARDED_TFRECORD_WRITER_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_IO_SHARDED_TFRECORD_WRITER_H_
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "gematria/io/record_writer.h"
+
+namespace gematria {
+
+enum class TFRecordCompression { kNone, kGzip, kZlib, kZstd };
+
+// Parses the name of a compression type, as used by tf.data: "" or "NONE",
+// "GZIP", "ZLIB", and in addition "ZSTD". The names are case-insensitive.
+absl::StatusOr<TFRecordCompression> ParseTFRecordCompression(
+    std::string_view name);
+
+struct ShardedTFRecordWriterOptions {
+  // The number of shards. Must be at least one.
+  int num_shards = 1;
+
+  TFRecordCompression compression = TFRecordCompression::kNone;
+  // The compression level passed to the compression library; -1 uses the
+  // default level of the library.
+  int compression_level = -1;
+
+  // The maximal size of a file in bytes, before compression. Each file holds
+  // at least one record, so a file may exceed the limit when it contains a
+  // single large record. When zero, the shards do not roll over.
+  int64_t max_file_size = 0;
+
+  // The maximal number of bytes of framed records that wait for each shard's
+  // background thread. Write() blocks when the queue of the shard is full,
+  // which limits the memory used by the writer when the producers are faster
+  // than the compression.
+  int64_t max_queued_bytes_per_shard = int64_t{64} << 20;
+};
+
+// Writes records to a set of local .tfrecord files. The methods of the writer
+// can be called from multiple threads at the same time; the records written by
+// a single thread are stored in the order in which they were written.
+class ShardedTFRecordWriter : public RecordWriter {
+ public:
+  // Creates a writer for the shards of `base_name`, and starts the background
+  // threads of the shards. Returns an error when the options are not valid.
+  // The files are created when the first data is written to them, or when the
+  // writer is closed.
+  static absl::StatusOr<std::unique_ptr<ShardedTFRecordWriter>> Open(
+      std::string_view base_name, const ShardedTFRecordWriterOptions& options);
+
+  ShardedTFRecordWriter(const ShardedTFRecordWriter&) = delete;
+  ShardedTFRecordWriter& operator=(const ShardedTFRecordWriter&) = delete;
+
+  // Closes the writer if it was not closed yet, ignoring errors.
+  ~ShardedTFRecordWriter() override;
+
+  // Adds a record to the next shard. Returns an error when the writer is
+  // closed, or when the background thread of the shard failed to write some
+  // of the previous records.
+  absl::Status Write(std::string_view record) override;
+
+  // Writes out all pending records, closes all files, and stops the
+  // background threads. Returns the first error encountered by any of the
+  // shards.
+  absl::Status Close() override;
+
+  int64_t num_records() const override;
+
+  // Returns the names of all files of the data set, ordered by the shard and
+  // by the position of the file in the shard. Must be called after Close().
+  std::vector<std::string> file_names() const;
+
+ private:
+  class Shard;
+
+  explicit ShardedTFRecordWriter(std::vector<std::unique_ptr<Shard>> shards);
+
+  // Protects all members below. Write() holds the mutex while adding a record
+  // to its shard, so that the records are assigned to the shards in order.
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+  int64_t num_records_ = 0;
+  bool closed_ = false;
+  absl::Status close_status_;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_IO_SHARDED_TFRECORD_WRITER_H_
@@ -0,0 +1,327 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/io/sharded_tfrecord_writer.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "gematria/io/tfrecord_reader.h"
+#include "gematria/testing/matchers.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "zlib.h"
+#include "zstd.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+using ::testing::UnorderedElementsAreArray;
+
+std::string ReadFile(const std::string& file_name) {
+  std::ifstream in(file_name, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(in),
+                     std::istreambuf_iterator<char>());
+}
+
+std::string InflateOrDie(std::string_view data) {
+  z_stream stream = {};
+  // Adding 32 to the window bits makes zlib detect both zlib and gzip headers.
+  EXPECT_EQ(inflateInit2(&stream, MAX_WBITS + 32), Z_OK);
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  stream.avail_in = data.size();
+  std::string out;
+  char buffer[4096];
+  int result = Z_OK;
+  while (result == Z_OK) {
+    stream.next_out = reinterpret_cast<Bytef*>(buffer);
+    stream.avail_out = sizeof(buffer);
+    result = inflate(&stream, Z_NO_FLUSH);
+    out.append(buffer, sizeof(buffer) - stream.avail_out);
+  }
+  EXPECT_EQ(result, Z_STREAM_END);
+  EXPECT_EQ(stream.avail_in, 0);
+  inflateEnd(&stream);
+  return out;
+}
+
+std::string ZstdDecompressOrDie(std::string_view data) {
+  ZSTD_DCtx* const context = ZSTD_createDCtx();
+  ZSTD_inBuffer input = {data.data(), data.size(), 0};
+  std::string out;
+  char buffer[4096];
+  size_t result = 1;
+  while (input.pos < input.size || result != 0) {
+    ZSTD_outBuffer output = {buffer, sizeof(buffer), 0};
+    result = ZSTD_decompressStream(context, &output, &input);
+    if (ZSTD_isError(result)) {
+      ADD_FAILURE() << ZSTD_getErrorName(result);
+      break;
+    }
+    out.append(buffer, output.pos);
+    if (output.pos == 0 && input.pos == input.size) break;
+  }
+  EXPECT_EQ(result, 0);
+  ZSTD_freeDCtx(context);
+  return out;
+}
+
+class ShardedTFRecordWriterTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    const ::testing::TestInfo* const test_info =
+        ::testing::UnitTest::GetInstance()->current_test_info();
+    // The names of parameterized tests contain slashes.
+    std::string test_name = test_info->name();
+    std::replace(test_name.begin(), test_name.end(), '/', '_');
+    base_name_ = ::testing::TempDir() + "/" + test_name + ".tfrecord";
+  }
+
+  // Reads all records from `file_name`, decompressing it first.
+  std::vector<std::string> ReadRecords(const std::string& file_name,
+                                       TFRecordCompression compression) {
+    std::string data = ReadFile(file_name);
+    switch (compression) {
+      case TFRecordCompression::kNone:
+        break;
+      case TFRecordCompression::kGzip:
+      case TFRecordCompression::kZlib:
+        data = InflateOrDie(data);
+        break;
+      case TFRecordCompression::kZstd:
+        data = ZstdDecompressOrDie(data);
+        break;
+    }
+    const std::string decompressed_file_name = file_name + ".decompressed";
+    std::ofstream(decompressed_file_name, std::ios::binary) << data;
+
+    std::vector<std::string> records;
+    absl::StatusOr<std::unique_ptr<TFRecordReader>> reader =
+        TFRecordReader::Open(decompressed_file_name);
+    EXPECT_OK(reader);
+    if (!reader.ok()) return records;
+    std::string record;
+    while (true) {
+      absl::StatusOr<bool> has_record = (*reader)->Read(record);
+      EXPECT_OK(has_record);
+      if (!has_record.ok() || !*has_record) break;
+      records.push_back(record);
+    }
+    return records;
+  }
+
+  std::string base_name_;
+};
+
+TEST_F(ShardedTFRecordWriterTest, SingleShard) {
+  absl::StatusOr<std::unique_ptr<ShardedTFRecordWriter>> writer =
+      ShardedTFRecordWriter::Open(base_name_, {});
+  ASSERT_OK(writer);
+  EXPECT_THAT((*writer)->Write("foo"), IsOk());
+  EXPECT_THAT((*writer)->Write(""), IsOk());
+  EXPECT_THAT((*writer)->Write("bar"), IsOk());
+  EXPECT_EQ((*writer)->num_records(), 3);
+  EXPECT_THAT((*writer)->Close(), IsOk());
+
+  EXPECT_THAT((*writer)->file_names(), ElementsAre(base_name_));
+  EXPECT_THAT(ReadRecords(base_name_, TFRecordCompression::kNone),
+              ElementsAre("foo", "", "bar"));
+}
+
+TEST_F(ShardedTFRecordWriterTest, MultipleShards) {
+  ShardedTFRecordWriterOptions options;
+  options.num_shards = 3;
+  absl::StatusOr<std::unique_ptr<ShardedTFRecordWriter>> writer =
+      ShardedTFRecordWriter::Open(base_name_, options);
+  ASSERT_OK(writer);
+  for (const std::string_view record : {"a", "b", "c", "d", "e"}) {
+    EXPECT_THAT((*writer)->Write(record), IsOk());
+  }
+  EXPECT_THAT((*writer)->Close(), IsOk());
+
+  const std::vector<std::string> file_names = (*writer)->file_names();
+  EXPECT_THAT(file_names, ElementsAre(base_name_ + "-00000-of-00003",
+                                      base_name_ + "-00001-of-00003",
+                                      base_name_ + "-00002-of-00003"));
+  ASSERT_EQ(file_names.size(), 3);
+  EXPECT_THAT(ReadRecords(file_names[0], TFRecordCompression::kNone),
+              ElementsAre("a", "d"));
+  EXPECT_THAT(ReadRecords(file_names[1], TFRecordCompression::kNone),
+              ElementsAre("b", "e"));
+  EXPECT_THAT(ReadRecords(file_names[2], TFRecordCompression::kNone),
+              ElementsAre("c"));
+}
+
+TEST_F(ShardedTFRecordWriterTest, EmptyShardsAreCreated) {
+  ShardedTFRecordWriterOptions options;
+  options.num_shards = 2;
+  absl::StatusOr<std::unique_ptr<ShardedTFRecordWriter>> writer =
+      ShardedTFRecordWriter::Open(base_name_, options);
+  ASSERT_OK(writer);
+  EXPECT_THAT((*writer)->Close(), IsOk());
+
+  const std::vector<std::string> file_names = (*writer)->file_names();
+  ASSERT_EQ(file_names.size(), 2);
+  for (const std::string& file_name : file_names) {
+    EXPECT_THAT(ReadRecords(file_name, TFRecordCompression::kNone), IsEmpty());
+  }
+}
+
+TEST_F(ShardedTFRecordWriterTest, RollOver) {
+  ShardedTFRecordWriterOptions options;
+  options.num_shards = 2;
+  // Each record of 4 bytes takes 20 bytes in the file, so each file holds at
+  // most two records.
+  options.max_file_size = 50;
+  absl::StatusOr<std::unique_ptr<ShardedTFRecordWriter>> writer =
+      ShardedTFRecordWriter::Open(base_name_, options);
+  ASSERT_OK(writer);
+  for (int i = 0; i < 6; ++i) {
+    EXPECT_THAT((*writer)->Write(absl::StrCat("rec", i)), IsOk());
+  }
+  EXPECT_THAT((*writer)->Close(), IsOk());
+
+  const std::vector<std::string> file_names = (*writer)->file_names();
+  EXPECT_THAT(file_names, ElementsAre(base_name_ + "-00000-of-00002-00000",
+                                      base_name_ + "-00000-of-00002-00001",
+                                      base_name_ + "-00001-of-00002-00000",
+                                      base_name_ + "-00001-of-00002-00001"));
+  ASSERT_EQ(file_names.size(), 4);
+  EXPECT_THAT(ReadRecords(file_names[0], TFRecordCompression::kNone),
+              ElementsAre("rec0", "rec2"));
+  EXPECT_THAT(ReadRecords(file_names[1], TFRecordCompression::kNone),
+              ElementsAre("rec4"));
+  EXPECT_THAT(ReadRecords(file_names[2], TFRecordCompression::kNone),
+              ElementsAre("rec1", "rec3"));
+  EXPECT_THAT(ReadRecords(file_names[3], TFRecordCompression::kNone),
+              ElementsAre("rec5"));
+}
+
+class ShardedTFRecordWriterCompressionTest
+    : public ShardedTFRecordWriterTest,
+      public ::testing::WithParamInterface<TFRecordCompression> {};
+
+TEST_P(ShardedTFRecordWriterCompressionTest, WriteAndRead) {
+  ShardedTFRecordWriterOptions options;
+  options.num_shards = 2;
+  options.compression = GetParam();
+  // Uses a small queue to exercise the blocking in Write().
+  options.max_queued_bytes_per_shard = 1000;
+  absl::StatusOr<std::unique_ptr<ShardedTFRecordWriter>> writer =
+      ShardedTFRecordWriter::Open(base_name_, options);
+  ASSERT_OK(writer);
+
+  // The records are large enough to span multiple chunks.
+  std::vector<std::string> expected_records;
+  for (int i = 0; i < 200; ++i) {
+    expected_records.push_back(absl::StrCat(
+        i, std::string(20000 + i, static_cast<char>('a' + i % 26))));
+  }
+  for (const std::string& record : expected_records) {
+    EXPECT_THAT((*writer)->Write(record), IsOk());
+  }
+  EXPECT_THAT((*writer)->Close(), IsOk());
+
+  std::vector<std::string> records;
+  for (const std::string& file_name : (*writer)->file_names()) {
+    const std::vector<std::string> shard_records =
+        ReadRecords(file_name, GetParam());
+    records.insert(records.end(), shard_records.begin(), shard_records.end());
+  }
+  EXPECT_THAT(records, UnorderedElementsAreArray(expected_records));
+}
+
+INSTANTIATE_TEST_SUITE_P(Compression, ShardedTFRecordWriterCompressionTest,
+                         ::testing::Values(TFRecordCompression::kNone,
+                                           TFRecordCompression::kGzip,
+                                           TFRecordCompression::kZlib,
+                                           TFRecordCompression::kZstd));
+
+TEST_F(ShardedTFRecordWriterTest, MultipleThreads) {
+  ShardedTFRecordWriterOptions options;
+  options.num_shards = 4;
+  absl::StatusOr<std::unique_ptr<ShardedTFRecordWriter>> writer =
+      ShardedTFRecordWriter::Open(base_name_, options);
+  ASSERT_OK(writer);
+
+  constexpr int kNumThreads = 4;
+  constexpr int kNumRecordsPerThread = 1000;
+  std::vector<std::thread> threads;
+  for (int thread = 0; thread < kNumThreads; ++thread) {
+    threads.emplace_back([&writer, thread]() {
+      for (int i = 0; i < kNumRecordsPerThread; ++i) {
+        EXPECT_THAT((*writer)->Write(absl::StrCat(thread, ":", i)), IsOk());
+      }
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+  EXPECT_THAT((*writer)->Close(), IsOk());
+  EXPECT_EQ((*writer)->num_records(), kNumThreads * kNumRecordsPerThread);
+
+  int num_records = 0;
+  for (const std::string& file_name : (*writer)->file_names()) {
+    num_records += ReadRecords(file_name, TFRecordCompression::kNone).size();
+  }
+  EXPECT_EQ(num_records, kNumThreads * kNumRecordsPerThread);
+}
+
+TEST_F(ShardedTFRecordWriterTest, WriteAfterClose) {
+  absl::StatusOr<std::unique_ptr<ShardedTFRecordWriter>> writer =
+      ShardedTFRecordWriter::Open(base_name_, {});
+  ASSERT_OK(writer);
+  EXPECT_THAT((*writer)->Close(), IsOk());
+  EXPECT_THAT((*writer)->Write("foo"),
+              StatusIs(absl::StatusCode::kFailedPrecondition));
+  // Closing the writer again returns the same status.
+  EXPECT_THAT((*writer)->Close(), IsOk());
+}
+
+TEST_F(ShardedTFRecordWriterTest, InvalidOptions) {
+  ShardedTFRecordWriterOptions options;
+  options.num_shards = 0;
+  EXPECT_THAT(ShardedTFRecordWriter::Open(base_name_, options),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+TEST(ParseTFRecordCompressionTest, ValidNames) {
+  EXPECT_THAT(ParseTFRecordCompression(""),
+              IsOkAndHolds(TFRecordCompression::kNone));
+  EXPECT_THAT(ParseTFRecordCompression("NONE"),
+              IsOkAndHolds(TFRecordCompression::kNone));
+  EXPECT_THAT(ParseTFRecordCompression("gzip"),
+              IsOkAndHolds(TFRecordCompression::kGzip));
+  EXPECT_THAT(ParseTFRecordCompression("ZLIB"),
+              IsOkAndHolds(TFRecordCompression::kZlib));
+  EXPECT_THAT(ParseTFRecordCompression("Zstd"),
+              IsOkAndHolds(TFRecordCompression::kZstd));
+}
+
+TEST(ParseTFRecordCompressionTest, InvalidName) {
+  EXPECT_THAT(ParseTFRecordCompression("lz4"),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+}  // namespace
+}  // namespace gematria
@@ -0,0 +1,95 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/io/tfrecord_reader.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <ios>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "gematria/io/tfrecord_writer.h"
+
+namespace gematria {
+namespace {
+
+// Loads an integer stored in the little endian byte order from `bytes`.
+template <typename UInt>
+UInt LoadLittleEndian(const char* bytes) {
+  UInt value = 0;
+  for (size_t i = 0; i < sizeof(UInt); ++i) {
+    value |= static_cast<UInt>(static_cast<unsigned char>(bytes[i])) << (8 * i);
+  }
+  return value;
+}
+
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<TFRecordReader>> TFRecordReader::Open(
+    std::string_view file_name, bool verify_checksums /*= true*/) {
+  const std::string file_name_str(file_name);
+  std::ifstream in(file_name_str, std::ios::binary);
+  if (!in.is_open()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Could not open file ", file_name, " for reading"));
+  }
+  return std::unique_ptr<TFRecordReader>(
+      new TFRecordReader(file_name_str, std::move(in), verify_checksums));
+}
+
+absl::StatusOr<bool> TFRecordReader::Read(std::string& record) {
+  char header[12];
+  in_.read(header, sizeof(header));
+  if (in_.gcount() == 0 && in_.eof()) return false;
+  if (in_.gcount() != sizeof(header)) {
+    return absl::DataLossError(
+        absl::StrCat("Truncated record header in ", file_name_, " after ",
+                     num_records_, " records"));
+  }
+  if (verify_checksums_ &&
+      LoadLittleEndian<uint32_t>(header + 8) !=
+          TFRecordMaskedCrc32c(std::string_view(header, 8))) {
+    return absl::DataLossError(
+        absl::StrCat("Corrupted record length in ", file_name_, " after ",
+                     num_records_, " records"));
+  }
+  const uint64_t length = LoadLittleEndian<uint64_t>(header);
+
+  record.resize(length);
+  char footer[4];
+  in_.read(record.data(), static_cast<std::streamsize>(length));
+  in_.read(footer, sizeof(footer));
+  if (!in_) {
+    return absl::DataLossError(
+        absl::StrCat("Truncated record in ", file_name_, " after ",
+                     num_records_, " records"));
+  }
+  if (verify_checksums_ &&
+      LoadLittleEndian<uint32_t>(footer) != TFRecordMaskedCrc32c(record)) {
+    return absl::DataLossError(
+        absl::StrCat("Corrupted record data in ", file_name_, " after ",
+                     num_records_, " records"));
+  }
+  ++num_records_;
+  return true;
+}
+
+}  // namespace gematria
@@ -0,0 +1,66 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains a reader for uncompressed .tfrecord files, as written by
+// TFRecordWriter or by tf.io.TFRecordWriter. See tfrecord_writer.h for the
+// format of the file.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_IO_TFRECORD_READER_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_IO_TFRECORD_READER_H_
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+
+namespace gematria {
+
+// Reads records from a local .tfrecord file, one by one.
+class TFRecordReader {
+ public:
+  // Opens `file_name` for reading. Returns an error when the file can't be
+  // opened. When `verify_checksums` is true, the reader checks the CRC32C
+  // checksums of the length and the data of each record.
+  static absl::StatusOr<std::unique_ptr<TFRecordReader>> Open(
+      std::string_view file_name, bool verify_checksums = true);
+
+  // Reads the next record from the file into `record`, reusing its memory.
+  // Returns true when a record was read, false at the end of the file, and an
+  // error when the file is truncated or a checksum does not match.
+  absl::StatusOr<bool> Read(std::string& record);
+
+  // Returns the number of records read through this reader.
+  int64_t num_records() const { return num_records_; }
+
+ private:
+  TFRecordReader(std::string file_name, std::ifstream in,
+                 bool verify_checksums)
+      : file_name_(std::move(file_name)),
+        in_(std::move(in)),
+        verify_checksums_(verify_checksums) {}
+
+  std::string file_name_;
+  std::ifstream in_;
+  bool verify_checksums_;
+  int64_t num_records_ = 0;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_IO_TFRECORD_READER_H_
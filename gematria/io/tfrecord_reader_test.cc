@@ -0,0 +1,127 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/io/tfrecord_reader.h"
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "gematria/io/tfrecord_writer.h"
+#include "gematria/testing/matchers.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+class TFRecordReaderTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    const ::testing::TestInfo* const test_info =
+        ::testing::UnitTest::GetInstance()->current_test_info();
+    file_name_ = ::testing::TempDir() + "/" + test_info->name() + ".tfrecord";
+  }
+
+  void WriteRecords(const std::vector<std::string>& records) {
+    absl::StatusOr<std::unique_ptr<TFRecordWriter>> writer =
+        TFRecordWriter::Open(file_name_);
+    ASSERT_OK(writer);
+    for (const std::string& record : records) {
+      ASSERT_THAT((*writer)->Write(record), IsOk());
+    }
+    ASSERT_THAT((*writer)->Close(), IsOk());
+  }
+
+  std::string file_name_;
+};
+
+TEST_F(TFRecordReaderTest, ReadRecords) {
+  WriteRecords({"foo", "", std::string(1000, 'x')});
+  absl::StatusOr<std::unique_ptr<TFRecordReader>> reader =
+      TFRecordReader::Open(file_name_);
+  ASSERT_OK(reader);
+  std::string record = "previous contents";
+  EXPECT_THAT((*reader)->Read(record), IsOkAndHolds(true));
+  EXPECT_EQ(record, "foo");
+  EXPECT_THAT((*reader)->Read(record), IsOkAndHolds(true));
+  EXPECT_EQ(record, "");
+  EXPECT_THAT((*reader)->Read(record), IsOkAndHolds(true));
+  EXPECT_EQ(record, std::string(1000, 'x'));
+  EXPECT_THAT((*reader)->Read(record), IsOkAndHolds(false));
+  EXPECT_THAT((*reader)->Read(record), IsOkAndHolds(false));
+  EXPECT_EQ((*reader)->num_records(), 3);
+}
+
+TEST_F(TFRecordReaderTest, EmptyFile) {
+  WriteRecords({});
+  absl::StatusOr<std::unique_ptr<TFRecordReader>> reader =
+      TFRecordReader::Open(file_name_);
+  ASSERT_OK(reader);
+  std::string record;
+  EXPECT_THAT((*reader)->Read(record), IsOkAndHolds(false));
+}
+
+TEST_F(TFRecordReaderTest, TruncatedRecord) {
+  WriteRecords({"foo"});
+  {
+    std::ofstream out(file_name_, std::ios::binary | std::ios::app);
+    // A valid header of a record with 3 bytes, and one byte of data.
+    out.write("\x03\x00\x00\x00\x00\x00\x00\x00\xb0\x99\x49\x0e"
+              "f",
+              13);
+  }
+  absl::StatusOr<std::unique_ptr<TFRecordReader>> reader =
+      TFRecordReader::Open(file_name_);
+  ASSERT_OK(reader);
+  std::string record;
+  EXPECT_THAT((*reader)->Read(record), IsOkAndHolds(true));
+  EXPECT_THAT((*reader)->Read(record),
+              StatusIs(absl::StatusCode::kDataLoss));
+}
+
+TEST_F(TFRecordReaderTest, CorruptedData) {
+  WriteRecords({"foo"});
+  {
+    std::fstream file(file_name_,
+                      std::ios::binary | std::ios::in | std::ios::out);
+    file.seekp(12);
+    file.write("g", 1);
+  }
+  for (const bool verify_checksums : {true, false}) {
+    SCOPED_TRACE(verify_checksums);
+    absl::StatusOr<std::unique_ptr<TFRecordReader>> reader =
+        TFRecordReader::Open(file_name_, verify_checksums);
+    ASSERT_OK(reader);
+    std::string record;
+    if (verify_checksums) {
+      EXPECT_THAT((*reader)->Read(record),
+                  StatusIs(absl::StatusCode::kDataLoss));
+    } else {
+      EXPECT_THAT((*reader)->Read(record), IsOkAndHolds(true));
+      EXPECT_EQ(record, "goo");
+    }
+  }
+}
+
+TEST_F(TFRecordReaderTest, InvalidFileName) {
+  EXPECT_THAT(TFRecordReader::Open(file_name_ + "/does/not/exist"),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+}  // namespace
+}  // namespace gematria
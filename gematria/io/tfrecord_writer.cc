@@ -0,0 +1,110 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/io/tfrecord_writer.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <ios>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "absl/crc/crc32c.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+
+namespace gematria {
+namespace {
+
+constexpr uint32_t kMaskDelta = 0xa282ead8;
+
+// Stores `value` to `bytes` in the little endian byte order.
+template <typename UInt>
+void StoreLittleEndian(UInt value, char* bytes) {
+  for (size_t i = 0; i < sizeof(UInt); ++i) {
+    bytes[i] = static_cast<char>(value >> (8 * i));
+  }
+}
+
+}  // namespace
+
+uint32_t TFRecordMaskedCrc32c(std::string_view data) {
+  const uint32_t crc = static_cast<uint32_t>(absl::ComputeCrc32c(data));
+  return ((crc >> 15) | (crc << 17)) + kMaskDelta;
+}
+
+void AppendTFRecord(std::string_view record, std::string& out) {
+  char header[12];
+  StoreLittleEndian<uint64_t>(record.size(), header);
+  StoreLittleEndian<uint32_t>(
+      TFRecordMaskedCrc32c(std::string_view(header, 8)), header + 8);
+  char footer[4];
+  StoreLittleEndian<uint32_t>(TFRecordMaskedCrc32c(record), footer);
+  static_assert(sizeof(header) + sizeof(footer) == kTFRecordOverhead);
+
+  out.append(header, sizeof(header));
+  out.append(record);
+  out.append(footer, sizeof(footer));
+}
+
+absl::StatusOr<std::unique_ptr<TFRecordWriter>> TFRecordWriter::Open(
+    std::string_view file_name, bool append /*= false*/) {
+  const std::string file_name_str(file_name);
+  std::ofstream out(file_name_str, std::ios::binary | (append ? std::ios::app
+                                                              : std::ios::trunc));
+  if (!out.is_open()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Could not open file ", file_name, " for writing"));
+  }
+  return std::unique_ptr<TFRecordWriter>(
+      new TFRecordWriter(file_name_str, std::move(out)));
+}
+
+absl::Status TFRecordWriter::Write(std::string_view record) {
+  if (!out_.is_open()) {
+    return absl::FailedPreconditionError(
+        absl::StrCat("The writer for ", file_name_, " is closed"));
+  }
+  char header[12];
+  StoreLittleEndian<uint64_t>(record.size(), header);
+  StoreLittleEndian<uint32_t>(
+      TFRecordMaskedCrc32c(std::string_view(header, 8)), header + 8);
+  char footer[4];
+  StoreLittleEndian<uint32_t>(TFRecordMaskedCrc32c(record), footer);
+
+  out_.write(header, sizeof(header));
+  out_.write(record.data(), record.size());
+  out_.write(footer, sizeof(footer));
+  if (!out_) {
+    return absl::InternalError(
+        absl::StrCat("Could not write a record to ", file_name_));
+  }
+  ++num_records_;
+  return absl::OkStatus();
+}
+
+absl::Status TFRecordWriter::Close() {
+  if (!out_.is_open()) return absl::OkStatus();
+  out_.close();
+  if (!out_) {
+    return absl::InternalError(absl::StrCat("Could not write ", file_name_));
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace gematria
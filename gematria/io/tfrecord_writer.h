@@ -0,0 +1,84 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains a writer for uncompressed .tfrecord files. The writer lets the C++
+// tools produce data sets that can be read by tf.data and by the helpers in
+// gematria/io/python/tfrecord.py, without depending on TensorFlow.
+//
+// Each record in the file is stored as:
+//   uint64 length;
+//   uint32 masked CRC32C of `length`;
+//   char   data[length];
+//   uint32 masked CRC32C of `data`;
+// where all integers are little endian.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_IO_TFRECORD_WRITER_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_IO_TFRECORD_WRITER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "gematria/io/record_writer.h"
+
+namespace gematria {
+
+// The number of bytes added to each record in the .tfrecord format.
+inline constexpr size_t kTFRecordOverhead = 16;
+
+// Returns the masked CRC32C checksum of `data`, as used in .tfrecord files.
+uint32_t TFRecordMaskedCrc32c(std::string_view data);
+
+// Appends `record` in the .tfrecord format, i.e. with its length and the
+// checksums, to `out`.
+void AppendTFRecord(std::string_view record, std::string& out);
+
+// Writes records to a local .tfrecord file.
+class TFRecordWriter : public RecordWriter {
+ public:
+  // Opens `file_name` for writing. When `append` is true and the file exists,
+  // the new records are added after the records already in the file; otherwise,
+  // the file is truncated. Returns an error when the file can't be opened.
+  static absl::StatusOr<std::unique_ptr<TFRecordWriter>> Open(
+      std::string_view file_name, bool append = false);
+
+  // Writes a single record to the file.
+  absl::Status Write(std::string_view record) override;
+
+  // Flushes and closes the file. Returns an error when some of the records
+  // could not be written. No records can be written after the writer is
+  // closed.
+  absl::Status Close() override;
+
+  // Returns the number of records written through this writer.
+  int64_t num_records() const override { return num_records_; }
+
+ private:
+  TFRecordWriter(std::string file_name, std::ofstream out)
+      : file_name_(std::move(file_name)), out_(std::move(out)) {}
+
+  std::string file_name_;
+  std::ofstream out_;
+  int64_t num_records_ = 0;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_IO_TFRECORD_WRITER_H_
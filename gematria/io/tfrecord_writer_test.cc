@@ -0,0 +1,113 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/io/tfrecord_writer.h"
+
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "gematria/testing/matchers.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+// The records "foo" and "" in the .tfrecord format, as written by
+// tf.io.TFRecordWriter.
+constexpr char kFooRecord[] =
+    "\x03\x00\x00\x00\x00\x00\x00\x00\xb0\x99\x49\x0e"
+    "foo"
+    "\x61\x8a\xbe\xfe";
+constexpr char kEmptyRecord[] =
+    "\x00\x00\x00\x00\x00\x00\x00\x00\x29\x03\x98\x07"
+    "\xd8\xea\x82\xa2";
+
+class TFRecordWriterTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    const ::testing::TestInfo* const test_info =
+        ::testing::UnitTest::GetInstance()->current_test_info();
+    file_name_ = ::testing::TempDir() + "/" + test_info->name() + ".tfrecord";
+  }
+
+  std::string ReadFile() const {
+    std::ifstream in(file_name_, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in),
+                       std::istreambuf_iterator<char>());
+  }
+
+  std::string file_name_;
+};
+
+TEST_F(TFRecordWriterTest, WriteRecords) {
+  absl::StatusOr<std::unique_ptr<TFRecordWriter>> writer =
+      TFRecordWriter::Open(file_name_);
+  ASSERT_OK(writer);
+  EXPECT_THAT((*writer)->Write("foo"), IsOk());
+  EXPECT_THAT((*writer)->Write(""), IsOk());
+  EXPECT_EQ((*writer)->num_records(), 2);
+  EXPECT_THAT((*writer)->Close(), IsOk());
+
+  EXPECT_EQ(ReadFile(), std::string(kFooRecord, sizeof(kFooRecord) - 1) +
+                            std::string(kEmptyRecord, sizeof(kEmptyRecord) - 1));
+}
+
+TEST(AppendTFRecordTest, SameAsWriter) {
+  std::string out = "prefix";
+  AppendTFRecord("foo", out);
+  AppendTFRecord("", out);
+  EXPECT_EQ(out, "prefix" + std::string(kFooRecord, sizeof(kFooRecord) - 1) +
+                     std::string(kEmptyRecord, sizeof(kEmptyRecord) - 1));
+}
+
+TEST_F(TFRecordWriterTest, Append) {
+  for (const bool append : {false, true}) {
+    absl::StatusOr<std::unique_ptr<TFRecordWriter>> writer =
+        TFRecordWriter::Open(file_name_, append);
+    ASSERT_OK(writer);
+    EXPECT_THAT((*writer)->Write("foo"), IsOk());
+    EXPECT_THAT((*writer)->Close(), IsOk());
+  }
+  const std::string foo_record(kFooRecord, sizeof(kFooRecord) - 1);
+  EXPECT_EQ(ReadFile(), foo_record + foo_record);
+
+  // Opening the file without `append` drops the existing records.
+  absl::StatusOr<std::unique_ptr<TFRecordWriter>> writer =
+      TFRecordWriter::Open(file_name_);
+  ASSERT_OK(writer);
+  EXPECT_THAT((*writer)->Close(), IsOk());
+  EXPECT_EQ(ReadFile(), "");
+}
+
+TEST_F(TFRecordWriterTest, WriteAfterClose) {
+  absl::StatusOr<std::unique_ptr<TFRecordWriter>> writer =
+      TFRecordWriter::Open(file_name_);
+  ASSERT_OK(writer);
+  EXPECT_THAT((*writer)->Close(), IsOk());
+  EXPECT_THAT((*writer)->Write("foo"),
+              StatusIs(absl::StatusCode::kFailedPrecondition));
+}
+
+TEST_F(TFRecordWriterTest, InvalidFileName) {
+  EXPECT_THAT(TFRecordWriter::Open(file_name_ + "/does/not/exist"),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+}  // namespace
+}  // namespace gematria
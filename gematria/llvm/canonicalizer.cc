@@ -17,8 +17,11 @@
 #include <cassert>
 #include <string>
 #include <string_view>
+#include <utility>
 
 #include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/compact_basic_block.h"
+#include "gematria/utils/trace.h"
 #include "lib/Target/X86/MCTargetDesc/X86BaseInfo.h"
 #include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/SmallVector.h"
@@ -55,6 +58,13 @@ namespace {
 // the binary code, e.g. addresses relative to labels or symbols. We can't
 // evaluate them without laying out the binary code, so we just replace them
 // with a constant.
+bool HasExprOperands(const llvm::MCInst& instruction) {
+  for (const llvm::MCOperand& operand : instruction) {
+    if (operand.isExpr()) return true;
+  }
+  return false;
+}
+
 void ReplaceExprOperands(llvm::MCInst& instruction) {
   for (int i = 0; i < instruction.getNumOperands(); ++i) {
     llvm::MCOperand& operand = instruction.getOperand(i);
@@ -87,24 +97,95 @@ Canonicalizer::Canonicalizer(const llvm::TargetMachine* target_machine)
 Canonicalizer::~Canonicalizer() = default;
 
 Instruction Canonicalizer::InstructionFromMCInst(llvm::MCInst mcinst) const {
-  ReplaceExprOperands(mcinst);
-  return PlatformSpecificInstructionFromMCInst(mcinst);
+  Instruction instruction;
+  InstructionFromMCInst(std::move(mcinst), instruction);
+  return instruction;
+}
+
+void Canonicalizer::InstructionFromMCInst(const llvm::MCInst& mcinst,
+                                          Instruction& instruction) const {
+  instruction.Clear();
+  if (HasExprOperands(mcinst)) {
+    llvm::MCInst mcinst_without_exprs = mcinst;
+    ReplaceExprOperands(mcinst_without_exprs);
+    PlatformSpecificInstructionFromMCInst(mcinst_without_exprs, instruction);
+  } else {
+    PlatformSpecificInstructionFromMCInst(mcinst, instruction);
+  }
+  if (symbol_table_ != nullptr) InternSymbols(*symbol_table_, instruction);
 }
 
 Instruction Canonicalizer::InstructionFromMachineInstr(llvm::MachineInstr& MI) const {
+  Instruction instruction;
+  InstructionFromMachineInstr(MI, instruction);
+  return instruction;
+}
+
+void Canonicalizer::InstructionFromMachineInstr(
+    llvm::MachineInstr& MI, Instruction& instruction) const {
   ReplaceExprOperands(MI);
-  return PlatformSpecificInstructionFromMachineInstr(MI);
+  instruction.Clear();
+  PlatformSpecificInstructionFromMachineInstr(MI, instruction);
+  if (symbol_table_ != nullptr) InternSymbols(*symbol_table_, instruction);
 }
 
 BasicBlock Canonicalizer::BasicBlockFromMCInst(
     llvm::ArrayRef<llvm::MCInst> mcinsts) const {
   BasicBlock block;
-  for (const llvm::MCInst& mcinst : mcinsts) {
-    block.instructions.push_back(InstructionFromMCInst(mcinst));
-  }
+  BasicBlockFromMCInst(mcinsts, block);
   return block;
 }
 
+void Canonicalizer::BasicBlockFromMCInst(llvm::ArrayRef<llvm::MCInst> mcinsts,
+                                         BasicBlock& block) const {
+  GEMATRIA_TRACE_SCOPE("Canonicalizer::BasicBlockFromMCInst");
+  block.instructions.resize(mcinsts.size());
+  for (size_t i = 0; i < mcinsts.size(); ++i) {
+    InstructionFromMCInst(mcinsts[i], block.instructions[i]);
+  }
+}
+
+void Canonicalizer::BasicBlocksFromMCInst(
+    llvm::ArrayRef<llvm::ArrayRef<llvm::MCInst>> mcinsts,
+    std::vector<BasicBlock>& blocks) const {
+  blocks.resize(mcinsts.size());
+  for (size_t i = 0; i < mcinsts.size(); ++i) {
+    BasicBlockFromMCInst(mcinsts[i], blocks[i]);
+  }
+}
+
+CompactBasicBlock Canonicalizer::CompactBasicBlockFromMCInst(
+    llvm::ArrayRef<llvm::MCInst> mcinsts) const {
+  GEMATRIA_TRACE_SCOPE("Canonicalizer::CompactBasicBlockFromMCInst");
+  assert(symbol_table_ != nullptr &&
+         "Compact basic blocks require a symbol table");
+  BasicBlockFromMCInst(mcinsts, compact_scratch_block_);
+  return CompactBasicBlock::FromInstructions(
+      compact_scratch_block_.instructions, *symbol_table_);
+}
+
+void Canonicalizer::BasicBlockFromMachineBasicBlock(
+    llvm::MachineBasicBlock& machine_block, BasicBlock& block) const {
+  GEMATRIA_TRACE_SCOPE("Canonicalizer::BasicBlockFromMachineBasicBlock");
+  block.instructions.resize(machine_block.size());
+  size_t num_instructions = 0;
+  for (llvm::MachineInstr& MI : machine_block) {
+    InstructionFromMachineInstr(MI, block.instructions[num_instructions++]);
+  }
+  // MachineBasicBlock::size() counts bundled instructions, while the loop
+  // visits only the top-level ones.
+  block.instructions.resize(num_instructions);
+}
+
+void Canonicalizer::BasicBlocksFromMachineFunction(
+    llvm::MachineFunction& function, std::vector<BasicBlock>& blocks) const {
+  blocks.resize(function.size());
+  size_t block_index = 0;
+  for (llvm::MachineBasicBlock& machine_block : function) {
+    BasicBlockFromMachineBasicBlock(machine_block, blocks[block_index++]);
+  }
+}
+
 std::string Canonicalizer::GetRegisterNameOrEmpty(
     const llvm::MCOperand& operand) const {
   assert(operand.isReg());
@@ -185,6 +266,28 @@ void AddX86VendorMnemonicAndPrefixes(
   assert(!instruction.mnemonic.empty());
 }
 
+// Extracts the mnemonic of `mcinst` from the mnemonic table generated by
+// TableGen. The table contains the part of the assembly string before the first
+// operand. Returns false when this part is not followed by a separator, i.e.
+// when the instruction printer may complete the mnemonic using the operands.
+// The tokens are extracted in the same way as in
+// AddX86VendorMnemonicAndPrefixes() for instructions that have operands.
+bool AddX86MnemonicFromTable(llvm::MCInstPrinter& printer,
+                             const llvm::MCInst& mcinst,
+                             Instruction& instruction) {
+  const char* const mnemonic = printer.getMnemonic(&mcinst).first;
+  if (mnemonic == nullptr) return false;
+  const std::string_view mnemonic_view(mnemonic);
+  if (mnemonic_view.empty() ||
+      (mnemonic_view.back() != '\t' && mnemonic_view.back() != ' ')) {
+    return false;
+  }
+  const auto tokens = SplitByAny(mnemonic_view, "\t\r\n ");
+  if (tokens.empty()) return false;
+  instruction.mnemonic = llvm::StringRef(tokens[0]).trim().upper();
+  return true;
+}
+
 void AddMIRVendorMnemonicAndPrefixes(
     const llvm::MCSubtargetInfo& subtarget_info,
     const llvm::MachineInstr& MI, Instruction& instruction) {
@@ -276,7 +379,8 @@ X86Canonicalizer::X86Canonicalizer(const llvm::TargetMachine* target_machine)
 X86Canonicalizer::~X86Canonicalizer() = default;
 
 
-Instruction X86Canonicalizer::PlatformSpecificInstructionFromMachineInstr(const llvm::MachineInstr & MI) const {
+void X86Canonicalizer::PlatformSpecificInstructionFromMachineInstr(
+    const llvm::MachineInstr& MI, Instruction& instruction) const {
   // NOTE (lukezhuz): Memory alias are determined by the type of memory operand
   // if it's a FrameIndex, then different frameindex should not be aliased to each other
   
@@ -287,7 +391,6 @@ Instruction X86Canonicalizer::PlatformSpecificInstructionFromMachineInstr(const
       *target_machine_.getMCRegisterInfo();
   const llvm::MCInstrInfo& instr_info = *target_machine_.getMCInstrInfo();
 
-  Instruction instruction;
   instruction.llvm_mnemonic =
       target_machine_.getMCInstrInfo()->getName(MI.getOpcode());
   instruction.mnemonic =
@@ -329,67 +432,119 @@ Instruction X86Canonicalizer::PlatformSpecificInstructionFromMachineInstr(const
     instruction.implicit_input_operands.push_back(InstructionOperand::Register(
         register_info.getName(implicit_input_register)));
   }
-  return instruction;
 }
 
 
-Instruction X86Canonicalizer::PlatformSpecificInstructionFromMCInst(
-    const llvm::MCInst& mcinst) const {
-  // NOTE(ondrasej): For now, we assume that all memory references are aliased.
-  // This is an overly conservative but safe choice. Note that Ithemal chose the
-  // other extreme where no two memory accesses are aliased - we may want to
-  // support this use case too.
-  constexpr int kWholeMemoryAliasGroup = 1;
+const X86Canonicalizer::InstructionTemplate&
+X86Canonicalizer::GetInstructionTemplate(const llvm::MCInst& mcinst) const {
+  const uint64_t key =
+      (uint64_t{mcinst.getOpcode()} << 32) | uint64_t{mcinst.getFlags()};
+  auto [it, inserted] = instruction_templates_.try_emplace(key);
+  InstructionTemplate& instruction_template = it->second;
+  if (!inserted) return instruction_template;
 
   const llvm::MCRegisterInfo& register_info =
       *target_machine_.getMCRegisterInfo();
   const llvm::MCInstrInfo& instr_info = *target_machine_.getMCInstrInfo();
-
-  Instruction instruction;
-  instruction.llvm_mnemonic =
-      target_machine_.getMCInstrInfo()->getName(mcinst.getOpcode());
-  AddX86VendorMnemonicAndPrefixes(*mcinst_printer_,
-                                  *target_machine_.getMCSubtargetInfo(), mcinst,
-                                  instruction);
-
   const llvm::MCInstrDesc& descriptor = instr_info.get(mcinst.getOpcode());
-  if (descriptor.mayLoad()) {
-    instruction.input_operands.push_back(
-        InstructionOperand::MemoryLocation(kWholeMemoryAliasGroup));
-  }
-  if (descriptor.mayStore()) {
-    instruction.output_operands.push_back(
-        InstructionOperand::MemoryLocation(kWholeMemoryAliasGroup));
-  }
+
+  instruction_template.llvm_mnemonic = instr_info.getName(mcinst.getOpcode());
+  instruction_template.may_load = descriptor.mayLoad();
+  instruction_template.may_store = descriptor.mayStore();
 
   const int memory_operand_index = GetX86MemoryOperandPosition(descriptor);
+  bool has_immediate_operands = false;
   for (int operand_index = 0; operand_index < descriptor.getNumOperands();
        ++operand_index) {
-    const bool is_output_operand = operand_index < descriptor.getNumDefs();
     const bool is_address_computation_tuple =
         operand_index == memory_operand_index;
-    AddOperand(mcinst, /*operand_index=*/operand_index,
-               /*is_output_operand=*/is_output_operand,
-               /*is_address_computation_tuple=*/is_address_computation_tuple,
-               instruction);
+    instruction_template.operands.push_back(
+        {/*operand_index=*/operand_index,
+         /*is_output_operand=*/operand_index < descriptor.getNumDefs(),
+         /*is_address_computation_tuple=*/is_address_computation_tuple});
     if (is_address_computation_tuple) {
       // A memory reference is represented as a 5-tuple. The whole 5-tuple is
       // processed in one CanonicalizeOperand() call and we need to skip the
       // remaining 4 elements here.
       operand_index += 4;
+    } else if (operand_index < mcinst.getNumOperands()) {
+      const llvm::MCOperand& operand = mcinst.getOperand(operand_index);
+      if (operand.isImm() || operand.isSFPImm() || operand.isDFPImm()) {
+        has_immediate_operands = true;
+      }
     }
   }
 
+  Instruction printed_instruction;
+  AddX86VendorMnemonicAndPrefixes(*mcinst_printer_,
+                                  *target_machine_.getMCSubtargetInfo(), mcinst,
+                                  printed_instruction);
+  instruction_template.has_static_mnemonic = !has_immediate_operands;
+  if (has_immediate_operands &&
+      mnemonic_extraction_ == MnemonicExtraction::kMnemonicTable) {
+    // The mnemonic table confirms that the mnemonic does not depend on the
+    // operands. We still verify that it gives the same tokens as the printer,
+    // e.g. the printer adds prefixes based on the flags of the MCInst.
+    Instruction table_instruction;
+    instruction_template.has_static_mnemonic =
+        AddX86MnemonicFromTable(*mcinst_printer_, mcinst, table_instruction) &&
+        table_instruction.mnemonic == printed_instruction.mnemonic &&
+        table_instruction.prefixes == printed_instruction.prefixes;
+  }
+  if (instruction_template.has_static_mnemonic) {
+    instruction_template.mnemonic = std::move(printed_instruction.mnemonic);
+    instruction_template.prefixes = std::move(printed_instruction.prefixes);
+  }
+
   for (llvm::MCPhysReg implicit_output_register : descriptor.implicit_defs()) {
-    instruction.implicit_output_operands.push_back(InstructionOperand::Register(
-        register_info.getName(implicit_output_register)));
+    instruction_template.implicit_output_operands.push_back(
+        InstructionOperand::Register(
+            register_info.getName(implicit_output_register)));
   }
   for (llvm::MCPhysReg implicit_input_register : descriptor.implicit_uses()) {
-    instruction.implicit_input_operands.push_back(InstructionOperand::Register(
-        register_info.getName(implicit_input_register)));
+    instruction_template.implicit_input_operands.push_back(
+        InstructionOperand::Register(
+            register_info.getName(implicit_input_register)));
   }
+  return instruction_template;
+}
 
-  return instruction;
+void X86Canonicalizer::PlatformSpecificInstructionFromMCInst(
+    const llvm::MCInst& mcinst, Instruction& instruction) const {
+  // NOTE(ondrasej): For now, we assume that all memory references are aliased.
+  // This is an overly conservative but safe choice. Note that Ithemal chose the
+  // other extreme where no two memory accesses are aliased - we may want to
+  // support this use case too.
+  constexpr int kWholeMemoryAliasGroup = 1;
+
+  const InstructionTemplate& instruction_template =
+      GetInstructionTemplate(mcinst);
+  instruction.llvm_mnemonic = instruction_template.llvm_mnemonic;
+  if (instruction_template.has_static_mnemonic) {
+    instruction.mnemonic = instruction_template.mnemonic;
+    instruction.prefixes = instruction_template.prefixes;
+  } else {
+    AddX86VendorMnemonicAndPrefixes(*mcinst_printer_,
+                                    *target_machine_.getMCSubtargetInfo(),
+                                    mcinst, instruction);
+  }
+
+  if (instruction_template.may_load) {
+    instruction.input_operands.push_back(
+        InstructionOperand::MemoryLocation(kWholeMemoryAliasGroup));
+  }
+  if (instruction_template.may_store) {
+    instruction.output_operands.push_back(
+        InstructionOperand::MemoryLocation(kWholeMemoryAliasGroup));
+  }
+  for (const OperandTemplate& operand : instruction_template.operands) {
+    AddOperand(mcinst, operand.operand_index, operand.is_output_operand,
+               operand.is_address_computation_tuple, instruction);
+  }
+  instruction.implicit_output_operands =
+      instruction_template.implicit_output_operands;
+  instruction.implicit_input_operands =
+      instruction_template.implicit_input_operands;
 }
 
 void X86Canonicalizer::AddOperand(const llvm::MCInst& mcinst, int operand_index,
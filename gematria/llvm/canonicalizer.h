@@ -19,15 +19,23 @@
 #ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_LLVM_CANONICALIZER_H_
 #define THIRD_PARTY_GEMATRIA_GEMATRIA_LLVM_CANONICALIZER_H_
 
+#include <cstdint>
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/compact_basic_block.h"
+#include "gematria/basic_block/symbol_table.h"
 #include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/MC/MCInst.h"
 #include "llvm/MC/MCInstPrinter.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/CodeGen/MachineBasicBlock.h"
+#include "llvm/CodeGen/MachineFunction.h"
 
 namespace gematria {
 
@@ -41,28 +49,82 @@ class Canonicalizer {
 
   // Extracts data from a single machine instruction.
   virtual Instruction InstructionFromMCInst(llvm::MCInst mcinst) const;
+  // A version of InstructionFromMCInst() that stores the extracted data in
+  // `instruction`. Any previous contents of `instruction` are replaced, but the
+  // memory allocated by it is reused. `mcinst` is copied only when it has
+  // expression operands that need to be replaced.
+  void InstructionFromMCInst(const llvm::MCInst& mcinst,
+                             Instruction& instruction) const;
 
   // Extract data from a single MachineInstr (MIR)
   virtual Instruction InstructionFromMachineInstr(
         llvm::MachineInstr& machine_instr) const;
+  // A version of InstructionFromMachineInstr() that stores the extracted data
+  // in `instruction`, reusing the memory allocated by it.
+  void InstructionFromMachineInstr(llvm::MachineInstr& machine_instr,
+                                   Instruction& instruction) const;
 
   // Extracts data from a sequence of instructions.
   virtual BasicBlock BasicBlockFromMCInst(
       llvm::ArrayRef<llvm::MCInst> mcinsts) const;
+  // A version of BasicBlockFromMCInst() that stores the extracted data in
+  // `block`, reusing the memory allocated by `block` and its instructions. When
+  // processing a large number of basic blocks, reusing one basic block object
+  // avoids most of the allocations done during the extraction.
+  void BasicBlockFromMCInst(llvm::ArrayRef<llvm::MCInst> mcinsts,
+                            BasicBlock& block) const;
+  // Extracts data from a batch of basic blocks; blocks[i] is extracted from
+  // mcinsts[i]. `blocks` is resized to the number of the basic blocks, and the
+  // memory allocated by its elements is reused as in BasicBlockFromMCInst().
+  void BasicBlocksFromMCInst(
+      llvm::ArrayRef<llvm::ArrayRef<llvm::MCInst>> mcinsts,
+      std::vector<BasicBlock>& blocks) const;
+  // Extracts data from a sequence of instructions into the compact encoding of
+  // basic blocks; see CompactBasicBlock. Requires a symbol table; the strings
+  // of the instructions are interned in it. The instructions are extracted into
+  // a basic block reused across calls, so only the compact basic block is
+  // allocated.
+  CompactBasicBlock CompactBasicBlockFromMCInst(
+      llvm::ArrayRef<llvm::MCInst> mcinsts) const;
+
+  // Extracts data from all instructions of a machine basic block. The block
+  // must be a part of a machine function. Reuses the memory allocated by
+  // `block` as in BasicBlockFromMCInst().
+  void BasicBlockFromMachineBasicBlock(llvm::MachineBasicBlock& machine_block,
+                                       BasicBlock& block) const;
+  // Extracts data from all machine basic blocks of `function`, in the order in
+  // which they appear in the function. `blocks` is resized to the number of the
+  // basic blocks, and the memory allocated by its elements is reused.
+  void BasicBlocksFromMachineFunction(llvm::MachineFunction& function,
+                                      std::vector<BasicBlock>& blocks) const;
 
   // Returns the target machine on which the canonicalizer is based.
   const llvm::TargetMachine& target_machine() const { return target_machine_; }
 
+  // Sets the symbol table used by the canonicalizer; nullptr disables symbol
+  // interning. When a symbol table is set, the mnemonics and register names of
+  // all extracted instructions are interned in it (see InternSymbols() in
+  // basic_block.h).
+  void set_symbol_table(std::shared_ptr<SymbolTable> symbol_table) {
+    symbol_table_ = std::move(symbol_table);
+  }
+  const std::shared_ptr<SymbolTable>& symbol_table() const {
+    return symbol_table_;
+  }
+
  protected:
   // The platform-specific code for instruction extraction. When called, this
-  // method can assume that `instruction` does not have any expression operands.
-  virtual Instruction PlatformSpecificInstructionFromMCInst(
-      const llvm::MCInst& instruction) const = 0;
+  // method can assume that `mcinst` does not have any expression operands and
+  // that `instruction` was cleared by Instruction::Clear().
+  virtual void PlatformSpecificInstructionFromMCInst(
+      const llvm::MCInst& mcinst, Instruction& instruction) const = 0;
 
   // The platform-specific code for instruction extraction at MIR level. When called, this
-  // method can assume that `instruction` does not have any expression operands.
-  virtual Instruction PlatformSpecificInstructionFromMachineInstr(
-      const llvm::MachineInstr& instruction) const = 0;
+  // method can assume that `machine_instr` does not have any expression operands
+  // and that `instruction` was cleared by Instruction::Clear().
+  virtual void PlatformSpecificInstructionFromMachineInstr(
+      const llvm::MachineInstr& machine_instr,
+      Instruction& instruction) const = 0;
 
   // Returns the name of a register in an operand. Returns an empty string when
   // the operand is an "undefined" operand.
@@ -71,19 +133,52 @@ class Canonicalizer {
   bool GetRegisterNameOrEmpty(const llvm::MachineOperand& operand, std::string& name, size_t& size) const;
 
   const llvm::TargetMachine& target_machine_;
+  std::shared_ptr<SymbolTable> symbol_table_;
+
+ private:
+  // The basic block used by CompactBasicBlockFromMCInst() to extract the
+  // instructions before they are encoded.
+  mutable BasicBlock compact_scratch_block_;
 };
 
 // A version of basic block extractor for X86-64.
+//
+// The canonicalizer caches the parts of the canonicalized instructions that
+// depend only on the opcode and the flags of the MCInst. The cache is not
+// thread-safe; each thread must use its own canonicalizer.
 class X86Canonicalizer final : public Canonicalizer {
  public:
+  // Selects how the canonicalizer finds out whether the mnemonic of an
+  // instruction depends on its operands. Both methods produce the same tokens.
+  enum class MnemonicExtraction {
+    // The mnemonic and the prefixes of instructions with immediate operands are
+    // always extracted from the output of the instruction printer.
+    kInstPrinter,
+    // The mnemonic and the prefixes are extracted from the output of the
+    // instruction printer once per opcode, and they are reused for all
+    // instructions where the mnemonic table generated by TableGen shows that
+    // the mnemonic does not depend on the operands.
+    kMnemonicTable,
+  };
+
   explicit X86Canonicalizer(const llvm::TargetMachine* target_machine);
   ~X86Canonicalizer() override;
 
+  MnemonicExtraction mnemonic_extraction() const {
+    return mnemonic_extraction_;
+  }
+  // Changes the mnemonic extraction method. Clears the cache of instruction
+  // templates.
+  void set_mnemonic_extraction(MnemonicExtraction mnemonic_extraction) {
+    mnemonic_extraction_ = mnemonic_extraction;
+    instruction_templates_.clear();
+  }
+
  private:
-  Instruction PlatformSpecificInstructionFromMCInst(
-      const llvm::MCInst& mcinst) const override;
-  Instruction PlatformSpecificInstructionFromMachineInstr(
-      const llvm::MachineInstr& MI) const override;
+  void PlatformSpecificInstructionFromMCInst(
+      const llvm::MCInst& mcinst, Instruction& instruction) const override;
+  void PlatformSpecificInstructionFromMachineInstr(
+      const llvm::MachineInstr& MI, Instruction& instruction) const override;
 
   void AddOperand(const llvm::MCInst& mcinst, int operand_index,
                   bool is_output_operand, bool is_address_computation_tuple,
@@ -92,7 +187,42 @@ class X86Canonicalizer final : public Canonicalizer {
                   bool is_output_operand, bool is_address_computation_tuple,
                   Instruction& instruction, const llvm::MCInstrDesc& descriptor) const;
 
+  // An explicit operand of an instruction, as passed to AddOperand().
+  struct OperandTemplate {
+    int operand_index;
+    bool is_output_operand;
+    bool is_address_computation_tuple;
+  };
+
+  // The parts of a canonicalized instruction that depend only on the opcode
+  // and the flags of the MCInst.
+  struct InstructionTemplate {
+    std::string llvm_mnemonic;
+    // True when `mnemonic` and `prefixes` are valid for all instructions with
+    // this opcode and flags. This is false for some instructions with explicit
+    // immediate operands, because the instruction printer may fold them into
+    // the mnemonic (e.g. the condition code of CMOVcc or the predicate of
+    // CMPPS); their mnemonic is then extracted for each instruction.
+    bool has_static_mnemonic = false;
+    std::string mnemonic;
+    std::vector<std::string> prefixes;
+    bool may_load = false;
+    bool may_store = false;
+    llvm::SmallVector<OperandTemplate, 4> operands;
+    std::vector<InstructionOperand> implicit_input_operands;
+    std::vector<InstructionOperand> implicit_output_operands;
+  };
+
+  // Returns the template for `mcinst`. Creates the template when this is the
+  // first instruction with the given opcode and flags.
+  const InstructionTemplate& GetInstructionTemplate(
+      const llvm::MCInst& mcinst) const;
+
   std::unique_ptr<llvm::MCInstPrinter> mcinst_printer_;
+  MnemonicExtraction mnemonic_extraction_ = MnemonicExtraction::kMnemonicTable;
+  // The instruction templates, indexed by the opcode in the upper 32 bits and
+  // by the flags of the MCInst in the lower 32 bits.
+  mutable llvm::DenseMap<uint64_t, InstructionTemplate> instruction_templates_;
 };
 
 }  // namespace gematria
@@ -111,6 +111,28 @@ TEST_F(X86BasicBlockExtractorTest, BasicBlockFromMCInst) {
               {InstructionOperand::Register("EFLAGS")})));
 }
 
+TEST_F(X86BasicBlockExtractorTest, BasicBlocksFromMCInst) {
+  const std::vector<llvm::MCInst> mcinsts = ParseAssemblyCode(R"(
+      ADD RAX, RBX
+      XOR QWORD PTR[RCX], RAX
+      MOV RAX, 1
+  )");
+  ASSERT_EQ(mcinsts.size(), 3);
+  const llvm::ArrayRef<llvm::MCInst> mcinsts_ref(mcinsts);
+  const std::vector<llvm::ArrayRef<llvm::MCInst>> mcinst_blocks = {
+      mcinsts_ref.take_front(2), mcinsts_ref.drop_front(2)};
+
+  // The blocks are overwritten, and the extra blocks are removed.
+  std::vector<BasicBlock> blocks(3);
+  blocks[0] = extractor_->BasicBlockFromMCInst(mcinsts);
+  extractor_->BasicBlocksFromMCInst(mcinst_blocks, blocks);
+  ASSERT_EQ(blocks.size(), 2);
+  EXPECT_EQ(blocks[0].instructions,
+            extractor_->BasicBlockFromMCInst(mcinst_blocks[0]).instructions);
+  EXPECT_EQ(blocks[1].instructions,
+            extractor_->BasicBlockFromMCInst(mcinst_blocks[1]).instructions);
+}
+
 TEST_F(X86BasicBlockExtractorTest, InstructionWithExprOperand) {
   const std::vector<llvm::MCInst> mcinsts = ParseAssemblyCode(R"(
     loop:
@@ -166,6 +188,76 @@ TEST_F(X86BasicBlockExtractorTest, InstructionWithSegmentRegisters) {
           /* implicit_output_operands= */ {}));
 }
 
+TEST_F(X86BasicBlockExtractorTest, InstructionsWithTheSameOpcode) {
+  const std::vector<llvm::MCInst> mcinsts = ParseAssemblyCode(R"(
+      ADD RAX, RBX
+      CMOVE RAX, RBX
+      ADD RCX, RDX
+      CMOVNE RAX, RBX
+  )");
+  ASSERT_EQ(mcinsts.size(), 4);
+
+  const BasicBlock block = extractor_->BasicBlockFromMCInst(mcinsts);
+  ASSERT_EQ(block.instructions.size(), 4);
+  EXPECT_EQ(block.instructions[0].mnemonic, "ADD");
+  EXPECT_EQ(block.instructions[2],
+            Instruction(
+                /* mnemonic= */ "ADD", /* llvm_mnemonic= */ "ADD64rr",
+                /* prefixes= */ {},
+                /* input_operands= */
+                {InstructionOperand::Register("RCX"),
+                 InstructionOperand::Register("RDX")},
+                /* implicit_input_operands= */ {},
+                /* output_operands= */ {InstructionOperand::Register("RCX")},
+                /* implicit_output_operands= */
+                {InstructionOperand::Register("EFLAGS")}));
+  // The condition code is an operand of the instruction, but it is a part of
+  // the mnemonic.
+  EXPECT_EQ(block.instructions[1].llvm_mnemonic,
+            block.instructions[3].llvm_mnemonic);
+  EXPECT_EQ(block.instructions[1].mnemonic, "CMOVE");
+  EXPECT_EQ(block.instructions[3].mnemonic, "CMOVNE");
+}
+
+TEST_F(X86BasicBlockExtractorTest, MnemonicTableMatchesInstPrinter) {
+  const std::vector<llvm::MCInst> mcinsts = ParseAssemblyCode(R"(
+      ADD RAX, 1
+      ADD RCX, 2
+      CMOVE RAX, RBX
+      CMOVNE RAX, RBX
+      SETB AL
+      SETNE AL
+      CMPLTPS XMM0, XMM1
+      CMPNEQPS XMM0, XMM1
+      SHL RAX, 1
+      SHL RAX, 5
+      MOV RAX, 0x123456789
+      MOV EAX, 1
+      LOCK ADD QWORD PTR [RAX], 1
+      ADD QWORD PTR [RAX], 1
+      REP MOVSB
+      RET
+  )");
+  ASSERT_EQ(mcinsts.size(), 16);
+
+  X86Canonicalizer inst_printer_canonicalizer(
+      &llvm_architecture_->target_machine());
+  inst_printer_canonicalizer.set_mnemonic_extraction(
+      X86Canonicalizer::MnemonicExtraction::kInstPrinter);
+  X86Canonicalizer mnemonic_table_canonicalizer(
+      &llvm_architecture_->target_machine());
+  mnemonic_table_canonicalizer.set_mnemonic_extraction(
+      X86Canonicalizer::MnemonicExtraction::kMnemonicTable);
+
+  // Process the block twice, so that the second pass uses the cached
+  // instruction templates.
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_EQ(
+        mnemonic_table_canonicalizer.BasicBlockFromMCInst(mcinsts).instructions,
+        inst_printer_canonicalizer.BasicBlockFromMCInst(mcinsts).instructions);
+  }
+}
+
 TEST_F(X86BasicBlockExtractorTest, LonePrefix) {
   const std::vector<llvm::MCInst> mcinsts = ParseAssemblyCode(R"(
       LOCK
@@ -14,13 +14,17 @@
 
 #include "gematria/llvm/disassembler.h"
 
+#include <cinttypes>
+#include <cstddef>
 #include <cstdint>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLFunctionalExtras.h"
 #include "llvm/MC/MCDisassembler/MCDisassembler.h"
+#include "llvm/MC/MCInst.h"
 #include "llvm/MC/MCInstPrinter.h"
 #include "llvm/MC/MCInstrInfo.h"
 #include "llvm/MC/MCRegisterInfo.h"
@@ -49,6 +53,37 @@ llvm::Expected<DisassembledInstruction> DisassembleOneInstruction(
     const llvm::MCRegisterInfo& register_info,
     const llvm::MCSubtargetInfo& subtarget_info, llvm::MCInstPrinter& printer,
     uint64_t base_address, llvm::ArrayRef<uint8_t>& machine_code) {
+  DisassembledInstruction result;
+  if (llvm::Error error = DisassembleOneInstruction(
+          disassembler, instruction_info, register_info, subtarget_info,
+          &printer, base_address, machine_code, result)) {
+    return std::move(error);
+  }
+  return result;
+}
+
+llvm::Expected<std::vector<DisassembledInstruction>> DisassembleAllInstructions(
+    const llvm::MCDisassembler& disassembler,
+    const llvm::MCInstrInfo& instruction_info,
+    const llvm::MCRegisterInfo& register_info,
+    const llvm::MCSubtargetInfo& subtarget_info, llvm::MCInstPrinter& printer,
+    uint64_t base_address, llvm::ArrayRef<uint8_t> machine_code) {
+  std::vector<DisassembledInstruction> result;
+  if (llvm::Error error = DisassembleAllInstructions(
+          disassembler, instruction_info, register_info, subtarget_info,
+          &printer, base_address, machine_code, result)) {
+    return std::move(error);
+  }
+  return std::move(result);
+}
+
+llvm::Error DisassembleOneInstruction(
+    const llvm::MCDisassembler& disassembler,
+    const llvm::MCInstrInfo& instruction_info,
+    const llvm::MCRegisterInfo& register_info,
+    const llvm::MCSubtargetInfo& subtarget_info, llvm::MCInstPrinter* printer,
+    uint64_t base_address, llvm::ArrayRef<uint8_t>& machine_code,
+    DisassembledInstruction& instruction) {
   if (machine_code.empty()) {
     return llvm::createStringError(llvm::errc::invalid_argument,
                                    "The input is empty");
@@ -57,18 +92,18 @@ llvm::Expected<DisassembledInstruction> DisassembleOneInstruction(
   std::string disassembler_output_buffer;
   llvm::raw_string_ostream output(disassembler_output_buffer);
 
-  DisassembledInstruction result;
-  llvm::ArrayRef<uint8_t> data = machine_code;
   // Use the current position of the instruction in memory as its address. This
   // is most likely not the "true" address, but in most cases it's the best we
   // get, and it is the address at which the instruction is parsed.
   const uint64_t instruction_address =
       reinterpret_cast<uint64_t>(machine_code.data());
   uint64_t instruction_size = 0;
-  result.address = base_address;
+  instruction.address = base_address;
+  instruction.mc_inst = llvm::MCInst();
   using DecodeStatus = llvm::MCDisassembler::DecodeStatus;
-  const DecodeStatus status = disassembler.getInstruction(
-      result.mc_inst, instruction_size, data, instruction_address, output);
+  const DecodeStatus status =
+      disassembler.getInstruction(instruction.mc_inst, instruction_size,
+                                  machine_code, instruction_address, output);
   switch (status) {
     case DecodeStatus::Success:
       break;
@@ -89,41 +124,71 @@ llvm::Expected<DisassembledInstruction> DisassembleOneInstruction(
         instruction_size, machine_code.size());
   }
 
-  result.machine_code.assign(machine_code.begin(),
-                             machine_code.begin() + instruction_size);
-  result.assembly = AssemblyFromMCInst(instruction_info, register_info,
-                                       subtarget_info, printer, result.mc_inst);
+  // assign() and clear() keep the capacity of the strings, so reusing
+  // `instruction` avoids allocating new buffers for each instruction.
+  instruction.machine_code.assign(machine_code.begin(),
+                                  machine_code.begin() + instruction_size);
+  instruction.assembly.clear();
+  if (printer != nullptr) {
+    llvm::raw_string_ostream stream(instruction.assembly);
+    printer->printInst(&instruction.mc_inst, 0, "", subtarget_info, stream);
+    stream.flush();
+  }
   machine_code = machine_code.drop_front(instruction_size);
-  return result;
+  return llvm::Error::success();
 }
 
-llvm::Expected<std::vector<DisassembledInstruction>> DisassembleAllInstructions(
+llvm::Error DisassembleAllInstructions(
     const llvm::MCDisassembler& disassembler,
     const llvm::MCInstrInfo& instruction_info,
     const llvm::MCRegisterInfo& register_info,
-    const llvm::MCSubtargetInfo& subtarget_info, llvm::MCInstPrinter& printer,
-    uint64_t base_address, llvm::ArrayRef<uint8_t> machine_code) {
-  std::vector<DisassembledInstruction> result;
-
-  int num_consumed_bytes = 0;
+    const llvm::MCSubtargetInfo& subtarget_info, llvm::MCInstPrinter* printer,
+    uint64_t base_address, llvm::ArrayRef<uint8_t> machine_code,
+    std::vector<DisassembledInstruction>& instructions) {
+  size_t num_instructions = 0;
+  uint64_t num_consumed_bytes = 0;
   while (!machine_code.empty()) {
-    llvm::Expected<DisassembledInstruction> instruction_or_status =
-        DisassembleOneInstruction(
+    if (num_instructions == instructions.size()) instructions.emplace_back();
+    DisassembledInstruction& instruction = instructions[num_instructions];
+    if (llvm::Error error = DisassembleOneInstruction(
             disassembler, instruction_info, register_info, subtarget_info,
-            printer, base_address + num_consumed_bytes, machine_code);
-    if (llvm::Error error = instruction_or_status.takeError()) {
-      std::string buffer;
-      llvm::raw_string_ostream outs(buffer);
+            printer, base_address + num_consumed_bytes, machine_code,
+            instruction)) {
       return llvm::createStringError(
           llvm::errc::invalid_argument,
-          "Parsing of machine code failed at byte %d with error %s",
-          num_consumed_bytes, buffer.c_str());
+          "Parsing of machine code failed at byte %" PRIu64 " with error %s",
+          num_consumed_bytes, llvm::toString(std::move(error)).c_str());
     }
-    result.push_back(*std::move(instruction_or_status));
-    num_consumed_bytes += result.back().machine_code.size();
+    num_consumed_bytes += instruction.machine_code.size();
+    ++num_instructions;
   }
+  instructions.resize(num_instructions);
+  return llvm::Error::success();
+}
 
-  return std::move(result);
+llvm::Error ForEachDisassembledInstruction(
+    const llvm::MCDisassembler& disassembler,
+    const llvm::MCInstrInfo& instruction_info,
+    const llvm::MCRegisterInfo& register_info,
+    const llvm::MCSubtargetInfo& subtarget_info, llvm::MCInstPrinter* printer,
+    uint64_t base_address, llvm::ArrayRef<uint8_t> machine_code,
+    llvm::function_ref<llvm::Error(const DisassembledInstruction&)> callback) {
+  DisassembledInstruction instruction;
+  uint64_t num_consumed_bytes = 0;
+  while (!machine_code.empty()) {
+    if (llvm::Error error = DisassembleOneInstruction(
+            disassembler, instruction_info, register_info, subtarget_info,
+            printer, base_address + num_consumed_bytes, machine_code,
+            instruction)) {
+      return llvm::createStringError(
+          llvm::errc::invalid_argument,
+          "Parsing of machine code failed at byte %" PRIu64 " with error %s",
+          num_consumed_bytes, llvm::toString(std::move(error)).c_str());
+    }
+    num_consumed_bytes += instruction.machine_code.size();
+    if (llvm::Error error = callback(instruction)) return error;
+  }
+  return llvm::Error::success();
 }
 
 }  // namespace gematria
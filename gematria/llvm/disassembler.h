@@ -20,6 +20,7 @@
 #include <vector>
 
 #include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLFunctionalExtras.h"
 #include "llvm/MC/MCDisassembler/MCDisassembler.h"
 #include "llvm/MC/MCInst.h"
 #include "llvm/MC/MCInstPrinter.h"
@@ -76,6 +77,52 @@ llvm::Expected<std::vector<DisassembledInstruction>> DisassembleAllInstructions(
     const llvm::MCSubtargetInfo& subtarget_info, llvm::MCInstPrinter& printer,
     uint64_t base_address, llvm::ArrayRef<uint8_t> machine_code);
 
+// Variants of the functions above for disassembling large amounts of code. They
+// write the instructions to caller-provided objects, so that the buffers of the
+// strings and the vector can be reused across calls, and they print the
+// assembly only when `printer` is not nullptr; otherwise, the `assembly` field
+// of the output instructions is left empty.
+
+// Disassembles at most one instruction starting at the first byte of
+// `machine_code` into `instruction`. On success, removes all bytes of the
+// instruction from `machine_code`. On error, leaves `machine_code` unchanged
+// and the contents of `instruction` unspecified.
+llvm::Error DisassembleOneInstruction(
+    const llvm::MCDisassembler& disassembler,
+    const llvm::MCInstrInfo& instruction_info,
+    const llvm::MCRegisterInfo& register_info,
+    const llvm::MCSubtargetInfo& subtarget_info, llvm::MCInstPrinter* printer,
+    uint64_t base_address, llvm::ArrayRef<uint8_t>& machine_code,
+    DisassembledInstruction& instruction);
+
+// Disassembles all instructions from `machine_code` into `instructions`,
+// replacing its previous contents. The elements already present in
+// `instructions` are overwritten in place. Uses the same rules for addresses
+// and errors as the function above; on error, the contents of `instructions`
+// are unspecified.
+llvm::Error DisassembleAllInstructions(
+    const llvm::MCDisassembler& disassembler,
+    const llvm::MCInstrInfo& instruction_info,
+    const llvm::MCRegisterInfo& register_info,
+    const llvm::MCSubtargetInfo& subtarget_info, llvm::MCInstPrinter* printer,
+    uint64_t base_address, llvm::ArrayRef<uint8_t> machine_code,
+    std::vector<DisassembledInstruction>& instructions);
+
+// Disassembles all instructions from `machine_code` and calls `callback` for
+// each of them in order, without storing the instructions. The same
+// DisassembledInstruction object is passed to all calls of `callback`, and it
+// is valid only until the callback returns. Stops at the first instruction
+// that can't be disassembled or when `callback` returns an error, and returns
+// this error. This is suitable also for walking large buffers of code, e.g. a
+// whole .text section.
+llvm::Error ForEachDisassembledInstruction(
+    const llvm::MCDisassembler& disassembler,
+    const llvm::MCInstrInfo& instruction_info,
+    const llvm::MCRegisterInfo& register_info,
+    const llvm::MCSubtargetInfo& subtarget_info, llvm::MCInstPrinter* printer,
+    uint64_t base_address, llvm::ArrayRef<uint8_t> machine_code,
+    llvm::function_ref<llvm::Error(const DisassembledInstruction&)> callback);
+
 }  // namespace gematria
 
 #endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_LLVM_DISASSEMBLER_H_
@@ -17,6 +17,7 @@
 #include <cstdint>
 #include <iterator>
 #include <memory>
+#include <vector>
 
 #include "absl/status/status.h"
 #include "gematria/llvm/llvm_architecture_support.h"
@@ -30,6 +31,8 @@
 #include "llvm/MC/MCInst.h"
 #include "llvm/MC/MCInstBuilder.h"
 #include "llvm/MC/MCInstPrinter.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/Error.h"
 
 namespace gematria {
 namespace {
@@ -282,5 +285,115 @@ TEST_F(DisassembleOneInstructionTest, X86_InvalidInstructionSequence) {
       StatusIs(absl::StatusCode::kInternal));
 }
 
+TEST_F(DisassembleAllInstructionsTest, X86_ReusesOutputVector) {
+  static constexpr uint8_t kFirstBlock[] = {0x90, 0x48, 0x89, 0xd8, 0x90};
+  static constexpr uint8_t kSecondBlock[] = {0x48, 0x89, 0xd8};
+  static constexpr uint64_t kAddress = 305;
+  std::unique_ptr<llvm::MCInstPrinter> mc_inst_printer =
+      llvm_x86_64_->CreateMCInstPrinter(1);
+
+  std::vector<DisassembledInstruction> instructions;
+  EXPECT_THAT(
+      LlvmErrorToStatus(DisassembleAllInstructions(
+          llvm_x86_64_->mc_disassembler(), llvm_x86_64_->mc_instr_info(),
+          llvm_x86_64_->mc_register_info(), llvm_x86_64_->mc_subtarget_info(),
+          mc_inst_printer.get(), kAddress, kFirstBlock, instructions)),
+      IsOk());
+  EXPECT_THAT(instructions,
+              ElementsAre(IsX86Nop(kAddress), IsX86MovRaxRbx(kAddress + 1),
+                          IsX86Nop(kAddress + 4)));
+
+  EXPECT_THAT(
+      LlvmErrorToStatus(DisassembleAllInstructions(
+          llvm_x86_64_->mc_disassembler(), llvm_x86_64_->mc_instr_info(),
+          llvm_x86_64_->mc_register_info(), llvm_x86_64_->mc_subtarget_info(),
+          mc_inst_printer.get(), kAddress, kSecondBlock, instructions)),
+      IsOk());
+  EXPECT_THAT(instructions, ElementsAre(IsX86MovRaxRbx(kAddress)));
+}
+
+TEST_F(DisassembleAllInstructionsTest, X86_NoPrinter) {
+  static constexpr uint8_t kInstructionData[] = {0x48, 0x89, 0xd8};
+  static constexpr uint64_t kAddress = 306;
+
+  std::vector<DisassembledInstruction> instructions;
+  EXPECT_THAT(
+      LlvmErrorToStatus(DisassembleAllInstructions(
+          llvm_x86_64_->mc_disassembler(), llvm_x86_64_->mc_instr_info(),
+          llvm_x86_64_->mc_register_info(), llvm_x86_64_->mc_subtarget_info(),
+          /*printer=*/nullptr, kAddress, kInstructionData, instructions)),
+      IsOk());
+  EXPECT_THAT(instructions,
+              ElementsAre(IsDisassembledInstruction(
+                  kAddress, IsEmpty(), "\x48\x89\xd8",
+                  IsMCInst(llvm::X86::MOV64rr,
+                           ElementsAre(IsRegister(llvm::X86::RAX),
+                                       IsRegister(llvm::X86::RBX))))));
+}
+
+using ForEachDisassembledInstructionTest = DisassemblerTest;
+
+TEST_F(ForEachDisassembledInstructionTest, X86_NopMovRaxRbxNop) {
+  static constexpr uint8_t kInstructionData[] = {0x90, 0x48, 0x89, 0xd8, 0x90};
+  static constexpr uint64_t kAddress = 307;
+  std::unique_ptr<llvm::MCInstPrinter> mc_inst_printer =
+      llvm_x86_64_->CreateMCInstPrinter(1);
+
+  std::vector<DisassembledInstruction> instructions;
+  EXPECT_THAT(
+      LlvmErrorToStatus(ForEachDisassembledInstruction(
+          llvm_x86_64_->mc_disassembler(), llvm_x86_64_->mc_instr_info(),
+          llvm_x86_64_->mc_register_info(), llvm_x86_64_->mc_subtarget_info(),
+          mc_inst_printer.get(), kAddress, kInstructionData,
+          [&](const DisassembledInstruction& instruction) {
+            instructions.push_back(instruction);
+            return llvm::Error::success();
+          })),
+      IsOk());
+  EXPECT_THAT(instructions,
+              ElementsAre(IsX86Nop(kAddress), IsX86MovRaxRbx(kAddress + 1),
+                          IsX86Nop(kAddress + 4)));
+}
+
+TEST_F(ForEachDisassembledInstructionTest, X86_StopsOnCallbackError) {
+  static constexpr uint8_t kInstructionData[] = {0x90, 0x90, 0x90};
+  static constexpr uint64_t kAddress = 308;
+
+  int num_calls = 0;
+  EXPECT_THAT(
+      LlvmErrorToStatus(ForEachDisassembledInstruction(
+          llvm_x86_64_->mc_disassembler(), llvm_x86_64_->mc_instr_info(),
+          llvm_x86_64_->mc_register_info(), llvm_x86_64_->mc_subtarget_info(),
+          /*printer=*/nullptr, kAddress, kInstructionData,
+          [&](const DisassembledInstruction& instruction) -> llvm::Error {
+            ++num_calls;
+            if (num_calls == 2) {
+              return llvm::createStringError(llvm::errc::interrupted,
+                                             "Stop");
+            }
+            return llvm::Error::success();
+          })),
+      StatusIs(absl::StatusCode::kInternal));
+  EXPECT_EQ(num_calls, 2);
+}
+
+TEST_F(ForEachDisassembledInstructionTest, X86_InvalidInstructionSequence) {
+  static constexpr uint8_t kInstructionData[] = {0x90, 0x48, 0x89};
+  static constexpr uint64_t kAddress = 309;
+
+  int num_calls = 0;
+  EXPECT_THAT(
+      LlvmErrorToStatus(ForEachDisassembledInstruction(
+          llvm_x86_64_->mc_disassembler(), llvm_x86_64_->mc_instr_info(),
+          llvm_x86_64_->mc_register_info(), llvm_x86_64_->mc_subtarget_info(),
+          /*printer=*/nullptr, kAddress, kInstructionData,
+          [&](const DisassembledInstruction& instruction) {
+            ++num_calls;
+            return llvm::Error::success();
+          })),
+      StatusIs(absl::StatusCode::kInternal));
+  EXPECT_EQ(num_calls, 1);
+}
+
 }  // namespace
 }  // namespace gematria
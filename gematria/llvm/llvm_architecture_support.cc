@@ -16,12 +16,14 @@
 
 #include <cassert>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <string_view>
 #include <utility>
 
 #include "llvm-c/Target.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/ADT/Twine.h"
 #include "llvm/MC/MCContext.h"
@@ -49,6 +51,13 @@ void InitializeLlvmOnce() {
   (void)initialize_llvm_internals;
 }
 
+std::unique_ptr<llvm::MCContext> CreateMCContext(
+    const llvm::TargetMachine& target_machine) {
+  return std::make_unique<llvm::MCContext>(
+      target_machine.getTargetTriple(), target_machine.getMCAsmInfo(),
+      target_machine.getMCRegisterInfo(), target_machine.getMCSubtargetInfo());
+}
+
 }  // namespace
 
 llvm::Expected<std::unique_ptr<LlvmArchitectureSupport>>
@@ -83,6 +92,48 @@ std::unique_ptr<LlvmArchitectureSupport> LlvmArchitectureSupport::X86_64() {
   return std::move(*x86_64_or_status);
 }
 
+llvm::Expected<std::shared_ptr<const LlvmArchitectureSupport>>
+LlvmArchitectureSupport::Shared(std::string_view llvm_triple,
+                                std::string_view cpu,
+                                std::string_view cpu_features) {
+  static std::mutex* const mutex = new std::mutex();
+  // The objects are intentionally leaked, so that they can be used also during
+  // the destruction of other static objects.
+  static auto* const shared_objects =
+      new llvm::StringMap<std::shared_ptr<const LlvmArchitectureSupport>>();
+
+  std::string key;
+  key.reserve(llvm_triple.size() + cpu.size() + cpu_features.size() + 2);
+  key.append(llvm_triple).append(1, '\0');
+  key.append(cpu).append(1, '\0');
+  key.append(cpu_features);
+
+  std::lock_guard<std::mutex> lock(*mutex);
+  std::shared_ptr<const LlvmArchitectureSupport>& shared_object =
+      (*shared_objects)[key];
+  if (shared_object == nullptr) {
+    llvm::Expected<std::unique_ptr<LlvmArchitectureSupport>> llvm_support =
+        FromTriple(llvm_triple, cpu, cpu_features);
+    if (llvm::Error error = llvm_support.takeError()) {
+      shared_objects->erase(key);
+      return std::move(error);
+    }
+    shared_object = std::move(*llvm_support);
+  }
+  return shared_object;
+}
+
+std::shared_ptr<const LlvmArchitectureSupport>
+LlvmArchitectureSupport::SharedX86_64() {
+  auto x86_64_or_status = Shared("x86_64", "", "");
+  if (!x86_64_or_status) {
+    llvm::errs() << x86_64_or_status.takeError();
+    assert(false);
+    return nullptr;
+  }
+  return std::move(*x86_64_or_status);
+}
+
 LlvmArchitectureSupport::LlvmArchitectureSupport(std::string_view llvm_triple,
                                                  std::string_view cpu,
                                                  std::string_view cpu_features,
@@ -93,12 +144,16 @@ LlvmArchitectureSupport::LlvmArchitectureSupport(std::string_view llvm_triple,
       /*TT=*/llvm_triple, /*CPU=*/cpu, /*Features=*/cpu_features,
       /*Options=*/target_options, /*RM=*/std::nullopt));
 
-  mc_context_ = std::make_unique<llvm::MCContext>(
-      target_machine_->getTargetTriple(), target_machine_->getMCAsmInfo(),
-      target_machine_->getMCRegisterInfo(),
-      target_machine_->getMCSubtargetInfo());
+  mc_context_ = CreateMCContext(*target_machine_);
   mc_disassembler_.reset(target_->createMCDisassembler(
       *target_machine_->getMCSubtargetInfo(), *mc_context_));
 }
 
+LlvmDisassemblerContext::LlvmDisassemblerContext(
+    const LlvmArchitectureSupport& llvm_support)
+    : llvm_support_(llvm_support),
+      mc_context_(CreateMCContext(llvm_support.target_machine())),
+      mc_disassembler_(llvm_support.target().createMCDisassembler(
+          llvm_support.mc_subtarget_info(), *mc_context_)) {}
+
 }  // namespace gematria
@@ -33,6 +33,12 @@ namespace gematria {
 
 // Provides a single handle to all LLVM objects representing a given
 // architecture that can be passed around easily and shared with Python code.
+//
+// All methods of the class are const, and apart from the disassembler returned
+// by mc_disassembler(), the objects it provides are not modified after the
+// construction and they can be used from multiple threads at the same time.
+// Threads that need to disassemble code concurrently should each create an
+// LlvmDisassemblerContext.
 class LlvmArchitectureSupport {
  public:
   // Creates the architecture support from an LLVM triple. Returns an error when
@@ -45,6 +51,19 @@ class LlvmArchitectureSupport {
   // Calls the necessary LLVMInitializeX86*() functions on the first invocation.
   static std::unique_ptr<LlvmArchitectureSupport> X86_64();
 
+  // Returns a process-wide architecture support object for the given LLVM
+  // triple, CPU and features. The object is created on the first call with
+  // these arguments and returned by all following calls, so that the LLVM
+  // target machine and its tables are created only once per process no matter
+  // how many workers use them. The object is never destroyed. Thread-safe.
+  static llvm::Expected<std::shared_ptr<const LlvmArchitectureSupport>> Shared(
+      std::string_view llvm_triple, std::string_view cpu,
+      std::string_view cpu_features);
+
+  // A convenience function that returns the shared architecture support for
+  // x86-64.
+  static std::shared_ptr<const LlvmArchitectureSupport> SharedX86_64();
+
   // Creates a new llvm::MCInstPriner. The value of `syntax_variant` is
   // architecture dependent, and corresponds to the same argument of
   // createMCInstPrinter.
@@ -72,6 +91,9 @@ class LlvmArchitectureSupport {
     return *target_machine_->getMCRegisterInfo();
   }
 
+  // Returns the disassembler owned by this object. The disassembler uses a
+  // mutable llvm::MCContext, and it must not be used from multiple threads at
+  // the same time; use LlvmDisassemblerContext to get a per-thread one.
   const llvm::MCDisassembler& mc_disassembler() const {
     return *mc_disassembler_;
   }
@@ -91,6 +113,30 @@ class LlvmArchitectureSupport {
   std::unique_ptr<llvm::MCDisassembler> mc_disassembler_;
 };
 
+// Holds the mutable LLVM objects needed to disassemble code for an
+// architecture. Creating the context is cheap compared to creating the
+// LlvmArchitectureSupport: each worker thread can create its own context
+// while sharing a single LlvmArchitectureSupport with the other threads. The
+// context is not thread-safe. The architecture support must outlive the
+// context.
+class LlvmDisassemblerContext {
+ public:
+  explicit LlvmDisassemblerContext(const LlvmArchitectureSupport& llvm_support);
+
+  const LlvmArchitectureSupport& llvm_support() const { return llvm_support_; }
+
+  llvm::MCContext& mc_context() { return *mc_context_; }
+
+  const llvm::MCDisassembler& mc_disassembler() const {
+    return *mc_disassembler_;
+  }
+
+ private:
+  const LlvmArchitectureSupport& llvm_support_;
+  std::unique_ptr<llvm::MCContext> mc_context_;
+  std::unique_ptr<llvm::MCDisassembler> mc_disassembler_;
+};
+
 }  // namespace gematria
 
 #endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_LLVM_STATE_H_
@@ -14,13 +14,20 @@
 
 #include "gematria/llvm/llvm_architecture_support.h"
 
+#include <cstdint>
 #include <memory>
+#include <thread>
+#include <vector>
 
 #include "absl/status/status.h"
 #include "gematria/llvm/llvm_to_absl.h"
 #include "gematria/testing/matchers.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/MC/MCDisassembler/MCDisassembler.h"
+#include "llvm/MC/MCInst.h"
+#include "llvm/Support/raw_ostream.h"
 
 namespace gematria {
 namespace {
@@ -50,5 +57,58 @@ TEST(LlvmArchitectureSupportTest, FromTriple_Invalid) {
   EXPECT_THAT(x86_64_or_status, StatusIs(absl::StatusCode::kInternal));
 }
 
+TEST(LlvmArchitectureSupportTest, Shared) {
+  auto x86_64_or_status = LlvmExpectedToStatusOr(
+      LlvmArchitectureSupport::Shared("x86_64", "", ""));
+  ASSERT_OK(x86_64_or_status);
+  std::shared_ptr<const LlvmArchitectureSupport> x86_64 =
+      std::move(x86_64_or_status).value();
+  ASSERT_NE(x86_64, nullptr);
+  EXPECT_EQ(x86_64->target_machine().getTargetTriple().getArchName(), "x86_64");
+
+  // All calls with the same arguments return the same object.
+  EXPECT_EQ(LlvmArchitectureSupport::SharedX86_64(), x86_64);
+  auto haswell_or_status = LlvmExpectedToStatusOr(
+      LlvmArchitectureSupport::Shared("x86_64", "haswell", ""));
+  ASSERT_OK(haswell_or_status);
+  EXPECT_NE(*haswell_or_status, x86_64);
+}
+
+TEST(LlvmArchitectureSupportTest, Shared_Invalid) {
+  auto x86_64_or_status =
+      LlvmExpectedToStatusOr(LlvmArchitectureSupport::Shared(
+          "an_architecture_that_does_not_exist", "", ""));
+  EXPECT_THAT(x86_64_or_status, StatusIs(absl::StatusCode::kInternal));
+}
+
+TEST(LlvmDisassemblerContextTest, DisassemblesFromMultipleThreads) {
+  static constexpr uint8_t kMovRaxRbx[] = {0x48, 0x89, 0xd8};
+  static constexpr int kNumThreads = 4;
+  const std::shared_ptr<const LlvmArchitectureSupport> x86_64 =
+      LlvmArchitectureSupport::SharedX86_64();
+  ASSERT_NE(x86_64, nullptr);
+
+  std::vector<uint64_t> instruction_sizes(kNumThreads);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&x86_64, &instruction_sizes, i]() {
+      LlvmDisassemblerContext context(*x86_64);
+      for (int j = 0; j < 100; ++j) {
+        llvm::MCInst instruction;
+        uint64_t size = 0;
+        const llvm::MCDisassembler::DecodeStatus status =
+            context.mc_disassembler().getInstruction(
+                instruction, size, kMovRaxRbx, 0, llvm::nulls());
+        if (status != llvm::MCDisassembler::Success) return;
+        instruction_sizes[i] = size;
+      }
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+  for (const uint64_t size : instruction_sizes) {
+    EXPECT_EQ(size, sizeof(kMovRaxRbx));
+  }
+}
+
 }  // namespace
 }  // namespace gematria
@@ -0,0 +1,158 @@
+# Copyright 2023 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""Contains a producer/consumer pipeline for preparing training batches.
+
+The pipeline runs a set of worker threads; each worker repeatedly calls its
+own batch function and puts the result to a bounded queue, from which the
+training loop takes the batches. This way, the next batches are prepared while
+the training step runs on the accelerator.
+
+The batch functions run in parallel with each other and with the consumer, so
+each worker must use its own batch state, e.g. its own graph builder. The
+parallelism is limited by the GIL; the workers scale only when the batch
+functions spend most of the time in native code that releases it.
+
+Typical usage:
+  with input_pipeline.BatchPrefetcher(
+      [make_batch_function() for _ in range(num_workers)], queue_depth=4
+  ) as prefetcher:
+    for batch in prefetcher:
+      train_on(batch)
+"""
+
+from collections.abc import Callable, Sequence
+import queue
+import threading
+from typing import Generic, Optional, TypeVar, Union
+
+from absl import logging
+
+T = TypeVar('T')
+
+# The interval in seconds in which blocked workers check whether the prefetcher
+# was closed.
+_POLL_INTERVAL_SECONDS = 0.1
+
+
+class _WorkerFinished:
+  """A marker put to the queue by a worker when it stops producing batches."""
+
+  def __init__(self, error: Optional[Exception] = None):
+    self.error = error
+
+
+class BatchPrefetcher(Generic[T]):
+  """Prepares batches on background threads.
+
+  Each batch function is called repeatedly from its own worker thread. A worker
+  stops when its batch function raises StopIteration; the iteration over the
+  prefetcher ends when all workers stopped. When a batch function raises any
+  other exception, the exception is re-raised from __next__() and all workers
+  are stopped.
+
+  With more than one worker, the batches are returned in the order in which
+  they are finished, not in the order in which the workers started them.
+  """
+
+  def __init__(
+      self,
+      batch_functions: Sequence[Callable[[], T]],
+      queue_depth: int = 2,
+  ):
+    """Initializes the prefetcher and starts the worker threads.
+
+    Args:
+      batch_functions: The functions that create the batches, one per worker
+        thread. The functions are called concurrently, and they must not share
+        any mutable state without synchronization.
+      queue_depth: The maximal number of finished batches waiting for the
+        consumer. The workers block when the queue is full.
+
+    Raises:
+      ValueError: When `batch_functions` is empty or `queue_depth` is not
+        positive.
+    """
+    if not batch_functions:
+      raise ValueError('At least one batch function is required.')
+    if queue_depth < 1:
+      raise ValueError(f'queue_depth must be positive, was {queue_depth}.')
+    self._queue = queue.Queue(maxsize=queue_depth)
+    self._stopped = threading.Event()
+    self._num_running_workers = len(batch_functions)
+    self._workers = [
+        threading.Thread(
+            target=self._run_worker,
+            args=(batch_function,),
+            name=f'BatchPrefetcher-{index}',
+            daemon=True,
+        )
+        for index, batch_function in enumerate(batch_functions)
+    ]
+    for worker in self._workers:
+      worker.start()
+
+  def __enter__(self) -> 'BatchPrefetcher[T]':
+    return self
+
+  def __exit__(self, *unused_exc_info) -> None:
+    self.close()
+
+  def __iter__(self) -> 'BatchPrefetcher[T]':
+    return self
+
+  def __next__(self) -> T:
+    """Returns the next finished batch; blocks until one is available."""
+    while self._num_running_workers > 0:
+      item = self._queue.get()
+      if not isinstance(item, _WorkerFinished):
+        return item
+      self._num_running_workers -= 1
+      if item.error is not None:
+        self.close()
+        raise item.error
+    raise StopIteration
+
+  def close(self) -> None:
+    """Stops the workers and waits until they finish.
+
+    The batches that were not consumed yet are discarded. A worker that is in
+    the middle of creating a batch stops after the batch is finished.
+    """
+    self._stopped.set()
+    for worker in self._workers:
+      worker.join()
+    self._num_running_workers = 0
+
+  def _put(self, item: Union[T, _WorkerFinished]) -> bool:
+    """Puts `item` to the queue; returns False when the prefetcher is closed."""
+    while not self._stopped.is_set():
+      try:
+        self._queue.put(item, timeout=_POLL_INTERVAL_SECONDS)
+        return True
+      except queue.Full:
+        pass
+    return False
+
+  def _run_worker(self, batch_function: Callable[[], T]) -> None:
+    error = None
+    try:
+      while not self._stopped.is_set():
+        if not self._put(batch_function()):
+          return
+    except StopIteration:
+      pass
+    except Exception as e:  # pylint: disable=broad-exception-caught
+      logging.exception('Batch function failed.')
+      error = e
+    self._put(_WorkerFinished(error))
@@ -0,0 +1,85 @@
+# Copyright 2023 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+import itertools
+import threading
+import time
+
+from absl.testing import absltest
+from gematria.model.python import input_pipeline
+
+
+class BatchPrefetcherTest(absltest.TestCase):
+
+  def test_single_worker_preserves_order(self):
+    batches = iter(range(10))
+    with input_pipeline.BatchPrefetcher(
+        [lambda: next(batches)], queue_depth=3
+    ) as prefetcher:
+      self.assertSequenceEqual(list(prefetcher), range(10))
+
+  def test_multiple_workers(self):
+    lock = threading.Lock()
+    batches = iter(range(100))
+
+    def make_batch():
+      with lock:
+        return next(batches)
+
+    with input_pipeline.BatchPrefetcher([make_batch] * 4) as prefetcher:
+      self.assertCountEqual(list(prefetcher), range(100))
+
+  def test_workers_run_concurrently(self):
+    num_workers = 3
+    barrier = threading.Barrier(num_workers, timeout=10)
+
+    def make_batch():
+      # Would time out if the workers ran one after another.
+      barrier.wait()
+      raise StopIteration
+
+    with input_pipeline.BatchPrefetcher(
+        [make_batch] * num_workers
+    ) as prefetcher:
+      self.assertEmpty(list(prefetcher))
+
+  def test_error_is_propagated(self):
+    def make_batch():
+      raise ValueError('Foo')
+
+    prefetcher = input_pipeline.BatchPrefetcher([make_batch])
+    with self.assertRaisesRegex(ValueError, 'Foo'):
+      next(prefetcher)
+    # The prefetcher is closed after the error.
+    self.assertEmpty(list(prefetcher))
+
+  def test_close_with_full_queue(self):
+    counter = itertools.count()
+    prefetcher = input_pipeline.BatchPrefetcher(
+        [lambda: next(counter)], queue_depth=1
+    )
+    self.assertEqual(next(prefetcher), 0)
+    # Gives the worker time to fill the queue and block.
+    time.sleep(0.2)
+    prefetcher.close()
+    self.assertEmpty(list(prefetcher))
+
+  def test_invalid_arguments(self):
+    with self.assertRaises(ValueError):
+      input_pipeline.BatchPrefetcher([])
+    with self.assertRaises(ValueError):
+      input_pipeline.BatchPrefetcher([lambda: 1], queue_depth=0)
+
+
+if __name__ == '__main__':
+  absltest.main()
@@ -175,6 +175,23 @@ _GEMATRIA_TRAINING_RANDOMIZE_BATCHES = flags.DEFINE_bool(
         ' the order in which they appear in the input.'
     ),
 )
+_GEMATRIA_TRAINING_NUM_INPUT_WORKERS = flags.DEFINE_integer(
+    'gematria_training_num_input_workers',
+    0,
+    (
+        'The number of background threads that schedule the training batches'
+        ' while the training step runs. When zero, the batches are scheduled'
+        ' synchronously in the training loop.'
+    ),
+)
+_GEMATRIA_TRAINING_INPUT_QUEUE_DEPTH = flags.DEFINE_integer(
+    'gematria_training_input_queue_depth',
+    2,
+    (
+        'The maximal number of scheduled batches waiting for the training step.'
+        ' Used only when --gematria_training_num_input_workers is positive.'
+    ),
+)
 _DROP_INVALID_BLOCKS = flags.DEFINE_bool(
     'gematria_drop_invalid_blocks',
     False,
@@ -910,4 +927,6 @@ def run_gematria_model_from_command_line_flags(
                 num_epochs=_GEMATRIA_TRAINING_NUM_EPOCHS.value,
                 randomize_batches=_GEMATRIA_TRAINING_RANDOMIZE_BATCHES.value,
                 randomize_expected_outputs=randomize_expected_outputs,
+                num_input_workers=_GEMATRIA_TRAINING_NUM_INPUT_WORKERS.value,
+                input_queue_depth=_GEMATRIA_TRAINING_INPUT_QUEUE_DEPTH.value,
             )
@@ -460,6 +460,8 @@ class GematriaMainFunctionTest(model_test.TestCase):
         num_epochs=num_epochs,
         randomize_batches=randomize_batches,
         randomize_expected_outputs=True,
+        num_input_workers=0,
+        input_queue_depth=2,
     )
 
     # Check that the files created by the monitored session are there.
@@ -546,6 +548,8 @@ class GematriaMainFunctionTest(model_test.TestCase):
         num_epochs=num_epochs,
         randomize_batches=randomize_batches,
         randomize_expected_outputs=False,
+        num_input_workers=0,
+        input_queue_depth=2,
     )
 
   @flagsaver.flagsaver
@@ -610,6 +614,8 @@ class GematriaMainFunctionTest(model_test.TestCase):
         num_epochs=num_epochs,
         randomize_batches=randomize_batches,
         randomize_expected_outputs=False,
+        num_input_workers=0,
+        input_queue_depth=2,
     )
 
   def test_train_with_resume(self):
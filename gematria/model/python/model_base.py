@@ -28,15 +28,20 @@ GnnModelBase.
 import abc
 import collections
 from collections.abc import Iterable, MutableMapping, MutableSequence, Sequence
+import contextlib
+import copy
+import functools
 import itertools
 import math
 import os
 import random
+import threading
 from typing import Optional, TypeVar, Union
 
 from absl import logging
 from gematria.basic_block.python import basic_block
 from gematria.basic_block.python import throughput
+from gematria.model.python import input_pipeline
 from gematria.model.python import loss_utils
 from gematria.model.python import options
 from gematria.model.python import training
@@ -923,6 +928,25 @@ class ModelBase(metaclass=abc.ABCMeta):
     """A version of validate_basic_block that works on blocks with throughpu."""
     return self.validate_basic_block(block.block)
 
+  def _clone_for_batch_scheduling(self) -> 'ModelBase':
+    """Creates a copy of the model that can schedule batches concurrently.
+
+    The copy shares the TensorFlow graph, the placeholders and all other
+    resources with the original model, so the feed_dicts it returns can be run
+    in the same session. Only the state used while scheduling a batch is
+    private to the copy. Child classes that keep additional mutable objects
+    used in self.schedule_batch() (e.g. a graph builder) must override this
+    method and create a new instance of these objects in the copy.
+
+    Returns:
+      A shallow copy of the model.
+    """
+    assert self._batch_expected_outputs is None, (
+        'ModelBase._clone_for_batch_scheduling() was called while a batch was'
+        ' being scheduled.'
+    )
+    return copy.copy(self)
+
   def _start_batch(self) -> None:
     """Method called before adding basic blocks in self.schedule_batch().
 
@@ -1422,6 +1446,8 @@ class ModelBase(metaclass=abc.ABCMeta):
       max_instructions_in_batch: Optional[int],
       randomize_batches: bool = True,
       randomize_expected_outputs: bool = False,
+      num_input_workers: int = 0,
+      input_queue_depth: int = 2,
   ) -> Optional[training.TrainingEpochStats]:
     """Runs training of the model on the given training data.
 
@@ -1444,6 +1470,14 @@ class ModelBase(metaclass=abc.ABCMeta):
       randomize_expected_outputs: Set to True to randomly select the expected
         outputs used for training from the available values. When False, it
         takes the first value from the list.
+      num_input_workers: The number of background threads that schedule the
+        batches while the training step runs. Each thread uses its own copy of
+        the batch scheduling state, see self._clone_for_batch_scheduling().
+        When zero, the batches are scheduled synchronously in the training
+        loop. With more than one worker and randomize_batches=False, the
+        batches may be trained in a different order than they are created.
+      input_queue_depth: The maximal number of scheduled batches waiting for
+        the training step. Used only when num_input_workers is positive.
 
     Returns:
       The loss before the last training step. Returns None when no training was
@@ -1451,12 +1485,12 @@ class ModelBase(metaclass=abc.ABCMeta):
     """
     if randomize_batches:
 
-      def run_one_epoch():
-        return self.train_mini_batch(
-            monitored_session,
+      def make_batch(scheduler: ModelBase) -> FeedDict:
+        return scheduler.schedule_batch(
             basic_block_list,
             max_blocks_in_batch=max_blocks_in_batch,
             max_instructions_in_batch=max_instructions_in_batch,
+            randomize_batch=True,
             randomize_expected_outputs=randomize_expected_outputs,
         )
 
@@ -1477,17 +1511,36 @@ class ModelBase(metaclass=abc.ABCMeta):
           )
       )
 
-      def run_one_epoch():
-        batch = next(batches)
-        schedule = self.schedule_batch(
+      # The workers take the batches from the shared iterator.
+      batches_lock = threading.Lock()
+
+      def make_batch(scheduler: ModelBase) -> FeedDict:
+        with batches_lock:
+          batch = next(batches)
+        return scheduler.schedule_batch(
             batch, randomize_expected_outputs=randomize_expected_outputs
         )
-        return self.train_batch(monitored_session, schedule)
 
-    with timer.scoped('ModelBase.train - one batch', num_iterations=num_epochs):
+    if num_input_workers > 0:
+      prefetcher = input_pipeline.BatchPrefetcher(
+          [
+              functools.partial(make_batch, self._clone_for_batch_scheduling())
+              for _ in range(num_input_workers)
+          ],
+          queue_depth=input_queue_depth,
+      )
+      next_schedule = functools.partial(next, prefetcher)
+    else:
+      prefetcher = contextlib.nullcontext()
+      next_schedule = functools.partial(make_batch, self)
+
+    with (
+        prefetcher,
+        timer.scoped('ModelBase.train - one batch', num_iterations=num_epochs),
+    ):
       stats = None
       while not monitored_session.should_stop():
-        stats = run_one_epoch()
+        stats = self.train_batch(monitored_session, next_schedule())
         logging.info('Training: %s', stats)
       return stats
 
@@ -773,6 +773,35 @@ class ModelBaseTest(model_test.TestCase):
       for weight in weights:
         self.assertAlmostEqual(float(weight), 0.5)
 
+  def test_train_with_input_workers(self):
+    num_epochs = 10
+    for randomize_batches in (True, False):
+      with self.subTest(randomize_batches=randomize_batches):
+        with tf.Graph().as_default():
+          model = TestModelWithVarGroups(
+              dtype=tf.dtypes.float32,
+              use_deltas=False,
+              learning_rate=0.1,
+              task_list=['foo', 'bar'],
+          )
+          model.initialize()
+          with tf.train.MonitoredSession(
+              hooks=[tf.train.StopAtStepHook(last_step=num_epochs)]
+          ) as sess:
+            stats = model.train(
+                sess,
+                self.blocks_with_throughput,
+                num_epochs=num_epochs,
+                max_blocks_in_batch=2,
+                max_instructions_in_batch=None,
+                randomize_batches=randomize_batches,
+                num_input_workers=2,
+                input_queue_depth=1,
+            )
+          self.assertEqual(stats.epoch, num_epochs)
+          # The batches were scheduled by copies of the model.
+          self.assertIsNone(model._batch_expected_outputs)
+
   def test_grad_clipping(self):
     task_list = ['foo', 'bar']
     model = TestModelWithVarGroups(
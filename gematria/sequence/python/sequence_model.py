@@ -14,10 +14,10 @@
 """Base class for Gematria models that read basic blocks as sequences of tokens."""
 
 import abc
-from collections.abc import MutableSequence
 from typing import Optional
 
 from gematria.basic_block.python import basic_block
+from gematria.granite.python import token_sequence_builder
 from gematria.model.python import model_base
 from gematria.model.python import oov_token_behavior
 from gematria.model.python import token_model
@@ -74,17 +74,32 @@ class SequenceModelBase(token_model.TokenModel, model_base.ModelBase):
   # The model used for processing the data.
   _model: Optional[tf.keras.Model] = None
 
-  # Temporary lists used when transforming basic blocks from BasicBlockProto to
-  # the three tensors described above.
-  _batch_tokens: MutableSequence[int]
-  _batch_num_tokens_per_instruction: MutableSequence[int]
-  _batch_num_instructions_per_block: MutableSequence[int]
+  # The native builder that transforms basic blocks to the three tensors
+  # described above.
+  _batch_token_sequence_builder: token_sequence_builder.TokenSequenceBuilder
 
   # Inputs (tf.placeholder tensors) specific to sequence models.
   _token_sequence_placeholder: tf.Tensor
   _num_tokens_per_instruction_placeholder: tf.Tensor
   _num_instructions_per_block_placeholder: tf.Tensor
 
+  def __init__(self, **kwargs):
+    """Initializes the sequence model.
+
+    Args:
+      **kwargs: All arguments are passed to the constructor of the base class.
+    """
+    super().__init__(**kwargs)
+    self._batch_token_sequence_builder = self._make_token_sequence_builder()
+
+  def _make_token_sequence_builder(
+      self,
+  ) -> token_sequence_builder.TokenSequenceBuilder:
+    return token_sequence_builder.TokenSequenceBuilder(
+        tokens=self._token_list,
+        out_of_vocabulary_behavior=self._oov_behavior,
+    )
+
   @abc.abstractmethod
   def _create_model(self) -> tf.keras.Model:
     """Creates the Keras model for this class.
@@ -130,18 +145,26 @@ class SequenceModelBase(token_model.TokenModel, model_base.ModelBase):
     else:
       self._output_tensor = model_output
 
+  # @Override
+  def _clone_for_batch_scheduling(self) -> 'SequenceModelBase':
+    """See base class."""
+    clone = super()._clone_for_batch_scheduling()
+    clone._batch_token_sequence_builder = self._make_token_sequence_builder()
+    return clone
+
   # @Override
   def _start_batch(self) -> None:
     """See base class."""
     super()._start_batch()
-    self._batch_tokens = []
-    self._batch_num_tokens_per_instruction = []
-    self._batch_num_instructions_per_block = []
+    self._batch_token_sequence_builder.reset()
 
   # @Override
   def _make_batch_feed_dict(self) -> model_base.FeedDict:
     """See base class."""
-    batch_tokens = np.array(self._batch_tokens, dtype=np.int32)
+    builder = self._batch_token_sequence_builder
+    # The builder returns a new copy of the array, so it can be modified in
+    # place.
+    batch_tokens = builder.token_sequence
     if self._oov_injection_probability > 0:
       oov_injection_mask = (
           np.random.uniform(0.0, 1.0, size=batch_tokens.shape)
@@ -151,19 +174,18 @@ class SequenceModelBase(token_model.TokenModel, model_base.ModelBase):
 
     return {
         self._token_sequence_placeholder: batch_tokens,
-        self._num_tokens_per_instruction_placeholder: np.array(
-            self._batch_num_tokens_per_instruction, dtype=np.int32
+        self._num_tokens_per_instruction_placeholder: (
+            builder.num_tokens_per_instruction
         ),
-        self._num_instructions_per_block_placeholder: np.array(
-            self._batch_num_instructions_per_block, dtype=np.int32
+        self._num_instructions_per_block_placeholder: (
+            builder.num_instructions_per_block
         ),
     }
 
   # @Override
   def _add_basic_block_to_batch(self, block: basic_block.BasicBlock) -> None:
     """See base class."""
-    self._batch_num_instructions_per_block.append(len(block.instructions))
-    for instruction in block.instructions:
-      tokens = instruction.as_token_list()
-      self._batch_num_tokens_per_instruction.append(len(tokens))
-      self._batch_tokens.extend(self._token_index(token) for token in tokens)
+    if not self._batch_token_sequence_builder.add_basic_block(block):
+      raise token_model.TokenNotFoundError(
+          self._batch_token_sequence_builder.last_unknown_token
+      )
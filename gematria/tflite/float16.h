@@ -0,0 +1,82 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains conversions between IEEE half-precision values, as stored in
+// TfLiteFloat16, and floats. They are used by the custom ops and by the
+// inference code to support models converted to float16.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_TFLITE_FLOAT16_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_TFLITE_FLOAT16_H_
+
+#include <cstdint>
+#include <cstring>
+
+namespace gematria {
+
+// Converts an IEEE half-precision value to a float.
+inline float HalfToFloat(uint16_t half) {
+  const uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+  const uint32_t exponent = (half >> 10) & 0x1f;
+  uint32_t mantissa = half & 0x3ff;
+  uint32_t bits = 0;
+  if (exponent == 0x1f) {
+    // Infinity or NaN.
+    bits = sign | 0x7f800000 | (mantissa << 13);
+  } else if (exponent != 0) {
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  } else if (mantissa != 0) {
+    // A denormal half is a normal float; shift the mantissa until its leading
+    // one is the implicit bit.
+    uint32_t float_exponent = 113;
+    while ((mantissa & 0x400) == 0) {
+      mantissa <<= 1;
+      --float_exponent;
+    }
+    bits = sign | (float_exponent << 23) | ((mantissa & 0x3ff) << 13);
+  } else {
+    bits = sign;
+  }
+  float value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// Converts a float to the nearest IEEE half-precision value; ties are rounded
+// to even, and values out of range become infinity.
+inline uint16_t FloatToHalf(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  const uint16_t sign = (bits >> 16) & 0x8000;
+  const uint32_t abs_bits = bits & 0x7fffffff;
+  if (abs_bits > 0x7f800000) return sign | 0x7e00;  // NaN.
+  if (abs_bits >= 0x477ff000) return sign | 0x7c00;  // Infinity.
+  if (abs_bits < 0x38800000) {
+    // The result is a denormal half or zero. Adding 0.5 aligns the mantissa
+    // so that the hardware rounds it to the half denormal precision.
+    float abs_value;
+    std::memcpy(&abs_value, &abs_bits, sizeof(abs_value));
+    abs_value += 0.5f;
+    uint32_t denormal_bits;
+    std::memcpy(&denormal_bits, &abs_value, sizeof(denormal_bits));
+    return sign | static_cast<uint16_t>(denormal_bits - 0x3f000000);
+  }
+  // Round the mantissa to 10 bits; a carry correctly increments the exponent.
+  const uint32_t rounding_bias = 0xfff + ((abs_bits >> 13) & 1);
+  return sign | static_cast<uint16_t>((abs_bits - 0x38000000 + rounding_bias) >>
+                                       13);
+}
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_TFLITE_FLOAT16_H_
@@ -15,15 +15,27 @@
 #include "gematria/tflite/unsorted_segment_sum_op.h"
 
 #include <algorithm>
+#include <cmath>
 #include <cstdint>
+#include <type_traits>
+#include <vector>
 
+#include "gematria/tflite/float16.h"
 #include "tensorflow/lite/c/c_api_types.h"
 #include "tensorflow/lite/c/common.h"
+#include "tensorflow/lite/kernels/cpu_backend_context.h"
+#include "tensorflow/lite/kernels/cpu_backend_threadpool.h"
 #include "tensorflow/lite/kernels/internal/runtime_shape.h"
 #include "tensorflow/lite/kernels/internal/tensor_ctypes.h"
 #include "tensorflow/lite/kernels/internal/types.h"
 #include "tensorflow/lite/kernels/kernel_util.h"
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 namespace gematria {
 namespace {
 
@@ -36,6 +48,27 @@ constexpr int kNumInputs = 3;
 constexpr int kOutputTensor = 0;
 constexpr int kNumOutputs = 1;
 
+// The indices of the inputs of the fused gather + segment sum op.
+constexpr int kGatherInputParamsTensor = 0;
+constexpr int kGatherInputIndicesTensor = 1;
+constexpr int kGatherInputSegmentIdsTensor = 2;
+constexpr int kGatherInputNumSegmentsTensor = 3;
+constexpr int kGatherNumInputs = 4;
+
+// Resizes `output_tensor` to `output_size`; takes the ownership of
+// `output_size`. Resizing a dynamic tensor reallocates its buffer; we avoid
+// this when the shape does not change between invocations.
+TfLiteStatus ResizeTensorIfChanged(TfLiteContext* context,
+                                   TfLiteTensor* output_tensor,
+                                   TfLiteIntArray* output_size) {
+  if (output_tensor->data.raw != nullptr &&
+      TfLiteIntArrayEqual(output_tensor->dims, output_size)) {
+    TfLiteIntArrayFree(output_size);
+    return kTfLiteOk;
+  }
+  return context->ResizeTensor(context, output_tensor, output_size);
+}
+
 // Resizes the output tensor based on the sizes of the input tensors.
 // Requires that:
 //   - the shape of `segment_ids_tensor` is a prefix of the shape of
@@ -80,7 +113,483 @@ TfLiteStatus ResizeOutputTensor(TfLiteContext* context,
     output_size->data[i] =
         data_tensor->dims->data[num_segment_ids_dimensions + i - 1];
   }
-  return context->ResizeTensor(context, output_tensor, output_size);
+  return ResizeTensorIfChanged(context, output_tensor, output_size);
+}
+
+// Resizes the output tensor of the fused gather + segment sum op. Requires
+// that `indices_tensor` and `segment_ids_tensor` are vectors of the same size,
+// and that the value of `num_segments_tensor` can be read. The output has the
+// shape of `params_tensor`, with the first dimension replaced by the value of
+// `num_segments_tensor`.
+TfLiteStatus ResizeGatherOutputTensor(TfLiteContext* context,
+                                      const TfLiteTensor* params_tensor,
+                                      const TfLiteTensor* indices_tensor,
+                                      const TfLiteTensor* segment_ids_tensor,
+                                      const TfLiteTensor* num_segments_tensor,
+                                      TfLiteTensor* output_tensor) {
+  const int num_segments =
+      tflite::GetTensorData<int32_t>(num_segments_tensor)[0];
+  TF_LITE_ENSURE(context, num_segments > 0);
+
+  const int num_params_dimensions = tflite::NumDimensions(params_tensor);
+  TF_LITE_ENSURE(context, num_params_dimensions > 0);
+  TF_LITE_ENSURE_EQ(context, tflite::NumDimensions(indices_tensor), 1);
+  TF_LITE_ENSURE_EQ(context, tflite::NumDimensions(segment_ids_tensor), 1);
+  TF_LITE_ENSURE_EQ(context, indices_tensor->dims->data[0],
+                    segment_ids_tensor->dims->data[0]);
+
+  TfLiteIntArray* const output_size =
+      TfLiteIntArrayCreate(num_params_dimensions);
+  output_size->data[0] = num_segments;
+  for (int i = 1; i < num_params_dimensions; ++i) {
+    output_size->data[i] = params_tensor->dims->data[i];
+  }
+  return ResizeTensorIfChanged(context, output_tensor, output_size);
+}
+
+// Adds `row_size` elements from `input` to `output`. The rows must not overlap.
+// When `row_size` is a compile-time constant, the loops are fully unrolled.
+inline void AddRow(const float* __restrict input, float* __restrict output,
+                   int row_size) {
+  int i = 0;
+#if defined(__AVX512F__)
+  for (; i + 16 <= row_size; i += 16) {
+    _mm512_storeu_ps(output + i, _mm512_add_ps(_mm512_loadu_ps(output + i),
+                                               _mm512_loadu_ps(input + i)));
+  }
+#endif
+#if defined(__AVX__)
+  for (; i + 8 <= row_size; i += 8) {
+    _mm256_storeu_ps(output + i, _mm256_add_ps(_mm256_loadu_ps(output + i),
+                                               _mm256_loadu_ps(input + i)));
+  }
+#endif
+#if defined(__SSE2__)
+  for (; i + 4 <= row_size; i += 4) {
+    _mm_storeu_ps(output + i, _mm_add_ps(_mm_loadu_ps(output + i),
+                                         _mm_loadu_ps(input + i)));
+  }
+#elif defined(__ARM_NEON)
+  for (; i + 4 <= row_size; i += 4) {
+    vst1q_f32(output + i,
+              vaddq_f32(vld1q_f32(output + i), vld1q_f32(input + i)));
+  }
+#endif
+  for (; i < row_size; ++i) {
+    output[i] += input[i];
+  }
+}
+
+// The inputs of a single invocation of the op. The segment IDs are already
+// validated: they are all in [0, num_segments), and `data` has `num_rows` rows
+// of `row_size` elements.
+struct SegmentSumInputs {
+  const float* data;
+  // When not null, row `i` of the input is row `data_rows[i]` of `data`, and
+  // the values in `data_rows` are already validated. Otherwise, row `i` of the
+  // input is row `i` of `data`.
+  const int32_t* data_rows;
+  const int32_t* segment_ids;
+  int num_rows;
+  int row_size;
+  int num_segments;
+  // True when `segment_ids` is sorted in non-decreasing order.
+  bool sorted_segment_ids;
+};
+
+// Calls `function` with std::integral_constant<int, row_size> when `row_size`
+// is one of the common embedding sizes, where the compiler can unroll the loop
+// over the row, and with std::integral_constant<int, 0> otherwise.
+template <typename Function>
+void DispatchRowSize(int row_size, Function function) {
+  switch (row_size) {
+    case 16:
+      return function(std::integral_constant<int, 16>());
+    case 32:
+      return function(std::integral_constant<int, 32>());
+    case 64:
+      return function(std::integral_constant<int, 64>());
+    case 128:
+      return function(std::integral_constant<int, 128>());
+    case 256:
+      return function(std::integral_constant<int, 256>());
+  }
+  function(std::integral_constant<int, 0>());
+}
+
+// Returns the pointer to input row `row`.
+inline const float* InputRow(const SegmentSumInputs& inputs, int row,
+                             int row_size) {
+  const int data_row =
+      inputs.data_rows == nullptr ? row : inputs.data_rows[row];
+  return inputs.data + data_row * row_size;
+}
+
+// For all rows `i` in [begin_row, end_row) whose segment ID is in
+// [begin_segment, end_segment), adds input row `i` to row
+// `segment_ids[i]` of `output`. `output` has `inputs.num_segments` rows.
+template <int kRowSize>
+void SegmentSumFixedRowSize(const SegmentSumInputs& inputs, int begin_row,
+                            int end_row, int begin_segment, int end_segment,
+                            float* output) {
+  const int row_size = kRowSize > 0 ? kRowSize : inputs.row_size;
+  const bool all_segments =
+      begin_segment == 0 && end_segment == inputs.num_segments;
+  for (int row = begin_row; row < end_row; ++row) {
+    const int segment = inputs.segment_ids[row];
+    if (!all_segments && (segment < begin_segment || segment >= end_segment)) {
+      continue;
+    }
+    AddRow(InputRow(inputs, row, row_size), output + segment * row_size,
+           row_size);
+  }
+}
+
+void SegmentSum(const SegmentSumInputs& inputs, int begin_row, int end_row,
+                int begin_segment, int end_segment, float* output) {
+  DispatchRowSize(inputs.row_size, [&](auto row_size_constant) {
+    SegmentSumFixedRowSize<decltype(row_size_constant)::value>(
+        inputs, begin_row, end_row, begin_segment, end_segment, output);
+  });
+}
+
+// Computes rows [begin_segment, end_segment) of the output when the segment
+// IDs are sorted. The input rows of each segment are contiguous, so the
+// reduction streams through them and writes each output row exactly
+// once: the first row of the segment is copied, the other rows are added to
+// it, and the rows of empty segments are zero-filled. `output` does not need
+// to be zero-filled.
+template <int kRowSize>
+void SortedSegmentSumFixedRowSize(const SegmentSumInputs& inputs,
+                                  int begin_segment, int end_segment,
+                                  float* output) {
+  const int row_size = kRowSize > 0 ? kRowSize : inputs.row_size;
+  const int32_t* const segment_ids_end =
+      inputs.segment_ids + inputs.num_rows;
+  int row = std::lower_bound(inputs.segment_ids, segment_ids_end,
+                             begin_segment) -
+            inputs.segment_ids;
+  for (int segment = begin_segment; segment < end_segment; ++segment) {
+    float* const output_row = output + segment * row_size;
+    if (row == inputs.num_rows || inputs.segment_ids[row] != segment) {
+      std::fill_n(output_row, row_size, 0.0f);
+      continue;
+    }
+    std::copy_n(InputRow(inputs, row, row_size), row_size, output_row);
+    for (++row; row < inputs.num_rows && inputs.segment_ids[row] == segment;
+         ++row) {
+      AddRow(InputRow(inputs, row, row_size), output_row, row_size);
+    }
+  }
+}
+
+void SortedSegmentSum(const SegmentSumInputs& inputs, int begin_segment,
+                      int end_segment, float* output) {
+  DispatchRowSize(inputs.row_size, [&](auto row_size_constant) {
+    SortedSegmentSumFixedRowSize<decltype(row_size_constant)::value>(
+        inputs, begin_segment, end_segment, output);
+  });
+}
+
+// The minimal number of elements of `data` processed by one thread. Smaller
+// inputs are processed by fewer threads, so that the cost of starting the
+// tasks does not outweigh the parallel speedup.
+constexpr int64_t kMinElementsPerThread = 16 * 1024;
+
+// When each thread has its own accumulator, the accumulators are summed at the
+// end; this costs `num_threads * num_segments * row_size` additions in a single
+// thread. This strategy is used only when this is at most 1/kMinRowsPerSegment
+// of the additions in the reduction.
+constexpr int64_t kMinRowsPerSegment = 4;
+
+// A task that computes the output rows for the segments in [begin_segment,
+// end_segment). With unsorted segment IDs, it scans all of them, but adds only
+// the rows of its segments, so that the tasks write to disjoint parts of the
+// output.
+class SegmentRangeTask : public tflite::cpu_backend_threadpool::Task {
+ public:
+  SegmentRangeTask(const SegmentSumInputs& inputs, int begin_segment,
+                   int end_segment, float* output)
+      : inputs_(inputs),
+        begin_segment_(begin_segment),
+        end_segment_(end_segment),
+        output_(output) {}
+
+  void Run() override {
+    if (inputs_.sorted_segment_ids) {
+      SortedSegmentSum(inputs_, begin_segment_, end_segment_, output_);
+      return;
+    }
+    std::fill(output_ + begin_segment_ * inputs_.row_size,
+              output_ + end_segment_ * inputs_.row_size, 0.0f);
+    SegmentSum(inputs_, 0, inputs_.num_rows, begin_segment_, end_segment_,
+               output_);
+  }
+
+ private:
+  SegmentSumInputs inputs_;
+  int begin_segment_;
+  int end_segment_;
+  float* output_;
+};
+
+// A task that sums rows [begin_row, end_row) into its own accumulator, which
+// has the same shape as the output. The accumulator must be zero-filled.
+class RowRangeTask : public tflite::cpu_backend_threadpool::Task {
+ public:
+  RowRangeTask(const SegmentSumInputs& inputs, int begin_row, int end_row,
+               float* accumulator)
+      : inputs_(inputs),
+        begin_row_(begin_row),
+        end_row_(end_row),
+        accumulator_(accumulator) {}
+
+  void Run() override {
+    SegmentSum(inputs_, begin_row_, end_row_, 0, inputs_.num_segments,
+               accumulator_);
+  }
+
+ private:
+  SegmentSumInputs inputs_;
+  int begin_row_;
+  int end_row_;
+  float* accumulator_;
+};
+
+// Computes the sums of the segments into `output`. Uses the threads of
+// `cpu_backend_context` when the input is large enough.
+void ParallelSegmentSum(const SegmentSumInputs& inputs,
+                        tflite::CpuBackendContext* cpu_backend_context,
+                        float* output) {
+  const int64_t num_elements = int64_t{inputs.num_rows} * inputs.row_size;
+  const int num_threads = static_cast<int>(
+      std::min<int64_t>(cpu_backend_context->max_num_threads(),
+                        num_elements / kMinElementsPerThread));
+  const int output_size = inputs.num_segments * inputs.row_size;
+  if (num_threads <= 1) {
+    if (inputs.sorted_segment_ids) {
+      SortedSegmentSum(inputs, 0, inputs.num_segments, output);
+      return;
+    }
+    std::fill_n(output, output_size, 0.0f);
+    SegmentSum(inputs, 0, inputs.num_rows, 0, inputs.num_segments, output);
+    return;
+  }
+
+  if (!inputs.sorted_segment_ids &&
+      int64_t{num_threads} * inputs.num_segments * kMinRowsPerSegment <=
+          inputs.num_rows) {
+    // Few segments with many rows each: the output is small, and each thread
+    // accumulates a contiguous range of rows into its own copy of it. The
+    // first thread uses the output directly.
+    std::fill_n(output, output_size, 0.0f);
+    std::vector<float> accumulators((num_threads - 1) * output_size, 0.0f);
+    std::vector<RowRangeTask> tasks;
+    tasks.reserve(num_threads);
+    for (int i = 0; i < num_threads; ++i) {
+      const int begin_row =
+          static_cast<int64_t>(inputs.num_rows) * i / num_threads;
+      const int end_row =
+          static_cast<int64_t>(inputs.num_rows) * (i + 1) / num_threads;
+      float* const accumulator =
+          i == 0 ? output : accumulators.data() + (i - 1) * output_size;
+      tasks.emplace_back(inputs, begin_row, end_row, accumulator);
+    }
+    tflite::cpu_backend_threadpool::Execute(tasks.size(), tasks.data(),
+                                            cpu_backend_context);
+    for (int i = 1; i < num_threads; ++i) {
+      AddRow(accumulators.data() + (i - 1) * output_size, output, output_size);
+    }
+    return;
+  }
+
+  // Many segments or sorted segment IDs: split the segments into ranges with
+  // roughly the same number of rows, so that each thread writes to its own
+  // part of the output.
+  std::vector<SegmentRangeTask> tasks;
+  tasks.reserve(num_threads);
+  if (inputs.sorted_segment_ids) {
+    // The first segment of each range is the segment of the row at the
+    // corresponding quantile.
+    int begin_segment = 0;
+    for (int i = 1; i < num_threads; ++i) {
+      const int row = static_cast<int64_t>(inputs.num_rows) * i / num_threads;
+      const int end_segment = std::max(begin_segment, inputs.segment_ids[row]);
+      tasks.emplace_back(inputs, begin_segment, end_segment, output);
+      begin_segment = end_segment;
+    }
+    tasks.emplace_back(inputs, begin_segment, inputs.num_segments, output);
+    tflite::cpu_backend_threadpool::Execute(tasks.size(), tasks.data(),
+                                            cpu_backend_context);
+    return;
+  }
+
+  std::vector<int> rows_per_segment(inputs.num_segments, 0);
+  for (int row = 0; row < inputs.num_rows; ++row) {
+    ++rows_per_segment[inputs.segment_ids[row]];
+  }
+  int begin_segment = 0;
+  int64_t num_assigned_rows = 0;
+  for (int segment = 0;
+       segment < inputs.num_segments &&
+       static_cast<int>(tasks.size()) + 1 < num_threads;
+       ++segment) {
+    num_assigned_rows += rows_per_segment[segment];
+    const int64_t target_rows = static_cast<int64_t>(inputs.num_rows) *
+                                (tasks.size() + 1) / num_threads;
+    if (num_assigned_rows >= target_rows) {
+      tasks.emplace_back(inputs, begin_segment, segment + 1, output);
+      begin_segment = segment + 1;
+    }
+  }
+  // The last task takes all the remaining segments.
+  tasks.emplace_back(inputs, begin_segment, inputs.num_segments, output);
+  tflite::cpu_backend_threadpool::Execute(tasks.size(), tasks.data(),
+                                          cpu_backend_context);
+}
+
+// Checks that `tensor` has a data type supported by the ops: float32, float16,
+// or int8 with per-tensor quantization.
+TfLiteStatus CheckDataTensorType(TfLiteContext* context,
+                                 const TfLiteTensor* tensor) {
+  switch (tensor->type) {
+    case kTfLiteFloat32:
+    case kTfLiteFloat16:
+      return kTfLiteOk;
+    case kTfLiteInt8:
+      TF_LITE_ENSURE(context, tensor->params.scale > 0.0f);
+      return kTfLiteOk;
+    default:
+      TF_LITE_KERNEL_LOG(context, "Unsupported data type: %d", tensor->type);
+      return kTfLiteError;
+  }
+}
+
+// Returns the values of `tensor` as floats. The reduction kernels work only on
+// floats; float16 and int8 values are converted to `buffer`, float32 values are
+// used directly.
+const float* GetFloatData(const TfLiteTensor* tensor,
+                          std::vector<float>& buffer) {
+  const int64_t num_values = tflite::NumElements(tensor);
+  switch (tensor->type) {
+    case kTfLiteFloat16: {
+      const auto* const values =
+          tflite::GetTensorData<TfLiteFloat16>(tensor);
+      buffer.resize(num_values);
+      for (int64_t i = 0; i < num_values; ++i) {
+        buffer[i] = HalfToFloat(values[i].data);
+      }
+      return buffer.data();
+    }
+    case kTfLiteInt8: {
+      const auto* const values = tflite::GetTensorData<int8_t>(tensor);
+      const float scale = tensor->params.scale;
+      const int32_t zero_point = tensor->params.zero_point;
+      buffer.resize(num_values);
+      for (int64_t i = 0; i < num_values; ++i) {
+        buffer[i] = scale * (values[i] - zero_point);
+      }
+      return buffer.data();
+    }
+    default:
+      return tflite::GetTensorData<float>(tensor);
+  }
+}
+
+// The state of an instance of the op.
+struct OpData {
+  // The values of a constant float16 or int8 data tensor converted to floats.
+  // The conversion is done once, in `prepare`, and shared by all invocations.
+  std::vector<float> constant_data;
+  bool has_constant_data = false;
+};
+
+void* SegmentSumInit(TfLiteContext* context, const char* buffer,
+                     size_t length) {
+  return new OpData();
+}
+
+void SegmentSumFree(TfLiteContext* context, void* buffer) {
+  delete static_cast<OpData*>(buffer);
+}
+
+// Converts the values of `tensor` to `op_data` when they are constant and they
+// can't be used directly by the reduction kernels.
+void PrepareConstantData(const TfLiteTensor* tensor, OpData* op_data) {
+  op_data->has_constant_data =
+      tensor->type != kTfLiteFloat32 && tflite::IsConstantTensor(tensor);
+  if (op_data->has_constant_data) {
+    GetFloatData(tensor, op_data->constant_data);
+  } else {
+    op_data->constant_data.clear();
+  }
+}
+
+// Returns the values of `tensor` as floats. Uses the values converted in
+// `prepare` when there are any, and converts them to `buffer` otherwise.
+const float* GetFloatData(const OpData& op_data, const TfLiteTensor* tensor,
+                          std::vector<float>& buffer) {
+  if (op_data.has_constant_data) return op_data.constant_data.data();
+  return GetFloatData(tensor, buffer);
+}
+
+// Returns a float buffer for the values of `tensor`. For float32 tensors, this
+// is the data of the tensor; for other types, it is `buffer`, and the values
+// must be copied to the tensor by StoreFloatData().
+float* GetFloatOutputData(TfLiteTensor* tensor, std::vector<float>& buffer) {
+  if (tensor->type == kTfLiteFloat32) {
+    return tflite::GetTensorData<float>(tensor);
+  }
+  buffer.resize(tflite::NumElements(tensor));
+  return buffer.data();
+}
+
+// Converts the values in `buffer` to the type of `tensor` and stores them in
+// the tensor. Int8 values are requantized with the quantization parameters of
+// the tensor.
+void StoreFloatData(const std::vector<float>& buffer, TfLiteTensor* tensor) {
+  switch (tensor->type) {
+    case kTfLiteFloat16: {
+      auto* const values = tflite::GetTensorData<TfLiteFloat16>(tensor);
+      for (size_t i = 0; i < buffer.size(); ++i) {
+        values[i].data = FloatToHalf(buffer[i]);
+      }
+      return;
+    }
+    case kTfLiteInt8: {
+      auto* const values = tflite::GetTensorData<int8_t>(tensor);
+      const float inverse_scale = 1.0f / tensor->params.scale;
+      const int32_t zero_point = tensor->params.zero_point;
+      for (size_t i = 0; i < buffer.size(); ++i) {
+        const float quantized =
+            std::round(buffer[i] * inverse_scale) + zero_point;
+        values[i] = static_cast<int8_t>(std::clamp(quantized, -128.0f, 127.0f));
+      }
+      return;
+    }
+    default:
+      return;
+  }
+}
+
+// Checks that all values in `segment_ids` are in [0, num_segments), and sets
+// `sorted` to true when they are sorted in non-decreasing order. The inputs are
+// validated once up front, so that the reduction loop has no checks.
+TfLiteStatus ValidateSegmentIds(TfLiteContext* context,
+                                const int32_t* segment_ids, int num_rows,
+                                int num_segments, bool* sorted) {
+  *sorted = true;
+  int previous_segment = 0;
+  for (int segment_index = 0; segment_index < num_rows; ++segment_index) {
+    const int segment = segment_ids[segment_index];
+    TF_LITE_ENSURE(context, segment >= 0);
+    // NOTE(ondrasej): This should also catch the case where the `num_segments`
+    // input is smaller than the largest segment ID in `segment_ids`.
+    TF_LITE_ENSURE(context, segment < num_segments);
+    *sorted &= segment >= previous_segment;
+    previous_segment = segment;
+  }
+  return kTfLiteOk;
 }
 
 TfLiteStatus UnsortedSegmentSumPrepare(TfLiteContext* context,
@@ -101,9 +610,9 @@ TfLiteStatus UnsortedSegmentSumPrepare(TfLiteContext* context,
                     tflite::GetInputSafe(context, node, kInputNumSegmentsTensor,
                                          &num_segments_tensor));
 
-  // TODO(ondrasej): Consider supporting additional data types.
-  TF_LITE_ENSURE_EQ(context, data_tensor->type, kTfLiteFloat32);
+  TF_LITE_ENSURE_OK(context, CheckDataTensorType(context, data_tensor));
   TF_LITE_ENSURE_EQ(context, segment_ids_tensor->type, kTfLiteInt32);
+  PrepareConstantData(data_tensor, static_cast<OpData*>(node->user_data));
 
   const int num_data_dimensions = tflite::NumDimensions(data_tensor);
   const int num_segment_ids_dimensions =
@@ -117,13 +626,16 @@ TfLiteStatus UnsortedSegmentSumPrepare(TfLiteContext* context,
   TfLiteTensor* output_tensor = nullptr;
   TF_LITE_ENSURE_OK(context, tflite::GetOutputSafe(context, node, kOutputTensor,
                                                    &output_tensor));
-  TF_LITE_ENSURE_EQ(context, output_tensor->type, kTfLiteFloat32);
+  // The sum is computed in float32 and converted to the type of the output.
+  // Int8 outputs may use different quantization parameters than the data.
+  TF_LITE_ENSURE_TYPES_EQ(context, output_tensor->type, data_tensor->type);
+  TF_LITE_ENSURE_OK(context, CheckDataTensorType(context, output_tensor));
 
-  // TODO(ondrasej): This condition is safe, but perhaps we could find a weaker
-  // condition for allocating the output during the `prepare` phase.
-  if (!tflite::IsConstantTensor(num_segments_tensor) ||
-      !tflite::IsConstantTensor(data_tensor) ||
-      !tflite::IsConstantTensor(segment_ids_tensor)) {
+  // The shape of the output depends only on the shapes of the data and the
+  // segment IDs, which are known during `prepare`, and on the value of
+  // `num_segments`. When it is known already, the output is allocated with the
+  // other tensors instead of being reallocated in each invocation.
+  if (!tflite::IsConstantOrPersistentTensor(num_segments_tensor)) {
     tflite::SetTensorToDynamic(output_tensor);
     return kTfLiteOk;
   }
@@ -161,7 +673,10 @@ TfLiteStatus UnsortedSegmentSumInvoke(TfLiteContext* context,
   }
   const tflite::RuntimeShape data_shape = tflite::GetTensorShape(data_tensor);
   const int data_flat_size = data_shape.FlatSize();
-  const auto* const data = tflite::GetTensorData<float>(data_tensor);
+  std::vector<float> float_data;
+  const float* const data =
+      GetFloatData(*static_cast<const OpData*>(node->user_data), data_tensor,
+                   float_data);
 
   const tflite::RuntimeShape index_shape =
       tflite::GetTensorShape(segment_ids_tensor);
@@ -171,28 +686,155 @@ TfLiteStatus UnsortedSegmentSumInvoke(TfLiteContext* context,
 
   const tflite::RuntimeShape output_shape =
       tflite::GetTensorShape(output_tensor);
-  const int output_flat_size = output_shape.FlatSize();
+  const int num_output_rows = output_shape.Dims(0);
 
-  auto* const output_data = tflite::GetTensorData<float>(output_tensor);
+  std::vector<float> float_output;
+  float* const output_data = GetFloatOutputData(output_tensor, float_output);
   // The size of a single "row" in the output tensor. We use this to compute the
   // address of the segment in the output vector.
   const int row_size = tflite::FlatSizeSkipDim(output_shape, 0);
-  std::fill(output_data, output_data + output_shape.FlatSize(), 0.0f);
-
-  for (int segment_index = 0; segment_index < index_flat_size;
-       ++segment_index) {
-    const int segment = index_data[segment_index];
-    const int input_row_start = segment_index * row_size;
-    const int output_row_start = segment * row_size;
-    TF_LITE_ENSURE(context, input_row_start + row_size <= data_flat_size);
-    TF_LITE_ENSURE(context, output_row_start >= 0);
-    // NOTE(ondrasej): This should also catch the case where the `num_segments`
-    // input is smaller than the largest segment ID in `segment_ids`.
-    TF_LITE_ENSURE(context, output_row_start + row_size <= output_flat_size);
-    for (int i = 0; i < row_size; ++i) {
-      output_data[output_row_start + i] += data[input_row_start + i];
-    }
+
+  // This also detects whether the segment IDs are sorted, which is common in
+  // the graphs used by Gematria.
+  TF_LITE_ENSURE(context,
+                 int64_t{index_flat_size} * row_size <= data_flat_size);
+  bool sorted_segment_ids = false;
+  TF_LITE_ENSURE_OK(context,
+                    ValidateSegmentIds(context, index_data, index_flat_size,
+                                       num_output_rows, &sorted_segment_ids));
+
+  const SegmentSumInputs inputs = {.data = data,
+                                   .data_rows = nullptr,
+                                   .segment_ids = index_data,
+                                   .num_rows = index_flat_size,
+                                   .row_size = row_size,
+                                   .num_segments = num_output_rows,
+                                   .sorted_segment_ids = sorted_segment_ids};
+  ParallelSegmentSum(inputs, tflite::CpuBackendContext::GetFromContext(context),
+                     output_data);
+  StoreFloatData(float_output, output_tensor);
+
+  return kTfLiteOk;
+}
+
+TfLiteStatus GatherUnsortedSegmentSumPrepare(TfLiteContext* context,
+                                             TfLiteNode* node) {
+  TF_LITE_ENSURE_EQ(context, tflite::NumInputs(node), kGatherNumInputs);
+  TF_LITE_ENSURE_EQ(context, tflite::NumOutputs(node), kNumOutputs);
+
+  const TfLiteTensor* params_tensor = nullptr;
+  TF_LITE_ENSURE_OK(context,
+                    tflite::GetInputSafe(context, node,
+                                         kGatherInputParamsTensor,
+                                         &params_tensor));
+  const TfLiteTensor* indices_tensor = nullptr;
+  TF_LITE_ENSURE_OK(context,
+                    tflite::GetInputSafe(context, node,
+                                         kGatherInputIndicesTensor,
+                                         &indices_tensor));
+  const TfLiteTensor* segment_ids_tensor = nullptr;
+  TF_LITE_ENSURE_OK(context,
+                    tflite::GetInputSafe(context, node,
+                                         kGatherInputSegmentIdsTensor,
+                                         &segment_ids_tensor));
+  const TfLiteTensor* num_segments_tensor = nullptr;
+  TF_LITE_ENSURE_OK(context,
+                    tflite::GetInputSafe(context, node,
+                                         kGatherInputNumSegmentsTensor,
+                                         &num_segments_tensor));
+
+  TF_LITE_ENSURE_OK(context, CheckDataTensorType(context, params_tensor));
+  TF_LITE_ENSURE_EQ(context, indices_tensor->type, kTfLiteInt32);
+  PrepareConstantData(params_tensor, static_cast<OpData*>(node->user_data));
+  TF_LITE_ENSURE_EQ(context, segment_ids_tensor->type, kTfLiteInt32);
+  TF_LITE_ENSURE_EQ(context, num_segments_tensor->type, kTfLiteInt32);
+  TF_LITE_ENSURE_EQ(context, tflite::NumDimensions(num_segments_tensor), 0);
+  TF_LITE_ENSURE_EQ(context, num_segments_tensor->bytes, sizeof(int32_t));
+
+  TfLiteTensor* output_tensor = nullptr;
+  TF_LITE_ENSURE_OK(context, tflite::GetOutputSafe(context, node, kOutputTensor,
+                                                   &output_tensor));
+  TF_LITE_ENSURE_TYPES_EQ(context, output_tensor->type, params_tensor->type);
+  TF_LITE_ENSURE_OK(context, CheckDataTensorType(context, output_tensor));
+
+  if (!tflite::IsConstantOrPersistentTensor(num_segments_tensor)) {
+    tflite::SetTensorToDynamic(output_tensor);
+    return kTfLiteOk;
   }
+  return ResizeGatherOutputTensor(context, params_tensor, indices_tensor,
+                                  segment_ids_tensor, num_segments_tensor,
+                                  output_tensor);
+}
+
+TfLiteStatus GatherUnsortedSegmentSumInvoke(TfLiteContext* context,
+                                            TfLiteNode* node) {
+  const TfLiteTensor* params_tensor = nullptr;
+  TF_LITE_ENSURE_OK(context,
+                    tflite::GetInputSafe(context, node,
+                                         kGatherInputParamsTensor,
+                                         &params_tensor));
+  const TfLiteTensor* indices_tensor = nullptr;
+  TF_LITE_ENSURE_OK(context,
+                    tflite::GetInputSafe(context, node,
+                                         kGatherInputIndicesTensor,
+                                         &indices_tensor));
+  const TfLiteTensor* segment_ids_tensor = nullptr;
+  TF_LITE_ENSURE_OK(context,
+                    tflite::GetInputSafe(context, node,
+                                         kGatherInputSegmentIdsTensor,
+                                         &segment_ids_tensor));
+  const TfLiteTensor* num_segments_tensor = nullptr;
+  TF_LITE_ENSURE_OK(context,
+                    tflite::GetInputSafe(context, node,
+                                         kGatherInputNumSegmentsTensor,
+                                         &num_segments_tensor));
+  TfLiteTensor* output_tensor = nullptr;
+  TF_LITE_ENSURE_OK(context, tflite::GetOutputSafe(context, node, kOutputTensor,
+                                                   &output_tensor));
+
+  if (tflite::IsDynamicTensor(output_tensor)) {
+    TF_LITE_ENSURE_OK(context, ResizeGatherOutputTensor(
+                                   context, params_tensor, indices_tensor,
+                                   segment_ids_tensor, num_segments_tensor,
+                                   output_tensor));
+  }
+
+  const int num_params_rows = params_tensor->dims->data[0];
+  const int num_rows = indices_tensor->dims->data[0];
+  const auto* const indices = tflite::GetTensorData<int32_t>(indices_tensor);
+  const auto* const segment_ids =
+      tflite::GetTensorData<int32_t>(segment_ids_tensor);
+  const tflite::RuntimeShape output_shape =
+      tflite::GetTensorShape(output_tensor);
+  const int num_output_rows = output_shape.Dims(0);
+  const int row_size = tflite::FlatSizeSkipDim(output_shape, 0);
+
+  for (int row = 0; row < num_rows; ++row) {
+    TF_LITE_ENSURE(context, indices[row] >= 0);
+    TF_LITE_ENSURE(context, indices[row] < num_params_rows);
+  }
+  bool sorted_segment_ids = false;
+  TF_LITE_ENSURE_OK(context,
+                    ValidateSegmentIds(context, segment_ids, num_rows,
+                                       num_output_rows, &sorted_segment_ids));
+
+  // The rows of `params` are read directly by the reduction; the gathered
+  // rows are never materialized. Constant float16 and int8 tables are
+  // converted only once, in `prepare`.
+  std::vector<float> float_params;
+  std::vector<float> float_output;
+  const SegmentSumInputs inputs = {
+      .data = GetFloatData(*static_cast<const OpData*>(node->user_data),
+                           params_tensor, float_params),
+      .data_rows = indices,
+      .segment_ids = segment_ids,
+      .num_rows = num_rows,
+      .row_size = row_size,
+      .num_segments = num_output_rows,
+      .sorted_segment_ids = sorted_segment_ids};
+  ParallelSegmentSum(inputs, tflite::CpuBackendContext::GetFromContext(context),
+                     GetFloatOutputData(output_tensor, float_output));
+  StoreFloatData(float_output, output_tensor);
 
   return kTfLiteOk;
 }
@@ -200,15 +842,26 @@ TfLiteStatus UnsortedSegmentSumInvoke(TfLiteContext* context,
 }  // namespace
 
 const char* kUnsortedSegmentSumOpName = "UnsortedSegmentSum";
+const char* kGatherUnsortedSegmentSumOpName = "GatherUnsortedSegmentSum";
 
 TfLiteRegistration* RegisterUnsortedSegmentSumOp() {
   static TfLiteRegistration registration = {
-      .init = nullptr,
-      .free = nullptr,
+      .init = SegmentSumInit,
+      .free = SegmentSumFree,
       .prepare = UnsortedSegmentSumPrepare,
       .invoke = UnsortedSegmentSumInvoke,
   };
   return &registration;
 }
 
+TfLiteRegistration* RegisterGatherUnsortedSegmentSumOp() {
+  static TfLiteRegistration registration = {
+      .init = SegmentSumInit,
+      .free = SegmentSumFree,
+      .prepare = GatherUnsortedSegmentSumPrepare,
+      .invoke = GatherUnsortedSegmentSumInvoke,
+  };
+  return &registration;
+}
+
 }  // namespace gematria
@@ -14,7 +14,20 @@
 
 // Implements `tf.UnsortedSegmentSum` as a custom TensorFlow Lite op. This
 // op supports the same shapes of inputs and outputs as the original TensorFlow
-// op, but it supports only float32 as data type, and int32 as index type.
+// op, but it supports only float32, float16, and int8 as data types, and int32
+// as index type. The output must have the same data type as the data; int8
+// tensors must use per-tensor quantization, and the output may use different
+// quantization parameters than the data. The sums are always computed in
+// float32.
+//
+// Also implements a fused `GatherUnsortedSegmentSum` op that computes
+// `tf.math.unsorted_segment_sum(tf.gather(params, indices), segment_ids,
+// num_segments)` without materializing the gathered rows. This is the
+// aggregation of messages in graph networks, where the gathered tensor has a
+// row for each edge of the graph. The op has four inputs, `params`, `indices`,
+// `segment_ids`, and `num_segments`; `indices` and `segment_ids` must be
+// vectors of the same size. The models use this op only after they are
+// rewritten by gematria/granite/python/fuse_tflite_gather_segment_sum.py.
 
 #ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_TFLITE_UNSORTED_SEGMENT_SUM_OP_H_
 #define THIRD_PARTY_GEMATRIA_GEMATRIA_TFLITE_UNSORTED_SEGMENT_SUM_OP_H_
@@ -30,6 +43,13 @@ extern const char* kUnsortedSegmentSumOpName;
 // Creates a registration structure for the unsorted segment sum op.
 TfLiteRegistration* RegisterUnsortedSegmentSumOp();
 
+// The name of the fused gather + unsorted segment sum op.
+extern const char* kGatherUnsortedSegmentSumOpName;
+
+// Creates a registration structure for the fused gather + unsorted segment sum
+// op.
+TfLiteRegistration* RegisterGatherUnsortedSegmentSumOp();
+
 }  // namespace gematria
 
 #endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_TFLITE_UNSORTED_SEGMENT_SUM_OP_H_
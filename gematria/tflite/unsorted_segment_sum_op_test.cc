@@ -28,13 +28,28 @@ namespace gematria {
 namespace {
 
 using ::testing::ElementsAre;
+using ::testing::ElementsAreArray;
+
+// Creates float16 values from their IEEE half-precision bit patterns.
+std::vector<TfLiteFloat16> HalfsFromBits(const std::vector<uint16_t>& bits) {
+  std::vector<TfLiteFloat16> halfs(bits.size());
+  for (size_t i = 0; i < bits.size(); ++i) halfs[i].data = bits[i];
+  return halfs;
+}
+
+std::vector<uint16_t> BitsFromHalfs(const std::vector<TfLiteFloat16>& halfs) {
+  std::vector<uint16_t> bits(halfs.size());
+  for (size_t i = 0; i < halfs.size(); ++i) bits[i] = halfs[i].data;
+  return bits;
+}
 
 class UnsortedSegmentSumOpModel : public tflite::SingleOpModel {
  public:
   UnsortedSegmentSumOpModel(const tflite::TensorData& data,
                             const tflite::TensorData& segment_ids,
                             const tflite::TensorData& num_segments,
-                            const tflite::TensorData& output) {
+                            const tflite::TensorData& output,
+                            int num_threads = 1) {
     data_id_ = AddInput(data);
     segment_ids_id_ = AddInput(segment_ids);
     num_segments_id_ = AddInput(num_segments);
@@ -42,7 +57,9 @@ class UnsortedSegmentSumOpModel : public tflite::SingleOpModel {
     SetCustomOp(tflite::string(kUnsortedSegmentSumOpName), {},
                 RegisterUnsortedSegmentSumOp);
     BuildInterpreter({GetShape(data_id_), GetShape(segment_ids_id_),
-                      GetShape(num_segments_id_)});
+                      GetShape(num_segments_id_)},
+                     num_threads, /* allow_fp32_relax_to_fp16 = */ false,
+                     /* apply_delegate = */ true);
   }
 
   int data() const { return data_id_; }
@@ -50,6 +67,13 @@ class UnsortedSegmentSumOpModel : public tflite::SingleOpModel {
   int num_segments() const { return num_segments_id_; }
 
   std::vector<float> GetOutput() { return ExtractVector<float>(output_id_); }
+  std::vector<TfLiteFloat16> GetHalfOutput() {
+    return ExtractVector<TfLiteFloat16>(output_id_);
+  }
+  std::vector<float> GetDequantizedOutput() {
+    return Dequantize<int8_t>(ExtractVector<int8_t>(output_id_),
+                              GetScale(output_id_), GetZeroPoint(output_id_));
+  }
   std::vector<int32_t> GetOutputShape() { return GetTensorShape(output_id_); }
 
  protected:
@@ -59,6 +83,54 @@ class UnsortedSegmentSumOpModel : public tflite::SingleOpModel {
   int output_id_;
 };
 
+class GatherUnsortedSegmentSumOpModel : public tflite::SingleOpModel {
+ public:
+  GatherUnsortedSegmentSumOpModel(const tflite::TensorData& params,
+                                  const tflite::TensorData& indices,
+                                  const tflite::TensorData& segment_ids,
+                                  const tflite::TensorData& num_segments,
+                                  const tflite::TensorData& output,
+                                  const std::vector<TfLiteFloat16>&
+                                      constant_params = {}) {
+    params_id_ = constant_params.empty()
+                     ? AddInput(params)
+                     : AddConstInput(params, constant_params);
+    indices_id_ = AddInput(indices);
+    segment_ids_id_ = AddInput(segment_ids);
+    num_segments_id_ = AddInput(num_segments);
+    output_id_ = AddOutput(output);
+    SetCustomOp(tflite::string(kGatherUnsortedSegmentSumOpName), {},
+                RegisterGatherUnsortedSegmentSumOp);
+    // Constant params already have their shape and must not be resized.
+    BuildInterpreter({constant_params.empty() ? GetShape(params_id_)
+                                              : std::vector<int>(),
+                      GetShape(indices_id_), GetShape(segment_ids_id_),
+                      GetShape(num_segments_id_)});
+  }
+
+  int params() const { return params_id_; }
+  int indices() const { return indices_id_; }
+  int segment_ids() const { return segment_ids_id_; }
+  int num_segments() const { return num_segments_id_; }
+
+  std::vector<float> GetOutput() { return ExtractVector<float>(output_id_); }
+  std::vector<TfLiteFloat16> GetHalfOutput() {
+    return ExtractVector<TfLiteFloat16>(output_id_);
+  }
+  std::vector<float> GetDequantizedOutput() {
+    return Dequantize<int8_t>(ExtractVector<int8_t>(output_id_),
+                              GetScale(output_id_), GetZeroPoint(output_id_));
+  }
+  std::vector<int32_t> GetOutputShape() { return GetTensorShape(output_id_); }
+
+ protected:
+  int params_id_;
+  int indices_id_;
+  int segment_ids_id_;
+  int num_segments_id_;
+  int output_id_;
+};
+
 TEST(UnsortedSegmentSumOpModelTest, Trivial1DMatrix) {
   UnsortedSegmentSumOpModel model(
       /* data = */ {tflite::TensorType_FLOAT32, {6}},
@@ -132,6 +204,158 @@ TEST(UnsortedSegmentSumOpModelTest, With2DSegmentIdMatrix) {
   EXPECT_THAT(model.GetOutputShape(), ElementsAre(4));
 }
 
+TEST(UnsortedSegmentSumOpModelTest, DifferentRowSizes) {
+  // Covers the specialized kernels for the common embedding sizes as well as
+  // the generic kernel with and without a remainder after the vector loop.
+  for (const int row_size : {1, 3, 16, 19, 32, 64, 100, 128, 256}) {
+    SCOPED_TRACE(row_size);
+    constexpr int kNumRows = 5;
+    constexpr int kNumSegments = 3;
+    const std::vector<int32_t> segment_ids = {2, 0, 2, 1, 2};
+    UnsortedSegmentSumOpModel model(
+        /* data = */ {tflite::TensorType_FLOAT32, {kNumRows, row_size}},
+        /* segment_ids = */ {tflite::TensorType_INT32, {kNumRows}},
+        /* num_segments = */ {tflite::TensorType_INT32, {}},
+        /* output = */ {tflite::TensorType_FLOAT32, {kNumSegments, row_size}});
+    std::vector<float> data(kNumRows * row_size);
+    std::vector<float> expected_output(kNumSegments * row_size, 0.0f);
+    for (int row = 0; row < kNumRows; ++row) {
+      for (int i = 0; i < row_size; ++i) {
+        data[row * row_size + i] = row * 1000 + i;
+        expected_output[segment_ids[row] * row_size + i] += row * 1000 + i;
+      }
+    }
+    model.PopulateTensor<float>(model.data(), data);
+    model.PopulateTensor<int32_t>(model.segment_ids(), segment_ids);
+    model.PopulateTensor<int32_t>(model.num_segments(), {kNumSegments});
+    ASSERT_EQ(model.Invoke(), kTfLiteOk);
+
+    EXPECT_THAT(model.GetOutput(), ElementsAreArray(expected_output));
+    EXPECT_THAT(model.GetOutputShape(), ElementsAre(kNumSegments, row_size));
+  }
+}
+
+TEST(UnsortedSegmentSumOpModelTest, MultipleThreads) {
+  // Covers both parallel strategies: few segments with many rows each use
+  // per-thread accumulators, many segments are split between the threads.
+  constexpr int kNumRows = 2000;
+  constexpr int kRowSize = 32;
+  for (const int num_segments : {3, 1500}) {
+    SCOPED_TRACE(num_segments);
+    UnsortedSegmentSumOpModel model(
+        /* data = */ {tflite::TensorType_FLOAT32, {kNumRows, kRowSize}},
+        /* segment_ids = */ {tflite::TensorType_INT32, {kNumRows}},
+        /* num_segments = */ {tflite::TensorType_INT32, {}},
+        /* output = */ {tflite::TensorType_FLOAT32, {num_segments, kRowSize}},
+        /* num_threads = */ 4);
+    std::vector<float> data(kNumRows * kRowSize);
+    std::vector<int32_t> segment_ids(kNumRows);
+    std::vector<float> expected_output(num_segments * kRowSize, 0.0f);
+    for (int row = 0; row < kNumRows; ++row) {
+      segment_ids[row] = (row * 7) % num_segments;
+      for (int i = 0; i < kRowSize; ++i) {
+        data[row * kRowSize + i] = row % 5 + i;
+        expected_output[segment_ids[row] * kRowSize + i] += row % 5 + i;
+      }
+    }
+    model.PopulateTensor<float>(model.data(), data);
+    model.PopulateTensor<int32_t>(model.segment_ids(), segment_ids);
+    model.PopulateTensor<int32_t>(model.num_segments(), {num_segments});
+    ASSERT_EQ(model.Invoke(), kTfLiteOk);
+
+    EXPECT_THAT(model.GetOutput(), ElementsAreArray(expected_output));
+  }
+}
+
+TEST(UnsortedSegmentSumOpModelTest, SortedSegmentIds) {
+  UnsortedSegmentSumOpModel model(
+      /* data = */ {tflite::TensorType_FLOAT32, {5, 2}},
+      /* segment_ids = */ {tflite::TensorType_INT32, {5}},
+      /* num_segments = */ {tflite::TensorType_INT32, {}},
+      /* output = */ {tflite::TensorType_FLOAT32, {5, 2}});
+  model.PopulateTensor<float>(model.data(), {1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f,
+                                             7.0f, 8.0f, 9.0f, 10.0f});
+  model.PopulateTensor<int32_t>(model.segment_ids(), {1, 1, 3, 3, 3});
+  model.PopulateTensor<int32_t>(model.num_segments(), {5});
+  ASSERT_EQ(model.Invoke(), kTfLiteOk);
+
+  // The empty segments before, between, and after the used segments are zero.
+  EXPECT_THAT(model.GetOutput(), ElementsAre(0.0f, 0.0f, 4.0f, 6.0f, 0.0f, 0.0f,
+                                             21.0f, 24.0f, 0.0f, 0.0f));
+  EXPECT_THAT(model.GetOutputShape(), ElementsAre(5, 2));
+}
+
+TEST(UnsortedSegmentSumOpModelTest, SortedSegmentIdsMultipleThreads) {
+  constexpr int kNumRows = 2000;
+  constexpr int kRowSize = 32;
+  constexpr int kNumSegments = 300;
+  UnsortedSegmentSumOpModel model(
+      /* data = */ {tflite::TensorType_FLOAT32, {kNumRows, kRowSize}},
+      /* segment_ids = */ {tflite::TensorType_INT32, {kNumRows}},
+      /* num_segments = */ {tflite::TensorType_INT32, {}},
+      /* output = */ {tflite::TensorType_FLOAT32, {kNumSegments, kRowSize}},
+      /* num_threads = */ 4);
+  std::vector<float> data(kNumRows * kRowSize);
+  std::vector<int32_t> segment_ids(kNumRows);
+  std::vector<float> expected_output(kNumSegments * kRowSize, 0.0f);
+  for (int row = 0; row < kNumRows; ++row) {
+    // Only every other segment is used.
+    segment_ids[row] = 2 * (row * (kNumSegments / 2) / kNumRows);
+    for (int i = 0; i < kRowSize; ++i) {
+      data[row * kRowSize + i] = row % 5 + i;
+      expected_output[segment_ids[row] * kRowSize + i] += row % 5 + i;
+    }
+  }
+  model.PopulateTensor<float>(model.data(), data);
+  model.PopulateTensor<int32_t>(model.segment_ids(), segment_ids);
+  model.PopulateTensor<int32_t>(model.num_segments(), {kNumSegments});
+  ASSERT_EQ(model.Invoke(), kTfLiteOk);
+
+  EXPECT_THAT(model.GetOutput(), ElementsAreArray(expected_output));
+}
+
+TEST(UnsortedSegmentSumOpModelTest, Int8Data) {
+  // The output uses a different quantization range than the data; the sums are
+  // requantized to it.
+  UnsortedSegmentSumOpModel model(
+      /* data = */ {tflite::TensorType_INT8, {3, 2}, -8.0f, 8.0f},
+      /* segment_ids = */ {tflite::TensorType_INT32, {3}},
+      /* num_segments = */ {tflite::TensorType_INT32, {}},
+      /* output = */ {tflite::TensorType_INT8, {3, 2}, -16.0f, 16.0f});
+  model.QuantizeAndPopulate<int8_t>(model.data(),
+                                    {1.0f, -2.0f, 3.0f, 4.0f, 5.0f, 6.0f});
+  model.PopulateTensor<int32_t>(model.segment_ids(), {0, 2, 2});
+  model.PopulateTensor<int32_t>(model.num_segments(), {3});
+  ASSERT_EQ(model.Invoke(), kTfLiteOk);
+
+  // The tolerance covers the quantization error of two data values and of the
+  // output value.
+  EXPECT_THAT(model.GetDequantizedOutput(),
+              ElementsAreArray(tflite::ArrayFloatNear(
+                  {1.0f, -2.0f, 0.0f, 0.0f, 8.0f, 10.0f}, 0.15f)));
+  EXPECT_THAT(model.GetOutputShape(), ElementsAre(3, 2));
+}
+
+TEST(UnsortedSegmentSumOpModelTest, Float16Data) {
+  UnsortedSegmentSumOpModel model(
+      /* data = */ {tflite::TensorType_FLOAT16, {3, 2}},
+      /* segment_ids = */ {tflite::TensorType_INT32, {3}},
+      /* num_segments = */ {tflite::TensorType_INT32, {}},
+      /* output = */ {tflite::TensorType_FLOAT16, {3, 2}});
+  // 1.0, 2.0, 3.0, 4.0, 5.0, 6.0.
+  model.PopulateTensor<TfLiteFloat16>(
+      model.data(),
+      HalfsFromBits({0x3c00, 0x4000, 0x4200, 0x4400, 0x4500, 0x4600}));
+  model.PopulateTensor<int32_t>(model.segment_ids(), {0, 2, 2});
+  model.PopulateTensor<int32_t>(model.num_segments(), {3});
+  ASSERT_EQ(model.Invoke(), kTfLiteOk);
+
+  // 1.0, 2.0, 0.0, 0.0, 8.0, 10.0.
+  EXPECT_THAT(BitsFromHalfs(model.GetHalfOutput()),
+              ElementsAre(0x3c00, 0x4000, 0x0000, 0x0000, 0x4800, 0x4900));
+  EXPECT_THAT(model.GetOutputShape(), ElementsAre(3, 2));
+}
+
 TEST(UnsortedSegmentSumOpModelTest, NotMatchingShapes) {
   // The shape of the segment IDs tensor does not match the shape of the data
   // tensor (they have a different size in the first dimension).
@@ -173,5 +397,104 @@ TEST(UnsortedSegmentSumOpModelTest, NegativeSegmentId) {
   EXPECT_EQ(model.Invoke(), kTfLiteError);
 }
 
+TEST(GatherUnsortedSegmentSumOpModelTest, Normal2DMatrix) {
+  GatherUnsortedSegmentSumOpModel model(
+      /* params = */ {tflite::TensorType_FLOAT32, {3, 2}},
+      /* indices = */ {tflite::TensorType_INT32, {4}},
+      /* segment_ids = */ {tflite::TensorType_INT32, {4}},
+      /* num_segments = */ {tflite::TensorType_INT32, {}},
+      /* output = */ {tflite::TensorType_FLOAT32, {4, 2}});
+  model.PopulateTensor<float>(model.params(),
+                              {4.0f, 5.0f, 6.0f, 7.0f, 8.0f, 9.0f});
+  model.PopulateTensor<int32_t>(model.indices(), {2, 0, 2, 1});
+  model.PopulateTensor<int32_t>(model.segment_ids(), {0, 0, 3, 1});
+  model.PopulateTensor<int32_t>(model.num_segments(), {4});
+  ASSERT_EQ(model.Invoke(), kTfLiteOk);
+
+  // Same as unsorted_segment_sum(gather(params, indices), segment_ids, 4).
+  EXPECT_THAT(model.GetOutput(),
+              ElementsAre(12.0f, 14.0f, 6.0f, 7.0f, 0.0f, 0.0f, 8.0f, 9.0f));
+  EXPECT_THAT(model.GetOutputShape(), ElementsAre(4, 2));
+}
+
+TEST(GatherUnsortedSegmentSumOpModelTest, Int8Params) {
+  GatherUnsortedSegmentSumOpModel model(
+      /* params = */ {tflite::TensorType_INT8, {3, 2}, -8.0f, 8.0f},
+      /* indices = */ {tflite::TensorType_INT32, {4}},
+      /* segment_ids = */ {tflite::TensorType_INT32, {4}},
+      /* num_segments = */ {tflite::TensorType_INT32, {}},
+      /* output = */ {tflite::TensorType_INT8, {4, 2}, -16.0f, 16.0f});
+  model.QuantizeAndPopulate<int8_t>(model.params(),
+                                    {4.0f, 5.0f, 6.0f, 7.0f, -1.0f, -2.0f});
+  model.PopulateTensor<int32_t>(model.indices(), {2, 0, 2, 1});
+  model.PopulateTensor<int32_t>(model.segment_ids(), {0, 0, 3, 1});
+  model.PopulateTensor<int32_t>(model.num_segments(), {4});
+  ASSERT_EQ(model.Invoke(), kTfLiteOk);
+
+  EXPECT_THAT(model.GetDequantizedOutput(),
+              ElementsAreArray(tflite::ArrayFloatNear(
+                  {3.0f, 3.0f, 6.0f, 7.0f, 0.0f, 0.0f, -1.0f, -2.0f}, 0.15f)));
+}
+
+TEST(GatherUnsortedSegmentSumOpModelTest, ConstantFloat16Params) {
+  // 4.0, 5.0, 6.0, 7.0, -1.0, -2.0.
+  GatherUnsortedSegmentSumOpModel model(
+      /* params = */ {tflite::TensorType_FLOAT16, {3, 2}},
+      /* indices = */ {tflite::TensorType_INT32, {4}},
+      /* segment_ids = */ {tflite::TensorType_INT32, {4}},
+      /* num_segments = */ {tflite::TensorType_INT32, {}},
+      /* output = */ {tflite::TensorType_FLOAT16, {4, 2}},
+      /* constant_params = */
+      HalfsFromBits({0x4400, 0x4500, 0x4600, 0x4700, 0xbc00, 0xc000}));
+  model.PopulateTensor<int32_t>(model.indices(), {2, 0, 2, 1});
+  model.PopulateTensor<int32_t>(model.segment_ids(), {0, 0, 3, 1});
+  model.PopulateTensor<int32_t>(model.num_segments(), {4});
+  ASSERT_EQ(model.Invoke(), kTfLiteOk);
+
+  // 3.0, 3.0, 6.0, 7.0, 0.0, 0.0, -1.0, -2.0.
+  EXPECT_THAT(BitsFromHalfs(model.GetHalfOutput()),
+              ElementsAre(0x4200, 0x4200, 0x4600, 0x4700, 0x0000, 0x0000,
+                          0xbc00, 0xc000));
+
+  // The values converted in `prepare` are reused by the next invocation.
+  model.PopulateTensor<int32_t>(model.indices(), {1, 1, 0, 0});
+  ASSERT_EQ(model.Invoke(), kTfLiteOk);
+
+  // 12.0, 14.0, 0.0, 0.0, 0.0, 0.0, 4.0, 5.0.
+  EXPECT_THAT(BitsFromHalfs(model.GetHalfOutput()),
+              ElementsAre(0x4a00, 0x4b00, 0x0000, 0x0000, 0x0000, 0x0000,
+                          0x4400, 0x4500));
+}
+
+TEST(GatherUnsortedSegmentSumOpModelTest, IndexOverflow) {
+  GatherUnsortedSegmentSumOpModel model(
+      /* params = */ {tflite::TensorType_FLOAT32, {3}},
+      /* indices = */ {tflite::TensorType_INT32, {2}},
+      /* segment_ids = */ {tflite::TensorType_INT32, {2}},
+      /* num_segments = */ {tflite::TensorType_INT32, {}},
+      /* output = */ {tflite::TensorType_FLOAT32, {2}});
+  model.PopulateTensor<float>(model.params(), {4.0f, 5.0f, 6.0f});
+  model.PopulateTensor<int32_t>(model.indices(), {0, 3});
+  model.PopulateTensor<int32_t>(model.segment_ids(), {0, 1});
+  model.PopulateTensor<int32_t>(model.num_segments(), {2});
+
+  EXPECT_EQ(model.Invoke(), kTfLiteError);
+}
+
+TEST(GatherUnsortedSegmentSumOpModelTest, NotMatchingShapes) {
+  GatherUnsortedSegmentSumOpModel model(
+      /* params = */ {tflite::TensorType_FLOAT32, {3}},
+      /* indices = */ {tflite::TensorType_INT32, {2}},
+      /* segment_ids = */ {tflite::TensorType_INT32, {3}},
+      /* num_segments = */ {tflite::TensorType_INT32, {}},
+      /* output = */ {tflite::TensorType_FLOAT32, {2}});
+  model.PopulateTensor<float>(model.params(), {4.0f, 5.0f, 6.0f});
+  model.PopulateTensor<int32_t>(model.indices(), {0, 1});
+  model.PopulateTensor<int32_t>(model.segment_ids(), {0, 1, 1});
+  model.PopulateTensor<int32_t>(model.num_segments(), {2});
+
+  EXPECT_EQ(model.Invoke(), kTfLiteError);
+}
+
 }  // namespace
 }  // namespace gematria
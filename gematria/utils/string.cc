@@ -15,18 +15,23 @@
 #include "gematria/utils/string.h"
 
 #include <cassert>
+#include <cstddef>
 #include <cstdint>
 #include <optional>
 #include <string>
 #include <string_view>
 #include <vector>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif  // __SSE2__
+
 namespace gematria {
 namespace {
 
-constexpr int kInvalidHexDigit = 256;
+constexpr uint8_t kInvalidHexDigit = 0xff;
 
-int ParseHexDigit(char digit) {
+constexpr uint8_t ParseHexDigit(char digit) {
   if (digit >= '0' && digit <= '9') {
     return digit - '0';
   }
@@ -39,6 +44,86 @@ int ParseHexDigit(char digit) {
   return kInvalidHexDigit;
 }
 
+// The values of all characters as hex digits, indexed by the character code.
+struct HexDigitTable {
+  constexpr HexDigitTable() : values() {
+    for (int c = 0; c < 256; ++c) {
+      values[c] = ParseHexDigit(static_cast<char>(c));
+    }
+  }
+  uint8_t values[256];
+};
+constexpr HexDigitTable kHexDigitTable;
+
+#ifdef __SSE2__
+// Decodes 16 hex digits from `hex` to 8 bytes. Returns the bytes in the lower
+// eight 16-bit lanes of the result, and sets `valid` to false when one of the
+// characters is not a hex digit.
+inline __m128i DecodeHexDigits16(const char* hex, bool& valid) {
+  const __m128i chars =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(hex));
+  // The comparisons are signed, so characters >= 0x80 are rejected by both.
+  const __m128i is_digit =
+      _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8('0' - 1)),
+                    _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), chars));
+  // Setting bit 5 maps 'A'-'F' to 'a'-'f' and does not map any other character
+  // to 'a'-'f'.
+  const __m128i lower = _mm_or_si128(chars, _mm_set1_epi8(0x20));
+  const __m128i is_letter =
+      _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                    _mm_cmpgt_epi8(_mm_set1_epi8('f' + 1), lower));
+  valid = _mm_movemask_epi8(_mm_or_si128(is_digit, is_letter)) == 0xffff;
+  const __m128i nibbles = _mm_or_si128(
+      _mm_and_si128(is_digit, _mm_sub_epi8(chars, _mm_set1_epi8('0'))),
+      _mm_and_si128(is_letter,
+                    _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+  // Each 16-bit lane contains the high nibble of a byte in its lower half and
+  // the low nibble in its upper half.
+  const __m128i high = _mm_slli_epi16(
+      _mm_and_si128(nibbles, _mm_set1_epi16(0x00ff)), 4);
+  const __m128i low = _mm_srli_epi16(nibbles, 8);
+  return _mm_or_si128(high, low);
+}
+#endif  // __SSE2__
+
+// Decodes `hex_string` to `output`, which must have space for
+// hex_string.size() / 2 bytes. `hex_string` must have an even length. Returns
+// false when `hex_string` contains characters that are not hex digits; the
+// contents of `output` are then unspecified.
+bool DecodeHexString(std::string_view hex_string, uint8_t* output) {
+  const char* hex = hex_string.data();
+  const char* const end = hex + hex_string.size();
+#ifdef __SSE2__
+  // Decode 32 hex digits per iteration, and 16 hex digits for the rest that
+  // fits in a vector register.
+  for (; end - hex >= 32; hex += 32, output += 16) {
+    bool valid_first = false;
+    bool valid_second = false;
+    const __m128i first = DecodeHexDigits16(hex, valid_first);
+    const __m128i second = DecodeHexDigits16(hex + 16, valid_second);
+    if (!valid_first || !valid_second) return false;
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(output),
+                     _mm_packus_epi16(first, second));
+  }
+  if (end - hex >= 16) {
+    bool valid = false;
+    const __m128i bytes = DecodeHexDigits16(hex, valid);
+    if (!valid) return false;
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(output),
+                     _mm_packus_epi16(bytes, bytes));
+    hex += 16;
+    output += 8;
+  }
+#endif  // __SSE2__
+  for (; hex != end; hex += 2, ++output) {
+    const uint8_t high = kHexDigitTable.values[static_cast<uint8_t>(hex[0])];
+    const uint8_t low = kHexDigitTable.values[static_cast<uint8_t>(hex[1])];
+    if ((high | low) > 15) return false;
+    *output = (high << 4) | low;
+  }
+  return true;
+}
+
 bool IsAsciiWhitespace(char c) {
   return c == ' ' || c == '\t' || c == '\r' || c == '\n';
 }
@@ -50,20 +135,25 @@ std::optional<std::vector<uint8_t>> ParseHexString(
   if (hex_string.size() % 2 != 0) {
     return std::nullopt;
   }
-  std::vector<uint8_t> res;
-  while (!hex_string.empty()) {
-    const int hex_value =
-        (ParseHexDigit(hex_string[0]) << 4) + ParseHexDigit(hex_string[1]);
-    if (hex_value >= 256) {
-      return std::nullopt;
-    }
-    res.push_back(hex_value);
-    hex_string.remove_prefix(2);
+  std::vector<uint8_t> res(hex_string.size() / 2);
+  if (!DecodeHexString(hex_string, res.data())) {
+    return std::nullopt;
   }
-
   return res;
 }
 
+bool HexStringBatch::Add(std::string_view hex_string) {
+  if (hex_string.size() % 2 != 0) return false;
+  const size_t begin = bytes_.size();
+  bytes_.resize(begin + hex_string.size() / 2);
+  if (!DecodeHexString(hex_string, bytes_.data() + begin)) {
+    bytes_.resize(begin);
+    return false;
+  }
+  offsets_.push_back(bytes_.size());
+  return true;
+}
+
 std::vector<std::string> StrSplitAsCopy(std::string_view text, char separator) {
   std::vector<std::string> splits;
   std::string_view::size_type last_separator = 0;
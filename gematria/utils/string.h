@@ -15,6 +15,7 @@
 #ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_UTILS_STRING_H_
 #define THIRD_PARTY_GEMATRIA_GEMATRIA_UTILS_STRING_H_
 
+#include <cstddef>
 #include <cstdint>
 #include <iomanip>
 #include <ios>
@@ -34,6 +35,42 @@ namespace gematria {
 // that are not hex digits.
 std::optional<std::vector<uint8_t>> ParseHexString(std::string_view hex_string);
 
+// A collection of byte strings decoded from hex strings, stored in a single
+// contiguous buffer. Reusing one batch for many hex strings avoids allocating
+// memory for each of them.
+class HexStringBatch {
+ public:
+  // Decodes `hex_string` as described by ParseHexString() and adds the bytes to
+  // the batch. Returns false and leaves the batch unchanged when `hex_string`
+  // is not a valid hex string.
+  bool Add(std::string_view hex_string);
+
+  // Removes all byte strings from the batch. Keeps the allocated memory.
+  void Clear() {
+    bytes_.clear();
+    offsets_.resize(1);
+  }
+
+  // Returns the number of byte strings in the batch.
+  size_t size() const { return offsets_.size() - 1; }
+
+  // Returns a pointer to the bytes and the number of bytes of the byte string
+  // at `index`. The pointer is valid until the batch is modified.
+  const uint8_t* data(size_t index) const {
+    return bytes_.data() + offsets_[index];
+  }
+  size_t size(size_t index) const {
+    return offsets_[index + 1] - offsets_[index];
+  }
+
+ private:
+  // The bytes of all the byte strings in the batch.
+  std::vector<uint8_t> bytes_;
+  // The byte string at index `i` is [bytes_[offsets_[i]], bytes_[offsets_[i +
+  // 1]]).
+  std::vector<size_t> offsets_ = {0};
+};
+
 // Formats `bytes` as a hex string that can be parsed with ParseHexString().
 inline std::string FormatAsHexString(std::string_view bytes) {
   std::stringstream out;
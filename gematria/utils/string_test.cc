@@ -14,6 +14,8 @@
 
 #include "gematria/utils/string.h"
 
+#include <cctype>
+#include <cstddef>
 #include <cstdint>
 #include <iterator>
 #include <optional>
@@ -59,6 +61,63 @@ TEST(ParseHexStringTest, SomeInvalidHexStrings) {
   }
 }
 
+// Checks hex strings of different lengths, so that all code paths of the
+// decoder are used.
+TEST(ParseHexStringTest, LongHexStrings) {
+  for (int size = 0; size < 100; ++size) {
+    std::string bytes;
+    for (int i = 0; i < size; ++i) bytes.push_back(static_cast<char>(i * 37));
+    std::string hex_string = FormatAsHexString(bytes);
+    EXPECT_THAT(ParseHexString(hex_string),
+                Optional(ElementsAreArray(bytes.begin(), bytes.end())))
+        << hex_string;
+    for (char& c : hex_string) c = std::toupper(c);
+    EXPECT_THAT(ParseHexString(hex_string),
+                Optional(ElementsAreArray(bytes.begin(), bytes.end())))
+        << hex_string;
+  }
+}
+
+TEST(ParseHexStringTest, InvalidCharacterAtAllPositions) {
+  const std::string valid_hex_string(70, 'a');
+  for (const char invalid_char : {'g', 'G', '/', ':', '@', '`', ' ', '\x80',
+                                  '\xe1', '\0'}) {
+    for (size_t i = 0; i < valid_hex_string.size(); ++i) {
+      std::string hex_string = valid_hex_string;
+      hex_string[i] = invalid_char;
+      EXPECT_EQ(ParseHexString(hex_string), std::nullopt)
+          << "position " << i << ", character " << static_cast<int>(invalid_char);
+    }
+  }
+}
+
+TEST(HexStringBatchTest, AddAndClear) {
+  HexStringBatch batch;
+  EXPECT_EQ(batch.size(), 0);
+  EXPECT_TRUE(batch.Add("abcd"));
+  EXPECT_FALSE(batch.Add("abc"));
+  EXPECT_FALSE(batch.Add("xy"));
+  EXPECT_TRUE(batch.Add(""));
+  EXPECT_TRUE(batch.Add("0123456789abcdef0123456789ABCDEF01"));
+  ASSERT_EQ(batch.size(), 3);
+
+  auto bytes = [&batch](size_t index) {
+    return std::vector<uint8_t>(batch.data(index),
+                                batch.data(index) + batch.size(index));
+  };
+  EXPECT_THAT(bytes(0), ElementsAre(0xab, 0xcd));
+  EXPECT_THAT(bytes(1), ElementsAre());
+  EXPECT_THAT(bytes(2),
+              ElementsAre(0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef, 0x01,
+                          0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef, 0x01));
+
+  batch.Clear();
+  EXPECT_EQ(batch.size(), 0);
+  EXPECT_TRUE(batch.Add("ff"));
+  ASSERT_EQ(batch.size(), 1);
+  EXPECT_THAT(bytes(0), ElementsAre(0xff));
+}
+
 TEST(FormatAsHexStringTest, EmptySpan) { EXPECT_EQ(FormatAsHexString(""), ""); }
 
 TEST(FormatAsHexStringTest, NonEmptySpan) {
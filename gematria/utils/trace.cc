@@ -0,0 +1,361 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/utils/trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iomanip>
+#include <ios>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace gematria {
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+int64_t NanosecondsSinceClockEpoch(Clock::time_point time) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             time.time_since_epoch())
+      .count();
+}
+
+// Accumulates the values of a scope or a counter. For scopes, the values are
+// the durations in nanoseconds.
+struct Accumulator {
+  void Add(int64_t value) {
+    ++count;
+    sum += value;
+    min = std::min(min, value);
+    max = std::max(max, value);
+  }
+  void Merge(const Accumulator& other) {
+    count += other.count;
+    sum += other.sum;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+  }
+
+  int64_t count = 0;
+  int64_t sum = 0;
+  int64_t min = std::numeric_limits<int64_t>::max();
+  int64_t max = std::numeric_limits<int64_t>::min();
+};
+
+// An event as it is recorded by the thread. Unlike TraceEvent, it keeps only
+// the pointer to the name, and the absolute start time.
+struct RecordedEvent {
+  TraceEvent::Type type;
+  const char* name;
+  int64_t start_ns;
+  int64_t value;
+};
+
+// The data collected by one thread, or by the threads that already finished.
+// The accumulators are keyed by the name pointers; the same name may appear
+// under different pointers, e.g. when it is used in multiple translation
+// units, so they are merged by the name string in snapshots.
+struct TraceData {
+  void Clear() {
+    scopes.clear();
+    counters.clear();
+    events.clear();
+    num_dropped_events = 0;
+  }
+
+  std::unordered_map<const char*, Accumulator> scopes;
+  std::unordered_map<const char*, Accumulator> counters;
+  std::vector<std::pair<int, RecordedEvent>> events;
+  int64_t num_dropped_events = 0;
+};
+
+class ThreadTraceBuffer;
+
+// The registry of the buffers of all running threads. The registry is never
+// destroyed, so that the buffers of threads that finish during the shutdown
+// can still unregister.
+class TraceRegistry {
+ public:
+  static TraceRegistry& Get() {
+    static TraceRegistry* const registry = new TraceRegistry();
+    return *registry;
+  }
+
+  // Registers a new buffer and returns the ID of its thread.
+  int Register(ThreadTraceBuffer* buffer);
+  // Unregisters `buffer` and keeps the data collected by it.
+  void Unregister(ThreadTraceBuffer* buffer);
+
+  TraceSnapshot Snapshot();
+  void Reset();
+
+  bool recording_events() const {
+    return recording_events_.load(std::memory_order_relaxed);
+  }
+  void SetRecordingEvents(bool enabled) {
+    if (enabled) {
+      origin_ns_.store(NanosecondsSinceClockEpoch(Clock::now()),
+                       std::memory_order_relaxed);
+    }
+    recording_events_.store(enabled, std::memory_order_relaxed);
+  }
+
+ private:
+  TraceRegistry() = default;
+
+  // Protects all members below, except for the atomics. When locking both the
+  // registry and a buffer, the registry must be locked first.
+  std::mutex mutex_;
+  std::vector<ThreadTraceBuffer*> buffers_;
+  TraceData finished_threads_;
+  int next_thread_id_ = 0;
+
+  std::atomic<bool> recording_events_ = false;
+  std::atomic<int64_t> origin_ns_ = 0;
+};
+
+class ThreadTraceBuffer {
+ public:
+  ThreadTraceBuffer() : thread_id_(TraceRegistry::Get().Register(this)) {}
+  ~ThreadTraceBuffer() { TraceRegistry::Get().Unregister(this); }
+
+  static ThreadTraceBuffer& ForCurrentThread() {
+    thread_local ThreadTraceBuffer buffer;
+    return buffer;
+  }
+
+  void AddScope(const char* name, Clock::time_point start,
+                Clock::time_point end) {
+    const int64_t start_ns = NanosecondsSinceClockEpoch(start);
+    const int64_t duration_ns = NanosecondsSinceClockEpoch(end) - start_ns;
+    const std::lock_guard<std::mutex> lock(mutex_);
+    data_.scopes[name].Add(duration_ns);
+    MaybeRecordEvent({TraceEvent::Type::kScope, name, start_ns, duration_ns});
+  }
+
+  void AddCounter(const char* name, int64_t value) {
+    const int64_t start_ns = TraceRegistry::Get().recording_events()
+                                 ? NanosecondsSinceClockEpoch(Clock::now())
+                                 : 0;
+    const std::lock_guard<std::mutex> lock(mutex_);
+    data_.counters[name].Add(value);
+    MaybeRecordEvent({TraceEvent::Type::kCounter, name, start_ns, value});
+  }
+
+  int thread_id() const { return thread_id_; }
+  std::mutex& mutex() { return mutex_; }
+  TraceData& data() { return data_; }
+
+ private:
+  void MaybeRecordEvent(const RecordedEvent& event) {
+    if (!TraceRegistry::Get().recording_events()) return;
+    if (data_.events.size() >= kMaxTraceEventsPerThread) {
+      ++data_.num_dropped_events;
+      return;
+    }
+    data_.events.emplace_back(thread_id_, event);
+  }
+
+  const int thread_id_;
+  std::mutex mutex_;
+  TraceData data_;
+};
+
+void MergeTraceData(const TraceData& from, TraceData& into) {
+  for (const auto& [name, accumulator] : from.scopes) {
+    into.scopes[name].Merge(accumulator);
+  }
+  for (const auto& [name, accumulator] : from.counters) {
+    into.counters[name].Merge(accumulator);
+  }
+  into.events.insert(into.events.end(), from.events.begin(), from.events.end());
+  into.num_dropped_events += from.num_dropped_events;
+}
+
+int TraceRegistry::Register(ThreadTraceBuffer* buffer) {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  buffers_.push_back(buffer);
+  return next_thread_id_++;
+}
+
+void TraceRegistry::Unregister(ThreadTraceBuffer* buffer) {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  buffers_.erase(std::find(buffers_.begin(), buffers_.end(), buffer));
+  const std::lock_guard<std::mutex> buffer_lock(buffer->mutex());
+  MergeTraceData(buffer->data(), finished_threads_);
+}
+
+TraceSnapshot TraceRegistry::Snapshot() {
+  TraceData data;
+  {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    MergeTraceData(finished_threads_, data);
+    for (ThreadTraceBuffer* const buffer : buffers_) {
+      const std::lock_guard<std::mutex> buffer_lock(buffer->mutex());
+      MergeTraceData(buffer->data(), data);
+    }
+  }
+
+  std::map<std::string, Accumulator> scopes;
+  for (const auto& [name, accumulator] : data.scopes) {
+    scopes[name].Merge(accumulator);
+  }
+  std::map<std::string, Accumulator> counters;
+  for (const auto& [name, accumulator] : data.counters) {
+    counters[name].Merge(accumulator);
+  }
+
+  TraceSnapshot snapshot;
+  for (const auto& [name, accumulator] : scopes) {
+    snapshot.scopes.push_back({name, accumulator.count, accumulator.sum,
+                               accumulator.min, accumulator.max});
+  }
+  for (const auto& [name, accumulator] : counters) {
+    snapshot.counters.push_back({name, accumulator.count, accumulator.sum,
+                                 accumulator.min, accumulator.max});
+  }
+  const int64_t origin_ns = origin_ns_.load(std::memory_order_relaxed);
+  snapshot.events.reserve(data.events.size());
+  for (const auto& [thread_id, event] : data.events) {
+    snapshot.events.push_back({event.type, event.name, thread_id,
+                               event.start_ns - origin_ns, event.value});
+  }
+  std::stable_sort(snapshot.events.begin(), snapshot.events.end(),
+                   [](const TraceEvent& a, const TraceEvent& b) {
+                     return std::tie(a.thread_id, a.start_ns) <
+                            std::tie(b.thread_id, b.start_ns);
+                   });
+  snapshot.num_dropped_events = data.num_dropped_events;
+  return snapshot;
+}
+
+void TraceRegistry::Reset() {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  finished_threads_.Clear();
+  for (ThreadTraceBuffer* const buffer : buffers_) {
+    const std::lock_guard<std::mutex> buffer_lock(buffer->mutex());
+    buffer->data().Clear();
+  }
+}
+
+// Appends `str` to `out` as a JSON string literal.
+void AppendJsonString(const std::string& str, std::ostringstream& out) {
+  out << '"';
+  for (const char c : str) {
+    switch (c) {
+      case '"':
+        out << "\\\"";
+        break;
+      case '\\':
+        out << "\\\\";
+        break;
+      case '\n':
+        out << "\\n";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          char escaped[7];
+          std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+          out << escaped;
+        } else {
+          out << c;
+        }
+    }
+  }
+  out << '"';
+}
+
+}  // namespace
+
+void SetTraceEventRecordingEnabled(bool enabled) {
+  TraceRegistry::Get().SetRecordingEvents(enabled);
+}
+
+TraceSnapshot GetTraceSnapshot() { return TraceRegistry::Get().Snapshot(); }
+
+void ResetTrace() { TraceRegistry::Get().Reset(); }
+
+std::string FormatTraceStats(const TraceSnapshot& snapshot) {
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(3);
+  for (const TraceScopeStats& scope : snapshot.scopes) {
+    const double mean_us =
+        scope.count == 0 ? 0.0 : scope.total_ns / 1000.0 / scope.count;
+    out << scope.name << ": count=" << scope.count
+        << " total_ms=" << scope.total_ns / 1e6 << " mean_us=" << mean_us
+        << " min_us=" << scope.min_ns / 1000.0
+        << " max_us=" << scope.max_ns / 1000.0 << "\n";
+  }
+  for (const TraceCounterStats& counter : snapshot.counters) {
+    const double mean =
+        counter.count == 0 ? 0.0
+                           : static_cast<double>(counter.sum) / counter.count;
+    out << counter.name << ": count=" << counter.count
+        << " sum=" << counter.sum << " mean=" << mean
+        << " min=" << counter.min << " max=" << counter.max << "\n";
+  }
+  if (snapshot.num_dropped_events > 0) {
+    out << "dropped events: " << snapshot.num_dropped_events << "\n";
+  }
+  return out.str();
+}
+
+std::string FormatChromeTraceJson(const TraceSnapshot& snapshot) {
+  std::ostringstream out;
+  // The timestamps in the Chrome trace format are in microseconds.
+  out << std::fixed << std::setprecision(3);
+  out << "{\"traceEvents\":[";
+  bool first = true;
+  for (const TraceEvent& event : snapshot.events) {
+    if (!first) out << ",";
+    first = false;
+    out << "\n{\"name\":";
+    AppendJsonString(event.name, out);
+    out << ",\"pid\":0,\"tid\":" << event.thread_id
+        << ",\"ts\":" << event.start_ns / 1000.0;
+    switch (event.type) {
+      case TraceEvent::Type::kScope:
+        out << ",\"ph\":\"X\",\"dur\":" << event.value / 1000.0 << "}";
+        break;
+      case TraceEvent::Type::kCounter:
+        out << ",\"ph\":\"C\",\"args\":{\"value\":" << event.value << "}}";
+        break;
+    }
+  }
+  out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+  return out.str();
+}
+
+void TraceScope::End() {
+  if (name_ == nullptr) return;
+  ThreadTraceBuffer::ForCurrentThread().AddScope(name_, start_, Clock::now());
+  name_ = nullptr;
+}
+
+void AddTraceCounter(const char* name, int64_t value) {
+  ThreadTraceBuffer::ForCurrentThread().AddCounter(name, value);
+}
+
+}  // namespace gematria
@@ -0,0 +1,184 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains a lightweight instrumentation layer for the hot paths of the
+// Gematria C++ libraries: scoped timers and counters that are aggregated per
+// name, and optionally recorded as individual events that can be exported in
+// the Chrome trace event format (viewable in chrome://tracing or Perfetto).
+//
+// The instrumentation is compiled out by default. It is compiled in when
+// GEMATRIA_ENABLE_TRACING is defined, i.e. with `--define tracing=1` in Bazel
+// builds, and with `-DGEMATRIA_ENABLE_TRACING=ON` in CMake builds. Without it,
+// the macros below expand to nothing and have no runtime cost.
+//
+// Typical usage:
+//   void GraphBuilder::AddBasicBlock(...) {
+//     GEMATRIA_TRACE_SCOPE("GraphBuilder::AddBasicBlock");
+//     ...
+//     GEMATRIA_TRACE_COUNTER("GraphBuilder::num_nodes", num_nodes);
+//   }
+//
+//   // At the end of the job:
+//   const TraceSnapshot snapshot = GetTraceSnapshot();
+//   std::cerr << FormatTraceStats(snapshot);
+//
+// The names passed to the macros must be string literals, or other strings
+// with static storage duration; the tracing code keeps only the pointers.
+//
+// The timers and counters are accumulated in a thread-local buffer, so the
+// threads do not contend on shared data; each scope costs two reads of the
+// steady clock and an uncontended lock of the buffer of the thread.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_UTILS_TRACE_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_UTILS_TRACE_H_
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace gematria {
+
+// True when the GEMATRIA_TRACE_* macros are compiled in.
+inline constexpr bool kTracingEnabled =
+#ifdef GEMATRIA_ENABLE_TRACING
+    true;
+#else
+    false;
+#endif  // GEMATRIA_ENABLE_TRACING
+
+// The maximal number of events recorded by each thread when event recording is
+// enabled. Events beyond this limit are still added to the aggregated stats,
+// but they are not recorded individually.
+inline constexpr int kMaxTraceEventsPerThread = 1 << 20;
+
+// Aggregated stats of all executions of a scope with the same name.
+struct TraceScopeStats {
+  std::string name;
+  int64_t count = 0;
+  int64_t total_ns = 0;
+  int64_t min_ns = 0;
+  int64_t max_ns = 0;
+};
+
+// Aggregated stats of all values added to a counter with the same name.
+struct TraceCounterStats {
+  std::string name;
+  int64_t count = 0;
+  int64_t sum = 0;
+  int64_t min = 0;
+  int64_t max = 0;
+};
+
+// A single recorded event. For scopes, `start_ns` is the time when the scope
+// was entered, relative to the time when event recording was enabled, and
+// `value` is the duration of the scope in nanoseconds. For counters, `value`
+// is the value added to the counter.
+struct TraceEvent {
+  enum class Type { kScope, kCounter };
+
+  Type type = Type::kScope;
+  std::string name;
+  int thread_id = 0;
+  int64_t start_ns = 0;
+  int64_t value = 0;
+};
+
+// A copy of all data collected by the tracing code. The scopes and counters
+// are sorted by name; the events are sorted by thread and by their start time.
+struct TraceSnapshot {
+  std::vector<TraceScopeStats> scopes;
+  std::vector<TraceCounterStats> counters;
+  std::vector<TraceEvent> events;
+  // The number of events that were not recorded because a thread reached
+  // kMaxTraceEventsPerThread.
+  int64_t num_dropped_events = 0;
+};
+
+// Enables or disables recording of individual events. Event recording is
+// disabled by default; only the aggregated stats are collected. Enabling the
+// recording resets the origin of the event timestamps.
+void SetTraceEventRecordingEnabled(bool enabled);
+
+// Returns a copy of the data collected so far from all threads, including the
+// threads that already finished.
+TraceSnapshot GetTraceSnapshot();
+
+// Removes all collected stats and events.
+void ResetTrace();
+
+// Formats the aggregated stats from `snapshot` as a human-readable table, with
+// one line per scope and per counter.
+std::string FormatTraceStats(const TraceSnapshot& snapshot);
+
+// Formats the events from `snapshot` in the JSON Chrome trace event format.
+// Scopes are exported as complete ("X") events and counters as counter ("C")
+// events.
+std::string FormatChromeTraceJson(const TraceSnapshot& snapshot);
+
+// Measures the time between the construction and the destruction of the
+// object, or until End() is called, and adds it to the stats of the scope
+// `name`. Use it through GEMATRIA_TRACE_SCOPE or GEMATRIA_TRACE_SCOPE_BEGIN, so
+// that it is compiled out by default.
+class TraceScope {
+ public:
+  explicit TraceScope(const char* name)
+      : name_(name), start_(std::chrono::steady_clock::now()) {}
+
+  TraceScope(const TraceScope&) = delete;
+  TraceScope& operator=(const TraceScope&) = delete;
+
+  ~TraceScope() { End(); }
+
+  // Ends the scope before the object is destroyed. Does nothing when the scope
+  // already ended.
+  void End();
+
+ private:
+  const char* name_;
+  const std::chrono::steady_clock::time_point start_;
+};
+
+// Adds `value` to the counter `name`. Use it through GEMATRIA_TRACE_COUNTER, so
+// that it is compiled out by default.
+void AddTraceCounter(const char* name, int64_t value);
+
+}  // namespace gematria
+
+#define GEMATRIA_TRACE_CONCAT_INTERNAL(a, b) a##b
+#define GEMATRIA_TRACE_CONCAT(a, b) GEMATRIA_TRACE_CONCAT_INTERNAL(a, b)
+
+#ifdef GEMATRIA_ENABLE_TRACING
+// Measures the time from this statement to the end of the enclosing scope.
+#define GEMATRIA_TRACE_SCOPE(name)                    \
+  const ::gematria::TraceScope GEMATRIA_TRACE_CONCAT( \
+      gematria_trace_scope_, __LINE__)(name)
+// Measures the time from GEMATRIA_TRACE_SCOPE_BEGIN to the matching
+// GEMATRIA_TRACE_SCOPE_END, or to the end of the enclosing scope when the code
+// returns early. Used to split a function into consecutive stages without
+// introducing new blocks.
+#define GEMATRIA_TRACE_SCOPE_BEGIN(variable, name) \
+  ::gematria::TraceScope variable(name)
+#define GEMATRIA_TRACE_SCOPE_END(variable) variable.End()
+// Adds `value` to the counter `name`.
+#define GEMATRIA_TRACE_COUNTER(name, value) \
+  ::gematria::AddTraceCounter(name, value)
+#else
+#define GEMATRIA_TRACE_SCOPE(name) static_cast<void>(0)
+#define GEMATRIA_TRACE_SCOPE_BEGIN(variable, name) static_cast<void>(0)
+#define GEMATRIA_TRACE_SCOPE_END(variable) static_cast<void>(0)
+#define GEMATRIA_TRACE_COUNTER(name, value) static_cast<void>(0)
+#endif  // GEMATRIA_ENABLE_TRACING
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_UTILS_TRACE_H_
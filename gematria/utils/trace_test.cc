@@ -0,0 +1,151 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/utils/trace.h"
+
+#include <string>
+#include <thread>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::AllOf;
+using ::testing::ElementsAre;
+using ::testing::Field;
+using ::testing::Ge;
+using ::testing::HasSubstr;
+using ::testing::IsEmpty;
+using ::testing::Not;
+using ::testing::UnorderedElementsAre;
+
+// The tests use TraceScope and AddTraceCounter directly, so that they work
+// also when the GEMATRIA_TRACE_* macros are compiled out.
+class TraceTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    SetTraceEventRecordingEnabled(false);
+    ResetTrace();
+  }
+  void TearDown() override {
+    SetTraceEventRecordingEnabled(false);
+    ResetTrace();
+  }
+};
+
+TEST_F(TraceTest, AggregatesScopes) {
+  for (int i = 0; i < 3; ++i) {
+    const TraceScope scope("TraceTest::Scope");
+  }
+  { const TraceScope scope("TraceTest::Another"); }
+
+  const TraceSnapshot snapshot = GetTraceSnapshot();
+  ASSERT_THAT(snapshot.scopes,
+              ElementsAre(Field(&TraceScopeStats::name, "TraceTest::Another"),
+                          Field(&TraceScopeStats::name, "TraceTest::Scope")));
+  const TraceScopeStats& scope = snapshot.scopes[1];
+  EXPECT_EQ(scope.count, 3);
+  EXPECT_GE(scope.min_ns, 0);
+  EXPECT_LE(scope.min_ns, scope.max_ns);
+  EXPECT_LE(scope.max_ns, scope.total_ns);
+  // Events are not recorded by default.
+  EXPECT_THAT(snapshot.events, IsEmpty());
+}
+
+TEST_F(TraceTest, AggregatesCounters) {
+  AddTraceCounter("TraceTest::Counter", 5);
+  AddTraceCounter("TraceTest::Counter", -2);
+  AddTraceCounter("TraceTest::Counter", 7);
+
+  const TraceSnapshot snapshot = GetTraceSnapshot();
+  ASSERT_EQ(snapshot.counters.size(), 1);
+  const TraceCounterStats& counter = snapshot.counters[0];
+  EXPECT_EQ(counter.name, "TraceTest::Counter");
+  EXPECT_EQ(counter.count, 3);
+  EXPECT_EQ(counter.sum, 10);
+  EXPECT_EQ(counter.min, -2);
+  EXPECT_EQ(counter.max, 7);
+  EXPECT_THAT(FormatTraceStats(snapshot),
+              HasSubstr("TraceTest::Counter: count=3 sum=10"));
+}
+
+TEST_F(TraceTest, KeepsDataOfFinishedThreads) {
+  std::thread thread([]() {
+    const TraceScope scope("TraceTest::Thread");
+    AddTraceCounter("TraceTest::ThreadCounter", 1);
+  });
+  thread.join();
+  { const TraceScope scope("TraceTest::Thread"); }
+
+  const TraceSnapshot snapshot = GetTraceSnapshot();
+  ASSERT_EQ(snapshot.scopes.size(), 1);
+  EXPECT_EQ(snapshot.scopes[0].count, 2);
+  ASSERT_EQ(snapshot.counters.size(), 1);
+  EXPECT_EQ(snapshot.counters[0].sum, 1);
+}
+
+TEST_F(TraceTest, EndScopeEarly) {
+  {
+    TraceScope scope("TraceTest::Stage");
+    scope.End();
+    // Ending the scope again or destroying it does not add another execution.
+    scope.End();
+  }
+  const TraceSnapshot snapshot = GetTraceSnapshot();
+  ASSERT_EQ(snapshot.scopes.size(), 1);
+  EXPECT_EQ(snapshot.scopes[0].count, 1);
+}
+
+TEST_F(TraceTest, Reset) {
+  { const TraceScope scope("TraceTest::Scope"); }
+  ResetTrace();
+  const TraceSnapshot snapshot = GetTraceSnapshot();
+  EXPECT_THAT(snapshot.scopes, IsEmpty());
+  EXPECT_THAT(snapshot.counters, IsEmpty());
+}
+
+TEST_F(TraceTest, ChromeTraceJson) {
+  SetTraceEventRecordingEnabled(true);
+  {
+    const TraceScope outer("TraceTest::\"Outer\"");
+    const TraceScope inner("TraceTest::Inner");
+    AddTraceCounter("TraceTest::Counter", 42);
+  }
+  SetTraceEventRecordingEnabled(false);
+  { const TraceScope ignored("TraceTest::NotRecorded"); }
+
+  const TraceSnapshot snapshot = GetTraceSnapshot();
+  EXPECT_THAT(
+      snapshot.events,
+      UnorderedElementsAre(
+          AllOf(Field(&TraceEvent::name, "TraceTest::\"Outer\""),
+                Field(&TraceEvent::type, TraceEvent::Type::kScope),
+                Field(&TraceEvent::start_ns, Ge(0))),
+          Field(&TraceEvent::name, "TraceTest::Inner"),
+          AllOf(Field(&TraceEvent::name, "TraceTest::Counter"),
+                Field(&TraceEvent::type, TraceEvent::Type::kCounter),
+                Field(&TraceEvent::value, 42))));
+
+  const std::string json = FormatChromeTraceJson(snapshot);
+  EXPECT_THAT(json, HasSubstr("{\"traceEvents\":["));
+  EXPECT_THAT(json, HasSubstr("\"name\":\"TraceTest::\\\"Outer\\\"\""));
+  EXPECT_THAT(json, HasSubstr("\"ph\":\"X\""));
+  EXPECT_THAT(json, HasSubstr("\"ph\":\"C\",\"args\":{\"value\":42}"));
+  EXPECT_THAT(json, Not(HasSubstr("NotRecorded")));
+}
+
+}  // namespace
+}  // namespace gematria
@@ -0,0 +1,173 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "llvm_cm/lib/frequency_profile.h"
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/ADT/bit.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/ErrorOr.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+namespace llvm_cm {
+namespace {
+
+using llvm::support::endian::read32le;
+using llvm::support::endian::read64le;
+
+bool isInBounds(uint64_t Offset, uint64_t Size, size_t BufferSize) {
+  return Offset <= BufferSize && Size <= BufferSize - Offset;
+}
+
+void appendUInt32(std::string &Out, uint32_t Value) {
+  char Bytes[4];
+  llvm::support::endian::write32le(Bytes, Value);
+  Out.append(Bytes, sizeof(Bytes));
+}
+
+void appendUInt64(std::string &Out, uint64_t Value) {
+  char Bytes[8];
+  llvm::support::endian::write64le(Bytes, Value);
+  Out.append(Bytes, sizeof(Bytes));
+}
+
+llvm::Error makeError(const llvm::Twine &Message) {
+  return llvm::make_error<llvm::StringError>(
+      Message, llvm::errc::invalid_argument);
+}
+
+}  // namespace
+
+std::string FrequencyProfile::serialize(const BBFreqMap &Frequencies) {
+  std::vector<llvm::StringRef> Names;
+  Names.reserve(Frequencies.size());
+  for (const auto &Entry : Frequencies) Names.push_back(Entry.getKey());
+  llvm::sort(Names);
+
+  std::string Out(Magic);
+  appendUInt32(Out, Version);
+  appendUInt32(Out, Names.size());
+  std::string Data;
+  const uint64_t DataOffset = HeaderSize + EntrySize * Names.size();
+  for (llvm::StringRef Name : Names) {
+    const llvm::SmallVector<BBFreq, 20> &Freqs =
+        Frequencies.find(Name)->second;
+    appendUInt64(Out, DataOffset + Data.size());
+    appendUInt32(Out, Name.size());
+    appendUInt32(Out, Freqs.size());
+    Data.append(Name.begin(), Name.end());
+    // Keep the frequencies aligned, so that they can be read efficiently
+    // from the memory-mapped file.
+    Data.resize(llvm::alignTo(DataOffset + Data.size(), 8) - DataOffset, '\0');
+    appendUInt64(Out, DataOffset + Data.size());
+    for (const BBFreq Freq : Freqs) {
+      appendUInt64(Data, llvm::bit_cast<uint64_t>(static_cast<double>(Freq)));
+    }
+  }
+  Out.append(Data);
+  return Out;
+}
+
+llvm::Expected<std::unique_ptr<FrequencyProfile>> FrequencyProfile::create(
+    std::unique_ptr<llvm::MemoryBuffer> Buffer, std::string Source) {
+  const llvm::StringRef Contents = Buffer->getBuffer();
+  if (Contents.size() < HeaderSize || !Contents.startswith(Magic)) {
+    return makeError("Not a binary profile: " + Source);
+  }
+  if (read32le(Contents.data() + Magic.size()) != Version) {
+    return makeError("Unsupported version of the binary profile: " + Source);
+  }
+  std::unique_ptr<FrequencyProfile> Profile(
+      new FrequencyProfile(std::move(Buffer), std::move(Source)));
+  Profile->NumFunctions = read32le(Contents.data() + Magic.size() + 4);
+  if (!isInBounds(HeaderSize, uint64_t{EntrySize} * Profile->NumFunctions,
+                  Contents.size())) {
+    return makeError("Truncated binary profile: " + Profile->Source);
+  }
+  for (uint32_t I = 0; I < Profile->NumFunctions; ++I) {
+    const char *Entry = Profile->entry(I);
+    if (!isInBounds(read64le(Entry), read32le(Entry + 8), Contents.size()) ||
+        !isInBounds(read64le(Entry + 16), uint64_t{8} * read32le(Entry + 12),
+                    Contents.size())) {
+      return makeError("Truncated binary profile: " + Profile->Source);
+    }
+    if (I > 0 && Profile->name(I - 1) >= Profile->name(I)) {
+      return makeError("Corrupted binary profile: " + Profile->Source);
+    }
+  }
+  return Profile;
+}
+
+llvm::Expected<std::unique_ptr<FrequencyProfile>>
+FrequencyProfile::fromBinaryFile(llvm::StringRef FileName) {
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> FileOrErr =
+      llvm::MemoryBuffer::getFile(FileName, /*IsText=*/false,
+                                  /*RequiresNullTerminator=*/false);
+  if (!FileOrErr) {
+    return llvm::make_error<llvm::StringError>(
+        "failed to open file " + FileName, FileOrErr.getError());
+  }
+  return create(std::move(*FileOrErr), "profile file " + FileName.str());
+}
+
+llvm::Expected<std::unique_ptr<FrequencyProfile>> FrequencyProfile::fromMap(
+    const BBFreqMap &Frequencies) {
+  return create(llvm::MemoryBuffer::getMemBufferCopy(serialize(Frequencies)),
+                "CSV file");
+}
+
+llvm::StringRef FrequencyProfile::name(uint32_t I) const {
+  assert(I < NumFunctions);
+  const char *Entry = entry(I);
+  return llvm::StringRef(Buffer->getBufferStart() + read64le(Entry),
+                         read32le(Entry + 8));
+}
+
+FrequencySpan FrequencyProfile::frequencies(uint32_t I) const {
+  assert(I < NumFunctions);
+  const char *Entry = entry(I);
+  return FrequencySpan(Buffer->getBufferStart() + read64le(Entry + 16),
+                       read32le(Entry + 12));
+}
+
+std::optional<FrequencySpan> FrequencyProfile::lookup(
+    llvm::StringRef FunctionName) const {
+  uint32_t Begin = 0;
+  uint32_t End = NumFunctions;
+  while (Begin < End) {
+    const uint32_t Middle = Begin + (End - Begin) / 2;
+    if (name(Middle) < FunctionName) {
+      Begin = Middle + 1;
+    } else {
+      End = Middle;
+    }
+  }
+  if (Begin == NumFunctions || name(Begin) != FunctionName) return std::nullopt;
+  return frequencies(Begin);
+}
+
+}  // namespace llvm_cm
@@ -0,0 +1,150 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains the basic block frequency profile used by llvm-cm, and its binary
+// file format.
+
+#ifndef THIRD_PARTY_GEMATRIA_LLVM_CM_LIB_FREQUENCY_PROFILE_H_
+#define THIRD_PARTY_GEMATRIA_LLVM_CM_LIB_FREQUENCY_PROFILE_H_
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/bit.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+namespace llvm_cm {
+
+// BB indices in the BBFreqMap that are not present in the CSV file will be
+// assigned an "BBFreq::Invalid (-1)" value.
+class BBFreq final {
+  double Value = Invalid;
+
+ public:
+  BBFreq() = default;
+
+  BBFreq(double Val) : Value(Val) {}
+
+  operator double() const { return Value; }
+
+  static constexpr double Invalid = -1;
+};
+
+// The basic block frequencies of all functions, keyed by the function name and
+// indexed by the BB ID, as read from a CSV file.
+using BBFreqMap = llvm::StringMap<llvm::SmallVector<BBFreq, 20>>;
+
+// The basic block frequencies of a single function, indexed by the BB ID.
+// Points to the data of a FrequencyProfile.
+class FrequencySpan final {
+  const char *Data = nullptr;
+  size_t NumBlocks = 0;
+
+ public:
+  FrequencySpan() = default;
+
+  FrequencySpan(const char *Data, size_t NumBlocks)
+      : Data(Data), NumBlocks(NumBlocks) {}
+
+  size_t size() const { return NumBlocks; }
+
+  double operator[](size_t BB) const {
+    assert(BB < NumBlocks);
+    return llvm::bit_cast<double>(
+        llvm::support::endian::read64le(Data + 8 * BB));
+  }
+};
+
+// Basic block frequencies keyed by the function name and the BB ID. The
+// frequencies are stored in a compact binary format that is used directly from
+// a memory-mapped file or from an in-memory buffer:
+//   * the header: the magic string, the format version (4 bytes) and the
+//     number of functions (4 bytes),
+//   * the function table: for every function, sorted by name, the offset of its
+//     name (8 bytes), the size of the name (4 bytes), the number of basic
+//     blocks (4 bytes) and the offset of the frequencies (8 bytes),
+//   * the data: the names of the functions and arrays of frequencies indexed by
+//     the BB ID, as doubles. BB IDs that are not in the profile have the
+//     frequency BBFreq::Invalid.
+// All numbers are little-endian, and all offsets are from the start of the
+// data.
+class FrequencyProfile final {
+ public:
+  static constexpr llvm::StringRef Magic = "LLVMCMBF";
+  static constexpr uint32_t Version = 1;
+
+  // Serializes the frequencies from `Frequencies` to the binary format.
+  static std::string serialize(const BBFreqMap &Frequencies);
+
+  // Creates the profile from a buffer in the binary format and checks its
+  // consistency. Returns an error when the buffer is not a valid profile.
+  // `Source` describes the origin of the buffer in the error messages.
+  static llvm::Expected<std::unique_ptr<FrequencyProfile>> create(
+      std::unique_ptr<llvm::MemoryBuffer> Buffer, std::string Source);
+
+  // Loads the profile from a (memory-mapped) file in the binary format.
+  static llvm::Expected<std::unique_ptr<FrequencyProfile>> fromBinaryFile(
+      llvm::StringRef FileName);
+
+  // Converts the frequencies from `Frequencies` to a profile.
+  static llvm::Expected<std::unique_ptr<FrequencyProfile>> fromMap(
+      const BBFreqMap &Frequencies);
+
+  const std::string &source() const { return Source; }
+
+  // Returns the number of functions in the profile.
+  uint32_t size() const { return NumFunctions; }
+
+  // Returns the name of the function at index `I` in the function table.
+  llvm::StringRef name(uint32_t I) const;
+
+  // Returns the frequencies of the basic blocks of the function at index `I`
+  // in the function table.
+  FrequencySpan frequencies(uint32_t I) const;
+
+  // Returns the frequencies of the basic blocks of `FunctionName`, or
+  // std::nullopt when the function is not in the profile.
+  std::optional<FrequencySpan> lookup(llvm::StringRef FunctionName) const;
+
+ private:
+  static constexpr size_t HeaderSize = Magic.size() + 4 + 4;
+  static constexpr size_t EntrySize = 8 + 4 + 4 + 8;
+
+  FrequencyProfile(std::unique_ptr<llvm::MemoryBuffer> Buffer,
+                   std::string Source)
+      : Buffer(std::move(Buffer)), Source(std::move(Source)) {}
+
+  const char *entry(uint32_t I) const {
+    return Buffer->getBufferStart() + HeaderSize + EntrySize * I;
+  }
+
+  std::unique_ptr<llvm::MemoryBuffer> Buffer;
+  uint32_t NumFunctions = 0;
+  // A description of the source of the profile used in error messages.
+  std::string Source;
+};
+
+}  // namespace llvm_cm
+
+#endif  // THIRD_PARTY_GEMATRIA_LLVM_CM_LIB_FREQUENCY_PROFILE_H_
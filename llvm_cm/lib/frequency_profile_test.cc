@@ -0,0 +1,214 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "llvm_cm/lib/frequency_profile.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace llvm_cm {
+namespace {
+
+using ::testing::AnyOf;
+using ::testing::ElementsAre;
+using ::testing::HasSubstr;
+
+// The offsets of the fields in the binary format; see the comment of
+// FrequencyProfile.
+constexpr size_t kVersionOffset = 8;
+constexpr size_t kHeaderSize = 16;
+constexpr size_t kEntrySize = 24;
+constexpr size_t kNameOffsetInEntry = 0;
+constexpr size_t kFrequenciesOffsetInEntry = 16;
+
+// Returns the frequencies of `Span` as a vector.
+std::vector<double> toVector(const FrequencySpan &Span) {
+  std::vector<double> Values;
+  for (size_t BB = 0; BB < Span.size(); ++BB) Values.push_back(Span[BB]);
+  return Values;
+}
+
+BBFreqMap createFrequencies() {
+  BBFreqMap Frequencies;
+  Frequencies["f2"] = {1.0};
+  Frequencies["f1"] = {1.0, BBFreq(), 0.5};
+  Frequencies["main"] = {0.25, 0.75};
+  return Frequencies;
+}
+
+llvm::Expected<std::unique_ptr<FrequencyProfile>> createFromString(
+    llvm::StringRef Contents) {
+  return FrequencyProfile::create(
+      llvm::MemoryBuffer::getMemBufferCopy(Contents), "test profile");
+}
+
+// Returns the error message of `Profile`, or an empty string when it is not an
+// error.
+std::string errorMessage(
+    llvm::Expected<std::unique_ptr<FrequencyProfile>> Profile) {
+  if (Profile) return "";
+  return llvm::toString(Profile.takeError());
+}
+
+void checkFrequencies(const FrequencyProfile &Profile) {
+  ASSERT_EQ(Profile.size(), 3);
+  // The functions are sorted by name.
+  EXPECT_EQ(Profile.name(0), "f1");
+  EXPECT_EQ(Profile.name(1), "f2");
+  EXPECT_EQ(Profile.name(2), "main");
+  EXPECT_THAT(toVector(Profile.frequencies(0)),
+              ElementsAre(1.0, BBFreq::Invalid, 0.5));
+
+  const std::optional<FrequencySpan> F2 = Profile.lookup("f2");
+  ASSERT_TRUE(F2.has_value());
+  EXPECT_THAT(toVector(*F2), ElementsAre(1.0));
+  const std::optional<FrequencySpan> Main = Profile.lookup("main");
+  ASSERT_TRUE(Main.has_value());
+  EXPECT_THAT(toVector(*Main), ElementsAre(0.25, 0.75));
+
+  EXPECT_EQ(Profile.lookup("f"), std::nullopt);
+  EXPECT_EQ(Profile.lookup("f3"), std::nullopt);
+  EXPECT_EQ(Profile.lookup("zzz"), std::nullopt);
+  EXPECT_EQ(Profile.lookup(""), std::nullopt);
+}
+
+TEST(FrequencyProfileTest, FromMap) {
+  llvm::Expected<std::unique_ptr<FrequencyProfile>> Profile =
+      FrequencyProfile::fromMap(createFrequencies());
+  ASSERT_TRUE(static_cast<bool>(Profile)) << toString(Profile.takeError());
+  EXPECT_EQ((*Profile)->source(), "CSV file");
+  checkFrequencies(**Profile);
+}
+
+TEST(FrequencyProfileTest, EmptyProfile) {
+  llvm::Expected<std::unique_ptr<FrequencyProfile>> Profile =
+      FrequencyProfile::fromMap(BBFreqMap());
+  ASSERT_TRUE(static_cast<bool>(Profile)) << toString(Profile.takeError());
+  EXPECT_EQ((*Profile)->size(), 0);
+  EXPECT_EQ((*Profile)->lookup("main"), std::nullopt);
+}
+
+TEST(FrequencyProfileTest, FromBinaryFile) {
+  llvm::SmallString<128> FileName;
+  ASSERT_FALSE(llvm::sys::fs::createTemporaryFile("frequency_profile_test",
+                                                  "profile", FileName));
+  {
+    std::error_code EC;
+    llvm::raw_fd_ostream OS(FileName, EC);
+    ASSERT_FALSE(EC);
+    OS << FrequencyProfile::serialize(createFrequencies());
+  }
+  llvm::Expected<std::unique_ptr<FrequencyProfile>> Profile =
+      FrequencyProfile::fromBinaryFile(FileName);
+  ASSERT_TRUE(static_cast<bool>(Profile)) << toString(Profile.takeError());
+  EXPECT_EQ((*Profile)->source(), ("profile file " + FileName).str());
+  checkFrequencies(**Profile);
+  llvm::sys::fs::remove(FileName);
+}
+
+TEST(FrequencyProfileTest, MissingFile) {
+  EXPECT_THAT(errorMessage(FrequencyProfile::fromBinaryFile(
+                  "/nonexistent/frequency_profile_test.profile")),
+              HasSubstr("failed to open file"));
+}
+
+TEST(FrequencyProfileTest, NotAProfile) {
+  EXPECT_THAT(errorMessage(createFromString("")),
+              HasSubstr("Not a binary profile: test profile"));
+  EXPECT_THAT(errorMessage(createFromString("main,0,1.000000e+00\n")),
+              HasSubstr("Not a binary profile"));
+
+  std::string Contents = FrequencyProfile::serialize(createFrequencies());
+  Contents[0] = 'X';
+  EXPECT_THAT(errorMessage(createFromString(Contents)),
+              HasSubstr("Not a binary profile"));
+}
+
+TEST(FrequencyProfileTest, UnsupportedVersion) {
+  std::string Contents = FrequencyProfile::serialize(createFrequencies());
+  llvm::support::endian::write32le(&Contents[kVersionOffset],
+                                   FrequencyProfile::Version + 1);
+  EXPECT_THAT(errorMessage(createFromString(Contents)),
+              HasSubstr("Unsupported version of the binary profile"));
+}
+
+TEST(FrequencyProfileTest, Truncated) {
+  const std::string Contents = FrequencyProfile::serialize(createFrequencies());
+  // The frequencies of the last function are at the end of the data, so every
+  // prefix of the profile is missing some of the data.
+  for (size_t Size = 0; Size < Contents.size(); ++Size) {
+    SCOPED_TRACE(Size);
+    EXPECT_THAT(
+        errorMessage(
+            createFromString(llvm::StringRef(Contents).take_front(Size))),
+        AnyOf(HasSubstr("Not a binary profile"),
+              HasSubstr("Truncated binary profile")));
+  }
+}
+
+TEST(FrequencyProfileTest, OffsetsOutOfBounds) {
+  const std::string Contents = FrequencyProfile::serialize(createFrequencies());
+  for (const size_t Field : {kNameOffsetInEntry, kFrequenciesOffsetInEntry}) {
+    SCOPED_TRACE(Field);
+    std::string Corrupted = Contents;
+    llvm::support::endian::write64le(
+        &Corrupted[kHeaderSize + kEntrySize + Field], Contents.size() - 1);
+    EXPECT_THAT(errorMessage(createFromString(Corrupted)),
+                HasSubstr("Truncated binary profile"));
+    // An offset that overflows when the size is added to it.
+    llvm::support::endian::write64le(
+        &Corrupted[kHeaderSize + kEntrySize + Field], ~uint64_t{0});
+    EXPECT_THAT(errorMessage(createFromString(Corrupted)),
+                HasSubstr("Truncated binary profile"));
+  }
+}
+
+TEST(FrequencyProfileTest, TooManyFunctions) {
+  std::string Contents = FrequencyProfile::serialize(createFrequencies());
+  llvm::support::endian::write32le(&Contents[kVersionOffset + 4], 0xffffffff);
+  EXPECT_THAT(errorMessage(createFromString(Contents)),
+              HasSubstr("Truncated binary profile"));
+}
+
+TEST(FrequencyProfileTest, UnsortedFunctions) {
+  std::string Contents = FrequencyProfile::serialize(createFrequencies());
+  // Point the name of the second function ("f2") to the name of the first one
+  // ("f1"), so that the names are not strictly increasing.
+  const uint64_t FirstNameOffset = llvm::support::endian::read64le(
+      &Contents[kHeaderSize + kNameOffsetInEntry]);
+  llvm::support::endian::write64le(
+      &Contents[kHeaderSize + kEntrySize + kNameOffsetInEntry],
+      FirstNameOffset);
+  EXPECT_THAT(errorMessage(createFromString(Contents)),
+              HasSubstr("Corrupted binary profile: test profile"));
+}
+
+}  // namespace
+}  // namespace llvm_cm
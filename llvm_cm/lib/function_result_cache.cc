@@ -0,0 +1,249 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "llvm_cm/lib/function_result_cache.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/ADT/bit.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/ErrorOr.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+
+namespace llvm_cm {
+namespace {
+
+// The size of a block in the file.
+constexpr size_t kBlockSize = 8 + 4 + 4;
+
+void appendUInt32(std::string &Out, uint32_t Value) {
+  char Bytes[4];
+  llvm::support::endian::write32le(Bytes, Value);
+  Out.append(Bytes, sizeof(Bytes));
+}
+
+void appendUInt64(std::string &Out, uint64_t Value) {
+  char Bytes[8];
+  llvm::support::endian::write64le(Bytes, Value);
+  Out.append(Bytes, sizeof(Bytes));
+}
+
+bool readUInt32(llvm::StringRef &Contents, uint32_t &Value) {
+  if (Contents.size() < 4) return false;
+  Value = llvm::support::endian::read32le(Contents.data());
+  Contents = Contents.drop_front(4);
+  return true;
+}
+
+bool readUInt64(llvm::StringRef &Contents, uint64_t &Value) {
+  if (Contents.size() < 8) return false;
+  Value = llvm::support::endian::read64le(Contents.data());
+  Contents = Contents.drop_front(8);
+  return true;
+}
+
+llvm::Error makeError(const llvm::Twine &Message) {
+  return llvm::make_error<llvm::StringError>(
+      Message, llvm::errc::invalid_argument);
+}
+
+}  // namespace
+
+FunctionResultCache::FunctionResultCache(llvm::StringRef FileName,
+                                         llvm::StringRef Configuration)
+    : FileName(FileName.str()),
+      ConfigurationHash(llvm::xxHash64(Configuration)) {}
+
+llvm::Error FunctionResultCache::load() {
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> FileOrErr =
+      llvm::MemoryBuffer::getFile(FileName, /*IsText=*/false,
+                                  /*RequiresNullTerminator=*/false);
+  if (!FileOrErr) {
+    if (FileOrErr.getError() == std::errc::no_such_file_or_directory) {
+      return llvm::Error::success();
+    }
+    return llvm::make_error<llvm::StringError>(
+        "failed to open file " + FileName, FileOrErr.getError());
+  }
+  return parse((*FileOrErr)->getBuffer());
+}
+
+llvm::Error FunctionResultCache::parse(llvm::StringRef Contents) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  Entries.clear();
+  llvm::Error Err = parseLocked(Contents);
+  if (Err) Entries.clear();
+  return Err;
+}
+
+llvm::Error FunctionResultCache::parseLocked(llvm::StringRef Contents) {
+  if (!Contents.consume_front(Magic)) {
+    return makeError("Not a result cache file");
+  }
+  uint32_t FileVersion = 0;
+  uint64_t NumEntries = 0;
+  if (!readUInt32(Contents, FileVersion) ||
+      !readUInt64(Contents, NumEntries)) {
+    return makeError("Truncated result cache file");
+  }
+  if (FileVersion != Version) {
+    return makeError("Unsupported version of the result cache file: " +
+                     llvm::Twine(FileVersion));
+  }
+  for (uint64_t I = 0; I < NumEntries; ++I) {
+    uint64_t Key = 0;
+    uint32_t NumBlocks = 0;
+    // Checking the size first avoids allocating a huge vector for a corrupted
+    // file.
+    if (!readUInt64(Contents, Key) || !readUInt32(Contents, NumBlocks) ||
+        Contents.size() / kBlockSize < NumBlocks) {
+      return makeError("Truncated result cache file");
+    }
+    std::vector<Block> &Blocks = Entries[Key].Blocks;
+    Blocks.resize(NumBlocks);
+    for (Block &B : Blocks) {
+      uint32_t HasPrediction = 0;
+      uint32_t Cost = 0;
+      readUInt64(Contents, B.BB);
+      readUInt32(Contents, HasPrediction);
+      readUInt32(Contents, Cost);
+      B.HasPrediction = HasPrediction != 0;
+      B.Cost = llvm::bit_cast<float>(Cost);
+    }
+  }
+  if (!Contents.empty()) {
+    return makeError("Unexpected data at the end of the result cache file");
+  }
+  return llvm::Error::success();
+}
+
+std::string FunctionResultCache::serialize() const {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  std::vector<uint64_t> Keys;
+  for (const auto &[Key, Entry] : Entries) {
+    if (Entry.Used) Keys.push_back(Key);
+  }
+  // The keys are sorted, so that the file does not depend on the order of the
+  // entries in the hash map.
+  llvm::sort(Keys);
+
+  std::string Contents = Magic.str();
+  appendUInt32(Contents, Version);
+  appendUInt64(Contents, Keys.size());
+  for (const uint64_t Key : Keys) {
+    const std::vector<Block> &Blocks = Entries.find(Key)->second.Blocks;
+    appendUInt64(Contents, Key);
+    appendUInt32(Contents, Blocks.size());
+    for (const Block &B : Blocks) {
+      appendUInt64(Contents, B.BB);
+      appendUInt32(Contents, B.HasPrediction);
+      appendUInt32(Contents, llvm::bit_cast<uint32_t>(B.Cost));
+    }
+  }
+  return Contents;
+}
+
+uint64_t FunctionResultCache::computeKey(
+    llvm::ArrayRef<uint8_t> FunctionBytes, uint64_t FunctionAddr,
+    llvm::ArrayRef<std::pair<uint64_t, uint64_t>> Labels) const {
+  // The labels are made relative to the start of the function, so that the
+  // key does not depend on the address of the function. They are also sorted
+  // by the BB ID at each address, so that the key does not depend on the
+  // order of the BB address map entries.
+  std::vector<std::pair<uint64_t, uint64_t>> SortedLabels;
+  SortedLabels.reserve(Labels.size());
+  for (const auto &[Addr, ID] : Labels) {
+    SortedLabels.emplace_back(Addr - FunctionAddr, ID);
+  }
+  llvm::sort(SortedLabels);
+
+  std::string KeyData;
+  appendUInt64(KeyData, ConfigurationHash);
+  appendUInt64(KeyData, FunctionBytes.size());
+  KeyData.append(FunctionBytes.begin(), FunctionBytes.end());
+  for (const auto &[Offset, ID] : SortedLabels) {
+    appendUInt64(KeyData, Offset);
+    appendUInt64(KeyData, ID);
+  }
+  return llvm::xxHash64(KeyData);
+}
+
+std::optional<std::vector<FunctionResultCache::Block>>
+FunctionResultCache::lookup(uint64_t Key) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto It = Entries.find(Key);
+  if (It == Entries.end()) {
+    ++NumMisses;
+    return std::nullopt;
+  }
+  ++NumHits;
+  It->second.Used = true;
+  return It->second.Blocks;
+}
+
+void FunctionResultCache::insert(uint64_t Key, std::vector<Block> Blocks) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  Entries[Key] = {std::move(Blocks), /*Used=*/true};
+}
+
+llvm::Error FunctionResultCache::write() const {
+  const std::string Contents = serialize();
+  auto MakeWriteError = [this](std::error_code EC) {
+    return llvm::make_error<llvm::StringError>(
+        "could not write the result cache " + FileName + ": " + EC.message(),
+        EC);
+  };
+
+  int FD = -1;
+  llvm::SmallString<128> TempFileName;
+  if (std::error_code EC = llvm::sys::fs::createUniqueFile(
+          FileName + ".tmp%%%%%%", FD, TempFileName)) {
+    return MakeWriteError(EC);
+  }
+  {
+    llvm::raw_fd_ostream OS(FD, /*shouldClose=*/true);
+    OS << Contents;
+    OS.close();
+    if (OS.has_error()) {
+      const std::error_code EC = OS.error();
+      OS.clear_error();
+      llvm::sys::fs::remove(TempFileName);
+      return MakeWriteError(EC);
+    }
+  }
+  if (std::error_code EC = llvm::sys::fs::rename(TempFileName, FileName)) {
+    llvm::sys::fs::remove(TempFileName);
+    return MakeWriteError(EC);
+  }
+  return llvm::Error::success();
+}
+
+}  // namespace llvm_cm
@@ -0,0 +1,137 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains the persistent cache of the GRANITE predictions for whole functions
+// used by llvm-cm (see -granite_result_cache), and its file format.
+
+#ifndef THIRD_PARTY_GEMATRIA_LLVM_CM_LIB_FUNCTION_RESULT_CACHE_H_
+#define THIRD_PARTY_GEMATRIA_LLVM_CM_LIB_FUNCTION_RESULT_CACHE_H_
+
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+
+namespace llvm_cm {
+
+// A persistent cache of the GRANITE predictions for whole functions. Each entry
+// is keyed by a hash of the bytes of the function, its basic block address map
+// and the configuration of the evaluation (the CPU, the model and the task
+// number), and it contains the BB IDs of the function in the order in which
+// they are evaluated with the predicted cost of each of them. The latency of a
+// function found in the cache is computed from these costs and the frequencies
+// from the current profile.
+//
+// The cache is loaded from a file at the beginning of the run and written back
+// at the end; only the entries used or added during the run are written, so
+// the file does not grow with entries for functions that no longer exist. The
+// file format is the magic string, the format version (4 bytes), the number of
+// entries (8 bytes), and for each entry its key (8 bytes), the number of
+// blocks (4 bytes) and for each block its BB ID (8 bytes), a flag whether the
+// block has a prediction (4 bytes) and the predicted cost as a float (4 bytes).
+// All numbers are little-endian. The cache is thread-safe.
+class FunctionResultCache final {
+ public:
+  static constexpr llvm::StringRef Magic = "LLVMCMRC";
+  static constexpr uint32_t Version = 1;
+
+  struct Block {
+    uint64_t BB = 0;
+    // False when the BB has no instructions evaluated by the model; such BBs
+    // contribute nothing to the latency, but their frequency must still be in
+    // the profile.
+    bool HasPrediction = false;
+    float Cost = 0.0f;
+
+    friend bool operator==(const Block &A, const Block &B) {
+      return A.BB == B.BB && A.HasPrediction == B.HasPrediction &&
+             A.Cost == B.Cost;
+    }
+  };
+
+  // Creates an empty cache backed by `FileName`. `Configuration` identifies
+  // the evaluation settings, and it is a part of all keys.
+  FunctionResultCache(llvm::StringRef FileName, llvm::StringRef Configuration);
+
+  // Loads the entries from the file. A file that does not exist is treated as
+  // an empty cache. Returns an error when the file can't be read or it is not
+  // a valid cache file; the cache is then empty.
+  llvm::Error load();
+
+  // Replaces the entries of the cache with the entries from `Contents` in the
+  // file format. Returns an error when `Contents` is not a valid cache file or
+  // it was written by a different version of the tool; the cache is then
+  // empty. The loaded entries are written back only when they are used.
+  llvm::Error parse(llvm::StringRef Contents);
+
+  // Returns the entries used or added during this run in the file format.
+  std::string serialize() const;
+
+  // Returns the key of the function in `FunctionBytes` that starts at
+  // `FunctionAddr`, with the basic block labels from `Labels`: pairs of the
+  // address of a basic block and its BB ID.
+  uint64_t computeKey(
+      llvm::ArrayRef<uint8_t> FunctionBytes, uint64_t FunctionAddr,
+      llvm::ArrayRef<std::pair<uint64_t, uint64_t>> Labels) const;
+
+  // Returns the blocks of the function with the given key, or std::nullopt
+  // when the function is not in the cache.
+  std::optional<std::vector<Block>> lookup(uint64_t Key);
+
+  void insert(uint64_t Key, std::vector<Block> Blocks);
+
+  // Writes the entries used or added during this run to the file. The file is
+  // replaced atomically.
+  llvm::Error write() const;
+
+  int64_t numHits() const {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    return NumHits;
+  }
+  int64_t numMisses() const {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    return NumMisses;
+  }
+
+ private:
+  struct Entry {
+    std::vector<Block> Blocks;
+    // True when the entry was used or added during this run.
+    bool Used = false;
+  };
+
+  // Same as parse(), but requires that `Mutex` is held and does not clear the
+  // entries on error.
+  llvm::Error parseLocked(llvm::StringRef Contents);
+
+  const std::string FileName;
+  const uint64_t ConfigurationHash;
+
+  mutable std::mutex Mutex;
+  // Guarded by `Mutex`.
+  std::unordered_map<uint64_t, Entry> Entries;
+  int64_t NumHits = 0;
+  int64_t NumMisses = 0;
+};
+
+}  // namespace llvm_cm
+
+#endif  // THIRD_PARTY_GEMATRIA_LLVM_CM_LIB_FUNCTION_RESULT_CACHE_H_
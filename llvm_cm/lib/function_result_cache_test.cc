@@ -0,0 +1,245 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "llvm_cm/lib/function_result_cache.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace llvm_cm {
+namespace {
+
+using ::testing::AnyOf;
+using ::testing::ElementsAre;
+using ::testing::HasSubstr;
+using ::testing::Optional;
+
+using Block = FunctionResultCache::Block;
+using Labels = std::vector<std::pair<uint64_t, uint64_t>>;
+
+// The offsets of the fields in the file format; see the comment of
+// FunctionResultCache.
+constexpr size_t kVersionOffset = 8;
+constexpr size_t kNumEntriesOffset = 12;
+constexpr size_t kFirstNumBlocksOffset = 20 + 8;
+
+constexpr uint64_t kFirstKey = 1;
+constexpr uint64_t kSecondKey = 2;
+
+const std::vector<Block> &firstBlocks() {
+  static const auto *const Blocks = new std::vector<Block>{
+      {.BB = 0, .HasPrediction = true, .Cost = 1.5f},
+      {.BB = 2, .HasPrediction = false, .Cost = 0.0f},
+      {.BB = 1, .HasPrediction = true, .Cost = 0.25f}};
+  return *Blocks;
+}
+
+const std::vector<Block> &secondBlocks() {
+  static const auto *const Blocks = new std::vector<Block>{
+      {.BB = 7, .HasPrediction = true, .Cost = 12.0f}};
+  return *Blocks;
+}
+
+// Returns the contents of a cache file with the entries from firstBlocks() and
+// secondBlocks().
+std::string createContents() {
+  FunctionResultCache Cache("unused", "configuration");
+  Cache.insert(kFirstKey, firstBlocks());
+  Cache.insert(kSecondKey, secondBlocks());
+  return Cache.serialize();
+}
+
+// Returns the error message of `Err`, or an empty string when it is not an
+// error.
+std::string errorMessage(llvm::Error Err) {
+  if (!Err) return "";
+  return llvm::toString(std::move(Err));
+}
+
+TEST(FunctionResultCacheTest, InsertAndLookup) {
+  FunctionResultCache Cache("unused", "configuration");
+  EXPECT_EQ(Cache.lookup(kFirstKey), std::nullopt);
+  Cache.insert(kFirstKey, firstBlocks());
+  EXPECT_THAT(Cache.lookup(kFirstKey), Optional(firstBlocks()));
+  EXPECT_EQ(Cache.lookup(kSecondKey), std::nullopt);
+  EXPECT_EQ(Cache.numHits(), 1);
+  EXPECT_EQ(Cache.numMisses(), 2);
+}
+
+TEST(FunctionResultCacheTest, SerializeAndParse) {
+  FunctionResultCache Cache("unused", "configuration");
+  ASSERT_EQ(errorMessage(Cache.parse(createContents())), "");
+  EXPECT_THAT(Cache.lookup(kFirstKey), Optional(firstBlocks()));
+  EXPECT_THAT(Cache.lookup(kSecondKey), Optional(secondBlocks()));
+  // The order of the entries in the file does not depend on the order in which
+  // they were used.
+  EXPECT_EQ(Cache.serialize(), createContents());
+}
+
+TEST(FunctionResultCacheTest, SerializesOnlyUsedEntries) {
+  FunctionResultCache Cache("unused", "configuration");
+  ASSERT_EQ(errorMessage(Cache.parse(createContents())), "");
+  // None of the parsed entries was used yet.
+  FunctionResultCache Empty("unused", "configuration");
+  EXPECT_EQ(Cache.serialize(), Empty.serialize());
+
+  EXPECT_THAT(Cache.lookup(kSecondKey), Optional(secondBlocks()));
+  FunctionResultCache Reparsed("unused", "configuration");
+  ASSERT_EQ(errorMessage(Reparsed.parse(Cache.serialize())), "");
+  EXPECT_EQ(Reparsed.lookup(kFirstKey), std::nullopt);
+  EXPECT_THAT(Reparsed.lookup(kSecondKey), Optional(secondBlocks()));
+}
+
+TEST(FunctionResultCacheTest, WriteAndLoad) {
+  llvm::SmallString<128> FileName;
+  ASSERT_FALSE(llvm::sys::fs::createTemporaryFile("function_result_cache_test",
+                                                  "cache", FileName));
+  {
+    FunctionResultCache Cache(FileName, "configuration");
+    Cache.insert(kFirstKey, firstBlocks());
+    ASSERT_EQ(errorMessage(Cache.write()), "");
+  }
+  FunctionResultCache Cache(FileName, "configuration");
+  ASSERT_EQ(errorMessage(Cache.load()), "");
+  EXPECT_THAT(Cache.lookup(kFirstKey), Optional(firstBlocks()));
+  EXPECT_EQ(Cache.lookup(kSecondKey), std::nullopt);
+  llvm::sys::fs::remove(FileName);
+}
+
+TEST(FunctionResultCacheTest, LoadMissingFile) {
+  FunctionResultCache Cache("/nonexistent/function_result_cache_test.cache",
+                            "configuration");
+  EXPECT_EQ(errorMessage(Cache.load()), "");
+  EXPECT_EQ(Cache.lookup(kFirstKey), std::nullopt);
+}
+
+TEST(FunctionResultCacheTest, WriteToMissingDirectory) {
+  FunctionResultCache Cache("/nonexistent/function_result_cache_test.cache",
+                            "configuration");
+  Cache.insert(kFirstKey, firstBlocks());
+  EXPECT_THAT(errorMessage(Cache.write()),
+              HasSubstr("could not write the result cache"));
+}
+
+TEST(FunctionResultCacheTest, NotACacheFile) {
+  FunctionResultCache Cache("unused", "configuration");
+  EXPECT_THAT(errorMessage(Cache.parse("")),
+              HasSubstr("Not a result cache file"));
+  std::string Contents = createContents();
+  Contents[0] = 'X';
+  EXPECT_THAT(errorMessage(Cache.parse(Contents)),
+              HasSubstr("Not a result cache file"));
+}
+
+TEST(FunctionResultCacheTest, UnsupportedVersion) {
+  std::string Contents = createContents();
+  llvm::support::endian::write32le(&Contents[kVersionOffset],
+                                   FunctionResultCache::Version + 1);
+  FunctionResultCache Cache("unused", "configuration");
+  EXPECT_THAT(errorMessage(Cache.parse(Contents)),
+              HasSubstr("Unsupported version of the result cache file"));
+}
+
+TEST(FunctionResultCacheTest, Truncated) {
+  const std::string Contents = createContents();
+  for (size_t Size = 0; Size < Contents.size(); ++Size) {
+    SCOPED_TRACE(Size);
+    FunctionResultCache Cache("unused", "configuration");
+    EXPECT_THAT(
+        errorMessage(Cache.parse(llvm::StringRef(Contents).take_front(Size))),
+        AnyOf(HasSubstr("Not a result cache file"),
+              HasSubstr("Truncated result cache file")));
+    // The entries parsed before the error are dropped.
+    EXPECT_EQ(Cache.lookup(kFirstKey), std::nullopt);
+  }
+}
+
+TEST(FunctionResultCacheTest, TrailingData) {
+  FunctionResultCache Cache("unused", "configuration");
+  EXPECT_THAT(errorMessage(Cache.parse(createContents() + "x")),
+              HasSubstr("Unexpected data at the end"));
+  EXPECT_EQ(Cache.lookup(kFirstKey), std::nullopt);
+}
+
+TEST(FunctionResultCacheTest, CorruptedCounts) {
+  FunctionResultCache Cache("unused", "configuration");
+  // A huge number of blocks is rejected before the blocks are allocated.
+  std::string Contents = createContents();
+  llvm::support::endian::write32le(&Contents[kFirstNumBlocksOffset],
+                                   0xffffffff);
+  EXPECT_THAT(errorMessage(Cache.parse(Contents)),
+              HasSubstr("Truncated result cache file"));
+
+  Contents = createContents();
+  llvm::support::endian::write64le(&Contents[kNumEntriesOffset], 3);
+  EXPECT_THAT(errorMessage(Cache.parse(Contents)),
+              HasSubstr("Truncated result cache file"));
+  llvm::support::endian::write64le(&Contents[kNumEntriesOffset], 1);
+  EXPECT_THAT(errorMessage(Cache.parse(Contents)),
+              HasSubstr("Unexpected data at the end"));
+}
+
+TEST(FunctionResultCacheTest, ParseErrorClearsEntries) {
+  FunctionResultCache Cache("unused", "configuration");
+  Cache.insert(kFirstKey, firstBlocks());
+  EXPECT_NE(errorMessage(Cache.parse("invalid")), "");
+  EXPECT_EQ(Cache.lookup(kFirstKey), std::nullopt);
+}
+
+TEST(FunctionResultCacheTest, ComputeKey) {
+  const FunctionResultCache Cache("unused", "configuration");
+  const uint8_t Bytes[] = {0x48, 0x89, 0xf8, 0xc3};
+  const uint64_t Key =
+      Cache.computeKey(Bytes, 0x1000, Labels{{0x1000, 0}, {0x1003, 1}});
+
+  // The key does not depend on the address of the function, or on the order
+  // of the BB IDs at the same address.
+  EXPECT_EQ(Cache.computeKey(Bytes, 0x2000, Labels{{0x2000, 0}, {0x2003, 1}}),
+            Key);
+  const uint64_t SameAddressKey = Cache.computeKey(
+      Bytes, 0x1000, Labels{{0x1000, 0}, {0x1000, 2}, {0x1003, 1}});
+  EXPECT_EQ(Cache.computeKey(Bytes, 0x1000,
+                             Labels{{0x1000, 2}, {0x1000, 0}, {0x1003, 1}}),
+            SameAddressKey);
+
+  // The key depends on the bytes, the labels and the configuration.
+  const uint8_t OtherBytes[] = {0x48, 0x89, 0xf0, 0xc3};
+  EXPECT_NE(Cache.computeKey(OtherBytes, 0x1000,
+                             Labels{{0x1000, 0}, {0x1003, 1}}),
+            Key);
+  EXPECT_NE(Cache.computeKey(Bytes, 0x1000, Labels{{0x1000, 0}, {0x1002, 1}}),
+            Key);
+  EXPECT_NE(SameAddressKey, Key);
+  const FunctionResultCache OtherCache("unused", "other configuration");
+  EXPECT_NE(OtherCache.computeKey(Bytes, 0x1000,
+                                  Labels{{0x1000, 0}, {0x1003, 1}}),
+            Key);
+}
+
+}  // namespace
+}  // namespace llvm_cm
@@ -2,6 +2,59 @@
 # RUN: llvm-mc -o %t.o --filetype=obj -triple=x86_64-unknown-linux-gnu %s
 # RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite | FileCheck %s
 # RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=count | FileCheck %s --check-prefix=CHECK-COUNT
+## The output of the parallel evaluation is in the same order.
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -j=4 | FileCheck %s
+## The workers may share fewer GRANITE interpreters than there are workers.
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -j=4 -granite_inference_workers=1 | FileCheck %s
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=count -j=4 | FileCheck %s --check-prefix=CHECK-COUNT
+## The padding added by shape bucketing does not change the predictions.
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -granite_shape_bucketing | FileCheck %s
+## Splitting the basic blocks into small batches does not change the
+## predictions; with one node per batch, each basic block is evaluated alone.
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -granite_max_nodes_per_batch=1 | FileCheck %s
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -granite_max_nodes_per_batch=64 -granite_max_edges_per_batch=64 -j=2 | FileCheck %s
+## A prediction cache that is too small for all the basic blocks evicts
+## predictions, but does not change them.
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -granite_cache_size=2 | FileCheck %s
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -granite_cache_size=2 -j=4 | FileCheck %s
+## The streaming mode that processes one text section at a time gives the same
+## results.
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -streaming | FileCheck %s
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -evaluator=count -streaming -j=4 | FileCheck %s --check-prefix=CHECK-COUNT
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -streaming -granite_cross_function_batch_blocks=16 -j=2 | FileCheck %s
+## The scheduling model evaluator reports a latency for every function; the
+## exact values depend on the scheduling model of the host CPU. sched-model.s
+## checks exact values for a pinned CPU.
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -evaluator=sched | FileCheck %s --check-prefix=CHECK-SCHED
+# RUN: not llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -evaluator=sched -mcpu=i386 2>&1 | FileCheck %s --check-prefix=CHECK-SCHED-NO-MODEL
+## With --hot_coverage, the latency of each function is the sum of the latencies
+## of its hot and cold basic blocks.
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -evaluator=count -hot_coverage=0.9 -cold_evaluator=count | FileCheck %s --check-prefix=CHECK-COUNT
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -hot_coverage=0.9 -cold_evaluator=sched | FileCheck %s --check-prefix=CHECK-SCHED
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -hot_coverage=0.9 -granite_cross_function_batch_blocks=16 -j=2 | FileCheck %s --check-prefix=CHECK-SCHED
+# RUN: not llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -evaluator=count -hot_coverage=0 2>&1 | FileCheck %s --check-prefix=CHECK-HOT-INVALID
+## --time_trace writes the phases of the evaluation as Chrome trace events.
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -time_trace=%t.json | FileCheck %s
+# RUN: FileCheck %s --input-file=%t.json --check-prefix=CHECK-TRACE
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -time_trace=%t.json -j=2 | FileCheck %s
+# RUN: FileCheck %s --input-file=%t.json --check-prefix=CHECK-TRACE
+## Evaluating the blocks of multiple functions in one batch gives the same results.
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -granite_cross_function_batch_blocks=16 | FileCheck %s
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -granite_cross_function_batch_blocks=1000 -j=2 | FileCheck %s
+## The second run takes all functions from the result cache; the results are the same.
+# RUN: rm -f %t.cache
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -granite_result_cache=%t.cache | FileCheck %s
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -granite_result_cache=%t.cache | FileCheck %s
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -granite_result_cache=%t.cache -granite_cross_function_batch_blocks=16 -j=2 | FileCheck %s
+## The result cache keeps the predictions of the selected task: with a
+## non-default -task_number, the cold and the warm run print the same latencies
+## as a run without the cache.
+# RUN: rm -f %t.task0.cache
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -task_number=0 > %t.task0.out
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -task_number=0 -granite_result_cache=%t.task0.cache > %t.task0.cold
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -task_number=0 -granite_result_cache=%t.task0.cache > %t.task0.warm
+# RUN: diff %t.task0.out %t.task0.cold
+# RUN: diff %t.task0.cold %t.task0.warm
 
 
 # CHECK:      <reverse>:
@@ -31,6 +84,32 @@
 # CHECK-COUNT: <main>:
 # CHECK-COUNT: Calculated Frequency: 2.346250e+02
 
+# CHECK-SCHED:      <reverse>:
+# CHECK-SCHED-NEXT: Calculated Frequency: {{[0-9]\.[0-9]+e[+-][0-9]+}}
+# CHECK-SCHED-NEXT: <tallestBillboard>:
+# CHECK-SCHED-NEXT: Calculated Frequency: {{[0-9]\.[0-9]+e[+-][0-9]+}}
+# CHECK-SCHED-NEXT: <isMatch>:
+# CHECK-SCHED-NEXT: Calculated Frequency: {{[0-9]\.[0-9]+e[+-][0-9]+}}
+# CHECK-SCHED-NEXT: <bubbleSort>:
+# CHECK-SCHED-NEXT: Calculated Frequency: {{[0-9]\.[0-9]+e[+-][0-9]+}}
+# CHECK-SCHED-NEXT: <isPrime>:
+# CHECK-SCHED-NEXT: Calculated Frequency: {{[0-9]\.[0-9]+e[+-][0-9]+}}
+# CHECK-SCHED-NEXT: <main>:
+# CHECK-SCHED-NEXT: Calculated Frequency: {{[0-9]\.[0-9]+e[+-][0-9]+}}
+
+# CHECK-SCHED-NO-MODEL: error: CPU 'i386' has no scheduling model
+
+# CHECK-HOT-INVALID: error: --hot_coverage must be in the range (0, 1]
+
+# CHECK-TRACE:     "traceEvents"
+# CHECK-TRACE-DAG: "name":"ReadProfile"
+# CHECK-TRACE-DAG: "name":"LoadGraniteModel"
+# CHECK-TRACE-DAG: "name":"EvaluateFunction","args":{"detail":"tallestBillboard"}
+# CHECK-TRACE-DAG: "name":"Disassemble"
+# CHECK-TRACE-DAG: "name":"Canonicalize"
+# CHECK-TRACE-DAG: "name":"GraniteInference"
+# CHECK-TRACE-DAG: "name":"Total EvaluateFunction","args":{"count":6,
+
  .text
  .file "test.c"
  .globl reverse                         # -- Begin function reverse
@@ -2,6 +2,10 @@
 # RUN: llvm-mc -o %t.o --filetype=obj -triple=x86_64-unknown-linux-gnu %t/profile-dump-test.s
 # RUN: llvm-cm %t.o --csv=%t/profile-dump-test.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite | FileCheck %t/profile-dump-test.s
 # RUN: llvm-cm %t.o --csv=%t/profile-dump-test.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=count | FileCheck %t/profile-dump-test.s --check-prefix=CHECK-COUNT
+## The binary profile converted from the CSV file gives the same results.
+# RUN: llvm-cm %t.o --csv=%t/profile-dump-test.csv --write_profile=%t.profile
+# RUN: llvm-cm %t.o --profile=%t.profile -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite | FileCheck %t/profile-dump-test.s
+# RUN: llvm-cm %t.o --profile=%t.profile -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=count | FileCheck %t/profile-dump-test.s --check-prefix=CHECK-COUNT
 
 //--- profile-dump-test.csv
 f2,0,1.000000e+00
@@ -0,0 +1,107 @@
+## LLVM-CM scheduling model evaluator test. The instructions are simple ALU
+## instructions and jumps whose scheduling information is the same in all
+## recent versions of the Skylake model: ADD, MOV and TEST have a reciprocal
+## throughput of 0.25, Jcc and JMP 0.5, and IMUL 1.0, all with a single
+## micro-op. The issue width is 6, so the cost of each basic block is the sum of
+## the reciprocal throughputs of its instructions.
+# REQUIRES: x86
+# RUN: split-file %s %t
+# RUN: llvm-mc -o %t.o --filetype=obj -triple=x86_64-unknown-linux-gnu %t/sched-model-test.s
+# RUN: llvm-cm %t.o --csv=%t/sched-model.csv -evaluator=sched -mcpu=skylake | FileCheck %t/sched-model-test.s --check-prefix=CHECK-SCHED
+# RUN: llvm-cm %t.o --csv=%t/sched-model.csv -evaluator=count | FileCheck %t/sched-model-test.s --check-prefix=CHECK-COUNT
+## With --hot_coverage, the hot and the cold basic blocks are evaluated with
+## different models, and the latency of the function is the sum of both.
+# RUN: llvm-cm %t.o --csv=%t/sched-model.csv -evaluator=sched -mcpu=skylake -hot_coverage=0.6 -cold_evaluator=count | FileCheck %t/sched-model-test.s --check-prefix=CHECK-HOT-SCHED
+# RUN: llvm-cm %t.o --csv=%t/sched-model.csv -evaluator=count -mcpu=skylake -hot_coverage=0.6 -cold_evaluator=sched | FileCheck %t/sched-model-test.s --check-prefix=CHECK-HOT-COUNT
+# RUN: llvm-cm %t.o --csv=%t/sched-model.csv -evaluator=sched -mcpu=skylake -hot_coverage=0.9 -cold_evaluator=count | FileCheck %t/sched-model-test.s --check-prefix=CHECK-HOT-SCHED-90
+## With the same model for both subsets, the result is the same as without
+## --hot_coverage.
+# RUN: llvm-cm %t.o --csv=%t/sched-model.csv -evaluator=sched -mcpu=skylake -hot_coverage=0.6 -cold_evaluator=sched | FileCheck %t/sched-model-test.s --check-prefix=CHECK-SCHED
+# RUN: llvm-cm %t.o --csv=%t/sched-model.csv -evaluator=count -hot_coverage=0.6 -cold_evaluator=count | FileCheck %t/sched-model-test.s --check-prefix=CHECK-COUNT
+
+//--- sched-model.csv
+main,0,1.000000e+00
+main,1,7.500000e-01
+main,2,2.500000e-01
+main,3,1.000000e+00
+
+//--- sched-model-test.s
+## BB 0: 3 * 0.25 + 0.5 = 1.25, BB 1: 1.0 + 0.25 + 0.5 = 1.75,
+## BB 2: 0.25 + 1.0 = 1.25, BB 3: 0.25 + 0.5 = 0.75.
+## 1.0 * 1.25 + 0.75 * 1.75 + 0.25 * 1.25 + 1.0 * 0.75 = 3.625.
+# CHECK-SCHED:      <main>:
+# CHECK-SCHED-NEXT: Calculated Frequency: 3.625000e+00
+
+## 1.0 * 4 + 0.75 * 3 + 0.25 * 2 + 1.0 * 2 = 8.75.
+# CHECK-COUNT:      <main>:
+# CHECK-COUNT-NEXT: Calculated Frequency: 8.750000e+00
+
+## The total frequency is 3.0. A coverage of 0.6 needs 1.8, which is reached by
+## the two blocks with frequency 1.0, so BBs 0 and 3 are hot and BBs 1 and 2
+## are cold.
+## Hot sched + cold count: (1.25 + 0.75) + (0.75 * 3 + 0.25 * 2) = 4.75.
+# CHECK-HOT-SCHED:      <main>:
+# CHECK-HOT-SCHED-NEXT: Calculated Frequency: 4.750000e+00
+## Hot count + cold sched: (4 + 2) + (0.75 * 1.75 + 0.25 * 1.25) = 7.625.
+# CHECK-HOT-COUNT:      <main>:
+# CHECK-HOT-COUNT-NEXT: Calculated Frequency: 7.625000e+00
+## A coverage of 0.9 needs 2.7, which also needs BB 1 with frequency 0.75; only
+## BB 2 is cold.
+## Hot sched + cold count: (1.25 + 0.75 * 1.75 + 0.75) + 0.25 * 2 = 3.8125.
+# CHECK-HOT-SCHED-90:      <main>:
+# CHECK-HOT-SCHED-90-NEXT: Calculated Frequency: 3.812500e+00
+
+ .text
+ .file "sched-model.ll"
+ .globl main                            # -- Begin function main
+ .p2align 4, 0x90
+ .type main,@function
+main:                                   # @main
+.Lfunc_begin0:
+ .cfi_startproc
+# %bb.0:                                # %entry
+ movl %edi, %eax
+ addl %esi, %eax
+ testl %eax, %eax
+ jle .LBB0_2
+.LBB_END0_0:
+.LBB0_1:                                # %is_pos
+ imull %esi, %eax
+ addl $10, %eax
+ jmp .LBB0_3
+.LBB_END0_1:
+.LBB0_2:                                # %is_neg
+ addl $-10, %eax
+ imull %edi, %eax
+.LBB_END0_2:
+.LBB0_3:                                # %loop
+ addl %edi, %eax
+ jmp .Lfunc_begin0
+.LBB_END0_3:
+.Lfunc_end0:
+ .size main, .Lfunc_end0-main
+ .cfi_endproc
+ .section .llvm_bb_addr_map,"o",@llvm_bb_addr_map,.text
+ .byte 2                               # version
+ .byte 0                               # feature
+ .quad .Lfunc_begin0                   # function address
+ .byte 4                               # number of basic blocks
+ .byte 0                               # BB id
+ .uleb128 .Lfunc_begin0-.Lfunc_begin0
+ .uleb128 .LBB_END0_0-.Lfunc_begin0
+ .byte 8
+ .byte 1                               # BB id
+ .uleb128 .LBB0_1-.LBB_END0_0
+ .uleb128 .LBB_END0_1-.LBB0_1
+ .byte 0
+ .byte 2                               # BB id
+ .uleb128 .LBB0_2-.LBB_END0_1
+ .uleb128 .LBB_END0_2-.LBB0_2
+ .byte 8
+ .byte 3                               # BB id
+ .uleb128 .LBB0_3-.LBB_END0_2
+ .uleb128 .LBB_END0_3-.LBB0_3
+ .byte 0
+ .text
+                                        # -- End function
+ .section ".note.GNU-stack","",@progbits
@@ -14,23 +14,32 @@
 #include <stdlib.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cinttypes>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <functional>
 #include <limits>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
 #include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/compact_basic_block.h"
+#include "gematria/basic_block/symbol_table.h"
 #include "gematria/granite/graph_builder_model_inference.h"
+#include "gematria/granite/graph_builder_model_inference_pool.h"
+#include "gematria/granite/prediction_cache.h"
 #include "gematria/llvm/canonicalizer.h"
 #include "llvm/ADT/ArrayRef.h"
-#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/MapVector.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/SmallString.h"
@@ -52,6 +61,7 @@
 #include "llvm/MC/MCInstrInfo.h"
 #include "llvm/MC/MCObjectFileInfo.h"
 #include "llvm/MC/MCRegisterInfo.h"
+#include "llvm/MC/MCSchedule.h"
 #include "llvm/MC/MCSubtargetInfo.h"
 #include "llvm/MC/MCTargetOptions.h"
 #include "llvm/MC/MCTargetOptionsCommandFlags.h"
@@ -72,13 +82,21 @@
 #include "llvm/Support/LineIterator.h"
 #include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/TimeProfiler.h"
 #include "llvm/Support/WithColor.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
 #include "llvm/Target/TargetMachine.h"
+#include "llvm_cm/lib/frequency_profile.h"
+#include "llvm_cm/lib/function_result_cache.h"
 #include "tensorflow/lite/model_builder.h"
 
 using namespace llvm;
 using namespace llvm::object;
+using llvm_cm::BBFreq;
+using llvm_cm::FrequencyProfile;
+using llvm_cm::FrequencySpan;
+using llvm_cm::FunctionResultCache;
 
 #define DEBUG_TYPE "llvm-cm"
 
@@ -95,15 +113,37 @@ static cl::opt<std::string> CPU("mcpu", cl::desc("Target a specific cpu type."),
                                 cl::init("skylake"),
                                 cl::value_desc("cpu-name"));
 
-enum class EvaluationType : int { Counter, Granite };
+enum class EvaluationType : int { Counter, SchedModel, Granite };
 static cl::opt<EvaluationType> EvaluationMethod(
     "evaluator", cl::desc("Choose llvm-cm latency output method: "),
     cl::init(EvaluationType::Counter),
     cl::values(clEnumValN(EvaluationType::Counter, "count",
                           "use weighted instruction counting"),
+               clEnumValN(EvaluationType::SchedModel, "sched",
+                          "use the reciprocal throughputs from the "
+                          "scheduling model of the CPU"),
                clEnumValN(EvaluationType::Granite, "granite",
                           "use GRANITE  model values")));
 
+static cl::opt<double> HotCoverage(
+    "hot_coverage", cl::init(1.0),
+    cl::desc("The share of the total frequency in the profile covered by the "
+             "basic blocks evaluated with --evaluator. The most frequent "
+             "basic blocks are selected; the other basic blocks are evaluated "
+             "with --cold_evaluator. 1 evaluates all basic blocks with "
+             "--evaluator."));
+
+static cl::opt<EvaluationType> ColdEvaluationMethod(
+    "cold_evaluator",
+    cl::desc("Choose the latency output method for the basic blocks not "
+             "selected by --hot_coverage: "),
+    cl::init(EvaluationType::Counter),
+    cl::values(clEnumValN(EvaluationType::Counter, "count",
+                          "use weighted instruction counting"),
+               clEnumValN(EvaluationType::SchedModel, "sched",
+                          "use the reciprocal throughputs from the "
+                          "scheduling model of the CPU")));
+
 static cl::opt<std::string> EvaluatorFilename(
     "granite_model", cl::desc("GRANITE tflite model file or any other model."),
     cl::value_desc("filename"));
@@ -112,26 +152,139 @@ static cl::opt<uint64_t> uArchTaskNumber(
     "task_number", cl::init(2),
     cl::desc("Specify uarch-specific task number if using GRANITE model"));
 
-static cl::opt<std::string> CSVFilename(
-    "csv",
-    cl::desc("CSV file name, for basic block frequencies. llvm-cm requires "
-             "profile information as a csv file."),
-    cl::value_desc("filename"), cl::Required);
+static cl::opt<unsigned> GranitePredictionCacheSize(
+    "granite_cache_size", cl::init(0),
+    cl::desc("The maximal number of GRANITE predictions cached across "
+             "functions, keyed by the canonicalized basic block. 0 disables "
+             "the cache."),
+    cl::value_desc("entries"));
+
+static cl::opt<int> GraniteNumThreads(
+    "granite_num_threads", cl::init(-1),
+    cl::desc("The number of threads used by the TensorFlow Lite interpreter "
+             "that runs the GRANITE model. -1 uses the interpreter default."),
+    cl::value_desc("threads"));
+
+static cl::opt<gematria::GraphBuilderModelInferenceOptions::Delegate>
+    GraniteDelegate(
+        "granite_delegate",
+        cl::desc("The TensorFlow Lite delegate used to run the GRANITE model."),
+        cl::init(gematria::GraphBuilderModelInferenceOptions::Delegate::kNone),
+        cl::values(
+            clEnumValN(
+                gematria::GraphBuilderModelInferenceOptions::Delegate::kNone,
+                "none", "use the built-in kernels"),
+            clEnumValN(
+                gematria::GraphBuilderModelInferenceOptions::Delegate::kXnnPack,
+                "xnnpack", "use XNNPACK for the supported ops")));
+
+static cl::opt<int> GraniteMaxNodesPerBatch(
+    "granite_max_nodes_per_batch", cl::init(-1),
+    cl::desc("The maximal number of graph nodes in a GRANITE batch. The basic "
+             "blocks of a function are split into several batches when "
+             "needed. -1 means no limit."),
+    cl::value_desc("nodes"));
+
+static cl::opt<int> GraniteMaxEdgesPerBatch(
+    "granite_max_edges_per_batch", cl::init(-1),
+    cl::desc("The maximal number of graph edges in a GRANITE batch. -1 means "
+             "no limit."),
+    cl::value_desc("edges"));
+
+static cl::opt<bool> GraniteDeduplicateBlocks(
+    "granite_deduplicate_blocks", cl::init(false),
+    cl::desc("Evaluate basic blocks that appear multiple times in a GRANITE "
+             "batch only once."));
+
+static cl::opt<int> GraniteCrossFunctionBatchBlocks(
+    "granite_cross_function_batch_blocks", cl::init(0),
+    cl::desc("When positive, the basic blocks of consecutive functions are "
+             "collected and evaluated by the GRANITE model together once at "
+             "least this many blocks are collected. The blocks are still split "
+             "into batches according to -granite_max_nodes_per_batch and "
+             "-granite_max_edges_per_batch. 0 evaluates each function "
+             "separately."),
+    cl::value_desc("blocks"));
+
+static cl::opt<std::string> GraniteResultCacheFilename(
+    "granite_result_cache",
+    cl::desc("A file with the GRANITE predictions for the basic blocks of "
+             "whole functions, kept across runs. Functions whose bytes, basic "
+             "block address map, CPU, model and task number match an entry in "
+             "the file are not disassembled or evaluated again; only their "
+             "frequencies are taken from the current profile. The file is "
+             "created when it does not exist, and it is rewritten at the end "
+             "of the run with the entries for the functions of this run."),
+    cl::value_desc("filename"));
 
-// BB indices in the BBFreqMap that are not present in the CSV file will be
-// assigned an "BBFreq::Invalid (-1)" value.
-class BBFreq final {
-  double Value = Invalid;
+static cl::opt<bool> GraniteShapeBucketing(
+    "granite_shape_bucketing", cl::init(false),
+    cl::desc("Pad the GRANITE batches so that the shapes of the input tensors "
+             "are rounded up to powers of two. The interpreter then re-plans "
+             "its memory only when a batch crosses a power of two. The "
+             "predictions do not change."));
+
+static cl::opt<bool> GraniteAllowDelegateFallback(
+    "granite_allow_delegate_fallback", cl::init(true),
+    cl::desc("Use the built-in kernels when the GRANITE delegate is not "
+             "available or can't be applied to the model."));
+
+static cl::opt<unsigned> GraniteInferenceWorkers(
+    "granite_inference_workers", cl::init(0),
+    cl::desc("The number of GRANITE interpreters shared by the -j workers. The "
+             "model is loaded once, and a worker holds an interpreter only "
+             "while it runs inference. 0 uses one interpreter per -j worker."),
+    cl::value_desc("interpreters"));
+
+static cl::opt<unsigned> NumJobs(
+    "j", cl::init(1),
+    cl::desc("The number of functions disassembled and evaluated in parallel. "
+             "The output is printed in the order of the symbols regardless of "
+             "this value. 0 uses one thread per hardware thread."),
+    cl::value_desc("jobs"));
+
+static cl::opt<std::string> TimeTraceFilename(
+    "time_trace",
+    cl::desc("Writes the wall time of the phases of llvm-cm, of the evaluation "
+             "of each function and of the sub-phases of the cost models to "
+             "the given file as Chrome trace events in JSON. The file also "
+             "contains the total time and the number of occurrences of each "
+             "phase."),
+    cl::value_desc("filename"));
 
- public:
-  BBFreq() = default;
+static cl::opt<unsigned> TimeTraceGranularity(
+    "time_trace_granularity", cl::init(0),
+    cl::desc("The minimal duration of a phase in microseconds for it to be "
+             "recorded as a separate trace event in --time_trace. The totals "
+             "include all phases regardless of this value."));
 
-  BBFreq(double Val) : Value(Val) {}
+static cl::opt<bool> Streaming(
+    "streaming", cl::init(false),
+    cl::desc("Process the text sections one at a time: the symbols and the "
+             "basic block address map of a section are read right before its "
+             "functions are evaluated, and they are released before the next "
+             "section. Keeps the memory usage flat on large binaries, at the "
+             "cost of reading the symbol table once per text section."));
 
-  operator double() const { return Value; }
+static cl::opt<std::string> CSVFilename(
+    "csv",
+    cl::desc("CSV file name, for basic block frequencies. llvm-cm requires "
+             "profile information either as a csv file or as a binary profile "
+             "(see -profile)."),
+    cl::value_desc("filename"));
 
-  static constexpr double Invalid = -1;
-};
+static cl::opt<std::string> ProfileFilename(
+    "profile",
+    cl::desc("Binary profile file name, for basic block frequencies. The "
+             "binary profile is created from a csv file with -write_profile "
+             "and it is memory-mapped instead of being parsed."),
+    cl::value_desc("filename"));
+
+static cl::opt<std::string> WriteProfileFilename(
+    "write_profile",
+    cl::desc("Convert the profile from -csv to the binary format, write it to "
+             "this file and exit without evaluating the input file."),
+    cl::value_desc("filename"));
 
 static void exitIf(bool Cond, Twine Message) {
   if (Cond) {
@@ -153,6 +306,13 @@ T unwrapOrError(Expected<T> EO) {
   return std::move(*EO);
 }
 
+// Same as unwrapOrError(), but reports the error like exitIf().
+template <typename T>
+T unwrapOrExit(Expected<T> EO) {
+  if (!EO) exitIf(true, toString(EO.takeError()));
+  return std::move(*EO);
+}
+
 static bool instructionTerminatesBasicBlock(const MCInstrInfo &instruction_info,
                                             const MCInst &inst) {
   const MCInstrDesc &desc = instruction_info.get(inst.getOpcode());
@@ -160,123 +320,448 @@ static bool instructionTerminatesBasicBlock(const MCInstrInfo &instruction_info,
          desc.isBarrier() || desc.hasUnmodeledSideEffects();
 }
 
-double calcFrequency(StringRef CurrSymbol,
-                     const StringMap<SmallVector<BBFreq, 20>> &BBFreqMap,
-                     uint64_t BB) {
-  exitIf(!BBFreqMap.contains(CurrSymbol),
-         "Function " + CurrSymbol + " not found in CSV file");
-  exitIf(BB >= BBFreqMap.lookup(CurrSymbol).size(),
-         "Basic block index not found in CSV file: Index " + Twine(BB) +
-             " is+ out of bounds");
-  exitIf(BBFreqMap.lookup(CurrSymbol)[BB] == BBFreq::Invalid,
-         "Basic block index not found in CSV file for function " + CurrSymbol +
-             ": Index " + Twine(BB) + " is not present");
-  return BBFreqMap.lookup(CurrSymbol)[BB];
+// The labels of the basic blocks of a function: pairs of the address of a
+// basic block and its BB ID, sorted by the address. Basic blocks at the same
+// address are in the order of the BB address map. A sorted array is used
+// instead of a hash map, because the instructions of a function are visited
+// in the order of their addresses.
+using BBLabels = std::vector<std::pair<uint64_t, uint64_t>>;
+
+// Returns the frequencies of the basic blocks of `CurrSymbol`. Exits with an
+// error message when the function is not in the profile.
+FrequencySpan lookupFunctionFrequencies(StringRef CurrSymbol,
+                                        const FrequencyProfile &Profile) {
+  const std::optional<FrequencySpan> Freqs = Profile.lookup(CurrSymbol);
+  exitIf(!Freqs.has_value(),
+         "Function " + CurrSymbol + " not found in " + Profile.source());
+  return *Freqs;
+}
+
+double calcFrequency(StringRef CurrSymbol, const FrequencyProfile &Profile,
+                     const FrequencySpan &Freqs, uint64_t BB) {
+  exitIf(BB >= Freqs.size(), "Basic block index not found in " +
+                                 Profile.source() + ": Index " + Twine(BB) +
+                                 " is+ out of bounds");
+  exitIf(Freqs[BB] == BBFreq::Invalid,
+         "Basic block index not found in " + Profile.source() +
+             " for function " + CurrSymbol + ": Index " + Twine(BB) +
+             " is not present");
+  return Freqs[BB];
+}
+
+// Returns the smallest frequency such that the basic blocks with at least this
+// frequency cover `Coverage` of the total frequency of all basic blocks in
+// `Profile`.
+double computeHotFrequencyThreshold(const FrequencyProfile &Profile,
+                                    double Coverage) {
+  std::vector<double> Frequencies;
+  double TotalFrequency = 0.0;
+  for (uint32_t I = 0; I < Profile.size(); ++I) {
+    const FrequencySpan Freqs = Profile.frequencies(I);
+    for (size_t BB = 0; BB < Freqs.size(); ++BB) {
+      if (Freqs[BB] == BBFreq::Invalid) continue;
+      Frequencies.push_back(Freqs[BB]);
+      TotalFrequency += Freqs[BB];
+    }
+  }
+  llvm::sort(Frequencies, std::greater<double>());
+  double CoveredFrequency = 0.0;
+  for (const double Frequency : Frequencies) {
+    CoveredFrequency += Frequency;
+    if (CoveredFrequency >= Coverage * TotalFrequency) return Frequency;
+  }
+  return 0.0;
 }
 
 // Abstraction for latency evaluator, applicate to future models.
 class CostModel {
+  // Forwards the basic blocks to other cost models.
+  friend class HotSubsetCostModel;
+
   // The functions here represent properties that should be common between all
   // models provided as input to llvm-cm.
  protected:
   // Handles latency calculation at the function level, once basic blocks have
   // all been assembled, as well as function level accumulation.
   virtual double getLatencyForGivenBlocks() = 0;
-  // How individual instructions are handled by a model.
+  // How individual instructions are handled by a model. The model may move
+  // from `Inst`.
   virtual void handleInstr(MCInst &Inst, MCInstrInfo &MII) = 0;
 
-  // Determines how individual basic blocks are handled.
-  virtual void evaluateBasicBlock(double Freq) = 0;
+  // Determines how individual basic blocks are handled. `BB` is the ID of the
+  // basic block in the BB address map.
+  virtual void evaluateBasicBlock(uint64_t BB, double Freq) = 0;
   virtual uint64_t getNumBasicBlocks() = 0;
+  // Clears the state accumulated for the previous function, so that the same
+  // model can be used to evaluate multiple functions.
+  virtual void reset() = 0;
 
  public:
+  // Receives the latency of a function once it is known.
+  using LatencyCallback = std::function<void(double)>;
+
   virtual ~CostModel() = default;
 
-  double getLatency(
+  // Disassembles the function in Bytes[Index, End) and evaluates it. Calls
+  // `Done` with the latency of the function. Depending on the model, this
+  // happens before evaluateFunction() returns, or in a later call to
+  // evaluateFunction() or flush(); the callbacks are always called in the
+  // order in which the functions were evaluated.
+  void evaluateFunction(
       MCDisassembler &DisAsm, uint64_t SectionAddr, ArrayRef<uint8_t> Bytes,
       uint64_t Start, uint64_t End, uint64_t Index,
       raw_svector_ostream &CommentStream, MCInstrInfo &MII,
-      const std::unordered_map<uint64_t, std::vector<uint64_t>> &Labels,
-      StringRef CurrSymbol,
-      const StringMap<SmallVector<BBFreq, 20>> &BBFreqMap);
+      const BBLabels &Labels, StringRef CurrSymbol,
+      const FrequencyProfile &Profile, LatencyCallback Done);
+
+  // Reports the latencies of all functions passed to evaluateFunction() whose
+  // latencies were not reported yet.
+  virtual void flush() {}
+
+ protected:
+  // Called before a function is disassembled, with the bytes of the function
+  // and the labels of its basic blocks. Returns true when the model evaluated
+  // the function without disassembling it, e.g. from a cache; in that case,
+  // the model takes ownership of `Done` and calls it as described in
+  // evaluateFunction(). The default implementation returns false.
+  virtual bool evaluateWithoutDisassembly(
+      ArrayRef<uint8_t> FunctionBytes, uint64_t FunctionAddr,
+      const BBLabels &Labels, StringRef CurrSymbol,
+      const FrequencyProfile &Profile, const FrequencySpan &Freqs,
+      LatencyCallback &Done) {
+    return false;
+  }
+
+  // Called after all basic blocks of a function were passed to
+  // evaluateBasicBlock(). The default implementation reports the latency from
+  // getLatencyForGivenBlocks() right away.
+  virtual void finishFunction(LatencyCallback Done) {
+    Done(getLatencyForGivenBlocks());
+  }
+};
+
+// The GRANITE model and the inference workers that run it, shared by the cost
+// models of all -j workers. The model is loaded only once, and a cost model
+// leases an inference worker only while it runs inference, so the number of
+// interpreters is set by -granite_inference_workers, not by -j.
+struct GraniteBackend {
+  std::unique_ptr<tflite::FlatBufferModel> Model;
+  std::unique_ptr<gematria::GraphBuilderModelInferencePool> Pool;
+  // The symbols of the compact basic blocks of all cost models. The table is
+  // thread-safe, and it is set on all inference workers.
+  std::shared_ptr<gematria::SymbolTable> Symbols;
+
+  // Loads the model from -granite_model and creates `NumWorkers` inference
+  // workers. When `Cache` is not null, the workers use it to look up
+  // predictions for basic blocks that were already evaluated.
+  static std::shared_ptr<GraniteBackend>
+  create(int NumWorkers, std::shared_ptr<gematria::PredictionCache> Cache) {
+    TimeTraceScope Scope("LoadGraniteModel");
+    auto Backend = std::make_shared<GraniteBackend>();
+    Backend->Model =
+        tflite::FlatBufferModel::BuildFromFile(EvaluatorFilename.c_str());
+    exitIf(Backend->Model == nullptr,
+           "failed to load the GRANITE model " + EvaluatorFilename);
+
+    gematria::GraphBuilderModelInferenceOptions Options;
+    Options.num_threads = GraniteNumThreads;
+    Options.delegate = GraniteDelegate;
+    Options.allow_delegate_fallback = GraniteAllowDelegateFallback;
+    Options.batch_budget.max_nodes = GraniteMaxNodesPerBatch;
+    Options.batch_budget.max_edges = GraniteMaxEdgesPerBatch;
+    Options.deduplicate_blocks = GraniteDeduplicateBlocks;
+    Options.shape_bucketing = GraniteShapeBucketing;
+    Backend->Pool =
+        unwrapOrError(gematria::GraphBuilderModelInferencePool::FromTfLiteModel(
+            Backend->Model.get(), NumWorkers, Options));
+    Backend->Symbols = std::make_shared<gematria::SymbolTable>();
+
+    // The pool has no per-worker settings; all workers are leased at once, so
+    // that each of them is configured exactly once.
+    std::vector<gematria::GraphBuilderModelInferencePool::Lease> Workers;
+    Workers.reserve(Backend->Pool->num_workers());
+    for (int I = 0; I < Backend->Pool->num_workers(); ++I) {
+      Workers.push_back(Backend->Pool->Acquire());
+      Workers.back()->SetPredictionCache(Cache);
+      Workers.back()->SetSymbolTable(Backend->Symbols);
+    }
+    return Backend;
+  }
 };
 
 class GraniteCostModel : public CostModel {
  private:
-  GraniteCostModel(
-      const TargetMachine *TM,
-      std::unique_ptr<tflite::FlatBufferModel> InfModel,
-      std::unique_ptr<gematria::GraphBuilderModelInference> Inference)
+  GraniteCostModel(const TargetMachine *TM,
+                   std::shared_ptr<GraniteBackend> Backend,
+                   std::shared_ptr<FunctionResultCache> ResultCache)
       : Canonicalizer(TM),
-        InfModel(std::move(InfModel)),
-        Inference(std::move(Inference)) {}
+        Backend(std::move(Backend)),
+        ResultCache(std::move(ResultCache)) {
+    Canonicalizer.set_symbol_table(this->Backend->Symbols);
+  }
 
   gematria::X86Canonicalizer Canonicalizer;
 
-  std::unique_ptr<tflite::FlatBufferModel> InfModel;
-  std::unique_ptr<gematria::GraphBuilderModelInference> Inference;
-
-  std::vector<std::pair<gematria::BasicBlock, double>> BasicBlocksAndFreq;
+  // The model and the inference workers shared with the other cost models.
+  std::shared_ptr<GraniteBackend> Backend;
+
+  // The persistent result cache, or nullptr when it is not used.
+  std::shared_ptr<FunctionResultCache> ResultCache;
+  // The key of the current function in `ResultCache`.
+  uint64_t CurrentCacheKey = 0;
+  // The basic blocks of the current function in the order of evaluation; the
+  // costs are filled in once the predictions are known.
+  std::vector<FunctionResultCache::Block> CurrentCacheBlocks;
+
+  // The basic blocks of the functions whose latencies were not reported yet,
+  // followed by the basic blocks of the current function. The blocks are held
+  // in the compact encoding, because cross-function batches may keep many of
+  // them alive at the same time.
+  std::vector<gematria::CompactBasicBlock> BasicBlocks;
+  // The frequencies of the blocks in `BasicBlocks`.
+  std::vector<double> BasicBlockFreqs;
+
+  // A function whose blocks were collected for a cross-function batch, but
+  // whose latency was not reported yet.
+  struct PendingFunction {
+    size_t NumBlocks = 0;
+    LatencyCallback Done;
+    // The latency of a function found in the result cache. Such functions
+    // have no blocks in `BasicBlocks`; they are kept here only so that the
+    // latencies are reported in order.
+    std::optional<double> CachedLatency;
+    uint64_t CacheKey = 0;
+    std::vector<FunctionResultCache::Block> CacheBlocks;
+  };
+  std::vector<PendingFunction> PendingFunctions;
+  // The number of blocks at the beginning of `BasicBlocks` that belong to
+  // `PendingFunctions`.
+  size_t NumPendingBlocks = 0;
 
   std::vector<MCInst> InstVec;
 
- public:
-  // Factory method to create a Granite-based cost model.
-  static std::unique_ptr<CostModel> create(const TargetMachine *TM) {
-    std::unique_ptr<tflite::FlatBufferModel> InfModel =
-        tflite::FlatBufferModel::BuildFromFile(EvaluatorFilename.c_str());
-
-    auto InferenceOr = unwrapOrError(
-        gematria::GraphBuilderModelInference::FromTfLiteModel(InfModel.get()));
-
-    // TODO(dayannd): Change this to make use of Expected<>.
-    if (InferenceOr == nullptr) return nullptr;
-
-    return std::unique_ptr<CostModel>(
-        new GraniteCostModel(TM, std::move(InfModel), std::move(InferenceOr)));
+  // Runs the model on all blocks from `BasicBlocks`.
+  std::vector<std::optional<gematria::GraphBuilderModelInference::OutputType>>
+  runInference() {
+    TimeTraceScope Scope("GraniteInference", [&]() {
+      return (Twine(BasicBlocks.size()) + " basic blocks").str();
+    });
+    // The worker is leased only for the inference, so that other cost models
+    // can use it while this one disassembles the next functions. The batch of
+    // a leased worker is always empty.
+    gematria::GraphBuilderModelInferencePool::Lease Inference =
+        Backend->Pool->Acquire();
+
+    // The blocks are split into several batches when they do not fit into the
+    // batch budget.
+    std::vector<
+        std::optional<gematria::GraphBuilderModelInference::OutputType>>
+        Predictions =
+            unwrapOrError(Inference->RunInferenceInBatches(BasicBlocks));
+    assert(Predictions.size() == BasicBlocks.size());
+    LLVM_DEBUG(dbgs() << "GRANITE peak tensor memory: "
+                      << Inference->peak_tensor_memory_bytes() << " bytes\n");
+    return Predictions;
   }
 
-  uint64_t getNumBasicBlocks() override { return BasicBlocksAndFreq.size(); }
-
-  double getLatencyForGivenBlocks() override {
-    Inference->Reset();
-
-    for (const auto &BasicBlock : BasicBlocksAndFreq) {
-      exitIf(!Inference->AddBasicBlockToBatch(BasicBlock.first),
-             "Basic block could not be added to batch!");
+  // Runs the model on all blocks from `BasicBlocks`, and returns the latencies
+  // of functions that have `FunctionNumBlocks` consecutive blocks each. The
+  // predictions are weighted by the block frequencies inside the inference
+  // library, so the per-block predictions are never materialized.
+  std::vector<double> runFunctionInference(ArrayRef<int> FunctionNumBlocks) {
+    TimeTraceScope Scope("GraniteInference", [&]() {
+      return (Twine(BasicBlocks.size()) + " basic blocks").str();
+    });
+    gematria::GraphBuilderModelInferencePool::Lease Inference =
+        Backend->Pool->Acquire();
+
+    const std::vector<gematria::GraphBuilderModelInference::FunctionOutputType>
+        Costs = unwrapOrError(Inference->RunFunctionInferenceInBatches(
+            BasicBlocks, BasicBlockFreqs, FunctionNumBlocks));
+    assert(Costs.size() == FunctionNumBlocks.size());
+    LLVM_DEBUG(dbgs() << "GRANITE peak tensor memory: "
+                      << Inference->peak_tensor_memory_bytes() << " bytes\n");
+    std::vector<double> Latencies;
+    Latencies.reserve(Costs.size());
+    for (const auto &FunctionCosts : Costs) {
+      // The costs are empty for functions without blocks.
+      if (FunctionCosts.empty()) {
+        Latencies.push_back(0.0);
+        continue;
+      }
+      exitIf(uArchTaskNumber >= FunctionCosts.size(),
+             "The -task_number is out of range for the GRANITE model!");
+      Latencies.push_back(FunctionCosts[uArchTaskNumber]);
     }
+    return Latencies;
+  }
 
-    const std::vector<gematria::GraphBuilderModelInference::OutputType>
-        Predictions = unwrapOrError(Inference->RunInference());
-    assert(Predictions.size() == BasicBlocksAndFreq.size());
+  // Returns the sum of the predictions for blocks [First, First + NumBlocks)
+  // weighted by their frequencies.
+  double accumulateLatency(
+      ArrayRef<std::optional<gematria::GraphBuilderModelInference::OutputType>>
+          Predictions,
+      size_t First, size_t NumBlocks) {
     double LatencyAccumulator = 0.0;
 
-    // The tasks: IVB, HSW, and SKL. We only care about SKL right now.
-    for (unsigned Block = 0; Block < Predictions.size(); ++Block) {
-      const auto &Costs = Predictions[Block];
+    // The tasks of the released models are IVB, HSW, and SKL; only the task
+    // selected by -task_number is used, SKL by default.
+    for (size_t Block = First; Block < First + NumBlocks; ++Block) {
+      exitIf(!Predictions[Block].has_value(),
+             "Basic block could not be added to batch!");
+      const auto &Costs = *Predictions[Block];
       // All Gematria models are implemented as multi-task models, even if
       // they have just one output head (and `output` contains just a single
       // value).
-      LatencyAccumulator += Costs[2] * BasicBlocksAndFreq[Block].second;
+      exitIf(uArchTaskNumber >= Costs.size(),
+             "The -task_number is out of range for the GRANITE model!");
+      LatencyAccumulator += Costs[uArchTaskNumber] * BasicBlockFreqs[Block];
     }
 
     return LatencyAccumulator;
   }
 
+ public:
+  // Factory method to create a Granite-based cost model that runs inference
+  // on the workers of `Backend`.
+  static std::unique_ptr<CostModel>
+  create(const TargetMachine *TM, std::shared_ptr<GraniteBackend> Backend,
+         std::shared_ptr<FunctionResultCache> ResultCache) {
+    assert(Backend != nullptr);
+    return std::unique_ptr<CostModel>(new GraniteCostModel(
+        TM, std::move(Backend), std::move(ResultCache)));
+  }
+
+  uint64_t getNumBasicBlocks() override {
+    return BasicBlocks.size() - NumPendingBlocks;
+  }
+
+  void reset() override {
+    BasicBlocks.resize(NumPendingBlocks);
+    BasicBlockFreqs.resize(NumPendingBlocks);
+    InstVec.clear();
+    CurrentCacheBlocks.clear();
+  }
+
+  double getLatencyForGivenBlocks() override {
+    assert(NumPendingBlocks == 0);
+    return runFunctionInference({static_cast<int>(BasicBlocks.size())})[0];
+  }
+
+  bool evaluateWithoutDisassembly(
+      ArrayRef<uint8_t> FunctionBytes, uint64_t FunctionAddr,
+      const BBLabels &Labels, StringRef CurrSymbol,
+      const FrequencyProfile &Profile, const FrequencySpan &Freqs,
+      LatencyCallback &Done) override {
+    if (ResultCache == nullptr) return false;
+    TimeTraceScope Scope("ResultCacheLookup");
+    CurrentCacheKey = ResultCache->computeKey(FunctionBytes, FunctionAddr,
+                                              Labels);
+    const std::optional<std::vector<FunctionResultCache::Block>> Blocks =
+        ResultCache->lookup(CurrentCacheKey);
+    if (!Blocks.has_value()) return false;
+    // The latency is accumulated in the same order and with the same types as
+    // in accumulateLatency(), so that it is the same as without the cache.
+    double LatencyAccumulator = 0.0;
+    for (const FunctionResultCache::Block &Block : *Blocks) {
+      const double Freq = calcFrequency(CurrSymbol, Profile, Freqs, Block.BB);
+      if (Block.HasPrediction) LatencyAccumulator += Block.Cost * Freq;
+    }
+    if (PendingFunctions.empty()) {
+      Done(LatencyAccumulator);
+    } else {
+      PendingFunction &Function = PendingFunctions.emplace_back();
+      Function.Done = std::move(Done);
+      Function.CachedLatency = LatencyAccumulator;
+    }
+    return true;
+  }
+
+  void finishFunction(LatencyCallback Done) override {
+    PendingFunction &Function = PendingFunctions.emplace_back();
+    Function.NumBlocks = BasicBlocks.size() - NumPendingBlocks;
+    Function.Done = std::move(Done);
+    Function.CacheKey = CurrentCacheKey;
+    Function.CacheBlocks = std::move(CurrentCacheBlocks);
+    CurrentCacheBlocks.clear();
+    NumPendingBlocks = BasicBlocks.size();
+    if (GraniteCrossFunctionBatchBlocks <= 0 ||
+        NumPendingBlocks >=
+            static_cast<size_t>(GraniteCrossFunctionBatchBlocks)) {
+      flush();
+    }
+  }
+
+  void flush() override {
+    if (PendingFunctions.empty()) return;
+    assert(NumPendingBlocks == BasicBlocks.size());
+    // The result cache stores the cost of each block, so the per-block
+    // predictions are needed only when it is used. Otherwise, the inference
+    // computes the latencies of the functions directly.
+    std::vector<std::optional<gematria::GraphBuilderModelInference::OutputType>>
+        Predictions;
+    std::vector<double> Latencies;
+    if (ResultCache != nullptr) {
+      if (!BasicBlocks.empty()) Predictions = runInference();
+    } else {
+      std::vector<int> FunctionNumBlocks;
+      FunctionNumBlocks.reserve(PendingFunctions.size());
+      for (const PendingFunction &Function : PendingFunctions)
+        FunctionNumBlocks.push_back(static_cast<int>(Function.NumBlocks));
+      Latencies = runFunctionInference(FunctionNumBlocks);
+    }
+    // Each prediction is attributed back to its function. The latencies are
+    // accumulated in the same order as when the functions are evaluated
+    // separately, so that the results are the same.
+    size_t FirstBlock = 0;
+    for (size_t I = 0; I < PendingFunctions.size(); ++I) {
+      PendingFunction &Function = PendingFunctions[I];
+      if (Function.CachedLatency.has_value()) {
+        Function.Done(*Function.CachedLatency);
+        continue;
+      }
+      if (ResultCache == nullptr) {
+        Function.Done(Latencies[I]);
+        continue;
+      }
+      const double Latency =
+          accumulateLatency(Predictions, FirstBlock, Function.NumBlocks);
+      // accumulateLatency() already checked that the task is in range.
+      size_t Block = FirstBlock;
+      for (FunctionResultCache::Block &CacheBlock : Function.CacheBlocks) {
+        if (CacheBlock.HasPrediction)
+          CacheBlock.Cost = (*Predictions[Block++])[uArchTaskNumber];
+      }
+      assert(Block == FirstBlock + Function.NumBlocks);
+      ResultCache->insert(Function.CacheKey, std::move(Function.CacheBlocks));
+      FirstBlock += Function.NumBlocks;
+      Function.Done(Latency);
+    }
+    PendingFunctions.clear();
+    BasicBlocks.clear();
+    BasicBlockFreqs.clear();
+    NumPendingBlocks = 0;
+  }
+
   void handleInstr(MCInst &Inst, MCInstrInfo &MII) override {
     if (!instructionTerminatesBasicBlock(MII, Inst) &&
         MII.getName(Inst.getOpcode()) != "CDQ" &&
         MII.getName(Inst.getOpcode()) != "NOOP") {
-      InstVec.push_back(Inst);
+      InstVec.push_back(std::move(Inst));
     }
   }
 
-  void evaluateBasicBlock(double Freq) override {
+  void evaluateBasicBlock(uint64_t BB, double Freq) override {
+    if (ResultCache != nullptr)
+      CurrentCacheBlocks.push_back({BB, !InstVec.empty()});
     if (InstVec.empty()) {
       return;
     }
-    BasicBlocksAndFreq.push_back(
-        std::make_pair(Canonicalizer.BasicBlockFromMCInst(InstVec), Freq));
+    {
+      TimeTraceScope Scope("Canonicalize");
+      BasicBlocks.push_back(Canonicalizer.CompactBasicBlockFromMCInst(InstVec));
+    }
+    BasicBlockFreqs.push_back(Freq);
     InstVec.clear();
   }
 };
@@ -299,11 +784,17 @@ class CountCostModel : public CostModel {
 
   uint64_t getNumBasicBlocks() override { return NumBasicBlocks; }
 
+  void reset() override {
+    NumBasicBlocks = 0;
+    NumInsts = 0;
+    TotalFuncLatency = 0.0;
+  }
+
   void handleInstr(MCInst &Inst, MCInstrInfo &MII) override { ++NumInsts; }
 
   double getLatencyForGivenBlocks() override { return TotalFuncLatency; }
 
-  void evaluateBasicBlock(double Freq) override {
+  void evaluateBasicBlock(uint64_t BB, double Freq) override {
     double BBLatency = Freq * NumInsts;
     TotalFuncLatency += BBLatency;
     ++NumBasicBlocks;
@@ -311,6 +802,158 @@ class CountCostModel : public CostModel {
   }
 };
 
+// A cost model that estimates the cost of a basic block from the scheduling
+// model of the CPU: the cost of a block is the sum of the reciprocal
+// throughputs of its instructions, but at least the number of cycles needed to
+// issue all their micro-ops. This ignores dependencies between the instructions
+// and the distribution of the micro-ops between the execution ports, but it is
+// much closer to the real cost than counting instructions, and it needs only a
+// few table lookups per instruction.
+class SchedModelCostModel : public CostModel {
+ private:
+  explicit SchedModelCostModel(const MCSubtargetInfo &STI)
+      : STI(STI), SchedModel(STI.getSchedModel()) {}
+
+  const MCSubtargetInfo &STI;
+  const MCSchedModel &SchedModel;
+
+  uint64_t NumBasicBlocks = 0;
+
+  // The sum of the reciprocal throughputs of the instructions of the current
+  // basic block.
+  double BlockThroughput = 0.0;
+  // The number of micro-ops of the instructions of the current basic block.
+  uint64_t BlockMicroOps = 0;
+
+  double TotalFuncLatency = 0.0;
+
+ public:
+  // Factory method for the scheduling model based cost model. Fails when the
+  // CPU has no scheduling model.
+  static std::unique_ptr<CostModel> create(const TargetMachine *TM) {
+    const MCSubtargetInfo &STI = *TM->getMCSubtargetInfo();
+    exitIf(!STI.getSchedModel().hasInstrSchedModel(),
+           "CPU '" + STI.getCPU().str() + "' has no scheduling model");
+    return std::unique_ptr<CostModel>(new SchedModelCostModel(STI));
+  }
+
+  uint64_t getNumBasicBlocks() override { return NumBasicBlocks; }
+
+  void reset() override {
+    NumBasicBlocks = 0;
+    BlockThroughput = 0.0;
+    BlockMicroOps = 0;
+    TotalFuncLatency = 0.0;
+  }
+
+  void handleInstr(MCInst &Inst, MCInstrInfo &MII) override {
+    unsigned SchedClassID = MII.get(Inst.getOpcode()).getSchedClass();
+    const MCSchedClassDesc *SCDesc =
+        SchedModel.getSchedClassDesc(SchedClassID);
+    // Variant scheduling classes depend on the operands of the instruction.
+    while (SCDesc->isVariant()) {
+      SchedClassID = STI.resolveVariantSchedClass(SchedClassID, &Inst, &MII,
+                                                  SchedModel.getProcessorID());
+      SCDesc = SchedModel.getSchedClassDesc(SchedClassID);
+    }
+    // Instructions without valid scheduling information are counted as a
+    // single micro-op issued in one cycle.
+    if (!SCDesc->isValid()) {
+      BlockThroughput += 1.0;
+      ++BlockMicroOps;
+      return;
+    }
+    BlockThroughput += MCSchedModel::getReciprocalThroughput(STI, *SCDesc);
+    BlockMicroOps += SCDesc->NumMicroOps;
+  }
+
+  double getLatencyForGivenBlocks() override { return TotalFuncLatency; }
+
+  void evaluateBasicBlock(uint64_t BB, double Freq) override {
+    const double IssueCycles =
+        static_cast<double>(BlockMicroOps) / SchedModel.IssueWidth;
+    TotalFuncLatency += Freq * std::max(BlockThroughput, IssueCycles);
+    ++NumBasicBlocks;
+    BlockThroughput = 0.0;
+    BlockMicroOps = 0;
+  }
+};
+
+// A cost model that evaluates the basic blocks with a frequency of at least a
+// given threshold with one cost model, and the other basic blocks with another,
+// cheaper cost model. The latency of a function is the sum of the latencies
+// from both models. The cold model must report the latency of each function
+// from finishFunction() right away.
+class HotSubsetCostModel : public CostModel {
+ private:
+  HotSubsetCostModel(std::unique_ptr<CostModel> Hot,
+                     std::unique_ptr<CostModel> Cold, double Threshold)
+      : Hot(std::move(Hot)), Cold(std::move(Cold)), Threshold(Threshold) {}
+
+  std::unique_ptr<CostModel> Hot;
+  std::unique_ptr<CostModel> Cold;
+  double Threshold;
+
+  // The instructions of the current basic block. They are passed to one of the
+  // models once the frequency of the block is known.
+  std::vector<MCInst> BlockInsts;
+  MCInstrInfo *MII = nullptr;
+
+ public:
+  // Factory method for the hot subset model. Basic blocks with a frequency of
+  // at least `Threshold` are evaluated with `Hot`, the other basic blocks with
+  // `Cold`.
+  static std::unique_ptr<CostModel> create(std::unique_ptr<CostModel> Hot,
+                                           std::unique_ptr<CostModel> Cold,
+                                           double Threshold) {
+    return std::unique_ptr<CostModel>(
+        new HotSubsetCostModel(std::move(Hot), std::move(Cold), Threshold));
+  }
+
+  uint64_t getNumBasicBlocks() override {
+    return Hot->getNumBasicBlocks() + Cold->getNumBasicBlocks();
+  }
+
+  void reset() override {
+    Hot->reset();
+    Cold->reset();
+    BlockInsts.clear();
+  }
+
+  void handleInstr(MCInst &Inst, MCInstrInfo &MII) override {
+    BlockInsts.push_back(std::move(Inst));
+    this->MII = &MII;
+  }
+
+  double getLatencyForGivenBlocks() override {
+    return Hot->getLatencyForGivenBlocks() + Cold->getLatencyForGivenBlocks();
+  }
+
+  void evaluateBasicBlock(uint64_t BB, double Freq) override {
+    CostModel &Model = Freq >= Threshold ? *Hot : *Cold;
+    for (MCInst &Inst : BlockInsts) Model.handleInstr(Inst, *MII);
+    Model.evaluateBasicBlock(BB, Freq);
+    BlockInsts.clear();
+  }
+
+  void flush() override { Hot->flush(); }
+
+ protected:
+  void finishFunction(LatencyCallback Done) override {
+    double ColdLatency = 0.0;
+    bool HasColdLatency = false;
+    Cold->finishFunction([&](double Latency) {
+      ColdLatency = Latency;
+      HasColdLatency = true;
+    });
+    assert(HasColdLatency && "The cold model must report latencies right away");
+    (void)HasColdLatency;
+    Hot->finishFunction([ColdLatency, Done = std::move(Done)](double Latency) {
+      Done(Latency + ColdLatency);
+    });
+  }
+};
+
 static SectionFilter getToolSectionFilter(object::ObjectFile const &O,
                                           uint64_t *Idx) {
   // Set the initial index to max so that the first increment will set it to 0.
@@ -353,49 +996,98 @@ SymbolInfoTy createSymbolInfo(const object::ObjectFile &Obj,
                                   : static_cast<uint8_t>(ELF::STT_NOTYPE));
 }
 
-void printFunctionNames(ArrayRef<SymbolInfoTy> Aliases) {
-  for (const auto &Alias : Aliases) outs() << "<" << Alias.Name << ">: \n";
+void printFunctionNames(ArrayRef<SymbolInfoTy> Aliases, raw_ostream &OS) {
+  for (const auto &Alias : Aliases) OS << "<" << Alias.Name << ">: \n";
 }
 
-static void collectBBtoAddressLabels(
-    const DenseMap<uint64_t, llvm::object::BBAddrMap> &AddrToBBAddrMap,
-    uint64_t SectionAddr, uint64_t Start, uint64_t End,
-    std::unordered_map<uint64_t, std::vector<uint64_t>> &Labels) {
-  if (AddrToBBAddrMap.empty()) return;
+// Returns the BB address map of the function at `Addr` from `BBAddrMaps`, which
+// is sorted by the function address, or nullptr when there is none.
+static const BBAddrMap *findBBAddrMap(ArrayRef<BBAddrMap> BBAddrMaps,
+                                      uint64_t Addr) {
+  const BBAddrMap *Iter = llvm::partition_point(
+      BBAddrMaps, [Addr](const BBAddrMap &Map) { return Map.Addr < Addr; });
+  if (Iter == BBAddrMaps.end() || Iter->Addr != Addr) return nullptr;
+  return Iter;
+}
+
+// Reads the BB address maps of the text section with index `SectionIndex`, or
+// of all sections when it is std::nullopt, and sorts them by the address of
+// their functions.
+static std::vector<BBAddrMap>
+readSortedBBAddrMaps(const ObjectFile &Obj,
+                     std::optional<unsigned> SectionIndex) {
+  TimeTraceScope Scope("ReadBBAddrMap");
+  std::vector<BBAddrMap> BBAddrMaps;
+  if (const auto *Elf = dyn_cast<object::ELFObjectFileBase>(&Obj)) {
+    auto BBAddrMappingOrErr = Elf->readBBAddrMap(SectionIndex);
+    exitIf(!BBAddrMappingOrErr, "failed to read basic block address mapping");
+    BBAddrMaps = std::move(*BBAddrMappingOrErr);
+  }
+  // When there are multiple maps for the same address, the first one is used.
+  llvm::stable_sort(BBAddrMaps, [](const BBAddrMap &A, const BBAddrMap &B) {
+    return A.Addr < B.Addr;
+  });
+  return BBAddrMaps;
+}
+
+// Fills `Labels` with the labels of the basic blocks from `Map` that start
+// before `EndAddress`. Clears `Labels` when `Map` is nullptr.
+static void collectBBtoAddressLabels(const BBAddrMap *Map, uint64_t EndAddress,
+                                     BBLabels &Labels) {
   Labels.clear();
-  const uint64_t StartAddress = SectionAddr + Start;
-  const uint64_t EndAddress = SectionAddr + End;
-  auto Iter = AddrToBBAddrMap.find(StartAddress);
-  if (Iter == AddrToBBAddrMap.end()) return;
-  for (const llvm::object::BBAddrMap::BBEntry &BB : Iter->second.BBEntries) {
-    const uint64_t BBAddress = BB.Offset + Iter->second.Addr;
+  if (Map == nullptr) return;
+  for (const BBAddrMap::BBEntry &BB : Map->BBEntries) {
+    const uint64_t BBAddress = BB.Offset + Map->Addr;
     if (BBAddress >= EndAddress) continue;
-    Labels[BBAddress].push_back(BB.ID);
+    Labels.emplace_back(BBAddress, BB.ID);
   }
+  // The entries are normally already sorted by their offsets.
+  if (!llvm::is_sorted(Labels, llvm::less_first()))
+    llvm::stable_sort(Labels, llvm::less_first());
 }
 
-double CostModel::getLatency(
+void CostModel::evaluateFunction(
     MCDisassembler &DisAsm, uint64_t SectionAddr, ArrayRef<uint8_t> Bytes,
     uint64_t Start, uint64_t End, uint64_t Index,
     raw_svector_ostream &CommentStream, MCInstrInfo &MII,
-    const std::unordered_map<uint64_t, std::vector<uint64_t>> &Labels,
-    StringRef CurrSymbol, const StringMap<SmallVector<BBFreq, 20>> &BBFreqMap) {
+    const BBLabels &Labels, StringRef CurrSymbol,
+    const FrequencyProfile &Profile, LatencyCallback Done) {
+  reset();
+  // The frequencies of the function are looked up once; the frequencies of the
+  // basic blocks are then looked up by their index.
+  const FrequencySpan Freqs = lookupFunctionFrequencies(CurrSymbol, Profile);
+  if (evaluateWithoutDisassembly(Bytes.slice(Index, End - Index),
+                                 SectionAddr + Index, Labels, CurrSymbol,
+                                 Profile, Freqs, Done)) {
+    return;
+  }
   uint64_t ThisBb = -1;
   bool EnteredBb = false;
+  // The first label at or after the current address.
+  BBLabels::const_iterator NextLabel = Labels.begin();
+  // The disassembly of each basic block is traced separately from its
+  // evaluation.
+  timeTraceProfilerBegin("Disassemble", StringRef());
   while (Index < End) {
     uint64_t CurrAddr = SectionAddr + Index;
-    auto FirstIter = Labels.find(CurrAddr);
-    if (FirstIter != Labels.end()) {
-      for (auto Label : FirstIter->second) {
-        if (EnteredBb)
-          evaluateBasicBlock(calcFrequency(CurrSymbol, BBFreqMap, ThisBb));
-        EnteredBb = true;
-        ThisBb = Label;
-
-        LLVM_DEBUG(dbgs() << "<"
-                          << "BB" + Twine(Label) << ">: "
-                          << format("%016" PRIx64 " ", CurrAddr) << "\n");
+    // Labels that are not at an instruction boundary are skipped.
+    while (NextLabel != Labels.end() && NextLabel->first < CurrAddr)
+      ++NextLabel;
+    for (; NextLabel != Labels.end() && NextLabel->first == CurrAddr;
+         ++NextLabel) {
+      const uint64_t Label = NextLabel->second;
+      if (EnteredBb) {
+        timeTraceProfilerEnd();
+        evaluateBasicBlock(ThisBb,
+                           calcFrequency(CurrSymbol, Profile, Freqs, ThisBb));
+        timeTraceProfilerBegin("Disassemble", StringRef());
       }
+      EnteredBb = true;
+      ThisBb = Label;
+
+      LLVM_DEBUG(dbgs() << "<"
+                        << "BB" + Twine(Label) << ">: "
+                        << format("%016" PRIx64 " ", CurrAddr) << "\n");
     }
     MCInst Inst;
     uint64_t Size = 0;
@@ -410,13 +1102,144 @@ double CostModel::getLatency(
           BytesSlice.size(), DisAsm.suggestBytesToSkip(BytesSlice, CurrAddr));
     Index += Size;
   }
-  evaluateBasicBlock(calcFrequency(CurrSymbol, BBFreqMap, ThisBb));
-  double Latency = getLatencyForGivenBlocks();
-  outs() << "Calculated Frequency: " << Latency << "\n";
-  return Latency;
+  timeTraceProfilerEnd();
+  evaluateBasicBlock(ThisBb, calcFrequency(CurrSymbol, Profile, Freqs, ThisBb));
+  finishFunction(std::move(Done));
+}
+
+static std::unique_ptr<CostModel>
+createCostModel(EvaluationType Method, const TargetMachine *TM,
+                std::shared_ptr<GraniteBackend> Granite,
+                std::shared_ptr<FunctionResultCache> ResultCache) {
+  std::unique_ptr<CostModel> Handler;
+  if (Method == EvaluationType::Granite) {
+    Handler = GraniteCostModel::create(TM, std::move(Granite),
+                                       std::move(ResultCache));
+  } else if (Method == EvaluationType::Counter) {
+    Handler = CountCostModel::create();
+  } else if (Method == EvaluationType::SchedModel) {
+    Handler = SchedModelCostModel::create(TM);
+  }
+  assert(Handler && "A valid Handler type must be specified!");
+  return Handler;
+}
+
+// Creates the cost model for the evaluation of one or more functions. When
+// `HotFrequencyThreshold` is set, only the basic blocks with at least this
+// frequency are evaluated with --evaluator, and the other basic blocks with
+// --cold_evaluator. `Granite` is the GRANITE backend shared by all cost models;
+// it is nullptr when --evaluator is not GRANITE. The cold evaluator never uses
+// GRANITE.
+static std::unique_ptr<CostModel>
+createCostModel(const TargetMachine *TM,
+                std::shared_ptr<GraniteBackend> Granite,
+                std::shared_ptr<FunctionResultCache> ResultCache,
+                std::optional<double> HotFrequencyThreshold) {
+  std::unique_ptr<CostModel> Handler = createCostModel(
+      EvaluationMethod, TM, std::move(Granite), std::move(ResultCache));
+  if (!HotFrequencyThreshold.has_value()) return Handler;
+  return HotSubsetCostModel::create(
+      std::move(Handler),
+      createCostModel(ColdEvaluationMethod, TM, nullptr, nullptr),
+      *HotFrequencyThreshold);
+}
+
+// A function (a group of aliased symbols) to be evaluated. The labels of its
+// basic blocks are collected from `BBAddrMap` only when the function is
+// evaluated, so that they are not kept in memory for all functions at once.
+struct FunctionToEvaluate {
+  uint64_t SectionAddr = 0;
+  ArrayRef<uint8_t> Bytes;
+  // The bounds of the function, relative to the start of the section.
+  uint64_t Start = 0;
+  uint64_t End = 0;
+  uint64_t Index = 0;
+  ArrayRef<SymbolInfoTy> Aliases;
+  // The BB address map of the function, or nullptr when it has none.
+  const BBAddrMap *AddrMap = nullptr;
+};
+
+// Calls `Callback` for each function symbol of `Obj` except for section
+// symbols, with the section in which the symbol is defined.
+static void forEachFunctionSymbol(
+    const ObjectFile &Obj,
+    function_ref<void(const SymbolRef &, section_iterator)> Callback) {
+  for (const object::SymbolRef &Symbol : Obj.symbols()) {
+    auto TypeOrErr = Symbol.getType();
+    exitIf(!TypeOrErr, "failed to get symbol type");
+    if (TypeOrErr.get() != SymbolRef::ST_Function) continue;
+    Expected<StringRef> NameOrErr = Symbol.getName();
+    exitIf(!NameOrErr, "failed to get symbol name");
+
+    // If the symbol is a section symbol, then ignore it.
+    if (Obj.isELF() && getElfSymbolType(Obj, Symbol) == ELF::STT_SECTION)
+      continue;
+
+    Callback(Symbol, unwrapOrError(Symbol.getSection()));
+  }
 }
 
-void populateBBFreqMap(StringMap<SmallVector<BBFreq, 20>> &BBFreqMap) {
+// Appends the functions of a text section to `Functions`. `SortedSymbols` are
+// the function symbols of the section sorted by address, and `BBAddrMaps` are
+// BB address maps that include the maps of the section, sorted by address. The
+// functions point to both of them.
+static void
+collectSectionFunctions(const SectionRef &Section,
+                        ArrayRef<SymbolInfoTy> SortedSymbols,
+                        ArrayRef<BBAddrMap> BBAddrMaps,
+                        std::vector<FunctionToEvaluate> &Functions) {
+  const uint64_t SectionAddr = Section.getAddress();
+  const uint64_t SectionSize = Section.getSize();
+  ArrayRef<uint8_t> Bytes =
+      arrayRefFromStringRef(unwrapOrError(Section.getContents()));
+
+  // For each symbol in the current section, obtain the location of each
+  // basic block.
+  for (size_t SI = 0, SE = SortedSymbols.size(); SI != SE;) {
+    // Find all symbols in the same "location" by incrementing over
+    // SI until the starting address changes. The sorted symbols were sorted
+    // by address.
+    const size_t FirstSI = SI;
+    uint64_t Start = SortedSymbols[SI].Addr;
+
+    // If the current symbol's address is the same as the previous
+    // symbol's address, then we know that the current symbol is an
+    // alias, and we skip it.
+    while (SI != SE && SortedSymbols[SI].Addr == Start) ++SI;
+
+    // End is the end of the current location, the start of the next symbol.
+    uint64_t End = SI < SE ? SortedSymbols[SI].Addr : SectionAddr + SectionSize;
+
+    // The aliases are the symbols that have the same address.
+    ArrayRef<SymbolInfoTy> Aliases = SortedSymbols.slice(FirstSI, SI - FirstSI);
+
+    uint64_t StartAddr = 0;
+    // If the symbol range does not overlap with our section,
+    // move to the next symbol.
+    if (Start >= End || End <= StartAddr) continue;
+
+    FunctionToEvaluate &Function = Functions.emplace_back();
+    Function.AddrMap = findBBAddrMap(BBAddrMaps, Start);
+
+    // Adjust the start and end addresses to be relative to the start of the
+    // section.
+    Start -= SectionAddr;
+    End -= SectionAddr;
+
+    Function.SectionAddr = SectionAddr;
+    Function.Bytes = Bytes;
+    Function.Start = Start;
+    Function.End = End;
+    Function.Aliases = Aliases;
+
+    Function.Index = Start;
+    if (SectionAddr < StartAddr)
+      Function.Index =
+          std::max<uint64_t>(Function.Index, StartAddr - SectionAddr);
+  }
+}
+
+void populateBBFreqMap(llvm_cm::BBFreqMap &BBFreqMap) {
   if (CSVFilename.empty()) return;
 
   llvm::ErrorOr<std::unique_ptr<MemoryBuffer>> FileOrErr =
@@ -452,14 +1275,22 @@ int main(int argc, char *argv[]) {
 
   cl::ParseCommandLineOptions(argc, argv, "llvm cost model tool\n");
 
+  // The worker threads check this flag instead of timeTraceProfilerEnabled(),
+  // which reports only the state of the current thread.
+  const bool TimeTraceEnabled = !TimeTraceFilename.empty();
+  if (TimeTraceEnabled)
+    timeTraceProfilerInitialize(TimeTraceGranularity, "llvm-cm");
+
   // Set up the triple and target features.
   InitializeAllTargets();
   InitializeAllTargetInfos();
   InitializeAllTargetMCs();
   InitializeAllDisassemblers();
 
-  object::OwningBinary<object::Binary> ObjBinary =
-      unwrapOrError(object::createBinary(InputFilename));
+  object::OwningBinary<object::Binary> ObjBinary = [&]() {
+    TimeTraceScope Scope("LoadObjectFile", InputFilename);
+    return unwrapOrError(object::createBinary(InputFilename));
+  }();
   object::Binary &Binary = *ObjBinary.getBinary();
   object::ObjectFile *Obj = cast<object::ObjectFile>(&Binary);
 
@@ -501,127 +1332,316 @@ int main(int argc, char *argv[]) {
                                      TargetOptions(), Reloc::Model::Static));
   assert(TM && "Unable to create target machine!");
 
-  StringMap<SmallVector<BBFreq, 20>> BBFreqMap;
-  populateBBFreqMap(BBFreqMap);
-
-  // Section information should be stored to determine whether
-  // or not the section is relevant to disassembly.
-  MapVector<SectionRef, SectionSymbolsTy> AllSymbols;
-  SectionSymbolsTy UndefinedSymbols;
-  for (const object::SymbolRef &Symbol : Obj->symbols()) {
-    auto TypeOrErr = Symbol.getType();
-    exitIf(!TypeOrErr, "failed to get symbol type");
-    if (TypeOrErr.get() != SymbolRef::ST_Function) continue;
-    Expected<StringRef> NameOrErr = Symbol.getName();
-    exitIf(!NameOrErr, "failed to get symbol name");
-
-    // If the symbol is a section symbol, then ignore it.
-    if (Obj->isELF() && getElfSymbolType(*Obj, Symbol) == ELF::STT_SECTION)
-      continue;
+  exitIf(CSVFilename.empty() == ProfileFilename.empty(),
+         "Exactly one of --csv and --profile must be specified");
+  std::unique_ptr<FrequencyProfile> Profile;
+  timeTraceProfilerBegin("ReadProfile", StringRef());
+  if (!ProfileFilename.empty()) {
+    exitIf(!WriteProfileFilename.empty(),
+           "--write_profile requires a --csv profile");
+    Profile = unwrapOrExit(FrequencyProfile::fromBinaryFile(ProfileFilename));
+  } else {
+    llvm_cm::BBFreqMap BBFreqMap;
+    populateBBFreqMap(BBFreqMap);
+    if (!WriteProfileFilename.empty()) {
+      std::error_code EC;
+      raw_fd_ostream ProfileOS(WriteProfileFilename, EC);
+      exitIf(static_cast<bool>(EC), "failed to open file " +
+                                        WriteProfileFilename + ": " +
+                                        EC.message());
+      ProfileOS << FrequencyProfile::serialize(BBFreqMap);
+      ProfileOS.close();
+      exitIf(ProfileOS.has_error(),
+             "failed to write file " + WriteProfileFilename);
+      return 0;
+    }
+    Profile = unwrapOrExit(FrequencyProfile::fromMap(BBFreqMap));
+  }
+  timeTraceProfilerEnd();
+
+  exitIf(!(HotCoverage > 0.0 && HotCoverage <= 1.0),
+         "--hot_coverage must be in the range (0, 1]");
+  std::optional<double> HotFrequencyThreshold;
+  if (HotCoverage < 1.0) {
+    // The per-function result cache stores the predictions for all basic
+    // blocks of a function, so it can't be combined with partial evaluation.
+    exitIf(!GraniteResultCacheFilename.empty(),
+           "--hot_coverage can't be used with --granite_result_cache");
+    HotFrequencyThreshold =
+        computeHotFrequencyThreshold(*Profile, HotCoverage);
+    LLVM_DEBUG(dbgs() << "Hot basic block frequency threshold: "
+                      << *HotFrequencyThreshold << "\n");
+  }
 
-    object::section_iterator SectionI = unwrapOrError(Symbol.getSection());
+  // The prediction cache is shared by the cost models of all functions.
+  std::shared_ptr<gematria::PredictionCache> PredictionCache;
+  if (EvaluationMethod == EvaluationType::Granite &&
+      GranitePredictionCacheSize > 0) {
+    PredictionCache = std::make_shared<gematria::PredictionCache>(
+        GranitePredictionCacheSize);
+  }
 
-    // If the section iterator does not point to the end of the section
-    // list, then the symbol is defined in a section.
-    if (SectionI != Obj->section_end()) {
-      AllSymbols[*SectionI].push_back(createSymbolInfo(*Obj, Symbol));
-    } else {
-      UndefinedSymbols.push_back(createSymbolInfo(*Obj, Symbol));
+  // The persistent result cache is shared by the cost models of all functions.
+  std::shared_ptr<FunctionResultCache> ResultCache;
+  if (EvaluationMethod == EvaluationType::Granite &&
+      !GraniteResultCacheFilename.empty()) {
+    llvm::ErrorOr<std::unique_ptr<MemoryBuffer>> ModelOrErr =
+        MemoryBuffer::getFile(EvaluatorFilename, /*IsText=*/false,
+                              /*RequiresNullTerminator=*/false);
+    exitIf(!ModelOrErr, "failed to open file " + EvaluatorFilename);
+    std::string Configuration;
+    raw_string_ostream ConfigurationOS(Configuration);
+    ConfigurationOS << TripleName << '\0' << CPU << '\0'
+                    << FeatureVals->getString() << '\0'
+                    << xxHash64((*ModelOrErr)->getBuffer()) << '\0'
+                    << uArchTaskNumber;
+    ConfigurationOS.flush();
+    ResultCache = std::make_shared<FunctionResultCache>(
+        GraniteResultCacheFilename, Configuration);
+    if (llvm::Error Err = ResultCache->load()) {
+      WithColor::warning(errs(), "llvm-cm")
+          << "ignoring invalid result cache file " << GraniteResultCacheFilename
+          << ": " << toString(std::move(Err)) << "\n";
     }
   }
 
-  // Sort the symbols in order of address.
-  for (std::pair<SectionRef, SectionSymbolsTy> &SortSymbols : AllSymbols)
-    llvm::stable_sort(SortSymbols.second);
-  llvm::stable_sort(UndefinedSymbols);
+  // TODO(dayannd): Implement function selection.
+  // Evaluates `Function` and passes its output to `Emit` once its latency is
+  // known. The cost model may delay this until more functions are evaluated.
+  // `Labels` is a buffer for the labels of the basic blocks of the function;
+  // it is reused across the functions evaluated by the same thread.
+  auto EvaluateFunction = [&](const FunctionToEvaluate &Function,
+                              MCDisassembler &FunctionDisAsm,
+                              CostModel &Handler,
+                              raw_svector_ostream &CommentStream,
+                              BBLabels &Labels,
+                              std::function<void(std::string)> Emit) {
+    TimeTraceScope Scope("EvaluateFunction", Function.Aliases[0].Name);
+    collectBBtoAddressLabels(Function.AddrMap,
+                             Function.SectionAddr + Function.End, Labels);
+    std::string Output;
+    raw_string_ostream OS(Output);
+    printFunctionNames(Function.Aliases, OS);
+    OS.flush();
+    Handler.evaluateFunction(
+        FunctionDisAsm, Function.SectionAddr, Function.Bytes, Function.Start,
+        Function.End, Function.Index, CommentStream, *MII, Labels,
+        Function.Aliases[0].Name, *Profile,
+        [Output = std::move(Output),
+         Emit = std::move(Emit)](double Latency) mutable {
+          raw_string_ostream OS(Output);
+          OS << "Calculated Frequency: " << Latency << "\n";
+          OS.flush();
+          Emit(std::move(Output));
+        });
+  };
 
-  DenseMap<uint64_t, BBAddrMap> BBAddrMap;
-  auto GetBBAddrMapping = [&]() {
-    BBAddrMap.clear();
-    if (const auto *Elf = dyn_cast<object::ELFObjectFileBase>(Obj)) {
-      auto BBAddrMappingOrErr = Elf->readBBAddrMap();
-      exitIf(!BBAddrMappingOrErr, "failed to read basic block address mapping");
-      for (auto &BBAddr : *BBAddrMappingOrErr) {
-        BBAddrMap.try_emplace(BBAddr.Addr, std::move(BBAddr));
+  unsigned NumWorkers = NumJobs;
+  if (NumWorkers == 0)
+    NumWorkers = std::max(1u, std::thread::hardware_concurrency());
+
+  // The GRANITE model is loaded once, and its inference workers are shared by
+  // the cost models of all worker threads.
+  std::shared_ptr<GraniteBackend> Granite;
+  if (EvaluationMethod == EvaluationType::Granite) {
+    const unsigned NumInferenceWorkers =
+        GraniteInferenceWorkers == 0
+            ? NumWorkers
+            : std::min<unsigned>(GraniteInferenceWorkers, NumWorkers);
+    Granite = GraniteBackend::create(NumInferenceWorkers, PredictionCache);
+  }
+
+  // With a single job, one cost model is reused for all functions; this also
+  // avoids loading the GRANITE model for each function. It is flushed after
+  // all sections are evaluated, so that cross-function batches may span
+  // sections.
+  std::unique_ptr<CostModel> MainHandler;
+  SmallString<40> MainComments;
+  raw_svector_ostream MainCommentStream(MainComments);
+  BBLabels MainLabels;
+
+  // The disassembler and the cost model of a worker thread. They are created
+  // by the first thread that uses the state, and they are kept for the next
+  // sections.
+  struct WorkerState {
+    std::unique_ptr<MCContext> Ctx;
+    std::unique_ptr<MCObjectFileInfo> MOFI;
+    std::unique_ptr<MCDisassembler> DisAsm;
+    std::unique_ptr<CostModel> Handler;
+    SmallString<40> Comments;
+    BBLabels Labels;
+  };
+  std::vector<WorkerState> WorkerStates(NumWorkers > 1 ? NumWorkers : 0);
+
+  // Evaluates `Functions` and prints their outputs in the order of the
+  // functions.
+  auto EvaluateFunctions = [&](ArrayRef<FunctionToEvaluate> Functions) {
+    if (Functions.empty()) return;
+    if (NumWorkers <= 1) {
+      if (MainHandler == nullptr) {
+        MainHandler = createCostModel(TM.get(), Granite, ResultCache,
+                                      HotFrequencyThreshold);
       }
+      for (const FunctionToEvaluate &Function : Functions) {
+        EvaluateFunction(Function, *DisAsm, *MainHandler, MainCommentStream,
+                         MainLabels,
+                         [](std::string Output) { outs() << Output; });
+      }
+      return;
     }
-  };
 
-  GetBBAddrMapping();
-
-  // Begin iterating over the sections. For each section, get the symbols,
-  // instructions and basic blocks and calculate the weighted
-  // frequency of each basic block.
-  for (const object::SectionRef &Section :
-       getToolSectionFilter(*Obj, nullptr)) {
-    if ((!Section.isText() || Section.isVirtual())) continue;
-    const uint64_t SectionAddr = Section.getAddress();
-    const uint64_t SectionSize = Section.getSize();
-    if (!SectionSize) continue;
-    // Get all the symbols in the section - these were sorted earlier.
-    SectionSymbolsTy &SortedSymbols = AllSymbols[Section];
-
-    ArrayRef<uint8_t> Bytes =
-        arrayRefFromStringRef(unwrapOrError(Section.getContents()));
-    SmallString<40> Comments;
-    raw_svector_ostream CommentStream(Comments);
-
-    // For each symbol in the current section, disassemble the instructions
-    // and obtain the location of each basic block.
-    for (size_t SI = 0, SE = SortedSymbols.size(); SI != SE;) {
-      // Find all symbols in the same "location" by incrementing over
-      // SI until the starting address changes. The sorted symbols were sorted
-      // by address.
-      const size_t FirstSI = SI;
-      uint64_t Start = SortedSymbols[SI].Addr;
-
-      // If the current symbol's address is the same as the previous
-      // symbol's address, then we know that the current symbol is an
-      // alias, and we skip it.
-      while (SI != SE && SortedSymbols[SI].Addr == Start) ++SI;
-
-      // End is the end of the current location, the start of the next symbol.
-      uint64_t End =
-          SI < SE ? SortedSymbols[SI].Addr : SectionAddr + SectionSize;
-
-      // The aliases are the symbols that have the same address.
-      ArrayRef<SymbolInfoTy> Aliases(&SortedSymbols[FirstSI], SI - FirstSI);
-
-      uint64_t StartAddr = 0;
-      // If the symbol range does not overlap with our section,
-      // move to the next symbol.
-      if (Start >= End || End <= StartAddr) continue;
-
-      // Adjust the start and end addresses to be relative to the start of the
-      // section.
-      Start -= SectionAddr;
-      End -= SectionAddr;
-
-      std::unordered_map<uint64_t, std::vector<uint64_t>> BBtoAddressLabels;
-      collectBBtoAddressLabels(BBAddrMap, SectionAddr, Start, End,
-                               BBtoAddressLabels);
-
-      // TODO(dayannd): Implement function selection.
-      printFunctionNames(Aliases);
-
-      uint64_t Index = Start;
-      if (SectionAddr < StartAddr)
-        Index = std::max<uint64_t>(Index, StartAddr - SectionAddr);
-
-      StringRef CurrSymbolName = Aliases[0].Name;
-
-      std::unique_ptr<CostModel> Handler;
-
-      if (EvaluationMethod == EvaluationType::Granite) {
-        Handler = GraniteCostModel::create(TM.get());
-      } else if (EvaluationMethod == EvaluationType::Counter) {
-        Handler = CountCostModel::create();
+    // Each worker has its own disassembler and cost model, and it takes the
+    // functions one by one from a shared counter. The output of each function
+    // is buffered, and the main thread prints the buffers in the order of the
+    // symbols as soon as they are complete.
+    std::vector<std::string> Outputs(Functions.size());
+    std::vector<bool> IsDone(Functions.size(), false);
+    std::mutex Mutex;
+    std::condition_variable FunctionDone;
+    std::atomic<size_t> NextFunction = 0;
+    auto RunWorker = [&](WorkerState &State) {
+      if (TimeTraceEnabled)
+        timeTraceProfilerInitialize(TimeTraceGranularity, "llvm-cm");
+      if (State.Handler == nullptr) {
+        State.Ctx = std::make_unique<MCContext>(
+            Triple(TripleName), AsmInfo.get(), MRI.get(), SubInfo.get());
+        State.MOFI.reset(TheTarget->createMCObjectFileInfo(*State.Ctx, false));
+        State.Ctx->setObjectFileInfo(State.MOFI.get());
+        State.DisAsm.reset(
+            TheTarget->createMCDisassembler(*SubInfo, *State.Ctx));
+        assert(State.DisAsm && "Unable to create disassembler!");
+        State.Handler = createCostModel(TM.get(), Granite, ResultCache,
+                                        HotFrequencyThreshold);
+      }
+      raw_svector_ostream CommentStream(State.Comments);
+      auto EmitFunction = [&](size_t I, std::string Output) {
+        {
+          std::lock_guard<std::mutex> Lock(Mutex);
+          Outputs[I] = std::move(Output);
+          IsDone[I] = true;
+        }
+        FunctionDone.notify_all();
+      };
+      for (size_t I = NextFunction++; I < Functions.size();
+           I = NextFunction++) {
+        EvaluateFunction(Functions[I], *State.DisAsm, *State.Handler,
+                         CommentStream, State.Labels,
+                         [&EmitFunction, I](std::string Output) {
+                           EmitFunction(I, std::move(Output));
+                         });
+      }
+      State.Handler->flush();
+      if (TimeTraceEnabled) timeTraceProfilerFinishThread();
+    };
+    const size_t NumThreads = std::min<size_t>(NumWorkers, Functions.size());
+    std::vector<std::thread> Workers;
+    Workers.reserve(NumThreads);
+    for (size_t I = 0; I < NumThreads; ++I)
+      Workers.emplace_back(RunWorker, std::ref(WorkerStates[I]));
+    for (size_t I = 0; I < Functions.size(); ++I) {
+      {
+        std::unique_lock<std::mutex> Lock(Mutex);
+        FunctionDone.wait(Lock, [&]() { return IsDone[I]; });
+      }
+      std::string Output;
+      {
+        std::lock_guard<std::mutex> Lock(Mutex);
+        Output = std::move(Outputs[I]);
       }
-      assert(Handler && "A valid Handler type must be specified!");
+      outs() << Output;
+    }
+    for (std::thread &Worker : Workers) Worker.join();
+  };
 
-      Handler->getLatency(*DisAsm, SectionAddr, Bytes, Start, End, Index,
-                          CommentStream, *MII, BBtoAddressLabels,
-                          CurrSymbolName, BBFreqMap);
+  if (Streaming) {
+    // Each text section is processed separately: its symbols and its BB
+    // address maps are read, its functions are evaluated, and all of them are
+    // released before the next section. The functions reference the data of
+    // the section only until they are evaluated, so the peak memory depends
+    // on the largest section, not on the whole binary.
+    std::vector<FunctionToEvaluate> Functions;
+    for (const object::SectionRef &Section :
+         getToolSectionFilter(*Obj, nullptr)) {
+      if ((!Section.isText() || Section.isVirtual())) continue;
+      const std::vector<BBAddrMap> BBAddrMaps =
+          readSortedBBAddrMaps(*Obj, Section.getIndex());
+      if (!Section.getSize()) continue;
+
+      SectionSymbolsTy SortedSymbols;
+      timeTraceProfilerBegin("ReadSymbols", StringRef());
+      forEachFunctionSymbol(
+          *Obj, [&](const SymbolRef &Symbol, section_iterator SectionI) {
+            if (SectionI != Obj->section_end() && *SectionI == Section)
+              SortedSymbols.push_back(createSymbolInfo(*Obj, Symbol));
+          });
+      llvm::stable_sort(SortedSymbols);
+      timeTraceProfilerEnd();
+
+      Functions.clear();
+      timeTraceProfilerBegin("CollectFunctions", StringRef());
+      collectSectionFunctions(Section, SortedSymbols, BBAddrMaps, Functions);
+      timeTraceProfilerEnd();
+      EvaluateFunctions(Functions);
+    }
+  } else {
+    // Section information should be stored to determine whether
+    // or not the section is relevant to disassembly.
+    MapVector<SectionRef, SectionSymbolsTy> AllSymbols;
+    timeTraceProfilerBegin("ReadSymbols", StringRef());
+    forEachFunctionSymbol(
+        *Obj, [&](const SymbolRef &Symbol, section_iterator SectionI) {
+          // If the section iterator does not point to the end of the section
+          // list, then the symbol is defined in a section.
+          if (SectionI != Obj->section_end())
+            AllSymbols[*SectionI].push_back(createSymbolInfo(*Obj, Symbol));
+        });
+
+    // Sort the symbols in order of address.
+    for (std::pair<SectionRef, SectionSymbolsTy> &SortSymbols : AllSymbols)
+      llvm::stable_sort(SortSymbols.second);
+    timeTraceProfilerEnd();
+
+    const std::vector<BBAddrMap> BBAddrMaps =
+        readSortedBBAddrMaps(*Obj, std::nullopt);
+
+    // Begin iterating over the sections. For each section, get the symbols and
+    // the locations of the basic blocks of each function. The functions are
+    // disassembled and evaluated below.
+    std::vector<FunctionToEvaluate> Functions;
+    timeTraceProfilerBegin("CollectFunctions", StringRef());
+    for (const object::SectionRef &Section :
+         getToolSectionFilter(*Obj, nullptr)) {
+      if ((!Section.isText() || Section.isVirtual())) continue;
+      if (!Section.getSize()) continue;
+      collectSectionFunctions(Section, AllSymbols[Section], BBAddrMaps,
+                              Functions);
     }
+    timeTraceProfilerEnd();
+    EvaluateFunctions(Functions);
+  }
+  if (MainHandler != nullptr) MainHandler->flush();
+
+  if (ResultCache != nullptr) {
+    LLVM_DEBUG(dbgs() << "Result cache: " << ResultCache->numHits()
+                      << " hits, " << ResultCache->numMisses()
+                      << " misses\n");
+    TimeTraceScope Scope("WriteResultCache");
+    if (llvm::Error Err = ResultCache->write()) {
+      WithColor::warning(errs(), "llvm-cm") << toString(std::move(Err)) << "\n";
+    }
+  }
+
+  if (PredictionCache != nullptr) {
+    LLVM_DEBUG(dbgs() << "Prediction cache: " << PredictionCache->num_hits()
+                      << " hits, " << PredictionCache->num_misses()
+                      << " misses, " << PredictionCache->size()
+                      << " entries\n");
+  }
+
+  if (TimeTraceEnabled) {
+    if (llvm::Error Err =
+            timeTraceProfilerWrite(TimeTraceFilename, InputFilename))
+      error(std::move(Err));
+    timeTraceProfilerCleanup();
   }
 }